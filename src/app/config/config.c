@@ -69,6 +69,7 @@
 #include "app/main/main.h"
 #include "app/main/subsysmgr.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
 #include "core/or/channel.h"
@@ -78,6 +79,7 @@
 #include "core/or/circuitstats.h"
 #include "core/or/connection_edge.h"
 #include "core/or/dos.h"
+#include "core/or/or_metrics.h"
 #include "core/or/policies.h"
 #include "core/or/relay.h"
 #include "core/or/scheduler.h"
@@ -95,6 +97,7 @@
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -360,6 +363,7 @@ static const config_var_t option_vars_[] = {
   V(CircuitsAvailableTimeout,    INTERVAL, "0"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-1.0"), /*negative:'Use default'*/
+  V(CircuitPriorityLazyScaling,  BOOL,    "0"),
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
 #if defined(HAVE_MODULE_RELAY) || defined(TOR_UNIT_TESTS)
   /* The unit tests expect the ClientOnly default to be 0. */
@@ -391,6 +395,8 @@ static const config_var_t option_vars_[] = {
   V(CookieAuthFileGroupReadable, BOOL,     "0"),
   V(CookieAuthFile,              FILENAME, NULL),
   V(CountPrivateBandwidth,       BOOL,     "0"),
+  V_IMMUTABLE(CPUWorkerReplyBatch,      POSINT, "64"),
+  V_IMMUTABLE(CPUWorkerReplyWindowUsec, POSINT, "0"),
   VAR_IMMUTABLE("DataDirectory", FILENAME, DataDirectory_option, NULL),
   V(DataDirectoryGroupReadable,  BOOL,     "0"),
   V(DisableOOSCheck,             BOOL,     "1"),
@@ -632,6 +638,7 @@ static const config_var_t option_vars_[] = {
   V(RejectPlaintextPorts,        CSV,      ""),
   V(RelayBandwidthBurst,         MEMUNIT,  "0"),
   V(RelayBandwidthRate,          MEMUNIT,  "0"),
+  V(RelayCryptoPipeline,         BOOL,     "0"),
   V(RendPostPeriod,              INTERVAL, "1 hour"),
   V(RephistTrackTime,            INTERVAL, "24 hours"),
   V_IMMUTABLE(RunAsDaemon,       BOOL,     "0"),
@@ -651,6 +658,7 @@ static const config_var_t option_vars_[] = {
   OBSOLETE("SchedulerLowWaterMark__"),
   OBSOLETE("SchedulerHighWaterMark__"),
   OBSOLETE("SchedulerMaxFlushCells__"),
+  V(KISTBatchedSampling,         BOOL,     "0"),
   V(KISTSchedRunInterval,        MSEC_INTERVAL, "0 msec"),
   V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
   V(Schedulers,                  CSV,      "KIST,KISTLite,Vanilla"),
@@ -680,6 +688,7 @@ static const config_var_t option_vars_[] = {
   VAR("UseEntryGuards",          BOOL,     UseEntryGuards_option, "1"),
   OBSOLETE("UseEntryGuardsAsDirGuards"),
   V(UseGuardFraction,            AUTOBOOL, "auto"),
+  V_IMMUTABLE(UseIOUring,        BOOL,     "0"),
   V(UseMicrodescriptors,         AUTOBOOL, "auto"),
   OBSOLETE("UseNTorHandshake"),
   V_IMMUTABLE(User,              STRING,   NULL),
@@ -1444,6 +1453,11 @@ options_act_once_on_startup(char **msg_out)
   /* This has to come up after libevent is initialized. */
   control_initialize_event_queue();
 
+  /* So does this, and it has to come before we open any connections that
+   * could use it.  If it fails, we carry on with Libevent. */
+  if (options->UseIOUring)
+    connection_uring_init();
+
   /*
    * Initialize the scheduler - this has to come after
    * options_init_from_torrc() sets up libevent - why yes, that seems
@@ -2236,6 +2250,9 @@ options_act,(const or_options_t *old_options))
     log_warn(LD_BUG,"Error parsing already-validated policy options.");
     return -1;
   }
+  /* Which nodes we can choose, and how we weight them, depends on our
+   * options. */
+  node_select_tables_clear();
 
   if (init_control_cookie_authentication(options->CookieAuthentication) < 0) {
     log_warn(LD_CONFIG,"Error creating control cookie authentication file.");
@@ -2399,6 +2416,10 @@ options_act,(const or_options_t *old_options))
   if (print_notice)
     options_act_relay_stats_msg();
 
+  /* Relay metrics cost a little on hot paths: only collect them when there
+   * is a MetricsPort to read them from. */
+  or_metrics_set_enabled(options->MetricsPort_set);
+
   if (options_act_relay_desc(old_options) < 0)
     return -1;
 
@@ -3280,6 +3301,12 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
   }
 #endif /* !defined(HAVE_SYS_UN_H) */
 
+  if (options->UseIOUring && options->Sandbox) {
+    /* The kernel doesn't run io_uring requests through our seccomp
+     * filter, so the sandbox doesn't allow io_uring at all. */
+    REJECT("UseIOUring is not compatible with Sandbox.");
+  }
+
   /* Set UseEntryGuards from the configured value, before we check it below.
    * We change UseEntryGuards when it's incompatible with other options,
    * but leave UseEntryGuards_option with the original value.
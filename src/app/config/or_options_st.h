@@ -426,6 +426,15 @@ struct or_options_t {
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** How many cpuworker replies should we handle at once, at most?  0 for
+   * no limit. */
+  int CPUWorkerReplyBatch;
+  /** After handling some cpuworker replies, how many microseconds should we
+   * wait for more before the workers can wake us up again? */
+  int CPUWorkerReplyWindowUsec;
+  /** If true, and we are a relay, do relay cell crypto for the circuits
+   * that pass through us on the cpuworker threads. */
+  int RelayCryptoPipeline;
   struct config_line_t *RendConfigLines; /**< List of configuration lines
                                           * for rendezvous services. */
   struct config_line_t *HidServAuth; /**< List of configuration lines for
@@ -561,6 +570,9 @@ struct or_options_t {
   } SafeLogging_;
 
   int Sandbox; /**< Boolean: should sandboxing be enabled? */
+  /** Boolean: should we do socket reads and writes through io_uring, where
+   * we can? */
+  int UseIOUring;
   int SafeSocks; /**< Boolean: should we outright refuse application
                   * connections that use socks4 or socks5-with-local-dns? */
   int ProtocolWarnings; /**< Boolean: when other parties screw up the Tor
@@ -852,6 +864,10 @@ struct or_options_t {
    */
   double CircuitPriorityHalflife;
 
+  /** If true, new channels store their circuits' weighted cell counts in
+   * a form that never needs to be rescaled (ewma_lazy_policy). */
+  int CircuitPriorityLazyScaling;
+
   /** Set to true if the TestingTorNetwork configuration option is set.
    * This is used so that options_validate() has a chance to realize that
    * the defaults have changed. */
@@ -1008,6 +1024,11 @@ struct or_options_t {
    */
   int NoExec;
 
+  /** If true, have the KIST scheduler ask the kernel about all of its
+   * sockets with one netlink dump per run, rather than with system calls on
+   * each socket. */
+  int KISTBatchedSampling;
+
   /** Have the KIST scheduler run every X milliseconds. If less than zero, do
    * not use the KIST scheduler but use the old vanilla scheduler instead. If
    * zero, do what the consensus says and fall back to using KIST as if this is
@@ -20,6 +20,7 @@
 #include "app/main/shutdown.h"
 #include "app/main/subsysmgr.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/mainloop_pubsub.h"
@@ -31,6 +32,7 @@
 #include "core/or/command.h"
 #include "core/or/connection_or.h"
 #include "core/or/relay.h"
+#include "core/or/scheduler.h"
 #include "core/or/status.h"
 #include "feature/api/tor_api.h"
 #include "feature/api/tor_api_internal.h"
@@ -422,6 +424,9 @@ dumpstats(int severity)
         (int) (get_bytes_written()/elapsed));
   }
 
+  connection_uring_log_stats(severity);
+  scheduler_log_stats(severity);
+
   tor_log(severity, LD_NET, "--------------- Dumping memory information:");
   dumpmemusage(severity);
 
@@ -888,6 +893,7 @@ sandbox_init_filter(void)
   OPEN_CACHEDIR_SUFFIX("cached-microdesc-consensus", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdescs", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdescs.new", ".tmp");
+  OPEN_CACHEDIR_SUFFIX("cached-microdescs.idx", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-descriptors", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-descriptors.new", ".tmp");
   OPEN_CACHEDIR("cached-descriptors.tmp.tmp");
@@ -960,6 +966,7 @@ sandbox_init_filter(void)
   RENAME_CACHEDIR_SUFFIX("cached-microdescs", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs.new", ".tmp");
+  RENAME_CACHEDIR_SUFFIX("cached-microdescs.idx", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors.new", ".tmp");
@@ -1188,6 +1195,12 @@ run_tor_main_loop(void)
     log_warn(LD_DIR,
              "Couldn't load all cached v3 certificates. Starting anyway.");
   }
+  if (server_mode(get_options()) || dir_server_mode(get_options())) {
+    /* launch cpuworkers. Need to do this *after* we've read the onion key,
+     * and before we load our cached directory information, so that we can
+     * parse it on the cpuworkers. */
+    cpu_init();
+  }
   if (router_reload_consensus_networkstatus()) {
     return -1;
   }
@@ -1201,10 +1214,6 @@ run_tor_main_loop(void)
   const time_t now = time(NULL);
   directory_info_has_arrived(now, 1, 0);
 
-  if (server_mode(get_options()) || dir_server_mode(get_options())) {
-    /* launch cpuworkers. Need to do this *after* we've read the onion key. */
-    cpu_init();
-  }
   consdiffmgr_enable_background_compression();
 
   /* Setup shared random protocol subsystem. */
@@ -18,6 +18,7 @@
 #include "app/main/shutdown.h"
 #include "app/main/subsysmgr.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/mainloop/mainloop_pubsub.h"
 #include "core/or/channeltls.h"
 #include "core/or/circuitlist.h"
@@ -25,6 +26,7 @@
 #include "core/or/circuitpadding.h"
 #include "core/or/connection_edge.h"
 #include "core/or/dos.h"
+#include "core/or/relay.h"
 #include "core/or/scheduler.h"
 #include "feature/client/addressmap.h"
 #include "feature/client/bridges.h"
@@ -130,7 +132,9 @@ tor_free_all(int postfork)
   channel_tls_free_all();
   channel_free_all();
   connection_free_all();
+  connection_uring_free_all();
   connection_edge_free_all();
+  cell_pools_free_all();
   scheduler_free_all();
   nodelist_free_all();
   microdesc_free_all();
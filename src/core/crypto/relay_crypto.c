@@ -97,6 +97,27 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in)
   crypto_cipher_crypt_inplace(cipher, (char*) in, CELL_PAYLOAD_SIZE);
 }
 
+/** Apply <b>cipher</b> to CELL_PAYLOAD_SIZE bytes of each of the
+ * <b>n_payloads</b> payloads in <b>payloads</b> (in place), in order.
+ *
+ * This gives the same result as calling relay_crypt_one_payload() on each
+ * payload in turn.  (We tried gathering the payloads into one buffer so that
+ * we could make a single cipher call for all of them, but copying the cells
+ * in and out costs more than the cipher calls that it saves.)
+ */
+void
+relay_crypt_payloads(crypto_cipher_t *cipher, uint8_t **payloads,
+                     int n_payloads)
+{
+  int i;
+
+  tor_assert(n_payloads >= 0);
+
+  for (i = 0; i < n_payloads; ++i)
+    crypto_cipher_crypt_inplace(cipher, (char *) payloads[i],
+                                CELL_PAYLOAD_SIZE);
+}
+
 /** Return the sendme_digest within the <b>crypto</b> object. */
 uint8_t *
 relay_crypto_get_sendme_digest(relay_crypto_t *crypto)
@@ -185,27 +206,110 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
       log_fn(LOG_PROTOCOL_WARN, LD_OR,
              "Incoming cell at client not recognized. Closing.");
       return -1;
-    } else {
-      relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
+    }
+  }
+
+  /* We're not the origin: we only have one layer to handle. */
+  relay_crypto_crypt_or_cell(&TO_OR_CIRCUIT(circ)->crypto, cell,
+                             cell_direction, recognized);
+  return 0;
+}
+
+/** Do the en/decryption for <b>cell</b> travelling in <b>cell_direction</b>
+ * through a relay whose keys for this circuit are in <b>crypto</b>.
+ *
+ * If cell_direction == CELL_DIRECTION_IN, encrypt one layer.  The cell is
+ * never recognized.
+ *
+ * If cell_direction == CELL_DIRECTION_OUT, decrypt one layer, and set
+ * *<b>recognized</b> to 1 if the cell is for us.
+ *
+ * This touches nothing but <b>crypto</b> and <b>cell</b>, so it is safe to
+ * call from a worker thread as long as nobody else is using <b>crypto</b>.
+ */
+void
+relay_crypto_crypt_or_cell(relay_crypto_t *crypto, cell_t *cell,
+                           cell_direction_t cell_direction,
+                           char *recognized)
+{
+  relay_header_t rh;
+
+  if (cell_direction == CELL_DIRECTION_IN) {
+    /* We're in the middle. Encrypt one layer. */
+    relay_crypt_one_payload(crypto->b_crypto, cell->payload);
+    return;
+  }
+
+  /* We're in the middle. Decrypt one layer. */
+  relay_crypt_one_payload(crypto->f_crypto, cell->payload);
+
+  relay_header_unpack(&rh, cell->payload);
+  if (rh.recognized == 0) {
+    /* it's possibly recognized. have to check digest to be sure. */
+    if (relay_digest_matches(crypto->f_digest, cell)) {
+      *recognized = 1;
+    }
+  }
+}
+
+/** As relay_crypto_crypt_or_cell(), but for the <b>n_cells</b> cells in
+ * <b>cells</b>, all travelling in <b>cell_direction</b>, in order.
+ *
+ * <b>recognized</b> must have room for <b>n_cells</b> entries; we set each
+ * one to 1 if the corresponding cell is for us, and to 0 otherwise.  If
+ * <b>recognized_digests</b> is provided, it must have room for DIGEST_LEN
+ * bytes per cell: for each recognized cell, we store there the running
+ * forward digest right after that cell, as relay_crypto_record_sendme_digest()
+ * would have seen it.
+ *
+ * The cipher work is batched with relay_crypt_payloads().  The digest work
+ * can't be: each cell's integrity check depends on the running digest of
+ * all the cells before it.
+ */
+void
+relay_crypto_crypt_or_cells(relay_crypto_t *crypto, cell_t **cells,
+                            int n_cells, cell_direction_t cell_direction,
+                            char *recognized, uint8_t *recognized_digests)
+{
+  uint8_t *payloads[RELAY_CRYPT_BATCH_MAX];
+  relay_header_t rh;
+  int i, j, n;
+
+  tor_assert(crypto);
+  tor_assert(n_cells >= 0);
+  tor_assert(recognized);
+
+  memset(recognized, 0, n_cells);
+
+  for (i = 0; i < n_cells; i += n) {
+    n = MIN(n_cells - i, RELAY_CRYPT_BATCH_MAX);
+    for (j = 0; j < n; ++j)
+      payloads[j] = cells[i+j]->payload;
+
+    if (cell_direction == CELL_DIRECTION_IN) {
       /* We're in the middle. Encrypt one layer. */
-      relay_crypt_one_payload(crypto->b_crypto, cell->payload);
+      relay_crypt_payloads(crypto->b_crypto, payloads, n);
+      continue;
     }
-  } else /* cell_direction == CELL_DIRECTION_OUT */ {
-    /* We're in the middle. Decrypt one layer. */
-    relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
 
-    relay_crypt_one_payload(crypto->f_crypto, cell->payload);
+    /* We're in the middle. Decrypt one layer. */
+    relay_crypt_payloads(crypto->f_crypto, payloads, n);
 
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
+    for (j = 0; j < n; ++j) {
+      relay_header_unpack(&rh, cells[i+j]->payload);
+      if (rh.recognized != 0)
+        continue;
       /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(crypto->f_digest, cell)) {
-        *recognized = 1;
-        return 0;
+      if (relay_digest_matches(crypto->f_digest, cells[i+j])) {
+        recognized[i+j] = 1;
+        if (recognized_digests) {
+          crypto_digest_get_digest(crypto->f_digest,
+                               (char *) recognized_digests + (i+j)*DIGEST_LEN,
+                               DIGEST_LEN);
+        }
       }
     }
   }
-  return 0;
 }
 
 /**
@@ -0,0 +1,432 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file relay_crypto_pipeline.c
+ * @brief Hand relay cell crypto on or_circuit_t to the cpuworker threads.
+ *
+ * Normally, relay cells are en/decrypted on the main thread, as soon as they
+ * arrive in circuit_receive_relay_cell() or are packaged in
+ * circuit_package_relay_cell().  On a busy relay, this AES-CTR and running
+ * digest work is enough to keep one core busy.  When RelayCryptoPipeline is
+ * set, we instead queue the cells of each or_circuit_t here, and hand them in
+ * batches to the cpuworker threadpool.
+ *
+ * The AES counters and running digests of a circuit only make sense if cells
+ * are crypted in exactly the order in which they are relayed.  We guarantee
+ * that as follows:
+ *
+ *   - Each circuit has at most one job with the workers at a time.  While it
+ *     does, every new cell for that circuit (including cells that we
+ *     originate) goes onto the circuit's pending queue, even if the pipeline
+ *     has since been disabled.
+ *   - When a job comes back, we finish processing its cells in order on the
+ *     main thread (circuit_receive_relay_cell_crypted() and
+ *     circuit_package_relay_cell_crypted()), and only then send the next
+ *     batch of pending cells to the workers.
+ *
+ * The main thread never touches the circuit's relay_crypto_t while a job is
+ * out.  Anything it would have read from the running digests (the SENDME
+ * digests) is computed by the worker and carried back in the
+ * relay_crypto_cell_t.
+ *
+ * If a circuit is freed while its job is with a worker, the job takes
+ * ownership of the circuit's keys, and frees them when it comes back.
+ **/
+
+#define RELAY_CRYPTO_PIPELINE_PRIVATE
+
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/crypto/relay_crypto_pipeline.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/circuitlist.h"
+#include "core/or/relay.h"
+#include "core/or/sendme.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/evloop/workqueue.h"
+
+#include "core/or/cell_st.h"
+#include "core/or/or_circuit_st.h"
+#include "core/or/relay_crypto_st.h"
+
+/** How many cells have gone through the pipeline since we started? */
+static uint64_t stats_n_pipelined_cells = 0;
+/** How many jobs have we handed to the workers since we started? */
+static uint64_t stats_n_pipelined_jobs = 0;
+
+static void relay_crypto_pipeline_launch(or_circuit_t *circ);
+
+/** Return true iff new relay cells on or_circuit_t should be crypted by the
+ * cpuworker threads. */
+int
+relay_crypto_pipeline_is_enabled(void)
+{
+  return get_options()->RelayCryptoPipeline && cpuworker_is_initialized();
+}
+
+/** Return true iff <b>circ</b> has cells in the pipeline.  While this is
+ * true, all crypto for <b>circ</b> must go through the pipeline. */
+int
+relay_crypto_pipeline_circ_is_busy(const or_circuit_t *circ)
+{
+  return circ->crypto_pipeline != NULL;
+}
+
+/** Allocate and return a new job that will use the keys in <b>crypto</b>.
+ * The job does not own the keys. */
+relay_crypto_job_t *
+relay_crypto_job_new(const relay_crypto_t *crypto)
+{
+  relay_crypto_job_t *job = tor_malloc_zero(sizeof(relay_crypto_job_t));
+  memcpy(&job->crypto, crypto, sizeof(job->crypto));
+  TOR_SIMPLEQ_INIT(&job->cells);
+  return job;
+}
+
+/** Append <b>rcell</b> to the end of <b>job</b>.  The job takes ownership
+ * of it. */
+void
+relay_crypto_job_add_cell(relay_crypto_job_t *job,
+                          relay_crypto_cell_t *rcell)
+{
+  TOR_SIMPLEQ_INSERT_TAIL(&job->cells, rcell, next);
+  ++job->n_cells;
+}
+
+/** Release all storage held by <b>job</b>, including its keys if it owns
+ * them. */
+void
+relay_crypto_job_free_(relay_crypto_job_t *job)
+{
+  relay_crypto_cell_t *rcell;
+  if (!job)
+    return;
+  while ((rcell = TOR_SIMPLEQ_FIRST(&job->cells))) {
+    TOR_SIMPLEQ_REMOVE_HEAD(&job->cells, next);
+    memwipe(rcell, 0, sizeof(*rcell));
+    tor_free(rcell);
+  }
+  if (job->owns_crypto)
+    relay_crypto_clear(&job->crypto);
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+
+/** Decrypt the <b>n</b> outbound cells in <b>rcells</b> with the keys in
+ * <b>crypto</b>, and note which ones are for us. */
+static void
+relay_crypto_job_decrypt_outbound(relay_crypto_t *crypto,
+                                  relay_crypto_cell_t **rcells, int n)
+{
+  cell_t *cells[RELAY_CRYPT_BATCH_MAX];
+  char recognized[RELAY_CRYPT_BATCH_MAX];
+  uint8_t digests[RELAY_CRYPT_BATCH_MAX * DIGEST_LEN];
+  int i;
+
+  tor_assert(n <= RELAY_CRYPT_BATCH_MAX);
+
+  for (i = 0; i < n; ++i)
+    cells[i] = &rcells[i]->cell;
+  relay_crypto_crypt_or_cells(crypto, cells, n, CELL_DIRECTION_OUT,
+                              recognized, digests);
+  for (i = 0; i < n; ++i) {
+    if (recognized[i]) {
+      rcells[i]->recognized = 1;
+      memcpy(rcells[i]->sendme_digest, digests + i*DIGEST_LEN, DIGEST_LEN);
+    }
+  }
+}
+
+/** Do the crypto for every cell in <b>job</b>, in order.  Touches nothing but
+ * the job and its keys, so it is safe to call from a worker thread.
+ *
+ * Outbound cells only touch the forward keys, and inbound and originated
+ * cells only touch the backward keys, so we can batch each direction
+ * separately as long as we keep the order within it. */
+void
+relay_crypto_job_run(relay_crypto_job_t *job)
+{
+  relay_crypto_t *crypto = &job->crypto;
+  relay_crypto_cell_t *rcell;
+  relay_crypto_cell_t *fwd[RELAY_CRYPT_BATCH_MAX];
+  uint8_t *bwd[RELAY_CRYPT_BATCH_MAX];
+  int n_fwd = 0, n_bwd = 0;
+
+  TOR_SIMPLEQ_FOREACH(rcell, &job->cells, next) {
+    switch (rcell->op) {
+      case RELAY_CRYPTO_OP_DECRYPT_OUTBOUND:
+        fwd[n_fwd++] = rcell;
+        break;
+      case RELAY_CRYPTO_OP_ORIGINATE:
+        relay_set_digest(crypto->b_digest, &rcell->cell);
+        if (rcell->want_sendme_digest) {
+          crypto_digest_get_digest(crypto->b_digest,
+                                   (char *) rcell->sendme_digest,
+                                   sizeof(rcell->sendme_digest));
+        }
+        FALLTHROUGH;
+      case RELAY_CRYPTO_OP_ENCRYPT_INBOUND:
+        bwd[n_bwd++] = rcell->cell.payload;
+        break;
+      default:
+        tor_assert_nonfatal_unreached_once();
+        break;
+    }
+    if (n_fwd == RELAY_CRYPT_BATCH_MAX) {
+      relay_crypto_job_decrypt_outbound(crypto, fwd, n_fwd);
+      n_fwd = 0;
+    }
+    if (n_bwd == RELAY_CRYPT_BATCH_MAX) {
+      relay_crypt_payloads(crypto->b_crypto, bwd, n_bwd);
+      n_bwd = 0;
+    }
+  }
+
+  if (n_fwd)
+    relay_crypto_job_decrypt_outbound(crypto, fwd, n_fwd);
+  if (n_bwd)
+    relay_crypt_payloads(crypto->b_crypto, bwd, n_bwd);
+}
+
+/** Worker-thread function: run a relay_crypto_job_t. */
+static workqueue_reply_t
+relay_crypto_pipeline_threadfn(void *state_, void *work_)
+{
+  (void) state_;
+  relay_crypto_job_run(work_);
+  return WQ_RPL_REPLY;
+}
+
+/** Finish processing a single cell from a job that came back for
+ * <b>circ</b>. */
+static void
+relay_crypto_pipeline_finish_cell(or_circuit_t *circ,
+                                  relay_crypto_cell_t *rcell)
+{
+  circuit_t *c = TO_CIRCUIT(circ);
+  int reason;
+
+  if (rcell->op == RELAY_CRYPTO_OP_ORIGINATE) {
+    circuit_package_relay_cell_crypted(&rcell->cell, circ,
+                          rcell->on_stream,
+                          rcell->want_sendme_digest ?
+                          rcell->sendme_digest : NULL,
+                          rcell->is_data);
+    return;
+  }
+
+  const cell_direction_t dir = (rcell->op == RELAY_CRYPTO_OP_DECRYPT_OUTBOUND)
+    ? CELL_DIRECTION_OUT : CELL_DIRECTION_IN;
+  reason = circuit_receive_relay_cell_crypted(&rcell->cell, c, dir, NULL,
+                          rcell->recognized,
+                          rcell->recognized ? rcell->sendme_digest : NULL);
+  if (reason < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL, "circuit_receive_relay_cell "
+           "(%s) failed after crypto pipeline. Closing.",
+           dir == CELL_DIRECTION_OUT ? "forward" : "backward");
+    circuit_mark_for_close(c, -reason);
+  }
+}
+
+/** Main-thread function: called when a worker is done with a
+ * relay_crypto_job_t. */
+static void
+relay_crypto_pipeline_replyfn(void *work_)
+{
+  relay_crypto_job_t *job = work_;
+  or_circuit_t *circ = job->circ;
+  relay_crypto_cell_t *rcell;
+
+  if (circ == NULL) {
+    log_debug(LD_OR, "Circuit died while its cells were being crypted.");
+    relay_crypto_job_free(job);
+    return;
+  }
+
+  tor_assert(circ->crypto_pipeline);
+  tor_assert(circ->crypto_pipeline->job == job);
+
+  /* The circuit stays busy while we do this, so that any cell that we send
+   * as a result of these ones gets crypted after them. */
+  TOR_SIMPLEQ_FOREACH(rcell, &job->cells, next) {
+    if (job->circ == NULL) {
+      /* The circuit got freed by one of the cells we just handled. */
+      break;
+    }
+    relay_crypto_pipeline_finish_cell(circ, rcell);
+  }
+
+  if (job->circ == NULL) {
+    relay_crypto_job_free(job);
+    return;
+  }
+
+  circ->crypto_pipeline->job = NULL;
+  relay_crypto_job_free(job);
+  relay_crypto_pipeline_launch(circ);
+}
+
+/** If <b>circ</b> has no job with the workers, send its next batch of pending
+ * cells.  If it has nothing left to do, release its pipeline state so that
+ * it can go back to inline crypto. */
+static void
+relay_crypto_pipeline_launch(or_circuit_t *circ)
+{
+  relay_crypto_pipeline_t *pl = circ->crypto_pipeline;
+  relay_crypto_job_t *job;
+  relay_crypto_cell_t *rcell;
+
+  tor_assert(pl);
+  if (pl->job)
+    return;
+
+  if (pl->n_pending == 0) {
+    tor_free(circ->crypto_pipeline);
+    return;
+  }
+
+  job = relay_crypto_job_new(&circ->crypto);
+  job->circ = circ;
+  while (job->n_cells < RELAY_CRYPTO_PIPELINE_MAX_BATCH &&
+         (rcell = TOR_SIMPLEQ_FIRST(&pl->pending))) {
+    TOR_SIMPLEQ_REMOVE_HEAD(&pl->pending, next);
+    --pl->n_pending;
+    relay_crypto_job_add_cell(job, rcell);
+  }
+
+  stats_n_pipelined_cells += job->n_cells;
+  ++stats_n_pipelined_jobs;
+  pl->job = job;
+
+  if (!cpuworker_queue_work(WQ_PRI_HIGH,
+                            relay_crypto_pipeline_threadfn,
+                            relay_crypto_pipeline_replyfn,
+                            job)) {
+    /* LCOV_EXCL_START */
+    log_warn(LD_BUG, "Couldn't queue relay crypto work on threadpool; "
+             "doing it inline.");
+    relay_crypto_job_run(job);
+    relay_crypto_pipeline_replyfn(job);
+    /* LCOV_EXCL_STOP */
+  }
+}
+
+/** Put <b>rcell</b> at the end of <b>circ</b>'s pipeline, and launch a job
+ * if none is running.  Return 0 on success, or -END_CIRC_REASON_* if the
+ * circuit has too many cells waiting. */
+static int
+relay_crypto_pipeline_enqueue(or_circuit_t *circ, relay_crypto_cell_t *rcell)
+{
+  relay_crypto_pipeline_t *pl = circ->crypto_pipeline;
+
+  if (!pl) {
+    pl = circ->crypto_pipeline = tor_malloc_zero(sizeof(*pl));
+    TOR_SIMPLEQ_INIT(&pl->pending);
+  }
+
+  if (pl->n_pending >= RELAY_CRYPTO_PIPELINE_MAX_PENDING) {
+    log_fn(LOG_PROTOCOL_WARN, LD_OR,
+           "Too many cells (%d) waiting for crypto on circuit %u. Closing.",
+           pl->n_pending, (unsigned) circ->p_circ_id);
+    tor_free(rcell);
+    return -END_CIRC_REASON_RESOURCELIMIT;
+  }
+
+  TOR_SIMPLEQ_INSERT_TAIL(&pl->pending, rcell, next);
+  ++pl->n_pending;
+
+  relay_crypto_pipeline_launch(circ);
+  return 0;
+}
+
+/** Queue a copy of <b>cell</b>, which just arrived on <b>circ</b> heading in
+ * <b>cell_direction</b>, to be crypted by a worker.  Once that is done, it
+ * will be passed on to circuit_receive_relay_cell_crypted().
+ *
+ * Return 0 on success, or -END_CIRC_REASON_* on failure (as for
+ * circuit_receive_relay_cell()). */
+int
+relay_crypto_pipeline_queue_received(or_circuit_t *circ,
+                                     const cell_t *cell,
+                                     cell_direction_t cell_direction)
+{
+  relay_crypto_cell_t *rcell = tor_malloc_zero(sizeof(*rcell));
+
+  tor_assert(cell_direction == CELL_DIRECTION_OUT ||
+             cell_direction == CELL_DIRECTION_IN);
+
+  memcpy(&rcell->cell, cell, sizeof(cell_t));
+  rcell->op = (cell_direction == CELL_DIRECTION_OUT) ?
+    RELAY_CRYPTO_OP_DECRYPT_OUTBOUND : RELAY_CRYPTO_OP_ENCRYPT_INBOUND;
+
+  return relay_crypto_pipeline_enqueue(circ, rcell);
+}
+
+/** Queue a copy of <b>cell</b>, which we are sending towards the origin of
+ * <b>circ</b> from the stream <b>on_stream</b>, to be digested and encrypted
+ * by a worker.  Once that is done, it will be passed on to
+ * circuit_package_relay_cell_crypted().
+ *
+ * The integrity and recognized fields of <b>cell</b> must be zero, as for
+ * relay_encrypt_cell_inbound().
+ *
+ * Return 0 on success, or -END_CIRC_REASON_* on failure. */
+int
+relay_crypto_pipeline_queue_originated(or_circuit_t *circ,
+                                       const cell_t *cell,
+                                       streamid_t on_stream)
+{
+  relay_crypto_cell_t *rcell = tor_malloc_zero(sizeof(*rcell));
+
+  memcpy(&rcell->cell, cell, sizeof(cell_t));
+  rcell->op = RELAY_CRYPTO_OP_ORIGINATE;
+  rcell->on_stream = on_stream;
+  /* These depend on the package window, so we need to decide them now, in
+   * the same way that sendme_record_sending_cell_digest() and
+   * sendme_record_cell_digest_on_circ() would. */
+  rcell->want_sendme_digest =
+    !! circuit_sendme_cell_is_next(TO_CIRCUIT(circ)->package_window);
+  rcell->is_data = (cell->payload[0] == RELAY_COMMAND_DATA);
+
+  return relay_crypto_pipeline_enqueue(circ, rcell);
+}
+
+/** Called from circuit_free_() when <b>circ</b> is about to be freed:
+ * release its pending cells, and if a worker still has a job for it, hand
+ * the circuit's keys over to that job. */
+void
+relay_crypto_pipeline_circuit_free(or_circuit_t *circ)
+{
+  relay_crypto_pipeline_t *pl = circ->crypto_pipeline;
+  relay_crypto_cell_t *rcell;
+
+  if (!pl)
+    return;
+
+  while ((rcell = TOR_SIMPLEQ_FIRST(&pl->pending))) {
+    TOR_SIMPLEQ_REMOVE_HEAD(&pl->pending, next);
+    memwipe(rcell, 0, sizeof(*rcell));
+    tor_free(rcell);
+  }
+
+  if (pl->job) {
+    /* The worker is using our keys, so the job gets to free them. */
+    pl->job->circ = NULL;
+    pl->job->owns_crypto = 1;
+    memset(&circ->crypto, 0, sizeof(circ->crypto));
+  }
+
+  tor_free(circ->crypto_pipeline);
+}
+
+/** Set *<b>n_cells_out</b> and *<b>n_jobs_out</b> to the number of cells
+ * and jobs that we have sent through the pipeline so far. */
+void
+relay_crypto_pipeline_get_stats(uint64_t *n_cells_out, uint64_t *n_jobs_out)
+{
+  *n_cells_out = stats_n_pipelined_cells;
+  *n_jobs_out = stats_n_pipelined_jobs;
+}
@@ -0,0 +1,119 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file relay_crypto_pipeline.h
+ * @brief Header for relay_crypto_pipeline.c
+ **/
+
+#ifndef TOR_RELAY_CRYPTO_PIPELINE_H
+#define TOR_RELAY_CRYPTO_PIPELINE_H
+
+int relay_crypto_pipeline_is_enabled(void);
+int relay_crypto_pipeline_circ_is_busy(const or_circuit_t *circ);
+
+int relay_crypto_pipeline_queue_received(or_circuit_t *circ,
+                                         const cell_t *cell,
+                                         cell_direction_t cell_direction);
+int relay_crypto_pipeline_queue_originated(or_circuit_t *circ,
+                                           const cell_t *cell,
+                                           streamid_t on_stream);
+
+void relay_crypto_pipeline_circuit_free(or_circuit_t *circ);
+
+void relay_crypto_pipeline_get_stats(uint64_t *n_cells_out,
+                                     uint64_t *n_jobs_out);
+
+#ifdef RELAY_CRYPTO_PIPELINE_PRIVATE
+
+#include "ext/tor_queue.h"
+#include "core/or/cell_st.h"
+#include "core/or/relay_crypto_st.h"
+
+/** Largest number of cells that we hand to a worker thread in a single
+ * job. */
+#define RELAY_CRYPTO_PIPELINE_MAX_BATCH 64
+
+/** If more than this many cells are waiting for crypto on a single circuit,
+ * something is wrong (the workers can't keep up, or somebody is flooding
+ * us), and we close the circuit. */
+#define RELAY_CRYPTO_PIPELINE_MAX_PENDING 4096
+
+/** What a worker thread needs to do with a cell. */
+typedef enum relay_crypto_op_t {
+  /** A cell that arrived from p_chan: remove one layer with f_crypto and
+   * check whether it is recognized with f_digest. */
+  RELAY_CRYPTO_OP_DECRYPT_OUTBOUND = 0,
+  /** A cell that arrived from n_chan: add one layer with b_crypto. */
+  RELAY_CRYPTO_OP_ENCRYPT_INBOUND = 1,
+  /** A cell that we originated ourselves: set its digest from b_digest, then
+   * add one layer with b_crypto. */
+  RELAY_CRYPTO_OP_ORIGINATE = 2,
+} relay_crypto_op_t;
+
+/** A cell waiting for (or done with) crypto in the relay crypto
+ * pipeline. */
+typedef struct relay_crypto_cell_t {
+  TOR_SIMPLEQ_ENTRY(relay_crypto_cell_t) next;
+  /** The cell itself.  Crypted in place by the worker. */
+  cell_t cell;
+  /** One of relay_crypto_op_t. */
+  uint8_t op;
+  /** Set by the worker: true iff this was a RELAY_CRYPTO_OP_DECRYPT_OUTBOUND
+   * cell that is recognized by this hop. */
+  unsigned int recognized : 1;
+  /** Set when queuing a RELAY_CRYPTO_OP_ORIGINATE cell: true iff we will
+   * need the backward digest of this cell for an authenticated SENDME. */
+  unsigned int want_sendme_digest : 1;
+  /** Set when queuing a RELAY_CRYPTO_OP_ORIGINATE cell: true iff this is a
+   * RELAY_DATA cell. */
+  unsigned int is_data : 1;
+  /** For RELAY_CRYPTO_OP_ORIGINATE: the stream that sent this cell. */
+  streamid_t on_stream;
+  /** Set by the worker: the running digest right after this cell, for
+   * recognized cells and for originated cells with want_sendme_digest. */
+  uint8_t sendme_digest[DIGEST_LEN];
+} relay_crypto_cell_t;
+
+TOR_SIMPLEQ_HEAD(relay_crypto_cell_queue_t, relay_crypto_cell_t);
+typedef struct relay_crypto_cell_queue_t relay_crypto_cell_queue_t;
+
+/** A batch of cells for a single circuit, handed to a worker thread. */
+typedef struct relay_crypto_job_t {
+  /** The circuit these cells belong to, or NULL if it was freed while the
+   * job was with a worker. */
+  or_circuit_t *circ;
+  /** Copy of the circuit's relay crypto keys. */
+  relay_crypto_t crypto;
+  /** True iff this job must free the keys in <b>crypto</b>, because the
+   * circuit that owned them is gone. */
+  unsigned int owns_crypto : 1;
+  /** The cells, in the order in which they must be crypted. */
+  relay_crypto_cell_queue_t cells;
+  /** Number of cells in <b>cells</b>. */
+  int n_cells;
+} relay_crypto_job_t;
+
+/** Per-circuit state for a circuit that has cells in the pipeline. */
+typedef struct relay_crypto_pipeline_t {
+  /** Cells that are waiting for the current job to finish. */
+  relay_crypto_cell_queue_t pending;
+  /** Number of cells in <b>pending</b>. */
+  int n_pending;
+  /** The job that a worker is handling for this circuit, if any. */
+  relay_crypto_job_t *job;
+} relay_crypto_pipeline_t;
+
+/* These are exposed (and not STATIC) so that the benchmarks can drive the
+ * worker side of the pipeline directly. */
+relay_crypto_job_t *relay_crypto_job_new(const relay_crypto_t *crypto);
+void relay_crypto_job_add_cell(relay_crypto_job_t *job,
+                               relay_crypto_cell_t *rcell);
+void relay_crypto_job_run(relay_crypto_job_t *job);
+void relay_crypto_job_free_(relay_crypto_job_t *job);
+#define relay_crypto_job_free(job) \
+  FREE_AND_NULL(relay_crypto_job_t, relay_crypto_job_free_, (job))
+
+#endif /* defined(RELAY_CRYPTO_PIPELINE_PRIVATE) */
+
+#endif /* !defined(TOR_RELAY_CRYPTO_PIPELINE_H) */
@@ -69,6 +69,7 @@
 #include "app/config/config.h"
 #include "app/config/resolve_addr.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
 #include "core/or/channel.h"
@@ -79,6 +80,8 @@
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
 #include "core/or/dos.h"
+#include "core/or/oom_age.h"
+#include "core/or/or_metrics.h"
 #include "core/or/policies.h"
 #include "core/or/reasons.h"
 #include "core/or/relay.h"
@@ -95,6 +98,7 @@
 #include "feature/dirauth/authmode.h"
 #include "feature/dirauth/dirauth_config.h"
 #include "feature/dircache/dirserv.h"
+#include "feature/dirclient/dirclient.h"
 #include "feature/dircommon/directory.h"
 #include "feature/hibernate/hibernate.h"
 #include "feature/hs/hs_common.h"
@@ -730,6 +734,7 @@ connection_init(time_t now, connection_t *conn, int type, int socket_family)
 
   conn->type = type;
   conn->socket_family = socket_family;
+  oom_age_entry_init(&conn->oom_age_entry, OOM_AGE_KIND_CONNECTION);
   if (!connection_is_listener(conn)) {
     /* listeners never use their buf */
     conn->inbuf = buf_new();
@@ -830,6 +835,8 @@ connection_free_minimal(connection_t *conn)
              (int)connection_get_outbuf_len(conn));
   }
 
+  oom_age_index_remove(&conn->oom_age_entry);
+
   if (!connection_is_listener(conn)) {
     buf_free(conn->inbuf);
     buf_free(conn->outbuf);
@@ -925,6 +932,8 @@ connection_free_minimal(connection_t *conn)
     tor_free(dir_conn->requested_resource);
 
     tor_compress_free(dir_conn->compress_state);
+    connection_dir_clear_file_region(dir_conn);
+    dir_client_stream_free(dir_conn->client_stream);
     dir_conn_clear_spool(dir_conn);
 
     rend_data_free(dir_conn->rend_data);
@@ -3413,7 +3422,7 @@ connection_bucket_get_share(int base, int priority,
 }
 
 /** How many bytes at most can we read onto this connection? */
-static ssize_t
+ssize_t
 connection_bucket_read_limit(connection_t *conn, time_t now)
 {
   int base = RELAY_PAYLOAD_SIZE;
@@ -3451,6 +3460,9 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
   size_t conn_bucket = buf_datalen(conn->outbuf);
   size_t global_bucket_val = token_bucket_rw_get_write(&global_bucket);
 
+  if (conn->type == CONN_TYPE_DIR)
+    conn_bucket += TO_DIR_CONN(conn)->file_region_len;
+
   if (!connection_is_rate_limited(conn)) {
     /* be willing to write to local conns even if our buckets are empty */
     return conn_bucket;
@@ -3609,6 +3621,7 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   }
 
   record_num_bytes_transferred_impl(conn, now, num_read, num_written);
+  or_metrics_note_conn_bytes(conn->type, num_read, num_written);
 
   if (!connection_is_rate_limited(conn))
     return; /* local IPs are free */
@@ -4121,6 +4134,16 @@ connection_buf_read_from_socket(connection_t *conn, ssize_t *max_to_read,
       conn->inbuf_reached_eof = 1;
 
     n_read = (size_t) result;
+  } else if (conn->uring) {
+    /* The bytes are already on our inbuf; find out how many there were. */
+    int reached_eof = 0;
+    result = connection_uring_read_from_socket(conn, &reached_eof,
+                                               socket_error);
+    if (reached_eof)
+      conn->inbuf_reached_eof = 1;
+    if (result < 0)
+      return -1;
+    n_read = (size_t) result;
   } else {
     /* !connection_speaks_cells, !conn->linked_conn. */
     int reached_eof = 0;
@@ -4143,6 +4166,8 @@ connection_buf_read_from_socket(connection_t *conn, ssize_t *max_to_read,
      /* change *max_to_read */
     *max_to_read = at_most - n_read;
 
+    connection_update_oom_age(conn);
+
     /* Onion service application connection. Note read bytes for metrics. */
     if (CONN_IS_EDGE(conn) && TO_EDGE_CONN(conn)->hs_ident) {
       edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
@@ -4193,6 +4218,36 @@ connection_buf_read_from_socket(connection_t *conn, ssize_t *max_to_read,
   return 0;
 }
 
+/** Make sure that <b>conn</b>'s entry in the OOM age index is no newer than
+ * the oldest data in its buffers.  Call this whenever data is added to one
+ * of <b>conn</b>'s buffers.
+ *
+ * We don't bother updating the index when data is removed from a buffer:
+ * an entry that is older than it should be is harmless, and
+ * circuits_handle_oom() corrects it if it ever looks at it. */
+void
+connection_update_oom_age(connection_t *conn)
+{
+  oom_age_entry_t *ent = &conn->oom_age_entry;
+  uint32_t now, age, stamp;
+
+  /* These are the only connections that the OOM handler looks at. */
+  if (conn->type != CONN_TYPE_DIR && !CONN_IS_EDGE(conn))
+    return;
+
+  if (buf_datalen(conn->inbuf) == 0 && buf_datalen(conn->outbuf) == 0) {
+    oom_age_index_remove(ent);
+    return;
+  }
+
+  now = monotime_coarse_get_stamp();
+  age = MAX(buf_get_oldest_chunk_timestamp(conn->inbuf, now),
+            buf_get_oldest_chunk_timestamp(conn->outbuf, now));
+  stamp = now - age;
+  if (!oom_age_entry_is_indexed(ent) || (int32_t)(stamp - ent->stamp) < 0)
+    oom_age_index_update(ent, stamp);
+}
+
 /** A pass-through to fetch_from_buf. */
 int
 connection_buf_get_bytes(char *string, size_t len, connection_t *conn)
@@ -4224,6 +4279,9 @@ connection_fetch_from_buf_http(connection_t *conn,
 int
 connection_wants_to_flush(connection_t *conn)
 {
+  if (conn->type == CONN_TYPE_DIR &&
+      connection_dir_has_file_region(TO_DIR_CONN(conn)))
+    return 1;
   return connection_get_outbuf_len(conn) > 0;
 }
 
@@ -4457,8 +4515,7 @@ connection_handle_write_impl(connection_t *conn, int force)
     result = (int)(initial_size-buf_datalen(conn->outbuf));
   } else {
     CONN_LOG_PROTECT(conn,
-                     result = buf_flush_to_socket(conn->outbuf, conn->s,
-                                                  max_to_write));
+                     result = connection_flush_to_socket(conn, max_to_write));
     if (result < 0) {
       if (CONN_IS_EDGE(conn))
         connection_edge_end_errno(TO_EDGE_CONN(conn));
@@ -4499,9 +4556,11 @@ connection_handle_write_impl(connection_t *conn, int force)
 
   connection_buckets_decrement(conn, approx_time(), n_read, n_written);
 
-  if (result > 0) {
+  if (result > 0 ||
+      (conn->type == CONN_TYPE_DIR && TO_DIR_CONN(conn)->file_region_failed)) {
     /* If we wrote any bytes from our buffer, then call the appropriate
-     * functions. */
+     * functions.  (A directory connection that couldn't send straight from
+     * a file also needs its spool to copy the rest of that file.) */
     if (connection_flushed_some(conn) < 0) {
       if (connection_speaks_cells(conn)) {
         connection_or_notify_error(TO_OR_CONN(conn),
@@ -4537,6 +4596,30 @@ connection_handle_write_impl(connection_t *conn, int force)
   return 0;
 }
 
+/** Write up to <b>max_to_write</b> bytes from <b>conn</b>'s outbuf to its
+ * socket.  If that empties the outbuf, and <b>conn</b> is a directory
+ * connection that is sending part of a file, continue with the file.
+ * Return the number of bytes written, or -1 on error.
+ *
+ * Only use this for connections that don't speak TLS. */
+int
+connection_flush_to_socket(connection_t *conn, size_t max_to_write)
+{
+  size_t from_buf = MIN(max_to_write, buf_datalen(conn->outbuf));
+  int result = conn->uring ?
+    connection_uring_flush_to_socket(conn, from_buf) :
+    buf_flush_to_socket(conn->outbuf, conn->s, from_buf);
+  if (result < 0 || conn->type != CONN_TYPE_DIR ||
+      buf_datalen(conn->outbuf) > 0 || (size_t)result >= max_to_write)
+    return result;
+
+  ssize_t r = connection_dir_flush_file_region(TO_DIR_CONN(conn),
+                                               max_to_write - result);
+  if (r < 0)
+    return -1;
+  return result + (int)r;
+}
+
 /* DOCDOC connection_handle_write */
 int
 connection_handle_write(connection_t *conn, int force)
@@ -4619,6 +4702,8 @@ connection_write_to_buf_failed(connection_t *conn)
 static void
 connection_write_to_buf_commit(connection_t *conn)
 {
+  connection_update_oom_age(conn);
+
   /* If we receive optimistic data in the EXIT_CONN_STATE_RESOLVING
    * state, we don't want to try to write it right away, since
    * conn->write_event won't be set yet.  Otherwise, write data from
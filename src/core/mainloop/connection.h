@@ -227,6 +227,7 @@ int retry_all_listeners(struct smartlist_t *new_conns,
 void connection_mark_all_noncontrol_listeners(void);
 void connection_mark_all_noncontrol_connections(void);
 
+ssize_t connection_bucket_read_limit(struct connection_t *conn, time_t now);
 ssize_t connection_bucket_write_limit(struct connection_t *conn, time_t now);
 bool connection_dir_is_global_write_low(const struct connection_t *conn,
                                         size_t attempt);
@@ -253,6 +254,8 @@ int connection_fetch_from_buf_http(struct connection_t *conn,
                                size_t max_bodylen, int force_complete);
 
 int connection_wants_to_flush(struct connection_t *conn);
+int connection_flush_to_socket(struct connection_t *conn,
+                               size_t max_to_write);
 int connection_outbuf_too_full(struct connection_t *conn);
 int connection_handle_write(struct connection_t *conn, int force);
 int connection_flush(struct connection_t *conn);
@@ -273,6 +276,7 @@ connection_buf_add(const char *string, size_t len, struct connection_t *conn)
 void connection_buf_add_compress(const char *string, size_t len,
                                  struct dir_connection_t *conn, int done);
 void connection_buf_add_buf(struct connection_t *conn, struct buf_t *buf);
+void connection_update_oom_age(struct connection_t *conn);
 
 size_t connection_get_inbuf_len(struct connection_t *conn);
 size_t connection_get_outbuf_len(struct connection_t *conn);
@@ -0,0 +1,494 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file connection_uring.c
+ * \brief Do reads and writes for some connections through io_uring.
+ *
+ * Normally, Libevent tells us when a connection's socket is readable or
+ * writable, and then we make a system call to move the bytes.  When
+ * UseIOUring is set, connections whose bytes go straight to the socket
+ * (that is, everything but TLS and linked connections) work the other way
+ * around: while a connection wants to read, we keep a receive request for
+ * it with the kernel, and while it wants to write, we keep a send request
+ * for it with the kernel.  When one of these finishes, we have already
+ * moved the bytes on or off the connection's buffers, and we tell the
+ * connection code about it through the same callbacks that Libevent would
+ * have invoked.
+ *
+ * We collect the requests that we want to make during each main loop
+ * iteration, and hand them all to the kernel at once at the end of the
+ * iteration.  The kernel tells us about finished requests by making the
+ * io_uring's file descriptor readable, so a single Libevent event covers
+ * every connection that we handle here.
+ *
+ * A connection keeps its Libevent events, so that the rest of the code
+ * doesn't need to care, but we never add them.
+ **/
+
+#define CONNECTION_URING_PRIVATE
+
+#include "core/or/or.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
+#include "core/mainloop/mainloop.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/uring.h"
+#include "lib/net/buffers_net.h"
+
+#include "core/or/connection_st.h"
+
+#include <event2/event.h>
+#include <errno.h>
+
+typedef struct connection_uring_t connection_uring_t;
+
+/** Our io_uring, or NULL if we aren't using one. */
+static tor_uring_t *the_ring = NULL;
+/** Libevent event that fires when the_ring has completions. */
+static struct event *ring_event = NULL;
+/** Event to process everything on pending_states, once per main loop
+ * iteration. */
+static mainloop_event_t *pending_event = NULL;
+/** List of connection_uring_t that we need to look at before the end of
+ * this main loop iteration: either they have finished requests to tell
+ * their connections about, or they want to make new requests. */
+static smartlist_t *pending_states = NULL;
+/** List of connection_uring_t whose connections are gone, but which still
+ * have requests with the kernel. */
+static smartlist_t *orphaned_states = NULL;
+
+/** Return true iff we're using io_uring for some connections. */
+int
+connection_uring_is_enabled(void)
+{
+  return the_ring != NULL;
+}
+
+/** Return true iff we can do the reads and writes for <b>conn</b> through
+ * io_uring. */
+STATIC int
+connection_uring_conn_is_eligible(const connection_t *conn)
+{
+  if (conn->linked || !SOCKET_OK(conn->s))
+    return 0;
+
+  switch (conn->type) {
+    case CONN_TYPE_EXIT:
+    case CONN_TYPE_AP:
+    case CONN_TYPE_DIR:
+    case CONN_TYPE_CONTROL:
+    case CONN_TYPE_METRICS:
+      return 1;
+    default:
+      /* OR connections do their I/O through the TLS library; listeners
+       * accept() instead of reading. */
+      return 0;
+  }
+}
+
+/** Free <b>cu</b> if nothing refers to it any more. */
+static void
+conn_uring_maybe_free(connection_uring_t *cu)
+{
+  if (cu->conn || cu->read_in_flight || cu->write_in_flight || cu->pending)
+    return;
+  smartlist_remove(orphaned_states, cu);
+  tor_free(cu);
+}
+
+/** Arrange to look at <b>cu</b> at the end of this main loop iteration. */
+static void
+conn_uring_mark_pending(connection_uring_t *cu)
+{
+  if (cu->pending)
+    return;
+  cu->pending = 1;
+  smartlist_add(pending_states, cu);
+  mainloop_event_activate(pending_event);
+}
+
+/** Return true iff <b>err</b> just means that a request didn't get to
+ * happen, and we should try it again. */
+static int
+conn_uring_err_is_transient(int err)
+{
+  return err == ECANCELED || err == EAGAIN || err == EINTR ||
+    err == ENOBUFS;
+}
+
+/** Callback: a receive request finished. */
+static void
+conn_uring_read_cb(tor_uring_req_t *req, int result, const uint8_t *data)
+{
+  connection_uring_t *cu = req->arg;
+
+  cu->read_in_flight = 0;
+  if (!cu->conn) {
+    conn_uring_maybe_free(cu);
+    return;
+  }
+
+  if (result > 0) {
+    tor_assert(data);
+    buf_add(cu->conn->inbuf, (const char *)data, result);
+    cu->n_read += result;
+    cu->read_ready = 1;
+  } else if (result == 0) {
+    cu->reached_eof = 1;
+    cu->read_ready = 1;
+  } else if (!conn_uring_err_is_transient(-result)) {
+    cu->read_errno = -result;
+    cu->read_ready = 1;
+  }
+  conn_uring_mark_pending(cu);
+}
+
+/** Callback: a send request, or a poll for writability, finished. */
+static void
+conn_uring_write_cb(tor_uring_req_t *req, int result, const uint8_t *data)
+{
+  connection_uring_t *cu = req->arg;
+  (void)data;
+
+  cu->write_in_flight = 0;
+  if (cu->send_buf >= 0) {
+    tor_uring_send_buf_release(the_ring, cu->send_buf);
+    cu->send_buf = -1;
+    if (cu->conn) {
+      if (result > 0) {
+        /* Nobody else takes bytes off the front of the outbuf while a send
+         * is pending, so these are the bytes that we sent. */
+        buf_t *outbuf = cu->conn->outbuf;
+        buf_drain(outbuf, MIN((size_t)result, buf_datalen(outbuf)));
+        cu->n_written += result;
+      } else if (result < 0 && !conn_uring_err_is_transient(-result)) {
+        cu->write_errno = -result;
+      }
+    }
+  }
+  if (!cu->conn) {
+    conn_uring_maybe_free(cu);
+    return;
+  }
+  /* For a poll, we don't care about the result: the connection code will
+   * find out about any errors when it tries to write. */
+  cu->write_ready = 1;
+  conn_uring_mark_pending(cu);
+}
+
+/** Hand the kernel whatever requests <b>cu</b>'s connection needs. */
+static void
+conn_uring_prepare_requests(connection_uring_t *cu)
+{
+  connection_t *conn = cu->conn;
+  const time_t now = approx_time();
+
+  if (cu->want_read && !cu->read_in_flight && !cu->reached_eof &&
+      !cu->read_errno) {
+    ssize_t at_most = connection_bucket_read_limit(conn, now);
+    const ssize_t room = BUF_MAX_LEN - buf_datalen(conn->inbuf);
+    if (at_most > room)
+      at_most = room;
+    /* If at_most is 0, the connection will stop reading when we tell it
+     * about its empty bucket, and start again when the bucket refills. */
+    if (at_most > 0 &&
+        tor_uring_prep_recv(the_ring, &cu->read_req, conn->s,
+                            at_most) == 0) {
+      cu->read_in_flight = 1;
+    }
+  }
+
+  if (cu->want_write && !cu->write_in_flight && !cu->write_errno) {
+    const size_t outbuf_len = buf_datalen(conn->outbuf);
+    ssize_t at_most = 0;
+    uint8_t *buf = NULL;
+    int idx = -1;
+
+    if (!connection_state_is_connecting(conn) && outbuf_len) {
+      at_most = connection_bucket_write_limit(conn, now);
+      if (at_most == 0)
+        return; /* Blocked on bandwidth; we'll be back. */
+      at_most = MIN((size_t)at_most, outbuf_len);
+      at_most = MIN((size_t)at_most, tor_uring_get_buf_size(the_ring));
+      idx = tor_uring_send_buf_get(the_ring, &buf);
+    }
+    if (idx >= 0) {
+      buf_peek(conn->outbuf, (char *)buf, at_most);
+      if (tor_uring_prep_send(the_ring, &cu->write_req, conn->s, idx,
+                              at_most) == 0) {
+        cu->send_buf = idx;
+        cu->write_in_flight = 1;
+      } else {
+        tor_uring_send_buf_release(the_ring, idx);
+      }
+    } else {
+      /* We're waiting for a connect() to finish, or we have nothing to send,
+       * or we're out of send buffers: just wait until the socket is
+       * writable, and let the connection code write synchronously. */
+      if (tor_uring_prep_poll_writable(the_ring, &cu->write_req,
+                                       conn->s) == 0) {
+        cu->write_in_flight = 1;
+      }
+    }
+  }
+}
+
+/** Tell connections about their finished requests, make the new requests
+ * that they want, and hand all of those to the kernel. */
+STATIC void
+connection_uring_process_pending(void)
+{
+  smartlist_t *todo = pending_states;
+  pending_states = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(todo, connection_uring_t *, cu) {
+    /* Any of these callbacks can close and free any connection, including
+     * this one.  That's okay: cu stays around while cu->pending is set. */
+    if (cu->conn && cu->want_read && cu->read_ready)
+      connection_dispatch_read_event(cu->conn);
+    if (cu->conn && cu->want_write && cu->write_ready)
+      connection_dispatch_write_event(cu->conn);
+    if (cu->conn)
+      conn_uring_prepare_requests(cu);
+    cu->pending = 0;
+    conn_uring_maybe_free(cu);
+  } SMARTLIST_FOREACH_END(cu);
+  smartlist_free(todo);
+
+  tor_uring_submit(the_ring, 0);
+}
+
+/** Callback for pending_event. */
+static void
+conn_uring_pending_cb(mainloop_event_t *ev, void *arg)
+{
+  (void)ev;
+  (void)arg;
+  connection_uring_process_pending();
+}
+
+/** Libevent callback: the kernel has finished some of our requests. */
+static void
+conn_uring_ring_cb(evutil_socket_t fd, short event, void *arg)
+{
+  (void)fd;
+  (void)event;
+  (void)arg;
+  tor_uring_process_completions(the_ring);
+}
+
+/** Start using io_uring for the connections that can use it.  Return 0 on
+ * success, and -1 if this kernel can't do what we need. */
+int
+connection_uring_init(void)
+{
+  if (the_ring)
+    return 0;
+
+  the_ring = tor_uring_new(CONN_URING_N_ENTRIES, CONN_URING_N_BUFS,
+                           CONN_URING_BUF_SIZE);
+  if (!the_ring) {
+    log_warn(LD_CONFIG, "UseIOUring is set, but we can't use io_uring on "
+             "this system: we need Linux 5.19 or later. Using Libevent "
+             "for all connections.");
+    return -1;
+  }
+
+  ring_event = tor_event_new(tor_libevent_get_base(),
+                             tor_uring_get_fd(the_ring), EV_READ|EV_PERSIST,
+                             conn_uring_ring_cb, NULL);
+  event_add(ring_event, NULL);
+  pending_event = mainloop_event_new(conn_uring_pending_cb, NULL);
+  pending_states = smartlist_new();
+  orphaned_states = smartlist_new();
+
+  log_notice(LD_NET, "Using io_uring for reads and writes on non-TLS "
+             "connections.");
+  return 0;
+}
+
+/** Stop using io_uring, and release all storage held for it.  Any
+ * connections that were using it must already be gone. */
+void
+connection_uring_free_all(void)
+{
+  if (!the_ring)
+    return;
+
+  /* This cancels every request that's still pending, without invoking any
+   * of their callbacks. */
+  tor_uring_free(the_ring);
+  tor_event_free(ring_event);
+  mainloop_event_free(pending_event);
+
+  SMARTLIST_FOREACH(orphaned_states, connection_uring_t *, cu, tor_free(cu));
+  smartlist_free(orphaned_states);
+  /* Every remaining pending state belonged to a connection, and so has
+   * already been freed or orphaned. */
+  smartlist_free(pending_states);
+}
+
+/** Log how much work we have done through io_uring. */
+void
+connection_uring_log_stats(int severity)
+{
+  tor_uring_stats_t st;
+  if (!the_ring)
+    return;
+  tor_uring_get_stats(the_ring, &st);
+  tor_log(severity, LD_NET,
+          "io_uring: %"PRIu64" requests submitted and %"PRIu64" completed "
+          "in %"PRIu64" system calls; %"PRIu64" receives found no "
+          "free buffer.",
+          st.n_submitted, st.n_completed, st.n_enter_calls, st.n_no_buffers);
+}
+
+/** If we're using io_uring and <b>conn</b> can use it, do its reads and
+ * writes through io_uring from now on.  Called when <b>conn</b> is added to
+ * the connection array. */
+void
+connection_uring_attach(connection_t *conn)
+{
+  if (!the_ring || conn->uring || !connection_uring_conn_is_eligible(conn))
+    return;
+
+  connection_uring_t *cu = tor_malloc_zero(sizeof(connection_uring_t));
+  cu->conn = conn;
+  cu->send_buf = -1;
+  cu->read_req.cb = conn_uring_read_cb;
+  cu->read_req.arg = cu;
+  cu->write_req.cb = conn_uring_write_cb;
+  cu->write_req.arg = cu;
+  conn->uring = cu;
+}
+
+/** Stop doing reads and writes for <b>conn</b> through io_uring.  Called
+ * just before we close <b>conn</b>'s socket. */
+void
+connection_uring_detach(connection_t *conn)
+{
+  connection_uring_t *cu = conn->uring;
+  if (!cu)
+    return;
+
+  conn->uring = NULL;
+  cu->conn = NULL;
+  cu->want_read = cu->want_write = 0;
+  if (cu->read_in_flight || cu->write_in_flight) {
+    /* The kernel holds a reference to the socket while it has requests on
+     * it, so we have to cancel them before closing the socket, or the other
+     * side will never see us close it.  Do it right away: the close is
+     * coming. */
+    if (cu->read_in_flight)
+      tor_uring_prep_cancel(the_ring, &cu->read_req);
+    if (cu->write_in_flight)
+      tor_uring_prep_cancel(the_ring, &cu->write_req);
+    tor_uring_submit(the_ring, 0);
+    smartlist_add(orphaned_states, cu);
+  }
+  conn_uring_maybe_free(cu);
+}
+
+/** Tell the io_uring backend that <b>conn</b> wants to read. */
+void
+connection_uring_start_reading(connection_t *conn)
+{
+  connection_uring_t *cu = conn->uring;
+  cu->want_read = 1;
+  conn_uring_mark_pending(cu);
+}
+
+/** Tell the io_uring backend that <b>conn</b> doesn't want to read.  Any
+ * receive that's already with the kernel still happens, but we won't tell
+ * the connection about it until it wants to read again. */
+void
+connection_uring_stop_reading(connection_t *conn)
+{
+  conn->uring->want_read = 0;
+}
+
+/** Tell the io_uring backend that <b>conn</b> wants to write. */
+void
+connection_uring_start_writing(connection_t *conn)
+{
+  connection_uring_t *cu = conn->uring;
+  cu->want_write = 1;
+  conn_uring_mark_pending(cu);
+}
+
+/** Tell the io_uring backend that <b>conn</b> doesn't want to write. */
+void
+connection_uring_stop_writing(connection_t *conn)
+{
+  conn->uring->want_write = 0;
+}
+
+/** Return true iff <b>conn</b> wants to read. */
+int
+connection_uring_is_reading(const connection_t *conn)
+{
+  return conn->uring->want_read;
+}
+
+/** Return true iff <b>conn</b> wants to write. */
+int
+connection_uring_is_writing(const connection_t *conn)
+{
+  return conn->uring->want_write;
+}
+
+/** The io_uring counterpart of buf_read_from_socket() for <b>conn</b>.
+ *
+ * We have already added any bytes that we received to the connection's
+ * inbuf; return the number of those bytes that we haven't reported yet.  Set
+ * *<b>reached_eof</b> if the other side has closed the connection.  On
+ * error, set *<b>socket_error</b> and return -1. */
+int
+connection_uring_read_from_socket(connection_t *conn, int *reached_eof,
+                                  int *socket_error)
+{
+  connection_uring_t *cu = conn->uring;
+  size_t n;
+
+  cu->read_ready = 0;
+  if (cu->read_errno) {
+    *socket_error = cu->read_errno;
+    return -1;
+  }
+  if (cu->reached_eof)
+    *reached_eof = 1;
+  n = cu->n_read;
+  cu->n_read = 0;
+  return (int) n;
+}
+
+/** The io_uring counterpart of buf_flush_to_socket() for <b>conn</b>.
+ *
+ * If we have sent some bytes since the last call, we have already drained
+ * them from the connection's outbuf: return how many there were.
+ * Otherwise, if no send is pending, try to write up to <b>sz</b> bytes
+ * right away.  On error, set errno and return -1. */
+int
+connection_uring_flush_to_socket(connection_t *conn, size_t sz)
+{
+  connection_uring_t *cu = conn->uring;
+  size_t n;
+
+  cu->write_ready = 0;
+  if (cu->write_errno) {
+    errno = cu->write_errno;
+    return -1;
+  }
+  if (cu->n_written) {
+    n = cu->n_written;
+    cu->n_written = 0;
+    return (int) n;
+  }
+  if (cu->write_in_flight && cu->send_buf >= 0) {
+    /* Writing now would put these bytes ahead of the ones that we're
+     * already sending. */
+    return 0;
+  }
+  return buf_flush_to_socket(conn->outbuf, conn->s, sz);
+}
@@ -0,0 +1,92 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file connection_uring.h
+ * \brief Header file for connection_uring.c.
+ **/
+
+#ifndef TOR_CONNECTION_URING_H
+#define TOR_CONNECTION_URING_H
+
+int connection_uring_init(void);
+int connection_uring_is_enabled(void);
+void connection_uring_free_all(void);
+void connection_uring_log_stats(int severity);
+
+void connection_uring_attach(connection_t *conn);
+void connection_uring_detach(connection_t *conn);
+
+void connection_uring_start_reading(connection_t *conn);
+void connection_uring_stop_reading(connection_t *conn);
+void connection_uring_start_writing(connection_t *conn);
+void connection_uring_stop_writing(connection_t *conn);
+int connection_uring_is_reading(const connection_t *conn);
+int connection_uring_is_writing(const connection_t *conn);
+
+int connection_uring_read_from_socket(connection_t *conn, int *reached_eof,
+                                      int *socket_error);
+int connection_uring_flush_to_socket(connection_t *conn, size_t sz);
+
+#ifdef CONNECTION_URING_PRIVATE
+
+#include "lib/evloop/uring.h"
+
+/** Size of each buffer that we read into or write from.  This is the same
+ * as the size of the chunks that buf_t prefers. */
+#define CONN_URING_BUF_SIZE 16384
+/** Number of receive buffers, and of send buffers.  The kernel only takes a
+ * receive buffer when data arrives, so this limits the number of reads that
+ * can finish in a single main loop iteration, not the number of
+ * connections. */
+#define CONN_URING_N_BUFS 256
+/** Number of submissions we can queue before we have to flush them. */
+#define CONN_URING_N_ENTRIES 4096
+
+/** The io_uring state for a single connection. */
+struct connection_uring_t {
+  /** The connection that this belongs to, or NULL if the connection is
+   * gone and we're just waiting for its requests to finish. */
+  connection_t *conn;
+  /** Our receive request, and our send (or poll-for-write) request. */
+  tor_uring_req_t read_req;
+  tor_uring_req_t write_req;
+
+  /** True iff the connection wants to read. */
+  unsigned int want_read : 1;
+  /** True iff the connection wants to write. */
+  unsigned int want_write : 1;
+  /** True iff read_req is with the kernel. */
+  unsigned int read_in_flight : 1;
+  /** True iff write_req is with the kernel. */
+  unsigned int write_in_flight : 1;
+  /** True iff a read finished, and the connection hasn't heard about it. */
+  unsigned int read_ready : 1;
+  /** True iff a write finished, and the connection hasn't heard about it. */
+  unsigned int write_ready : 1;
+  /** True iff we have seen the end of the stream. */
+  unsigned int reached_eof : 1;
+  /** True iff this is on the list of states that we need to look at at the
+   * end of this main loop iteration. */
+  unsigned int pending : 1;
+
+  /** Send buffer for write_req, or -1 if write_req is a poll. */
+  int send_buf;
+  /** Number of bytes that we have added to the connection's inbuf, and not
+   * yet reported to it. */
+  size_t n_read;
+  /** Number of bytes that we have drained from the connection's outbuf, and
+   * not yet reported to it. */
+  size_t n_written;
+  /** Nonzero: an error from the last read, not yet reported. */
+  int read_errno;
+  /** Nonzero: an error from the last write, not yet reported. */
+  int write_errno;
+};
+
+STATIC int connection_uring_conn_is_eligible(const connection_t *conn);
+STATIC void connection_uring_process_pending(void);
+
+#endif /* defined(CONNECTION_URING_PRIVATE) */
+
+#endif /* !defined(TOR_CONNECTION_URING_H) */
@@ -17,6 +17,7 @@
  *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
  *  </ul>
  **/
+#define CPUWORKER_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/circuitlist.h"
@@ -26,17 +27,17 @@
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "core/or/onion.h"
+#include "core/or/or_metrics.h"
 #include "feature/relay/circuitbuild_relay.h"
 #include "feature/relay/onion_queue.h"
 #include "feature/stats/rephist.h"
 #include "feature/relay/router.h"
 #include "lib/evloop/workqueue.h"
+#include "lib/thread/threads.h"
 #include "core/crypto/onion_crypto.h"
 
 #include "core/or/or_circuit_st.h"
 
-static void queue_pending_tasks(void);
-
 typedef struct worker_state_t {
   int generation;
   server_onion_keys_t *onion_keys;
@@ -72,6 +73,8 @@ worker_state_free_void(void *arg)
 
 static replyqueue_t *replyqueue = NULL;
 static threadpool_t *threadpool = NULL;
+/** Number of threads in <b>threadpool</b>. */
+static int n_cpuworker_threads = 1;
 
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
@@ -93,6 +96,7 @@ cpu_init(void)
       least one thread of each kind.
     */
     const int n_threads = get_num_cpus(get_options()) + 1;
+    n_cpuworker_threads = n_threads;
     threadpool = threadpool_new(n_threads,
                                 replyqueue,
                                 worker_state_new,
@@ -102,12 +106,90 @@ cpu_init(void)
     int r = threadpool_register_reply_event(threadpool, NULL);
 
     tor_assert(r == 0);
+
+    const or_options_t *options = get_options();
+    replyqueue_set_max_batch(replyqueue, options->CPUWorkerReplyBatch);
+    threadpool_set_reply_coalesce_usec(threadpool,
+                                 (uint32_t)options->CPUWorkerReplyWindowUsec);
   }
 
   /* Total voodoo. Can we make this more sensible? */
   max_pending_tasks = get_num_cpus(get_options()) * 64;
 }
 
+/** Return true iff the cpuworker threadpool is running. */
+int
+cpuworker_is_initialized(void)
+{
+  return threadpool != NULL;
+}
+
+/** Reply queue statistics as of the last call to
+ * cpuworker_log_reply_stats(). */
+static replyqueue_stats_t last_reply_stats;
+/** When did we last call cpuworker_log_reply_stats()? */
+static time_t last_reply_stats_time = 0;
+
+/** Log how often the cpuworkers have woken up the main thread, and how
+ * long their replies have waited for it, since the last time we logged
+ * these. */
+void
+cpuworker_log_reply_stats(int severity, time_t now)
+{
+  replyqueue_stats_t stats;
+  smartlist_t *buckets;
+  char *hist;
+  uint64_t n_wakeups, n_alerts, n_replies;
+  time_t elapsed;
+  int i;
+
+  if (!replyqueue)
+    return;
+
+  replyqueue_get_stats(replyqueue, &stats);
+  n_wakeups = stats.n_wakeups - last_reply_stats.n_wakeups;
+  n_alerts = stats.n_alerts - last_reply_stats.n_alerts;
+  n_replies = stats.n_replies - last_reply_stats.n_replies;
+  for (i = 0; i < REPLYQUEUE_LATENCY_BUCKETS; ++i)
+    stats.latency_hist[i] -= last_reply_stats.latency_hist[i];
+  elapsed = last_reply_stats_time ? now - last_reply_stats_time : 0;
+
+  /* Remember the totals, not the differences, for next time. */
+  replyqueue_get_stats(replyqueue, &last_reply_stats);
+  last_reply_stats_time = now;
+
+  if (!n_replies || elapsed <= 0)
+    return;
+
+  log_fn(severity, LD_OR,
+         "Cpuworkers woke up the main thread %.2f times/sec "
+         "(%.2f alerts/sec) with %.2f replies per wakeup. Reply latency: "
+         "median %"PRIu64" usec, 90%% %"PRIu64" usec, 99%% %"PRIu64" usec.",
+         ((double)n_wakeups) / elapsed, ((double)n_alerts) / elapsed,
+         n_wakeups ? ((double)n_replies) / n_wakeups : 0.0,
+         replyqueue_stats_latency_usec(&stats, 0.5),
+         replyqueue_stats_latency_usec(&stats, 0.9),
+         replyqueue_stats_latency_usec(&stats, 0.99));
+
+  buckets = smartlist_new();
+  for (i = 0; i < REPLYQUEUE_LATENCY_BUCKETS; ++i) {
+    if (!stats.latency_hist[i])
+      continue;
+    if (i == REPLYQUEUE_LATENCY_BUCKETS - 1)
+      smartlist_add_asprintf(buckets, "more:%"PRIu64,
+                             stats.latency_hist[i]);
+    else
+      smartlist_add_asprintf(buckets, "%"PRIu64":%"PRIu64,
+                             UINT64_C(1) << i, stats.latency_hist[i]);
+  }
+  hist = smartlist_join_strings(buckets, " ", 0, NULL);
+  log_fn(severity, LD_OR,
+         "Cpuworker reply latency histogram (usec, up to:count): %s", hist);
+  tor_free(hist);
+  SMARTLIST_FOREACH(buckets, char *, cp, tor_free(cp));
+  smartlist_free(buckets);
+}
+
 /** Magic numbers to make sure our cpuworker_requests don't grow any
  * mis-framing bugs. */
 #define CPUWORKER_REQUEST_MAGIC 0xda4afeed
@@ -120,6 +202,10 @@ typedef struct cpuworker_request_t {
 
   /** Flag: Are we timing this request? */
   unsigned timed : 1;
+  /** Flag: Should we time this request for the relay metrics?  We decide
+   * this on the main thread, since that's the only one that may look at
+   * or_metrics_enabled. */
+  unsigned metrics : 1;
   /** If we're timing this request, when was it sent to the cpuworker? */
   struct timeval started_at;
 
@@ -168,6 +254,17 @@ typedef struct cpuworker_job_u_t {
   } u;
 } cpuworker_job_t;
 
+/** A group of onion handshake jobs that a single cpuworker handles as one
+ * work item, so that they share one trip through the work queue and one
+ * reply. Every circuit in the batch has the batch's work queue entry as its
+ * workqueue_entry. */
+typedef struct cpuworker_batch_t {
+  /** Number of jobs in <b>jobs</b>. */
+  int n_jobs;
+  /** The jobs themselves. */
+  cpuworker_job_t *jobs[MAX_ONIONSKIN_BATCH];
+} cpuworker_batch_t;
+
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
 {
@@ -214,6 +311,13 @@ static uint64_t onionskins_usec_internal[MAX_ONION_HANDSHAKE_TYPE+1];
  * cpuworkers to give us answers for that kind of onionskin?
  */
 static uint64_t onionskins_usec_roundtrip[MAX_ONION_HANDSHAKE_TYPE+1];
+/** Indexed by handshake type: how many onionskins of that type have we sent
+ * to the cpuworkers? */
+static uint64_t onionskins_n_batched[MAX_ONION_HANDSHAKE_TYPE+1];
+/** Indexed by handshake type, corresponding to onionskins counted in
+ * onionskins_n_batched: the total size of the batches that those onionskins
+ * were sent in. */
+static uint64_t onionskins_batch_size_total[MAX_ONION_HANDSHAKE_TYPE+1];
 
 /** If any onionskin takes longer than this, we clip them to this
  * time. (microseconds) */
@@ -305,19 +409,52 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          "%s onionskins have averaged %u usec overhead (%.2f%%) in "
          "cpuworker code ",
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
+
+  if (onionskins_n_batched[onionskin_type]) {
+    log_fn(severity, LD_OR,
+           "%s onionskins have been sent to cpuworkers in batches of %.2f "
+           "on average.",
+           onionskin_type_name,
+           ((double)onionskins_batch_size_total[onionskin_type]) /
+           onionskins_n_batched[onionskin_type]);
+  }
 }
 
-/** Handle a reply from the worker threads. */
+/** Note that we are about to send an onionskin of type
+ * <b>onionskin_type</b> to a cpuworker in a batch of <b>batch_size</b>. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+note_onionskin_batched(uint16_t onionskin_type, int batch_size)
+{
+  if (onionskin_type > MAX_ONION_HANDSHAKE_TYPE) /* should be impossible */
+    return;
+  ++onionskins_n_batched[onionskin_type];
+  onionskins_batch_size_total[onionskin_type] += batch_size;
+  if (onionskins_n_batched[onionskin_type] >= 500000) {
+    onionskins_n_batched[onionskin_type] /= 2;
+    onionskins_batch_size_total[onionskin_type] /= 2;
+  }
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return how many onionskins of type <b>onionskin_type</b> we have counted
+ * as sent to the cpuworkers in batches. */
+STATIC uint64_t
+cpuworker_get_n_onionskins_batched(uint16_t onionskin_type)
+{
+  if (onionskin_type > MAX_ONION_HANDSHAKE_TYPE) /* should be impossible */
+    return 0;
+  return onionskins_n_batched[onionskin_type];
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Handle the reply to a single onion handshake <b>job</b>, and free the
+ * job. */
+static void
+cpuworker_onion_handshake_reply_job(cpuworker_job_t *job)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
-  tor_assert(total_pending_tasks > 0);
-  --total_pending_tasks;
-
   /* Could avoid this, but doesn't matter. */
   memcpy(&rpl, &job->u.reply, sizeof(rpl));
 
@@ -393,18 +530,30 @@ cpuworker_onion_handshake_replyfn(void *work_)
   memwipe(&rpl, 0, sizeof(rpl));
   memwipe(job, 0, sizeof(*job));
   tor_free(job);
+}
+
+/** Handle a reply from the worker threads. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
+{
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  tor_assert(total_pending_tasks >= batch->n_jobs);
+  total_pending_tasks -= batch->n_jobs;
+
+  for (i = 0; i < batch->n_jobs; ++i)
+    cpuworker_onion_handshake_reply_job(batch->jobs[i]);
+
+  tor_free(batch);
   queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
+/** Answer the onionskin in a single <b>job</b> using <b>onion_keys</b>. */
 static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+cpuworker_onion_handshake_job(server_onion_keys_t *onion_keys,
+                              cpuworker_job_t *job)
 {
-  worker_state_t *state = state_;
-  cpuworker_job_t *job = work_;
-
-  /* variables for onion processing */
-  server_onion_keys_t *onion_keys = state->onion_keys;
   cpuworker_request_t req;
   cpuworker_reply_t rpl;
 
@@ -417,10 +566,12 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
   created_cell_t *cell_out = &rpl.created_cell;
   struct timeval tv_start = {0,0}, tv_end;
   int n;
+  /* We also time every handshake while we're collecting relay metrics. */
+  const bool timed = req.timed || req.metrics;
   rpl.timed = req.timed;
   rpl.started_at = req.started_at;
   rpl.handshake_type = cc->handshake_type;
-  if (req.timed)
+  if (timed)
     tor_gettimeofday(&tv_start);
   n = onion_skin_server_handshake(cc->handshake_type,
                                   cc->onionskin, cc->handshake_len,
@@ -451,16 +602,18 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
     rpl.success = 1;
   }
   rpl.magic = CPUWORKER_REPLY_MAGIC;
-  if (req.timed) {
+  if (timed) {
     struct timeval tv_diff;
     int64_t usec;
     tor_gettimeofday(&tv_end);
     timersub(&tv_end, &tv_start, &tv_diff);
     usec = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
     if (usec < 0 || usec > MAX_BELIEVABLE_ONIONSKIN_DELAY)
-      rpl.n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
-    else
+      usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
+    if (req.timed)
       rpl.n_usec = (uint32_t) usec;
+    if (req.metrics)
+      or_metrics_note_onionskin_handshake(rpl.success, usec);
   }
 
   memcpy(&job->u.reply, &rpl, sizeof(rpl));
@@ -470,21 +623,162 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
   return WQ_RPL_REPLY;
 }
 
+/** Implementation function for onion handshake requests. */
+static workqueue_reply_t
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    workqueue_reply_t r =
+      cpuworker_onion_handshake_job(state->onion_keys, batch->jobs[i]);
+    if (r != WQ_RPL_REPLY)
+      return r;
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Return how many onionskins we should hand to a single cpuworker at once,
+ * when <b>n_queued</b> of them are waiting, the threadpool has
+ * <b>n_threads</b> threads, and we can send <b>room</b> more onionskins
+ * before we hit max_pending_tasks.
+ *
+ * We only batch when there is more queued work than there are threads:
+ * until then, it's better to spread the onionskins across the threads than
+ * to have one thread answer several of them while the others sit idle. */
+STATIC int
+cpuworker_onionskin_batch_size(int n_queued, int n_threads, int room)
+{
+  int n;
+  if (n_threads < 1)
+    n_threads = 1;
+  n = CEIL_DIV(n_queued, n_threads);
+  n = CLAMP(1, n, MAX_ONIONSKIN_BATCH);
+  return MAX(1, MIN(n, room));
+}
+
+/** Build and return a new job to answer <b>onionskin</b> for <b>circ</b>.
+ * Frees <b>onionskin</b>. */
+static cpuworker_job_t *
+cpuworker_job_new(or_circuit_t *circ, create_cell_t *onionskin)
+{
+  cpuworker_job_t *job;
+  cpuworker_request_t req;
+  int should_time;
+
+  if (!channel_is_client(circ->p_chan))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  should_time = should_time_request(onionskin->handshake_type);
+  memset(&req, 0, sizeof(req));
+  req.magic = CPUWORKER_REQUEST_MAGIC;
+  req.timed = should_time;
+  req.metrics = or_metrics_enabled;
+
+  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
+
+  tor_free(onionskin);
+
+  if (should_time)
+    tor_gettimeofday(&req.started_at);
+
+  job = tor_malloc_zero(sizeof(cpuworker_job_t));
+  job->circ = circ;
+  memcpy(&job->u.request, &req, sizeof(req));
+  memwipe(&req, 0, sizeof(req));
+
+  return job;
+}
+
+/** Send every job in <b>batch</b> to the cpuworkers as a single work item.
+ * If <b>requeue</b> is true, these jobs were already sent once, in a batch
+ * that we cancelled: don't count them again in our batch statistics.
+ *
+ * Return 0 on success.  On failure, free <b>batch</b> and its jobs, and
+ * return -1.  If <b>requeue</b> is true, also mark their circuits for close
+ * on failure, since nobody else is going to answer them. */
+static int
+cpuworker_queue_batch(cpuworker_batch_t *batch, int requeue)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  tor_assert(batch->n_jobs > 0);
+
+  total_pending_tasks += batch->n_jobs;
+  queue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                     cpuworker_onion_handshake_threadfn,
+                                     cpuworker_onion_handshake_replyfn,
+                                     batch);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    total_pending_tasks -= batch->n_jobs;
+    for (i = 0; i < batch->n_jobs; ++i) {
+      or_circuit_t *circ = batch->jobs[i]->circ;
+      circ->workqueue_entry = NULL;
+      if (requeue && !TO_CIRCUIT(circ)->marked_for_close)
+        circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+      memwipe(batch->jobs[i], 0, sizeof(cpuworker_job_t));
+      tor_free(batch->jobs[i]);
+    }
+    tor_free(batch);
+    return -1;
+  }
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    cpuworker_job_t *job = batch->jobs[i];
+    if (!requeue)
+      note_onionskin_batched(job->u.request.create_cell.handshake_type,
+                             batch->n_jobs);
+    job->circ->workqueue_entry = queue_entry;
+    log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
+              job, queue_entry, job->circ);
+  }
+
+  return 0;
+}
+
 /** Take pending tasks from the queue and assign them to cpuworkers. */
-static void
+STATIC void
 queue_pending_tasks(void)
 {
   or_circuit_t *circ;
   create_cell_t *onionskin = NULL;
+  int queue_empty = 0;
+
+  while (!queue_empty && total_pending_tasks < max_pending_tasks) {
+    cpuworker_batch_t *batch;
+    int n_queued = 0, batch_size;
+    uint16_t t;
+
+    for (t = 0; t <= MAX_ONION_HANDSHAKE_TYPE; ++t)
+      n_queued += onion_num_pending(t);
+    batch_size = cpuworker_onionskin_batch_size(n_queued,
+                                   n_cpuworker_threads,
+                                   max_pending_tasks - total_pending_tasks);
+
+    batch = tor_malloc_zero(sizeof(cpuworker_batch_t));
+    while (batch->n_jobs < batch_size) {
+      circ = onion_next_task(&onionskin);
+      if (!circ) {
+        queue_empty = 1;
+        break;
+      }
+      if (!circ->p_chan) {
+        log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+        tor_free(onionskin);
+        continue;
+      }
+      batch->jobs[batch->n_jobs++] = cpuworker_job_new(circ, onionskin);
+    }
 
-  while (total_pending_tasks < max_pending_tasks) {
-    circ = onion_next_task(&onionskin);
-
-    if (!circ)
-      return;
-
-    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0)
+    if (batch->n_jobs == 0) {
+      tor_free(batch);
+    } else if (cpuworker_queue_batch(batch, 0) < 0) {
       log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+    }
   }
 }
 
@@ -504,6 +798,14 @@ cpuworker_queue_work,(workqueue_priority_t priority,
                                         arg);
 }
 
+/** Try to cancel the work item <b>ent</b>. Return its argument if we
+ * cancelled it, or NULL if a cpuworker has already started on it. */
+MOCK_IMPL(STATIC void *,
+cpuworker_cancel_work,(workqueue_entry_t *ent))
+{
+  return workqueue_entry_cancel(ent);
+}
+
 /** Try to tell a cpuworker to perform the public key operations necessary to
  * respond to <b>onionskin</b> for the circuit <b>circ</b>.
  *
@@ -513,10 +815,7 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
-  cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
+  cpuworker_batch_t *batch;
 
   tor_assert(threadpool);
 
@@ -535,63 +834,175 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (!channel_is_client(circ->p_chan))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
+  batch = tor_malloc_zero(sizeof(cpuworker_batch_t));
+  batch->jobs[batch->n_jobs++] = cpuworker_job_new(circ, onionskin);
 
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  tor_free(onionskin);
+  return cpuworker_queue_batch(batch, 0);
+}
 
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
+/** If <b>circ</b> has a pending handshake that hasn't been processed yet,
+ * remove it from the worker queue. */
+void
+cpuworker_cancel_circ_handshake(or_circuit_t *circ)
+{
+  cpuworker_batch_t *batch;
+  int i, n_kept = 0;
+  if (circ->workqueue_entry == NULL)
+    return;
 
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
+  batch = cpuworker_cancel_work(circ->workqueue_entry);
+  if (batch) {
+    /* It successfully cancelled.  The other circuits in the batch still
+     * want their answers, so we queue them again without this one. */
+    tor_assert(total_pending_tasks >= batch->n_jobs);
+    total_pending_tasks -= batch->n_jobs;
+    for (i = 0; i < batch->n_jobs; ++i) {
+      cpuworker_job_t *job = batch->jobs[i];
+      if (job->circ == circ) {
+        memwipe(job, 0xe0, sizeof(*job));
+        tor_free(job);
+      } else {
+        batch->jobs[n_kept++] = job;
+      }
+    }
+    batch->n_jobs = n_kept;
+    /* if (!batch), this is done in cpuworker_onion_handshake_replyfn. */
+    circ->workqueue_entry = NULL;
 
-  ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
-    return -1;
+    if (n_kept == 0) {
+      tor_free(batch);
+    } else if (cpuworker_queue_batch(batch, 1) < 0) {
+      log_info(LD_OR, "Couldn't requeue the rest of a cancelled batch.");
+    }
   }
+}
 
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
+/** A set of calls that cpuworker_run_parallel() is waiting for. */
+typedef struct cpuworker_parallel_t {
+  /** Protects n_running. */
+  tor_mutex_t lock;
+  /** Signalled when n_running drops to zero. */
+  tor_cond_t cond;
+  /** How many calls have we handed to the threadpool that it hasn't
+   * finished yet? */
+  int n_running;
+} cpuworker_parallel_t;
+
+/** One call that cpuworker_run_parallel() has handed to the threadpool. */
+typedef struct cpuworker_parallel_job_t {
+  /** The set that this call belongs to. Only valid until the call is
+   * done. */
+  cpuworker_parallel_t *group;
+  /** The function to call, and its argument. */
+  void (*fn)(void *);
+  void *arg;
+  /** The threadpool's handle for this call. */
+  workqueue_entry_t *ent;
+} cpuworker_parallel_job_t;
+
+/** Worker-thread side of cpuworker_run_parallel(). */
+static workqueue_reply_t
+cpuworker_parallel_threadfn(void *state_, void *work_)
+{
+  cpuworker_parallel_job_t *job = work_;
+  cpuworker_parallel_t *group = job->group;
+  (void)state_;
 
-  circ->workqueue_entry = queue_entry;
+  job->fn(job->arg);
 
-  return 0;
+  tor_mutex_acquire(&group->lock);
+  if (--group->n_running == 0)
+    tor_cond_signal_all(&group->cond);
+  tor_mutex_release(&group->lock);
+  /* The main thread may free group as soon as we release the lock. */
+  return WQ_RPL_REPLY;
 }
 
-/** If <b>circ</b> has a pending handshake that hasn't been processed yet,
- * remove it from the worker queue. */
+/** Main-thread side of cpuworker_parallel_threadfn(), run once the reply
+ * comes back. cpuworker_run_parallel() is long done by then. */
+static void
+cpuworker_parallel_replyfn(void *work_)
+{
+  tor_free(work_);
+}
+
+/** Call <b>fn</b> on every element of <b>args</b>, and return once all of
+ * the calls are done.
+ *
+ * If the cpuworkers are running, hand all but the first call to them and
+ * make the first call ourselves. Then take back every call that no
+ * cpuworker has started yet and make it ourselves too, and finally wait
+ * for the cpuworkers to finish the rest. We never wait behind other work
+ * in the queue, so this is never slower than making every call ourselves.
+ *
+ * <b>fn</b> must be safe to call from any thread, and the calls must not
+ * depend on each other. */
 void
-cpuworker_cancel_circ_handshake(or_circuit_t *circ)
+cpuworker_run_parallel(void (*fn)(void *), void **args, int n_args)
 {
-  cpuworker_job_t *job;
-  if (circ->workqueue_entry == NULL)
+  cpuworker_parallel_t group;
+  cpuworker_parallel_job_t **jobs;
+  int i;
+
+  if (n_args <= 0)
     return;
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
-    /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
-    circ->workqueue_entry = NULL;
+  if (!threadpool || n_args == 1 || !in_main_thread()) {
+    for (i = 0; i < n_args; ++i)
+      fn(args[i]);
+    return;
+  }
+
+  memset(&group, 0, sizeof(group));
+  tor_mutex_init_for_cond(&group.lock);
+  tor_cond_init(&group.cond);
+
+  jobs = tor_calloc(n_args, sizeof(cpuworker_parallel_job_t *));
+  for (i = 1; i < n_args; ++i) {
+    cpuworker_parallel_job_t *job = tor_malloc_zero(sizeof(*job));
+    job->group = &group;
+    job->fn = fn;
+    job->arg = args[i];
+    tor_mutex_acquire(&group.lock);
+    ++group.n_running;
+    tor_mutex_release(&group.lock);
+    job->ent = threadpool_queue_work_priority(threadpool, WQ_PRI_HIGH,
+                                              cpuworker_parallel_threadfn,
+                                              cpuworker_parallel_replyfn,
+                                              job);
+    if (!job->ent) {
+      tor_mutex_acquire(&group.lock);
+      --group.n_running;
+      tor_mutex_release(&group.lock);
+      tor_free(job);
+    }
+    jobs[i] = job;
   }
+
+  fn(args[0]);
+
+  /* Take back the calls that are still waiting in the queue, starting with
+   * the ones that would have waited the longest. */
+  for (i = n_args - 1; i >= 1; --i) {
+    cpuworker_parallel_job_t *job = jobs[i];
+    if (!job) {
+      /* We couldn't queue this one. */
+      fn(args[i]);
+    } else if (workqueue_entry_cancel(job->ent)) {
+      tor_mutex_acquire(&group.lock);
+      --group.n_running;
+      tor_mutex_release(&group.lock);
+      tor_free(job);
+      fn(args[i]);
+    }
+  }
+
+  tor_mutex_acquire(&group.lock);
+  while (group.n_running > 0)
+    tor_cond_wait(&group.cond, &group.lock, NULL);
+  tor_mutex_release(&group.lock);
+
+  tor_cond_uninit(&group.cond);
+  tor_mutex_uninit(&group.lock);
+  tor_free(jobs);
 }
@@ -13,6 +13,7 @@
 #define TOR_CPUWORKER_H
 
 void cpu_init(void);
+int cpuworker_is_initialized(void);
 void cpuworkers_rotate_keyinfo(void);
 struct workqueue_entry_t;
 enum workqueue_reply_t;
@@ -23,6 +24,10 @@ MOCK_DECL(struct workqueue_entry_t *, cpuworker_queue_work, (
                     void (*reply_fn)(void *),
                     void *arg));
 
+/** Largest number of onionskins that we hand to a single cpuworker as one
+ * work item. */
+#define MAX_ONIONSKIN_BATCH 8
+
 struct create_cell_t;
 int assign_onionskin_to_cpuworker(or_circuit_t *circ,
                                   struct create_cell_t *onionskin);
@@ -31,7 +36,21 @@ uint64_t estimated_usec_for_onionskins(uint32_t n_requests,
                                        uint16_t onionskin_type);
 void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
+void cpuworker_log_reply_stats(int severity, time_t now);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+void cpuworker_run_parallel(void (*fn)(void *), void **args, int n_args);
+
+#ifdef CPUWORKER_PRIVATE
+STATIC int cpuworker_onionskin_batch_size(int n_queued, int n_threads,
+                                          int room);
+STATIC void queue_pending_tasks(void);
+#ifdef TOR_UNIT_TESTS
+STATIC uint64_t cpuworker_get_n_onionskins_batched(uint16_t onionskin_type);
+#endif
+MOCK_DECL(STATIC void *, cpuworker_cancel_work,
+          (struct workqueue_entry_t *ent));
+#endif
+
 #endif /* !defined(TOR_CPUWORKER_H) */
 
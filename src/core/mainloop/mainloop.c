@@ -53,6 +53,7 @@
 #include "app/config/statefile.h"
 #include "app/main/ntmain.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
@@ -66,6 +67,7 @@
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
 #include "core/or/dos.h"
+#include "core/or/relay.h"
 #include "core/or/status.h"
 #include "feature/client/addressmap.h"
 #include "feature/client/bridges.h"
@@ -263,6 +265,7 @@ connection_add_impl(connection_t *conn, int is_connecting)
     conn->write_event = tor_event_new(tor_libevent_get_base(),
          conn->s, EV_WRITE|EV_PERSIST, conn_write_callback, conn);
     /* XXXX CHECK FOR NULL RETURN! */
+    connection_uring_attach(conn);
   }
 
   log_debug(LD_NET,"new conn type %s, socket %d, address %s, n_conns %d.",
@@ -276,6 +279,7 @@ connection_add_impl(connection_t *conn, int is_connecting)
 void
 connection_unregister_events(connection_t *conn)
 {
+  connection_uring_detach(conn);
   if (conn->read_event) {
     if (event_del(conn->read_event))
       log_warn(LD_BUG, "Error removing read event for %d", (int)conn->s);
@@ -511,6 +515,9 @@ connection_is_reading(connection_t *conn)
 {
   tor_assert(conn);
 
+  if (conn->uring)
+    return connection_uring_is_reading(conn);
+
   return conn->reading_from_linked_conn ||
     (conn->read_event && event_pending(conn->read_event, EV_READ, NULL));
 }
@@ -619,6 +626,8 @@ connection_stop_reading,(connection_t *conn))
   if (conn->linked) {
     conn->reading_from_linked_conn = 0;
     connection_stop_reading_from_linked_conn(conn);
+  } else if (conn->uring) {
+    connection_uring_stop_reading(conn);
   } else {
     if (event_del(conn->read_event))
       log_warn(LD_NET, "Error from libevent setting read event state for %d "
@@ -642,6 +651,8 @@ connection_start_reading,(connection_t *conn))
     conn->reading_from_linked_conn = 1;
     if (connection_should_read_from_linked_conn(conn))
       connection_start_reading_from_linked_conn(conn);
+  } else if (conn->uring) {
+    connection_uring_start_reading(conn);
   } else {
     if (event_add(conn->read_event, NULL))
       log_warn(LD_NET, "Error from libevent setting read event state for %d "
@@ -657,6 +668,9 @@ connection_is_writing(connection_t *conn)
 {
   tor_assert(conn);
 
+  if (conn->uring)
+    return connection_uring_is_writing(conn);
+
   return conn->writing_to_linked_conn ||
     (conn->write_event && event_pending(conn->write_event, EV_WRITE, NULL));
 }
@@ -675,6 +689,8 @@ connection_stop_writing,(connection_t *conn))
     conn->writing_to_linked_conn = 0;
     if (conn->linked_conn)
       connection_stop_reading_from_linked_conn(conn->linked_conn);
+  } else if (conn->uring) {
+    connection_uring_stop_writing(conn);
   } else {
     if (event_del(conn->write_event))
       log_warn(LD_NET, "Error from libevent setting write event state for %d "
@@ -699,6 +715,8 @@ connection_start_writing,(connection_t *conn))
     if (conn->linked_conn &&
         connection_should_read_from_linked_conn(conn->linked_conn))
       connection_start_reading_from_linked_conn(conn->linked_conn);
+  } else if (conn->uring) {
+    connection_uring_start_writing(conn);
   } else {
     if (event_add(conn->write_event, NULL))
       log_warn(LD_NET, "Error from libevent setting write event state for %d "
@@ -947,6 +965,24 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
     close_closeable_connections();
 }
 
+/** Handle a read event on <b>conn</b>, exactly as if Libevent had told us
+ * that it was readable.  Used by backends (like connection_uring.c) that
+ * find out about readable connections without Libevent's help. */
+void
+connection_dispatch_read_event(connection_t *conn)
+{
+  conn_read_callback(conn->s, EV_READ, conn);
+}
+
+/** Handle a write event on <b>conn</b>, exactly as if Libevent had told us
+ * that it was writable.  Used by backends (like connection_uring.c) that
+ * find out about writable connections without Libevent's help. */
+void
+connection_dispatch_write_event(connection_t *conn)
+{
+  conn_write_callback(conn->s, EV_WRITE, conn);
+}
+
 /** If the connection at connection_array[i] is marked for close, then:
  *    - If it has data that it wants to flush, try to flush it.
  *    - If it _still_ has data to flush, and conn->hold_open_until_flushed is
@@ -1007,7 +1043,7 @@ conn_close_if_marked(int i)
       } else
         retval = -1; /* never flush non-open broken tls connections */
     } else {
-      retval = buf_flush_to_socket(conn->outbuf, conn->s, sz);
+      retval = connection_flush_to_socket(conn, sz);
     }
     if (retval >= 0 && /* Technically, we could survive things like
                           TLS_WANT_WRITE here. But don't bother for now. */
@@ -1357,6 +1393,7 @@ static int periodic_events_initialized = 0;
 CALLBACK(add_entropy);
 CALLBACK(check_expired_networkstatus);
 CALLBACK(clean_caches);
+CALLBACK(clean_cell_pools);
 CALLBACK(clean_consdiffmgr);
 CALLBACK(fetch_networkstatus);
 CALLBACK(heartbeat);
@@ -1386,6 +1423,7 @@ STATIC periodic_event_item_t mainloop_periodic_events[] = {
   /* Everyone needs to run these. They need to have very long timeouts for
    * that to be safe. */
   CALLBACK(add_entropy, ALL, 0),
+  CALLBACK(clean_cell_pools, ALL, 0),
   CALLBACK(heartbeat, ALL, 0),
   CALLBACK(reset_padding_counts, ALL, 0),
 
@@ -2017,6 +2055,20 @@ clean_caches_callback(time_t now, const or_options_t *options)
   return CLEAN_CACHES_INTERVAL;
 }
 
+/**
+ * Periodic callback: Give the memory for cell pool chunks that have stayed
+ * empty for a whole interval back to the OS.
+ */
+static int
+clean_cell_pools_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  cell_pools_clean(0);
+#define CLEAN_CELL_POOLS_INTERVAL 60
+  return CLEAN_CELL_POOLS_INTERVAL;
+}
+
 /**
  * Periodic callback: Clean the cache of failed hidden service lookups
  * frequently.
@@ -871,6 +871,8 @@ channel_init(channel_t *chan)
 
   /* Channel is not in the scheduler heap. */
   chan->sched_heap_idx = -1;
+  /* Nor in the KIST socket table. */
+  chan->sched_sock_idx = -1;
 
   tor_addr_make_unspec(&chan->addr_according_to_peer);
 }
@@ -942,6 +944,8 @@ channel_free_(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_clear_circid_map(chan);
+
   tor_free(chan);
 }
 
@@ -1013,6 +1017,8 @@ channel_force_xfree(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  channel_clear_circid_map(chan);
+
   tor_free(chan);
 }
 
@@ -20,6 +20,20 @@
 #define tor_timer_t timeout
 struct tor_timer_t;
 
+/**
+ * An open-addressed hash table mapping circuit IDs to the circuits that use
+ * them on a single channel.  Only circuitlist.c looks inside it.
+ */
+typedef struct chan_circid_map_t {
+  /** Array of mask+1 slots, or NULL if the map has never held anything. */
+  struct chan_circid_ent_t *ents;
+  /** One less than the number of slots in ents; always a power of two
+   * minus one. */
+  unsigned mask;
+  /** Number of slots in use. */
+  unsigned n_used;
+} chan_circid_map_t;
+
 /* Channel handler function pointer typedefs */
 typedef void (*channel_listener_fn_ptr)(channel_listener_t *, channel_t *);
 typedef void (*channel_cell_handler_fn_ptr)(channel_t *, cell_t *);
@@ -293,6 +307,11 @@ struct channel_t {
 
   /** Heap index for use by the scheduler */
   int sched_heap_idx;
+  /** Index of this channel's entry in the KIST socket table, or -1. */
+  int sched_sock_idx;
+  /** True iff this channel is on the KIST scheduler's list of channels with
+   * data to write to the kernel at the end of the current run. */
+  unsigned int sched_in_outbuf_table:1;
 
   /** Timestamps for both cell channels and listeners */
   time_t timestamp_created; /* Channel created */
@@ -409,6 +428,13 @@ struct channel_t {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /**
+   * Map from circuit ID to circuit for every circuit on this channel, along
+   * with placeholders for circuit IDs that we can't reuse yet because a
+   * DESTROY is pending.  Managed by circuitlist.c.
+   */
+  chan_circid_map_t circid_map;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
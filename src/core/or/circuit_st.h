@@ -17,6 +17,7 @@
 #include "lib/container/handles.h"
 
 #include "core/or/cell_queue_st.h"
+#include "core/or/oom_age.h"
 #include "ext/ht.h"
 
 struct hs_token_t;
@@ -146,8 +147,9 @@ struct circuit_t {
    * At maximum, this list contains 200 bytes plus the smartlist overhead. */
   smartlist_t *sendme_last_digests;
 
-  /** Temporary field used during circuits_handle_oom. */
-  uint32_t age_tmp;
+  /** Our entry in the OOM age index, keyed by the oldest cell queued on
+   * this circuit. */
+  oom_age_entry_t oom_age_entry;
 
   /** For storage while n_chan is pending (state CIRCUIT_STATE_CHAN_WAIT). */
   struct create_cell_t *n_chan_create_cell;
@@ -15,11 +15,12 @@
  * find which circuit it is associated with, based on the channel and the
  * circuit ID in the relay cell.
  *
- * To handle that, we maintain a global list of circuits, and a hashtable
- * mapping [channel,circID] pairs to circuits.  Circuits are added to and
- * removed from this mapping using circuit_set_p_circid_chan() and
- * circuit_set_n_circid_chan().  To look up a circuit from this map, most
- * callers should use circuit_get_by_circid_channel(), though
+ * To handle that, we maintain a global list of circuits, and for each
+ * channel, a small open-addressed hashtable mapping circIDs to circuits.
+ * Circuits are added to and removed from these maps using
+ * circuit_set_p_circid_chan() and circuit_set_n_circid_chan().  To look up
+ * a circuit from these maps, most callers should use
+ * circuit_get_by_circid_channel(), though
  * circuit_get_by_circid_channel_even_if_marked() is appropriate under some
  * circumstances.
  *
@@ -85,9 +86,11 @@
 #include "feature/relay/onion_queue.h"
 #include "core/crypto/onion_crypto.h"
 #include "core/crypto/onion_fast.h"
+#include "core/or/or_metrics.h"
 #include "core/or/policies.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/crypto/relay_crypto_pipeline.h"
 #include "feature/rend/rendclient.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/stats/predict_ports.h"
@@ -101,8 +104,10 @@
 #include "lib/compress/compress_zlib.h"
 #include "lib/compress/compress_zstd.h"
 #include "lib/buf/buffers.h"
+#include "lib/malloc/mempool.h"
 
 #include "core/or/ocirc_event.h"
+#include "core/or/oom_age.h"
 
 #include "ht.h"
 
@@ -177,57 +182,148 @@ CONST_TO_ORIGIN_CIRCUIT(const circuit_t *x)
   return DOWNCAST(origin_circuit_t, x);
 }
 
-/** A map from channel and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
-typedef struct chan_circid_circuit_map_t {
-  HT_ENTRY(chan_circid_circuit_map_t) node;
-  channel_t *chan;
-  circid_t circ_id;
+/** One slot in a channel's chan_circid_map_t.  (Lookup performance is
+ * very important here, since we need to do it every time a cell arrives,
+ * so we keep these small enough that four of them fit in a cache line.) */
+typedef struct chan_circid_ent_t {
+  /** The circuit using circ_id, CIRCID_PLACEHOLDER if circ_id is marked
+   * unusable, or NULL if this slot is empty. */
   circuit_t *circuit;
+  /** The circuit ID for this slot. */
+  circid_t circ_id;
   /* For debugging 12184: when was this placeholder item added? */
-  time_t made_placeholder_at;
-} chan_circid_circuit_map_t;
+  uint32_t made_placeholder_at;
+} chan_circid_ent_t;
 
-/** Helper for hash tables: compare the channel and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
- */
-static inline int
-chan_circid_entries_eq_(chan_circid_circuit_map_t *a,
-                        chan_circid_circuit_map_t *b)
-{
-  return a->chan == b->chan && a->circ_id == b->circ_id;
-}
-
-/** Helper: return a hash based on circuit ID and the pointer value of
- * chan in <b>a</b>. */
-static inline unsigned int
-chan_circid_entry_hash_(chan_circid_circuit_map_t *a)
-{
-  /* Try to squeze the siphash input into 8 bytes to save any extra siphash
-   * rounds.  This hash function is in the critical path. */
-  uintptr_t chan = (uintptr_t) (void*) a->chan;
-  uint32_t array[2];
-  array[0] = a->circ_id;
-  /* The low bits of the channel pointer are uninteresting, since the channel
-   * is a pretty big structure. */
-  array[1] = (uint32_t) (chan >> 6);
-  return (unsigned) siphash24g(array, sizeof(array));
-}
-
-/** Map from [chan,circid] to circuit. */
-static HT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
-     chan_circid_map = HT_INITIALIZER();
-HT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_);
-HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
-             tor_reallocarray_, tor_free_);
-
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
+/** Value for chan_circid_ent_t.circuit in a slot for a circuit ID that is
+ * reserved until we send a DESTROY, but that has no circuit. */
+#define CIRCID_PLACEHOLDER ((circuit_t *)(uintptr_t)1)
+
+/** Smallest number of slots that we allocate for a chan_circid_map_t. */
+#define CHAN_CIRCID_MAP_MIN_SIZE 8
+
+/** Helper: return the slot where we start looking for <b>circ_id</b> in a
+ * map with the given <b>mask</b>. */
+static inline unsigned
+chan_circid_slot(circid_t circ_id, unsigned mask)
+{
+  /* Circuit IDs are chosen by the other side of the channel, so we use a
+   * keyed hash to keep them from piling up in one run of slots.  This hash
+   * function is in the critical path. */
+  return ((unsigned) siphash24g(&circ_id, sizeof(circ_id))) & mask;
+}
+
+/** Return the slot for <b>circ_id</b> in <b>map</b>, or NULL if there is
+ * none. */
+static inline chan_circid_ent_t *
+chan_circid_map_find(const chan_circid_map_t *map, circid_t circ_id)
+{
+  unsigned i;
+  if (!map->ents)
+    return NULL;
+  for (i = chan_circid_slot(circ_id, map->mask); map->ents[i].circuit;
+       i = (i + 1) & map->mask) {
+    if (map->ents[i].circ_id == circ_id)
+      return &map->ents[i];
+  }
+  return NULL;
+}
+
+/** Rebuild <b>map</b> with <b>n_slots</b> slots, which must be a power of
+ * two large enough to hold all its entries. */
+static void
+chan_circid_map_resize(chan_circid_map_t *map, unsigned n_slots)
+{
+  chan_circid_ent_t *old = map->ents;
+  unsigned old_n_slots = old ? map->mask + 1 : 0;
+  unsigned i, j;
+
+  tor_assert(n_slots > map->n_used);
+  map->ents = tor_calloc(n_slots, sizeof(chan_circid_ent_t));
+  map->mask = n_slots - 1;
+  for (i = 0; i < old_n_slots; ++i) {
+    if (!old[i].circuit)
+      continue;
+    for (j = chan_circid_slot(old[i].circ_id, map->mask);
+         map->ents[j].circuit; j = (j + 1) & map->mask)
+      ;
+    map->ents[j] = old[i];
+  }
+  tor_free(old);
+}
+
+/** Return the slot for <b>circ_id</b> in <b>map</b>, adding an empty one
+ * if there is none.  The caller must set the circuit field of a new slot
+ * before doing anything else with the map. */
+static chan_circid_ent_t *
+chan_circid_map_find_or_add(chan_circid_map_t *map, circid_t circ_id)
+{
+  chan_circid_ent_t *ent = chan_circid_map_find(map, circ_id);
+  unsigned i;
+  if (ent)
+    return ent;
+
+  /* Keep the load factor at or below 3/4. */
+  if (!map->ents)
+    chan_circid_map_resize(map, CHAN_CIRCID_MAP_MIN_SIZE);
+  else if ((map->n_used + 1) * 4 > (map->mask + 1) * 3)
+    chan_circid_map_resize(map, (map->mask + 1) * 2);
+
+  for (i = chan_circid_slot(circ_id, map->mask); map->ents[i].circuit;
+       i = (i + 1) & map->mask)
+    ;
+  ++map->n_used;
+  ent = &map->ents[i];
+  ent->circ_id = circ_id;
+  ent->made_placeholder_at = 0;
+  return ent;
+}
+
+/** Remove the slot for <b>circ_id</b> from <b>map</b>.  Return true iff
+ * there was one. */
+static int
+chan_circid_map_remove(chan_circid_map_t *map, circid_t circ_id)
+{
+  chan_circid_ent_t *ent = chan_circid_map_find(map, circ_id);
+  unsigned hole, i, home;
+  if (!ent)
+    return 0;
+
+  /* Shift later members of the same run back into the hole, so that we
+   * never need tombstones. */
+  hole = (unsigned)(ent - map->ents);
+  for (i = (hole + 1) & map->mask; map->ents[i].circuit;
+       i = (i + 1) & map->mask) {
+    home = chan_circid_slot(map->ents[i].circ_id, map->mask);
+    /* Move entry i into the hole unless its home slot lies cyclically in
+     * (hole, i]. */
+    if (((i - home) & map->mask) >= ((i - hole) & map->mask)) {
+      map->ents[hole] = map->ents[i];
+      hole = i;
+    }
+  }
+  memset(&map->ents[hole], 0, sizeof(chan_circid_ent_t));
+  --map->n_used;
+
+  if (map->n_used == 0) {
+    tor_free(map->ents);
+    map->mask = 0;
+  } else if (map->mask + 1 > CHAN_CIRCID_MAP_MIN_SIZE &&
+             map->n_used * 8 < map->mask + 1) {
+    chan_circid_map_resize(map, (map->mask + 1) / 2);
+  }
+  return 1;
+}
+
+/** Release all storage held by the circuit ID map of <b>chan</b>.  Any
+ * circuits still there must not use <b>chan</b> again. */
+void
+channel_clear_circid_map(channel_t *chan)
+{
+  tor_free(chan->circid_map.ents);
+  chan->circid_map.mask = 0;
+  chan->circid_map.n_used = 0;
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
@@ -238,8 +334,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
                                circid_t id,
                                channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  chan_circid_ent_t *found;
   channel_t *old_chan, **chan_ptr;
   circid_t old_id, *circid_ptr;
   int make_active, attached = 0;
@@ -260,14 +355,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (id == old_id && chan == old_chan)
     return;
 
-  if (_last_circid_chan_ent &&
-      ((old_id == _last_circid_chan_ent->circ_id &&
-        old_chan == _last_circid_chan_ent->chan) ||
-       (id == _last_circid_chan_ent->circ_id &&
-        chan == _last_circid_chan_ent->chan))) {
-    _last_circid_chan_ent = NULL;
-  }
-
   if (old_chan) {
     /*
      * If we're changing channels or ID and had an old channel and a non
@@ -281,12 +368,8 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
       circuitmux_detach_circuit(old_chan->cmux, circ);
     }
 
-    /* we may need to remove it from the conn-circid map */
-    search.circ_id = old_id;
-    search.chan = old_chan;
-    found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
-    if (found) {
-      tor_free(found);
+    /* we may need to remove it from the old channel's circid map */
+    if (chan_circid_map_remove(&old_chan->circid_map, old_id)) {
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
         --(old_chan->num_n_circuits);
@@ -305,20 +388,10 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (chan == NULL)
     return;
 
-  /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.chan = chan;
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-  if (found) {
-    found->circuit = circ;
-    found->made_placeholder_at = 0;
-  } else {
-    found = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    found->circ_id = id;
-    found->chan = chan;
-    found->circuit = circ;
-    HT_INSERT(chan_circid_map, &chan_circid_map, found);
-  }
+  /* now add the new one to the new channel's circid map */
+  found = chan_circid_map_find_or_add(&chan->circid_map, id);
+  found->circuit = circ;
+  found->made_placeholder_at = 0;
 
   /*
    * Attach to the circuitmux if we're changing channels or IDs and
@@ -354,30 +427,23 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
 void
 channel_mark_circid_unusable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  chan_circid_ent_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_map_find(&chan->circid_map, id);
 
-  if (ent && ent->circuit) {
+  if (ent && ent->circuit != CIRCID_PLACEHOLDER) {
     /* we have a problem. */
     log_warn(LD_BUG, "Tried to mark %u unusable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
   } else if (ent) {
     /* It's already marked. */
     if (!ent->made_placeholder_at)
-      ent->made_placeholder_at = approx_time();
+      ent->made_placeholder_at = (uint32_t) approx_time();
   } else {
-    ent = tor_malloc_zero(sizeof(chan_circid_circuit_map_t));
-    ent->chan = chan;
-    ent->circ_id = id;
-    /* leave circuit at NULL. */
-    ent->made_placeholder_at = approx_time();
-    HT_INSERT(chan_circid_map, &chan_circid_map, ent);
+    ent = chan_circid_map_find_or_add(&chan->circid_map, id);
+    ent->circuit = CIRCID_PLACEHOLDER;
+    ent->made_placeholder_at = (uint32_t) approx_time();
   }
 }
 
@@ -387,22 +453,16 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
 void
 channel_mark_circid_usable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *ent;
+  chan_circid_ent_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
-  if (ent && ent->circuit) {
+  ent = chan_circid_map_find(&chan->circid_map, id);
+  if (ent && ent->circuit != CIRCID_PLACEHOLDER) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
     return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
-  tor_free(ent);
+  chan_circid_map_remove(&chan->circid_map, id);
 }
 
 /** Called to indicate that a DESTROY is pending on <b>chan</b> with
@@ -1001,6 +1061,8 @@ init_circuit_base(circuit_t *circ)
   circ->deliver_window = CIRCWINDOW_START;
   circuit_reset_sendme_randomness(circ);
   cell_queue_init(&circ->n_chan_cells);
+  oom_age_entry_init(&circ->oom_age_entry, OOM_AGE_KIND_CIRCUIT);
+  or_metrics_note_circuit(true);
 
   smartlist_add(circuit_get_global_list(), circ);
   circ->global_circuitlist_idx = smartlist_len(circuit_get_global_list()) - 1;
@@ -1205,6 +1267,7 @@ circuit_free_(circuit_t *circ)
 
     should_free = (ocirc->workqueue_entry == NULL);
 
+    relay_crypto_pipeline_circuit_free(ocirc);
     relay_crypto_clear(&ocirc->crypto);
 
     if (ocirc->rend_splice) {
@@ -1241,6 +1304,8 @@ circuit_free_(circuit_t *circ)
   /* Clear cell queue _after_ removing it from the map.  Otherwise our
    * "active" checks will be violated. */
   cell_queue_clear(&circ->n_chan_cells);
+  oom_age_index_remove(&circ->oom_age_entry);
+  or_metrics_note_circuit(false);
 
   /* Cleanup possible SENDME state. */
   if (circ->sendme_last_digests) {
@@ -1338,20 +1403,6 @@ circuit_free_all(void)
 
   smartlist_free(circuits_pending_other_guards);
   circuits_pending_other_guards = NULL;
-
-  {
-    chan_circid_circuit_map_t **elt, **next, *c;
-    for (elt = HT_START(chan_circid_map, &chan_circid_map);
-         elt;
-         elt = next) {
-      c = *elt;
-      next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
-
-      tor_assert(c->circuit == NULL);
-      tor_free(c);
-    }
-  }
-  HT_CLEAR(chan_circid_map, &chan_circid_map);
 }
 
 /** Release a crypt_path_reference_t*, which may be NULL. */
@@ -1459,20 +1510,10 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  const chan_circid_ent_t *found;
 
-  if (_last_circid_chan_ent &&
-      circ_id == _last_circid_chan_ent->circ_id &&
-      chan == _last_circid_chan_ent->chan) {
-    found = _last_circid_chan_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-    _last_circid_chan_ent = found;
-  }
-  if (found && found->circuit) {
+  found = chan_circid_map_find(&chan->circid_map, circ_id);
+  if (found && found->circuit != CIRCID_PLACEHOLDER) {
     log_debug(LD_CIRC,
               "circuit_get_by_circid_channel_impl() returning circuit %p for"
               " circ_id %u, channel ID %"PRIu64 " (%p)",
@@ -1568,19 +1609,14 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
-  chan_circid_circuit_map_t *found;
+  const chan_circid_ent_t *found;
 
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
+  found = chan_circid_map_find(&chan->circid_map, circ_id);
 
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-
-  if (! found || found->circuit)
+  if (! found || found->circuit != CIRCID_PLACEHOLDER)
     return 0;
 
-  return found->made_placeholder_at;
+  return (time_t) found->made_placeholder_at;
 }
 
 /** Return the circuit that a given edge connection is using. */
@@ -2424,6 +2460,7 @@ marked_circuit_free_cells(circuit_t *circ)
     or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
     cell_queue_clear(&orcirc->p_chan_cells);
   }
+  oom_age_index_remove(&circ->oom_age_entry);
 }
 
 static size_t
@@ -2446,6 +2483,7 @@ single_conn_free_bytes(connection_t *conn)
       dir_conn->compress_state = NULL;
     }
   }
+  oom_age_index_remove(&conn->oom_age_entry);
   return result;
 }
 
@@ -2503,6 +2541,28 @@ circuit_alloc_in_half_streams(const circuit_t *c)
     return 0;
 }
 
+/** Return the age of the oldest buffer chunk on <b>conn</b>, where age is
+ * taken in timestamp units before the time <b>now</b>.  If the connection has
+ * no data, treat it as having age zero.
+ **/
+static uint32_t
+conn_get_buffer_age(const connection_t *conn, uint32_t now_ts)
+{
+  uint32_t age = 0, age2;
+  if (conn->outbuf) {
+    age2 = buf_get_oldest_chunk_timestamp(conn->outbuf, now_ts);
+    if (age2 > age)
+      age = age2;
+  }
+  if (conn->inbuf) {
+    age2 = buf_get_oldest_chunk_timestamp(conn->inbuf, now_ts);
+    if (age2 > age)
+      age = age2;
+  }
+  return age;
+}
+
+#ifdef TOR_UNIT_TESTS
 /**
  * Return the age of the oldest cell queued on <b>c</b>, in timestamp units.
  * Return 0 if there are no cells queued on c.  Requires that <b>now</b> be
@@ -2531,27 +2591,6 @@ circuit_max_queued_cell_age(const circuit_t *c, uint32_t now)
   return age;
 }
 
-/** Return the age of the oldest buffer chunk on <b>conn</b>, where age is
- * taken in timestamp units before the time <b>now</b>.  If the connection has
- * no data, treat it as having age zero.
- **/
-static uint32_t
-conn_get_buffer_age(const connection_t *conn, uint32_t now_ts)
-{
-  uint32_t age = 0, age2;
-  if (conn->outbuf) {
-    age2 = buf_get_oldest_chunk_timestamp(conn->outbuf, now_ts);
-    if (age2 > age)
-      age = age2;
-  }
-  if (conn->inbuf) {
-    age2 = buf_get_oldest_chunk_timestamp(conn->inbuf, now_ts);
-    if (age2 > age)
-      age = age2;
-  }
-  return age;
-}
-
 /** Return the age in timestamp units of the oldest buffer chunk on any stream
  * in the linked list <b>stream</b>, where age is taken in timestamp units
  * before the timestamp <b>now</b>. */
@@ -2601,67 +2640,153 @@ circuit_max_queued_item_age(const circuit_t *c, uint32_t now)
   else
     return data_age;
 }
+#endif /* defined(TOR_UNIT_TESTS) */
 
-/** Helper to sort a list of circuit_t by age of oldest item, in descending
- * order. */
-static int
-circuits_compare_by_oldest_queued_item_(const void **a_, const void **b_)
+/** Update <b>circ</b>'s entry in the OOM age index to match the oldest cell
+ * in its cell queues.  Call this whenever a cell is added to an empty cell
+ * queue on <b>circ</b>, or removed from the head of one. */
+void
+circuit_update_oom_age(circuit_t *circ)
 {
-  const circuit_t *a = *a_;
-  const circuit_t *b = *b_;
-  uint32_t age_a = a->age_tmp;
-  uint32_t age_b = b->age_tmp;
+  const packed_cell_t *cell, *cell2 = NULL;
 
-  if (age_a < age_b)
-    return 1;
-  else if (age_a == age_b)
-    return 0;
+  cell = TOR_SIMPLEQ_FIRST(&circ->n_chan_cells.head);
+  if (CIRCUIT_IS_ORCIRC(circ))
+    cell2 = TOR_SIMPLEQ_FIRST(&TO_OR_CIRCUIT(circ)->p_chan_cells.head);
+
+  if (!cell || (cell2 && (int32_t)(cell2->inserted_timestamp -
+                                   cell->inserted_timestamp) < 0))
+    cell = cell2;
+
+  if (cell)
+    oom_age_index_update(&circ->oom_age_entry, cell->inserted_timestamp);
   else
-    return -1;
+    oom_age_index_remove(&circ->oom_age_entry);
 }
 
-static uint32_t now_ts_for_buf_cmp;
-
-/** Helper to sort a list of circuit_t by age of oldest item, in descending
- * order. */
-static int
-conns_compare_by_buffer_age_(const void **a_, const void **b_)
+/** State for circuits_handle_oom() as it walks the OOM age index. */
+typedef struct oom_walk_state_t {
+  /** The current coarse timestamp. */
+  uint32_t now;
+  /** How many bytes do we want to recover? */
+  size_t mem_to_recover;
+  /** How many bytes have we recovered so far? */
+  size_t mem_recovered;
+  /** How many circuits have we killed? */
+  int n_circuits_killed;
+  /** How many non-linked directory connections have we killed? */
+  int n_dirconns_killed;
+} oom_walk_state_t;
+
+/** Kill <b>circ</b> and aggressively free its queues and stream buffers,
+ * recording what we recovered in <b>st</b>. */
+static void
+circuit_kill_for_oom(circuit_t *circ, oom_walk_state_t *st)
 {
-  const connection_t *a = *a_;
-  const connection_t *b = *b_;
-  time_t age_a = conn_get_buffer_age(a, now_ts_for_buf_cmp);
-  time_t age_b = conn_get_buffer_age(b, now_ts_for_buf_cmp);
+  size_t n = n_cells_in_circ_queues(circ);
+  const size_t half_stream_alloc = circuit_alloc_in_half_streams(circ);
+  size_t freed;
 
-  if (age_a < age_b)
-    return 1;
-  else if (age_a == age_b)
-    return 0;
-  else
-    return -1;
+  if (! circ->marked_for_close) {
+    circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+  }
+  marked_circuit_free_cells(circ);
+  freed = marked_circuit_free_stream_bytes(circ);
+
+  ++st->n_circuits_killed;
+
+  st->mem_recovered += n * packed_cell_mem_cost();
+  st->mem_recovered += half_stream_alloc;
+  st->mem_recovered += freed;
 }
 
-#define FRACTION_OF_DATA_TO_RETAIN_ON_OOM 0.90
+/** Return the circuit that holds the data in <b>conn</b>'s buffers: the
+ * circuit of <b>conn</b> if it is a stream, or the circuit of the stream
+ * <b>conn</b> is linked to.  Return NULL if there is no such circuit. */
+static circuit_t *
+conn_get_oom_circuit(connection_t *conn)
+{
+  if (!CONN_IS_EDGE(conn) && conn->linked_conn)
+    conn = conn->linked_conn;
+  if (!CONN_IS_EDGE(conn))
+    return NULL;
+  return TO_EDGE_CONN(conn)->on_circuit;
+}
 
-/** We're out of memory for cells, having allocated <b>current_allocation</b>
- * bytes' worth.  Kill the 'worst' circuits until we're under
- * FRACTION_OF_DATA_TO_RETAIN_ON_OOM of our maximum usage. */
-void
-circuits_handle_oom(size_t current_allocation)
+/** Callback for oom_age_index_walk(): reclaim the memory used by the
+ * circuit or connection that owns <b>ent</b>.  <b>arg</b> is an
+ * oom_walk_state_t. */
+static int
+circuits_handle_oom_visit_(oom_age_entry_t *ent, void *arg)
 {
-  smartlist_t *circlist;
-  smartlist_t *connection_array = get_connection_array();
-  int conn_idx;
-  size_t mem_to_recover;
-  size_t mem_recovered=0;
-  int n_circuits_killed=0;
-  int n_dirconns_killed=0;
-  uint32_t now_ts;
+  oom_walk_state_t *st = arg;
+
+  if (ent->kind == OOM_AGE_KIND_CIRCUIT) {
+    circuit_kill_for_oom(SUBTYPE_P(ent, circuit_t, oom_age_entry), st);
+  } else if (ent->kind == OOM_AGE_KIND_CONNECTION) {
+    connection_t *conn = SUBTYPE_P(ent, connection_t, oom_age_entry);
+    circuit_t *circ;
+    uint32_t stamp;
+
+    /* We don't update the index when data leaves a buffer, so the entry
+     * may be out of date.  If it is, put it where it belongs; we'll get
+     * back to it if we need to. */
+    if (buf_datalen(conn->inbuf) == 0 && buf_datalen(conn->outbuf) == 0) {
+      oom_age_index_remove(ent);
+      return OOM_AGE_WALK_CONTINUE;
+    }
+    stamp = st->now - conn_get_buffer_age(conn, st->now);
+    if (stamp != ent->stamp) {
+      oom_age_index_update(ent, stamp);
+      return OOM_AGE_WALK_CONTINUE;
+    }
+
+    if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) {
+      /* Free storage in non-linked directory connections. */
+      if (!conn->marked_for_close)
+        connection_mark_for_close(conn);
+      st->mem_recovered += single_conn_free_bytes(conn);
+      ++st->n_dirconns_killed;
+    } else if ((circ = conn_get_oom_circuit(conn))) {
+      /* This is a stream (or linked to one): kill its circuit. */
+      circuit_kill_for_oom(circ, st);
+    } else {
+      return OOM_AGE_WALK_CONTINUE;
+    }
+  } else {
+    return OOM_AGE_WALK_CONTINUE;
+  }
+
+  if (st->mem_recovered >= st->mem_to_recover)
+    return OOM_AGE_WALK_STOP;
+  return OOM_AGE_WALK_CONTINUE;
+}
+
+/** We're out of memory for cells.  Kill the 'worst' circuits until we have
+ * recovered at least <b>min_remove_bytes</b> bytes, and return the number of
+ * bytes we recovered.  This is the OOM handler that memacct_handle_oom()
+ * calls for cell queues.
+ *
+ * The worst circuits are the ones with the oldest queued data, in their
+ * cell queues or in the buffers of their streams.  We also kill non-linked
+ * directory connections with old enough data.  We find them all with the
+ * OOM age index, so that the work we do here is proportional to the number
+ * of things we kill, not to the number of things we have. */
+size_t
+circuits_handle_oom(time_t now, size_t min_remove_bytes)
+{
+  oom_walk_state_t st;
+  size_t pool_mem_released;
+  mp_pool_stats_t cell_pool_stats;
+  cell_pool_get_stats(&cell_pool_stats);
   log_notice(LD_GENERAL, "We're low on memory (cell queues total alloc:"
              " %"TOR_PRIuSZ" buffer total alloc: %" TOR_PRIuSZ ","
              " tor compress total alloc: %" TOR_PRIuSZ
              " (zlib: %" TOR_PRIuSZ ", zstd: %" TOR_PRIuSZ ","
              " lzma: %" TOR_PRIuSZ "),"
-             " rendezvous cache total alloc: %" TOR_PRIuSZ "). Killing"
+             " rendezvous cache total alloc: %" TOR_PRIuSZ ","
+             " cell pool: %" TOR_PRIuSZ " cells in use, %" TOR_PRIuSZ
+             " bytes mapped). Killing"
              " circuits withover-long queues. (This behavior is controlled by"
              " MaxMemInQueues.)",
              cell_queues_get_total_allocation(),
@@ -2670,99 +2795,35 @@ circuits_handle_oom(size_t current_allocation)
              tor_zlib_get_total_allocation(),
              tor_zstd_get_total_allocation(),
              tor_lzma_get_total_allocation(),
-             rend_cache_get_total_allocation());
-
-  {
-    size_t mem_target = (size_t)(get_options()->MaxMemInQueues *
-                                 FRACTION_OF_DATA_TO_RETAIN_ON_OOM);
-    if (current_allocation <= mem_target)
-      return;
-    mem_to_recover = current_allocation - mem_target;
-  }
-
-  now_ts = monotime_coarse_get_stamp();
-
-  circlist = circuit_get_global_list();
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->age_tmp = circuit_max_queued_item_age(circ, now_ts);
-  } SMARTLIST_FOREACH_END(circ);
+             rend_cache_get_total_allocation(),
+             cell_pool_stats.n_items_used,
+             cell_pool_stats.n_bytes_mapped);
 
-  /* This is O(n log n); there are faster algorithms we could use instead.
-   * Let's hope this doesn't happen enough to be in the critical path. */
-  smartlist_sort(circlist, circuits_compare_by_oldest_queued_item_);
-
-  /* Fix up the indices before we run into trouble */
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->global_circuitlist_idx = circ_sl_idx;
-  } SMARTLIST_FOREACH_END(circ);
-
-  /* Now sort the connection array ... */
-  now_ts_for_buf_cmp = now_ts;
-  smartlist_sort(connection_array, conns_compare_by_buffer_age_);
-  now_ts_for_buf_cmp = 0;
-
-  /* Fix up the connection array to its new order. */
-  SMARTLIST_FOREACH_BEGIN(connection_array, connection_t *, conn) {
-    conn->conn_array_index = conn_sl_idx;
-  } SMARTLIST_FOREACH_END(conn);
-
-  /* Okay, now the worst circuits and connections are at the front of their
-   * respective lists. Let's mark them, and reclaim their storage
-   * aggressively. */
-  conn_idx = 0;
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    size_t n;
-    size_t freed;
-
-    /* Free storage in any non-linked directory connections that have buffered
-     * data older than this circuit. */
-    while (conn_idx < smartlist_len(connection_array)) {
-      connection_t *conn = smartlist_get(connection_array, conn_idx);
-      uint32_t conn_age = conn_get_buffer_age(conn, now_ts);
-      if (conn_age < circ->age_tmp) {
-        break;
-      }
-      if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) {
-        if (!conn->marked_for_close)
-          connection_mark_for_close(conn);
-        mem_recovered += single_conn_free_bytes(conn);
+  (void) now;
 
-        ++n_dirconns_killed;
+  memset(&st, 0, sizeof(st));
+  st.mem_to_recover = min_remove_bytes;
+  st.now = monotime_coarse_get_stamp();
 
-        if (mem_recovered >= mem_to_recover)
-          goto done_recovering_mem;
-      }
-      ++conn_idx;
-    }
-
-    /* Now, kill the circuit. */
-    n = n_cells_in_circ_queues(circ);
-    const size_t half_stream_alloc = circuit_alloc_in_half_streams(circ);
-    if (! circ->marked_for_close) {
-      circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
-    }
-    marked_circuit_free_cells(circ);
-    freed = marked_circuit_free_stream_bytes(circ);
-
-    ++n_circuits_killed;
-
-    mem_recovered += n * packed_cell_mem_cost();
-    mem_recovered += half_stream_alloc;
-    mem_recovered += freed;
-
-    if (mem_recovered >= mem_to_recover)
-      goto done_recovering_mem;
-  } SMARTLIST_FOREACH_END(circ);
+  /* Visit circuits and connections from the one with the oldest queued
+   * data onwards, killing them until we have recovered enough. */
+  oom_age_index_walk(st.now, circuits_handle_oom_visit_, &st);
 
- done_recovering_mem:
+  /* The cells we just freed went back to their pools; give the chunks that
+   * are now empty back to the OS. */
+  pool_mem_released = cell_pools_clean(1);
 
   log_notice(LD_GENERAL, "Removed %"TOR_PRIuSZ" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
-             "connections.",
-             mem_recovered,
-             n_circuits_killed,
-             smartlist_len(circlist) - n_circuits_killed,
-             n_dirconns_killed);
+             "connections. Released %"TOR_PRIuSZ" bytes of idle cell pool "
+             "memory.",
+             st.mem_recovered,
+             st.n_circuits_killed,
+             smartlist_len(circuit_get_global_list()) - st.n_circuits_killed,
+             st.n_dirconns_killed,
+             pool_mem_released);
+
+  return st.mem_recovered;
 }
 
 /** Verify that circuit <b>c</b> has all of its invariants
@@ -22,6 +22,14 @@
  * that has elapsed since the tick.  We do re-scale the circuits on the
  * circuitmux periodically, so that we don't overflow double.
  *
+ * That periodic rescale touches every active circuit on the circuitmux.
+ * The ewma_lazy_policy variant avoids it: it stores the logarithm of each
+ * circuit's cell count, scaled relative to a single fixed point in the
+ * past.  Cells sent later just have a larger logarithmic weight, which
+ * grows linearly with time and so can't overflow in practice.  Since all
+ * circuits share the same reference point, their order never changes
+ * unless they send cells, and nothing ever needs to be rescaled.
+ *
  *
  * This module should be used through the interfaces in circuitmux.c, which it
  * implements.
@@ -70,16 +78,24 @@ static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
 static void scale_active_circuits(ewma_policy_data_t *pol,
                                   unsigned cur_tick);
+static inline double log_add_exp(double a, double b);
 
 /*** Circuitmux policy methods ***/
 
 static circuitmux_policy_data_t * ewma_alloc_cmux_data(circuitmux_t *cmux);
+static circuitmux_policy_data_t *
+ewma_lazy_alloc_cmux_data(circuitmux_t *cmux);
 static void ewma_free_cmux_data(circuitmux_t *cmux,
                                 circuitmux_policy_data_t *pol_data);
 static circuitmux_policy_circ_data_t *
 ewma_alloc_circ_data(circuitmux_t *cmux, circuitmux_policy_data_t *pol_data,
                      circuit_t *circ, cell_direction_t direction,
                      unsigned int cell_count);
+static circuitmux_policy_circ_data_t *
+ewma_lazy_alloc_circ_data(circuitmux_t *cmux,
+                          circuitmux_policy_data_t *pol_data,
+                          circuit_t *circ, cell_direction_t direction,
+                          unsigned int cell_count);
 static void
 ewma_free_circ_data(circuitmux_t *cmux,
                     circuitmux_policy_data_t *pol_data,
@@ -116,6 +132,10 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
  */
 static double ewma_scale_factor = 0.1;
 
+/** The negative natural logarithm of ewma_scale_factor: how much the
+ * logarithmic weight of a cell grows per tick in ewma_lazy_policy. */
+static double ewma_log_growth_per_tick = 2.302585092994046;
+
 /*** EWMA circuitmux_policy_t method table ***/
 
 circuitmux_policy_t ewma_policy = {
@@ -131,12 +151,33 @@ circuitmux_policy_t ewma_policy = {
   /*.cmp_cmux =*/ ewma_cmp_cmux
 };
 
+/*** Lazily scaled EWMA circuitmux_policy_t method table ***/
+
+circuitmux_policy_t ewma_lazy_policy = {
+  /*.alloc_cmux_data =*/ ewma_lazy_alloc_cmux_data,
+  /*.free_cmux_data =*/ ewma_free_cmux_data,
+  /*.alloc_circ_data =*/ ewma_lazy_alloc_circ_data,
+  /*.free_circ_data =*/ ewma_free_circ_data,
+  /*.notify_circ_active =*/ ewma_notify_circ_active,
+  /*.notify_circ_inactive =*/ ewma_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL, /* EWMA doesn't need this */
+  /*.notify_xmit_cells =*/ ewma_notify_xmit_cells,
+  /*.pick_active_circuit =*/ ewma_pick_active_circuit,
+  /*.cmp_cmux =*/ ewma_cmp_cmux
+};
+
 /** Have we initialized the ewma tick-counting logic? */
 static int ewma_ticks_initialized = 0;
 /** At what monotime_coarse_t did the current tick begin? */
 static monotime_coarse_t start_of_current_tick;
 /** What is the number of the current tick? */
 static unsigned current_tick_num;
+/** For ewma_lazy_policy: the logarithmic weight of a cell sent at the start
+ * of lazy_base_tick. */
+static double lazy_base_log_weight;
+/** For ewma_lazy_policy: the tick at which we last changed
+ * ewma_log_growth_per_tick. */
+static unsigned lazy_base_tick;
 
 /*** EWMA method implementations using the below EWMA helper functions ***/
 
@@ -171,6 +212,21 @@ ewma_alloc_cmux_data(circuitmux_t *cmux)
   return TO_CMUX_POL_DATA(pol);
 }
 
+/**
+ * As ewma_alloc_cmux_data(), but for ewma_lazy_policy.
+ */
+
+static circuitmux_policy_data_t *
+ewma_lazy_alloc_cmux_data(circuitmux_t *cmux)
+{
+  ewma_policy_data_t *pol = TO_EWMA_POL_DATA(ewma_alloc_cmux_data(cmux));
+
+  tor_assert(pol);
+  pol->lazy_scaling = 1;
+
+  return TO_CMUX_POL_DATA(pol);
+}
+
 /**
  * Free an ewma_policy_data_t allocated with ewma_alloc_cmux_data()
  */
@@ -234,6 +290,27 @@ ewma_alloc_circ_data(circuitmux_t *cmux,
   return TO_CMUX_POL_CIRC_DATA(cdata);
 }
 
+/**
+ * As ewma_alloc_circ_data(), but for ewma_lazy_policy.
+ */
+
+static circuitmux_policy_circ_data_t *
+ewma_lazy_alloc_circ_data(circuitmux_t *cmux,
+                          circuitmux_policy_data_t *pol_data,
+                          circuit_t *circ,
+                          cell_direction_t direction,
+                          unsigned int cell_count)
+{
+  ewma_policy_circ_data_t *cdata = TO_EWMA_POL_CIRC_DATA(
+      ewma_alloc_circ_data(cmux, pol_data, circ, direction, cell_count));
+
+  tor_assert(cdata);
+  /* The logarithm of a count of zero. */
+  cdata->cell_ewma.cell_count = -HUGE_VAL;
+
+  return TO_CMUX_POL_CIRC_DATA(cdata);
+}
+
 /**
  * Free an ewma_policy_circ_data_t allocated with ewma_alloc_circ_data()
  */
@@ -336,20 +413,29 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
-  /* Rescale the EWMAs if needed */
   tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
+  cell_ewma = &(cdata->cell_ewma);
 
-  if (tick != pol->active_circuit_pqueue_last_recalibrated) {
-    scale_active_circuits(pol, tick);
-  }
+  if (pol->lazy_scaling) {
+    /* Add the weight of these cells in log space; nothing else needs to
+     * change. */
+    ewma_increment = log((double)n_cells) +
+      cell_ewma_get_log_weight(tick, fractional_tick);
+    cell_ewma->cell_count = log_add_exp(cell_ewma->cell_count,
+                                        ewma_increment);
+  } else {
+    /* Rescale the EWMAs if needed */
+    if (tick != pol->active_circuit_pqueue_last_recalibrated) {
+      scale_active_circuits(pol, tick);
+    }
 
-  /* How much do we adjust the cell count in cell_ewma by? */
-  ewma_increment =
-    ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
+    /* How much do we adjust the cell count in cell_ewma by? */
+    ewma_increment =
+      ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
 
-  /* Do the adjustment */
-  cell_ewma = &(cdata->cell_ewma);
-  cell_ewma->cell_count += ewma_increment;
+    /* Do the adjustment */
+    cell_ewma->cell_count += ewma_increment;
+  }
 
   /*
    * Since we just sent on this circuit, it should be at the head of
@@ -508,6 +594,8 @@ cell_ewma_initialize_ticks(void)
     return;
   monotime_coarse_get(&start_of_current_tick);
   crypto_rand((char*)&current_tick_num, sizeof(current_tick_num));
+  lazy_base_tick = current_tick_num;
+  lazy_base_log_weight = 0.0;
   ewma_ticks_initialized = 1;
 }
 
@@ -539,6 +627,35 @@ cell_ewma_get_current_tick_and_fraction(double *remainder_out)
   return current_tick_num;
 }
 
+#ifdef TOR_UNIT_TESTS
+/** Move the EWMA clock forward by <b>n_ticks</b> whole ticks, exactly as if
+ * that much time had passed. */
+void
+cell_ewma_advance_ticks_for_testing(unsigned n_ticks)
+{
+  cell_ewma_initialize_ticks();
+  current_tick_num += n_ticks;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Return the natural logarithm of the weight, relative to the fixed
+ * starting point that ewma_lazy_policy uses, of a cell sent
+ * <b>fractional_tick</b> of the way through <b>tick</b>.
+ *
+ * A cell sent one tick later weighs 1/ewma_scale_factor times as much, so
+ * this grows linearly with time.  Since every lazily scaled cell count is
+ * a sum of such weights, their order is the same as if we had rescaled
+ * them all to the current tick. */
+STATIC double
+cell_ewma_get_log_weight(unsigned tick, double fractional_tick)
+{
+  /* This math can wrap around, but that's okay: unsigned overflow is
+     well-defined */
+  int diff = (int)(tick - lazy_base_tick);
+  return lazy_base_log_weight +
+    (diff + fractional_tick) * ewma_log_growth_per_tick;
+}
+
 /* Default value for the CircuitPriorityHalflifeMsec consensus parameter in
  * msec. */
 #define CMUX_PRIORITY_HALFLIFE_MSEC_DEFAULT 30000
@@ -597,11 +714,18 @@ void
 cmux_ewma_set_options(const or_options_t *options,
                       const networkstatus_t *consensus)
 {
-  double halflife;
+  double halflife, fractional_tick;
   const char *source;
+  unsigned tick;
 
   cell_ewma_initialize_ticks();
 
+  /* Cells that ewma_lazy_policy has already counted keep the weight they
+   * got under the old scale factor: only the growth from now on changes. */
+  tick = cell_ewma_get_current_tick_and_fraction(&fractional_tick);
+  lazy_base_log_weight = cell_ewma_get_log_weight(tick, 0.0);
+  lazy_base_tick = tick;
+
   /* Both options and consensus can be NULL. This assures us to either get a
    * valid configured value or the default one. */
   halflife = get_circuit_priority_halflife(options, consensus, &source);
@@ -610,6 +734,7 @@ cmux_ewma_set_options(const or_options_t *options,
   halflife /= EWMA_TICK_LEN;
   /* compute per-tick scale factor. */
   ewma_scale_factor = exp(LOG_ONEHALF / halflife);
+  ewma_log_growth_per_tick = -LOG_ONEHALF / halflife;
   log_info(LD_OR,
            "Enabled cell_ewma algorithm because of value in %s; "
            "scale factor is %f per %d seconds",
@@ -627,6 +752,19 @@ get_scale_factor(unsigned from_tick, unsigned to_tick)
   return pow(ewma_scale_factor, diff);
 }
 
+/** Return log(exp(<b>a</b>) + exp(<b>b</b>)), without overflowing when
+ * <b>a</b> and <b>b</b> are large.  Either may be -HUGE_VAL, but not both. */
+static inline double
+log_add_exp(double a, double b)
+{
+  if (a < b) {
+    double tmp = a;
+    a = b;
+    b = tmp;
+  }
+  return a + log1p(exp(b - a));
+}
+
 /** Adjust the cell count of <b>ewma</b> so that it is scaled with respect to
  * <b>cur_tick</b> */
 static void
@@ -674,9 +812,11 @@ add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
   tor_assert(ewma);
   tor_assert(ewma->heap_index == -1);
 
-  scale_single_cell_ewma(
-      ewma,
-      pol->active_circuit_pqueue_last_recalibrated);
+  if (!pol->lazy_scaling) {
+    scale_single_cell_ewma(
+        ewma,
+        pol->active_circuit_pqueue_last_recalibrated);
+  }
 
   smartlist_pqueue_add(pol->active_circuit_pqueue,
                        compare_cell_ewma_counts,
@@ -712,6 +852,16 @@ pop_first_cell_ewma(ewma_policy_data_t *pol)
                               offsetof(cell_ewma_t, heap_index));
 }
 
+/** Return the circuitmux policy that new channels should use, given
+ * <b>options</b>. */
+const circuitmux_policy_t *
+cmux_ewma_get_policy(const or_options_t *options)
+{
+  if (options && options->CircuitPriorityLazyScaling)
+    return &ewma_lazy_policy;
+  return &ewma_policy;
+}
+
 /**
  * Drop all resources held by circuitmux_ewma.c, and deinitialize the
  * module. */
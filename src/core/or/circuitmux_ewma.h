@@ -14,13 +14,22 @@
 
 /* The public EWMA policy callbacks object. */
 extern circuitmux_policy_t ewma_policy;
+/* The same policy, with EWMA values kept in a form that never needs
+ * rescaling. */
+extern circuitmux_policy_t ewma_lazy_policy;
 
 /* Externally visible EWMA functions */
 void cmux_ewma_set_options(const or_options_t *options,
                            const networkstatus_t *consensus);
 
+const circuitmux_policy_t *cmux_ewma_get_policy(const or_options_t *options);
+
 void circuitmux_ewma_free_all(void);
 
+#ifdef TOR_UNIT_TESTS
+void cell_ewma_advance_ticks_for_testing(unsigned n_ticks);
+#endif
+
 #ifdef CIRCUITMUX_EWMA_PRIVATE
 
 /*** EWMA structures ***/
@@ -43,7 +52,11 @@ struct cell_ewma_t {
    * since the start of this tick have weight greater than 1.0; ones sent
    * earlier have less weight. */
   unsigned int last_adjusted_tick;
-  /** The EWMA of the cell count. */
+  /** The EWMA of the cell count.
+   *
+   * For ewma_lazy_policy, this is instead the natural logarithm of the cell
+   * count scaled to a fixed point in the past (or -HUGE_VAL for no cells);
+   * see cell_ewma_get_log_weight(). */
   double cell_count;
   /** True iff this is the cell count for a circuit's previous
    * channel. */
@@ -70,6 +83,13 @@ struct ewma_policy_data_t {
    * or_connection_t before that.
    */
   unsigned int active_circuit_pqueue_last_recalibrated;
+
+  /**
+   * True iff this belongs to ewma_lazy_policy: the cell counts in
+   * active_circuit_pqueue are logarithms relative to a fixed point, so
+   * that we never need to rescale them.
+   */
+  unsigned int lazy_scaling : 1;
 };
 
 struct ewma_policy_circ_data_t {
@@ -132,6 +152,7 @@ TO_EWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
 
 STATIC unsigned cell_ewma_get_current_tick_and_fraction(double *remainder_out);
 STATIC void cell_ewma_initialize_ticks(void);
+STATIC double cell_ewma_get_log_weight(unsigned tick, double fractional_tick);
 
 #endif /* defined(CIRCUITMUX_EWMA_PRIVATE) */
 
@@ -48,6 +48,7 @@
 #include "core/or/connection_or.h"
 #include "core/or/dos.h"
 #include "core/or/onion.h"
+#include "core/or/or_metrics.h"
 #include "core/or/relay.h"
 #include "feature/control/control_events.h"
 #include "feature/hibernate/hibernate.h"
@@ -187,6 +188,8 @@ command_process_cell(channel_t *chan, cell_t *cell)
 #define PROCESS_CELL(tp, cl, cn) command_process_ ## tp ## _cell(cl, cn)
 #endif /* defined(KEEP_TIMING_STATS) */
 
+  or_metrics_note_cell(cell->command);
+
   switch (cell->command) {
     case CELL_CREATE:
     case CELL_CREATE_FAST:
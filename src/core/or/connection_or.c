@@ -43,6 +43,7 @@
 #include "feature/relay/relay_handshake.h"
 #include "feature/control/control_events.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/malloc/mempool.h"
 #include "feature/dirauth/reachability.h"
 #include "feature/client/entrynodes.h"
 #include "lib/geoip/geoip.h"
@@ -504,13 +505,34 @@ var_cell_pack_header(const var_cell_t *cell, char *hdr_out, int wide_circ_ids)
   return r;
 }
 
+/** Pool from which we allocate var_cell_t objects with up to
+ * VAR_CELL_POOL_MAX_PAYLOAD bytes of payload.  Bigger ones come from the
+ * heap. */
+static mp_pool_t *var_cell_pool = NULL;
+
+/** Largest var cell payload that we allocate from var_cell_pool.  This
+ * covers VERSIONS, AUTH_CHALLENGE, AUTHENTICATE, and most padding cells;
+ * CERTS cells are usually bigger, but there's only one of those per
+ * connection. */
+#define VAR_CELL_POOL_MAX_PAYLOAD CELL_PAYLOAD_SIZE
+
+/** Number of bytes that we map from the OS at a time for var_cell_pool. */
+#define VAR_CELL_POOL_CHUNK_SIZE (64*1024)
+
 /** Allocate and return a new var_cell_t with <b>payload_len</b> bytes of
  * payload space. */
 var_cell_t *
 var_cell_new(uint16_t payload_len)
 {
   size_t size = offsetof(var_cell_t, payload) + payload_len;
-  var_cell_t *cell = tor_malloc_zero(size);
+  var_cell_t *cell;
+  if (PREDICT_UNLIKELY(!var_cell_pool)) {
+    var_cell_pool = mp_pool_new(offsetof(var_cell_t, payload) +
+                                VAR_CELL_POOL_MAX_PAYLOAD,
+                                VAR_CELL_POOL_CHUNK_SIZE);
+  }
+  cell = mp_pool_get_sized(var_cell_pool, size);
+  memset(cell, 0, size);
   cell->payload_len = payload_len;
   cell->command = 0;
   cell->circ_id = 0;
@@ -525,12 +547,9 @@ var_cell_t *
 var_cell_copy(const var_cell_t *src)
 {
   var_cell_t *copy = NULL;
-  size_t size = 0;
 
   if (src != NULL) {
-    size = offsetof(var_cell_t, payload) + src->payload_len;
-    copy = tor_malloc_zero(size);
-    copy->payload_len = src->payload_len;
+    copy = var_cell_new(src->payload_len);
     copy->command = src->command;
     copy->circ_id = src->circ_id;
     memcpy(copy->payload, src->payload, copy->payload_len);
@@ -543,7 +562,34 @@ var_cell_copy(const var_cell_t *src)
 void
 var_cell_free_(var_cell_t *cell)
 {
-  tor_free(cell);
+  mp_pool_release(cell);
+}
+
+/** Set *<b>stats_out</b> to the current occupancy of the var cell pool. */
+void
+var_cell_pool_get_stats(mp_pool_stats_t *stats_out)
+{
+  if (var_cell_pool)
+    mp_pool_get_stats(var_cell_pool, stats_out);
+  else
+    memset(stats_out, 0, sizeof(*stats_out));
+}
+
+/** Give the memory for unused chunks in the var cell pool back to the OS,
+ * as for cell_pools_clean(). */
+void
+var_cell_pool_clean(int aggressive)
+{
+  if (var_cell_pool)
+    mp_pool_clean(var_cell_pool, 0, !aggressive);
+}
+
+/** Release all storage held by the var cell pool, including any cells
+ * still allocated from it. */
+void
+var_cell_pool_free_all(void)
+{
+  mp_pool_destroy(var_cell_pool);
 }
 
 /** We've received an EOF from <b>conn</b>. Mark it for close and return. */
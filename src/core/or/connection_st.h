@@ -12,6 +12,8 @@
 #ifndef CONNECTION_ST_H
 #define CONNECTION_ST_H
 
+#include "core/or/oom_age.h"
+
 struct buf_t;
 
 /* Values for connection_t.magic: used to make sure that downcasts (casts from
@@ -98,9 +100,15 @@ struct connection_t {
 
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
+  /** If we do our reads and writes on this connection through io_uring
+   * instead of through read_event and write_event, our io_uring state. */
+  struct connection_uring_t *uring;
   struct buf_t *inbuf; /**< Buffer holding data read over this connection. */
   struct buf_t *outbuf; /**< Buffer holding data to write over this
                          * connection. */
+  /** Our entry in the OOM age index, keyed by the oldest data in our
+   * buffers.  Only used for directory and edge connections. */
+  oom_age_entry_t oom_age_entry;
   time_t timestamp_last_read_allowed; /**< When was the last time libevent said
                                        * we could read? */
   time_t timestamp_last_write_allowed; /**< When was the last time libevent
@@ -23,6 +23,7 @@
 #include "lib/crypt_ops/crypto_rand.h"
 
 #include "core/or/dos.h"
+#include "core/or/or_metrics.h"
 
 #include "core/or/or_connection_st.h"
 
@@ -518,6 +519,7 @@ dos_cc_get_defense_type(channel_t *chan)
     /* We've just assess that this circuit should trigger a defense for the
      * cell it just seen. Note it down. */
     cc_num_rejected_cells++;
+    or_metrics_note_dos(OR_METRICS_DOS_CIRCUIT_CREATION);
     return dos_cc_defense_type;
   }
 
@@ -551,6 +553,7 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
    * defense. */
   if (entry->dos_stats.concurrent_count > dos_conn_max_concurrent_count) {
     conn_num_addr_rejected++;
+    or_metrics_note_dos(OR_METRICS_DOS_CONCURRENT_CONN);
     return dos_conn_defense_type;
   }
 
@@ -601,6 +604,7 @@ void
 dos_note_refuse_single_hop_client(void)
 {
   num_single_hop_client_refused++;
+  or_metrics_note_dos(OR_METRICS_DOS_SINGLE_HOP);
 }
 
 /* Return true iff single hop client connection (ESTABLISH_RENDEZVOUS) should
@@ -0,0 +1,266 @@
+/* Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file memacct.c
+ *
+ * \brief Keep track of the memory that counts towards MaxMemInQueues, and
+ *   reclaim it when we run low.
+ *
+ * Every subsystem that holds memory on behalf of the network (cell queues,
+ * buffers, caches, and so on) registers a memacct_t that says how to find
+ * out how much memory it is using, and optionally how to free some of it.
+ * cell_queues_check_size() asks this module for our total allocation; when
+ * that goes over MaxMemInQueues, memacct_handle_oom() asks the subsystems
+ * to give memory back, in order of priority.
+ *
+ * We also report what each subsystem is using, and how much we have
+ * reclaimed from it, on the control port and on the MetricsPort.
+ **/
+
+#include "core/or/or.h"
+#include "core/or/memacct.h"
+
+#include "app/config/config.h"
+#include "lib/metrics/metrics_store.h"
+
+/** A registered memacct_t, along with what we have done to it. */
+typedef struct memacct_entry_t {
+  /** The subsystem. */
+  const memacct_t *acct;
+  /** How many bytes have we reclaimed from this subsystem? */
+  uint64_t n_bytes_reclaimed;
+} memacct_entry_t;
+
+/** List of memacct_entry_t, sorted by priority. */
+static smartlist_t *memacct_entries = NULL;
+/** How many times have we run out of memory? */
+static uint64_t memacct_n_oom = 0;
+/** Store that we use to answer MetricsPort requests. */
+static metrics_store_t *memacct_metrics_store = NULL;
+/** List holding memacct_metrics_store, for memacct_get_metrics_stores(). */
+static smartlist_t *memacct_metrics_stores = NULL;
+
+/** Start counting the memory used by the subsystem described in
+ * <b>acct</b>.  Registering the same memacct_t twice has no effect. */
+void
+memacct_register(const memacct_t *acct)
+{
+  memacct_entry_t *ent;
+  int idx = 0;
+
+  tor_assert(acct);
+  tor_assert(acct->name);
+  tor_assert(acct->get_allocation);
+
+  if (!memacct_entries)
+    memacct_entries = smartlist_new();
+
+  SMARTLIST_FOREACH(memacct_entries, memacct_entry_t *, e,
+                    if (e->acct == acct) return);
+
+  ent = tor_malloc_zero(sizeof(*ent));
+  ent->acct = acct;
+  /* Keep the list sorted, and keep subsystems with the same priority in the
+   * order they registered.  There are only a handful of these. */
+  while (idx < smartlist_len(memacct_entries)) {
+    const memacct_entry_t *e = smartlist_get(memacct_entries, idx);
+    if (e->acct->priority > acct->priority)
+      break;
+    ++idx;
+  }
+  smartlist_insert(memacct_entries, idx, ent);
+}
+
+/** Forget about every subsystem we have registered, and free all storage
+ * held by this module. */
+void
+memacct_free_all(void)
+{
+  if (memacct_entries) {
+    SMARTLIST_FOREACH(memacct_entries, memacct_entry_t *, e, tor_free(e));
+    smartlist_free(memacct_entries);
+  }
+  metrics_store_free(memacct_metrics_store);
+  smartlist_free(memacct_metrics_stores);
+  memacct_n_oom = 0;
+}
+
+/** Return the total number of bytes allocated by all of the subsystems that
+ * count towards MaxMemInQueues. */
+size_t
+memacct_get_total_allocation(void)
+{
+  size_t total = 0;
+  if (!memacct_entries)
+    return 0;
+  SMARTLIST_FOREACH(memacct_entries, const memacct_entry_t *, e,
+                    total += e->acct->get_allocation());
+  return total;
+}
+
+/** We're out of memory, having allocated <b>current_allocation</b> bytes'
+ * worth in all subsystems.  Ask the subsystems to give some back, in order
+ * of priority: first shrink the subsystems that are over their budgets, and
+ * then reclaim from the others until we are down to
+ * MEMACCT_FRACTION_TO_RETAIN of MaxMemInQueues. */
+void
+memacct_handle_oom(time_t now, size_t current_allocation)
+{
+  const uint64_t max_mem = get_options()->MaxMemInQueues;
+  const size_t mem_target = (size_t)(max_mem * MEMACCT_FRACTION_TO_RETAIN);
+  size_t alloc = current_allocation;
+
+  ++memacct_n_oom;
+  if (!memacct_entries)
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(memacct_entries, memacct_entry_t *, e) {
+    const memacct_t *acct = e->acct;
+    size_t bytes_to_remove, freed;
+
+    if (!acct->handle_oom)
+      continue;
+
+    if (acct->budget_percent) {
+      /* Shrink it to half its budget if it's over budget. */
+      const size_t usage = acct->get_allocation();
+      const uint64_t budget = max_mem / 100 * acct->budget_percent;
+      if (usage <= budget)
+        continue;
+      bytes_to_remove = usage - (size_t)(budget / 2);
+    } else {
+      if (alloc <= mem_target)
+        continue;
+      bytes_to_remove = alloc - mem_target;
+    }
+
+    freed = acct->handle_oom(now, bytes_to_remove);
+    e->n_bytes_reclaimed += freed;
+    alloc = (freed < alloc) ? alloc - freed : 0;
+  } SMARTLIST_FOREACH_END(e);
+}
+
+/** Return the registered subsystem called <b>name</b>, or NULL if there is
+ * none. */
+static const memacct_entry_t *
+memacct_find(const char *name)
+{
+  if (!memacct_entries)
+    return NULL;
+  SMARTLIST_FOREACH(memacct_entries, const memacct_entry_t *, e,
+                    if (!strcmp(e->acct->name, name)) return e);
+  return NULL;
+}
+
+/** Set *<b>alloc_out</b> to the number of bytes that the subsystem called
+ * <b>name</b> has allocated, and return 0.  Return -1 if there is no such
+ * subsystem. */
+int
+memacct_get_allocation_by_name(const char *name, size_t *alloc_out)
+{
+  const memacct_entry_t *e = memacct_find(name);
+  if (!e)
+    return -1;
+  *alloc_out = e->acct->get_allocation();
+  return 0;
+}
+
+/** Return a newly allocated string, with one "name=bytes" line for each
+ * subsystem, listing how much memory it has allocated. */
+char *
+memacct_get_usage_for_control(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+  if (memacct_entries) {
+    SMARTLIST_FOREACH(memacct_entries, const memacct_entry_t *, e,
+      smartlist_add_asprintf(lines, "%s=%"TOR_PRIuSZ, e->acct->name,
+                             e->acct->get_allocation()));
+  }
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Return a newly allocated string, with one "name=bytes" line for each
+ * subsystem that can give memory back, listing how much we have reclaimed
+ * from it. */
+char *
+memacct_get_reclaimed_for_control(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+  if (memacct_entries) {
+    SMARTLIST_FOREACH_BEGIN(memacct_entries, const memacct_entry_t *, e) {
+      if (!e->acct->handle_oom)
+        continue;
+      smartlist_add_asprintf(lines, "%s=%"PRIu64, e->acct->name,
+                             e->n_bytes_reclaimed);
+    } SMARTLIST_FOREACH_END(e);
+  }
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Add a metric called <b>name</b> to <b>store</b>, labeled with the name
+ * of <b>acct</b> if it is not NULL, and set it to <b>value</b>. */
+static void
+memacct_add_metric(metrics_store_t *store, metrics_type_t type,
+                   const char *name, const char *help,
+                   const memacct_t *acct, int64_t value)
+{
+  metrics_store_entry_t *entry = metrics_store_add(store, type, name, help);
+  if (acct) {
+    char label[128];
+    tor_snprintf(label, sizeof(label), "subsys=%s", acct->name);
+    metrics_store_entry_add_label(entry, label);
+  }
+  metrics_store_entry_update(entry, value);
+}
+
+/** Return a list of the metrics stores for memory accounting. This is the
+ * function attached to the .get_metrics() member of the subsys_t. */
+const smartlist_t *
+memacct_get_metrics_stores(void)
+{
+  metrics_store_t *store;
+
+  /* These numbers change all the time, and there are only a few of them, so
+   * we build a new store each time we're asked. */
+  metrics_store_free(memacct_metrics_store);
+  store = memacct_metrics_store = metrics_store_new();
+
+  memacct_add_metric(store, METRICS_TYPE_GAUGE,
+                     METRICS_NAME(mem_limit_bytes),
+                     "Limit on memory in queues (MaxMemInQueues)",
+                     NULL, (int64_t) get_options()->MaxMemInQueues);
+  memacct_add_metric(store, METRICS_TYPE_COUNTER,
+                     METRICS_NAME(mem_oom_total),
+                     "Number of times we ran low on memory",
+                     NULL, (int64_t) memacct_n_oom);
+  if (memacct_entries) {
+    SMARTLIST_FOREACH_BEGIN(memacct_entries, const memacct_entry_t *, e) {
+      memacct_add_metric(store, METRICS_TYPE_GAUGE,
+                         METRICS_NAME(mem_alloc_bytes),
+                         "Bytes allocated in queues, by subsystem",
+                         e->acct, (int64_t) e->acct->get_allocation());
+      if (e->acct->handle_oom)
+        memacct_add_metric(store, METRICS_TYPE_COUNTER,
+                           METRICS_NAME(mem_reclaimed_bytes_total),
+                           "Bytes reclaimed when low on memory, by subsystem",
+                           e->acct, (int64_t) e->n_bytes_reclaimed);
+    } SMARTLIST_FOREACH_END(e);
+  }
+
+  if (!memacct_metrics_stores)
+    memacct_metrics_stores = smartlist_new();
+  smartlist_clear(memacct_metrics_stores);
+  smartlist_add(memacct_metrics_stores, store);
+  return memacct_metrics_stores;
+}
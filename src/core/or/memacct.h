@@ -0,0 +1,68 @@
+/* Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file memacct.h
+ * \brief Header file for memacct.c.
+ **/
+
+#ifndef TOR_MEMACCT_H
+#define TOR_MEMACCT_H
+
+#include "lib/cc/torint.h"
+#include "lib/container/smartlist.h"
+#include "lib/testsupport/testsupport.h"
+
+#include <time.h>
+
+/** A subsystem whose memory counts towards MaxMemInQueues.  Subsystems
+ * register one of these with memacct_register() when they are initialized;
+ * it must stay valid until memacct_free_all() is called. */
+typedef struct memacct_t {
+  /** Short name for this subsystem, for logs, the control port, and the
+   * MetricsPort. */
+  const char *name;
+  /** Return the number of bytes this subsystem currently has allocated. */
+  size_t (*get_allocation)(void);
+  /** If not NULL, try to free at least <b>min_remove_bytes</b> bytes from
+   * this subsystem because we are low on memory; return the number of
+   * bytes actually freed. */
+  size_t (*handle_oom)(time_t now, size_t min_remove_bytes);
+  /** When we are low on memory, we call handle_oom on every subsystem in
+   * increasing order of priority. */
+  int priority;
+  /** If nonzero, this subsystem's budget, as a percentage of
+   * MaxMemInQueues.  When we're low on memory and this subsystem is over
+   * budget, we shrink it to half its budget.  If zero, this subsystem has
+   * no budget of its own: when we're low on memory, we shrink it until our
+   * total allocation is back to MEMACCT_FRACTION_TO_RETAIN of
+   * MaxMemInQueues. */
+  unsigned budget_percent;
+} memacct_t;
+
+/** Priorities for memacct_t.priority: we reclaim caches before we start
+ * killing circuits. */
+#define MEMACCT_PRIO_HS_CACHE 10
+#define MEMACCT_PRIO_GEOIP_CACHE 20
+#define MEMACCT_PRIO_DNS_CACHE 30
+#define MEMACCT_PRIO_CIRCUITS 100
+
+/** When we're out of memory, reclaim memory until we are using no more than
+ * this fraction of MaxMemInQueues. */
+#define MEMACCT_FRACTION_TO_RETAIN 0.90
+
+void memacct_register(const memacct_t *acct);
+void memacct_free_all(void);
+
+size_t memacct_get_total_allocation(void);
+void memacct_handle_oom(time_t now, size_t current_allocation);
+
+char *memacct_get_usage_for_control(void);
+char *memacct_get_reclaimed_for_control(void);
+int memacct_get_allocation_by_name(const char *name, size_t *alloc_out);
+
+const smartlist_t *memacct_get_metrics_stores(void);
+
+#endif /* !defined(TOR_MEMACCT_H) */
@@ -0,0 +1,270 @@
+/* Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file oom_age.c
+ *
+ * \brief Keep circuits and connections indexed by the age of their oldest
+ *   queued data, for use by the out-of-memory handler.
+ *
+ * When we run low on memory, circuits_handle_oom() kills whichever circuits
+ * and connections have the oldest data queued, until it has recovered
+ * enough memory.  Rather than computing every object's age and sorting all
+ * of them whenever that happens, we keep an index that is updated as data
+ * is queued and dequeued.
+ *
+ * The index is a ring of buckets, each covering 2**OOM_AGE_BUCKET_SHIFT
+ * coarse timestamp units, plus one "ancient" bucket for everything older
+ * than the ring.  Adding, moving, or removing an entry is O(1).  When we
+ * walk the index, we sort only the bucket we are currently looking at, so
+ * the cost of a walk depends on how much we visit, not on how many objects
+ * are in the index.
+ *
+ * An entry's stamp must never be newer than the oldest data its owner has
+ * queued, or the OOM handler could miss it.  It may be older: the OOM
+ * handler checks the real age of each entry it visits, and moves the entry
+ * if it turns out to be too old.
+ **/
+
+#define OOM_AGE_PRIVATE
+#include "orconfig.h"
+#include "core/or/oom_age.h"
+
+#include "lib/malloc/malloc.h"
+#include "lib/container/smartlist.h"
+
+#include <string.h>
+
+TOR_TAILQ_HEAD(oom_age_bucket_t, oom_age_entry_t);
+
+/** The buckets of the index, indexed by slot number.  Slots 1 through
+ * OOM_AGE_N_BUCKETS form a ring; the last one is the ancient bucket.  Slot 0
+ * is OOM_AGE_SLOT_NONE, and is never used. */
+static struct oom_age_bucket_t oom_age_buckets[OOM_AGE_SLOT_ANCIENT + 1];
+/** True iff we have initialized oom_age_buckets and oom_age_horizon. */
+static int oom_age_initialized = 0;
+/** The bucket number of the oldest bucket in the ring.  Bucket numbers
+ * are timestamps shifted right by OOM_AGE_BUCKET_SHIFT; they wrap. */
+static uint32_t oom_age_horizon = 0;
+/** How many entries are in the index? */
+static int oom_age_n_entries = 0;
+
+/** Return the bucket number for the timestamp <b>stamp</b>. */
+static inline uint32_t
+oom_age_bucket_num(uint32_t stamp)
+{
+  return stamp >> OOM_AGE_BUCKET_SHIFT;
+}
+
+/** Return the slot number of the ring bucket for bucket number
+ * <b>bucket</b>. */
+static inline int
+oom_age_ring_slot(uint32_t bucket)
+{
+  return 1 + (int)(bucket & (OOM_AGE_N_BUCKETS - 1));
+}
+
+/** Initialize the index, if we have not done so already.  <b>bucket</b> is
+ * the bucket number of the newest thing we know about. */
+static void
+oom_age_init(uint32_t bucket)
+{
+  int i;
+  if (oom_age_initialized)
+    return;
+  for (i = 0; i <= OOM_AGE_SLOT_ANCIENT; ++i)
+    TOR_TAILQ_INIT(&oom_age_buckets[i]);
+  oom_age_horizon = bucket - (OOM_AGE_N_BUCKETS - 1);
+  oom_age_initialized = 1;
+}
+
+/** Move the ring forward so that it includes bucket number <b>bucket</b>.
+ * Everything in the buckets that fall off the old end of the ring goes to
+ * the ancient bucket. */
+static void
+oom_age_advance(uint32_t bucket)
+{
+  uint32_t ahead = bucket - oom_age_horizon;
+  uint32_t n_expire, i;
+  struct oom_age_bucket_t *ancient = &oom_age_buckets[OOM_AGE_SLOT_ANCIENT];
+
+  /* Nothing to do if the bucket is in the ring, or behind it. */
+  if ((int32_t)ahead < OOM_AGE_N_BUCKETS)
+    return;
+
+  n_expire = ahead - (OOM_AGE_N_BUCKETS - 1);
+  if (n_expire > OOM_AGE_N_BUCKETS)
+    n_expire = OOM_AGE_N_BUCKETS;
+
+  for (i = 0; i < n_expire; ++i) {
+    int slot = oom_age_ring_slot(oom_age_horizon + i);
+    oom_age_entry_t *ent;
+    while ((ent = TOR_TAILQ_FIRST(&oom_age_buckets[slot]))) {
+      TOR_TAILQ_REMOVE(&oom_age_buckets[slot], ent, next);
+      TOR_TAILQ_INSERT_TAIL(ancient, ent, next);
+      ent->slot = OOM_AGE_SLOT_ANCIENT;
+    }
+  }
+  oom_age_horizon = bucket - (OOM_AGE_N_BUCKETS - 1);
+}
+
+/** Add <b>ent</b>, which must not be in the index, with timestamp
+ * <b>stamp</b>. */
+static void
+oom_age_insert(oom_age_entry_t *ent, uint32_t stamp)
+{
+  uint32_t bucket = oom_age_bucket_num(stamp);
+  int slot;
+
+  oom_age_init(bucket);
+  oom_age_advance(bucket);
+
+  if ((int32_t)(bucket - oom_age_horizon) < 0)
+    slot = OOM_AGE_SLOT_ANCIENT;
+  else
+    slot = oom_age_ring_slot(bucket);
+
+  ent->stamp = stamp;
+  ent->slot = slot;
+  TOR_TAILQ_INSERT_TAIL(&oom_age_buckets[slot], ent, next);
+  ++oom_age_n_entries;
+}
+
+/** Initialize <b>ent</b> as an entry that is not in the index, and that
+ * belongs to an object of type <b>kind</b>. */
+void
+oom_age_entry_init(oom_age_entry_t *ent, oom_age_kind_t kind)
+{
+  memset(ent, 0, sizeof(*ent));
+  ent->slot = OOM_AGE_SLOT_NONE;
+  ent->kind = (uint8_t) kind;
+}
+
+/** Remove <b>ent</b> from the index, if it is there. */
+void
+oom_age_index_remove(oom_age_entry_t *ent)
+{
+  if (ent->slot == OOM_AGE_SLOT_NONE)
+    return;
+  if (ent->slot != OOM_AGE_SLOT_DETACHED)
+    TOR_TAILQ_REMOVE(&oom_age_buckets[ent->slot], ent, next);
+  ent->slot = OOM_AGE_SLOT_NONE;
+  --oom_age_n_entries;
+}
+
+/** Record that the oldest data queued on the owner of <b>ent</b> was
+ * queued at <b>stamp</b>, adding <b>ent</b> to the index if it is not
+ * there already. */
+void
+oom_age_index_update(oom_age_entry_t *ent, uint32_t stamp)
+{
+  if (oom_age_entry_is_indexed(ent)) {
+    if (ent->stamp == stamp)
+      return;
+    /* Most updates move an entry within a single bucket. */
+    if (ent->slot != OOM_AGE_SLOT_ANCIENT &&
+        oom_age_bucket_num(ent->stamp) == oom_age_bucket_num(stamp)) {
+      ent->stamp = stamp;
+      return;
+    }
+  }
+  oom_age_index_remove(ent);
+  oom_age_insert(ent, stamp);
+}
+
+/** Timestamp to use when sorting a bucket in oom_age_index_walk(). */
+static uint32_t oom_age_sort_now = 0;
+
+/** Helper to sort a list of oom_age_entry_t by age, oldest first. */
+static int
+oom_age_compare_entries_(const void **a_, const void **b_)
+{
+  const oom_age_entry_t *a = *a_, *b = *b_;
+  uint32_t age_a = oom_age_sort_now - a->stamp;
+  uint32_t age_b = oom_age_sort_now - b->stamp;
+  if (age_a < age_b)
+    return 1;
+  else if (age_a == age_b)
+    return 0;
+  else
+    return -1;
+}
+
+/** Call <b>fn</b> on the entries in the index, from the oldest to the
+ * newest, as of the timestamp <b>now</b>, until it returns
+ * OOM_AGE_WALK_STOP.  Return 1 if <b>fn</b> stopped the walk, and 0 if we
+ * ran out of entries. */
+int
+oom_age_index_walk(uint32_t now, oom_age_visit_fn_t fn, void *arg)
+{
+  smartlist_t *batch, *putback;
+  uint32_t first_bucket;
+  int i, stopped = 0;
+
+  if (!oom_age_initialized)
+    return 0;
+
+  oom_age_advance(oom_age_bucket_num(now));
+  first_bucket = oom_age_horizon;
+
+  batch = smartlist_new();
+  putback = smartlist_new();
+
+  /* Visit the ancient bucket first (i == -1), then the ring. */
+  for (i = -1; i < OOM_AGE_N_BUCKETS && !stopped; ++i) {
+    int slot = (i < 0) ? OOM_AGE_SLOT_ANCIENT :
+      oom_age_ring_slot(first_bucket + i);
+    struct oom_age_bucket_t *bucket = &oom_age_buckets[slot];
+
+    /* The callback may move entries back into the bucket we are visiting;
+     * keep going until it is empty. */
+    while (!stopped && !TOR_TAILQ_EMPTY(bucket)) {
+      oom_age_entry_t *ent;
+      while ((ent = TOR_TAILQ_FIRST(bucket))) {
+        TOR_TAILQ_REMOVE(bucket, ent, next);
+        ent->slot = OOM_AGE_SLOT_DETACHED;
+        smartlist_add(batch, ent);
+      }
+
+      oom_age_sort_now = now;
+      smartlist_sort(batch, oom_age_compare_entries_);
+      oom_age_sort_now = 0;
+
+      SMARTLIST_FOREACH_BEGIN(batch, oom_age_entry_t *, e) {
+        /* An earlier callback may have removed or moved this entry. */
+        if (e->slot != OOM_AGE_SLOT_DETACHED)
+          continue;
+        if (stopped) {
+          smartlist_add(putback, e);
+          continue;
+        }
+        if (fn(e, arg) == OOM_AGE_WALK_STOP)
+          stopped = 1;
+        if (e->slot == OOM_AGE_SLOT_DETACHED)
+          smartlist_add(putback, e);
+      } SMARTLIST_FOREACH_END(e);
+      smartlist_clear(batch);
+    }
+  }
+
+  /* Everything that the callback left alone goes back where it was. */
+  SMARTLIST_FOREACH_BEGIN(putback, oom_age_entry_t *, e) {
+    if (e->slot == OOM_AGE_SLOT_DETACHED) {
+      oom_age_index_remove(e);
+      oom_age_insert(e, e->stamp);
+    }
+  } SMARTLIST_FOREACH_END(e);
+
+  smartlist_free(batch);
+  smartlist_free(putback);
+  return stopped;
+}
+
+/** Return the number of entries in the OOM age index. */
+int
+oom_age_index_get_n_entries(void)
+{
+  return oom_age_n_entries;
+}
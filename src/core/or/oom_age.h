@@ -0,0 +1,77 @@
+/* Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file oom_age.h
+ * \brief Header file for oom_age.c.
+ **/
+
+#ifndef TOR_OOM_AGE_H
+#define TOR_OOM_AGE_H
+
+#include "lib/cc/torint.h"
+#include "lib/testsupport/testsupport.h"
+#include "ext/tor_queue.h"
+
+/** What kind of object contains an oom_age_entry_t. */
+typedef enum oom_age_kind_t {
+  OOM_AGE_KIND_CIRCUIT = 1,
+  OOM_AGE_KIND_CONNECTION = 2,
+} oom_age_kind_t;
+
+/** An entry in the OOM age index. This is embedded in every object whose
+ * queued data the OOM handler may want to reclaim; its <b>stamp</b> is the
+ * coarse monotonic timestamp of the oldest data queued on that object. */
+typedef struct oom_age_entry_t {
+  TOR_TAILQ_ENTRY(oom_age_entry_t) next;
+  /** Coarse timestamp of the oldest item queued on the owner. */
+  uint32_t stamp;
+  /** Index of the bucket holding this entry, or one of the OOM_AGE_SLOT_*
+   * values below.  A zeroed entry is not in the index. */
+  int16_t slot;
+  /** What kind of object contains this entry: an oom_age_kind_t. */
+  uint8_t kind;
+} oom_age_entry_t;
+
+/** Value for oom_age_entry_t.slot: the entry is not in the index. */
+#define OOM_AGE_SLOT_NONE 0
+/** Value for oom_age_entry_t.slot: the entry has been taken out of its
+ * bucket by oom_age_index_walk(), and is being examined. */
+#define OOM_AGE_SLOT_DETACHED (-1)
+
+void oom_age_entry_init(oom_age_entry_t *ent, oom_age_kind_t kind);
+void oom_age_index_update(oom_age_entry_t *ent, uint32_t stamp);
+void oom_age_index_remove(oom_age_entry_t *ent);
+
+/** Return true iff <b>ent</b> is currently in the OOM age index. */
+static inline int
+oom_age_entry_is_indexed(const oom_age_entry_t *ent)
+{
+  return ent->slot > 0;
+}
+
+/** Return values for an oom_age_visit_fn_t. */
+#define OOM_AGE_WALK_CONTINUE 0
+#define OOM_AGE_WALK_STOP 1
+
+/** Callback type for oom_age_index_walk(). The callback may update or
+ * remove the entry it is given (or any other entry); entries it leaves
+ * alone are put back in the index when the walk is done. */
+typedef int (*oom_age_visit_fn_t)(oom_age_entry_t *ent, void *arg);
+
+int oom_age_index_walk(uint32_t now, oom_age_visit_fn_t fn, void *arg);
+int oom_age_index_get_n_entries(void);
+
+#ifdef OOM_AGE_PRIVATE
+/** Number of regular buckets in the index. */
+#define OOM_AGE_N_BUCKETS 4096
+/** Each regular bucket covers 2**OOM_AGE_BUCKET_SHIFT timestamp units. */
+#define OOM_AGE_BUCKET_SHIFT 6
+/** Slot number for entries older than every regular bucket.  The regular
+ * buckets are slots 1 through OOM_AGE_N_BUCKETS. */
+#define OOM_AGE_SLOT_ANCIENT (OOM_AGE_N_BUCKETS + 1)
+#endif /* defined(OOM_AGE_PRIVATE) */
+
+#endif /* !defined(TOR_OOM_AGE_H) */
@@ -15,6 +15,7 @@
 #include "lib/evloop/token_bucket.h"
 
 struct onion_queue_t;
+struct relay_crypto_pipeline_t;
 
 /** An or_circuit_t holds information needed to implement a circuit at an
  * OR. */
@@ -44,6 +45,11 @@ struct or_circuit_t {
   /** Cryptographic state used for encrypting and authenticating relay
    * cells to and from this hop. */
   relay_crypto_t crypto;
+  /** If this circuit has cells waiting for, or being handled by, the relay
+   * crypto pipeline, their state.  While this is set, nobody but the
+   * pipeline may touch <b>crypto</b>.  Used only in
+   * relay_crypto_pipeline.c */
+  struct relay_crypto_pipeline_t *crypto_pipeline;
 
   /** Points to spliced circuit if purpose is REND_ESTABLISHED, and circuit
    * is not marked for close. */
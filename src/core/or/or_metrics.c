@@ -0,0 +1,333 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file or_metrics.c
+ * @brief Relay-wide counters for the MetricsPort.
+ *
+ * The code that relays cells, builds and frees circuits, answers
+ * onionskins, moves bytes, fends off DoS attempts and runs the scheduler
+ * calls the or_metrics_note_*() functions.  We keep the counts in a
+ * metrics_shard_set_t, so that any thread can update them without locking,
+ * and only add them up and turn them into a metrics_store_t when someone
+ * asks for them on the MetricsPort.
+ *
+ * Nothing is counted unless a MetricsPort is configured: until then, each
+ * of the or_metrics_note_*() functions is a single test of
+ * or_metrics_enabled.
+ **/
+
+#include "core/or/or.h"
+#include "core/or/command.h"
+#include "core/or/or_metrics.h"
+#include "core/mainloop/connection.h"
+
+#include "lib/metrics/metrics_shard.h"
+#include "lib/metrics/metrics_store.h"
+
+/** Fixed-length cells have commands below this; we count each of them
+ * separately, and lump together everything else. */
+#define N_CELL_COMMANDS 16
+/** Number of connection types we count bytes for. */
+#define N_CONN_TYPES 7
+/** Number of reasons in or_metrics_dos_t. */
+#define N_DOS_DEFENSES 3
+/** Number of buckets in the onionskin handshake histogram. */
+#define N_HANDSHAKE_BOUNDS 9
+/** Number of buckets in the scheduler histogram. */
+#define N_SCHED_BOUNDS 11
+
+/** Slots in or_metrics_shards. */
+typedef enum or_metrics_slot_t {
+  /* One per cell command below N_CELL_COMMANDS, and one for the rest. */
+  SLOT_CELLS = 0,
+  SLOT_CIRC_CREATED = SLOT_CELLS + N_CELL_COMMANDS + 1,
+  SLOT_CIRC_FREED,
+  SLOT_ONIONSKIN_QUEUED,
+  SLOT_ONIONSKIN_DROPPED,
+  SLOT_HANDSHAKE_SUCCESS,
+  SLOT_HANDSHAKE_FAILURE,
+  /* Bytes read, then bytes written, for each connection type. */
+  SLOT_CONN_BYTES,
+  SLOT_DOS = SLOT_CONN_BYTES + 2 * N_CONN_TYPES,
+  SLOT_SCHED_RUNS = SLOT_DOS + N_DOS_DEFENSES,
+  SLOT_HANDSHAKE_HIST,
+  SLOT_SCHED_HIST = SLOT_HANDSHAKE_HIST +
+    METRICS_SHARD_HISTOGRAM_N_SLOTS(N_HANDSHAKE_BOUNDS),
+  N_SLOTS = SLOT_SCHED_HIST + METRICS_SHARD_HISTOGRAM_N_SLOTS(N_SCHED_BOUNDS)
+} or_metrics_slot_t;
+
+/** Upper bounds, in microseconds, for the onionskin handshake histogram. */
+static const int64_t handshake_bounds[N_HANDSHAKE_BOUNDS] = {
+  50, 100, 200, 500, 1000, 2000, 5000, 10000, 50000,
+};
+static const metrics_shard_histogram_t handshake_hist = {
+  .first_slot = SLOT_HANDSHAKE_HIST,
+  .n_bounds = N_HANDSHAKE_BOUNDS,
+  .bounds = handshake_bounds,
+};
+
+/** Upper bounds for the histogram of channels pending on each scheduler
+ * run. */
+static const int64_t sched_bounds[N_SCHED_BOUNDS] = {
+  0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512,
+};
+static const metrics_shard_histogram_t sched_hist = {
+  .first_slot = SLOT_SCHED_HIST,
+  .n_bounds = N_SCHED_BOUNDS,
+  .bounds = sched_bounds,
+};
+
+/** Label for each connection type we count bytes for, indexed by one less
+ * than its value in conn_type_idx. */
+static const char *conn_type_names[N_CONN_TYPES] = {
+  "or", "exit", "ap", "dir", "control", "ext_or", "metrics",
+};
+/** For each connection type, one plus its index in conn_type_names, or 0
+ * if we don't count its bytes. */
+static const uint8_t conn_type_idx[CONN_TYPE_MAX_ + 1] = {
+  [CONN_TYPE_OR] = 1,
+  [CONN_TYPE_EXIT] = 2,
+  [CONN_TYPE_AP] = 3,
+  [CONN_TYPE_DIR] = 4,
+  [CONN_TYPE_CONTROL] = 5,
+  [CONN_TYPE_EXT_OR] = 6,
+  [CONN_TYPE_METRICS] = 7,
+};
+
+/** Label for each or_metrics_dos_t. */
+static const char *dos_names[N_DOS_DEFENSES] = {
+  "circuit_creation", "concurrent_connections", "single_hop_client",
+};
+
+bool or_metrics_enabled = false;
+
+/** The counters. */
+static metrics_shard_set_t *or_metrics_shards = NULL;
+/** Store that we use to answer MetricsPort requests. */
+static metrics_store_t *or_metrics_store = NULL;
+/** List holding or_metrics_store, for or_metrics_get_stores(). */
+static smartlist_t *or_metrics_stores = NULL;
+
+/** Set up our counters. They stay at zero until or_metrics_set_enabled()
+ * is called. */
+void
+or_metrics_init(void)
+{
+  if (!or_metrics_shards)
+    or_metrics_shards = metrics_shard_set_new(N_SLOTS);
+}
+
+/** Free all storage held by this module, and stop counting. */
+void
+or_metrics_free_all(void)
+{
+  or_metrics_enabled = false;
+  metrics_shard_set_free(or_metrics_shards);
+  metrics_store_free(or_metrics_store);
+  smartlist_free(or_metrics_stores);
+}
+
+/** Start counting if <b>enabled</b> is true, or stop if it is false. We
+ * only count while there's a MetricsPort to report the counts on. */
+void
+or_metrics_set_enabled(bool enabled)
+{
+  or_metrics_enabled = enabled && or_metrics_shards != NULL;
+}
+
+/** Helper: add <b>n</b> to the counter in <b>slot</b>. */
+static inline void
+or_metrics_add(unsigned slot, uint64_t n)
+{
+  if (or_metrics_shards)
+    metrics_shard_set_add(or_metrics_shards, slot, n);
+}
+
+/** Backend for or_metrics_note_cell(). */
+void
+or_metrics_note_cell_(uint8_t command)
+{
+  or_metrics_add(SLOT_CELLS + MIN(command, N_CELL_COMMANDS), 1);
+}
+
+/** Backend for or_metrics_note_circuit(). */
+void
+or_metrics_note_circuit_(bool created)
+{
+  or_metrics_add(created ? SLOT_CIRC_CREATED : SLOT_CIRC_FREED, 1);
+}
+
+/** Backend for or_metrics_note_onionskin(). */
+void
+or_metrics_note_onionskin_(bool queued)
+{
+  or_metrics_add(queued ? SLOT_ONIONSKIN_QUEUED : SLOT_ONIONSKIN_DROPPED, 1);
+}
+
+/** Note that a cpuworker answered an onionskin in <b>usec</b>
+ * microseconds, successfully iff <b>success</b>.
+ *
+ * Unlike the other or_metrics_note_*() functions, this one doesn't check
+ * or_metrics_enabled, since it runs on the cpuworker threads: the main
+ * thread checks that when it sends the onionskin off, and tells the
+ * cpuworker whether to call us. */
+void
+or_metrics_note_onionskin_handshake(bool success, int64_t usec)
+{
+  if (!or_metrics_shards)
+    return;
+  or_metrics_add(success ? SLOT_HANDSHAKE_SUCCESS : SLOT_HANDSHAKE_FAILURE,
+                 1);
+  metrics_shard_histogram_observe(or_metrics_shards, &handshake_hist, usec);
+}
+
+/** Backend for or_metrics_note_conn_bytes(). */
+void
+or_metrics_note_conn_bytes_(int conn_type, size_t n_read, size_t n_written)
+{
+  unsigned idx;
+  if (conn_type < 0 || conn_type > CONN_TYPE_MAX_)
+    return;
+  idx = conn_type_idx[conn_type];
+  if (idx == 0)
+    return;
+  --idx;
+  if (n_read)
+    or_metrics_add(SLOT_CONN_BYTES + 2 * idx, n_read);
+  if (n_written)
+    or_metrics_add(SLOT_CONN_BYTES + 2 * idx + 1, n_written);
+}
+
+/** Backend for or_metrics_note_dos(). */
+void
+or_metrics_note_dos_(or_metrics_dos_t defense)
+{
+  if (BUG((unsigned) defense >= N_DOS_DEFENSES))
+    return;
+  or_metrics_add(SLOT_DOS + defense, 1);
+}
+
+/** Backend for or_metrics_note_scheduler_run(). */
+void
+or_metrics_note_scheduler_run_(int n_pending)
+{
+  if (!or_metrics_shards)
+    return;
+  or_metrics_add(SLOT_SCHED_RUNS, 1);
+  metrics_shard_histogram_observe(or_metrics_shards, &sched_hist, n_pending);
+}
+
+/** Add a metric called <b>name</b> to <b>store</b>, with the labels
+ * <b>label1</b> and <b>label2</b> if they are not NULL, and set it to the
+ * value of the counter in <b>slot</b>. */
+static void
+add_counter(metrics_store_t *store, const char *name, const char *help,
+            const char *label1, const char *label2, unsigned slot)
+{
+  metrics_store_entry_t *entry =
+    metrics_store_add(store, METRICS_TYPE_COUNTER, name, help);
+  uint64_t value = metrics_shard_set_get(or_metrics_shards, slot);
+  if (label1)
+    metrics_store_entry_add_label(entry, label1);
+  if (label2)
+    metrics_store_entry_add_label(entry, label2);
+  metrics_store_entry_update(entry, (int64_t) MIN(value, INT64_MAX));
+}
+
+/** Add a histogram metric called <b>name</b> to <b>store</b>, with the
+ * values in <b>hist</b>. */
+static void
+add_histogram(metrics_store_t *store, const char *name, const char *help,
+              const metrics_shard_histogram_t *hist)
+{
+  uint64_t counts[MAX(N_HANDSHAKE_BOUNDS, N_SCHED_BOUNDS) + 1];
+  int64_t sum;
+  metrics_store_entry_t *entry;
+
+  tor_assert(hist->n_bounds < ARRAY_LENGTH(counts));
+  metrics_shard_histogram_get(or_metrics_shards, hist, counts, &sum);
+  entry = metrics_store_add(store, METRICS_TYPE_HISTOGRAM, name, help);
+  metrics_store_entry_set_histogram(entry, hist->n_bounds, hist->bounds,
+                                    counts, sum);
+}
+
+/** Return a list of the metrics stores for the relay-wide counters. This is
+ * called from the .get_metrics() member of the "or" subsys_fns_t. */
+const smartlist_t *
+or_metrics_get_stores(void)
+{
+  metrics_store_t *store;
+  char label[64];
+
+  if (!or_metrics_stores)
+    or_metrics_stores = smartlist_new();
+  smartlist_clear(or_metrics_stores);
+  if (!or_metrics_shards)
+    return or_metrics_stores;
+
+  /* The counts change all the time, so we build a new store each time we're
+   * asked. */
+  metrics_store_free(or_metrics_store);
+  store = or_metrics_store = metrics_store_new();
+
+  for (unsigned cmd = 0; cmd <= N_CELL_COMMANDS; ++cmd) {
+    const char *name = cell_command_to_string((uint8_t) cmd);
+    if (cmd < N_CELL_COMMANDS && !strcmp(name, "unrecognized"))
+      continue;
+    tor_snprintf(label, sizeof(label), "command=%s", name);
+    add_counter(store, METRICS_NAME(cells_received_total),
+                "Cells received, by cell command", label, NULL,
+                SLOT_CELLS + cmd);
+  }
+
+  add_counter(store, METRICS_NAME(circuits_total),
+              "Circuits created and freed", "event=created", NULL,
+              SLOT_CIRC_CREATED);
+  add_counter(store, METRICS_NAME(circuits_total),
+              "Circuits created and freed", "event=freed", NULL,
+              SLOT_CIRC_FREED);
+
+  add_counter(store, METRICS_NAME(onionskins_total),
+              "Onionskins queued for, or dropped before, a cpuworker",
+              "action=queued", NULL, SLOT_ONIONSKIN_QUEUED);
+  add_counter(store, METRICS_NAME(onionskins_total),
+              "Onionskins queued for, or dropped before, a cpuworker",
+              "action=dropped", NULL, SLOT_ONIONSKIN_DROPPED);
+  add_counter(store, METRICS_NAME(onionskin_handshakes_total),
+              "Onionskins answered by a cpuworker", "result=success", NULL,
+              SLOT_HANDSHAKE_SUCCESS);
+  add_counter(store, METRICS_NAME(onionskin_handshakes_total),
+              "Onionskins answered by a cpuworker", "result=failure", NULL,
+              SLOT_HANDSHAKE_FAILURE);
+  add_histogram(store, METRICS_NAME(onionskin_handshake_usec),
+                "Time a cpuworker spent answering an onionskin, in usec",
+                &handshake_hist);
+
+  for (unsigned i = 0; i < N_CONN_TYPES; ++i) {
+    tor_snprintf(label, sizeof(label), "type=%s", conn_type_names[i]);
+    add_counter(store, METRICS_NAME(connection_bytes_total),
+                "Bytes transferred, by connection type", label,
+                "direction=read", SLOT_CONN_BYTES + 2 * i);
+    add_counter(store, METRICS_NAME(connection_bytes_total),
+                "Bytes transferred, by connection type", label,
+                "direction=written", SLOT_CONN_BYTES + 2 * i + 1);
+  }
+
+  for (unsigned i = 0; i < N_DOS_DEFENSES; ++i) {
+    tor_snprintf(label, sizeof(label), "defense=%s", dos_names[i]);
+    add_counter(store, METRICS_NAME(dos_rejected_total),
+                "Things rejected by the DoS mitigation subsystem", label,
+                NULL, SLOT_DOS + i);
+  }
+
+  add_counter(store, METRICS_NAME(scheduler_runs_total),
+              "Number of times the cell scheduler ran", NULL, NULL,
+              SLOT_SCHED_RUNS);
+  add_histogram(store, METRICS_NAME(scheduler_pending_channels),
+                "Channels waiting for the cell scheduler when it ran",
+                &sched_hist);
+
+  smartlist_add(or_metrics_stores, store);
+  return or_metrics_stores;
+}
@@ -0,0 +1,99 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file or_metrics.h
+ * @brief Header for or_metrics.c
+ **/
+
+#ifndef TOR_OR_METRICS_H
+#define TOR_OR_METRICS_H
+
+#include "lib/cc/compat_compiler.h"
+#include "lib/cc/torint.h"
+#include "lib/container/smartlist.h"
+
+/** Reasons for which the DoS mitigation subsystem can reject something. */
+typedef enum or_metrics_dos_t {
+  /** A cell on a circuit from an address marked by the circuit creation
+   * defense. */
+  OR_METRICS_DOS_CIRCUIT_CREATION = 0,
+  /** A connection from an address with too many concurrent connections. */
+  OR_METRICS_DOS_CONCURRENT_CONN = 1,
+  /** A single hop client, refused at a rendezvous point. */
+  OR_METRICS_DOS_SINGLE_HOP = 2,
+} or_metrics_dos_t;
+
+/** True iff we are collecting relay metrics. Don't use this directly; the
+ * or_metrics_note_*() functions below check it for you. Only the main
+ * thread may read it. */
+extern bool or_metrics_enabled;
+
+void or_metrics_init(void);
+void or_metrics_free_all(void);
+void or_metrics_set_enabled(bool enabled);
+
+void or_metrics_note_cell_(uint8_t command);
+void or_metrics_note_circuit_(bool created);
+void or_metrics_note_onionskin_(bool queued);
+void or_metrics_note_onionskin_handshake(bool success, int64_t usec);
+void or_metrics_note_conn_bytes_(int conn_type, size_t n_read,
+                                 size_t n_written);
+void or_metrics_note_dos_(or_metrics_dos_t defense);
+void or_metrics_note_scheduler_run_(int n_pending);
+
+/** Note that we received a cell with command <b>command</b>. */
+static inline void
+or_metrics_note_cell(uint8_t command)
+{
+  if (PREDICT_UNLIKELY(or_metrics_enabled))
+    or_metrics_note_cell_(command);
+}
+
+/** Note that we created a circuit if <b>created</b> is true, or that we
+ * freed one otherwise. */
+static inline void
+or_metrics_note_circuit(bool created)
+{
+  if (PREDICT_UNLIKELY(or_metrics_enabled))
+    or_metrics_note_circuit_(created);
+}
+
+/** Note that we put an onionskin in the queue if <b>queued</b> is true, or
+ * that we dropped one otherwise. */
+static inline void
+or_metrics_note_onionskin(bool queued)
+{
+  if (PREDICT_UNLIKELY(or_metrics_enabled))
+    or_metrics_note_onionskin_(queued);
+}
+
+/** Note that a connection of type <b>conn_type</b> read <b>n_read</b> bytes
+ * and wrote <b>n_written</b> bytes. */
+static inline void
+or_metrics_note_conn_bytes(int conn_type, size_t n_read, size_t n_written)
+{
+  if (PREDICT_UNLIKELY(or_metrics_enabled))
+    or_metrics_note_conn_bytes_(conn_type, n_read, n_written);
+}
+
+/** Note that the DoS mitigation subsystem rejected something because of
+ * <b>defense</b>. */
+static inline void
+or_metrics_note_dos(or_metrics_dos_t defense)
+{
+  if (PREDICT_UNLIKELY(or_metrics_enabled))
+    or_metrics_note_dos_(defense);
+}
+
+/** Note that the scheduler ran with <b>n_pending</b> channels waiting. */
+static inline void
+or_metrics_note_scheduler_run(int n_pending)
+{
+  if (PREDICT_UNLIKELY(or_metrics_enabled))
+    or_metrics_note_scheduler_run_(n_pending);
+}
+
+const smartlist_t *or_metrics_get_stores(void);
+
+#endif /* !defined(TOR_OR_METRICS_H) */
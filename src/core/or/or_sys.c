@@ -11,18 +11,54 @@
 
 #include "orconfig.h"
 #include "core/or/or.h"
+#include "core/or/circuitlist.h"
+#include "core/or/connection_edge.h"
+#include "core/or/memacct.h"
+#include "core/or/or_metrics.h"
 #include "core/or/or_periodic.h"
 #include "core/or/or_sys.h"
 #include "core/or/policies.h"
 #include "core/or/protover.h"
+#include "core/or/relay.h"
 #include "core/or/versions.h"
+#include "feature/stats/geoip_stats.h"
 
+#include "lib/buf/buffers.h"
+#include "lib/compress/compress.h"
 #include "lib/subsys/subsys.h"
 
+/** Memory accounting for the things that the OR module counts towards
+ * MaxMemInQueues.  Only cell queues and the geoip client cache can give
+ * memory back directly; buffers and half-closed streams go away along with
+ * the circuits that own them. */
+static const memacct_t or_memacct[] = {
+  { .name = "cell-queues",
+    .get_allocation = cell_queues_get_total_allocation,
+    .handle_oom = circuits_handle_oom,
+    .priority = MEMACCT_PRIO_CIRCUITS },
+  { .name = "half-streams",
+    .get_allocation = half_streams_get_total_allocation },
+  { .name = "buffers",
+    .get_allocation = buf_get_total_allocation },
+  { .name = "compression",
+    .get_allocation = tor_compress_get_total_allocation },
+  { .name = "geoip-client-cache",
+    .get_allocation = geoip_client_cache_total_allocation,
+    .handle_oom = geoip_client_cache_handle_oom,
+    .priority = MEMACCT_PRIO_GEOIP_CACHE,
+    .budget_percent = 20 },
+};
+
+/** All the metrics stores that subsys_or_get_metrics() returns. */
+static smartlist_t *or_sys_metrics_stores = NULL;
+
 static int
 subsys_or_initialize(void)
 {
   or_register_periodic_events();
+  or_metrics_init();
+  for (unsigned i = 0; i < ARRAY_LENGTH(or_memacct); ++i)
+    memacct_register(&or_memacct[i]);
   return 0;
 }
 
@@ -32,6 +68,22 @@ subsys_or_shutdown(void)
   protover_free_all();
   protover_summary_cache_free_all();
   policies_free_all();
+  memacct_free_all();
+  or_metrics_free_all();
+  smartlist_free(or_sys_metrics_stores);
+}
+
+/** Return the metrics stores of the OR module: memory accounting, and the
+ * relay-wide counters. */
+static const smartlist_t *
+subsys_or_get_metrics(void)
+{
+  if (!or_sys_metrics_stores)
+    or_sys_metrics_stores = smartlist_new();
+  smartlist_clear(or_sys_metrics_stores);
+  smartlist_add_all(or_sys_metrics_stores, memacct_get_metrics_stores());
+  smartlist_add_all(or_sys_metrics_stores, or_metrics_get_stores());
+  return or_sys_metrics_stores;
 }
 
 static int
@@ -53,4 +105,5 @@ const struct subsys_fns_t sys_or = {
   .initialize = subsys_or_initialize,
   .shutdown = subsys_or_shutdown,
   .add_pubsub = subsys_or_add_pubsub,
+  .get_metrics = subsys_or_get_metrics,
 };
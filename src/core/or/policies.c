@@ -21,6 +21,7 @@
 #include "feature/client/bridges.h"
 #include "app/config/config.h"
 #include "core/or/policies.h"
+#include "core/or/policy_trie.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
@@ -60,6 +61,12 @@ static smartlist_t *authdir_invalid_policy = NULL;
  * match in order to not be marked as BadExit. */
 static smartlist_t *authdir_badexit_policy = NULL;
 
+/** Compiled versions of authdir_reject_policy, authdir_invalid_policy, and
+ * authdir_badexit_policy, which can be long. */
+static compiled_policy_t *authdir_reject_compiled = NULL;
+static compiled_policy_t *authdir_invalid_compiled = NULL;
+static compiled_policy_t *authdir_badexit_compiled = NULL;
+
 /** Parsed addr_policy_t describing which addresses we believe we can start
  * circuits at. */
 static smartlist_t *reachable_or_addr_policy = NULL;
@@ -369,15 +376,12 @@ firewall_is_fascist_dir(void)
   return (reachable_dir_addr_policy != NULL || firewall_is_fascist_impl());
 }
 
-/** Return true iff <b>policy</b> (possibly NULL) will allow a
- * connection to <b>addr</b>:<b>port</b>.
+/** Return true iff the result <b>p</b> of checking an address against a
+ * policy means that we should allow the connection.
  */
 static int
-addr_policy_permits_tor_addr(const tor_addr_t *addr, uint16_t port,
-                            smartlist_t *policy)
+addr_policy_result_permits(addr_policy_result_t p)
 {
-  addr_policy_result_t p;
-  p = compare_tor_addr_to_addr_policy(addr, port, policy);
   switch (p) {
     case ADDR_POLICY_PROBABLY_ACCEPTED:
     case ADDR_POLICY_ACCEPTED:
@@ -391,6 +395,27 @@ addr_policy_permits_tor_addr(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** Return true iff <b>policy</b> (possibly NULL) will allow a
+ * connection to <b>addr</b>:<b>port</b>.
+ */
+static int
+addr_policy_permits_tor_addr(const tor_addr_t *addr, uint16_t port,
+                            smartlist_t *policy)
+{
+  return addr_policy_result_permits(
+                        compare_tor_addr_to_addr_policy(addr, port, policy));
+}
+
+/** As addr_policy_permits_tor_addr, but for the compiled policy
+ * <b>cp</b>. */
+static int
+compiled_policy_permits_tor_addr(const tor_addr_t *addr, uint16_t port,
+                                 const compiled_policy_t *cp)
+{
+  return addr_policy_result_permits(
+                        compare_tor_addr_to_compiled_policy(addr, port, cp));
+}
+
 /** Return true iff we think our firewall will let us make a connection to
  * addr:port.
  *
@@ -1092,7 +1117,7 @@ addr_is_in_cc_list(const tor_addr_t *addr, const smartlist_t *cc_list)
 int
 authdir_policy_permits_address(const tor_addr_t *addr, uint16_t port)
 {
-  if (!addr_policy_permits_tor_addr(addr, port, authdir_reject_policy))
+  if (!compiled_policy_permits_tor_addr(addr, port, authdir_reject_compiled))
     return 0;
   return !addr_is_in_cc_list(addr, get_options()->AuthDirRejectCCs);
 }
@@ -1103,7 +1128,8 @@ authdir_policy_permits_address(const tor_addr_t *addr, uint16_t port)
 int
 authdir_policy_valid_address(const tor_addr_t *addr, uint16_t port)
 {
-  if (!addr_policy_permits_tor_addr(addr, port, authdir_invalid_policy))
+  if (!compiled_policy_permits_tor_addr(addr, port,
+                                       authdir_invalid_compiled))
     return 0;
   return !addr_is_in_cc_list(addr, get_options()->AuthDirInvalidCCs);
 }
@@ -1114,7 +1140,8 @@ authdir_policy_valid_address(const tor_addr_t *addr, uint16_t port)
 int
 authdir_policy_badexit_address(const tor_addr_t *addr, uint16_t port)
 {
-  if (!addr_policy_permits_tor_addr(addr, port, authdir_badexit_policy))
+  if (!compiled_policy_permits_tor_addr(addr, port,
+                                       authdir_badexit_compiled))
     return 1;
   return addr_is_in_cc_list(addr, get_options()->AuthDirBadExitCCs);
 }
@@ -1271,6 +1298,13 @@ policies_parse_from_options(const or_options_t *options)
   }
   if (parse_reachable_addresses() < 0)
     ret = -1;
+
+  compiled_policy_free(authdir_reject_compiled);
+  authdir_reject_compiled = addr_policy_compile(authdir_reject_policy);
+  compiled_policy_free(authdir_invalid_compiled);
+  authdir_invalid_compiled = addr_policy_compile(authdir_invalid_policy);
+  compiled_policy_free(authdir_badexit_compiled);
+  authdir_badexit_compiled = addr_policy_compile(authdir_badexit_policy);
   return ret;
 }
 
@@ -2903,7 +2937,13 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   }
 
   if (node->ri) {
-    return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
+    /* Descriptors don't change once we've parsed them, so compile the exit
+     * policy the first time we need it. */
+    if (!node->ri->exit_policy_compiled && node->ri->exit_policy)
+      node->ri->exit_policy_compiled =
+        addr_policy_compile(node->ri->exit_policy);
+    return compare_tor_addr_to_compiled_policy(addr, port,
+                                         node->ri->exit_policy_compiled);
   } else if (node->md) {
     if (node->md->exit_policy == NULL)
       return ADDR_POLICY_REJECTED;
@@ -3112,6 +3152,10 @@ policies_free_all(void)
   authdir_invalid_policy = NULL;
   addr_policy_list_free(authdir_badexit_policy);
   authdir_badexit_policy = NULL;
+  compiled_policy_free(authdir_reject_compiled);
+  compiled_policy_free(authdir_invalid_compiled);
+  compiled_policy_free(authdir_badexit_compiled);
+  compiled_policies_free_all();
 
   if (!HT_EMPTY(&policy_root)) {
     policy_map_ent_t **ent;
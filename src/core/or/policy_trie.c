@@ -0,0 +1,608 @@
+/* Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file policy_trie.c
+ * \brief Compile address policies into a form that we can check quickly.
+ *
+ * Checking an address and port against a full address policy with
+ * compare_tor_addr_to_addr_policy() means walking the whole list of
+ * accept/reject patterns until one of them matches.  That's fine for the
+ * default exit policy, but it gets slow for the long reject-lists that some
+ * exits and directory authorities use, and we do it for every stream that
+ * an exit opens.
+ *
+ * Here we turn a policy into a binary trie over address bits for each
+ * address family.  Every pattern hangs off the trie node for its address
+ * prefix, and each node knows, for every range of ports, which of its
+ * patterns comes first in the policy.  To check an address and port, we walk
+ * down the trie along the address, and take the earliest pattern we see on
+ * the way: so a lookup takes time proportional to the length of the
+ * address, not the length of the policy.
+ *
+ * Compiled policies are immutable and shared: we intern them by their
+ * (canonical) entries, so every router with the default exit policy uses
+ * the same compiled_policy_t.
+ **/
+
+#define POLICY_TRIE_PRIVATE
+
+#include "core/or/or.h"
+#include "core/or/policies.h"
+#include "core/or/policy_trie.h"
+#include "ext/ht.h"
+#include "ext/siphash.h"
+
+#include "core/or/addr_policy_st.h"
+
+/** Marks "no rule" in a compiled policy.  Larger than any rule index, so
+ * that we can take the minimum of rule indices without special cases. */
+#define NO_RULE INT_MAX
+
+/** A range of ports, from <b>first_port</b> up to the first_port of the next
+ * policy_port_seg_t in the same array, or to 65535. */
+typedef struct policy_port_seg_t {
+  uint16_t first_port;
+  /** The index of the first rule that covers these ports, or NO_RULE; or,
+   * in compiled_policy_t.unknown_addr_segs, an addr_policy_result_t. */
+  int value;
+} policy_port_seg_t;
+
+/** A node in the trie of a compiled_policy_t. */
+typedef struct policy_trie_node_t {
+  /** The indices of the nodes for the next address bit being 0 and 1, or 0
+   * if there is none.  (Node 0 is a root, so it's never anybody's child.) */
+  uint32_t child[2];
+  /** The rules whose address prefix ends at this node are
+   * rules[first_rule] through rules[first_rule + n_rules - 1], in the order
+   * they appear in the policy. */
+  uint32_t first_rule;
+  uint32_t n_rules;
+  /** For each range of ports, the first of this node's rules that covers
+   * it: segs[first_seg] through segs[first_seg + n_segs - 1]. */
+  uint32_t first_seg;
+  uint32_t n_segs;
+  /** The first of this node's rules that covers every port, or NO_RULE. */
+  int all_ports_rule;
+} policy_trie_node_t;
+
+/** An address policy, compiled for fast lookups. */
+struct compiled_policy_t {
+  HT_ENTRY(compiled_policy_t) node;
+  /** Number of users of this compiled policy. */
+  int refcnt;
+  /** Hash of the entries in <b>policy</b>. */
+  unsigned hash;
+  /** The policy that we compiled, as a list of canonical addr_policy_t;
+   * we hold one reference to each of them. */
+  smartlist_t *policy;
+  /** True iff this policy has an entry that we don't know how to compile,
+   * so we just use compare_tor_addr_to_addr_policy() on it. */
+  unsigned int linear_only:1;
+  /** For each rule, true iff it's an accept rule. */
+  uint8_t *accepts;
+  /** The trie.  Node 0 is the root for IPv4, and node 1 is the root for
+   * IPv6. */
+  policy_trie_node_t *nodes;
+  int n_nodes;
+  /** Storage for the rule and port lists of the trie's nodes. */
+  int *rules;
+  policy_port_seg_t *segs;
+  /** For every range of ports, the result of checking an unknown address on
+   * one of those ports against this policy. */
+  policy_port_seg_t *unknown_addr_segs;
+  int n_unknown_addr_segs;
+};
+
+/** Index of the root node for AF_INET addresses. */
+#define ROOT_IPV4 0
+/** Index of the root node for AF_INET6 addresses. */
+#define ROOT_IPV6 1
+
+/** Return true iff a and b are the same list of canonical entries. */
+static inline int
+compiled_policy_eq(const compiled_policy_t *a, const compiled_policy_t *b)
+{
+  int n = smartlist_len(a->policy);
+  if (n != smartlist_len(b->policy))
+    return 0;
+  return fast_memeq(a->policy->list, b->policy->list, n * sizeof(void *));
+}
+
+/** Return the hash that we computed for <b>cp</b>. */
+static inline unsigned
+compiled_policy_hash(const compiled_policy_t *cp)
+{
+  return cp->hash;
+}
+
+/** Map from policy contents to compiled policies. */
+static HT_HEAD(compiled_policy_map, compiled_policy_t)
+     compiled_policy_root = HT_INITIALIZER();
+
+HT_PROTOTYPE(compiled_policy_map, compiled_policy_t, node,
+             compiled_policy_hash, compiled_policy_eq);
+HT_GENERATE2(compiled_policy_map, compiled_policy_t, node,
+             compiled_policy_hash, compiled_policy_eq, 0.6,
+             tor_reallocarray_, tor_free_);
+
+/** Return the number of address bits that matter for addresses of the
+ * family <b>family</b>, or 0 if we can't compile such addresses. */
+static inline int
+family_max_bits(sa_family_t family)
+{
+  switch (family) {
+    case AF_INET: return 32;
+    case AF_INET6: return 128;
+    default: return 0;
+  }
+}
+
+/** Return bit number <b>bit</b> (counting from the most significant bit) of
+ * the IPv4 or IPv6 address <b>addr</b>. */
+static inline int
+addr_get_bit(const tor_addr_t *addr, int bit)
+{
+  if (tor_addr_family(addr) == AF_INET) {
+    return (tor_addr_to_ipv4h(addr) >> (31 - bit)) & 1;
+  } else {
+    const uint8_t *a = tor_addr_to_in6_addr8(addr);
+    return (a[bit >> 3] >> (7 - (bit & 7))) & 1;
+  }
+}
+
+/** Return true iff <b>e</b> covers <b>port</b>. */
+static inline int
+rule_covers_port(const addr_policy_t *e, uint16_t port)
+{
+  return e->prt_min <= port && port <= e->prt_max;
+}
+
+/** Helper for qsort: compare two uint16_t ports. */
+static int
+compare_ports_(const void *a, const void *b)
+{
+  uint16_t pa = *(const uint16_t *)a, pb = *(const uint16_t *)b;
+  return (pa > pb) - (pa < pb);
+}
+
+/** Set *<b>n_out</b> to the number of distinct ports at which one of the
+ * <b>n</b> rules in <b>rules</b> (indices into <b>policy</b>) starts or stops
+ * covering ports, including 0, and return them in a new sorted array. */
+static uint16_t *
+policy_port_boundaries(const smartlist_t *policy, const int *rules, int n,
+                       int *n_out)
+{
+  uint16_t *bounds = tor_calloc(2 * n + 1, sizeof(uint16_t));
+  int i, n_bounds = 0, n_unique = 0;
+
+  bounds[n_bounds++] = 0;
+  for (i = 0; i < n; ++i) {
+    const addr_policy_t *e = smartlist_get(policy, rules[i]);
+    bounds[n_bounds++] = e->prt_min;
+    if (e->prt_max < 65535)
+      bounds[n_bounds++] = e->prt_max + 1;
+  }
+  qsort(bounds, n_bounds, sizeof(uint16_t), compare_ports_);
+  for (i = 0; i < n_bounds; ++i) {
+    if (n_unique == 0 || bounds[n_unique - 1] != bounds[i])
+      bounds[n_unique++] = bounds[i];
+  }
+  *n_out = n_unique;
+  return bounds;
+}
+
+/** Append a policy_port_seg_t for ports starting at <b>port</b> with
+ * <b>value</b> to the <b>n</b>-element array *<b>segs</b>, whose allocated
+ * length is *<b>cap</b>, unless it would just extend the previous one, at or
+ * after position <b>first</b>.  Return the new number of elements. */
+static int
+policy_port_seg_append(policy_port_seg_t **segs, int n, int *cap,
+                       int first, uint16_t port, int value)
+{
+  if (n > first && (*segs)[n - 1].value == value)
+    return n;
+  if (n == *cap) {
+    *cap = *cap ? *cap * 2 : 16;
+    *segs = tor_reallocarray(*segs, *cap, sizeof(policy_port_seg_t));
+  }
+  (*segs)[n].first_port = port;
+  (*segs)[n].value = value;
+  return n + 1;
+}
+
+/** Return the value of the segment of the <b>n</b>-element sorted array
+ * <b>segs</b> that contains <b>port</b>. */
+static inline int
+policy_port_seg_lookup(const policy_port_seg_t *segs, int n, uint16_t port)
+{
+  int lo = 0, hi = n - 1;
+  /* segs[0].first_port is always 0, so the answer is in segs[lo..hi]. */
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (segs[mid].first_port <= port)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return segs[lo].value;
+}
+
+/** Return the result of checking an unknown address on <b>port</b> against
+ * <b>policy</b>.  This is the same logic as in
+ * compare_tor_addr_to_addr_policy(), which we can't call here since tests
+ * like to mock it. */
+static addr_policy_result_t
+policy_result_for_unknown_addr(const smartlist_t *policy, uint16_t port)
+{
+  int maybe_accept = 0, maybe_reject = 0;
+
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, e) {
+    if (!rule_covers_port(e, port))
+      continue;
+    if (e->maskbits == 0) {
+      if (e->policy_type == ADDR_POLICY_ACCEPT)
+        return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED :
+          ADDR_POLICY_ACCEPTED;
+      else
+        return maybe_accept ? ADDR_POLICY_PROBABLY_REJECTED :
+          ADDR_POLICY_REJECTED;
+    } else if (e->policy_type == ADDR_POLICY_REJECT) {
+      maybe_reject = 1;
+    } else {
+      maybe_accept = 1;
+    }
+  } SMARTLIST_FOREACH_END(e);
+
+  return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+}
+
+/** Helper for qsort: compare two (node, rule) pairs. */
+static int
+compare_node_rule_pairs_(const void *a, const void *b)
+{
+  const int *pa = a, *pb = b;
+  if (pa[0] != pb[0])
+    return (pa[0] > pb[0]) - (pa[0] < pb[0]);
+  return (pa[1] > pb[1]) - (pa[1] < pb[1]);
+}
+
+/** Fill in the port segments and all_ports_rule of <b>node</b>, one of the
+ * nodes of <b>cp</b>.  The segments go at the end of the segs array of
+ * <b>cp</b>, which currently holds <b>n_segs</b> of them and has room for
+ * *<b>segs_cap</b>.  Return the new number of segments. */
+static int
+policy_trie_node_build_segs(compiled_policy_t *cp, policy_trie_node_t *node,
+                            int n_segs, int *segs_cap)
+{
+  const smartlist_t *policy = cp->policy;
+  const int *node_rules = cp->rules + node->first_rule;
+  uint16_t *bounds;
+  int n_bounds, j;
+  uint32_t r;
+
+  bounds = policy_port_boundaries(policy, node_rules, node->n_rules,
+                                  &n_bounds);
+  node->first_seg = n_segs;
+  for (j = 0; j < n_bounds; ++j) {
+    int first = NO_RULE;
+    for (r = 0; r < node->n_rules; ++r) {
+      if (rule_covers_port(smartlist_get(policy, node_rules[r]),
+                           bounds[j])) {
+        first = node_rules[r];
+        break;
+      }
+    }
+    n_segs = policy_port_seg_append(&cp->segs, n_segs, segs_cap,
+                                    node->first_seg, bounds[j], first);
+  }
+  node->n_segs = n_segs - node->first_seg;
+  tor_free(bounds);
+
+  for (r = 0; r < node->n_rules; ++r) {
+    const addr_policy_t *e = smartlist_get(policy, node_rules[r]);
+    if (e->prt_min <= 1 && e->prt_max >= 65535) {
+      node->all_ports_rule = node_rules[r];
+      break;
+    }
+  }
+  return n_segs;
+}
+
+/** Build the trie and port tables for <b>cp</b>, whose policy field is
+ * set.  Return 0 on success, or -1 if the policy has an entry that we can't
+ * compile. */
+static int
+compiled_policy_build(compiled_policy_t *cp)
+{
+  const smartlist_t *policy = cp->policy;
+  const int n_rules = smartlist_len(policy);
+  int *pairs, *all_rules;
+  int nodes_cap = 64, segs_cap = 0, n_segs = 0;
+  int i;
+  uint16_t *bounds;
+  int n_bounds;
+
+  SMARTLIST_FOREACH(policy, const addr_policy_t *, e,
+    if (!family_max_bits(tor_addr_family(&e->addr)))
+      return -1);
+
+  cp->accepts = tor_malloc_zero(n_rules + 1);
+  cp->nodes = tor_calloc(nodes_cap, sizeof(policy_trie_node_t));
+  cp->n_nodes = 2;
+  cp->rules = tor_calloc(n_rules + 1, sizeof(int));
+  cp->nodes[ROOT_IPV4].all_ports_rule = NO_RULE;
+  cp->nodes[ROOT_IPV6].all_ports_rule = NO_RULE;
+
+  /* Insert every rule, and remember the node where each one ended up. */
+  pairs = tor_calloc(2 * n_rules + 1, sizeof(int));
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, e) {
+    const int family = tor_addr_family(&e->addr);
+    int bits = MIN((int)e->maskbits, family_max_bits(family));
+    uint32_t cur = (family == AF_INET) ? ROOT_IPV4 : ROOT_IPV6;
+    int b;
+
+    cp->accepts[e_sl_idx] = (e->policy_type == ADDR_POLICY_ACCEPT);
+    for (b = 0; b < bits; ++b) {
+      int bit = addr_get_bit(&e->addr, b);
+      if (!cp->nodes[cur].child[bit]) {
+        if (cp->n_nodes == nodes_cap) {
+          cp->nodes = tor_reallocarray(cp->nodes, nodes_cap * 2,
+                                       sizeof(policy_trie_node_t));
+          memset(cp->nodes + nodes_cap, 0,
+                 nodes_cap * sizeof(policy_trie_node_t));
+          nodes_cap *= 2;
+        }
+        cp->nodes[cp->n_nodes].all_ports_rule = NO_RULE;
+        cp->nodes[cur].child[bit] = cp->n_nodes++;
+      }
+      cur = cp->nodes[cur].child[bit];
+    }
+    pairs[2 * e_sl_idx] = (int)cur;
+    pairs[2 * e_sl_idx + 1] = e_sl_idx;
+  } SMARTLIST_FOREACH_END(e);
+
+  /* Group the rules by node, keeping them in policy order. */
+  qsort(pairs, n_rules, 2 * sizeof(int), compare_node_rule_pairs_);
+  for (i = 0; i < n_rules; ++i) {
+    policy_trie_node_t *node = &cp->nodes[pairs[2 * i]];
+    if (node->n_rules == 0)
+      node->first_rule = i;
+    node->n_rules++;
+    cp->rules[i] = pairs[2 * i + 1];
+  }
+  tor_free(pairs);
+
+  /* For each node with rules, note which rule comes first for each range of
+   * ports. */
+  for (i = 0; i < cp->n_nodes; ++i) {
+    if (cp->nodes[i].n_rules)
+      n_segs = policy_trie_node_build_segs(cp, &cp->nodes[i], n_segs,
+                                           &segs_cap);
+  }
+
+  /* And for unknown addresses, just remember the answer for each range of
+   * ports. */
+  all_rules = tor_calloc(n_rules + 1, sizeof(int));
+  for (i = 0; i < n_rules; ++i)
+    all_rules[i] = i;
+  bounds = policy_port_boundaries(policy, all_rules, n_rules, &n_bounds);
+  segs_cap = 0;
+  for (i = 0; i < n_bounds; ++i) {
+    addr_policy_result_t r = policy_result_for_unknown_addr(policy,
+                                                            bounds[i]);
+    cp->n_unknown_addr_segs =
+      policy_port_seg_append(&cp->unknown_addr_segs, cp->n_unknown_addr_segs,
+                             &segs_cap, 0, bounds[i], (int)r);
+  }
+  tor_free(bounds);
+  tor_free(all_rules);
+
+  return 0;
+}
+
+/** Return a compiled version of <b>policy</b>, or NULL if <b>policy</b> is
+ * NULL.  The caller must release it with compiled_policy_free().
+ *
+ * Compiled policies are shared between every user of the same policy, so
+ * this is cheap to call for a policy that somebody else has compiled. */
+compiled_policy_t *
+addr_policy_compile(const smartlist_t *policy)
+{
+  compiled_policy_t search, *found;
+
+  if (!policy)
+    return NULL;
+
+  /* Get our own reference to the canonical copy of every entry, so that
+   * equal policies have the same list of entries. */
+  memset(&search, 0, sizeof(search));
+  search.policy = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, e) {
+    addr_policy_t tmp;
+    memcpy(&tmp, e, sizeof(tmp));
+    tmp.is_canonical = 0;
+    smartlist_add(search.policy, addr_policy_get_canonical_entry(&tmp));
+  } SMARTLIST_FOREACH_END(e);
+  search.hash = (unsigned) siphash24g(search.policy->list,
+                         smartlist_len(search.policy) * sizeof(void *));
+
+  found = HT_FIND(compiled_policy_map, &compiled_policy_root, &search);
+  if (found) {
+    addr_policy_list_free(search.policy);
+    ++found->refcnt;
+    return found;
+  }
+
+  found = tor_memdup(&search, sizeof(search));
+  found->refcnt = 1;
+  if (compiled_policy_build(found) < 0) {
+    found->linear_only = 1;
+  }
+  HT_INSERT(compiled_policy_map, &compiled_policy_root, found);
+  return found;
+}
+
+/** Release all storage held by <b>cp</b>. */
+static void
+compiled_policy_free_storage(compiled_policy_t *cp)
+{
+  addr_policy_list_free(cp->policy);
+  tor_free(cp->accepts);
+  tor_free(cp->nodes);
+  tor_free(cp->rules);
+  tor_free(cp->segs);
+  tor_free(cp->unknown_addr_segs);
+  tor_free(cp);
+}
+
+/** Release a reference to <b>cp</b>, freeing it if that was the last
+ * one. */
+void
+compiled_policy_free_(compiled_policy_t *cp)
+{
+  if (!cp)
+    return;
+  if (--cp->refcnt > 0)
+    return;
+  HT_REMOVE(compiled_policy_map, &compiled_policy_root, cp);
+  compiled_policy_free_storage(cp);
+}
+
+/** Helper for compare_tor_addr_to_compiled_policy: the address family of
+ * <b>addr</b> is known and compiled, and <b>port</b> is nonzero. */
+static addr_policy_result_t
+compiled_policy_lookup(const compiled_policy_t *cp, const tor_addr_t *addr,
+                       uint16_t port)
+{
+  const int max_bits = family_max_bits(tor_addr_family(addr));
+  uint32_t cur = (tor_addr_family(addr) == AF_INET) ? ROOT_IPV4 : ROOT_IPV6;
+  int depth = 0, best = NO_RULE;
+
+  for (;;) {
+    const policy_trie_node_t *node = &cp->nodes[cur];
+    if (node->n_segs) {
+      int r = policy_port_seg_lookup(cp->segs + node->first_seg,
+                                     node->n_segs, port);
+      best = MIN(best, r);
+    }
+    if (depth == max_bits)
+      break;
+    cur = node->child[addr_get_bit(addr, depth++)];
+    if (!cur)
+      break;
+  }
+
+  if (best == NO_RULE || cp->accepts[best])
+    return ADDR_POLICY_ACCEPTED;
+  return ADDR_POLICY_REJECTED;
+}
+
+/** Helper for compare_tor_addr_to_compiled_policy: the address family of
+ * <b>addr</b> is known and compiled, but the port is not known. */
+static addr_policy_result_t
+compiled_policy_lookup_noport(const compiled_policy_t *cp,
+                              const tor_addr_t *addr)
+{
+  const int max_bits = family_max_bits(tor_addr_family(addr));
+  uint32_t path[129];
+  int path_len = 0, i, first_definite = NO_RULE;
+  int maybe_accept = 0, maybe_reject = 0;
+  uint32_t cur = (tor_addr_family(addr) == AF_INET) ? ROOT_IPV4 : ROOT_IPV6;
+
+  /* Find the first rule on the path that matches every port... */
+  for (;;) {
+    path[path_len++] = cur;
+    first_definite = MIN(first_definite, cp->nodes[cur].all_ports_rule);
+    if (path_len > max_bits)
+      break;
+    cur = cp->nodes[cur].child[addr_get_bit(addr, path_len - 1)];
+    if (!cur)
+      break;
+  }
+
+  /* ... and see whether any of the rules that might match before it would
+   * say something different. */
+  for (i = 0; i < path_len; ++i) {
+    const policy_trie_node_t *node = &cp->nodes[path[i]];
+    uint32_t r;
+    for (r = 0; r < node->n_rules; ++r) {
+      int rule = cp->rules[node->first_rule + r];
+      if (rule >= first_definite)
+        break;
+      if (cp->accepts[rule])
+        maybe_accept = 1;
+      else
+        maybe_reject = 1;
+    }
+  }
+
+  if (first_definite == NO_RULE)
+    return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+  if (cp->accepts[first_definite])
+    return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+  return maybe_accept ? ADDR_POLICY_PROBABLY_REJECTED : ADDR_POLICY_REJECTED;
+}
+
+/** As compare_tor_addr_to_addr_policy(), but check against the compiled
+ * policy <b>cp</b>.  Always gives the same answer as
+ * compare_tor_addr_to_addr_policy() would for the policy that we compiled.
+ */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const compiled_policy_t *cp)
+{
+  if (!cp) {
+    /* no policy? accept all. */
+    return ADDR_POLICY_ACCEPTED;
+  } else if (cp->linear_only) {
+    return compare_tor_addr_to_addr_policy(addr, port, cp->policy);
+  } else if (addr == NULL || tor_addr_is_null(addr)) {
+    if (port == 0) {
+      log_info(LD_BUG, "Rejecting null address with 0 port (family %d)",
+               addr ? tor_addr_family(addr) : -1);
+      return ADDR_POLICY_REJECTED;
+    }
+    return policy_port_seg_lookup(cp->unknown_addr_segs,
+                                  cp->n_unknown_addr_segs, port);
+  } else if (!family_max_bits(tor_addr_family(addr))) {
+    return compare_tor_addr_to_addr_policy(addr, port, cp->policy);
+  } else if (port == 0) {
+    return compiled_policy_lookup_noport(cp, addr);
+  } else {
+    return compiled_policy_lookup(cp, addr, port);
+  }
+}
+
+/** Release every compiled policy, whether or not anybody still uses it. */
+void
+compiled_policies_free_all(void)
+{
+  compiled_policy_t **ent, **next, *cp;
+  for (ent = HT_START(compiled_policy_map, &compiled_policy_root);
+       ent; ent = next) {
+    cp = *ent;
+    next = HT_NEXT_RMV(compiled_policy_map, &compiled_policy_root, ent);
+    compiled_policy_free_storage(cp);
+  }
+  HT_CLEAR(compiled_policy_map, &compiled_policy_root);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of distinct compiled policies in use. */
+STATIC int
+compiled_policies_count(void)
+{
+  return (int) HT_SIZE(&compiled_policy_root);
+}
+
+/** Return true iff <b>cp</b> couldn't be compiled, and just falls back to
+ * checking its policy one entry at a time. */
+STATIC int
+compiled_policy_is_linear(const compiled_policy_t *cp)
+{
+  return cp->linear_only;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
@@ -0,0 +1,36 @@
+/* Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file policy_trie.h
+ * \brief Header file for policy_trie.c.
+ **/
+
+#ifndef TOR_POLICY_TRIE_H
+#define TOR_POLICY_TRIE_H
+
+#include "core/or/policies.h"
+#include "lib/testsupport/testsupport.h"
+
+typedef struct compiled_policy_t compiled_policy_t;
+
+compiled_policy_t *addr_policy_compile(const smartlist_t *policy);
+void compiled_policy_free_(compiled_policy_t *cp);
+#define compiled_policy_free(cp) \
+  FREE_AND_NULL(compiled_policy_t, compiled_policy_free_, (cp))
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                                           const tor_addr_t *addr,
+                                           uint16_t port,
+                                           const compiled_policy_t *cp);
+void compiled_policies_free_all(void);
+
+#ifdef POLICY_TRIE_PRIVATE
+#ifdef TOR_UNIT_TESTS
+STATIC int compiled_policies_count(void);
+STATIC int compiled_policy_is_linear(const compiled_policy_t *cp);
+#endif /* defined(TOR_UNIT_TESTS) */
+#endif /* defined(POLICY_TRIE_PRIVATE) */
+
+#endif /* !defined(TOR_POLICY_TRIE_H) */
@@ -65,11 +65,11 @@
 #include "feature/control/control_events.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
+#include "lib/malloc/mempool.h"
+#include "core/or/memacct.h"
 #include "feature/dircommon/directory.h"
-#include "feature/relay/dns.h"
 #include "feature/relay/circuitbuild_relay.h"
 #include "feature/stats/geoip_stats.h"
-#include "feature/hs/hs_cache.h"
 #include "core/mainloop/mainloop.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodelist.h"
@@ -78,6 +78,7 @@
 #include "core/or/reasons.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/crypto/relay_crypto_pipeline.h"
 #include "feature/rend/rendcache.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/nodelist/describe.h"
@@ -226,10 +227,8 @@ int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
 {
-  channel_t *chan = NULL;
   crypt_path_t *layer_hint=NULL;
   char recognized=0;
-  int reason;
 
   tor_assert(cell);
   tor_assert(circ);
@@ -238,6 +237,15 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   if (circ->marked_for_close)
     return 0;
 
+  if (! CIRCUIT_IS_ORIGIN(circ) &&
+      (relay_crypto_pipeline_circ_is_busy(TO_OR_CIRCUIT(circ)) ||
+       relay_crypto_pipeline_is_enabled())) {
+    /* Let a cpuworker do the crypto. We'll get the cell back in
+     * circuit_receive_relay_cell_crypted(). */
+    return relay_crypto_pipeline_queue_received(TO_OR_CIRCUIT(circ), cell,
+                                                cell_direction);
+  }
+
   if (relay_decrypt_cell(circ, cell, cell_direction, &layer_hint, &recognized)
       < 0) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
@@ -245,6 +253,33 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
     return -END_CIRC_REASON_INTERNAL;
   }
 
+  return circuit_receive_relay_cell_crypted(cell, circ, cell_direction,
+                                            layer_hint, recognized, NULL);
+}
+
+/** Second half of circuit_receive_relay_cell(): handle a relay <b>cell</b>
+ * on <b>circ</b> that has already been en/decrypted.  <b>layer_hint</b> and
+ * <b>recognized</b> are as set by relay_decrypt_cell().
+ *
+ * If the crypto was done by the relay crypto pipeline, and the cell is
+ * recognized, <b>recognized_digest</b> holds the running forward digest of
+ * the circuit right after this cell.  Otherwise it is NULL, and we read the
+ * digest from the circuit's crypto state.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+int
+circuit_receive_relay_cell_crypted(cell_t *cell, circuit_t *circ,
+                                   cell_direction_t cell_direction,
+                                   crypt_path_t *layer_hint, char recognized,
+                                   const uint8_t *recognized_digest)
+{
+  channel_t *chan = NULL;
+  int reason;
+
+  if (circ->marked_for_close)
+    return 0;
+
   circuit_update_channel_usage(circ, cell);
 
   if (recognized) {
@@ -252,7 +287,12 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
 
     /* Recognized cell, the cell digest has been updated, we'll record it for
      * the SENDME if need be. */
-    sendme_record_received_cell_digest(circ, layer_hint);
+    if (recognized_digest) {
+      sendme_record_received_cell_digest_precomputed(TO_OR_CIRCUIT(circ),
+                                                     recognized_digest);
+    } else {
+      sendme_record_received_cell_digest(circ, layer_hint);
+    }
 
     if (circ->purpose == CIRCUIT_PURPOSE_PATH_BIAS_TESTING) {
       if (pathbias_check_probe_response(circ, cell) == -1) {
@@ -409,6 +449,17 @@ circuit_package_relay_cell, (cell_t *cell, circuit_t *circ,
       return 0; /* just drop it */
     }
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    if (relay_crypto_pipeline_circ_is_busy(or_circ) ||
+        relay_crypto_pipeline_is_enabled()) {
+      /* Let a cpuworker do the crypto. We'll get the cell back in
+       * circuit_package_relay_cell_crypted(). */
+      int reason = relay_crypto_pipeline_queue_originated(or_circ, cell,
+                                                          on_stream);
+      if (reason < 0) {
+        circuit_mark_for_close(circ, -reason);
+      }
+      return 0;
+    }
     relay_encrypt_cell_inbound(cell, or_circ);
     chan = or_circ->p_chan;
   }
@@ -418,6 +469,33 @@ circuit_package_relay_cell, (cell_t *cell, circuit_t *circ,
   return 0;
 }
 
+/** Second half of circuit_package_relay_cell() for a <b>cell</b> that we
+ * originated towards the origin of <b>circ</b>, once the relay crypto
+ * pipeline has digested and encrypted it.
+ *
+ * If <b>sendme_digest</b> is set, it is the running backward digest of the
+ * circuit right after this cell, and we need to remember it for SENDME
+ * authentication.  <b>is_data</b> is true iff this was a RELAY_DATA cell.
+ */
+void
+circuit_package_relay_cell_crypted(cell_t *cell, or_circuit_t *circ,
+                                   streamid_t on_stream,
+                                   const uint8_t *sendme_digest,
+                                   bool is_data)
+{
+  if (TO_CIRCUIT(circ)->marked_for_close)
+    return;
+
+  if (sendme_digest) {
+    sendme_record_sending_cell_digest_precomputed(circ, sendme_digest,
+                                                  is_data);
+  }
+
+  ++stats_n_relay_cells_relayed;
+  append_cell_to_circuit_queue(TO_CIRCUIT(circ), circ->p_chan, cell,
+                               CELL_DIRECTION_IN, on_stream);
+}
+
 /** If cell's stream_id matches the stream_id of any conn that's
  * attached to circ, return that conn, else return NULL.
  */
@@ -711,8 +789,13 @@ relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
 
   /* If applicable, note the cell digest for the SENDME version 1 purpose if
    * we need to. This call needs to be after the circuit_package_relay_cell()
-   * because the cell digest is set within that function. */
-  if (relay_command == RELAY_COMMAND_DATA) {
+   * because the cell digest is set within that function.
+   *
+   * If the cell went to the relay crypto pipeline instead, the digest
+   * doesn't exist yet: circuit_package_relay_cell_crypted() will note it. */
+  if (relay_command == RELAY_COMMAND_DATA &&
+      (CIRCUIT_IS_ORIGIN(circ) ||
+       !relay_crypto_pipeline_circ_is_busy(TO_OR_CIRCUIT(circ)))) {
     sendme_record_cell_digest_on_circ(circ, cpath_layer);
   }
 
@@ -2500,20 +2583,31 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
 /** The total number of cells we have allocated. */
 static size_t total_cells_allocated = 0;
 
+/** Pool from which we allocate packed_cell_t objects. */
+static mp_pool_t *cell_pool = NULL;
+
+/** Number of bytes that we map from the OS at a time for the cell pools. */
+#define CELL_POOL_CHUNK_SIZE (128*1024)
+
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
   --total_cells_allocated;
-  tor_free(cell);
+  mp_pool_release(cell);
 }
 
 /** Allocate and return a new packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
+  packed_cell_t *cell;
+  if (PREDICT_UNLIKELY(!cell_pool))
+    cell_pool = mp_pool_new(sizeof(packed_cell_t), CELL_POOL_CHUNK_SIZE);
   ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  cell = mp_pool_get(cell_pool);
+  memset(cell, 0, sizeof(packed_cell_t));
+  return cell;
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2525,6 +2619,64 @@ packed_cell_free_(packed_cell_t *cell)
   packed_cell_free_unchecked(cell);
 }
 
+/** Set *<b>stats_out</b> to the current occupancy of the packed cell
+ * pool. */
+void
+cell_pool_get_stats(mp_pool_stats_t *stats_out)
+{
+  if (cell_pool)
+    mp_pool_get_stats(cell_pool, stats_out);
+  else
+    memset(stats_out, 0, sizeof(*stats_out));
+}
+
+/** Give the memory for unused chunks in the packed and var cell pools back
+ * to the OS.  If <b>aggressive</b> is true, release every empty chunk;
+ * otherwise, release only the ones that have stayed empty since the last
+ * time we were called.  Return the number of bytes released. */
+size_t
+cell_pools_clean(int aggressive)
+{
+  mp_pool_stats_t before, after;
+  size_t released = 0;
+
+  cell_pool_get_stats(&before);
+  if (cell_pool)
+    mp_pool_clean(cell_pool, 0, !aggressive);
+  cell_pool_get_stats(&after);
+  released += before.n_bytes_mapped - after.n_bytes_mapped;
+
+  var_cell_pool_get_stats(&before);
+  var_cell_pool_clean(aggressive);
+  var_cell_pool_get_stats(&after);
+  released += before.n_bytes_mapped - after.n_bytes_mapped;
+
+  return released;
+}
+
+/** Release all storage held by the packed and var cell pools, including any
+ * cells still allocated from them. */
+void
+cell_pools_free_all(void)
+{
+  mp_pool_destroy(cell_pool);
+  var_cell_pool_free_all();
+}
+
+/** Log the occupancy of a cell pool called <b>name</b>, as given in
+ * <b>stats</b>, at log level <b>severity</b>. */
+static void
+log_cell_pool_stats(int severity, const char *name,
+                    const mp_pool_stats_t *stats)
+{
+  tor_log(severity, LD_MM,
+          "%s pool: %"TOR_PRIuSZ" cells in use, %"TOR_PRIuSZ" free, in "
+          "%"TOR_PRIuSZ" chunks (%"TOR_PRIuSZ" empty); %"TOR_PRIuSZ" bytes "
+          "mapped, %"TOR_PRIuSZ" bytes per cell.",
+          name, stats->n_items_used, stats->n_items_free, stats->n_chunks,
+          stats->n_empty_chunks, stats->n_bytes_mapped, stats->item_cost);
+}
+
 /** Log current statistics for cell pool allocation at log level
  * <b>severity</b>. */
 void
@@ -2532,6 +2684,7 @@ dump_cell_pool_usage(int severity)
 {
   int n_circs = 0;
   int n_cells = 0;
+  mp_pool_stats_t stats;
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, c) {
     n_cells += c->n_chan_cells.n;
     if (!CIRCUIT_IS_ORIGIN(c))
@@ -2542,6 +2695,10 @@ dump_cell_pool_usage(int severity)
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
           n_cells, n_circs, (int)total_cells_allocated - n_cells);
+  cell_pool_get_stats(&stats);
+  log_cell_pool_stats(severity, "Packed cell", &stats);
+  var_cell_pool_get_stats(&stats);
+  log_cell_pool_stats(severity, "Var cell", &stats);
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2578,6 +2735,10 @@ cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
   copy->inserted_timestamp = monotime_coarse_get_stamp();
 
   cell_queue_append(queue, copy);
+
+  /* A new cell only changes the circuit's oldest cell if it is alone. */
+  if (circ && queue->n == 1)
+    circuit_update_oom_age(circ);
 }
 
 /** Initialize <b>queue</b> as an empty cell queue. */
@@ -2680,12 +2841,12 @@ destroy_cell_to_packed_cell(destroy_cell_t *inp, int wide_circ_ids)
   return packed;
 }
 
-/** Return the total number of bytes used for each packed_cell in a queue.
- * Approximate. */
+/** Return the total number of bytes used for each packed_cell in a queue,
+ * including the cell pool's per-item overhead. */
 size_t
 packed_cell_mem_cost(void)
 {
-  return sizeof(packed_cell_t);
+  return mp_pool_item_cost(sizeof(packed_cell_t));
 }
 
 /* DOCDOC */
@@ -2706,41 +2867,13 @@ static time_t last_time_under_memory_pressure = 0;
 STATIC int
 cell_queues_check_size(void)
 {
-  time_t now = time(NULL);
-  size_t alloc = cell_queues_get_total_allocation();
-  alloc += half_streams_get_total_allocation();
-  alloc += buf_get_total_allocation();
-  alloc += tor_compress_get_total_allocation();
-  const size_t rend_cache_total = rend_cache_get_total_allocation();
-  alloc += rend_cache_total;
-  const size_t geoip_client_cache_total =
-    geoip_client_cache_total_allocation();
-  alloc += geoip_client_cache_total;
-  const size_t dns_cache_total = dns_cache_total_allocation();
-  alloc += dns_cache_total;
+  /* Every subsystem that counts towards MaxMemInQueues registers itself
+   * with memacct; see or_sys.c and friends. */
+  const size_t alloc = memacct_get_total_allocation();
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
     if (alloc >= get_options()->MaxMemInQueues) {
-      /* If we're spending over 20% of the memory limit on hidden service
-       * descriptors, free them until we're down to 10%. Do the same for geoip
-       * client cache. */
-      if (rend_cache_total > get_options()->MaxMemInQueues / 5) {
-        const size_t bytes_to_remove =
-          rend_cache_total - (size_t)(get_options()->MaxMemInQueues / 10);
-        alloc -= hs_cache_handle_oom(now, bytes_to_remove);
-      }
-      if (geoip_client_cache_total > get_options()->MaxMemInQueues / 5) {
-        const size_t bytes_to_remove =
-          geoip_client_cache_total -
-          (size_t)(get_options()->MaxMemInQueues / 10);
-        alloc -= geoip_client_cache_handle_oom(now, bytes_to_remove);
-      }
-      if (dns_cache_total > get_options()->MaxMemInQueues / 5) {
-        const size_t bytes_to_remove =
-          dns_cache_total - (size_t)(get_options()->MaxMemInQueues / 10);
-        alloc -= dns_cache_handle_oom(now, bytes_to_remove);
-      }
-      circuits_handle_oom(alloc);
+      memacct_handle_oom(time(NULL), alloc);
       return 1;
     }
   }
@@ -2971,6 +3104,7 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
      * has more than one.
      */
     cell = cell_queue_pop(queue);
+    circuit_update_oom_age(circ);
 
     /* Calculate the exact time that this cell has spent in the queue. */
     if (get_options()->CellStatistics ||
@@ -3254,6 +3388,7 @@ circuit_clear_cell_queue(circuit_t *circ, channel_t *chan)
 
   /* Clear the queue */
   cell_queue_clear(queue);
+  circuit_update_oom_age(circ);
 
   /* Update the cell counter in the cmux */
   if (chan->cmux && circuitmux_is_circuit_attached(chan->cmux, circ))
@@ -19,6 +19,11 @@ extern uint64_t stats_n_circ_max_cell_reached;
 void relay_consensus_has_changed(const networkstatus_t *ns);
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+int circuit_receive_relay_cell_crypted(cell_t *cell, circuit_t *circ,
+                                       cell_direction_t cell_direction,
+                                       crypt_path_t *layer_hint,
+                                       char recognized,
+                                       const uint8_t *recognized_digest);
 size_t cell_queues_get_total_allocation(void);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
@@ -28,6 +33,10 @@ relay_send_command_from_edge_,(streamid_t stream_id, circuit_t *circ,
                                uint8_t relay_command, const char *payload,
                                size_t payload_len, crypt_path_t *cpath_layer,
                                const char *filename, int lineno));
+void circuit_package_relay_cell_crypted(cell_t *cell, or_circuit_t *circ,
+                                        streamid_t on_stream,
+                                        const uint8_t *sendme_digest,
+                                        bool is_data);
 /* Indicates to relay_send_command_from_edge() that it is a control cell. */
 #define CONTROL_CELL_ID 0
 #define relay_send_command_from_edge(stream_id, circ, relay_command, payload, \
@@ -50,6 +59,10 @@ extern uint64_t stats_n_data_cells_received;
 extern uint64_t stats_n_data_bytes_received;
 
 void dump_cell_pool_usage(int severity);
+struct mp_pool_stats_t;
+void cell_pool_get_stats(struct mp_pool_stats_t *stats_out);
+size_t cell_pools_clean(int aggressive);
+void cell_pools_free_all(void);
 size_t packed_cell_mem_cost(void);
 
 int have_been_under_memory_pressure(void);
@@ -7,6 +7,7 @@
 #include "lib/evloop/compat_libevent.h"
 #define SCHEDULER_PRIVATE
 #define SCHEDULER_KIST_PRIVATE
+#include "core/or/or_metrics.h"
 #include "core/or/scheduler.h"
 #include "core/mainloop/mainloop.h"
 #include "lib/buf/buffers.h"
@@ -216,6 +217,7 @@ scheduler_evt_callback(mainloop_event_t *event, void *arg)
    * are getting scheduled. Things are very broken. scheduler_t says the run()
    * function is mandatory. */
   tor_assert(the_scheduler->run);
+  or_metrics_note_scheduler_run(smartlist_len(channels_pending));
   the_scheduler->run();
 
   /* Schedule itself back in if it has more work. */
@@ -663,6 +665,18 @@ scheduler_release_channel,(channel_t *chan))
   scheduler_set_channel_state(chan, SCHED_CHAN_IDLE);
 }
 
+/*
+ * Log the current scheduler's statistics, if it keeps any, at
+ * <b>severity</b>.
+ */
+void
+scheduler_log_stats(int severity)
+{
+  if (the_scheduler && the_scheduler->log_stats) {
+    the_scheduler->log_stats(severity);
+  }
+}
+
 /** Mark a channel as ready to accept writes.
   * Possible state changes:
   *
@@ -93,6 +93,11 @@ typedef struct scheduler_t {
    * scheduler should use this as an opportunity to parse and cache torrc
    * options so that it doesn't have to call get_options() all the time. */
   void (*on_new_options)(void);
+
+  /* (Optional) To be called when Tor is dumping its statistics to the log,
+   * for example on SIGUSR1. Log whatever the scheduler counts about itself
+   * at <b>severity</b>. */
+  void (*log_stats)(int severity);
 } scheduler_t;
 
 /*****************************************************************************
@@ -120,6 +125,7 @@ void scheduler_free_all(void);
 void scheduler_conf_changed(void);
 void scheduler_notify_networkstatus_changed(void);
 MOCK_DECL(void, scheduler_release_channel, (channel_t *chan));
+void scheduler_log_stats(int severity);
 
 /*
  * Ways for a channel to interact with the scheduling system. A channel only
@@ -176,20 +182,50 @@ void scheduler_touch_channel(channel_t *chan);
 /* Socket table entry which holds information of a channel's socket and kernel
  * TCP information. Only used by KIST. */
 typedef struct socket_table_ent_t {
-  HT_ENTRY(socket_table_ent_t) node;
-  const channel_t *chan;
+  channel_t *chan;
   /* Amount written this scheduling run */
   uint64_t written;
   /* Amount that can be written this scheduling run */
   uint64_t limit;
+  /* Inode number of the channel's socket, or 0 if we don't know it yet. Used
+   * to find the socket in a batched sample. */
+  uint64_t inode;
   /* TCP info from the kernel */
   uint32_t cwnd;
   uint32_t unacked;
   uint32_t mss;
   uint32_t notsent;
+  /* True iff the TCP info above came from a batched sample in this
+   * scheduling run, so we don't need to ask the kernel again. */
+  unsigned int sampled : 1;
 } socket_table_ent_t;
 
-typedef HT_HEAD(outbuf_table_s, outbuf_table_ent_t) outbuf_table_t;
+/* The channels whose outbuf KIST may need to write to the kernel before the
+ * end of a scheduling run. A channel is on the list iff its
+ * sched_in_outbuf_table flag is set; a channel that was removed can still
+ * appear in the list, with the flag clear. */
+typedef struct outbuf_table_t {
+  smartlist_t *chans;
+} outbuf_table_t;
+
+/* Counters that describe the work the KIST scheduler has done. */
+typedef struct kist_stats_t {
+  /* Number of scheduling runs. */
+  uint64_t n_runs;
+  /* Number of times that we updated a channel's socket information. */
+  uint64_t n_sock_updates;
+  /* How many of those updates came from a batched sample. */
+  uint64_t n_sock_updates_batched;
+  /* Number of system calls that we made to learn about sockets. */
+  uint64_t n_syscalls;
+  /* Total and maximum time by which runs started later than we had
+   * scheduled them, in microseconds. */
+  uint64_t total_latency_usec;
+  uint64_t max_latency_usec;
+  /* Total and maximum time that runs took, in microseconds. */
+  uint64_t total_run_usec;
+  uint64_t max_run_usec;
+} kist_stats_t;
 
 MOCK_DECL(int, channel_should_write_to_kernel,
           (outbuf_table_t *table, channel_t *chan));
@@ -201,9 +237,11 @@ void scheduler_kist_set_full_mode(void);
 void scheduler_kist_set_lite_mode(void);
 scheduler_t *get_kist_scheduler(void);
 int kist_scheduler_run_interval(void);
+void kist_get_stats(kist_stats_t *out);
 
 #ifdef TOR_UNIT_TESTS
 extern int32_t sched_run_interval;
+STATIC void update_all_socket_info(smartlist_t *cp);
 #endif /* TOR_UNIT_TESTS */
 
 #endif /* defined(SCHEDULER_KIST_PRIVATE) */
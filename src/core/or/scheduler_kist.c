@@ -19,6 +19,7 @@
 #define SCHEDULER_PRIVATE
 #include "core/or/scheduler.h"
 #include "lib/math/fp.h"
+#include "lib/net/sock_diag.h"
 
 #include "core/or/or_connection_st.h"
 
@@ -36,56 +37,23 @@
  * Data structures and supporting functions
  *****************************************************************************/
 
-/* Socket_table hash table stuff. The socket_table keeps track of per-socket
- * limit information imposed by kist and used by kist. */
+/* The socket_table keeps track of per-socket limit information imposed by
+ * kist and used by kist. It is a dense array of entries: each channel that
+ * has an entry knows its index in the array, and when we remove an entry we
+ * move the last one into its place. That way a scheduling run can look up a
+ * channel's entry without hashing, and walking the table touches only
+ * contiguous memory. */
 
-static uint32_t
-socket_table_ent_hash(const socket_table_ent_t *ent)
-{
-  return (uint32_t)ent->chan->global_identifier;
-}
-
-static unsigned
-socket_table_ent_eq(const socket_table_ent_t *a, const socket_table_ent_t *b)
-{
-  return a->chan == b->chan;
-}
-
-typedef HT_HEAD(socket_table_s, socket_table_ent_t) socket_table_t;
-
-static socket_table_t socket_table = HT_INITIALIZER();
-
-HT_PROTOTYPE(socket_table_s, socket_table_ent_t, node, socket_table_ent_hash,
-             socket_table_ent_eq);
-HT_GENERATE2(socket_table_s, socket_table_ent_t, node, socket_table_ent_hash,
-             socket_table_ent_eq, 0.6, tor_reallocarray, tor_free_);
-
-/* outbuf_table hash table stuff. The outbuf_table keeps track of which
- * channels have data sitting in their outbuf so the kist scheduler can force
- * a write from outbuf to kernel periodically during a run and at the end of a
- * run. */
-
-typedef struct outbuf_table_ent_t {
-  HT_ENTRY(outbuf_table_ent_t) node;
-  channel_t *chan;
-} outbuf_table_ent_t;
-
-static uint32_t
-outbuf_table_ent_hash(const outbuf_table_ent_t *ent)
-{
-  return (uint32_t)ent->chan->global_identifier;
-}
+typedef struct socket_table_t {
+  socket_table_ent_t *ents;
+  int n_ents;
+  int capacity;
+} socket_table_t;
 
-static unsigned
-outbuf_table_ent_eq(const outbuf_table_ent_t *a, const outbuf_table_ent_t *b)
-{
-  return a->chan->global_identifier == b->chan->global_identifier;
-}
+static socket_table_t socket_table = { NULL, 0, 0 };
 
-HT_PROTOTYPE(outbuf_table_s, outbuf_table_ent_t, node, outbuf_table_ent_hash,
-             outbuf_table_ent_eq);
-HT_GENERATE2(outbuf_table_s, outbuf_table_ent_t, node, outbuf_table_ent_hash,
-             outbuf_table_ent_eq, 0.6, tor_reallocarray, tor_free_);
+/* Smallest number of entries that we allocate room for. */
+#define SOCKET_TABLE_MIN_CAPACITY 16
 
 /*****************************************************************************
  * Other internal data
@@ -112,6 +80,20 @@ static unsigned int kist_no_kernel_support = 0;
 #else /* !defined(HAVE_KIST_SUPPORT) */
 static unsigned int kist_lite_mode = 1;
 #endif /* defined(HAVE_KIST_SUPPORT) */
+/* True iff KISTBatchedSampling is set. */
+static unsigned int kist_batched_sampling = 0;
+/* True iff we tried to open a sock_diag socket and couldn't, so we should
+ * stop trying. */
+static unsigned int kist_batched_unavailable = 0;
+/* Our sock_diag socket for batched sampling, if we have one. */
+static tor_sock_diag_t *kist_sock_diag = NULL;
+
+/* Counters for kist_get_stats() and the log. */
+static kist_stats_t kist_stats;
+/* True iff a run is scheduled, and we haven't reached it yet. */
+static unsigned int kist_run_is_scheduled = 0;
+/* If kist_run_is_scheduled, the time for which we scheduled that run. */
+static monotime_t kist_scheduled_run_time;
 
 /*****************************************************************************
  * Internally called function implementations
@@ -131,52 +113,39 @@ channel_outbuf_length(channel_t *chan)
   return buf_datalen(TO_CONN(BASE_CHAN_TO_TLS(chan)->conn)->outbuf);
 }
 
-/* Little helper function for HT_FOREACH_FN. */
-static int
-each_channel_write_to_kernel(outbuf_table_ent_t *ent, void *data)
-{
-  (void) data; /* Make compiler happy. */
-  channel_write_to_kernel(ent->chan);
-  return 0; /* Returning non-zero removes the element from the table. */
-}
-
-/* Free the given outbuf table entry ent. */
-static int
-free_outbuf_info_by_ent(outbuf_table_ent_t *ent, void *data)
-{
-  (void) data; /* Make compiler happy. */
-  log_debug(LD_SCHED, "Freeing outbuf table entry from chan=%" PRIu64,
-            ent->chan->global_identifier);
-  tor_free(ent);
-  return 1; /* So HT_FOREACH_FN will remove the element */
-}
-
-/* Free the given socket table entry ent. */
-static int
-free_socket_info_by_ent(socket_table_ent_t *ent, void *data)
+/* Free the socket table entry at index idx of table. */
+static void
+socket_table_remove_idx(socket_table_t *table, int idx)
 {
-  (void) data; /* Make compiler happy. */
+  socket_table_ent_t *ent = &table->ents[idx];
   log_debug(LD_SCHED, "Freeing socket table entry from chan=%" PRIu64,
             ent->chan->global_identifier);
-  tor_free(ent);
-  return 1; /* So HT_FOREACH_FN will remove the element */
+  if (idx != table->n_ents - 1) {
+    *ent = table->ents[table->n_ents - 1];
+    ent->chan->sched_sock_idx = idx;
+  }
+  --table->n_ents;
 }
 
 /* Clean up socket_table. Probably because the KIST sched impl is going away */
 static void
 free_all_socket_info(void)
 {
-  HT_FOREACH_FN(socket_table_s, &socket_table, free_socket_info_by_ent, NULL);
-  HT_CLEAR(socket_table_s, &socket_table);
+  tor_free(socket_table.ents);
+  socket_table.n_ents = socket_table.capacity = 0;
 }
 
+/* Return the entry in table for chan, or NULL if it has none. The pointer is
+ * only valid until the next entry is added to or removed from the table. */
 static socket_table_ent_t *
 socket_table_search(socket_table_t *table, const channel_t *chan)
 {
-  socket_table_ent_t search, *ent = NULL;
-  search.chan = chan;
-  ent = HT_FIND(socket_table_s, table, &search);
-  return ent;
+  const int idx = chan->sched_sock_idx;
+  /* A channel's index can be out of date if the table was freed under it,
+   * so check that the entry really is this channel's. */
+  if (idx < 0 || idx >= table->n_ents || table->ents[idx].chan != chan)
+    return NULL;
+  return &table->ents[idx];
 }
 
 /* Free a socket entry in table for the given chan. */
@@ -189,57 +158,15 @@ free_socket_info_by_chan(socket_table_t *table, const channel_t *chan)
     return;
   log_debug(LD_SCHED, "scheduler free socket info for chan=%" PRIu64,
             chan->global_identifier);
-  HT_REMOVE(socket_table_s, table, ent);
-  free_socket_info_by_ent(ent, NULL);
+  socket_table_remove_idx(table, (int)(ent - table->ents));
 }
 
-/* Perform system calls for the given socket in order to calculate kist's
- * per-socket limit as documented in the function body. */
-MOCK_IMPL(void,
-update_socket_info_impl, (socket_table_ent_t *ent))
+/* Given the kernel TCP information in ent, calculate kist's per-socket
+ * limit as documented in the function body. */
+static void
+socket_info_compute_limit(socket_table_ent_t *ent)
 {
-#ifdef HAVE_KIST_SUPPORT
   int64_t tcp_space, extra_space;
-  tor_assert(ent);
-  tor_assert(ent->chan);
-  const tor_socket_t sock =
-    TO_CONN(CONST_BASE_CHAN_TO_TLS(ent->chan)->conn)->s;
-  struct tcp_info tcp;
-  socklen_t tcp_info_len = sizeof(tcp);
-
-  if (kist_no_kernel_support || kist_lite_mode) {
-    goto fallback;
-  }
-
-  /* Gather information */
-  if (getsockopt(sock, SOL_TCP, TCP_INFO, (void *)&(tcp), &tcp_info_len) < 0) {
-    if (errno == EINVAL) {
-      /* Oops, this option is not provided by the kernel, we'll have to
-       * disable KIST entirely. This can happen if tor was built on a machine
-       * with the support previously or if the kernel was updated and lost the
-       * support. */
-      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
-                           "for KIST anymore. We will fallback to the naive "
-                           "approach. Remove KIST from the Schedulers list "
-                           "to disable.");
-      kist_no_kernel_support = 1;
-    }
-    goto fallback;
-  }
-  if (ioctl(sock, SIOCOUTQNSD, &(ent->notsent)) < 0) {
-    if (errno == EINVAL) {
-      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
-                           "for KIST anymore. We will fallback to the naive "
-                           "approach. Remove KIST from the Schedulers list "
-                           "to disable.");
-      /* Same reason as the above. */
-      kist_no_kernel_support = 1;
-    }
-    goto fallback;
-  }
-  ent->cwnd = tcp.tcpi_snd_cwnd;
-  ent->unacked = tcp.tcpi_unacked;
-  ent->mss = tcp.tcpi_snd_mss;
 
   /* In order to reduce outbound kernel queuing delays and thus improve Tor's
    * ability to prioritize circuits, KIST wants to set a socket write limit
@@ -291,7 +218,7 @@ update_socket_info_impl, (socket_table_ent_t *ent))
   extra_space =
     clamp_double_to_int64(
                  (ent->cwnd * (int64_t)ent->mss) * sock_buf_size_factor) -
-    ent->notsent - (int64_t)channel_outbuf_length((channel_t *) ent->chan);
+    ent->notsent - (int64_t)channel_outbuf_length(ent->chan);
   if ((tcp_space + extra_space) < 0) {
     /* This means that the "notsent" queue is just too big so we shouldn't put
      * more in the kernel for now. */
@@ -301,6 +228,57 @@ update_socket_info_impl, (socket_table_ent_t *ent))
      * And we know this will always be positive, since we checked above. */
     ent->limit = (uint64_t)tcp_space + (uint64_t)extra_space;
   }
+}
+
+/* Perform system calls for the given socket in order to calculate kist's
+ * per-socket limit. */
+MOCK_IMPL(void,
+update_socket_info_impl, (socket_table_ent_t *ent))
+{
+#ifdef HAVE_KIST_SUPPORT
+  tor_assert(ent);
+  tor_assert(ent->chan);
+  const tor_socket_t sock =
+    TO_CONN(CONST_BASE_CHAN_TO_TLS(ent->chan)->conn)->s;
+  struct tcp_info tcp;
+  socklen_t tcp_info_len = sizeof(tcp);
+
+  if (kist_no_kernel_support || kist_lite_mode) {
+    goto fallback;
+  }
+
+  /* Gather information */
+  ++kist_stats.n_syscalls;
+  if (getsockopt(sock, SOL_TCP, TCP_INFO, (void *)&(tcp), &tcp_info_len) < 0) {
+    if (errno == EINVAL) {
+      /* Oops, this option is not provided by the kernel, we'll have to
+       * disable KIST entirely. This can happen if tor was built on a machine
+       * with the support previously or if the kernel was updated and lost the
+       * support. */
+      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
+                           "for KIST anymore. We will fallback to the naive "
+                           "approach. Remove KIST from the Schedulers list "
+                           "to disable.");
+      kist_no_kernel_support = 1;
+    }
+    goto fallback;
+  }
+  ++kist_stats.n_syscalls;
+  if (ioctl(sock, SIOCOUTQNSD, &(ent->notsent)) < 0) {
+    if (errno == EINVAL) {
+      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
+                           "for KIST anymore. We will fallback to the naive "
+                           "approach. Remove KIST from the Schedulers list "
+                           "to disable.");
+      /* Same reason as the above. */
+      kist_no_kernel_support = 1;
+    }
+    goto fallback;
+  }
+  ent->cwnd = tcp.tcpi_snd_cwnd;
+  ent->unacked = tcp.tcpi_unacked;
+  ent->mss = tcp.tcpi_snd_mss;
+  socket_info_compute_limit(ent);
   return;
 
 #else /* !defined(HAVE_KIST_SUPPORT) */
@@ -316,9 +294,8 @@ update_socket_info_impl, (socket_table_ent_t *ent))
   ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
   /* This function calls the specialized channel object (currently channeltls)
    * and ask how many cells it can write on the outbuf which we then multiply
-   * by the size of the cells for this channel. The cast is because this
-   * function requires a non-const channel object, meh. */
-  ent->limit = channel_num_cells_writeable((channel_t *) ent->chan) *
+   * by the size of the cells for this channel. */
+  ent->limit = channel_num_cells_writeable(ent->chan) *
                (get_cell_network_size(ent->chan->wide_circ_ids) +
                 TLS_PER_CELL_OVERHEAD);
 }
@@ -328,16 +305,22 @@ update_socket_info_impl, (socket_table_ent_t *ent))
  * every scheduling run
  */
 static void
-init_socket_info(socket_table_t *table, const channel_t *chan)
+init_socket_info(socket_table_t *table, channel_t *chan)
 {
   socket_table_ent_t *ent = NULL;
   ent = socket_table_search(table, chan);
   if (!ent) {
     log_debug(LD_SCHED, "scheduler init socket info for chan=%" PRIu64,
               chan->global_identifier);
-    ent = tor_malloc_zero(sizeof(*ent));
+    if (table->n_ents == table->capacity) {
+      table->capacity = MAX(SOCKET_TABLE_MIN_CAPACITY, table->capacity * 2);
+      table->ents = tor_reallocarray(table->ents, table->capacity,
+                                     sizeof(socket_table_ent_t));
+    }
+    chan->sched_sock_idx = table->n_ents++;
+    ent = &table->ents[chan->sched_sock_idx];
+    memset(ent, 0, sizeof(*ent));
     ent->chan = chan;
-    HT_INSERT(socket_table_s, table, ent);
   }
   ent->written = 0;
 }
@@ -347,30 +330,133 @@ init_socket_info(socket_table_t *table, const channel_t *chan)
 static void
 outbuf_table_add(outbuf_table_t *table, channel_t *chan)
 {
-  outbuf_table_ent_t search, *ent;
-  search.chan = chan;
-  ent = HT_FIND(outbuf_table_s, table, &search);
-  if (!ent) {
+  if (!chan->sched_in_outbuf_table) {
     log_debug(LD_SCHED, "scheduler init outbuf info for chan=%" PRIu64,
               chan->global_identifier);
-    ent = tor_malloc_zero(sizeof(*ent));
-    ent->chan = chan;
-    HT_INSERT(outbuf_table_s, table, ent);
+    chan->sched_in_outbuf_table = 1;
+    smartlist_add(table->chans, chan);
   }
 }
 
 static void
 outbuf_table_remove(outbuf_table_t *table, channel_t *chan)
 {
-  outbuf_table_ent_t search, *ent;
-  search.chan = chan;
-  ent = HT_FIND(outbuf_table_s, table, &search);
-  if (ent) {
-    HT_REMOVE(outbuf_table_s, table, ent);
-    free_outbuf_info_by_ent(ent, NULL);
+  (void) table;
+  /* The channel stays in the list; the end of the run will skip it. */
+  chan->sched_in_outbuf_table = 0;
+}
+
+#ifdef HAVE_KIST_SUPPORT
+
+/* One entry of the index that we use to match a batched sample to our
+ * socket table. */
+typedef struct kist_inode_ent_t {
+  uint64_t inode;
+  int idx;
+} kist_inode_ent_t;
+
+/* Everything that a batched sample needs. */
+typedef struct kist_sample_state_t {
+  socket_table_t *table;
+  /* Our sockets, sorted by inode. */
+  kist_inode_ent_t *by_inode;
+  int n;
+} kist_sample_state_t;
+
+/* Helper for qsort and bsearch: compare two kist_inode_ent_t by inode. */
+static int
+compare_inode_ents_(const void *a_, const void *b_)
+{
+  const kist_inode_ent_t *a = a_, *b = b_;
+  if (a->inode < b->inode)
+    return -1;
+  else if (a->inode > b->inode)
+    return 1;
+  else
+    return 0;
+}
+
+/* Callback for tor_sock_diag_dump_tcp(): if the socket in info is one of
+ * ours, remember what the kernel told us about it. */
+static void
+kist_sample_socket_cb(const tor_tcp_diag_t *info, void *arg)
+{
+  kist_sample_state_t *state = arg;
+  kist_inode_ent_t key, *found;
+  socket_table_ent_t *ent;
+
+  key.inode = info->inode;
+  found = bsearch(&key, state->by_inode, state->n, sizeof(kist_inode_ent_t),
+                  compare_inode_ents_);
+  if (!found)
+    return;
+  ent = &state->table->ents[found->idx];
+  ent->cwnd = info->cwnd;
+  ent->unacked = info->unacked;
+  ent->mss = info->mss;
+  ent->notsent = info->notsent;
+  ent->sampled = 1;
+}
+
+/* Ask the kernel about the sockets of all the pending channels in cp at
+ * once, and mark the entries in table that we learned about as sampled.
+ * Entries that we don't learn about are left alone. */
+static void
+sample_socket_info_batched(socket_table_t *table, smartlist_t *cp)
+{
+  kist_sample_state_t state;
+  unsigned n_syscalls = 0;
+
+  if (!kist_sock_diag) {
+    kist_sock_diag = tor_sock_diag_new();
+    ++kist_stats.n_syscalls;
+    if (!kist_sock_diag) {
+      log_notice(LD_SCHED, "KISTBatchedSampling is set, but the kernel won't "
+                 "let us ask about our sockets in a batch. Asking about "
+                 "each socket separately instead.");
+      kist_batched_unavailable = 1;
+      return;
+    }
   }
+
+  memset(&state, 0, sizeof(state));
+  state.table = table;
+  state.by_inode = tor_calloc(smartlist_len(cp), sizeof(kist_inode_ent_t));
+  SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
+    socket_table_ent_t *ent = socket_table_search(table, pchan);
+    if (SCHED_BUG(!ent, pchan)) {
+      continue;
+    }
+    if (!ent->inode) {
+      /* We only need to do this once per channel. */
+      ++kist_stats.n_syscalls;
+      if (tor_sock_diag_get_inode(
+                  TO_CONN(CONST_BASE_CHAN_TO_TLS(pchan)->conn)->s,
+                  &ent->inode) < 0) {
+        continue;
+      }
+    }
+    state.by_inode[state.n].inode = ent->inode;
+    state.by_inode[state.n].idx = (int)(ent - table->ents);
+    ++state.n;
+  } SMARTLIST_FOREACH_END(pchan);
+
+  if (state.n) {
+    qsort(state.by_inode, state.n, sizeof(kist_inode_ent_t),
+          compare_inode_ents_);
+    if (tor_sock_diag_dump_tcp(kist_sock_diag, kist_sample_socket_cb,
+                               &state, &n_syscalls) < 0) {
+      /* Whatever we did learn is still good; we'll ask about the rest
+       * separately. */
+      log_info(LD_SCHED, "Batched socket sample failed.");
+    }
+    kist_stats.n_syscalls += n_syscalls;
+  }
+  tor_free(state.by_inode);
 }
 
+#endif /* defined(HAVE_KIST_SUPPORT) */
+
 /* Set the scheduler running interval. */
 static void
 set_scheduler_run_interval(void)
@@ -413,7 +499,15 @@ update_socket_info(socket_table_t *table, const channel_t *chan)
   if (SCHED_BUG(!ent, chan)) {
     return; // Whelp. Entry didn't exist for some reason so nothing to do.
   }
-  update_socket_info_impl(ent);
+  ++kist_stats.n_sock_updates;
+  if (ent->sampled) {
+    /* We already have fresh TCP info from a batched sample. */
+    ent->sampled = 0;
+    ++kist_stats.n_sock_updates_batched;
+    socket_info_compute_limit(ent);
+  } else {
+    update_socket_info_impl(ent);
+  }
   log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
                       ", cwnd: %" PRIu32 ", unacked: %" PRIu32
                       ", notsent: %" PRIu32 ", mss: %" PRIu32,
@@ -421,6 +515,23 @@ update_socket_info(socket_table_t *table, const channel_t *chan)
             ent->notsent, ent->mss);
 }
 
+/* Make sure that every channel in cp has an entry in the socket table, and
+ * update its socket kernel information. */
+STATIC void
+update_all_socket_info(smartlist_t *cp)
+{
+  SMARTLIST_FOREACH(cp, channel_t *, pchan,
+                    init_socket_info(&socket_table, pchan));
+#ifdef HAVE_KIST_SUPPORT
+  if (kist_batched_sampling && !kist_batched_unavailable &&
+      !kist_lite_mode && !kist_no_kernel_support) {
+    sample_socket_info_batched(&socket_table, cp);
+  }
+#endif /* defined(HAVE_KIST_SUPPORT) */
+  SMARTLIST_FOREACH(cp, const channel_t *, pchan,
+                    update_socket_info(&socket_table, pchan));
+}
+
 /* Increment the channel's socket written value by the number of bytes. */
 static void
 update_socket_written(socket_table_t *table, channel_t *chan, size_t bytes)
@@ -489,11 +600,39 @@ have_work(void)
   return smartlist_len(cp) > 0;
 }
 
+/* Note that a run is starting at start, and how late it is. */
+static void
+kist_note_run_start(const monotime_t *start)
+{
+  ++kist_stats.n_runs;
+  if (kist_run_is_scheduled) {
+    int64_t late = monotime_diff_usec(&kist_scheduled_run_time, start);
+    if (late > 0) {
+      kist_stats.total_latency_usec += (uint64_t)late;
+      kist_stats.max_latency_usec =
+        MAX(kist_stats.max_latency_usec, (uint64_t)late);
+    }
+    kist_run_is_scheduled = 0;
+  }
+}
+
+/* Note that a run which began at start ended at end. */
+static void
+kist_note_run_end(const monotime_t *start, const monotime_t *end)
+{
+  int64_t took = monotime_diff_usec(start, end);
+  if (took > 0) {
+    kist_stats.total_run_usec += (uint64_t)took;
+    kist_stats.max_run_usec = MAX(kist_stats.max_run_usec, (uint64_t)took);
+  }
+}
+
 /* Function of the scheduler interface: free_all() */
 static void
 kist_free_all(void)
 {
   free_all_socket_info();
+  tor_sock_diag_free(kist_sock_diag);
 }
 
 /* Function of the scheduler interface: on_channel_free() */
@@ -515,6 +654,12 @@ static void
 kist_scheduler_on_new_options(void)
 {
   sock_buf_size_factor = get_options()->KISTSockBufSizeFactor;
+  kist_batched_sampling = get_options()->KISTBatchedSampling;
+  if (!kist_batched_sampling) {
+    tor_sock_diag_free(kist_sock_diag);
+    /* Try again if we're asked to sample in batches again. */
+    kist_batched_unavailable = 0;
+  }
 
   /* Calls kist_scheduler_run_interval which calls get_options(). */
   set_scheduler_run_interval();
@@ -533,6 +678,7 @@ kist_scheduler_init(void)
    * One side effect is that the first scheduler run will be at the next tick
    * that is in now + 10 msec (KIST_SCHED_RUN_INTERVAL_DEFAULT) by default. */
   monotime_get(&scheduler_last_run);
+  kist_run_is_scheduled = 0;
 
   kist_scheduler_on_new_options();
   IF_BUG_ONCE(sched_run_interval == 0) {
@@ -576,9 +722,17 @@ kist_scheduler_schedule(void)
     next_run.tv_usec = (int) ((sched_run_interval - diff) * 1000);
     /* Re-adding an event reschedules it. It does not duplicate it. */
     scheduler_ev_add(&next_run);
+    if (!kist_run_is_scheduled) {
+      monotime_add_msec(&kist_scheduled_run_time, &now,
+                        (uint32_t)(sched_run_interval - diff));
+    }
   } else {
     scheduler_ev_active();
+    if (!kist_run_is_scheduled) {
+      kist_scheduled_run_time = now;
+    }
   }
+  kist_run_is_scheduled = 1;
 }
 
 /* Function of the scheduler interface: run() */
@@ -594,13 +748,14 @@ kist_scheduler_run(void)
   smartlist_t *to_readd = NULL;
   smartlist_t *cp = get_channels_pending();
 
-  outbuf_table_t outbuf_table = HT_INITIALIZER();
+  outbuf_table_t outbuf_table = { smartlist_new() };
+  monotime_t run_start;
+
+  monotime_get(&run_start);
+  kist_note_run_start(&run_start);
 
   /* For each pending channel, collect new kernel information */
-  SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
-      init_socket_info(&socket_table, pchan);
-      update_socket_info(&socket_table, pchan);
-  } SMARTLIST_FOREACH_END(pchan);
+  update_all_socket_info(cp);
 
   log_debug(LD_SCHED, "Running the scheduler. %d channels pending",
             smartlist_len(cp));
@@ -726,11 +881,14 @@ kist_scheduler_run(void)
   } /* End of main scheduling loop */
 
   /* Write the outbuf of any channels that still have data */
-  HT_FOREACH_FN(outbuf_table_s, &outbuf_table, each_channel_write_to_kernel,
-                NULL);
+  SMARTLIST_FOREACH_BEGIN(outbuf_table.chans, channel_t *, ochan) {
+    if (ochan->sched_in_outbuf_table) {
+      ochan->sched_in_outbuf_table = 0;
+      channel_write_to_kernel(ochan);
+    }
+  } SMARTLIST_FOREACH_END(ochan);
   /* We are done with it. */
-  HT_FOREACH_FN(outbuf_table_s, &outbuf_table, free_outbuf_info_by_ent, NULL);
-  HT_CLEAR(outbuf_table_s, &outbuf_table);
+  smartlist_free(outbuf_table.chans);
 
   log_debug(LD_SCHED, "len pending=%d, len to_readd=%d",
             smartlist_len(cp),
@@ -754,6 +912,28 @@ kist_scheduler_run(void)
   }
 
   monotime_get(&scheduler_last_run);
+  kist_note_run_end(&run_start, &scheduler_last_run);
+}
+
+/* Function of the scheduler interface: log_stats() */
+static void
+kist_scheduler_log_stats(int severity)
+{
+  const kist_stats_t *st = &kist_stats;
+  if (!st->n_runs)
+    return;
+  tor_log(severity, LD_SCHED,
+          "KIST scheduler: %" PRIu64 " runs; %" PRIu64 " socket updates "
+          "(%" PRIu64 " from batched samples) using %" PRIu64 " system "
+          "calls, %.2f calls per run.",
+          st->n_runs, st->n_sock_updates, st->n_sock_updates_batched,
+          st->n_syscalls, ((double)st->n_syscalls) / st->n_runs);
+  tor_log(severity, LD_SCHED,
+          "KIST scheduler: runs started an average of %" PRIu64 " usec late "
+          "(at most %" PRIu64 " usec), and took an average of %" PRIu64
+          " usec (at most %" PRIu64 " usec).",
+          st->total_latency_usec / st->n_runs, st->max_latency_usec,
+          st->total_run_usec / st->n_runs, st->max_run_usec);
 }
 
 /*****************************************************************************
@@ -770,6 +950,7 @@ static scheduler_t kist_scheduler = {
   .schedule = kist_scheduler_schedule,
   .run = kist_scheduler_run,
   .on_new_options = kist_scheduler_on_new_options,
+  .log_stats = kist_scheduler_log_stats,
 };
 
 /* Return the KIST scheduler object. If it didn't exists, return a newly
@@ -810,6 +991,13 @@ kist_scheduler_run_interval(void)
                                  KIST_SCHED_RUN_INTERVAL_MAX);
 }
 
+/* Copy the KIST scheduler's counters into out. */
+void
+kist_get_stats(kist_stats_t *out)
+{
+  memcpy(out, &kist_stats, sizeof(*out));
+}
+
 /* Set KISTLite mode that is KIST without kernel support. */
 void
 scheduler_kist_set_lite_mode(void)
@@ -337,7 +337,7 @@ record_cell_digest_on_circ(circuit_t *circ, const uint8_t *sendme_digest)
  * We are able to know that because the package or deliver window value minus
  * one cell (the possible SENDME cell) should be a multiple of the increment
  * window value. */
-static bool
+bool
 circuit_sendme_cell_is_next(int window)
 {
   /* At the start of the window, no SENDME will be expected. */
@@ -683,6 +683,48 @@ sendme_record_received_cell_digest(circuit_t *circ, crypt_path_t *cpath)
   }
 }
 
+/* As sendme_record_received_cell_digest() for an or_circuit_t, but for a
+ * cell whose crypto was done by the relay crypto pipeline: <b>digest</b> is
+ * the forward digest of the circuit right after that cell. */
+void
+sendme_record_received_cell_digest_precomputed(or_circuit_t *circ,
+                                               const uint8_t *digest)
+{
+  tor_assert(circ);
+  tor_assert(digest);
+
+  /* Only record if the next cell is expected to be a SENDME. */
+  if (!circuit_sendme_cell_is_next(TO_CIRCUIT(circ)->deliver_window)) {
+    return;
+  }
+
+  memcpy(relay_crypto_get_sendme_digest(&circ->crypto), digest, DIGEST_LEN);
+}
+
+/* Called once the relay crypto pipeline has encrypted a cell that we sent on
+ * the or_circuit_t <b>circ</b>, and for which we decided, when we queued it,
+ * that the next cell we expect to receive is a SENDME. <b>digest</b> is the
+ * backward digest of the circuit right after that cell.
+ *
+ * This does the work of both sendme_record_sending_cell_digest() and, if
+ * <b>is_data</b> is set, sendme_record_cell_digest_on_circ(). */
+void
+sendme_record_sending_cell_digest_precomputed(or_circuit_t *circ,
+                                              const uint8_t *digest,
+                                              bool is_data)
+{
+  uint8_t *sendme_digest;
+
+  tor_assert(circ);
+  tor_assert(digest);
+
+  sendme_digest = relay_crypto_get_sendme_digest(&circ->crypto);
+  memcpy(sendme_digest, digest, DIGEST_LEN);
+  if (is_data) {
+    record_cell_digest_on_circ(TO_CIRCUIT(circ), sendme_digest);
+  }
+}
+
 /* Called once we encrypted a cell. Record the cell digest as the next sendme
  * digest only if the next cell we expect to receive is a SENDME so we can
  * match the digests. */
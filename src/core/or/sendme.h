@@ -34,11 +34,19 @@ int sendme_note_circuit_data_packaged(circuit_t *circ,
                                       crypt_path_t *layer_hint);
 int sendme_note_stream_data_packaged(edge_connection_t *conn);
 
+/* Window accounting. */
+bool circuit_sendme_cell_is_next(int window);
+
 /* Record cell digest on circuit. */
 void sendme_record_cell_digest_on_circ(circuit_t *circ, crypt_path_t *cpath);
 /* Record cell digest as the SENDME digest. */
 void sendme_record_received_cell_digest(circuit_t *circ, crypt_path_t *cpath);
 void sendme_record_sending_cell_digest(circuit_t *circ, crypt_path_t *cpath);
+void sendme_record_received_cell_digest_precomputed(or_circuit_t *circ,
+                                                    const uint8_t *digest);
+void sendme_record_sending_cell_digest_precomputed(or_circuit_t *circ,
+                                                   const uint8_t *digest,
+                                                   bool is_data);
 
 /* Private section starts. */
 #ifdef SENDME_PRIVATE
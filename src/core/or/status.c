@@ -25,6 +25,7 @@
 #include "feature/relay/routermode.h"
 #include "core/or/circuitlist.h"
 #include "core/mainloop/mainloop.h"
+#include "core/mainloop/cpuworker.h"
 #include "feature/stats/rephist.h"
 #include "feature/hibernate/hibernate.h"
 #include "app/config/statefile.h"
@@ -213,6 +214,7 @@ log_heartbeat(time_t now)
 
   if (public_server_mode(options)) {
     rep_hist_log_circuit_handshake_stats(now);
+    cpuworker_log_reply_stats(LOG_NOTICE, now);
     rep_hist_log_link_protocol_counts();
     dos_log_heartbeat();
   }
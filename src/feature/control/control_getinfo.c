@@ -18,6 +18,7 @@
 #include "core/or/circuitlist.h"
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
+#include "core/or/memacct.h"
 #include "core/or/policies.h"
 #include "core/or/versions.h"
 #include "feature/client/addressmap.h"
@@ -1473,6 +1474,33 @@ getinfo_helper_rephist(control_connection_t *control_conn,
   return 0;
 }
 
+/** Implementation helper for GETINFO: answers queries about the memory
+ * that counts towards MaxMemInQueues. */
+STATIC int
+getinfo_helper_memory(control_connection_t *control_conn,
+                      const char *question, char **answer,
+                      const char **errmsg)
+{
+  (void) control_conn;
+
+  if (!strcmp(question, "memory/total")) {
+    tor_asprintf(answer, "%"TOR_PRIuSZ, memacct_get_total_allocation());
+  } else if (!strcmp(question, "memory/usage")) {
+    *answer = memacct_get_usage_for_control();
+  } else if (!strcmp(question, "memory/reclaimed")) {
+    *answer = memacct_get_reclaimed_for_control();
+  } else if (!strcmpstart(question, "memory/usage/")) {
+    size_t alloc;
+    if (memacct_get_allocation_by_name(question + strlen("memory/usage/"),
+                                       &alloc) < 0) {
+      *errmsg = "Unrecognized subsystem";
+      return -1;
+    }
+    tor_asprintf(answer, "%"TOR_PRIuSZ, alloc);
+  }
+  return 0;
+}
+
 /** Implementation helper for GETINFO: answers queries about shared random
  * value. */
 static int
@@ -1675,6 +1703,14 @@ static const getinfo_item_t getinfo_items[] = {
        "Username under which the tor process is running."),
   ITEM("process/descriptor-limit", misc, "File descriptor limit."),
   ITEM("limits/max-mem-in-queues", misc, "Actual limit on memory in queues"),
+  ITEM("memory/total", memory,
+       "Total memory that counts towards MaxMemInQueues."),
+  ITEM("memory/usage", memory,
+       "Memory that counts towards MaxMemInQueues, by subsystem."),
+  PREFIX("memory/usage/", memory,
+         "Memory that counts towards MaxMemInQueues, for one subsystem."),
+  ITEM("memory/reclaimed", memory,
+       "Memory reclaimed when low on memory, by subsystem."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
@@ -109,9 +109,6 @@ dircollator_add_routerstatus(dircollator_t *dc,
 {
   const char *id = vrs->status.identity_digest;
 
-  /* Clear this flag; we might set it later during the voting process */
-  vrs->ed25519_reflects_consensus = 0;
-
   (void) vote; // We don't currently need this.
 
   /* First, add this item to the appropriate RSA-SHA-Id array. */
@@ -157,6 +154,7 @@ dircollator_new(int n_votes, int n_authorities)
 
   dc->by_rsa_sha1 = digestmap_new();
   HT_INIT(double_digest_map, &dc->by_both_ids);
+  dc->ed25519_consensus = digestmap_new();
 
   return dc;
 }
@@ -172,6 +170,7 @@ dircollator_free_(dircollator_t *dc)
     digestmap_free(dc->by_collated_rsa_sha1, NULL);
 
   digestmap_free(dc->by_rsa_sha1, tor_free_);
+  digestmap_free(dc->ed25519_consensus, NULL);
   smartlist_free(dc->all_rsa_sha1_lst);
 
   ddmap_entry_t **e, **next, *this;
@@ -264,15 +263,16 @@ dircollator_collate_by_ed25519(dircollator_t *dc)
     tor_assert(vrs_lst2);
 
     for (i = 0; i < dc->n_votes; ++i) {
-      if (ent->vrs_lst[i] != NULL) {
-        ent->vrs_lst[i]->ed25519_reflects_consensus = 1;
-      } else if (vrs_lst2[i] && ! vrs_lst2[i]->has_ed25519_listing) {
+      if (ent->vrs_lst[i] == NULL &&
+          vrs_lst2[i] && ! vrs_lst2[i]->has_ed25519_listing) {
         ent->vrs_lst[i] = vrs_lst2[i];
       }
     }
 
-    /* Record that we have seen this RSA digest. */
+    /* Record that we have seen this RSA digest, and that the authorities
+     * agreed on its ed25519 key. */
     digestmap_set(rsa_digests, (char*)ent->d, ent->vrs_lst);
+    digestmap_set(dc->ed25519_consensus, (char*)ent->d, ent);
     smartlist_add(dc->all_rsa_sha1_lst, ent->d);
   }
 
@@ -324,3 +324,22 @@ dircollator_get_votes_for_router(dircollator_t *dc, int idx)
   return digestmap_get(dc->by_collated_rsa_sha1,
                        smartlist_get(dc->all_rsa_sha1_lst, idx));
 }
+
+/** Return true iff more than half of the authorities agreed on the ed25519
+ * key of the <b>idx</b>th router in the collation order.  If so, the entries
+ * from dircollator_get_votes_for_router() that have an ed25519 listing are
+ * exactly the ones that list that key.
+ *
+ * We keep this here rather than in the vote_routerstatus_t entries, so that
+ * collation never changes the votes: we may build several consensus
+ * flavors from the same votes at once.
+ *
+ * This function may only be called after dircollator_collate. */
+int
+dircollator_router_has_ed25519_consensus(dircollator_t *dc, int idx)
+{
+  tor_assert(dc->is_collated);
+  tor_assert(idx < smartlist_len(dc->all_rsa_sha1_lst));
+  return digestmap_get(dc->ed25519_consensus,
+                       smartlist_get(dc->all_rsa_sha1_lst, idx)) != NULL;
+}
@@ -28,6 +28,7 @@ void dircollator_collate(dircollator_t *dc, int consensus_method);
 int dircollator_n_routers(dircollator_t *dc);
 vote_routerstatus_t **dircollator_get_votes_for_router(dircollator_t *dc,
                                                        int idx);
+int dircollator_router_has_ed25519_consensus(dircollator_t *dc, int idx);
 
 #ifdef DIRCOLLATE_PRIVATE
 struct ddmap_entry_t;
@@ -53,6 +54,9 @@ struct dircollator_t {
    * by_rsa_sha1 above. We include <NULL,RSA-SHA1> entries for votes that
    * say that there is no Ed key. */
   struct double_digest_map by_both_ids;
+  /** Map from RSA-SHA1 identity digest to a nonnull pointer, for every
+   * identity that we collated by its <ed, RSA-SHA1> pair. */
+  digestmap_t *ed25519_consensus;
 
   /** One of two outputs created by collation: a map from RSA-SHA1
    * identity digest to an array of the vote_routerstatus_t objects.  Entries
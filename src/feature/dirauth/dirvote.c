@@ -8,6 +8,7 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "app/config/resolve_addr.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/policies.h"
 #include "core/or/protover.h"
 #include "core/or/tor_version_st.h"
@@ -63,7 +64,9 @@
 
 #include "lib/container/order.h"
 #include "lib/encoding/confline.h"
+#include "lib/compress/compress.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/time/compat_time.h"
 
 /* Algorithm to use for the bandwidth file digest. */
 #define DIGEST_ALG_BW_FILE DIGEST_SHA256
@@ -734,10 +737,14 @@ compute_routerstatus_consensus(smartlist_t *votes, int consensus_method,
     most_alt_orport = smartlist_get_most_frequent(alt_orports,
                                                   compare_orports_);
     if (most_alt_orport) {
+      char addrbuf[TOR_ADDR_BUF_LEN];
       memcpy(best_alt_orport_out, most_alt_orport, sizeof(tor_addr_port_t));
-      log_debug(LD_DIR, "\"a\" line winner for %s is %s",
-                most->status.nickname,
-                fmt_addrport(&most_alt_orport->addr, most_alt_orport->port));
+      if (!tor_addr_to_str(addrbuf, &most_alt_orport->addr,
+                           sizeof(addrbuf), 1))
+        strlcpy(addrbuf, "???", sizeof(addrbuf));
+      log_debug(LD_DIR, "\"a\" line winner for %s is %s:%u",
+                most->status.nickname, addrbuf,
+                (unsigned)most_alt_orport->port);
     }
 
     SMARTLIST_FOREACH(alt_orports, tor_addr_port_t *, ap, tor_free(ap));
@@ -864,10 +871,12 @@ compute_consensus_versions_list(smartlist_t *lst, int n_versioning)
   char *result;
   SMARTLIST_FOREACH_BEGIN(lst, const char *, v) {
     if (strchr(v, ' ')) {
+      char *esc = esc_for_log(v);
       log_warn(LD_DIR, "At least one authority has voted for a version %s "
                "that contains a space. This probably wasn't intentional, and "
                "is likely to cause trouble. Please tell them to stop it.",
-               escaped(v));
+               esc);
+      tor_free(esc);
     }
   } SMARTLIST_FOREACH_END(v);
   sort_version_list(lst, 0);
@@ -1497,15 +1506,20 @@ compute_nth_protocol_set(int n, int n_voters, const smartlist_t *votes)
  * here, you should allocate a new "consensus_method" for the new
  * behavior, and make the new behavior conditional on a new-enough
  * consensus_method.
+ *
+ * We don't check the consensus here: see networkstatus_compute_consensus().
+ * This function doesn't change any global state or the votes, other than
+ * sorting <b>votes</b>, so several threads can build consensus flavors from
+ * the same votes at once.
  **/
-STATIC char *
-networkstatus_compute_consensus(smartlist_t *votes,
-                                int total_authorities,
-                                crypto_pk_t *identity_key,
-                                crypto_pk_t *signing_key,
-                                const char *legacy_id_key_digest,
-                                crypto_pk_t *legacy_signing_key,
-                                consensus_flavor_t flavor)
+static char *
+networkstatus_build_consensus(smartlist_t *votes,
+                              int total_authorities,
+                              crypto_pk_t *identity_key,
+                              crypto_pk_t *signing_key,
+                              const char *legacy_id_key_digest,
+                              crypto_pk_t *legacy_signing_key,
+                              consensus_flavor_t flavor)
 {
   smartlist_t *chunks;
   char *result = NULL;
@@ -1521,7 +1535,6 @@ networkstatus_compute_consensus(smartlist_t *votes,
     flavor == FLAV_NS ? NS_V3_CONSENSUS : NS_V3_CONSENSUS_MICRODESC;
   char *params = NULL;
   char *packages = NULL;
-  int added_weights = 0;
   dircollator_t *collator = NULL;
   smartlist_t *param_list = NULL;
 
@@ -1731,17 +1744,21 @@ networkstatus_compute_consensus(smartlist_t *votes,
     SMARTLIST_FOREACH_BEGIN(dir_sources, const dir_src_ent_t *, e) {
       char fingerprint[HEX_DIGEST_LEN+1];
       char votedigest[HEX_DIGEST_LEN+1];
+      char addrbuf[TOR_ADDR_BUF_LEN];
       networkstatus_t *v = e->v;
       networkstatus_voter_info_t *voter = get_voter(v);
 
       base16_encode(fingerprint, sizeof(fingerprint), e->digest, DIGEST_LEN);
       base16_encode(votedigest, sizeof(votedigest), voter->vote_digest,
                     DIGEST_LEN);
+      /* Not fmt_addr(): we may be running on a cpuworker. */
+      if (!tor_addr_to_str(addrbuf, &voter->ipv4_addr, sizeof(addrbuf), 0))
+        strlcpy(addrbuf, "???", sizeof(addrbuf));
 
       smartlist_add_asprintf(chunks,
                    "dir-source %s%s %s %s %s %d %d\n",
                    voter->nickname, e->is_legacy ? "-legacy" : "",
-                   fingerprint, voter->address, fmt_addr(&voter->ipv4_addr),
+                   fingerprint, voter->address, addrbuf,
                    voter->ipv4_dirport,
                    voter->ipv4_orport);
       if (! e->is_legacy) {
@@ -1772,8 +1789,10 @@ networkstatus_compute_consensus(smartlist_t *votes,
         max_unmeasured_bw_kb = (uint32_t)
           tor_parse_ulong(eq+1, 10, 1, UINT32_MAX, &ok, NULL);
         if (!ok) {
+          char *esc = esc_for_log(max_unmeasured_param);
           log_warn(LD_DIR, "Bad element '%s' in max unmeasured bw param",
-                   escaped(max_unmeasured_param));
+                   esc);
+          tor_free(esc);
           max_unmeasured_bw_kb = DEFAULT_MAX_UNMEASURED_BW_KB;
         }
       }
@@ -1927,6 +1946,8 @@ networkstatus_compute_consensus(smartlist_t *votes,
     for (i = 0; i < num_routers; ++i) {
       vote_routerstatus_t **vrs_lst =
         dircollator_get_votes_for_router(collator, i);
+      const int has_ed25519_consensus =
+        dircollator_router_has_ed25519_consensus(collator, i);
 
       vote_routerstatus_t *rs;
       routerstatus_t rs_out;
@@ -2001,7 +2022,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
           bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
 
         /* Count number for which ed25519 is canonical. */
-        if (rs->ed25519_reflects_consensus) {
+        if (has_ed25519_consensus && rs->has_ed25519_listing) {
           ++ed_consensus;
           if (ed_consensus_val) {
             tor_assert(fast_memeq(ed_consensus_val, rs->ed25519_id,
@@ -2347,19 +2368,21 @@ networkstatus_compute_consensus(smartlist_t *votes,
         weight_scale = tor_parse_long(eq+1, 10, 1, INT32_MAX, &ok,
                                          NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Bad element '%s' in bw weight param",
-              escaped(bw_weight_param));
+          char *esc = esc_for_log(bw_weight_param);
+          log_warn(LD_DIR, "Bad element '%s' in bw weight param", esc);
+          tor_free(esc);
           weight_scale = BW_WEIGHT_SCALE;
         }
       } else {
-        log_warn(LD_DIR, "Bad element '%s' in bw weight param",
-            escaped(bw_weight_param));
+        char *esc = esc_for_log(bw_weight_param);
+        log_warn(LD_DIR, "Bad element '%s' in bw weight param", esc);
+        tor_free(esc);
         weight_scale = BW_WEIGHT_SCALE;
       }
     }
 
-    added_weights = networkstatus_compute_bw_weights_v10(chunks, G, M, E, D,
-                                                         T, weight_scale);
+    networkstatus_compute_bw_weights_v10(chunks, G, M, E, D, T,
+                                         weight_scale);
   }
 
   /* Add a signature. */
@@ -2426,23 +2449,6 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
   result = smartlist_join_strings(chunks, "", 0, NULL);
 
-  {
-    networkstatus_t *c;
-    if (!(c = networkstatus_parse_vote_from_string(result, strlen(result),
-                                                   NULL,
-                                                   NS_TYPE_CONSENSUS))) {
-      log_err(LD_BUG, "Generated a networkstatus consensus we couldn't "
-              "parse.");
-      tor_free(result);
-      goto done;
-    }
-    // Verify balancing parameters
-    if (added_weights) {
-      networkstatus_verify_bw_weights(c, consensus_method);
-    }
-    networkstatus_vote_free(c);
-  }
-
  done:
 
   dircollator_free(collator);
@@ -2459,6 +2465,62 @@ networkstatus_compute_consensus(smartlist_t *votes,
   return result;
 }
 
+/** Parse the consensus <b>body</b> that we just built, check that its
+ * bandwidth weights balance, and return its parsed form.  Log a bug and
+ * return NULL if we can't parse it.
+ *
+ * Only call this from the main thread: the parser uses the protover
+ * summary cache and the static buffers of escaped() and friends. */
+static networkstatus_t *
+networkstatus_check_consensus(const char *body)
+{
+  networkstatus_t *c;
+  if (!(c = networkstatus_parse_vote_from_string(body, strlen(body),
+                                                 NULL,
+                                                 NS_TYPE_CONSENSUS))) {
+    log_err(LD_BUG, "Generated a networkstatus consensus we couldn't "
+            "parse.");
+    return NULL;
+  }
+  // Verify balancing parameters
+  if (c->weight_params) {
+    networkstatus_verify_bw_weights(c, c->consensus_method);
+  }
+  return c;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Build a consensus as networkstatus_build_consensus() does, and check it
+ * with networkstatus_check_consensus().  Return the consensus in a newly
+ * allocated string, or NULL if we couldn't build it or it didn't check
+ * out.  We build every flavor at once with
+ * dirvote_compute_consensus_flavors(); the tests use this to build just
+ * one. */
+STATIC char *
+networkstatus_compute_consensus(smartlist_t *votes,
+                                int total_authorities,
+                                crypto_pk_t *identity_key,
+                                crypto_pk_t *signing_key,
+                                const char *legacy_id_key_digest,
+                                crypto_pk_t *legacy_signing_key,
+                                consensus_flavor_t flavor)
+{
+  networkstatus_t *c;
+  char *result = networkstatus_build_consensus(votes, total_authorities,
+                                               identity_key, signing_key,
+                                               legacy_id_key_digest,
+                                               legacy_signing_key, flavor);
+  if (!result)
+    return NULL;
+  if (!(c = networkstatus_check_consensus(result))) {
+    tor_free(result);
+    return NULL;
+  }
+  networkstatus_vote_free(c);
+  return result;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Given a list of networkstatus_t for each vote, return a newly allocated
  * string containing the "package" lines for the vote. */
 STATIC char *
@@ -2839,6 +2901,17 @@ get_detached_signatures_from_pending_consensuses(pending_consensus_t *pending,
   return signatures;
 }
 
+/** Log how long the voting action <b>action</b>, which we started at
+ * <b>start</b>, took. */
+static void
+dirvote_log_action_time(const char *action, const monotime_t *start)
+{
+  monotime_t end;
+  monotime_get(&end);
+  log_notice(LD_DIR, "%s took %"PRId64" msec.", action,
+             monotime_diff_msec(start, &end));
+}
+
 /**
  * Entry point: Take whatever voting actions are pending as of <b>now</b>.
  *
@@ -2847,6 +2920,8 @@ get_detached_signatures_from_pending_consensuses(pending_consensus_t *pending,
 time_t
 dirvote_act(const or_options_t *options, time_t now)
 {
+  monotime_t start;
+
   if (!authdir_mode_v3(options))
     return TIME_MAX;
   tor_assert_nonfatal(voting_schedule.voting_starts);
@@ -2876,17 +2951,23 @@ dirvote_act(const or_options_t *options, time_t now)
 
   IF_TIME_FOR_NEXT_ACTION(voting_starts, have_voted) {
     log_notice(LD_DIR, "Time to vote.");
+    monotime_get(&start);
     dirvote_perform_vote();
+    dirvote_log_action_time("Voting", &start);
     voting_schedule.have_voted = 1;
   } ENDIF
   IF_TIME_FOR_NEXT_ACTION(fetch_missing_votes, have_fetched_missing_votes) {
     log_notice(LD_DIR, "Time to fetch any votes that we're missing.");
+    monotime_get(&start);
     dirvote_fetch_missing_votes();
+    dirvote_log_action_time("Requesting missing votes", &start);
     voting_schedule.have_fetched_missing_votes = 1;
   } ENDIF
   IF_TIME_FOR_NEXT_ACTION(voting_ends, have_built_consensus) {
     log_notice(LD_DIR, "Time to compute a consensus.");
+    monotime_get(&start);
     dirvote_compute_consensuses();
+    dirvote_log_action_time("Computing the consensus", &start);
     /* XXXX We will want to try again later if we haven't got enough
      * votes yet.  Implement this if it turns out to ever happen. */
     voting_schedule.have_built_consensus = 1;
@@ -2894,13 +2975,17 @@ dirvote_act(const or_options_t *options, time_t now)
   IF_TIME_FOR_NEXT_ACTION(fetch_missing_signatures,
                           have_fetched_missing_signatures) {
     log_notice(LD_DIR, "Time to fetch any signatures that we're missing.");
+    monotime_get(&start);
     dirvote_fetch_missing_signatures();
+    dirvote_log_action_time("Requesting missing signatures", &start);
     voting_schedule.have_fetched_missing_signatures = 1;
   } ENDIF
   IF_TIME_FOR_NEXT_ACTION(interval_starts,
                           have_published_consensus) {
     log_notice(LD_DIR, "Time to publish the consensus and discard old votes");
+    monotime_get(&start);
     dirvote_publish_consensus();
+    dirvote_log_action_time("Publishing the consensus", &start);
     dirvote_clear_votes(0);
     voting_schedule.have_published_consensus = 1;
     /* Update our shared random state with the consensus just published. */
@@ -3356,6 +3441,153 @@ write_v3_votes_to_disk(const smartlist_t *pending_votes)
   smartlist_free(votestrings);
 }
 
+/** One flavor of consensus for dirvote_compute_consensus_flavors() to
+ * build, possibly on a cpuworker. */
+typedef struct consensus_flavor_job_t {
+  /** Which flavor to build. */
+  consensus_flavor_t flavor;
+  /** This job's own copy of the list of votes, since
+   * networkstatus_build_consensus() sorts it. */
+  smartlist_t *votes;
+  /** The rest of the arguments for networkstatus_build_consensus(). */
+  int n_voters;
+  crypto_pk_t *identity_key;
+  crypto_pk_t *signing_key;
+  const char *legacy_id_digest;
+  crypto_pk_t *legacy_signing_key;
+  /** The consensus that we built, or NULL if we couldn't build it. */
+  char *body;
+  /** How long it took to build the consensus. */
+  int64_t build_msec;
+} consensus_flavor_job_t;
+
+/** Build the consensus flavor described by the consensus_flavor_job_t
+ * <b>arg</b>. Safe to call from any thread, as long as the main thread is
+ * waiting for us.
+ *
+ * We don't check the consensus here: see networkstatus_check_consensus(). */
+static void
+consensus_flavor_job_run(void *arg)
+{
+  consensus_flavor_job_t *job = arg;
+  monotime_t start, built;
+
+  monotime_get(&start);
+  job->body = networkstatus_build_consensus(job->votes, job->n_voters,
+                                            job->identity_key,
+                                            job->signing_key,
+                                            job->legacy_id_digest,
+                                            job->legacy_signing_key,
+                                            job->flavor);
+  monotime_get(&built);
+  job->build_msec = monotime_diff_msec(&start, &built);
+}
+
+/** Build every flavor of consensus from <b>votes</b>, as
+ * networkstatus_compute_consensus() does for one flavor, and parse each of
+ * them.  For each flavor, set the corresponding element of
+ * <b>bodies_out</b> to the consensus we built and of
+ * <b>consensuses_out</b> to its parsed form, or both to NULL on failure.
+ * Return the number of flavors that we built.
+ *
+ * The flavors don't depend on each other, so we build them in parallel on
+ * the cpuworkers when we can, and then parse and check them here on the
+ * main thread.
+ * Every flavor comes out exactly as it would if we built them one after
+ * another. */
+STATIC int
+dirvote_compute_consensus_flavors(smartlist_t *votes, int n_voters,
+                                  crypto_pk_t *identity_key,
+                                  crypto_pk_t *signing_key,
+                                  const char *legacy_id_digest,
+                                  crypto_pk_t *legacy_signing_key,
+                                  char **bodies_out,
+                                  networkstatus_t **consensuses_out)
+{
+  consensus_flavor_job_t jobs[N_CONSENSUS_FLAVORS];
+  void *args[N_CONSENSUS_FLAVORS];
+  monotime_t start, end;
+  int flav, n_generated = 0;
+
+  memset(jobs, 0, sizeof(jobs));
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    consensus_flavor_job_t *job = &jobs[flav];
+    job->flavor = flav;
+    job->votes = smartlist_new();
+    smartlist_add_all(job->votes, votes);
+    job->n_voters = n_voters;
+    job->identity_key = identity_key;
+    job->signing_key = signing_key;
+    job->legacy_id_digest = legacy_id_digest;
+    job->legacy_signing_key = legacy_signing_key;
+    args[flav] = job;
+  }
+
+  monotime_get(&start);
+  cpuworker_run_parallel(consensus_flavor_job_run, args,
+                         N_CONSENSUS_FLAVORS);
+  monotime_get(&end);
+
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    consensus_flavor_job_t *job = &jobs[flav];
+    const char *flavor_name = networkstatus_get_flavor_name(flav);
+    networkstatus_t *consensus;
+    monotime_t parse_start, parse_end;
+    bodies_out[flav] = NULL;
+    consensuses_out[flav] = NULL;
+    smartlist_free(job->votes);
+
+    if (!job->body) {
+      log_warn(LD_DIR, "Couldn't generate a %s consensus at all!",
+               flavor_name);
+      continue;
+    }
+    monotime_get(&parse_start);
+    consensus = networkstatus_check_consensus(job->body);
+    monotime_get(&parse_end);
+    if (!consensus) {
+      log_warn(LD_DIR, "Couldn't parse %s consensus we generated!",
+               flavor_name);
+      tor_free(job->body);
+      continue;
+    }
+    log_info(LD_DIR, "Built %s consensus in %"PRId64" msec, and parsed it "
+             "in %"PRId64" msec.", flavor_name, job->build_msec,
+             monotime_diff_msec(&parse_start, &parse_end));
+    bodies_out[flav] = job->body;
+    consensuses_out[flav] = consensus;
+    n_generated++;
+  }
+  log_notice(LD_DIR, "Built %d consensus flavor(s) in %"PRId64" msec.",
+             n_generated, monotime_diff_msec(&start, &end));
+
+  return n_generated;
+}
+
+/** A consensus flavor that we're about to publish, to be compressed,
+ * possibly on a cpuworker. */
+typedef struct consensus_compress_job_t {
+  /** The consensus to compress. Not owned by this job. */
+  const char *body;
+  size_t body_len;
+  /** The compressed consensus, or NULL if we couldn't compress it. */
+  char *compressed;
+  size_t compressed_len;
+} consensus_compress_job_t;
+
+/** Compress the consensus described by the consensus_compress_job_t
+ * <b>arg</b> in the way that the directory cache code would. */
+static void
+consensus_compress_job_run(void *arg)
+{
+  consensus_compress_job_t *job = arg;
+  if (tor_compress(&job->compressed, &job->compressed_len,
+                   job->body, job->body_len, ZLIB_METHOD) < 0) {
+    tor_free(job->compressed);
+    job->compressed_len = 0;
+  }
+}
+
 /** Try to compute a v3 networkstatus consensus from the currently pending
  * votes.  Return 0 on success, -1 on failure.  Store the consensus in
  * pending_consensus: it won't be ready to be published until we have
@@ -3366,8 +3598,7 @@ dirvote_compute_consensuses(void)
   /* Have we got enough votes to try? */
   int n_votes, n_voters, n_vote_running = 0;
   smartlist_t *votes = NULL;
-  char *consensus_body = NULL, *signatures = NULL;
-  networkstatus_t *consensus = NULL;
+  char *signatures = NULL;
   authority_cert_t *my_cert;
   pending_consensus_t pending[N_CONSENSUS_FLAVORS];
   int flav;
@@ -3418,6 +3649,8 @@ dirvote_compute_consensuses(void)
     char legacy_dbuf[DIGEST_LEN];
     crypto_pk_t *legacy_sign=NULL;
     char *legacy_id_digest = NULL;
+    char *bodies[N_CONSENSUS_FLAVORS];
+    networkstatus_t *consensuses[N_CONSENSUS_FLAVORS];
     int n_generated = 0;
     if (get_options()->V3AuthUseLegacyKey) {
       authority_cert_t *cert = get_my_v3_legacy_cert();
@@ -3432,38 +3665,21 @@ dirvote_compute_consensuses(void)
       }
     }
 
+    dirvote_compute_consensus_flavors(votes, n_voters,
+                                      my_cert->identity_key,
+                                      get_my_v3_authority_signing_key(),
+                                      legacy_id_digest, legacy_sign,
+                                      bodies, consensuses);
+
     for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
-      const char *flavor_name = networkstatus_get_flavor_name(flav);
-      consensus_body = networkstatus_compute_consensus(
-        votes, n_voters,
-        my_cert->identity_key,
-        get_my_v3_authority_signing_key(), legacy_id_digest, legacy_sign,
-        flav);
-
-      if (!consensus_body) {
-        log_warn(LD_DIR, "Couldn't generate a %s consensus at all!",
-                 flavor_name);
-        continue;
-      }
-      consensus = networkstatus_parse_vote_from_string(consensus_body,
-                                                       strlen(consensus_body),
-                                                       NULL,
-                                                       NS_TYPE_CONSENSUS);
-      if (!consensus) {
-        log_warn(LD_DIR, "Couldn't parse %s consensus we generated!",
-                 flavor_name);
-        tor_free(consensus_body);
+      if (!consensuses[flav])
         continue;
-      }
-
       /* 'Check' our own signature, to mark it valid. */
-      networkstatus_check_consensus_signature(consensus, -1);
+      networkstatus_check_consensus_signature(consensuses[flav], -1);
 
-      pending[flav].body = consensus_body;
-      pending[flav].consensus = consensus;
+      pending[flav].body = bodies[flav];
+      pending[flav].consensus = consensuses[flav];
       n_generated++;
-      consensus_body = NULL;
-      consensus = NULL;
     }
     if (!n_generated) {
       log_warn(LD_DIR, "Couldn't generate any consensus flavors at all.");
@@ -3520,9 +3736,7 @@ dirvote_compute_consensuses(void)
   return 0;
  err:
   smartlist_free(votes);
-  tor_free(consensus_body);
   tor_free(signatures);
-  networkstatus_vote_free(consensus);
 
   return -1;
 }
@@ -3710,9 +3924,12 @@ dirvote_add_signatures(const char *detached_signatures_body,
 static int
 dirvote_publish_consensus(void)
 {
-  int i;
+  consensus_compress_job_t jobs[N_CONSENSUS_FLAVORS];
+  void *args[N_CONSENSUS_FLAVORS];
+  int flavors[N_CONSENSUS_FLAVORS];
+  int i, n_ready = 0;
 
-  /* Now remember all the other consensuses as if we were a directory cache. */
+  memset(jobs, 0, sizeof(jobs));
   for (i = 0; i < N_CONSENSUS_FLAVORS; ++i) {
     pending_consensus_t *pending = &pending_consensuses[i];
     const char *name;
@@ -3723,6 +3940,29 @@ dirvote_publish_consensus(void)
       log_warn(LD_DIR, "Not enough info to publish pending %s consensus",name);
       continue;
     }
+    jobs[n_ready].body = pending->body;
+    jobs[n_ready].body_len = strlen(pending->body);
+    args[n_ready] = &jobs[n_ready];
+    flavors[n_ready] = i;
+    ++n_ready;
+  }
+
+  /* We're about to serve every one of these, so compress them all at once
+   * rather than one after another as we start serving them. */
+  cpuworker_run_parallel(consensus_compress_job_run, args, n_ready);
+  for (i = 0; i < n_ready; ++i) {
+    if (jobs[i].compressed) {
+      dirserv_add_precompressed_consensus(jobs[i].body, jobs[i].body_len,
+                                          jobs[i].compressed,
+                                          jobs[i].compressed_len);
+      tor_free(jobs[i].compressed);
+    }
+  }
+
+  /* Now remember all the other consensuses as if we were a directory cache. */
+  for (i = 0; i < n_ready; ++i) {
+    pending_consensus_t *pending = &pending_consensuses[flavors[i]];
+    const char *name = networkstatus_get_flavor_name(flavors[i]);
 
     if (networkstatus_set_current_consensus(pending->body,
                                             strlen(pending->body),
@@ -3731,6 +3971,7 @@ dirvote_publish_consensus(void)
     else
       log_notice(LD_DIR, "Published %s consensus", name);
   }
+  dirserv_clear_precompressed_consensuses();
 
   return 0;
 }
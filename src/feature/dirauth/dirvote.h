@@ -222,6 +222,7 @@ STATIC int
 networkstatus_compute_bw_weights_v10(smartlist_t *chunks, int64_t G,
                                      int64_t M, int64_t E, int64_t D,
                                      int64_t T, int64_t weight_scale);
+#ifdef TOR_UNIT_TESTS
 STATIC
 char *networkstatus_compute_consensus(smartlist_t *votes,
                                       int total_authorities,
@@ -230,6 +231,15 @@ char *networkstatus_compute_consensus(smartlist_t *votes,
                                       const char *legacy_identity_key_digest,
                                       crypto_pk_t *legacy_signing_key,
                                       consensus_flavor_t flavor);
+#endif
+STATIC int dirvote_compute_consensus_flavors(smartlist_t *votes,
+                                          int n_voters,
+                                          crypto_pk_t *identity_key,
+                                          crypto_pk_t *signing_key,
+                                          const char *legacy_id_digest,
+                                          crypto_pk_t *legacy_signing_key,
+                                          char **bodies_out,
+                                          networkstatus_t **consensuses_out);
 STATIC
 int networkstatus_add_detached_signatures(networkstatus_t *target,
                                           ns_detached_signatures_t *sigs,
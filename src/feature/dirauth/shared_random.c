@@ -115,12 +115,6 @@ static const char current_srv_str[] = "shared-rand-current-value";
 static const char commit_ns_str[] = "shared-rand-commit";
 static const char sr_flag_ns_str[] = "shared-rand-participate";
 
-/** The value of the consensus param AuthDirNumSRVAgreements found in the
- * vote. This is set once the consensus creation subsystem requests the
- * SRV(s) that should be put in the consensus. We use this value to decide
- * if we keep or not an SRV. */
-static int32_t num_srv_agreements_from_vote;
-
 /** Return a heap allocated copy of the SRV <b>orig</b>. */
 sr_srv_t *
 sr_srv_dup(const sr_srv_t *orig)
@@ -753,10 +747,11 @@ save_commit_to_state(sr_commit_t *commit)
   }
 }
 
-/** Return 1 if we should we keep an SRV voted by <b>n_agreements</b> auths.
- * Return 0 if we should ignore it. */
+/** Return 1 if we should we keep an SRV voted by <b>n_agreements</b> auths,
+ * given that the votes set AuthDirNumSRVAgreements to
+ * <b>num_srv_agreements</b>.  Return 0 if we should ignore it. */
 static int
-should_keep_srv(int n_agreements)
+should_keep_srv(int n_agreements, int32_t num_srv_agreements)
 {
   /* Check if the most popular SRV has reached majority. */
   int n_voters = get_n_authorities(V3_DIRINFO);
@@ -773,9 +768,9 @@ should_keep_srv(int n_agreements)
    * to keep it. */
   if (sr_state_srv_is_fresh()) {
     /* Check if we have super majority for this new SRV value. */
-    if (n_agreements < num_srv_agreements_from_vote) {
+    if (n_agreements < num_srv_agreements) {
       log_notice(LD_DIR, "SR: New SRV didn't reach agreement [%d/%d]!",
-                 n_agreements, num_srv_agreements_from_vote);
+                 n_agreements, num_srv_agreements);
       return 0;
     }
   }
@@ -810,11 +805,13 @@ compare_srv_(const void **_a, const void **_b)
 
 /** Using a list of <b>votes</b>, return the SRV object from them that has
  * been voted by the majority of dirauths. If <b>current</b> is set, we look
- * for the current SRV value else the previous one. The returned pointer is
- * an object located inside a vote. NULL is returned if no appropriate value
- * could be found. */
+ * for the current SRV value else the previous one. A fresh SRV also needs
+ * the <b>num_srv_agreements</b> that the votes ask for. The returned pointer
+ * is an object located inside a vote. NULL is returned if no appropriate
+ * value could be found. */
 STATIC sr_srv_t *
-get_majority_srv_from_votes(const smartlist_t *votes, int current)
+get_majority_srv_from_votes(const smartlist_t *votes, int current,
+                            int32_t num_srv_agreements)
 {
   int count = 0;
   sr_srv_t *most_frequent_srv = NULL;
@@ -849,7 +846,7 @@ get_majority_srv_from_votes(const smartlist_t *votes, int current)
   }
 
   /* Was this SRV voted by enough auths for us to keep it? */
-  if (!should_keep_srv(count)) {
+  if (!should_keep_srv(count, num_srv_agreements)) {
     goto end;
   }
 
@@ -1208,13 +1205,12 @@ sr_get_string_for_consensus(const smartlist_t *votes,
     goto end;
   }
 
-  /* Set the global value of AuthDirNumSRVAgreements found in the votes. */
-  num_srv_agreements_from_vote = num_srv_agreements;
-
   /* Check the votes and figure out if SRVs should be included in the final
    * consensus. */
-  sr_srv_t *prev_srv = get_majority_srv_from_votes(votes, 0);
-  sr_srv_t *cur_srv = get_majority_srv_from_votes(votes, 1);
+  sr_srv_t *prev_srv = get_majority_srv_from_votes(votes, 0,
+                                                   num_srv_agreements);
+  sr_srv_t *cur_srv = get_majority_srv_from_votes(votes, 1,
+                                                  num_srv_agreements);
   srv_str = get_ns_str_from_sr_values(prev_srv, cur_srv);
   if (!srv_str) {
     goto end;
@@ -1279,16 +1275,3 @@ sr_save_and_cleanup(void)
   sr_state_save();
   sr_cleanup();
 }
-
-#ifdef TOR_UNIT_TESTS
-
-/** Set the global value of number of SRV agreements so the test can play
- * along by calling specific functions that don't parse the votes prior for
- * the AuthDirNumSRVAgreements value. */
-void
-set_num_srv_agreements(int32_t value)
-{
-  num_srv_agreements_from_vote = value;
-}
-
-#endif /* defined(TOR_UNIT_TESTS) */
@@ -172,7 +172,8 @@ STATIC int commit_has_reveal_value(const sr_commit_t *commit);
 STATIC int verify_commit_and_reveal(const sr_commit_t *commit);
 
 STATIC sr_srv_t *get_majority_srv_from_votes(const smartlist_t *votes,
-                                             int current);
+                                             int current,
+                                             int32_t num_srv_agreements);
 
 STATIC void save_commit_to_state(sr_commit_t *commit);
 STATIC int commitments_are_the_same(const sr_commit_t *commit_one,
@@ -186,10 +187,4 @@ STATIC void save_commit_during_reveal_phase(const sr_commit_t *commit);
 
 #endif /* defined(SHARED_RANDOM_PRIVATE) */
 
-#ifdef TOR_UNIT_TESTS
-
-void set_num_srv_agreements(int32_t value);
-
-#endif /* TOR_UNIT_TESTS */
-
 #endif /* !defined(TOR_SHARED_RANDOM_H) */
@@ -64,6 +64,10 @@ struct consensus_cache_t {
   storage_dir_t *dir;
   /** List of all the entries in the directory. */
   smartlist_t *entries;
+  /** Map from "key value" for each label to a smartlist of the entries that
+   * have that label, in no particular order.  Only the first label with any
+   * given key is indexed, to match consensus_cache_entry_get_value(). */
+  strmap_t *label_index;
 
   /** The maximum number of entries that we'd like to allow in this cache.
    * This is the same as the storagedir limit when MUST_UNMAP_TO_UNLINK is
@@ -76,6 +80,10 @@ static void consensus_cache_rescan(consensus_cache_t *);
 static void consensus_cache_entry_map(consensus_cache_t *,
                                       consensus_cache_entry_t *);
 static void consensus_cache_entry_unmap(consensus_cache_entry_t *ent);
+static void consensus_cache_index_entry(consensus_cache_t *cache,
+                                        consensus_cache_entry_t *ent);
+static void consensus_cache_unindex_entry(consensus_cache_t *cache,
+                                          consensus_cache_entry_t *ent);
 
 /**
  * Helper: Open a consensus cache in subdirectory <b>subdir</b> of the
@@ -171,6 +179,13 @@ consensus_cache_register_with_sandbox(consensus_cache_t *cache,
 #endif
 #endif
 
+/** Helper: free a smartlist from the label index, for strmap_free(). */
+static void
+label_index_list_free_(void *lst)
+{
+  smartlist_free_(lst);
+}
+
 /**
  * Helper: clear all entries from <b>cache</b> (but do not delete
  * any that aren't marked for removal
@@ -180,6 +195,7 @@ consensus_cache_clear(consensus_cache_t *cache)
 {
   consensus_cache_delete_pending(cache, 0);
 
+  strmap_free(cache->label_index, label_index_list_free_);
   SMARTLIST_FOREACH_BEGIN(cache->entries, consensus_cache_entry_t *, ent) {
     ent->in_cache = NULL;
     consensus_cache_entry_decref(ent);
@@ -188,6 +204,62 @@ consensus_cache_clear(consensus_cache_t *cache)
   cache->entries = NULL;
 }
 
+/**
+ * Helper: return a newly allocated key for <b>key</b>=<b>value</b> in the
+ * label index.  (Label keys can't contain spaces, so this is unambiguous.)
+ */
+static char *
+label_index_key(const char *key, const char *value)
+{
+  char *k = NULL;
+  tor_asprintf(&k, "%s %s", key, value);
+  return k;
+}
+
+/**
+ * Add <b>ent</b> to the label index of <b>cache</b>.
+ */
+static void
+consensus_cache_index_entry(consensus_cache_t *cache,
+                            consensus_cache_entry_t *ent)
+{
+  for (const config_line_t *line = ent->labels; line; line = line->next) {
+    if (config_line_find(ent->labels, line->key) != line)
+      continue; /* Only the first value for each key counts. */
+    char *k = label_index_key(line->key, line->value);
+    smartlist_t *lst = strmap_get(cache->label_index, k);
+    if (!lst) {
+      lst = smartlist_new();
+      strmap_set(cache->label_index, k, lst);
+    }
+    smartlist_add(lst, ent);
+    tor_free(k);
+  }
+}
+
+/**
+ * Remove <b>ent</b> from the label index of <b>cache</b>.
+ */
+static void
+consensus_cache_unindex_entry(consensus_cache_t *cache,
+                              consensus_cache_entry_t *ent)
+{
+  for (const config_line_t *line = ent->labels; line; line = line->next) {
+    if (config_line_find(ent->labels, line->key) != line)
+      continue;
+    char *k = label_index_key(line->key, line->value);
+    smartlist_t *lst = strmap_get(cache->label_index, k);
+    if (lst) {
+      smartlist_remove(lst, ent);
+      if (smartlist_len(lst) == 0) {
+        strmap_remove(cache->label_index, k);
+        smartlist_free(lst);
+      }
+    }
+    tor_free(k);
+  }
+}
+
 /**
  * Drop all storage held by <b>cache</b>.
  */
@@ -237,6 +309,7 @@ consensus_cache_add(consensus_cache_t *cache,
   ent->in_cache = cache;
   ent->unused_since = TIME_MAX;
   smartlist_add(cache->entries, ent);
+  consensus_cache_index_entry(cache, ent);
   /* Start the reference count at 2: the caller owns one copy, and the
    * cache owns another.
    */
@@ -269,7 +342,8 @@ consensus_cache_find_first(consensus_cache_t *cache,
  * Given a <b>cache</b>, add every entry to <b>out</b> for which
  * <b>key</b>=<b>value</b>.  If <b>key</b> is NULL, add every entry.
  *
- * Do not add any entry that has been marked for removal.
+ * Do not add any entry that has been marked for removal.  The entries are
+ * added in no particular order.
  *
  * Does not adjust reference counts.
  */
@@ -279,19 +353,20 @@ consensus_cache_find_all(smartlist_t *out,
                          const char *key,
                          const char *value)
 {
-  SMARTLIST_FOREACH_BEGIN(cache->entries, consensus_cache_entry_t *, ent) {
+  const smartlist_t *candidates = cache->entries;
+  if (key) {
+    char *k = label_index_key(key, value);
+    candidates = strmap_get(cache->label_index, k);
+    tor_free(k);
+    if (!candidates)
+      return;
+  }
+  SMARTLIST_FOREACH_BEGIN(candidates, consensus_cache_entry_t *, ent) {
     if (ent->can_remove == 1) {
       /* We want to delete this; pretend it isn't there. */
       continue;
     }
-    if (! key) {
-      smartlist_add(out, ent);
-      continue;
-    }
-    const char *found_val = consensus_cache_entry_get_value(ent, key);
-    if (found_val && !strcmp(value, found_val)) {
-      smartlist_add(out, ent);
-    }
+    smartlist_add(out, ent);
   } SMARTLIST_FOREACH_END(ent);
 }
 
@@ -457,6 +532,33 @@ consensus_cache_entry_get_body(const consensus_cache_entry_t *ent,
   return 0;
 }
 
+/**
+ * Open the file that holds <b>ent</b> for reading, so that its body can be
+ * sent without going through memory.  The body must already be mapped (see
+ * consensus_cache_entry_get_body()).  On success, set *<b>offset_out</b> to
+ * the position of the body within the file, and return a file descriptor
+ * that the caller must close.  On failure, return -1.
+ */
+int
+consensus_cache_entry_open_body(const consensus_cache_entry_t *ent,
+                                uint64_t *offset_out)
+{
+  if (BUG(ent->magic != CCE_MAGIC))
+    return -1; // LCOV_EXCL_LINE
+  if (! ent->in_cache || ! ent->map)
+    return -1;
+  if (BUG(ent->body < (const uint8_t *)ent->map->data) ||
+      BUG(ent->body + ent->bodylen >
+          (const uint8_t *)ent->map->data + ent->map->size))
+    return -1; // LCOV_EXCL_LINE
+
+  int fd = storage_dir_open_for_read(ent->in_cache->dir, ent->fname);
+  if (fd < 0)
+    return -1;
+  *offset_out = (uint64_t)(ent->body - (const uint8_t *)ent->map->data);
+  return fd;
+}
+
 /**
  * Unmap every mmap'd element of <b>cache</b> that has been unused
  * since <b>cutoff</b>.
@@ -533,6 +635,7 @@ consensus_cache_delete_pending(consensus_cache_t *cache, int force)
     }
 
     SMARTLIST_DEL_CURRENT(cache->entries, ent);
+    consensus_cache_unindex_entry(cache, ent);
     ent->in_cache = NULL;
     char *fname = tor_strdup(ent->fname); /* save a copy */
     consensus_cache_entry_decref(ent);
@@ -552,6 +655,7 @@ consensus_cache_rescan(consensus_cache_t *cache)
   }
 
   cache->entries = smartlist_new();
+  cache->label_index = strmap_new();
   const smartlist_t *fnames = storage_dir_list(cache->dir);
   SMARTLIST_FOREACH_BEGIN(fnames, const char *, fname) {
     tor_mmap_t *map = NULL;
@@ -586,6 +690,7 @@ consensus_cache_rescan(consensus_cache_t *cache)
     ent->in_cache = cache;
     ent->unused_since = TIME_MAX;
     smartlist_add(cache->entries, ent);
+    consensus_cache_index_entry(cache, ent);
     tor_munmap_file(map); /* don't actually need to keep this around */
   } SMARTLIST_FOREACH_END(fname);
 }
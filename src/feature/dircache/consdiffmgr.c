@@ -462,10 +462,8 @@ cdm_cache_lookup_consensus(consensus_flavor_t flavor, time_t valid_after)
   format_iso_time_nospace(formatted_time, valid_after);
   const char *flavname = networkstatus_get_flavor_name(flavor);
 
-  /* We'll filter by valid-after time first, since that should
+  /* We'll look up by valid-after time first, since that should
    * match the fewest documents. */
-  /* We could add an extra hashtable here, but since we only do this scan
-   * when adding a new consensus, it probably doesn't matter much. */
   smartlist_t *matches = smartlist_new();
   consensus_cache_find_all(matches, cdm_cache_get(),
                            LABEL_VALID_AFTER, formatted_time);
@@ -118,6 +118,28 @@ directory_permits_begindir_requests(const or_options_t *options)
  * currently serving. */
 static strmap_t *cached_consensuses = NULL;
 
+/** A compressed copy of a consensus that we expect to start serving soon:
+ * see dirserv_add_precompressed_consensus(). */
+typedef struct precompressed_consensus_t {
+  char *compressed;
+  size_t compressed_len;
+} precompressed_consensus_t;
+
+/** Map from the SHA256 digest of a consensus to the
+ * precompressed_consensus_t for it. */
+static digest256map_t *precompressed_consensuses = NULL;
+
+/** Free a precompressed_consensus_t. */
+static void
+precompressed_consensus_free_(void *arg)
+{
+  precompressed_consensus_t *pc = arg;
+  if (!pc)
+    return;
+  tor_free(pc->compressed);
+  tor_free(pc);
+}
+
 /** Decrement the reference count on <b>d</b>, and free it if it no longer has
  * any references. */
 void
@@ -146,6 +168,43 @@ new_cached_dir(char *s, time_t published)
   return d;
 }
 
+/** Remember that <b>compressed</b> (of length <b>compressed_len</b>) is
+ * the consensus <b>consensus</b> (of length <b>consensus_len</b>),
+ * compressed with ZLIB_METHOD, so that if we're asked to serve that
+ * consensus before dirserv_clear_precompressed_consensuses() is called, we
+ * don't need to compress it again.
+ *
+ * Directory authorities compress all of their consensus flavors at once
+ * on the cpuworkers, just before they publish them. */
+void
+dirserv_add_precompressed_consensus(const char *consensus,
+                                    size_t consensus_len,
+                                    const char *compressed,
+                                    size_t compressed_len)
+{
+  uint8_t digest[DIGEST256_LEN];
+  precompressed_consensus_t *pc;
+
+  if (!precompressed_consensuses)
+    precompressed_consensuses = digest256map_new();
+
+  crypto_digest256((char *)digest, consensus, consensus_len, DIGEST_SHA256);
+  pc = tor_malloc_zero(sizeof(precompressed_consensus_t));
+  pc->compressed = tor_memdup(compressed, compressed_len);
+  pc->compressed_len = compressed_len;
+  precompressed_consensus_free_(
+              digest256map_set(precompressed_consensuses, digest, pc));
+}
+
+/** Forget every consensus passed to dirserv_add_precompressed_consensus()
+ * that we haven't started serving. */
+void
+dirserv_clear_precompressed_consensuses(void)
+{
+  digest256map_free(precompressed_consensuses, precompressed_consensus_free_);
+  precompressed_consensuses = NULL;
+}
+
 /** Remove all storage held in <b>d</b>, but do not free <b>d</b> itself. */
 static void
 clear_cached_dir(cached_dir_t *d)
@@ -178,14 +237,33 @@ dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
                                            const uint8_t *sha3_as_signed,
                                            time_t published)
 {
-  cached_dir_t *new_networkstatus;
+  cached_dir_t *new_networkstatus = NULL;
   cached_dir_t *old_networkstatus;
   if (!cached_consensuses)
     cached_consensuses = strmap_new();
 
-  new_networkstatus =
-    new_cached_dir(tor_memdup_nulterm(networkstatus, networkstatus_len),
-                   published);
+  if (precompressed_consensuses) {
+    uint8_t digest[DIGEST256_LEN];
+    precompressed_consensus_t *pc;
+    crypto_digest256((char *)digest, networkstatus, networkstatus_len,
+                     DIGEST_SHA256);
+    pc = digest256map_remove(precompressed_consensuses, digest);
+    if (pc) {
+      new_networkstatus = tor_malloc_zero(sizeof(cached_dir_t));
+      new_networkstatus->refcnt = 1;
+      new_networkstatus->dir =
+        tor_memdup_nulterm(networkstatus, networkstatus_len);
+      new_networkstatus->dir_len = strlen(new_networkstatus->dir);
+      new_networkstatus->published = published;
+      new_networkstatus->dir_compressed = pc->compressed;
+      new_networkstatus->dir_compressed_len = pc->compressed_len;
+      tor_free(pc);
+    }
+  }
+  if (!new_networkstatus)
+    new_networkstatus =
+      new_cached_dir(tor_memdup_nulterm(networkstatus, networkstatus_len),
+                     published);
   memcpy(&new_networkstatus->digests, digests, sizeof(common_digests_t));
   memcpy(&new_networkstatus->digest_sha3_as_signed, sha3_as_signed,
          DIGEST256_LEN);
@@ -383,6 +461,12 @@ spooled_resource_free_(spooled_resource_t *spooled)
  * at least this much. */
 #define DIRSERV_CACHED_DIR_CHUNK_SIZE 8192
 
+/** When spooling a consensus cache entry to a connection that can take it,
+ * we hand the rest of the file to the kernel instead of copying it, as long
+ * as at least this much is left.  (For smaller objects, opening the file
+ * costs more than the copy.) */
+#define DIRSERV_FILE_REGION_MIN 65536
+
 /** Return an compression ratio for compressing objects from <b>source</b>.
  */
 static double
@@ -502,11 +586,36 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
       total_len = spooled->cce_len;
       ptr = (const char *)spooled->cce_body;
     }
+    if (cce && connection_dir_has_file_region(conn)) {
+      if (! conn->file_region_failed) {
+        /* The kernel is still sending the rest of this entry. */
+        return SRFS_MORE;
+      }
+      /* The kernel wouldn't send it for us: copy the rest instead. */
+      spooled->cached_dir_offset = total_len - conn->file_region_len;
+      connection_dir_clear_file_region(conn);
+    }
+
     /* How many bytes left to flush? */
     int64_t remaining;
     remaining = total_len - spooled->cached_dir_offset;
     if (BUG(remaining < 0))
       return SRFS_ERR;
+    if (remaining == 0)
+      return SRFS_DONE;
+
+    if (cce && remaining >= DIRSERV_FILE_REGION_MIN &&
+        connection_dir_can_send_file_region(conn)) {
+      uint64_t file_offset = 0;
+      int fd = consensus_cache_entry_open_body(cce, &file_offset);
+      if (fd >= 0) {
+        file_offset += spooled->cached_dir_offset;
+        connection_dir_set_file_region(conn, fd, file_offset,
+                                       (size_t) remaining);
+        spooled->cached_dir_offset = total_len;
+        return SRFS_MORE;
+      }
+    }
     ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
 
     connection_dir_buf_add(ptr + spooled->cached_dir_offset,
@@ -800,4 +909,5 @@ dirserv_free_all(void)
 {
   strmap_free(cached_consensuses, free_cached_dir_);
   cached_consensuses = NULL;
+  dirserv_clear_precompressed_consensuses();
 }
@@ -93,6 +93,11 @@ void dirserv_set_cached_consensus_networkstatus(const char *consensus,
                                               const common_digests_t *digests,
                                               const uint8_t *sha3_as_signed,
                                               time_t published);
+void dirserv_add_precompressed_consensus(const char *consensus,
+                                         size_t consensus_len,
+                                         const char *compressed,
+                                         size_t compressed_len);
+void dirserv_clear_precompressed_consensuses(void);
 #else /* !defined(HAVE_MODULE_DIRCACHE) */
 #define have_module_dircache() (0)
 #define directory_caches_unknown_auth_certs(opt) \
@@ -112,6 +117,15 @@ void dirserv_set_cached_consensus_networkstatus(const char *consensus,
     (void)(e);                                                  \
     (void)(f);                                                  \
   } STMT_END
+#define dirserv_add_precompressed_consensus(a,b,c,d) \
+  STMT_BEGIN {                                       \
+    (void)(a);                                       \
+    (void)(b);                                       \
+    (void)(c);                                       \
+    (void)(d);                                       \
+  } STMT_END
+#define dirserv_clear_precompressed_consensuses() \
+  STMT_NIL
 #endif /* defined(HAVE_MODULE_DIRCACHE) */
 
 void dirserv_clear_old_networkstatuses(time_t cutoff);
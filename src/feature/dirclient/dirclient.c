@@ -53,6 +53,7 @@
 #include "feature/rend/rendservice.h"
 #include "feature/stats/predict_ports.h"
 
+#include "lib/buf/buffers.h"
 #include "lib/cc/ctassert.h"
 #include "lib/compress/compress.h"
 #include "lib/crypt_ops/crypto_format.h"
@@ -2011,6 +2012,377 @@ dirclient_dump_total_dls(void)
   }
 }
 
+/** How many decompressed bytes of microdescriptors do we let pile up on a
+ * streaming download before we parse the complete ones among them? */
+#define DIR_STREAM_MD_BATCH_SIZE (16*1024)
+
+/** How many compressed bytes do we take from the inbuf at a time when we're
+ * decompressing a response as it arrives? */
+#define DIR_STREAM_CHUNK_SIZE (16*1024)
+
+/** State for a directory response that we're decompressing as it arrives,
+ * rather than buffering all of it until the server closes the
+ * connection. */
+typedef struct dir_client_stream_t {
+  /** The headers of the response, NUL-terminated. */
+  char *headers;
+  /** The compression method that the server declared, and that the start of
+   * the body agreed with. */
+  compress_method_t compression;
+  /** The object that's decompressing the body. */
+  tor_compress_state_t *decompress;
+  /** True iff the decompressor has reached the end of a compressed stream,
+   * and has had no input since. */
+  unsigned int decompress_done:1;
+  /** Decompressed bytes that we haven't handed to a parser yet. */
+  char *body;
+  /** Number of bytes used in <b>body</b>. */
+  size_t body_len;
+  /** Number of bytes allocated for <b>body</b>. */
+  size_t body_alloc;
+  /** Number of bytes we've taken from the inbuf so far: headers and
+   * compressed body alike. */
+  size_t n_read;
+  /** For microdescriptor downloads: the digests that we asked for and
+   * haven't received yet. */
+  smartlist_t *md_wanted;
+  /** For microdescriptor downloads: how many of them we've already added to
+   * the cache. */
+  int n_mds_added;
+  /** For microdescriptor downloads: true iff we've added some to the cache
+   * since we last called directory_info_has_arrived(). */
+  unsigned int mds_unannounced:1;
+  /** For microdescriptor downloads: when we last called
+   * directory_info_has_arrived(). */
+  time_t mds_announced_at;
+} dir_client_stream_t;
+
+/** Release all storage held by <b>stream</b>. */
+void
+dir_client_stream_free_(dir_client_stream_t *stream)
+{
+  if (!stream)
+    return;
+  tor_free(stream->headers);
+  tor_compress_free(stream->decompress);
+  tor_free(stream->body);
+  if (stream->md_wanted) {
+    SMARTLIST_FOREACH(stream->md_wanted, char *, cp, tor_free(cp));
+    smartlist_free(stream->md_wanted);
+  }
+  tor_free(stream);
+}
+
+/** Return the number of bytes of the response on <b>conn</b> that we've
+ * already taken off its inbuf to decompress as they arrived. */
+size_t
+connection_dir_client_bytes_streamed(const dir_connection_t *conn)
+{
+  return conn->client_stream ? conn->client_stream->n_read : 0;
+}
+
+/** Look at the start of the response on <b>conn</b>, and decide whether we
+ * can decompress it as it arrives.  If so, take its headers off the inbuf
+ * and set up conn-\>client_stream.  If not, set
+ * conn-\>client_stream_declined, so that the whole response stays on the
+ * inbuf until EOF, where connection_dir_client_reached_eof() deals with it
+ * (and with anything unusual about it) in the usual way.  If we can't tell
+ * yet, do nothing. */
+static void
+dir_client_stream_start(dir_connection_t *conn)
+{
+  buf_t *inbuf = TO_CONN(conn)->inbuf;
+  char *headers = NULL;
+  int status_code;
+  compress_method_t compression;
+  /* Enough body bytes to recognize any of the compression methods we
+   * support. */
+  const size_t magic_len = 4;
+  char magic[4];
+
+  if (conn->base_.purpose != DIR_PURPOSE_FETCH_CONSENSUS &&
+      conn->base_.purpose != DIR_PURPOSE_FETCH_MICRODESC)
+    goto decline;
+  if (conn->base_.purpose == DIR_PURPOSE_FETCH_MICRODESC &&
+      (!conn->requested_resource ||
+       strcmpstart(conn->requested_resource, "d/")))
+    goto decline;
+
+  off_t headers_end = buf_find_string_offset(inbuf, "\r\n\r\n", 4);
+  if (headers_end < 0) {
+    if (buf_datalen(inbuf) > MAX_HEADERS_SIZE)
+      goto decline;
+    return;
+  }
+  const size_t headers_len = (size_t)headers_end + 4;
+  if (headers_len > MAX_HEADERS_SIZE)
+    goto decline;
+  if (buf_datalen(inbuf) < headers_len + magic_len)
+    return;
+
+  headers = tor_malloc(headers_len + magic_len + 1);
+  buf_peek(inbuf, headers, headers_len + magic_len);
+  memcpy(magic, headers + headers_len, magic_len);
+  headers[headers_len] = '\0';
+
+  if (parse_http_response(headers, &status_code, NULL, &compression,
+                          NULL) < 0)
+    goto decline;
+  /* Anything other than a compressed 200 response that looks the way it's
+   * labeled is rare enough that we handle it all at once. */
+  if (status_code != 200 ||
+      compression == NO_METHOD || compression == UNKNOWN_METHOD ||
+      !tor_compress_supports_method(compression) ||
+      detect_compression_method(magic, magic_len) != compression)
+    goto decline;
+  if (purpose_needs_anonymity(conn->base_.purpose, conn->router_purpose,
+                              conn->requested_resource) &&
+      !allowed_anonymous_connection_compression_method(compression))
+    goto decline;
+
+  dir_client_stream_t *stream = tor_malloc_zero(sizeof(*stream));
+  stream->headers = headers;
+  stream->compression = compression;
+  stream->decompress = tor_compress_new(0, compression, HIGH_COMPRESSION);
+  if (!stream->decompress) {
+    dir_client_stream_free(stream);
+    conn->client_stream_declined = 1;
+    return;
+  }
+  if (conn->base_.purpose == DIR_PURPOSE_FETCH_MICRODESC) {
+    stream->md_wanted = smartlist_new();
+    dir_split_resource_into_fingerprints(conn->requested_resource+2,
+                                         stream->md_wanted, NULL,
+                                         DSR_DIGEST256|DSR_BASE64);
+  }
+  buf_drain(inbuf, headers_len);
+  stream->n_read = headers_len;
+  conn->client_stream = stream;
+  log_debug(LD_DIR, "Decompressing %s response on %s as it arrives.",
+            compression_method_get_human_name(compression),
+            connection_describe(TO_CONN(conn)));
+  return;
+
+ decline:
+  tor_free(headers);
+  conn->client_stream_declined = 1;
+}
+
+/** Decompress <b>in_len</b> bytes from <b>in</b> onto the end of
+ * stream-\>body, growing it as needed.  If <b>finish</b> is true, there's
+ * no more input coming, and the compressed data had better be complete.
+ * Return 0 on success and -1 on failure. */
+static int
+dir_client_stream_decompress(dir_client_stream_t *stream,
+                             const char *in, size_t in_len, int finish)
+{
+  if (in_len)
+    stream->decompress_done = 0;
+  else if (stream->decompress_done)
+    return 0;
+
+  while (1) {
+    if (stream->body_alloc - stream->body_len < 1024) {
+      if (stream->body_alloc >= SIZE_T_CEILING / 2)
+        return -1;
+      stream->body_alloc = MAX(stream->body_alloc * 2, 8192);
+      stream->body = tor_realloc(stream->body, stream->body_alloc);
+    }
+    char *out = stream->body + stream->body_len;
+    size_t out_len = stream->body_alloc - stream->body_len;
+    tor_compress_output_t r =
+      tor_compress_process(stream->decompress, &out, &out_len,
+                           &in, &in_len, finish);
+    stream->body_len = out - stream->body;
+
+    switch (r) {
+      case TOR_COMPRESS_DONE:
+        if (in_len == 0) {
+          stream->decompress_done = 1;
+          return 0;
+        }
+        /* More input is present: it's another compressed stream
+         * concatenated to the first one. */
+        tor_compress_free(stream->decompress);
+        stream->decompress = tor_compress_new(0, stream->compression,
+                                              HIGH_COMPRESSION);
+        if (!stream->decompress)
+          return -1;
+        break;
+      case TOR_COMPRESS_OK:
+        if (finish) {
+          log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+                 "Unexpected end of input while decompressing");
+          return -1;
+        }
+        if (in_len == 0)
+          return 0;
+        break;
+      case TOR_COMPRESS_BUFFER_FULL:
+        if (out_len) {
+          log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+                 "Possible truncated or corrupt compressed data");
+          return -1;
+        }
+        /* We'll make room on the next time through the loop. */
+        break;
+      case TOR_COMPRESS_ERROR:
+      default:
+        log_fn(LOG_PROTOCOL_WARN, LD_GENERAL,
+               "Error while uncompressing data: bad input?");
+        return -1;
+    }
+  }
+}
+
+/** Hand every complete microdescriptor that has arrived so far on the
+ * streaming download <b>conn</b> to the microdescriptor cache, so that we
+ * can start using them before the rest of the response arrives. */
+static void
+dir_client_stream_parse_microdescs(dir_connection_t *conn)
+{
+  dir_client_stream_t *stream = conn->client_stream;
+  const char *eos = stream->body + stream->body_len;
+  const char *cp = stream->body, *last_start = NULL;
+
+  if (stream->body_len < DIR_STREAM_MD_BATCH_SIZE)
+    return;
+
+  /* Every microdescriptor begins with an onion-key line; everything before
+   * the last one we've seen start is complete. */
+  while ((cp = tor_memstr(cp, eos - cp, "\nonion-key"))) {
+    last_start = ++cp;
+  }
+  if (!last_start)
+    return;
+
+  const time_t now = approx_time();
+  smartlist_t *mds = microdescs_add_to_cache(get_microdesc_cache(),
+                                             stream->body, last_start,
+                                             SAVED_NOWHERE, 0, now,
+                                             stream->md_wanted);
+  const size_t parsed = last_start - stream->body;
+  memmove(stream->body, last_start, stream->body_len - parsed);
+  stream->body_len -= parsed;
+
+  if (mds && smartlist_len(mds)) {
+    stream->n_mds_added += smartlist_len(mds);
+    stream->mds_unannounced = 1;
+  }
+  smartlist_free(mds);
+
+  /* Looking at what we can do with our new directory information isn't
+   * free, so don't do it more than once a second. */
+  if (stream->mds_unannounced && stream->mds_announced_at != now) {
+    control_event_boot_dir(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
+                           count_loading_descriptors_progress());
+    directory_info_has_arrived(now, 0, 1);
+    stream->mds_unannounced = 0;
+    stream->mds_announced_at = now;
+  }
+}
+
+/** Called when more of a response has arrived on the directory client
+ * connection <b>conn</b>.  If it's a response that we know how to handle
+ * piece by piece, take what we can off the inbuf: decompress it, and (for
+ * microdescriptors) parse it and add the results to the cache.  Everything
+ * else is left for connection_dir_client_reached_eof().
+ *
+ * Return 0 on success, and -1 if the response is broken and the connection
+ * should be closed. */
+int
+connection_dir_client_process_partial(dir_connection_t *conn)
+{
+  buf_t *inbuf = TO_CONN(conn)->inbuf;
+
+  if (conn->base_.state != DIR_CONN_STATE_CLIENT_READING ||
+      conn->client_stream_declined)
+    return 0;
+  if (!conn->client_stream) {
+    dir_client_stream_start(conn);
+    if (!conn->client_stream)
+      return 0;
+  }
+
+  dir_client_stream_t *stream = conn->client_stream;
+  char *chunk = tor_malloc(DIR_STREAM_CHUNK_SIZE);
+  int r = 0;
+  while (buf_datalen(inbuf)) {
+    size_t n = MIN(buf_datalen(inbuf), DIR_STREAM_CHUNK_SIZE);
+    buf_get_bytes(inbuf, chunk, n);
+    stream->n_read += n;
+    if (stream->n_read > MAX_DIR_DL_SIZE) {
+      log_warn(LD_PROTOCOL,
+               "'fetch' response too large (%s). Closing.",
+               connection_describe(TO_CONN(conn)));
+      r = -1;
+      break;
+    }
+    if (dir_client_stream_decompress(stream, chunk, n, 0) < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_HTTP,
+             "Unable to decompress HTTP body (tried %s, on %s).",
+             compression_method_get_human_name(stream->compression),
+             connection_describe(TO_CONN(conn)));
+      r = -1;
+      break;
+    }
+  }
+  tor_free(chunk);
+
+  if (r == 0 && conn->base_.purpose == DIR_PURPOSE_FETCH_MICRODESC)
+    dir_client_stream_parse_microdescs(conn);
+  return r;
+}
+
+/** Called when we reach EOF on the streaming directory download
+ * <b>conn</b>.  Finish decompressing the response, and set *<b>headers</b>,
+ * *<b>body</b> and *<b>body_len</b> to its headers and to whatever of its
+ * body we haven't parsed yet, as connection_fetch_from_buf_http() would.
+ * Move the remaining state needed to handle the response into <b>args</b>,
+ * and free conn-\>client_stream.  Return 0 on success and -1 on failure. */
+static int
+dir_client_stream_finish(dir_connection_t *conn,
+                         char **headers, char **body, size_t *body_len,
+                         response_handler_args_t *args)
+{
+  dir_client_stream_t *stream;
+  int r = -1;
+
+  if (connection_dir_client_process_partial(conn) < 0)
+    goto done;
+
+  stream = conn->client_stream;
+  /* We only stream the kinds of document where we want all of it; the
+   * microdescriptor parser is happy with a truncated last entry, though. */
+  if (conn->base_.purpose != DIR_PURPOSE_FETCH_MICRODESC &&
+      dir_client_stream_decompress(stream, NULL, 0, 1) < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_HTTP,
+           "Unable to decompress HTTP body (tried %s, on %s).",
+           compression_method_get_human_name(stream->compression),
+           connection_describe(TO_CONN(conn)));
+    goto done;
+  }
+
+  *headers = stream->headers;
+  stream->headers = NULL;
+  *body_len = stream->body_len;
+  *body = tor_realloc(stream->body, stream->body_len + 1);
+  (*body)[stream->body_len] = '\0';
+  stream->body = NULL;
+  args->md_wanted = stream->md_wanted;
+  stream->md_wanted = NULL;
+  args->md_unannounced = stream->mds_unannounced;
+  if (stream->n_mds_added)
+    log_info(LD_DIR, "Added %d microdescriptors from %s while they were "
+             "still arriving.", stream->n_mds_added,
+             connection_describe_peer(TO_CONN(conn)));
+  r = 0;
+
+ done:
+  dir_client_stream_free(conn->client_stream);
+  return r;
+}
+
 /** We are a client, and we've finished reading the server's
  * response. Parse it and act appropriately.
  *
@@ -2020,7 +2392,7 @@ dirclient_dump_total_dls(void)
  *
  * The caller will take care of marking the connection for close.
  */
-static int
+STATIC int
 connection_dir_client_reached_eof(dir_connection_t *conn)
 {
   char *body = NULL;
@@ -2041,8 +2413,12 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     purpose_needs_anonymity(conn->base_.purpose,
                             conn->router_purpose,
                             conn->requested_resource);
+  const bool streamed = conn->client_stream != NULL;
+  response_handler_args_t args;
+  memset(&args, 0, sizeof(args));
 
-  received_bytes = connection_get_inbuf_len(TO_CONN(conn));
+  received_bytes = connection_get_inbuf_len(TO_CONN(conn)) +
+    connection_dir_client_bytes_streamed(conn);
 
   log_debug(LD_DIR, "Downloaded %"TOR_PRIuSZ" bytes on connection of purpose "
              "%s; bootstrap %d%%",
@@ -2054,7 +2430,12 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     total_dl[conn->base_.purpose][bootstrapped] += received_bytes;
   }
 
-  switch (connection_fetch_from_buf_http(TO_CONN(conn),
+  if (streamed) {
+    /* We've been decompressing this one as it arrived. */
+    if (dir_client_stream_finish(conn, &headers, &body, &body_len,
+                                 &args) < 0)
+      return -1;
+  } else switch (connection_fetch_from_buf_http(TO_CONN(conn),
                               &headers, MAX_HEADERS_SIZE,
                               &body, &body_len, MAX_DIR_DL_SIZE,
                               allow_partial)) {
@@ -2160,14 +2541,13 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     goto done;
   }
 
-  if (dir_client_decompress_response_body(&body, &body_len,
+  if (!streamed &&
+      dir_client_decompress_response_body(&body, &body_len,
                              conn, compression, anonymized_connection) < 0) {
     rv = -1;
     goto done;
   }
 
-  response_handler_args_t args;
-  memset(&args, 0, sizeof(args));
   args.status_code = status_code;
   args.reason = reason;
   args.body = body;
@@ -2222,6 +2602,10 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   }
 
  done:
+  if (args.md_wanted) {
+    SMARTLIST_FOREACH(args.md_wanted, char *, cp, tor_free(cp));
+    smartlist_free(args.md_wanted);
+  }
   tor_free(body);
   tor_free(headers);
   tor_free(reason);
@@ -2600,10 +2984,15 @@ handle_response_fetch_microdesc(dir_connection_t *conn,
   tor_assert(conn->requested_resource &&
              !strcmpstart(conn->requested_resource, "d/"));
   tor_assert_nonfatal(!fast_mem_is_zero(conn->identity_digest, DIGEST_LEN));
-  which = smartlist_new();
-  dir_split_resource_into_fingerprints(conn->requested_resource+2,
-                                       which, NULL,
-                                       DSR_DIGEST256|DSR_BASE64);
+  if (args->md_wanted) {
+    /* We've already added some of the answer to the cache as it arrived. */
+    which = args->md_wanted;
+  } else {
+    which = smartlist_new();
+    dir_split_resource_into_fingerprints(conn->requested_resource+2,
+                                         which, NULL,
+                                         DSR_DIGEST256|DSR_BASE64);
+  }
   if (status_code != 200) {
     log_info(LD_DIR, "Received status code %d (%s) from server "
              "%s while fetching \"/tor/micro/%s\".  I'll try again "
@@ -2612,9 +3001,6 @@ handle_response_fetch_microdesc(dir_connection_t *conn,
              connection_describe_peer(TO_CONN(conn)),
              conn->requested_resource);
     dir_microdesc_download_failed(which, status_code, conn->identity_digest);
-    SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
-    smartlist_free(which);
-    return 0;
   } else {
     smartlist_t *mds;
     time_t now = approx_time();
@@ -2625,16 +3011,18 @@ handle_response_fetch_microdesc(dir_connection_t *conn,
       /* Mark remaining ones as failed. */
       dir_microdesc_download_failed(which, status_code, conn->identity_digest);
     }
-    if (mds && smartlist_len(mds)) {
+    if ((mds && smartlist_len(mds)) || args->md_unannounced) {
       control_event_boot_dir(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
                              count_loading_descriptors_progress());
       directory_info_has_arrived(now, 0, 1);
     }
-    SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
-    smartlist_free(which);
     smartlist_free(mds);
   }
 
+  if (which != args->md_wanted) {
+    SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
+    smartlist_free(which);
+  }
   return 0;
 }
 
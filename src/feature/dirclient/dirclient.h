@@ -91,6 +91,12 @@ MOCK_DECL(void, directory_initiate_request, (directory_request_t *request));
 int router_supports_extrainfo(const char *identity_digest, int is_authority);
 
 void connection_dir_client_request_failed(dir_connection_t *conn);
+int connection_dir_client_process_partial(dir_connection_t *conn);
+size_t connection_dir_client_bytes_streamed(const dir_connection_t *conn);
+struct dir_client_stream_t;
+void dir_client_stream_free_(struct dir_client_stream_t *stream);
+#define dir_client_stream_free(stream) \
+  FREE_AND_NULL(struct dir_client_stream_t, dir_client_stream_free_, (stream))
 void connection_dir_client_refetch_hsdesc_if_needed(
                                           dir_connection_t *dir_conn);
 
@@ -145,6 +151,13 @@ typedef struct response_handler_args_t {
   const char *body;
   size_t body_len;
   const char *headers;
+  /** For a microdescriptor download that we parsed as it arrived: the
+   * digests that we asked for and have not received yet.  Owned by the
+   * caller. */
+  smartlist_t *md_wanted;
+  /** True if we've added microdescriptors from this response to the cache
+   * without telling the rest of Tor about them yet. */
+  bool md_unannounced;
 } response_handler_args_t;
 
 enum compress_method_t;
@@ -164,6 +177,7 @@ STATIC int handle_response_fetch_microdesc(dir_connection_t *conn,
 
 STATIC int handle_response_fetch_consensus(dir_connection_t *conn,
                                          const response_handler_args_t *args);
+STATIC int connection_dir_client_reached_eof(dir_connection_t *conn);
 
 STATIC dirinfo_type_t dir_fetch_type(int dir_purpose, int router_purpose,
                                      const char *resource);
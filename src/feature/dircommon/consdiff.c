@@ -361,6 +361,201 @@ calc_changes(smartlist_slice_t *slice1,
   }
 }
 
+/** Which algorithm does gen_ed_diff() use to compare the lines between two
+ * matching router entries? */
+static consdiff_engine_t consdiff_engine = CONSDIFF_ENGINE_MYERS;
+
+/** Make gen_ed_diff() use <b>engine</b> from now on.  Both engines find a
+ * shortest diff; when there is more than one, they may pick different
+ * ones. */
+void
+consdiff_set_engine(consdiff_engine_t engine)
+{
+  consdiff_engine = engine;
+}
+
+/** Return the line at index <b>idx</b> of <b>slice</b>. */
+static inline const cdline_t *
+slice_get(const smartlist_slice_t *slice, int idx)
+{
+  return smartlist_get(slice->list, slice->offset + idx);
+}
+
+/**
+ * Helper: Find a point (*<b>x_out</b>, *<b>y_out</b>) in the middle of a
+ * shortest edit script from <b>slice1</b> to <b>slice2</b>, so that an
+ * optimal diff of the two slices is an optimal diff of the slices before
+ * that point followed by an optimal diff of the slices after it.
+ *
+ * This is the "middle snake" search from Myers' "An O(ND) Difference
+ * Algorithm and Its Variations": we follow the furthest-reaching paths
+ * with D edits forward from the start and backward from the end at the same
+ * time, until they overlap.  It takes O((N+M)D) time, where D is the size of
+ * the diff, and O(N+M) space.
+ *
+ * Both slices must be non-empty, and must differ in their first lines and
+ * in their last lines.  Return 0 on success, or -1 if the slices have no
+ * lines in common: then the paths only meet after n+m edits, which is more
+ * than we look for, and there is no useful point to split at anyway.
+ */
+static int
+myers_middle_snake(const smartlist_slice_t *slice1,
+                   const smartlist_slice_t *slice2,
+                   int *x_out, int *y_out)
+{
+  const int n = slice1->len, m = slice2->len;
+  const int max_d = (n + m + 1) / 2;
+  const int v_offset = max_d;
+  const int v_length = 2 * max_d + 2;
+  const int delta = n - m;
+  /* If delta is odd, the paths overlap while we extend the forward one;
+   * otherwise, while we extend the reverse one. */
+  const int front = (delta % 2 != 0);
+  /* How far out of the edit graph the forward and reverse paths have gone
+   * on each side, so we can stop looking at those diagonals. */
+  int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+  int d, k1, k2, r = -1;
+  /* For each diagonal k, the furthest x that a forward (v1) or reverse (v2)
+   * path has reached on that diagonal. */
+  int *v1 = tor_malloc(sizeof(int) * v_length);
+  int *v2 = tor_malloc(sizeof(int) * v_length);
+
+  for (int i = 0; i < v_length; ++i) {
+    v1[i] = -1;
+    v2[i] = -1;
+  }
+  v1[v_offset + 1] = 0;
+  v2[v_offset + 1] = 0;
+
+  for (d = 0; d < max_d; ++d) {
+    /* Extend the forward paths by one edit. */
+    for (k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+      const int k1_offset = v_offset + k1;
+      int x1, y1;
+      if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1]))
+        x1 = v1[k1_offset + 1];
+      else
+        x1 = v1[k1_offset - 1] + 1;
+      y1 = x1 - k1;
+      while (x1 < n && y1 < m &&
+             lines_eq(slice_get(slice1, x1), slice_get(slice2, y1))) {
+        ++x1;
+        ++y1;
+      }
+      v1[k1_offset] = x1;
+      if (x1 > n) {
+        /* Ran off the right of the graph. */
+        k1end += 2;
+      } else if (y1 > m) {
+        /* Ran off the bottom of the graph. */
+        k1start += 2;
+      } else if (front) {
+        const int k2_offset = v_offset + delta - k1;
+        if (k2_offset >= 0 && k2_offset < v_length && v2[k2_offset] != -1) {
+          /* Mirror x2 onto the top-left coordinate system. */
+          const int x2 = n - v2[k2_offset];
+          if (x1 >= x2) {
+            *x_out = x1;
+            *y_out = y1;
+            r = 0;
+            goto done;
+          }
+        }
+      }
+    }
+
+    /* Extend the reverse paths by one edit. */
+    for (k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+      const int k2_offset = v_offset + k2;
+      int x2, y2;
+      if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1]))
+        x2 = v2[k2_offset + 1];
+      else
+        x2 = v2[k2_offset - 1] + 1;
+      y2 = x2 - k2;
+      while (x2 < n && y2 < m &&
+             lines_eq(slice_get(slice1, n - x2 - 1),
+                      slice_get(slice2, m - y2 - 1))) {
+        ++x2;
+        ++y2;
+      }
+      v2[k2_offset] = x2;
+      if (x2 > n) {
+        /* Ran off the left of the graph. */
+        k2end += 2;
+      } else if (y2 > m) {
+        /* Ran off the top of the graph. */
+        k2start += 2;
+      } else if (!front) {
+        const int k1_offset = v_offset + delta - k2;
+        if (k1_offset >= 0 && k1_offset < v_length && v1[k1_offset] != -1) {
+          const int x1 = v1[k1_offset];
+          const int y1 = v_offset + x1 - k1_offset;
+          if (x1 >= n - x2) {
+            *x_out = x1;
+            *y_out = y1;
+            r = 0;
+            goto done;
+          }
+        }
+      }
+    }
+  }
+
+ done:
+  tor_free(v1);
+  tor_free(v2);
+  return r;
+}
+
+/**
+ * Helper: Like calc_changes, but use Myers' algorithm to find the changes.
+ * This takes time proportional to the size of the slices times the size of
+ * the diff, rather than to the product of the sizes of the slices.
+ */
+STATIC void
+calc_changes_myers(smartlist_slice_t *slice1,
+                   smartlist_slice_t *slice2,
+                   bitarray_t *changed1, bitarray_t *changed2)
+{
+  int x, y;
+
+  trim_slices(slice1, slice2);
+
+  if (slice1->len <= 1) {
+    set_changed(changed1, changed2, slice1, slice2);
+
+  } else if (slice2->len <= 1) {
+    set_changed(changed2, changed1, slice2, slice1);
+
+  } else if (myers_middle_snake(slice1, slice2, &x, &y) < 0) {
+    /* The slices have no lines in common (as with "a a a a" and
+     * "b b b b"), so marking every line as changed is the right answer. */
+    int i;
+    for (i = 0; i < slice1->len; ++i)
+      bitarray_set(changed1, slice1->offset + i);
+    for (i = 0; i < slice2->len; ++i)
+      bitarray_set(changed2, slice2->offset + i);
+
+  } else {
+    smartlist_slice_t *top, *bot, *left, *right;
+
+    top = smartlist_slice(slice1->list, slice1->offset, slice1->offset+x);
+    bot = smartlist_slice(slice1->list, slice1->offset+x,
+        slice1->offset+slice1->len);
+    left = smartlist_slice(slice2->list, slice2->offset, slice2->offset+y);
+    right = smartlist_slice(slice2->list, slice2->offset+y,
+        slice2->offset+slice2->len);
+
+    calc_changes_myers(top, left, changed1, changed2);
+    calc_changes_myers(bot, right, changed1, changed2);
+    tor_free(top);
+    tor_free(bot);
+    tor_free(left);
+    tor_free(right);
+  }
+}
+
 /* This table is from crypto.c. The SP and PAD defines are different. */
 #define NOT_VALID_BASE64 255
 #define X NOT_VALID_BASE64
@@ -737,7 +932,10 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
 
     smartlist_slice_t *cons1_sl = smartlist_slice(cons1, start1, i1);
     smartlist_slice_t *cons2_sl = smartlist_slice(cons2, start2, i2);
-    calc_changes(cons1_sl, cons2_sl, changed1, changed2);
+    if (consdiff_engine == CONSDIFF_ENGINE_MYERS)
+      calc_changes_myers(cons1_sl, cons2_sl, changed1, changed2);
+    else
+      calc_changes(cons1_sl, cons2_sl, changed1, changed2);
     tor_free(cons1_sl);
     tor_free(cons2_sl);
     start1 = i1, start2 = i2;
@@ -19,6 +19,17 @@ char *consensus_diff_apply(const char *consensus, size_t consensus_len,
 
 int looks_like_a_consensus_diff(const char *document, size_t len);
 
+/** Algorithms for finding the changed lines between two matching router
+ * entries when generating a consensus diff. */
+typedef enum consdiff_engine_t {
+  /** Hirschberg's longest-common-subsequence algorithm: O(N*M) time. */
+  CONSDIFF_ENGINE_LCS,
+  /** Myers' algorithm: O((N+M)*D) time, for a diff of D lines. */
+  CONSDIFF_ENGINE_MYERS,
+} consdiff_engine_t;
+
+void consdiff_set_engine(consdiff_engine_t engine);
+
 #ifdef CONSDIFF_PRIVATE
 #include "lib/container/bitarray.h"
 
@@ -68,6 +79,9 @@ STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   int start_line);
 STATIC void calc_changes(smartlist_slice_t *slice1, smartlist_slice_t *slice2,
                          bitarray_t *changed1, bitarray_t *changed2);
+STATIC void calc_changes_myers(smartlist_slice_t *slice1,
+                               smartlist_slice_t *slice2,
+                               bitarray_t *changed1, bitarray_t *changed2);
 STATIC smartlist_slice_t *smartlist_slice(const smartlist_t *list,
                                           int start, int end);
 STATIC int next_router(const smartlist_t *cons, int cur);
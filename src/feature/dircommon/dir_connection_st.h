@@ -15,6 +15,7 @@
 #include "core/or/connection_st.h"
 
 struct tor_compress_state_t;
+struct dir_client_stream_t;
 
 /** Subtype of connection_t for an "directory connection" -- that is, an HTTP
  * connection to retrieve or serve directory material. */
@@ -41,6 +42,26 @@ struct dir_connection_t {
   smartlist_t *spool;
   /** The compression object doing on-the-fly compression for spooled data. */
   struct tor_compress_state_t *compress_state;
+  /** If we're sending part of a file straight from the disk to this
+   * connection's socket, the number of bytes of it that are left to send;
+   * otherwise 0.  See connection_dir_flush_file_region(). */
+  size_t file_region_len;
+  /** The file that we're sending from, if <b>file_region_len</b> is
+   * nonzero. */
+  int file_region_fd;
+  /** Offset within <b>file_region_fd</b> of the next byte to send. */
+  uint64_t file_region_offset;
+  /** True if the kernel refused to send from a file to this connection: we
+   * should copy everything through the outbuf from now on. */
+  unsigned int file_region_failed:1;
+
+  /** If we're a client decompressing (and perhaps parsing) a response as it
+   * arrives, rather than once the server closes the connection, the state
+   * for doing so.  See connection_dir_client_process_partial(). */
+  struct dir_client_stream_t *client_stream;
+  /** True if we've looked at the start of the response on this connection,
+   * and decided to leave all of it on the inbuf until we reach EOF. */
+  unsigned int client_stream_declined:1;
 
   /** What rendezvous service are we querying for? */
   rend_data_t *rend_data;
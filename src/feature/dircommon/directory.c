@@ -7,6 +7,7 @@
 
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "core/or/circuitlist.h"
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
@@ -26,6 +27,10 @@
 #include "feature/dircommon/dir_connection_st.h"
 #include "feature/nodelist/routerinfo_st.h"
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 /**
  * \file directory.c
  * \brief Code to send and fetch information from directory authorities and
@@ -191,6 +196,108 @@ connection_dir_is_encrypted(const dir_connection_t *conn)
   return TO_CONN(conn)->linked;
 }
 
+/** Return true iff we may send file contents straight from the disk to
+ * <b>conn</b>'s socket, without copying them into its outbuf first.  We
+ * only do this for plain unencrypted connections that aren't compressing
+ * anything on the fly: the kernel has to be able to send the file bytes
+ * exactly as they are. */
+int
+connection_dir_can_send_file_region(const dir_connection_t *conn)
+{
+  const connection_t *base = TO_CONN(conn);
+  return tor_socket_sendfile_supported() &&
+    SOCKET_OK(base->s) &&
+    base->uring == NULL &&
+    conn->compress_state == NULL &&
+    !conn->file_region_failed &&
+    !connection_dir_is_encrypted(conn);
+}
+
+/** Make <b>conn</b> send <b>len</b> bytes from the file <b>fd</b>, starting
+ * at <b>offset</b>, once everything on its outbuf has been sent.  Takes
+ * ownership of <b>fd</b>.
+ *
+ * Nothing more should be added to the outbuf until the region is gone: see
+ * connection_dir_has_file_region(). */
+void
+connection_dir_set_file_region(dir_connection_t *conn, int fd,
+                               uint64_t offset, size_t len)
+{
+  tor_assert(fd >= 0);
+  if (BUG(conn->file_region_len) || len == 0) {
+    close(fd);
+    return;
+  }
+  conn->file_region_fd = fd;
+  conn->file_region_offset = offset;
+  conn->file_region_len = len;
+  connection_start_writing(TO_CONN(conn));
+}
+
+/** Return true iff <b>conn</b> still has bytes to send from a file. */
+int
+connection_dir_has_file_region(const dir_connection_t *conn)
+{
+  return conn->file_region_len > 0;
+}
+
+/** Close and forget the file that <b>conn</b> is sending from, if any. */
+void
+connection_dir_clear_file_region(dir_connection_t *conn)
+{
+  if (conn->file_region_len == 0)
+    return;
+  close(conn->file_region_fd);
+  conn->file_region_fd = -1;
+  conn->file_region_offset = 0;
+  conn->file_region_len = 0;
+}
+
+/** Send up to <b>max_to_write</b> bytes from the file that <b>conn</b> is
+ * sending from, straight to its socket.  Return the number of bytes sent,
+ * which may be 0 if the socket is full, or -1 on error.
+ *
+ * If the kernel can't send from this file to this socket, set
+ * file_region_failed and return 0: the spooling code will notice, and
+ * send the rest of the region through the outbuf. */
+ssize_t
+connection_dir_flush_file_region(dir_connection_t *conn, size_t max_to_write)
+{
+  connection_t *base = TO_CONN(conn);
+  if (conn->file_region_len == 0 || conn->file_region_failed ||
+      max_to_write == 0)
+    return 0;
+
+  size_t n = MIN(max_to_write, conn->file_region_len);
+  ssize_t r = tor_socket_sendfile(base->s, conn->file_region_fd,
+                                  &conn->file_region_offset, n);
+  if (r < 0) {
+    int e = tor_socket_errno(base->s);
+    if (ERRNO_IS_EAGAIN(e))
+      return 0;
+    if (e == EINVAL || e == ENOSYS || e == EOVERFLOW) {
+      log_info(LD_DIR, "Couldn't send directory data straight from its "
+               "file (%s); copying it instead.", tor_socket_strerror(e));
+      conn->file_region_failed = 1;
+      return 0;
+    }
+    log_debug(LD_NET, "sendfile() failed: %s", tor_socket_strerror(e));
+    return -1;
+  } else if (r == 0) {
+    /* The file got shorter than we expected. */
+    log_warn(LD_DIR, "Reached the end of a cached directory file with %"
+             TOR_PRIuSZ" bytes left to send.", conn->file_region_len);
+    return -1;
+  }
+
+  conn->file_region_len -= r;
+  if (conn->file_region_len == 0) {
+    close(conn->file_region_fd);
+    conn->file_region_fd = -1;
+  }
+  return r;
+}
+
 /** Return true iff the given directory connection <b>dir_conn</b> is
  * anonymous, that is, it is on a circuit via a public relay and not directly
  * from a client or bridge.
@@ -450,7 +557,8 @@ connection_dir_process_inbuf(dir_connection_t *conn)
   tor_assert(conn);
   tor_assert(conn->base_.type == CONN_TYPE_DIR);
 
-  /* Directory clients write, then read data until they receive EOF;
+  /* Directory clients write, then read data until they receive EOF (though
+   * for some responses they start decompressing and parsing early);
    * directory servers read data until they get an HTTP command, then
    * write their response (when it's finished flushing, they mark for
    * close).
@@ -469,7 +577,8 @@ connection_dir_process_inbuf(dir_connection_t *conn)
     (TO_CONN(conn)->purpose == DIR_PURPOSE_FETCH_STATUS_VOTE) ?
     MAX_VOTE_DL_SIZE : MAX_DIRECTORY_OBJECT_SIZE;
 
-  if (connection_get_inbuf_len(TO_CONN(conn)) > max_size) {
+  if (connection_get_inbuf_len(TO_CONN(conn)) +
+      connection_dir_client_bytes_streamed(conn) > max_size) {
     log_warn(LD_HTTP,
              "Too much data received from %s: "
              "denial of service attempt, or you need to upgrade?",
@@ -478,6 +587,12 @@ connection_dir_process_inbuf(dir_connection_t *conn)
     return -1;
   }
 
+  /* Some responses we can start on before they're complete. */
+  if (connection_dir_client_process_partial(conn) < 0) {
+    connection_mark_for_close(TO_CONN(conn));
+    return -1;
+  }
+
   if (!conn->base_.inbuf_reached_eof)
     log_debug(LD_HTTP,"Got data, not eof. Leaving on inbuf.");
   return 0;
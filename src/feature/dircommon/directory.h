@@ -95,6 +95,13 @@ int parse_http_command(const char *headers,
 char *http_get_header(const char *headers, const char *which);
 
 int connection_dir_is_encrypted(const dir_connection_t *conn);
+int connection_dir_can_send_file_region(const dir_connection_t *conn);
+void connection_dir_set_file_region(dir_connection_t *conn, int fd,
+                                    uint64_t offset, size_t len);
+int connection_dir_has_file_region(const dir_connection_t *conn);
+void connection_dir_clear_file_region(dir_connection_t *conn);
+ssize_t connection_dir_flush_file_region(dir_connection_t *conn,
+                                         size_t max_to_write);
 bool connection_dir_is_anonymous(const dir_connection_t *conn);
 int connection_dir_reached_eof(dir_connection_t *conn);
 int connection_dir_process_inbuf(dir_connection_t *conn);
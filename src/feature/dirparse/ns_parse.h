@@ -42,6 +42,11 @@ STATIC routerstatus_t *routerstatus_parse_entry_from_string(
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav);
+STATIC int routerstatus_parse_section_sharded(networkstatus_t *ns,
+                                              const char *s,
+                                              const char *s_end,
+                                              consensus_flavor_t flav,
+                                              size_t shard_size);
 #endif /* defined(NS_PARSE_PRIVATE) */
 
 #endif /* !defined(TOR_NS_PARSE_H) */
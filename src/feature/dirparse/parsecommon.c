@@ -261,6 +261,19 @@ mem_eq_token(const void *mem, size_t memlen, const char *token)
   return memlen == len && fast_memeq(mem, token, len);
 }
 
+/** Return true iff the <b>kwd_len</b>-byte keyword at <b>kwd</b> is the
+ * keyword of <b>rule</b>.  We compare the precomputed lengths and the first
+ * bytes before looking at the rest, since most entries in a table fail one
+ * of those two checks. */
+static inline bool
+token_rule_matches(const token_rule_t *rule, const char *kwd, size_t kwd_len)
+{
+  /* No keyword is empty, so kwd[0] is in bounds once the lengths agree. */
+  return rule->t_len == kwd_len &&
+    rule->t[0] == kwd[0] &&
+    fast_memeq(kwd, rule->t, kwd_len);
+}
+
 /** Helper function: read the next token from *s, advance *s to the end of the
  * token, and return the parsed token.  Parse *<b>s</b> according to the list
  * of tokens in <b>table</b>.
@@ -311,7 +324,7 @@ get_next_token(memarea_t *area,
   /* Search the table for the appropriate entry.  (I tried a binary search
    * instead, but it wasn't any faster.) */
   for (i = 0; table[i].t ; ++i) {
-    if (mem_eq_token(*s, next-*s, table[i].t)) {
+    if (token_rule_matches(&table[i], *s, next-*s)) {
       /* We've found the keyword. */
       kwd = table[i].t;
       tok->tp = table[i].v;
@@ -358,8 +371,12 @@ get_next_token(memarea_t *area,
   /* Check whether there's an object present */
   *s = eat_whitespace_eos(eol, eos);  /* Scan from end of first line */
   tor_assert(eos >= *s);
+  /* Most tokens have no object: look at the start of the line before we
+   * spend a memchr() finding its end. */
+  if (eos-*s < 11 || fast_memneq(*s, "-----BEGIN ", 11)) /* No object. */
+    goto check_object;
   eol = memchr(*s, '\n', eos-*s);
-  if (!eol || eol-*s<11 || strcmpstart(*s, "-----BEGIN ")) /* No object. */
+  if (!eol) /* No object. */
     goto check_object;
 
   if (eol - *s <= 16 || memchr(*s+11,'\0',eol-*s-16) || /* no short lines, */
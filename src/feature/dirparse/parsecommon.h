@@ -240,24 +240,28 @@ typedef enum {
  */
 /**@{*/
 
+/** The length of the keyword <b>s</b>, which must be a string literal. (The
+ * empty strings make sure of that.) */
+#define T_LEN_(s) (sizeof("" s "") - 1)
+
 /** Appears to indicate the end of a table. */
-#define END_OF_TABLE { NULL, NIL_, 0,0,0, NO_OBJ, 0, INT_MAX, 0, 0 }
+#define END_OF_TABLE { NULL, NIL_, 0,0,0, NO_OBJ, 0, INT_MAX, 0, 0, 0 }
 /** An item with no restrictions: used for obsolete document types */
-#define T(s,t,a,o)    { s, t, a, o, 0, INT_MAX, 0, 0 }
+#define T(s,t,a,o)    { s, t, a, o, 0, INT_MAX, 0, 0, T_LEN_(s) }
 /** An item with no restrictions on multiplicity or location. */
-#define T0N(s,t,a,o)  { s, t, a, o, 0, INT_MAX, 0, 0 }
+#define T0N(s,t,a,o)  { s, t, a, o, 0, INT_MAX, 0, 0, T_LEN_(s) }
 /** An item that must appear exactly once */
-#define T1(s,t,a,o)   { s, t, a, o, 1, 1, 0, 0 }
+#define T1(s,t,a,o)   { s, t, a, o, 1, 1, 0, 0, T_LEN_(s) }
 /** An item that must appear exactly once, at the start of the document */
-#define T1_START(s,t,a,o)   { s, t, a, o, 1, 1, AT_START, 0 }
+#define T1_START(s,t,a,o)   { s, t, a, o, 1, 1, AT_START, 0, T_LEN_(s) }
 /** An item that must appear exactly once, at the end of the document */
-#define T1_END(s,t,a,o)   { s, t, a, o, 1, 1, AT_END, 0 }
+#define T1_END(s,t,a,o)   { s, t, a, o, 1, 1, AT_END, 0, T_LEN_(s) }
 /** An item that must appear one or more times */
-#define T1N(s,t,a,o)  { s, t, a, o, 1, INT_MAX, 0, 0 }
+#define T1N(s,t,a,o)  { s, t, a, o, 1, INT_MAX, 0, 0, T_LEN_(s) }
 /** An item that must appear no more than once */
-#define T01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 0 }
+#define T01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 0, T_LEN_(s) }
 /** An annotation that must appear no more than once */
-#define A01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 1 }
+#define A01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 1, T_LEN_(s) }
 
 /** Argument multiplicity: any number of arguments. */
 #define ARGS        0,INT_MAX,0
@@ -295,6 +299,8 @@ typedef struct token_rule_t {
   int pos;
   /** True iff this token is an annotation. */
   int is_annotation;
+  /** The length of <b>t</b>. */
+  size_t t_len;
 } token_rule_t;
 
 void token_clear(directory_token_t *tok);
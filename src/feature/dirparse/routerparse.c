@@ -54,6 +54,7 @@
 
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/policies.h"
 #include "core/or/versions.h"
 #include "feature/dirparse/parsecommon.h"
@@ -70,6 +71,7 @@
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/crypt_ops/crypto_util.h"
 #include "lib/memarea/memarea.h"
 #include "lib/sandbox/sandbox.h"
 
@@ -231,6 +233,130 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
   return -1;
 }
 
+/** The ed25519 signatures on a router descriptor, along with everything
+ * they refer to, so that we can check them after we're done parsing the
+ * descriptor. */
+typedef struct router_ed_sigs_t {
+  /** The signing key certificate, the ntor onion key crosscert, and the
+   * descriptor itself. */
+  ed25519_checkable_t check[3];
+  /** Message for check[2]: the digest of the signed part of the
+   * descriptor. */
+  uint8_t d256[DIGEST256_LEN];
+  /** Public key for check[1], derived from the ntor onion key. */
+  ed25519_public_key_t ntor_cc_pk;
+  /** Certificate holding the message for check[1]. */
+  tor_cert_t *ntor_cc_cert;
+
+  /** Fields used by router_parse_list_from_string():
+   * @{ */
+  /** The router that these signatures are on. */
+  routerinfo_t *router;
+  /** Start and end of that router's descriptor in the string we're
+   * parsing, which need not be NUL-terminated. */
+  const char *desc, *desc_end;
+  /** True iff we could compute the digest of that descriptor. */
+  unsigned int have_raw_digest : 1;
+  /** Set to true iff every signature checks out. */
+  unsigned int ok : 1;
+  /** The digest of the descriptor. */
+  char raw_digest[DIGEST_LEN];
+  /** @} */
+} router_ed_sigs_t;
+
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                     int cache_copy, int allow_annotations,
+                                     const char *prepend_annotations,
+                                     int *can_dl_again_out,
+                                     router_ed_sigs_t **ed_sigs_out);
+
+#define router_ed_sigs_free(sigs) \
+  FREE_AND_NULL(router_ed_sigs_t, router_ed_sigs_free_, (sigs))
+
+/** Release all storage held by <b>sigs</b>. */
+static void
+router_ed_sigs_free_(router_ed_sigs_t *sigs)
+{
+  if (!sigs)
+    return;
+  tor_cert_free(sigs->ntor_cc_cert);
+  memwipe(sigs, 0, sizeof(*sigs));
+  tor_free(sigs);
+}
+
+/** Return 0 if every signature in <b>sigs</b> is valid, and -1 otherwise. */
+static int
+router_ed_sigs_check(const router_ed_sigs_t *sigs)
+{
+  return ed25519_checksig_batch(NULL, sigs->check, 3) < 0 ? -1 : 0;
+}
+
+/** How many descriptors' worth of ed25519 signatures do we check as a single
+ * batch in router_parse_list_from_string()?  Batch verification gets
+ * cheaper per signature as the batch grows, but the batches are also how we
+ * split up the work among threads. */
+#define ROUTER_ED_SIGS_PER_BATCH 32
+
+/** A slice of the descriptors that router_check_ed_sigs() is checking. */
+typedef struct router_ed_sigs_batch_t {
+  router_ed_sigs_t **sigs;
+  int n;
+} router_ed_sigs_batch_t;
+
+/** Check every signature in <b>arg</b>, a router_ed_sigs_batch_t, and set
+ * the ok flag on each descriptor's router_ed_sigs_t.  This function can run
+ * in a cpuworker thread. */
+static void
+router_ed_sigs_batch_check(void *arg)
+{
+  router_ed_sigs_batch_t *batch = arg;
+  const int n_checkable = batch->n * 3;
+  ed25519_checkable_t *check = tor_calloc(n_checkable, sizeof(*check));
+  int *okay = tor_calloc(n_checkable, sizeof(int));
+  int i;
+
+  for (i = 0; i < batch->n; ++i) {
+    memcpy(&check[i*3], batch->sigs[i]->check, sizeof(batch->sigs[i]->check));
+  }
+  ed25519_checksig_batch(okay, check, n_checkable);
+  for (i = 0; i < batch->n; ++i) {
+    batch->sigs[i]->ok = okay[i*3] && okay[i*3+1] && okay[i*3+2];
+  }
+
+  tor_free(check);
+  tor_free(okay);
+}
+
+/** Check the signatures in <b>pending</b>, a list of router_ed_sigs_t, in
+ * batches, and spread the batches across the cpuworkers if they are
+ * running. */
+static void
+router_check_ed_sigs(smartlist_t *pending)
+{
+  const int n = smartlist_len(pending);
+  const int n_batches = CEIL_DIV(n, ROUTER_ED_SIGS_PER_BATCH);
+  router_ed_sigs_batch_t *batches;
+  void **args;
+  int i;
+
+  if (n == 0)
+    return;
+
+  batches = tor_calloc(n_batches, sizeof(router_ed_sigs_batch_t));
+  args = tor_calloc(n_batches, sizeof(void *));
+  for (i = 0; i < n_batches; ++i) {
+    const int first = i * ROUTER_ED_SIGS_PER_BATCH;
+    batches[i].sigs = (router_ed_sigs_t **) &pending->list[first];
+    batches[i].n = MIN(ROUTER_ED_SIGS_PER_BATCH, n - first);
+    args[i] = &batches[i];
+  }
+
+  cpuworker_run_parallel(router_ed_sigs_batch_check, args, n_batches);
+
+  tor_free(batches);
+  tor_free(args);
+}
+
 /** Given a string *<b>s</b> containing a concatenated sequence of router
  * descriptors (or extra-info documents if <b>want_extrainfo</b> is set),
  * parses them and stores the result in <b>dest</b>. All routers are marked
@@ -244,6 +370,9 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
  * Returns 0 on success and -1 on failure.  Adds a digest to
  * <b>invalid_digests_out</b> for every entry that was unparseable or
  * invalid. (This may cause duplicate entries.)
+ *
+ * We check the ed25519 signatures on router descriptors only once we have
+ * parsed all of them, so that we can check them in large batches.
  */
 int
 router_parse_list_from_string(const char **s, const char *eos,
@@ -260,6 +389,7 @@ router_parse_list_from_string(const char **s, const char *eos,
   void *elt;
   const char *end, *start;
   int have_extrainfo;
+  smartlist_t *pending_ed_sigs = smartlist_new();
 
   tor_assert(s);
   tor_assert(*s);
@@ -300,17 +430,27 @@ router_parse_list_from_string(const char **s, const char *eos,
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
+      router_ed_sigs_t *ed_sigs = NULL;
       have_raw_digest = router_get_router_hash(*s, end-*s, raw_digest) == 0;
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations, &dl_again);
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations, &dl_again,
+                                       &ed_sigs);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router_describe(router),
                   router_purpose_to_string(router->purpose));
         signed_desc = &router->cache_info;
         elt = router;
+        if (ed_sigs) {
+          ed_sigs->router = router;
+          ed_sigs->desc = *s;
+          ed_sigs->desc_end = end;
+          ed_sigs->have_raw_digest = have_raw_digest;
+          memcpy(ed_sigs->raw_digest, raw_digest, DIGEST_LEN);
+          smartlist_add(pending_ed_sigs, ed_sigs);
+        }
       }
     }
     if (! elt && ! dl_again && have_raw_digest && invalid_digests_out) {
@@ -329,6 +469,25 @@ router_parse_list_from_string(const char **s, const char *eos,
     smartlist_add(dest, elt);
   }
 
+  router_check_ed_sigs(pending_ed_sigs);
+  SMARTLIST_FOREACH_BEGIN(pending_ed_sigs, router_ed_sigs_t *, ed_sigs) {
+    if (!ed_sigs->ok) {
+      char *desc_dup = tor_strndup(ed_sigs->desc,
+                                   ed_sigs->desc_end - ed_sigs->desc);
+      log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+      dump_desc(desc_dup, "router descriptor");
+      tor_free(desc_dup);
+      smartlist_remove_keeporder(dest, ed_sigs->router);
+      routerinfo_free(ed_sigs->router);
+      if (ed_sigs->have_raw_digest && invalid_digests_out) {
+        smartlist_add(invalid_digests_out,
+                      tor_memdup(ed_sigs->raw_digest, DIGEST_LEN));
+      }
+    }
+    router_ed_sigs_free(ed_sigs);
+  } SMARTLIST_FOREACH_END(ed_sigs);
+  smartlist_free(pending_ed_sigs);
+
   return 0;
 }
 
@@ -395,6 +554,23 @@ router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations,
                                int *can_dl_again_out)
+{
+  return router_parse_entry_impl(s, end, cache_copy, allow_annotations,
+                                 prepend_annotations, can_dl_again_out,
+                                 NULL);
+}
+
+/** As router_parse_entry_from_string(), but if <b>ed_sigs_out</b> is
+ * provided, don't check the ed25519 signatures on the descriptor: instead,
+ * set *<b>ed_sigs_out</b> to a new router_ed_sigs_t that the caller must
+ * check before trusting the descriptor.  (If the descriptor has no such
+ * signatures, leave *<b>ed_sigs_out</b> alone.) */
+static routerinfo_t *
+router_parse_entry_impl(const char *s, const char *end,
+                        int cache_copy, int allow_annotations,
+                        const char *prepend_annotations,
+                        int *can_dl_again_out,
+                        router_ed_sigs_t **ed_sigs_out)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -406,6 +582,7 @@ router_parse_entry_from_string(const char *s, const char *end,
   int ok = 1;
   memarea_t *area = NULL;
   tor_cert_t *ntor_cc_cert = NULL;
+  router_ed_sigs_t *ed_sigs = NULL;
   /* Do not set this to '1' until we have parsed everything that we intend to
    * parse that's covered by the hash. */
   int can_dl_again = 0;
@@ -674,7 +851,6 @@ router_parse_entry_from_string(const char *s, const char *end,
       }
       int ntor_cc_sign_bit = !strcmp(cc_ntor_tok->args[0], "1");
 
-      uint8_t d256[DIGEST256_LEN];
       const char *signed_start, *signed_end;
       tor_cert_t *cert = tor_cert_parse(
                        (const uint8_t*)ed_cert_tok->object_body,
@@ -721,8 +897,8 @@ router_parse_entry_from_string(const char *s, const char *end,
         goto err;
       }
 
-      ed25519_public_key_t ntor_cc_pk;
-      if (ed25519_public_key_from_curve25519_public_key(&ntor_cc_pk,
+      ed_sigs = tor_malloc_zero(sizeof(router_ed_sigs_t));
+      if (ed25519_public_key_from_curve25519_public_key(&ed_sigs->ntor_cc_pk,
                                             router->onion_curve25519_pkey,
                                             ntor_cc_sign_bit)<0) {
         log_warn(LD_DIR, "Error converting onion key to ed25519");
@@ -740,18 +916,18 @@ router_parse_entry_from_string(const char *s, const char *end,
       crypto_digest_add_bytes(d, ED_DESC_SIGNATURE_PREFIX,
         strlen(ED_DESC_SIGNATURE_PREFIX));
       crypto_digest_add_bytes(d, signed_start, signed_end-signed_start);
-      crypto_digest_get_digest(d, (char*)d256, sizeof(d256));
+      crypto_digest_get_digest(d, (char*)ed_sigs->d256,
+                               sizeof(ed_sigs->d256));
       crypto_digest_free(d);
 
-      ed25519_checkable_t check[3];
-      int check_ok[3];
+      ed25519_checkable_t *check = ed_sigs->check;
       time_t expires = TIME_MAX;
       if (tor_cert_get_checkable_sig(&check[0], cert, NULL, &expires) < 0) {
         log_err(LD_BUG, "Couldn't create 'checkable' for cert.");
         goto err;
       }
-      if (tor_cert_get_checkable_sig(&check[1],
-                               ntor_cc_cert, &ntor_cc_pk, &expires) < 0) {
+      if (tor_cert_get_checkable_sig(&check[1], ntor_cc_cert,
+                                     &ed_sigs->ntor_cc_pk, &expires) < 0) {
         log_err(LD_BUG, "Couldn't create 'checkable' for ntor_cc_cert.");
         goto err;
       }
@@ -762,12 +938,18 @@ router_parse_entry_from_string(const char *s, const char *end,
         goto err;
       }
       check[2].pubkey = &cert->signed_key;
-      check[2].msg = d256;
+      check[2].msg = ed_sigs->d256;
       check[2].len = DIGEST256_LEN;
+      /* check[1] refers to the contents of this certificate. */
+      ed_sigs->ntor_cc_cert = ntor_cc_cert;
+      ntor_cc_cert = NULL;
 
-      if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
-        log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
-        goto err;
+      if (!ed_sigs_out) {
+        if (router_ed_sigs_check(ed_sigs) < 0) {
+          log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+          goto err;
+        }
+        router_ed_sigs_free(ed_sigs);
       }
 
       rsa_pubkey = router_get_rsa_onion_pkey(router->onion_pkey,
@@ -929,13 +1111,30 @@ router_parse_entry_from_string(const char *s, const char *end,
   if (!router->platform) {
     router->platform = tor_strdup("<unknown>");
   }
+  if (ed_sigs_out && ed_sigs) {
+    *ed_sigs_out = ed_sigs;
+    ed_sigs = NULL;
+  }
   goto done;
 
  err:
-  dump_desc(s_dup, "router descriptor");
+  if (ed_sigs && can_dl_again && router_ed_sigs_check(ed_sigs) < 0) {
+    /* We deferred checking these signatures, but they would have made us
+     * reject the descriptor before we got to the part that let us download
+     * it again. */
+    log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+    can_dl_again = 0;
+  }
+  {
+    /* s_dup may be the start of a longer list: dump only this one. */
+    char *desc_dup = tor_strndup(s_dup, end - s_dup);
+    dump_desc(desc_dup, "router descriptor");
+    tor_free(desc_dup);
+  }
   routerinfo_free(router);
   router = NULL;
  done:
+  router_ed_sigs_free(ed_sigs);
   crypto_pk_free(rsa_pubkey);
   tor_cert_free(ntor_cc_cert);
   if (tokens) {
@@ -1160,7 +1359,12 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
 
   goto done;
  err:
-  dump_desc(s_dup, "extra-info descriptor");
+  {
+    /* s_dup may be the start of a longer list: dump only this one. */
+    char *desc_dup = tor_strndup(s_dup, end - s_dup);
+    dump_desc(desc_dup, "extra-info descriptor");
+    tor_free(desc_dup);
+  }
   extrainfo_free(extrainfo);
   extrainfo = NULL;
  done:
@@ -6,14 +6,29 @@
  * @brief Setup and tear down the HS subsystem.
  **/
 
+#include "core/or/or.h"
+#include "core/or/memacct.h"
 #include "lib/subsys/subsys.h"
 
+#include "feature/hs/hs_cache.h"
 #include "feature/hs/hs_metrics.h"
 #include "feature/hs/hs_sys.h"
+#include "feature/rend/rendcache.h"
+
+/** Memory accounting for the onion service descriptor caches: when we're
+ * low on memory, we shrink them before anything else. */
+static const memacct_t hs_cache_memacct = {
+  .name = "hs-cache",
+  .get_allocation = rend_cache_get_total_allocation,
+  .handle_oom = hs_cache_handle_oom,
+  .priority = MEMACCT_PRIO_HS_CACHE,
+  .budget_percent = 20,
+};
 
 static int
 subsys_hs_initialize(void)
 {
+  memacct_register(&hs_cache_memacct);
   return 0;
 }
 
@@ -51,9 +51,14 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
   char published[ISO_TIME_LEN+1];
   char identity64[BASE64_DIGEST_LEN+1];
   char digest64[BASE64_DIGEST_LEN+1];
+  /* Don't use fmt_addr() and friends: directory authorities format
+   * consensus flavors on several threads at once. */
+  char ip_str[TOR_ADDR_BUF_LEN];
+  char ipv6_str[TOR_ADDR_BUF_LEN];
   smartlist_t *chunks = smartlist_new();
 
-  const char *ip_str = fmt_addr(&rs->ipv4_addr);
+  if (!tor_addr_to_str(ip_str, &rs->ipv4_addr, sizeof(ip_str), 0))
+    strlcpy(ip_str, "???", sizeof(ip_str));
   if (ip_str[0] == '\0')
     goto err;
 
@@ -79,8 +84,10 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
 
   /* Possible "a" line. At most one for now. */
   if (!tor_addr_is_null(&rs->ipv6_addr)) {
-    smartlist_add_asprintf(chunks, "a %s\n",
-                           fmt_addrport(&rs->ipv6_addr, rs->ipv6_orport));
+    if (!tor_addr_to_str(ipv6_str, &rs->ipv6_addr, sizeof(ipv6_str), 1))
+      strlcpy(ipv6_str, "???", sizeof(ipv6_str));
+    smartlist_add_asprintf(chunks, "a %s:%u\n",
+                           ipv6_str, (unsigned)rs->ipv6_orport);
   }
 
   if (format == NS_V3_CONSENSUS || format == NS_V3_CONSENSUS_MICRODESC)
@@ -8,8 +8,10 @@
  *  less-frequently-changing router information.
  */
 
+#define MICRODESC_PRIVATE
 #include "core/or/or.h"
 
+#include "lib/arch/bytes.h"
 #include "lib/fdio/fdio.h"
 
 #include "app/config/config.h"
@@ -43,8 +45,13 @@
 
 /** A data structure to hold a bunch of cached microdescriptors.  There are
  * two active files in the cache: a "cache file" that we mmap, and a "journal
- * file" that we append to.  Periodically, we rebuild the cache file to hold
- * only the microdescriptors that we want to keep */
+ * file" that we append to.  Periodically, we move the journal to the end of
+ * the cache file, or, once enough of the cache file is unused, rebuild the
+ * cache file to hold only the microdescriptors that we want to keep.
+ *
+ * Next to the cache file we keep an "index file" that lists where every
+ * microdescriptor in the cache file is, so that at startup we can load the
+ * cache without parsing the microdescriptors we never use. */
 struct microdesc_cache_t {
   /** Map from sha256-digest to microdesc_t for every microdesc_t in the
    * cache. */
@@ -54,6 +61,8 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the index file. */
+  char *index_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
   /** Number of bytes used in the journal file. */
@@ -68,6 +77,8 @@ struct microdesc_cache_t {
 
   /** True iff we have loaded this cache from disk ever. */
   int is_loaded;
+  /** True iff the index file doesn't describe the current cache file. */
+  int index_is_stale;
 };
 
 static microdesc_cache_t *get_microdesc_cache_noload(void);
@@ -266,6 +277,7 @@ get_microdesc_cache_noload(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_cachedir_fname("cached-microdescs");
     cache->journal_fname = get_cachedir_fname("cached-microdescs.new");
+    cache->index_fname = get_cachedir_fname("cached-microdescs.idx");
     the_microdesc_cache = cache;
   }
   return the_microdesc_cache;
@@ -508,6 +520,237 @@ warn_if_nul_found(const char *inp, size_t len, int64_t offset,
   }
 }
 
+/** The index file starts with this string. */
+#define MD_INDEX_MAGIC "tor-md-index-v1\n"
+/** The length of MD_INDEX_MAGIC. */
+#define MD_INDEX_MAGIC_LEN 16
+/** The length of the index header: the magic string, then the length of the
+ * cache file that the index describes and the number of entries, as 64-bit
+ * integers. */
+#define MD_INDEX_HEADER_LEN (MD_INDEX_MAGIC_LEN + 8 + 8)
+/** The length of an index entry: a sha256 digest, then the offset and length
+ * of the body in the cache file and its last-listed time, as 64-bit
+ * integers.  Entries are sorted by digest. */
+#define MD_INDEX_ENTRY_LEN (DIGEST256_LEN + 8 + 8 + 8)
+/** The number of bytes that dump_microdescriptor() writes as annotations for
+ * a microdescriptor with a last_listed time. */
+#define MD_ANNOTATION_LEN (strlen("@last-listed ") + ISO_TIME_LEN + 1)
+
+/** If <b>md</b> was loaded from the index file and has not been parsed yet,
+ * parse its body and fill in its fields.  Return 0 on success.  On failure,
+ * remove <b>md</b> from <b>cache</b>, free it, and return -1. */
+static int
+microdesc_materialize(microdesc_cache_t *cache, microdesc_t *md)
+{
+  smartlist_t *parsed = NULL;
+  microdesc_t *p = NULL;
+
+  if (! md->is_unparsed)
+    return 0;
+
+  if (md->body) {
+    parsed = microdescs_parse_from_string(md->body, md->body + md->bodylen,
+                                          0, SAVED_IN_CACHE, NULL);
+    if (smartlist_len(parsed) == 1)
+      p = smartlist_get(parsed, 0);
+  }
+  if (!p || tor_memneq(p->digest, md->digest, DIGEST256_LEN)) {
+    log_warn(LD_DIR, "A microdescriptor listed in the microdescriptor cache "
+             "index didn't match the cache file. Dropping it.");
+    if (parsed) {
+      SMARTLIST_FOREACH(parsed, microdesc_t *, m, microdesc_free(m));
+      smartlist_free(parsed);
+    }
+    HT_REMOVE(microdesc_map, &cache->map, md);
+    md->held_in_map = 0;
+    cache->bytes_dropped += md->bodylen;
+    microdesc_free(md);
+    return -1;
+  }
+
+  /* Take the parsed fields; the body stays where it is. */
+  md->onion_pkey = p->onion_pkey;
+  md->onion_pkey_len = p->onion_pkey_len;
+  md->onion_curve25519_pkey = p->onion_curve25519_pkey;
+  md->ed25519_identity_pkey = p->ed25519_identity_pkey;
+  tor_addr_copy(&md->ipv6_addr, &p->ipv6_addr);
+  md->ipv6_orport = p->ipv6_orport;
+  md->family = p->family;
+  md->exit_policy = p->exit_policy;
+  md->ipv6_exit_policy = p->ipv6_exit_policy;
+  md->policy_is_reject_star = p->policy_is_reject_star;
+  md->is_unparsed = 0;
+
+  p->onion_pkey = NULL;
+  p->onion_curve25519_pkey = NULL;
+  p->ed25519_identity_pkey = NULL;
+  p->family = NULL;
+  p->exit_policy = p->ipv6_exit_policy = NULL;
+  microdesc_free(p);
+  smartlist_free(parsed);
+  return 0;
+}
+
+/** Helper: compare two microdescs by their digests. */
+static int
+compare_microdescs_by_digest_(const void **a, const void **b)
+{
+  const microdesc_t *md1 = *a, *md2 = *b;
+  return fast_memcmp(md1->digest, md2->digest, DIGEST256_LEN);
+}
+
+/** Write the index file for the cache file of <b>cache</b>.  Return 0 on
+ * success, -1 on failure. */
+static int
+microdesc_cache_write_index(microdesc_cache_t *cache)
+{
+  smartlist_t *mds;
+  microdesc_t **mdp;
+  char *buf, *cp;
+  size_t len;
+  int r;
+
+  if (!cache->cache_content) {
+    /* There is nothing to describe. */
+    cache->index_is_stale = 0;
+    return write_str_to_file(cache->index_fname, "", 1);
+  }
+
+  mds = smartlist_new();
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if ((*mdp)->saved_location == SAVED_IN_CACHE && (*mdp)->body)
+      smartlist_add(mds, *mdp);
+  }
+  smartlist_sort(mds, compare_microdescs_by_digest_);
+
+  len = MD_INDEX_HEADER_LEN + smartlist_len(mds) * MD_INDEX_ENTRY_LEN;
+  cp = buf = tor_malloc(len);
+  memcpy(cp, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN);
+  set_uint64(cp + MD_INDEX_MAGIC_LEN,
+             tor_htonll(cache->cache_content->size));
+  set_uint64(cp + MD_INDEX_MAGIC_LEN + 8, tor_htonll(smartlist_len(mds)));
+  cp += MD_INDEX_HEADER_LEN;
+  SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+    memcpy(cp, md->digest, DIGEST256_LEN);
+    set_uint64(cp + DIGEST256_LEN, tor_htonll((uint64_t)md->off));
+    set_uint64(cp + DIGEST256_LEN + 8, tor_htonll(md->bodylen));
+    set_uint64(cp + DIGEST256_LEN + 16,
+               tor_htonll((uint64_t)md->last_listed));
+    cp += MD_INDEX_ENTRY_LEN;
+  } SMARTLIST_FOREACH_END(md);
+  tor_assert(cp == buf + len);
+
+  r = write_bytes_to_file(cache->index_fname, buf, len, 1);
+  if (r < 0) {
+    log_warn(LD_DIR, "Couldn't write microdescriptor cache index to %s",
+             cache->index_fname);
+  } else {
+    cache->index_is_stale = 0;
+  }
+  tor_free(buf);
+  smartlist_free(mds);
+  return r;
+}
+
+/** Try to fill the empty <b>cache</b> from its index file, instead of
+ * parsing its whole cache file.  We only parse the microdescriptors that the
+ * current consensus lists; the rest wait until somebody looks them up.
+ * Return the number of microdescriptors loaded, or -1 if the index is
+ * missing or doesn't describe the cache file. */
+static int
+microdesc_cache_load_index(microdesc_cache_t *cache)
+{
+  const tor_mmap_t *mm = cache->cache_content;
+  smartlist_t *loaded = NULL;
+  struct stat st;
+  char *idx;
+  const char *cp;
+  uint64_t cache_len, n_entries, i;
+  size_t live_bytes = 0;
+  int r = -1;
+
+  tor_assert(mm);
+  idx = read_file_to_str(cache->index_fname, RFTS_BIN|RFTS_IGNORE_MISSING,
+                         &st);
+  if (!idx)
+    return -1;
+
+  if ((size_t)st.st_size < MD_INDEX_HEADER_LEN ||
+      fast_memneq(idx, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN))
+    goto done;
+  cache_len = tor_ntohll(get_uint64(idx + MD_INDEX_MAGIC_LEN));
+  n_entries = tor_ntohll(get_uint64(idx + MD_INDEX_MAGIC_LEN + 8));
+  if (cache_len != mm->size ||
+      n_entries > ((size_t)st.st_size - MD_INDEX_HEADER_LEN) /
+                    MD_INDEX_ENTRY_LEN ||
+      (size_t)st.st_size != MD_INDEX_HEADER_LEN +
+                              n_entries * MD_INDEX_ENTRY_LEN)
+    goto done;
+
+  loaded = smartlist_new();
+  cp = idx + MD_INDEX_HEADER_LEN;
+  for (i = 0; i < n_entries; ++i, cp += MD_INDEX_ENTRY_LEN) {
+    const uint64_t off = tor_ntohll(get_uint64(cp + DIGEST256_LEN));
+    const uint64_t bodylen = tor_ntohll(get_uint64(cp + DIGEST256_LEN + 8));
+    microdesc_t *md;
+
+    /* The entries must be sorted, with no duplicates, and each one must
+     * point inside the cache file.  We don't look at the bodies here, so
+     * that we don't page in the whole file: microdesc_materialize() checks
+     * each digest when we parse it. */
+    if (i && fast_memcmp(cp - MD_INDEX_ENTRY_LEN, cp, DIGEST256_LEN) >= 0)
+      goto done;
+    if (off > mm->size || bodylen > mm->size - off || bodylen < 9)
+      goto done;
+
+    md = tor_malloc_zero(sizeof(microdesc_t));
+    memcpy(md->digest, cp, DIGEST256_LEN);
+    md->off = (off_t)off;
+    md->body = (char *)mm->data + off;
+    md->bodylen = (size_t)bodylen;
+    md->last_listed =
+      (time_t)tor_ntohll(get_uint64(cp + DIGEST256_LEN + 16));
+    md->saved_location = SAVED_IN_CACHE;
+    md->is_unparsed = 1;
+    smartlist_add(loaded, md);
+    live_bytes += md->bodylen + (md->last_listed ? MD_ANNOTATION_LEN : 0);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(loaded, microdesc_t *, md) {
+    HT_INSERT(microdesc_map, &cache->map, md);
+    md->held_in_map = 1;
+    ++cache->n_seen;
+    cache->total_len_seen += md->bodylen;
+  } SMARTLIST_FOREACH_END(md);
+  /* Whatever the index doesn't cover is space we could get back by
+   * rebuilding.  (This is an estimate: the annotations might have been
+   * written with an older last_listed time.) */
+  if (mm->size > live_bytes)
+    cache->bytes_dropped += mm->size - live_bytes;
+  r = smartlist_len(loaded);
+
+  {
+    networkstatus_t *ns = networkstatus_get_latest_consensus();
+    if (ns && ns->flavor == FLAV_MICRODESC) {
+      SMARTLIST_FOREACH_BEGIN(loaded, microdesc_t *, md) {
+        if (router_get_consensus_status_by_descriptor_digest(ns,
+                                                             md->digest) &&
+            microdesc_materialize(cache, md) == 0)
+          nodelist_add_microdesc(md);
+      } SMARTLIST_FOREACH_END(md);
+    }
+  }
+  if (r > 0)
+    router_dir_info_changed();
+
+ done:
+  if (r < 0 && loaded)
+    SMARTLIST_FOREACH(loaded, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(loaded);
+  tor_free(idx);
+  return r;
+}
+
 /** Reload the contents of <b>cache</b> from disk.  If it is empty, load it
  * for the first time.  Return 0 on success, -1 on failure. */
 int
@@ -525,12 +768,20 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
-    warn_if_nul_found(mm->data, mm->size, 0, "scanning microdesc cache");
-    added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
-                                    SAVED_IN_CACHE, 0, -1, NULL);
-    if (added) {
-      total += smartlist_len(added);
-      smartlist_free(added);
+    int n_indexed = microdesc_cache_load_index(cache);
+    if (n_indexed >= 0) {
+      total += n_indexed;
+    } else {
+      log_info(LD_DIR, "Microdescriptor cache index is missing or out of "
+               "date; parsing the whole cache.");
+      cache->index_is_stale = 1;
+      warn_if_nul_found(mm->data, mm->size, 0, "scanning microdesc cache");
+      added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
+                                      SAVED_IN_CACHE, 0, -1, NULL);
+      if (added) {
+        total += smartlist_len(added);
+        smartlist_free(added);
+      }
     }
   }
 
@@ -553,6 +804,8 @@ microdesc_cache_reload(microdesc_cache_t *cache)
            total);
 
   microdesc_cache_rebuild(cache, 0 /* don't force */);
+  if (cache->index_is_stale)
+    microdesc_cache_write_index(cache);
 
   return 0;
 }
@@ -658,7 +911,18 @@ microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force)
   }
 }
 
-static int
+/** Possible ways to bring the cache file up to date. */
+typedef enum {
+  /** Leave the cache file and the journal alone. */
+  MD_REBUILD_NONE,
+  /** Move the journal to the end of the cache file. */
+  MD_REBUILD_APPEND,
+  /** Write a new cache file with everything we want to keep. */
+  MD_REBUILD_COMPACT,
+} md_rebuild_t;
+
+/** Return what we should do to the cache file of <b>cache</b>. */
+static md_rebuild_t
 should_rebuild_md_cache(microdesc_cache_t *cache)
 {
     const size_t old_len =
@@ -667,13 +931,15 @@ should_rebuild_md_cache(microdesc_cache_t *cache)
     const size_t dropped = cache->bytes_dropped;
 
     if (journal_len < 16384)
-      return 0; /* Don't bother, not enough has happened yet. */
+      return MD_REBUILD_NONE; /* Don't bother, not enough has happened yet. */
     if (dropped > (journal_len + old_len) / 3)
-      return 1; /* We could save 1/3 or more of the currently used space. */
+      /* We could save 1/3 or more of the currently used space. */
+      return MD_REBUILD_COMPACT;
     if (journal_len > old_len / 2)
-      return 1; /* We should append to the regular file */
+      /* We should append to the regular file */
+      return old_len ? MD_REBUILD_APPEND : MD_REBUILD_COMPACT;
 
-    return 0;
+    return MD_REBUILD_NONE;
 }
 
 /**
@@ -696,10 +962,135 @@ microdesc_wipe_body(microdesc_t *md)
   md->no_save = 1;
 }
 
-/** Regenerate the main cache file for <b>cache</b>, clear the journal file,
- * and update every microdesc_t in the cache with pointers to its new
- * location.  If <b>force</b> is true, do this unconditionally.  If
- * <b>force</b> is false, do it only if we expect to save space on disk. */
+/** Map the cache file of <b>cache</b> again after we have changed it, and
+ * point every microdesc_t stored there at its body in the new mapping.
+ * Return 0 on success, -1 on failure. */
+static int
+microdesc_cache_remap(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  const tor_mmap_t *mm;
+
+  tor_assert(cache->cache_content == NULL);
+  mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
+  if (!mm) {
+    log_warn(LD_DIR, "Couldn't map microdescriptor cache file %s again "
+             "after changing it.", cache->cache_fname);
+  }
+
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    if (md->saved_location != SAVED_IN_CACHE)
+      continue;
+    if (!mm || md->off < 0 || (uint64_t)md->off > mm->size ||
+        md->bodylen > mm->size - (uint64_t)md->off) {
+      microdesc_wipe_body(md);
+      continue;
+    }
+    md->body = (char *)mm->data + md->off;
+  }
+
+  return mm ? 0 : -1;
+}
+
+/** Move every microdescriptor in the journal of <b>cache</b> to the end of
+ * its cache file, clear the journal file, and update the index.  Unlike
+ * microdesc_cache_rebuild(), this leaves the rest of the cache file alone.
+ * Return 0 on success, -1 on failure. */
+STATIC int
+microdesc_cache_append_journal(microdesc_cache_t *cache)
+{
+  open_file_t *open_file;
+  microdesc_t **mdp;
+  smartlist_t *wrote = NULL;
+  off_t orig_len;
+  int fd, res = -1;
+
+  log_info(LD_DIR, "Appending the microdescriptor journal to the cache...");
+
+  /* Don't let anybody trust the index while the cache file changes. */
+  write_str_to_file(cache->index_fname, "", 1);
+  cache->index_is_stale = 1;
+
+  /* As in microdesc_cache_rebuild(), unmap the file before we write to it;
+   * we remap it below. */
+  if (cache->cache_content) {
+    if (tor_munmap_file(cache->cache_content) != 0) {
+      log_warn(LD_FS,
+               "Failed to unmap old microdescriptor cache while appending");
+    }
+    cache->cache_content = NULL;
+  }
+
+  fd = start_writing_to_file(cache->cache_fname,
+                             OPEN_FLAGS_APPEND|O_BINARY,
+                             0600, &open_file);
+  if (fd < 0) {
+    log_warn(LD_DIR, "Couldn't append to microdescriptor cache in %s: %s",
+             cache->cache_fname, strerror(errno));
+    goto remap;
+  }
+  tor_fd_seekend(fd);
+  orig_len = tor_fd_getpos(fd);
+
+  wrote = smartlist_new();
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    size_t annotation_len;
+    if (md->saved_location != SAVED_IN_JOURNAL || md->no_save || !md->body)
+      continue;
+
+    /* dump_microdescriptor() sets md->off for us. */
+    if (dump_microdescriptor(fd, md, &annotation_len) < 0) {
+      /* Leave the cache file the way we found it. */
+      if (orig_len < 0 || tor_fd_setpos(fd, orig_len) < 0 ||
+          tor_ftruncate(fd) < 0) {
+        log_warn(LD_FS, "Couldn't truncate partial write to microdescriptor "
+                 "cache: %s", strerror(errno));
+      }
+      abort_writing_to_file(open_file);
+      goto remap;
+    }
+    smartlist_add(wrote, md);
+  }
+
+  if (finish_writing_to_file(open_file) < 0) {
+    log_warn(LD_DIR, "Error appending to microdescriptor cache: %s",
+             strerror(errno));
+    goto remap;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(wrote, microdesc_t *, md) {
+    tor_free(md->body);
+    md->saved_location = SAVED_IN_CACHE;
+  } SMARTLIST_FOREACH_END(md);
+
+  write_str_to_file(cache->journal_fname, "", 1);
+  cache->journal_len = 0;
+  res = 0;
+
+ remap:
+  if (microdesc_cache_remap(cache) < 0) {
+    res = -1;
+  } else {
+    if (res == 0) {
+      log_info(LD_DIR, "Moved %d microdescriptors from the journal to the "
+               "cache.", smartlist_len(wrote));
+    }
+    /* Even if we failed, the mds that were there before are still there. */
+    microdesc_cache_write_index(cache);
+  }
+  smartlist_free(wrote);
+  return res;
+}
+
+/** Bring the main cache file for <b>cache</b> up to date, clear the journal
+ * file, and update every microdesc_t in the cache with pointers to its new
+ * location.  If <b>force</b> is true, regenerate the cache file
+ * unconditionally.  If <b>force</b> is false, do something only if the
+ * journal has grown large or we expect to save space on disk: either append
+ * the journal to the cache file, or regenerate the cache file if that would
+ * make it much smaller. */
 int
 microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
 {
@@ -710,6 +1101,7 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   ssize_t size;
   off_t off = 0, off_real;
   int orig_size, new_size;
+  md_rebuild_t how;
 
   if (cache == NULL) {
     cache = the_microdesc_cache;
@@ -720,11 +1112,18 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   /* Remove dead descriptors */
   microdesc_cache_clean(cache, 0/*cutoff*/, 0/*force*/);
 
-  if (!force && !should_rebuild_md_cache(cache))
+  how = force ? MD_REBUILD_COMPACT : should_rebuild_md_cache(cache);
+  if (how == MD_REBUILD_NONE)
     return 0;
+  if (how == MD_REBUILD_APPEND)
+    return microdesc_cache_append_journal(cache);
 
   log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
 
+  /* Don't let anybody trust the index while the cache file changes. */
+  write_str_to_file(cache->index_fname, "", 1);
+  cache->index_is_stale = 1;
+
   orig_size = (int)(cache->cache_content ? cache->cache_content->size : 0);
   orig_size += (int)cache->journal_len;
 
@@ -834,6 +1233,8 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
            "Saved %d bytes; %d still used.",
            orig_size-new_size, new_size);
 
+  microdesc_cache_write_index(cache);
+
   return 0;
 }
 
@@ -930,6 +1331,7 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->index_fname);
     tor_free(the_microdesc_cache);
   }
 
@@ -939,16 +1341,33 @@ microdesc_free_all(void)
   }
 }
 
+/** As microdesc_cache_lookup_by_digest256(), but don't parse the
+ * microdescriptor if we haven't parsed it yet.  The result may have only its
+ * cache information, body, and digest set. */
+STATIC microdesc_t *
+microdesc_cache_lookup_noparse(microdesc_cache_t *cache, const char *d)
+{
+  microdesc_t *md, search;
+  if (!cache)
+    cache = get_microdesc_cache();
+  memcpy(search.digest, d, DIGEST256_LEN);
+  md = HT_FIND(microdesc_map, &cache->map, &search);
+  return md;
+}
+
 /** If there is a microdescriptor in <b>cache</b> whose sha256 digest is
  * <b>d</b>, return it.  Otherwise return NULL. */
 microdesc_t *
 microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
 {
-  microdesc_t *md, search;
+  microdesc_t *md;
   if (!cache)
     cache = get_microdesc_cache();
-  memcpy(search.digest, d, DIGEST256_LEN);
-  md = HT_FIND(microdesc_map, &cache->map, &search);
+  md = microdesc_cache_lookup_noparse(cache, d);
+  if (md && PREDICT_UNLIKELY(md->is_unparsed)) {
+    if (microdesc_materialize(cache, md) < 0)
+      md = NULL;
+  }
   return md;
 }
 
@@ -964,7 +1383,7 @@ microdesc_list_missing_digest256(networkstatus_t *ns, microdesc_cache_t *cache,
   time_t now = time(NULL);
   tor_assert(ns->flavor == FLAV_MICRODESC);
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    if (microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest))
+    if (microdesc_cache_lookup_noparse(cache, rs->descriptor_digest))
       continue;
     if (downloadable_only &&
         !download_status_is_ready(&rs->dl_status, now))
@@ -1042,7 +1461,7 @@ update_microdescs_from_networkstatus(time_t now)
   tor_assert(ns->flavor == FLAV_MICRODESC);
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    md = microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest);
+    md = microdesc_cache_lookup_noparse(cache, rs->descriptor_digest);
     if (md && ns->valid_after > md->last_listed)
       md->last_listed = ns->valid_after;
   } SMARTLIST_FOREACH_END(rs);
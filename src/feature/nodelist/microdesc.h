@@ -56,5 +56,11 @@ void microdesc_note_outdated_dirserver(const char *relay_digest);
 int microdesc_relay_is_outdated_dirserver(const char *relay_digest);
 void microdesc_reset_outdated_dirservers_list(void);
 
+#ifdef MICRODESC_PRIVATE
+STATIC microdesc_t *microdesc_cache_lookup_noparse(microdesc_cache_t *cache,
+                                                   const char *d);
+STATIC int microdesc_cache_append_journal(microdesc_cache_t *cache);
+#endif /* defined(MICRODESC_PRIVATE) */
+
 #endif /* !defined(TOR_MICRODESC_H) */
 
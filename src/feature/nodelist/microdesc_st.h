@@ -42,6 +42,11 @@ struct microdesc_t {
   unsigned int held_in_map : 1;
   /** True iff the exit policy for this router rejects everything. */
   unsigned int policy_is_reject_star : 1;
+  /** True iff we loaded this microdesc from the cache index, and haven't
+   * parsed its body yet: only the cache information, the body, and the
+   * digest are set.  microdesc_cache_lookup_by_digest256() parses it on
+   * first use. */
+  unsigned int is_unparsed : 1;
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
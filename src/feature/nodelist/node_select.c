@@ -18,6 +18,7 @@
 #include "core/or/policies.h"
 #include "core/or/reasons.h"
 #include "feature/client/entrynodes.h"
+#include "feature/dirauth/authmode.h"
 #include "feature/dirclient/dirclient.h"
 #include "feature/dirclient/dirclient_modes.h"
 #include "feature/dircommon/directory.h"
@@ -881,34 +882,51 @@ routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
 }
 
 /**
- * Remove every node_t that appears in <b>excluded</b> from <b>sl</b>.
- *
- * Behaves like smartlist_subtract, but uses nodelist_idx values to deliver
- * linear performance when smartlist_subtract would be quadratic.
+ * Return a new bitarray, as long as the nodelist, with the bit for the
+ * nodelist_idx of every node_t in <b>nodes</b> set.  Return NULL if some
+ * node's nodelist_idx turns out to be wrong.
  **/
-static void
-nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
+static bitarray_t *
+nodelist_idx_bitarray_new(const smartlist_t *nodes)
 {
   const smartlist_t *nodelist = nodelist_get_list();
   const int nodelist_len = smartlist_len(nodelist);
-  bitarray_t *excluded_idx = bitarray_init_zero(nodelist_len);
+  bitarray_t *result = bitarray_init_zero(nodelist_len);
 
   /* We haven't used nodelist_idx in this way previously, so I'm going to be
    * paranoid in this code, and check that nodelist_idx is correct for every
-   * node before we use it.  If we fail, we fall back to smartlist_subtract().
+   * node before we use it.  If we fail, our callers fall back to a slower
+   * way that doesn't need it.
    */
-
-  /* Set the excluded_idx bit corresponding to every excluded node...
-   */
-  SMARTLIST_FOREACH_BEGIN(excluded, const node_t *, node) {
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
     const int idx = node->nodelist_idx;
     if (BUG(idx < 0) || BUG(idx >= nodelist_len) ||
         BUG(node != smartlist_get(nodelist, idx))) {
-      goto internal_error;
+      bitarray_free(result);
+      return NULL;
     }
-    bitarray_set(excluded_idx, idx);
+    bitarray_set(result, idx);
   } SMARTLIST_FOREACH_END(node);
 
+  return result;
+}
+
+/**
+ * Remove every node_t that appears in <b>excluded</b> from <b>sl</b>.
+ *
+ * Behaves like smartlist_subtract, but uses nodelist_idx values to deliver
+ * linear performance when smartlist_subtract would be quadratic.
+ **/
+static void
+nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
+{
+  const smartlist_t *nodelist = nodelist_get_list();
+  const int nodelist_len = smartlist_len(nodelist);
+  bitarray_t *excluded_idx = nodelist_idx_bitarray_new(excluded);
+
+  if (!excluded_idx)
+    goto internal_error;
+
   /* Then remove them from sl.
    */
   SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
@@ -932,6 +950,299 @@ nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
   bitarray_free(excluded_idx);
 }
 
+/** Largest number of precomputed selection tables that we keep at once.
+ * Each table is keyed by a set of router_crn_flags_t and a weighting rule,
+ * and in practice we only use a handful of combinations; if something asks
+ * for more, we just start over. */
+#define NODE_SELECT_MAX_TABLES 16
+
+/** How many times do we draw from a precomputed table before giving up on
+ * finding a node that isn't excluded, and building the candidate list the
+ * slow way? */
+#define NODE_SELECT_MAX_REJECTIONS 32
+
+/** A precomputed table for choosing, in constant time, among all the nodes
+ * that satisfy a set of router_crn_flags_t, weighted by bandwidth according
+ * to a bandwidth_weight_rule_t. */
+typedef struct node_select_table_t {
+  /** The flags and weighting rule that this table was built for. */
+  router_crn_flags_t flags;
+  bandwidth_weight_rule_t rule;
+  /** The number of candidate nodes. */
+  int n_nodes;
+  /** The candidate nodes, in nodelist order. */
+  const node_t **nodes;
+  /** The alias table for the candidates' weights: see
+   * node_select_alias_build(). */
+  uint64_t *prob;
+  int *alias;
+  /** The capacity of each column of the alias table: the sum of the
+   * candidates' scaled weights. */
+  uint64_t total;
+} node_select_table_t;
+
+/** The precomputed selection tables that we currently hold. */
+static smartlist_t *node_select_tables = NULL;
+
+/** Build an alias table (using Vose's method) for the <b>n_entries</b>
+ * weights in <b>entries</b>, so that each element can later be chosen with
+ * probability proportional to its weight in constant time.
+ *
+ * The sum of <b>entries</b>, multiplied by <b>n_entries</b>, must fit in a
+ * uint64_t.  Every column of the table has a capacity equal to the sum of
+ * the weights: <b>prob_out</b>[i] receives the part of column i that belongs
+ * to element i, and <b>alias_out</b>[i] the element that owns the rest of
+ * the column.  All the arithmetic is exact, so that the table describes the
+ * same distribution as the weights themselves. */
+STATIC void
+node_select_alias_build(const uint64_t *entries, int n_entries,
+                        uint64_t *prob_out, int *alias_out)
+{
+  uint64_t total = 0;
+  uint64_t *scaled;
+  int *small, *large;
+  int n_small = 0, n_large = 0;
+  int i;
+
+  for (i = 0; i < n_entries; ++i)
+    total += entries[i];
+
+  scaled = tor_calloc(n_entries, sizeof(uint64_t));
+  small = tor_calloc(n_entries, sizeof(int));
+  large = tor_calloc(n_entries, sizeof(int));
+
+  for (i = 0; i < n_entries; ++i) {
+    scaled[i] = entries[i] * (uint64_t)n_entries;
+    alias_out[i] = i;
+    if (scaled[i] < total)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+
+  while (n_small && n_large) {
+    const int s = small[--n_small];
+    const int l = large[n_large - 1];
+    prob_out[s] = scaled[s];
+    alias_out[s] = l;
+    scaled[l] -= total - scaled[s];
+    if (scaled[l] < total) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+  /* Whatever is left fills its own column exactly, since the scaled
+   * weights add up to n_entries columns' worth. */
+  while (n_large)
+    prob_out[large[--n_large]] = total;
+  while (n_small)
+    prob_out[small[--n_small]] = total;
+
+  tor_free(scaled);
+  tor_free(small);
+  tor_free(large);
+}
+
+/** Pick an element from the alias table with <b>n_entries</b> columns of
+ * capacity <b>total</b> described by <b>prob</b> and <b>alias</b>, as built
+ * by node_select_alias_build(), and return its index.  If <b>total</b> is
+ * zero, every element is equally likely. */
+STATIC int
+node_select_alias_pick(const uint64_t *prob, const int *alias,
+                       int n_entries, uint64_t total)
+{
+  uint64_t r, u;
+  int col;
+  uint64_t mask;
+
+  tor_assert(n_entries > 0);
+  if (total == 0)
+    return crypto_rand_int(n_entries);
+
+  r = crypto_rand_uint64(total * (uint64_t)n_entries);
+  col = (int)(r / total);
+  u = r % total;
+  /* Like select_array_member_cumulative_timei(), don't branch on the
+   * random value. */
+  mask = 0 - (uint64_t)(u < prob[col]);
+  return (int)(((uint64_t)col & mask) | ((uint64_t)alias[col] & ~mask));
+}
+
+/** Free all storage held by <b>table</b>. */
+static void
+node_select_table_free_(node_select_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->nodes);
+  tor_free(table->prob);
+  tor_free(table->alias);
+  tor_free(table);
+}
+#define node_select_table_free(table) \
+  FREE_AND_NULL(node_select_table_t, node_select_table_free_, (table))
+
+/** Build a new selection table for every node that we could choose with
+ * <b>flags</b>, weighted by bandwidth according to <b>rule</b>. */
+static node_select_table_t *
+node_select_table_new(router_crn_flags_t flags, bandwidth_weight_rule_t rule)
+{
+  node_select_table_t *table = tor_malloc_zero(sizeof(node_select_table_t));
+  smartlist_t *sl = smartlist_new();
+  double *bandwidths_dbl = NULL;
+  double total_dbl = 0.0;
+  uint64_t *weights = NULL;
+  int i;
+
+  table->flags = flags;
+  table->rule = rule;
+
+  router_add_running_nodes_to_smartlist(sl, flags);
+  table->n_nodes = smartlist_len(sl);
+  if (table->n_nodes == 0 ||
+      compute_weighted_bandwidths(sl, rule, &bandwidths_dbl, &total_dbl) < 0)
+    goto done;
+
+  table->nodes = tor_calloc(table->n_nodes, sizeof(const node_t *));
+  table->prob = tor_calloc(table->n_nodes, sizeof(uint64_t));
+  table->alias = tor_calloc(table->n_nodes, sizeof(int));
+  weights = tor_calloc(table->n_nodes, sizeof(uint64_t));
+
+  SMARTLIST_FOREACH(sl, const node_t *, node,
+                    table->nodes[node_sl_idx] = node);
+
+  /* Scale the weights so that a full table (n_nodes columns, each as big as
+   * the total) stays well inside a uint64_t.  Don't let any node with a
+   * nonzero weight get rounded out of the table entirely. */
+  if (total_dbl > 0.0) {
+    const double scale = ((double)(UINT64_C(1) << 62)) /
+      table->n_nodes / total_dbl;
+    for (i = 0; i < table->n_nodes; ++i) {
+      weights[i] = tor_llround(bandwidths_dbl[i] * scale);
+      if (weights[i] == 0 && bandwidths_dbl[i] > 0.0)
+        weights[i] = 1;
+      table->total += weights[i];
+    }
+  }
+
+  node_select_alias_build(weights, table->n_nodes,
+                          table->prob, table->alias);
+
+ done:
+  tor_free(bandwidths_dbl);
+  tor_free(weights);
+  smartlist_free(sl);
+  return table;
+}
+
+/** Return the selection table for <b>flags</b> and <b>rule</b>, building it
+ * if we don't have it yet. */
+static const node_select_table_t *
+node_select_table_get(router_crn_flags_t flags, bandwidth_weight_rule_t rule)
+{
+  node_select_table_t *table;
+
+  if (!node_select_tables)
+    node_select_tables = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(node_select_tables, node_select_table_t *, t) {
+    if (t->flags == flags && t->rule == rule)
+      return t;
+  } SMARTLIST_FOREACH_END(t);
+
+  if (smartlist_len(node_select_tables) >= NODE_SELECT_MAX_TABLES)
+    node_select_tables_clear();
+
+  table = node_select_table_new(flags, rule);
+  smartlist_add(node_select_tables, table);
+  return table;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of precomputed selection tables that we hold. */
+STATIC int
+node_select_tables_count(void)
+{
+  return node_select_tables ? smartlist_len(node_select_tables) : 0;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Forget every precomputed selection table.  Called whenever the set of
+ * usable nodes or their weights may have changed: when the nodelist or the
+ * consensus changes, when we learn new descriptors, when a node goes up or
+ * down, and when our options change. */
+void
+node_select_tables_clear(void)
+{
+  if (!node_select_tables)
+    return;
+  SMARTLIST_FOREACH(node_select_tables, node_select_table_t *, t,
+                    node_select_table_free(t));
+  smartlist_clear(node_select_tables);
+}
+
+/** Release all storage held by the precomputed selection tables. */
+void
+node_select_tables_free_all(void)
+{
+  node_select_tables_clear();
+  smartlist_free(node_select_tables);
+}
+
+/** Try to choose a node for router_choose_random_node_helper() from the
+ * precomputed table for <b>flags</b> and <b>rule</b>, rejecting nodes in
+ * <b>excluded_idx</b> (a bitarray of nodelist_idx values) or in
+ * <b>excludedset</b>.
+ *
+ * Since a node's weight doesn't depend on which other nodes are
+ * candidates, drawing from the whole table until we get a node that isn't
+ * excluded chooses nodes with exactly the same probabilities as building
+ * the list of candidates and choosing from that.  Return NULL if we didn't
+ * find an acceptable node in a reasonable number of tries: the caller must
+ * then fall back to the slow way, which also keeps the distribution the
+ * same when all the remaining nodes have weight zero. */
+static const node_t *
+node_select_table_choose(router_crn_flags_t flags,
+                         bandwidth_weight_rule_t rule,
+                         bitarray_t *excluded_idx,
+                         int excluded_idx_len,
+                         const routerset_t *excludedset)
+{
+  const node_select_table_t *table = node_select_table_get(flags, rule);
+  int attempt;
+
+  if (table->n_nodes == 0 || !table->nodes)
+    return NULL;
+
+  for (attempt = 0; attempt < NODE_SELECT_MAX_REJECTIONS; ++attempt) {
+    const int i = node_select_alias_pick(table->prob, table->alias,
+                                         table->n_nodes, table->total);
+    const node_t *node = table->nodes[i];
+    const int idx = node->nodelist_idx;
+    if (idx >= 0 && idx < excluded_idx_len &&
+        bitarray_is_set(excluded_idx, idx))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+    /* Don't trust the table blindly if something changed a node behind our
+     * back without telling us. */
+    if (!router_can_choose_node(node, flags))
+      continue;
+    return node;
+  }
+  return NULL;
+}
+
+/** Return true iff we should choose nodes for router_choose_random_node()
+ * from precomputed selection tables.  Directory authorities change their
+ * nodes' flags in too many places for the tables to keep up with, and
+ * choose nodes rarely enough that it doesn't matter. */
+static bool
+node_select_tables_enabled(void)
+{
+  return !authdir_mode(get_options());
+}
+
 /* Node selection helper for router_choose_random_node().
  *
  * Populates a node list based on <b>flags</b>, ignoring nodes in
@@ -943,9 +1254,22 @@ router_choose_random_node_helper(smartlist_t *excludednodes,
                                  router_crn_flags_t flags,
                                  bandwidth_weight_rule_t rule)
 {
-  smartlist_t *sl=smartlist_new();
+  smartlist_t *sl;
   const node_t *choice = NULL;
 
+  if (node_select_tables_enabled()) {
+    bitarray_t *excluded_idx = nodelist_idx_bitarray_new(excludednodes);
+    if (excluded_idx) {
+      choice = node_select_table_choose(flags, rule, excluded_idx,
+                                        smartlist_len(nodelist_get_list()),
+                                        excludedset);
+      bitarray_free(excluded_idx);
+    }
+    if (choice)
+      return choice;
+  }
+
+  sl = smartlist_new();
   router_add_running_nodes_to_smartlist(sl, flags);
   log_debug(LD_CIRC,
            "We found %d running nodes.",
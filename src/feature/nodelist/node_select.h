@@ -86,6 +86,9 @@ const node_t *router_choose_random_node(smartlist_t *excludedsmartlist,
                                         struct routerset_t *excludedset,
                                         router_crn_flags_t flags);
 
+void node_select_tables_clear(void);
+void node_select_tables_free_all(void);
+
 const routerstatus_t *router_pick_trusteddirserver(dirinfo_type_t type,
                                                    int flags);
 const routerstatus_t *router_pick_fallback_dirserver(dirinfo_type_t type,
@@ -103,6 +106,13 @@ STATIC const routerstatus_t *router_pick_directory_server_impl(
                                            int *n_busy_out);
 STATIC int router_is_already_dir_fetching(const tor_addr_port_t *ap,
                                           int serverdesc, int microdesc);
+STATIC void node_select_alias_build(const uint64_t *entries, int n_entries,
+                                    uint64_t *prob_out, int *alias_out);
+STATIC int node_select_alias_pick(const uint64_t *prob, const int *alias,
+                                  int n_entries, uint64_t total);
+#ifdef TOR_UNIT_TESTS
+STATIC int node_select_tables_count(void);
+#endif /* defined(TOR_UNIT_TESTS) */
 #endif /* defined(NODE_SELECT_PRIVATE) */
 
 #endif /* !defined(TOR_NODE_SELECT_H) */
@@ -256,6 +256,8 @@ node_get_or_create(const char *identity_digest)
 
   node->country = -1;
 
+  node_select_tables_clear();
+
   return node;
 }
 
@@ -621,6 +623,8 @@ nodelist_set_consensus(const networkstatus_t *ns)
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
+  node_select_tables_clear();
+
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
 
@@ -766,6 +770,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tor_assert(tmp == node);
   }
   node_remove_from_ed25519_map(node);
+  node_select_tables_clear();
 
   idx = node->nodelist_idx;
   tor_assert(idx >= 0);
@@ -844,6 +849,8 @@ nodelist_purge(void)
 void
 nodelist_free_all(void)
 {
+  node_select_tables_free_all();
+
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
@@ -2389,6 +2396,7 @@ void
 router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
+  node_select_tables_clear();
   rend_hsdir_routers_changed();
   hs_service_dir_info_changed();
   hs_client_dir_info_changed();
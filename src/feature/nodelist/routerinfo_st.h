@@ -58,6 +58,9 @@ struct routerinfo_t {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** exit_policy, compiled for fast lookups; NULL if we haven't needed it
+   * yet. */
+  struct compiled_policy_t *exit_policy_compiled;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
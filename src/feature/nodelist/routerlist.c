@@ -69,6 +69,7 @@
 #include "core/or/circuituse.h"
 #include "core/or/extendinfo.h"
 #include "core/or/policies.h"
+#include "core/or/policy_trie.h"
 #include "feature/client/bridges.h"
 #include "feature/control/control_events.h"
 #include "feature/dirauth/authmode.h"
@@ -938,6 +939,7 @@ routerinfo_free_(routerinfo_t *router)
     smartlist_free(router->declared_family);
   }
   addr_policy_list_free(router->exit_policy);
+  compiled_policy_free(router->exit_policy_compiled);
   short_policy_free(router->ipv6_exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
@@ -32,6 +32,7 @@
 #include "core/mainloop/cpuworker.h"
 #include "core/or/circuitlist.h"
 #include "core/or/onion.h"
+#include "core/or/or_metrics.h"
 #include "feature/nodelist/networkstatus.h"
 
 #include "core/or/or_circuit_st.h"
@@ -174,6 +175,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
       tor_free(m);
     }
     tor_free(tmp);
+    or_metrics_note_onionskin(false);
     return -1;
   }
 
@@ -185,6 +187,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 
   circ->onionqueue_entry = tmp;
   TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type], tmp, next);
+  or_metrics_note_onionskin(true);
 
   /* cull elderly requests. */
   while (1) {
@@ -195,6 +198,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
     circ = head->circ;
     circ->onionqueue_entry = NULL;
     onion_queue_entry_remove(head);
+    or_metrics_note_onionskin(false);
     log_info(LD_CIRC,
              "Circuit create request is too old; canceling due to overload.");
     if (! TO_CIRCUIT(circ)->marked_for_close) {
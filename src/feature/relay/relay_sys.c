@@ -11,6 +11,7 @@
 
 #include "orconfig.h"
 #include "core/or/or.h"
+#include "core/or/memacct.h"
 
 #include "feature/relay/dns.h"
 #include "feature/relay/ext_orport.h"
@@ -22,10 +23,20 @@
 
 #include "lib/subsys/subsys.h"
 
+/** Memory accounting for the DNS cache. */
+static const memacct_t dns_cache_memacct = {
+  .name = "dns-cache",
+  .get_allocation = dns_cache_total_allocation,
+  .handle_oom = dns_cache_handle_oom,
+  .priority = MEMACCT_PRIO_DNS_CACHE,
+  .budget_percent = 20,
+};
+
 static int
 subsys_relay_initialize(void)
 {
   relay_register_periodic_events();
+  memacct_register(&dns_cache_memacct);
   return 0;
 }
 
@@ -15,6 +15,7 @@
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
 #include "core/or/policies.h"
+#include "core/or/policy_trie.h"
 #include "core/or/protover.h"
 #include "feature/client/transports.h"
 #include "feature/control/control_events.h"
@@ -1669,6 +1670,9 @@ router_compare_to_my_exit_policy(const tor_addr_t *addr, uint16_t port)
    * summary. */
   if ((tor_addr_family(addr) == AF_INET ||
        tor_addr_family(addr) == AF_INET6)) {
+    if (me->exit_policy_compiled)
+      return compare_tor_addr_to_compiled_policy(addr, port,
+                      me->exit_policy_compiled) != ADDR_POLICY_ACCEPTED;
     return compare_tor_addr_to_addr_policy(addr, port,
                                me->exit_policy) != ADDR_POLICY_ACCEPTED;
 #if 0
@@ -2142,6 +2146,7 @@ router_build_fresh_unsigned_routerinfo,(routerinfo_t **ri_out))
                                             &ri->ipv6_addr,
                                             &ri->exit_policy);
   }
+  ri->exit_policy_compiled = addr_policy_compile(ri->exit_policy);
   ri->policy_is_reject_star =
     policy_is_reject_star(ri->exit_policy, AF_INET, 1) &&
     policy_is_reject_star(ri->exit_policy, AF_INET6, 1);
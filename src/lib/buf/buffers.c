@@ -34,6 +34,9 @@
 #include "lib/string/printf.h"
 #include "lib/time/compat_time.h"
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -904,6 +907,146 @@ buf_set_to_copy(buf_t **output,
   return 0;
 }
 
+#ifdef HAVE_SYS_UIO_H
+/** Fill in up to <b>max_iov</b> entries of <b>iov</b> to point at the first
+ * <b>max_bytes</b> bytes of data in <b>buf</b>, one entry per chunk, so that
+ * they can be written with a single writev() call.  Return the number of
+ * entries used.
+ *
+ * The entries point into <b>buf</b>'s own memory, so they are only valid
+ * until the next time <b>buf</b> is modified.  Once some of the data has
+ * been written, remove it with buf_drain(). */
+int
+buf_get_data_iov(const buf_t *buf, struct iovec *iov, int max_iov,
+                 size_t max_bytes)
+{
+  const chunk_t *chunk;
+  int n = 0;
+
+  tor_assert(buf);
+  tor_assert(iov);
+
+  for (chunk = buf->head; chunk && n < max_iov && max_bytes;
+       chunk = chunk->next) {
+    size_t len = chunk->datalen;
+    if (len == 0)
+      continue;
+    if (len > max_bytes)
+      len = max_bytes;
+    iov[n].iov_base = chunk->data;
+    iov[n].iov_len = len;
+    max_bytes -= len;
+    ++n;
+  }
+  return n;
+}
+
+/** Make room for up to <b>at_most</b> more bytes at the end of <b>buf</b>,
+ * adding chunks as needed, and fill in up to <b>max_iov</b> entries of
+ * <b>iov</b> to point at the free space, so that it can be filled with a
+ * single readv() call.  Return the number of entries used.  (We might make
+ * room for less than <b>at_most</b> bytes if we run out of entries.)
+ *
+ * After reading, the caller must call buf_commit_space_iov() with the same
+ * entries, even if nothing was read: the free space isn't part of the
+ * buffer's data until then, and we may have added chunks that need to go
+ * away again. */
+int
+buf_get_space_iov(buf_t *buf, struct iovec *iov, int max_iov,
+                  size_t at_most)
+{
+  chunk_t *chunk;
+  size_t total = 0;
+  int n = 0;
+
+  tor_assert(buf);
+  tor_assert(iov);
+
+  if (max_iov <= 0 || at_most == 0)
+    return 0;
+
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN) {
+    size_t len = CHUNK_REMAINING_CAPACITY(buf->tail);
+    if (len > at_most)
+      len = at_most;
+    iov[n].iov_base = CHUNK_WRITE_PTR(buf->tail);
+    iov[n].iov_len = len;
+    total += len;
+    ++n;
+  }
+
+  while (total < at_most && n < max_iov) {
+    size_t len = at_most - total;
+    chunk = buf_add_chunk_with_capacity(buf, len, 1);
+    if (len > chunk->memlen)
+      len = chunk->memlen;
+    iov[n].iov_base = CHUNK_WRITE_PTR(chunk);
+    iov[n].iov_len = len;
+    total += len;
+    ++n;
+  }
+
+  return n;
+}
+
+/** Tell <b>buf</b> that <b>n_bytes</b> bytes have been written into the
+ * <b>n_iov</b> entries of <b>iov</b>, which were set up by
+ * buf_get_space_iov(), and add them to the buffer's data.  Release any
+ * chunks that buf_get_space_iov() added but that didn't receive any data. */
+void
+buf_commit_space_iov(buf_t *buf, const struct iovec *iov, int n_iov,
+                     size_t n_bytes)
+{
+  chunk_t *chunk, *prev = NULL, *last_used;
+  int i;
+
+  tor_assert(buf);
+
+  if (n_iov <= 0) {
+    tor_assert(n_bytes == 0);
+    return;
+  }
+
+  /* Find the chunk that the first entry points into. */
+  for (chunk = buf->head; chunk; prev = chunk, chunk = chunk->next) {
+    if (CHUNK_WRITE_PTR(chunk) == iov[0].iov_base)
+      break;
+  }
+  tor_assert(chunk);
+
+  last_used = prev;
+  for (i = 0; i < n_iov; ++i, chunk = chunk->next) {
+    size_t len = iov[i].iov_len;
+    tor_assert(chunk);
+    tor_assert(CHUNK_WRITE_PTR(chunk) == iov[i].iov_base);
+    if (len > n_bytes)
+      len = n_bytes;
+    chunk->datalen += len;
+    buf->datalen += len;
+    n_bytes -= len;
+    if (chunk->datalen)
+      last_used = chunk;
+  }
+  tor_assert(n_bytes == 0);
+
+  /* Everything after last_used is an empty chunk that we added. */
+  chunk = last_used ? last_used->next : buf->head;
+  while (chunk) {
+    chunk_t *next = chunk->next;
+    tor_assert(chunk->datalen == 0);
+    buf_chunk_free_unchecked(chunk);
+    chunk = next;
+  }
+  if (last_used) {
+    last_used->next = NULL;
+    buf->tail = last_used;
+  } else {
+    buf->head = buf->tail = NULL;
+  }
+  check();
+}
+#endif /* defined(HAVE_SYS_UIO_H) */
+
 /** Log an error and exit if <b>buf</b> is corrupted.
  */
 void
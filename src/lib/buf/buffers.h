@@ -65,6 +65,16 @@ void buf_pullup(buf_t *buf, size_t bytes,
                 const char **head_out, size_t *len_out);
 char *buf_extract(buf_t *buf, size_t *sz_out);
 
+#ifdef HAVE_SYS_UIO_H
+struct iovec;
+int buf_get_data_iov(const buf_t *buf, struct iovec *iov, int max_iov,
+                     size_t max_bytes);
+int buf_get_space_iov(buf_t *buf, struct iovec *iov, int max_iov,
+                      size_t at_most);
+void buf_commit_space_iov(buf_t *buf, const struct iovec *iov, int n_iov,
+                          size_t n_bytes);
+#endif /* defined(HAVE_SYS_UIO_H) */
+
 #ifdef BUFFERS_PRIVATE
 #ifdef TOR_UNIT_TESTS
 buf_t *buf_new_with_data(const char *cp, size_t sz);
@@ -0,0 +1,675 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file uring.c
+ * \brief A small wrapper around the Linux io_uring interface.
+ *
+ * An io_uring is a pair of queues that we share with the kernel: we put
+ * requests ("submission queue entries") on one, and the kernel puts results
+ * ("completion queue entries") on the other.  Many requests can be handed
+ * to the kernel with a single system call, and when the kernel finishes a
+ * read or write, it has already moved the data: we don't need another
+ * system call to do it, the way we do with poll-style interfaces.
+ *
+ * We only support the handful of operations that our network code needs:
+ * receiving into a kernel-selected buffer, sending from one of our own
+ * buffers, polling, and cancelling.  We talk to the kernel directly rather
+ * than using liburing, since we need so little of it.
+ *
+ * Receive buffers come from a "provided buffer ring": the kernel picks a
+ * buffer only when data actually arrives, so a socket that is waiting for
+ * data doesn't tie up any memory.  We hand each receive buffer back to the
+ * kernel as soon as the completion callback for it returns.
+ *
+ * Send buffers are ours: the caller copies the data to send into one of
+ * them, and gets it back when the send completes.  That way the caller's
+ * own memory is never in use by the kernel, and it can free that memory
+ * whenever it likes.  (Registering the send buffers with the kernel would
+ * only pay off for zero-copy sends, which need much larger writes than ours
+ * to be worthwhile.)
+ *
+ * Only use these functions from a single thread.
+ **/
+
+#include "orconfig.h"
+#include "lib/evloop/uring.h"
+#include "lib/intmath/cmp.h"
+#include "lib/log/log.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+#include "lib/malloc/map_anon.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_IO_URING
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/** Group ID for our provided buffer ring. */
+#define URING_BUF_GROUP 0
+
+struct tor_uring_t {
+  /** The file descriptor for the ring itself. */
+  int fd;
+
+  /** Memory for the submission queue ring, and its size. */
+  void *sq_ring;
+  size_t sq_ring_size;
+  /** Memory for the completion queue ring, and its size.  Equal to
+   * <b>sq_ring</b> if the kernel lets us map them together. */
+  void *cq_ring;
+  size_t cq_ring_size;
+  /** The submission queue entries, and their total size. */
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  /** Fields of the submission queue that we share with the kernel. */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_flags;
+  /** Mask to turn an index into an offset in the submission queue. */
+  unsigned sq_mask;
+  /** Number of entries in the submission queue. */
+  unsigned sq_entries;
+  /** Our own idea of the submission queue tail: it includes entries that
+   * we have prepared but not yet told the kernel about. */
+  unsigned sq_tail_local;
+  /** Number of entries that we have prepared, but the kernel has not yet
+   * consumed. */
+  unsigned n_unsubmitted;
+
+  /** Fields of the completion queue that we share with the kernel. */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  struct io_uring_cqe *cqes;
+  /** Mask to turn an index into an offset in the completion queue. */
+  unsigned cq_mask;
+
+  /** Size of each receive and send buffer. */
+  size_t buf_size;
+  /** Number of receive buffers, and number of send buffers. */
+  unsigned n_bufs;
+
+  /** The ring through which we provide receive buffers to the kernel. */
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  /** Our copy of the tail of <b>buf_ring</b>. */
+  uint16_t buf_ring_tail;
+  /** Memory for the receive buffers. */
+  uint8_t *recv_bufs;
+
+  /** Memory for the send buffers. */
+  uint8_t *send_bufs;
+  /** Stack of indices of send buffers that are not in use. */
+  int *free_send_bufs;
+  unsigned n_free_send_bufs;
+
+  /** Counters, for benchmarks and diagnostics. */
+  tor_uring_stats_t stats;
+};
+
+/** Wrapper for the io_uring_setup system call. */
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+/** Wrapper for the io_uring_enter system call. */
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, NULL, 0);
+}
+
+/** Wrapper for the io_uring_register system call. */
+static int
+sys_io_uring_register(int fd, unsigned opcode, const void *arg,
+                      unsigned nr_args)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/** Return true iff this kernel lets us use the io_uring features that we
+ * need. */
+int
+tor_uring_is_supported(void)
+{
+  static int supported = -1;
+  if (supported < 0) {
+    tor_uring_t *ring = tor_uring_new(4, 1, 4096);
+    supported = (ring != NULL);
+    tor_uring_free(ring);
+  }
+  return supported;
+}
+
+/** Return the receive buffer with index <b>bid</b> to the kernel. */
+static void
+uring_recycle_recv_buf(tor_uring_t *ring, uint16_t bid)
+{
+  struct io_uring_buf *b =
+    &ring->buf_ring->bufs[ring->buf_ring_tail & (ring->n_bufs - 1)];
+  b->addr = (uint64_t)(uintptr_t)(ring->recv_bufs + bid * ring->buf_size);
+  b->len = (uint32_t) ring->buf_size;
+  b->bid = bid;
+  ++ring->buf_ring_tail;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_ring_tail,
+                   __ATOMIC_RELEASE);
+}
+
+/** Map the queues for the io_uring <b>ring</b>, as described by <b>p</b>.
+ * Return 0 on success and -1 on failure. */
+static int
+uring_map_queues(tor_uring_t *ring, const struct io_uring_params *p)
+{
+  ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+    p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sq_ring_size = ring->cq_ring_size =
+      MAX(ring->sq_ring_size, ring->cq_ring_size);
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    return -1;
+  }
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      return -1;
+    }
+  }
+  ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    return -1;
+  }
+
+  uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+  ring->sq_head = (unsigned *)(sq + p->sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+  ring->sq_flags = (unsigned *)(sq + p->sq_off.flags);
+  ring->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+  ring->sq_entries = *(unsigned *)(sq + p->sq_off.ring_entries);
+  ring->sq_tail_local = *ring->sq_tail;
+  /* We always use submission queue entry i for array slot i. */
+  unsigned *sq_array = (unsigned *)(sq + p->sq_off.array);
+  for (unsigned i = 0; i < ring->sq_entries; ++i)
+    sq_array[i] = i;
+
+  ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+  return 0;
+}
+
+/** Set up the receive and send buffers for <b>ring</b>.  Return 0 on
+ * success and -1 on failure. */
+static int
+uring_setup_buffers(tor_uring_t *ring)
+{
+  const size_t total = ring->n_bufs * ring->buf_size;
+
+  /* Receive buffers, and the ring that we use to hand them to the
+   * kernel. */
+  ring->buf_ring_size = ring->n_bufs * sizeof(struct io_uring_buf);
+  ring->buf_ring = tor_mmap_anonymous(ring->buf_ring_size, 0, NULL);
+  ring->recv_bufs = tor_mmap_anonymous(total, 0, NULL);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t) ring->buf_ring;
+  reg.ring_entries = ring->n_bufs;
+  reg.bgid = URING_BUF_GROUP;
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING,
+                            &reg, 1) < 0) {
+    log_info(LD_NET, "Unable to register io_uring receive buffers: %s",
+             strerror(errno));
+    return -1;
+  }
+  for (unsigned i = 0; i < ring->n_bufs; ++i)
+    uring_recycle_recv_buf(ring, (uint16_t)i);
+
+  /* Send buffers. */
+  ring->send_bufs = tor_mmap_anonymous(total, 0, NULL);
+  ring->free_send_bufs = tor_calloc(ring->n_bufs, sizeof(int));
+  for (unsigned i = 0; i < ring->n_bufs; ++i)
+    ring->free_send_bufs[i] = (int)(ring->n_bufs - 1 - i);
+  ring->n_free_send_bufs = ring->n_bufs;
+  return 0;
+}
+
+/** Create and return a new io_uring with room for at least
+ * <b>n_entries</b> pending submissions.  It will have <b>n_bufs</b> receive
+ * buffers and <b>n_bufs</b> send buffers, each of size <b>buf_size</b>.
+ * <b>n_bufs</b> must be a power of two.
+ *
+ * Return NULL if the kernel doesn't support what we need. */
+tor_uring_t *
+tor_uring_new(unsigned n_entries, unsigned n_bufs, size_t buf_size)
+{
+  struct io_uring_params p;
+  tor_uring_t *ring;
+
+  tor_assert(n_bufs && n_bufs <= 32768 && (n_bufs & (n_bufs - 1)) == 0);
+  tor_assert(buf_size && buf_size <= UINT32_MAX);
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CLAMP;
+  int fd = sys_io_uring_setup(n_entries, &p);
+  if (fd < 0) {
+    log_info(LD_NET, "io_uring_setup() failed: %s", strerror(errno));
+    return NULL;
+  }
+
+  ring = tor_malloc_zero(sizeof(tor_uring_t));
+  ring->fd = fd;
+  ring->n_bufs = n_bufs;
+  ring->buf_size = buf_size;
+
+  /* Without NODROP, the kernel would silently lose completions when the
+   * completion queue is full, and we'd never hear about the requests that
+   * they belonged to. */
+  if (!(p.features & IORING_FEAT_NODROP)) {
+    log_info(LD_NET, "This kernel's io_uring can drop completions.");
+    goto err;
+  }
+  if (uring_map_queues(ring, &p) < 0) {
+    log_info(LD_NET, "Unable to map io_uring queues: %s", strerror(errno));
+    goto err;
+  }
+  if (uring_setup_buffers(ring) < 0)
+    goto err;
+
+  return ring;
+ err:
+  tor_uring_free(ring);
+  return NULL;
+}
+
+/** Release all storage held by <b>ring</b>.  Requests that are still
+ * pending are cancelled, and their callbacks are never invoked. */
+void
+tor_uring_free_(tor_uring_t *ring)
+{
+  if (!ring)
+    return;
+  const size_t total = ring->n_bufs * ring->buf_size;
+  /* Closing the ring cancels everything on it; do it before we unmap any
+   * memory that the kernel might still be using. */
+  if (ring->fd >= 0)
+    close(ring->fd);
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->buf_ring)
+    tor_munmap_anonymous(ring->buf_ring, ring->buf_ring_size);
+  if (ring->recv_bufs)
+    tor_munmap_anonymous(ring->recv_bufs, total);
+  if (ring->send_bufs)
+    tor_munmap_anonymous(ring->send_bufs, total);
+  tor_free(ring->free_send_bufs);
+  tor_free(ring);
+}
+
+/** Return the file descriptor for <b>ring</b>.  It becomes readable when
+ * there are completions to process. */
+int
+tor_uring_get_fd(const tor_uring_t *ring)
+{
+  return ring->fd;
+}
+
+/** Return the size of each of <b>ring</b>'s send and receive buffers. */
+size_t
+tor_uring_get_buf_size(const tor_uring_t *ring)
+{
+  return ring->buf_size;
+}
+
+/** Copy <b>ring</b>'s counters into <b>out</b>. */
+void
+tor_uring_get_stats(const tor_uring_t *ring, tor_uring_stats_t *out)
+{
+  memcpy(out, &ring->stats, sizeof(*out));
+}
+
+/** Take a send buffer from <b>ring</b>, and set *<b>buf_out</b> to point
+ * to it.  Return its index, or -1 if all of them are in use. */
+int
+tor_uring_send_buf_get(tor_uring_t *ring, uint8_t **buf_out)
+{
+  if (ring->n_free_send_bufs == 0)
+    return -1;
+  int idx = ring->free_send_bufs[--ring->n_free_send_bufs];
+  *buf_out = ring->send_bufs + idx * ring->buf_size;
+  return idx;
+}
+
+/** Give the send buffer with index <b>buf_idx</b> back to <b>ring</b>. */
+void
+tor_uring_send_buf_release(tor_uring_t *ring, int buf_idx)
+{
+  tor_assert(buf_idx >= 0 && (unsigned)buf_idx < ring->n_bufs);
+  tor_assert(ring->n_free_send_bufs < ring->n_bufs);
+  ring->free_send_bufs[ring->n_free_send_bufs++] = buf_idx;
+}
+
+/** Return a zeroed submission queue entry from <b>ring</b>, or NULL if the
+ * queue is full and we couldn't make room in it. */
+static struct io_uring_sqe *
+uring_get_sqe(tor_uring_t *ring)
+{
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_tail_local - head >= ring->sq_entries) {
+    /* Full: hand what we have to the kernel, and try again. */
+    if (tor_uring_submit(ring, 0) < 0)
+      return NULL;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_tail_local - head >= ring->sq_entries)
+      return NULL;
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sq_tail_local & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ++ring->sq_tail_local;
+  ++ring->n_unsubmitted;
+  return sqe;
+}
+
+/** Prepare a request to receive up to <b>max_len</b> bytes from the socket
+ * <b>fd</b> into one of <b>ring</b>'s receive buffers.  Return 0 on success
+ * and -1 if the submission queue is full. */
+int
+tor_uring_prep_recv(tor_uring_t *ring, tor_uring_req_t *req,
+                    int fd, size_t max_len)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->len = (uint32_t) MIN(max_len, ring->buf_size);
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = (uint64_t)(uintptr_t) req;
+  return 0;
+}
+
+/** Prepare a request to send the first <b>len</b> bytes of the send buffer
+ * <b>buf_idx</b> on the socket <b>fd</b>.  Return 0 on success and -1 if the
+ * submission queue is full. */
+int
+tor_uring_prep_send(tor_uring_t *ring, tor_uring_req_t *req,
+                    int fd, int buf_idx, size_t len)
+{
+  tor_assert(buf_idx >= 0 && (unsigned)buf_idx < ring->n_bufs);
+  tor_assert(len <= ring->buf_size);
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)(ring->send_bufs + buf_idx*ring->buf_size);
+  sqe->len = (uint32_t) len;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uint64_t)(uintptr_t) req;
+  return 0;
+}
+
+/** Prepare a request to wait until <b>fd</b> is writable.  When it
+ * finishes, the result is the poll(2) revents for <b>fd</b>.  Return 0 on
+ * success and -1 if the submission queue is full. */
+int
+tor_uring_prep_poll_writable(tor_uring_t *ring, tor_uring_req_t *req, int fd)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = (uint64_t)(uintptr_t) req;
+  return 0;
+}
+
+/** Prepare a request to cancel the pending request <b>req</b>.  If the
+ * cancellation succeeds, <b>req</b>'s callback gets -ECANCELED.  Return 0
+ * on success and -1 if the submission queue is full. */
+int
+tor_uring_prep_cancel(tor_uring_t *ring, tor_uring_req_t *req)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t) req;
+  /* We don't care how the cancellation itself goes. */
+  sqe->user_data = 0;
+  return 0;
+}
+
+/** Hand every prepared request on <b>ring</b> to the kernel, and wait until
+ * at least <b>wait_for</b> completions are ready.  Return the number of
+ * requests that the kernel accepted, or -1 on error. */
+int
+tor_uring_submit(tor_uring_t *ring, unsigned wait_for)
+{
+  __atomic_store_n(ring->sq_tail, ring->sq_tail_local, __ATOMIC_RELEASE);
+  if (ring->n_unsubmitted == 0 && wait_for == 0)
+    return 0;
+
+  int r = sys_io_uring_enter(ring->fd, ring->n_unsubmitted, wait_for,
+                             wait_for ? IORING_ENTER_GETEVENTS : 0);
+  ++ring->stats.n_enter_calls;
+  if (r < 0) {
+    /* The entries are still on the queue; we'll retry them next time. */
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+      return 0;
+    log_warn(LD_NET, "io_uring_enter() failed: %s", strerror(errno));
+    return -1;
+  }
+  tor_assert((unsigned)r <= ring->n_unsubmitted);
+  ring->n_unsubmitted -= r;
+  ring->stats.n_submitted += r;
+  return r;
+}
+
+/** Invoke the callback for every completed request on <b>ring</b>.  Return
+ * the number of completions that we processed.
+ *
+ * Callbacks may prepare and submit new requests, but must not call this
+ * function. */
+int
+tor_uring_process_completions(tor_uring_t *ring)
+{
+  unsigned head = *ring->cq_head;
+  int n = 0;
+
+  for (;;) {
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      /* If the kernel ran out of room on the completion queue, it is
+       * holding some completions for us: ask for them. */
+      if (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) &
+          IORING_SQ_CQ_OVERFLOW) {
+        sys_io_uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+        ++ring->stats.n_enter_calls;
+        if (__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != head)
+          continue;
+      }
+      break;
+    }
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    tor_uring_req_t *req = (tor_uring_req_t *)(uintptr_t) cqe->user_data;
+    const int result = cqe->res;
+    const unsigned flags = cqe->flags;
+    /* Release the queue entry before the callback, in case the callback
+     * causes more completions. */
+    __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+    ++n;
+
+    if (result == -ENOBUFS)
+      ++ring->stats.n_no_buffers;
+    if (!req)
+      continue;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+      const uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+      req->cb(req, result, ring->recv_bufs + bid * ring->buf_size);
+      uring_recycle_recv_buf(ring, bid);
+    } else {
+      req->cb(req, result, NULL);
+    }
+  }
+  ring->stats.n_completed += n;
+  return n;
+}
+
+#else /* !defined(HAVE_IO_URING) */
+
+/* Without kernel support, nothing works: tor_uring_new() always fails, so
+ * nobody can call the rest of these. */
+
+int
+tor_uring_is_supported(void)
+{
+  return 0;
+}
+
+tor_uring_t *
+tor_uring_new(unsigned n_entries, unsigned n_bufs, size_t buf_size)
+{
+  (void)n_entries;
+  (void)n_bufs;
+  (void)buf_size;
+  return NULL;
+}
+
+void
+tor_uring_free_(tor_uring_t *ring)
+{
+  tor_assert_nonfatal(ring == NULL);
+}
+
+int
+tor_uring_get_fd(const tor_uring_t *ring)
+{
+  (void)ring;
+  tor_assert_unreached();
+  return -1;
+}
+
+size_t
+tor_uring_get_buf_size(const tor_uring_t *ring)
+{
+  (void)ring;
+  tor_assert_unreached();
+  return 0;
+}
+
+void
+tor_uring_get_stats(const tor_uring_t *ring, tor_uring_stats_t *out)
+{
+  (void)ring;
+  memset(out, 0, sizeof(*out));
+}
+
+int
+tor_uring_send_buf_get(tor_uring_t *ring, uint8_t **buf_out)
+{
+  (void)ring;
+  *buf_out = NULL;
+  return -1;
+}
+
+void
+tor_uring_send_buf_release(tor_uring_t *ring, int buf_idx)
+{
+  (void)ring;
+  (void)buf_idx;
+  tor_assert_unreached();
+}
+
+int
+tor_uring_prep_recv(tor_uring_t *ring, tor_uring_req_t *req,
+                    int fd, size_t max_len)
+{
+  (void)ring;
+  (void)req;
+  (void)fd;
+  (void)max_len;
+  return -1;
+}
+
+int
+tor_uring_prep_send(tor_uring_t *ring, tor_uring_req_t *req,
+                    int fd, int buf_idx, size_t len)
+{
+  (void)ring;
+  (void)req;
+  (void)fd;
+  (void)buf_idx;
+  (void)len;
+  return -1;
+}
+
+int
+tor_uring_prep_poll_writable(tor_uring_t *ring, tor_uring_req_t *req, int fd)
+{
+  (void)ring;
+  (void)req;
+  (void)fd;
+  return -1;
+}
+
+int
+tor_uring_prep_cancel(tor_uring_t *ring, tor_uring_req_t *req)
+{
+  (void)ring;
+  (void)req;
+  return -1;
+}
+
+int
+tor_uring_submit(tor_uring_t *ring, unsigned wait_for)
+{
+  (void)ring;
+  (void)wait_for;
+  return -1;
+}
+
+int
+tor_uring_process_completions(tor_uring_t *ring)
+{
+  (void)ring;
+  return 0;
+}
+
+#endif /* defined(HAVE_IO_URING) */
@@ -0,0 +1,75 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file uring.h
+ * \brief Header for uring.c
+ **/
+
+#ifndef TOR_URING_H
+#define TOR_URING_H
+
+#include "orconfig.h"
+#include "lib/cc/torint.h"
+#include "lib/malloc/malloc.h"
+
+/** A Linux io_uring instance, with the buffers that we use for I/O on it. */
+typedef struct tor_uring_t tor_uring_t;
+typedef struct tor_uring_req_t tor_uring_req_t;
+
+/** Callback for a finished request.  <b>result</b> is the result of the
+ * operation, or a negative errno value.  For receives, <b>data</b> holds the
+ * received bytes; it is only valid until the callback returns.  For all
+ * other operations it is NULL. */
+typedef void (*tor_uring_cb_fn_t)(tor_uring_req_t *req, int result,
+                                  const uint8_t *data);
+
+/** A request that we have handed (or will hand) to the kernel.  The owner
+ * keeps this structure alive until its callback has been invoked. */
+struct tor_uring_req_t {
+  /** Function to call when the request is done. */
+  tor_uring_cb_fn_t cb;
+  /** Pointer for the owner's use. */
+  void *arg;
+};
+
+/** Counters for a tor_uring_t. */
+typedef struct tor_uring_stats_t {
+  /** Number of times that we entered the kernel to submit requests or to
+   * wait for completions. */
+  uint64_t n_enter_calls;
+  /** Number of requests that the kernel has accepted from us. */
+  uint64_t n_submitted;
+  /** Number of completions that we have processed. */
+  uint64_t n_completed;
+  /** Number of receives that failed because every receive buffer was in
+   * use. */
+  uint64_t n_no_buffers;
+} tor_uring_stats_t;
+
+int tor_uring_is_supported(void);
+tor_uring_t *tor_uring_new(unsigned n_entries, unsigned n_bufs,
+                           size_t buf_size);
+void tor_uring_free_(tor_uring_t *ring);
+#define tor_uring_free(ring) \
+  FREE_AND_NULL(tor_uring_t, tor_uring_free_, (ring))
+
+int tor_uring_get_fd(const tor_uring_t *ring);
+size_t tor_uring_get_buf_size(const tor_uring_t *ring);
+void tor_uring_get_stats(const tor_uring_t *ring, tor_uring_stats_t *out);
+
+int tor_uring_send_buf_get(tor_uring_t *ring, uint8_t **buf_out);
+void tor_uring_send_buf_release(tor_uring_t *ring, int buf_idx);
+
+int tor_uring_prep_recv(tor_uring_t *ring, tor_uring_req_t *req,
+                        int fd, size_t max_len);
+int tor_uring_prep_send(tor_uring_t *ring, tor_uring_req_t *req,
+                        int fd, int buf_idx, size_t len);
+int tor_uring_prep_poll_writable(tor_uring_t *ring, tor_uring_req_t *req,
+                                 int fd);
+int tor_uring_prep_cancel(tor_uring_t *ring, tor_uring_req_t *req);
+
+int tor_uring_submit(tor_uring_t *ring, unsigned wait_for);
+int tor_uring_process_completions(tor_uring_t *ring);
+
+#endif /* !defined(TOR_URING_H) */
@@ -1,4 +1,3 @@
-
 /* copyright (c) 2013-2015, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
@@ -9,13 +8,27 @@
  * for them to send answers back to the main thread.
  *
  * The main structure here is a threadpool_t : it manages a set of worker
- * threads, a queue of pending work, and a reply queue.  Every piece of work
- * is a workqueue_entry_t, containing data to process and a function to
+ * threads, their queues of pending work, and a reply queue.  Every piece of
+ * work is a workqueue_entry_t, containing data to process and a function to
  * process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in net/alertsock.c.
+ * Each worker thread has its own queues of pending work, one per priority,
+ * protected by its own lock.  New work goes onto one worker's queues; a
+ * worker takes work from its own queues first, and steals from the other
+ * workers' queues when its own are empty.  This way, the workers don't all
+ * contend for a single lock every time they look for work.
+ *
+ * The main thread informs idle worker threads of pending work by using a
+ * condition variable, which it only touches when some worker is actually
+ * waiting on it.  The workers hand completed work back through per-worker
+ * lock-free rings on the reply queue, and inform the main process of
+ * completed work by using an alert_sockets_t object, as implemented in
+ * net/alertsock.c.  A worker only sends an alert if the main thread hasn't
+ * been alerted since it last looked at its answers; when the main thread is
+ * busy, it can also hold off alerts for a short window and pick up all the
+ * answers that arrive in the meantime at once.  Either way, the main thread
+ * handles a bounded number of answers at a time, so that a flood of answers
+ * can't keep it from its other events.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -28,6 +41,8 @@
 #include "lib/evloop/workqueue.h"
 
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/intmath/bits.h"
+#include "lib/intmath/cmp.h"
 #include "lib/intmath/weakrng.h"
 #include "lib/log/ratelim.h"
 #include "lib/log/log.h"
@@ -35,6 +50,7 @@
 #include "lib/net/alertsock.h"
 #include "lib/net/socket.h"
 #include "lib/thread/threads.h"
+#include "lib/time/compat_time.h"
 
 #include "ext/tor_queue.h"
 #include <event2/event.h>
@@ -49,19 +65,26 @@ typedef struct work_tailq_t work_tailq_t;
 
 struct threadpool_t {
   /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+   * thread. This array doesn't change once the threads are running. */
   struct workerthread_t **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
+  /** Condition variable that idle workers wait on, and which gets signaled
+   * when there is new work or a new update. */
   tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** Number of workers that are waiting (or about to wait) on
+   * <b>condition</b>. */
+  atomic_counter_t n_idle;
+  /** Total number of pending work items with priority <b>p</b>, on all the
+   * workers' queues. */
+  atomic_counter_t n_pending[WORKQUEUE_N_PRIORITIES];
+  /** Number of work items that a worker has taken from another worker's
+   * queues. */
+  atomic_counter_t n_stolen;
 
   /** The current 'update generation' of the threadpool.  Any thread that is
-   * at an earlier generation needs to run the update function. */
-  unsigned generation;
+   * at an earlier generation needs to run the update function.  Only
+   * changed while holding <b>lock</b>. */
+  atomic_counter_t generation;
 
   /** Function that should be run for updates on each thread. */
   workqueue_reply_t (*update_fn)(void *, void *);
@@ -72,10 +95,18 @@ struct threadpool_t {
   /** Event to notice when another thread has sent a reply. */
   struct event *reply_event;
   void (*reply_cb)(threadpool_t *);
+  /** Timer to look for more replies at the end of a coalescing window. */
+  struct event *reply_timer;
+  /** How long, in microseconds, should we hold off alerts from the workers
+   * after we've handled some replies?  0 if we shouldn't. */
+  uint32_t reply_coalesce_usec;
+  /** True iff we're holding off alerts from the workers until
+   * <b>reply_timer</b> fires. */
+  unsigned reply_window_open : 1;
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect the update fields and <b>condition</b>. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -100,7 +131,11 @@ struct workqueue_entry_t {
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_t *on_pool;
-  /** True iff this entry is waiting for a worker to start processing it. */
+  /** The worker thread on whose queues this entry was placed.  Set when the
+   * entry is queued, and never changed afterwards. */
+  struct workerthread_t *on_thread;
+  /** True iff this entry is waiting for a worker to start processing it.
+   * Protected by on_thread's lock. */
   uint8_t pending;
   /** Priority of this entry. */
   workqueue_priority_bitfield_t priority : WORKQUEUE_PRIORITY_BITS;
@@ -110,14 +145,57 @@ struct workqueue_entry_t {
   void (*reply_fn)(void *arg);
   /** Argument for the above functions. */
   void *arg;
+  /** When did a worker finish with this entry and queue it as a reply? */
+  monotime_t answered_at;
 };
 
+/** Number of slots in each worker's reply ring.  Must be a power of two. */
+#define REPLY_RING_SIZE 256
+
+/** A single-producer, single-consumer ring of answers from one worker
+ * thread to the main thread.  Only the worker advances <b>tail</b>, and only
+ * the main thread advances <b>head</b>. */
+typedef struct reply_ring_t {
+  /** Index of the next answer for the main thread to take. */
+  atomic_counter_t head;
+  /** Index of the next free slot for the worker to fill. */
+  atomic_counter_t tail;
+  /** The answers themselves, indexed modulo REPLY_RING_SIZE. */
+  workqueue_entry_t *slots[REPLY_RING_SIZE];
+} reply_ring_t;
+
 struct replyqueue_t {
   /** Mutex to protect the answers field */
   tor_mutex_t lock;
-  /** Doubly-linked list of answers that the reply queue needs to handle. */
+  /** Doubly-linked list of answers that the reply queue needs to handle,
+   * for when a worker's reply ring is full. */
   TOR_TAILQ_HEAD(, workqueue_entry_t) answers;
 
+  /** One reply ring for each worker thread that answers to this queue.
+   * Only changed from the main thread. */
+  reply_ring_t **rings;
+  /** Number of elements in rings. */
+  int n_rings;
+  /** True iff a worker has alerted the main thread, and the main thread
+   * hasn't started processing the answers yet; or if the main thread has
+   * asked the workers not to alert it for now. */
+  atomic_counter_t alert_pending;
+  /** Largest number of answers to handle in one call to
+   * replyqueue_process(), or 0 for no limit. */
+  int max_batch;
+  /** Index of the ring where the next call to replyqueue_process() should
+   * start, so that a batch limit doesn't favor the first rings. */
+  int next_ring;
+
+  /** Number of alerts that workers have sent on this queue. */
+  atomic_counter_t n_alerts;
+  /** Number of answers that workers have put on <b>answers</b> because
+   * their rings were full. */
+  atomic_counter_t n_overflows;
+  /** Statistics about the answers that the main thread has handled.
+   * Only used from the main thread. */
+  replyqueue_stats_t stats;
+
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
 };
@@ -133,13 +211,25 @@ typedef struct workerthread_t {
   void *state;
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
+  /** Our ring on <b>reply_queue</b>. */
+  reply_ring_t *reply_ring;
   /** The current update generation of this thread */
-  unsigned generation;
+  size_t generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
+
+  /** Mutex to protect <b>work</b>, and the pending flags of the entries on
+   * it. */
+  tor_mutex_t lock;
+  /** Queues of pending work that were placed on this thread. The queue with
+   * priority <b>p</b> is work[p]. Other threads may steal from them. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** Number of entries in work[p], so that other threads can tell whether
+   * there's anything to steal without taking our lock. */
+  atomic_counter_t n_queued[WORKQUEUE_N_PRIORITIES];
 } workerthread_t;
 
-static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
+static void queue_reply(workerthread_t *thread, workqueue_entry_t *work);
 
 /** Allocate and return a new workqueue_entry_t, set up to run the function
  * <b>fn</b> in the worker thread, and <b>reply_fn</b> in the main
@@ -173,6 +263,38 @@ workqueue_entry_free_(workqueue_entry_t *ent)
   tor_free(ent);
 }
 
+/** Put <b>ent</b> on its thread's queue for its priority: at the head if
+ * <b>at_head</b> is true, and at the tail otherwise.  Mark it as pending.
+ *
+ * The caller must hold ent->on_thread's lock. */
+static void
+workqueue_entry_enqueue(workqueue_entry_t *ent, int at_head)
+{
+  workerthread_t *thread = ent->on_thread;
+  workqueue_priority_t prio = ent->priority;
+  if (at_head)
+    TOR_TAILQ_INSERT_HEAD(&thread->work[prio], ent, next_work);
+  else
+    TOR_TAILQ_INSERT_TAIL(&thread->work[prio], ent, next_work);
+  ent->pending = 1;
+  atomic_counter_add(&thread->n_queued[prio], 1);
+  atomic_counter_add(&thread->in_pool->n_pending[prio], 1);
+}
+
+/** Remove <b>ent</b> from its thread's queue, and mark it as non-pending.
+ *
+ * The caller must hold ent->on_thread's lock. */
+static void
+workqueue_entry_dequeue(workqueue_entry_t *ent)
+{
+  workerthread_t *thread = ent->on_thread;
+  workqueue_priority_t prio = ent->priority;
+  TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
+  ent->pending = 0;
+  atomic_counter_sub(&thread->n_queued[prio], 1);
+  atomic_counter_sub(&thread->in_pool->n_pending[prio], 1);
+}
+
 /**
  * Cancel a workqueue_entry_t that has been returned from
  * threadpool_queue_work.
@@ -192,14 +314,14 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
-  workqueue_priority_t prio = ent->priority;
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    workqueue_entry_dequeue(ent);
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -207,34 +329,63 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
-
-   must hold lock */
+/** Return true iff any work is pending anywhere in <b>pool</b>. */
 static int
-worker_thread_has_work(workerthread_t *thread)
+threadpool_has_pending_work(threadpool_t *pool)
 {
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
-        return 1;
+    if (atomic_counter_get(&pool->n_pending[i]))
+      return 1;
   }
-  return thread->generation != thread->in_pool->generation;
+  return 0;
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
+/** Return true iff <b>thread</b> needs to run its pool's update function
+ * before it does any more work. */
+static int
+worker_thread_needs_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  return thread->generation != atomic_counter_get(&pool->generation);
+}
+
+/** Take the oldest pending entry with priority <b>prio</b> from
+ * <b>victim</b>'s queues, and return it; or return NULL if there is none.
+ * <b>victim</b> may be the calling thread, or any other thread in the same
+ * pool. */
+static workqueue_entry_t *
+worker_thread_take_work(workerthread_t *victim, workqueue_priority_t prio)
+{
+  workqueue_entry_t *work;
+  /* Don't bother with the lock if there's obviously nothing here. */
+  if (atomic_counter_get(&victim->n_queued[prio]) == 0)
+    return NULL;
+  tor_mutex_acquire(&victim->lock);
+  work = TOR_TAILQ_FIRST(&victim->work[prio]);
+  if (work)
+    workqueue_entry_dequeue(work);
+  tor_mutex_release(&victim->lock);
+  return work;
+}
+
+/** Extract the next workqueue_entry_t for <b>thread</b> to run, removing it
+ * from the relevant queues and marking it as non-pending.  Return NULL if
+ * there is no work to do.
  *
- * The caller must hold the lock. */
+ * We choose a priority as if all the pool's work were on one set of queues.
+ * Then we take work of that priority from our own queues if we have any,
+ * and steal it from another thread otherwise. */
 static workqueue_entry_t *
 worker_thread_extract_next_work(workerthread_t *thread)
 {
   threadpool_t *pool = thread->in_pool;
-  work_tailq_t *queue = NULL, *this_queue;
-  unsigned i;
+  workqueue_entry_t *work;
+  int prio = -1;
+  int i, start;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
-    if (!TOR_TAILQ_EMPTY(this_queue)) {
-      queue = this_queue;
+    if (atomic_counter_get(&pool->n_pending[i])) {
+      prio = i;
       if (! crypto_fast_rng_one_in_n(get_thread_fast_rng(),
                                      thread->lower_priority_chance)) {
         /* Usually we'll just break now, so that we can get out of the loop
@@ -246,13 +397,69 @@ worker_thread_extract_next_work(workerthread_t *thread)
     }
   }
 
-  if (queue == NULL)
+  if (prio < 0)
     return NULL;
 
-  workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
-  TOR_TAILQ_REMOVE(queue, work, next_work);
-  work->pending = 0;
-  return work;
+  work = worker_thread_take_work(thread, prio);
+  if (work)
+    return work;
+
+  /* Start at a random victim, so that the thieves don't all pile onto the
+   * same thread. */
+  start = (int) crypto_fast_rng_get_uint(get_thread_fast_rng(),
+                                         pool->n_threads);
+  for (i = 0; i < pool->n_threads; ++i) {
+    workerthread_t *victim = pool->threads[(start + i) % pool->n_threads];
+    if (victim == thread)
+      continue;
+    work = worker_thread_take_work(victim, prio);
+    if (work) {
+      atomic_counter_add(&pool->n_stolen, 1);
+      return work;
+    }
+  }
+  return NULL;
+}
+
+/** Run the current update function of <b>thread</b>'s pool, and return its
+ * result. */
+static workqueue_reply_t
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_reply_t (*update_fn)(void*,void*);
+  void *arg;
+
+  tor_mutex_acquire(&pool->lock);
+  arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  update_fn = pool->update_fn;
+  thread->generation = atomic_counter_get(&pool->generation);
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg);
+}
+
+/** Block until there might be work or an update for <b>thread</b>. */
+static void
+worker_thread_wait_for_work(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+
+  tor_mutex_acquire(&pool->lock);
+  /* We announce that we're idle before we check for work; the main thread
+   * adds work before it checks for idle threads.  So either we'll see the
+   * work, or the main thread will see us and signal us, and since we hold
+   * the lock until we're waiting, that signal can't get lost. */
+  atomic_counter_add(&pool->n_idle, 1);
+  while (!threadpool_has_pending_work(pool) &&
+         !worker_thread_needs_update(thread)) {
+    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
+      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    }
+  }
+  atomic_counter_sub(&pool->n_idle, 1);
+  tor_mutex_release(&pool->lock);
 }
 
 /**
@@ -262,102 +469,149 @@ static void
 worker_thread_main(void *thread_)
 {
   workerthread_t *thread = thread_;
-  threadpool_t *pool = thread->in_pool;
   workqueue_entry_t *work;
   workqueue_reply_t result;
 
-  tor_mutex_acquire(&pool->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        tor_mutex_acquire(&pool->lock);
-        continue;
+    if (worker_thread_needs_update(thread)) {
+      if (worker_thread_run_update(thread) != WQ_RPL_REPLY) {
+        return;
       }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
-
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
-      result = work->fn(thread->state, work->arg);
+      continue;
+    }
 
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
+    work = worker_thread_extract_next_work(thread);
+    if (work == NULL) {
+      /* TODO: support an idle-function */
+      worker_thread_wait_for_work(thread);
+      continue;
+    }
 
-      /* We may need to exit the thread. */
-      if (result != WQ_RPL_REPLY) {
-        return;
-      }
-      tor_mutex_acquire(&pool->lock);
+    if (worker_thread_needs_update(thread)) {
+      /* An update arrived while we were looking for work; this work may
+       * have been queued after it.  Put the work back where we found it,
+       * and run the update first. */
+      tor_mutex_acquire(&work->on_thread->lock);
+      workqueue_entry_enqueue(work, 1);
+      tor_mutex_release(&work->on_thread->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
-    /* TODO: support an idle-function */
+    /* We run the work function without holding any lock. */
+    result = work->fn(thread->state, work->arg);
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    /* Queue the reply for the main thread. */
+    queue_reply(thread, work);
+
+    /* We may need to exit the thread. */
+    if (result != WQ_RPL_REPLY) {
+      return;
     }
   }
 }
 
-/** Put a reply on the reply queue.  The reply must not currently be on
- * any thread's work queue. */
+/** Try to put <b>work</b> on <b>ring</b>.  Return 0 on success, and -1 if
+ * the ring is full.  Only the ring's worker thread may call this. */
+static int
+reply_ring_push(reply_ring_t *ring, workqueue_entry_t *work)
+{
+  size_t head = atomic_counter_get(&ring->head);
+  size_t tail = atomic_counter_get(&ring->tail);
+  if (tail - head >= REPLY_RING_SIZE)
+    return -1;
+  monotime_get(&work->answered_at);
+  ring->slots[tail % REPLY_RING_SIZE] = work;
+  /* Only publish the slot once it's written. */
+  atomic_counter_add(&ring->tail, 1);
+  return 0;
+}
+
+/** Remove and return the oldest answer on <b>ring</b>, or NULL if it is
+ * empty.  Only the main thread may call this. */
+static workqueue_entry_t *
+reply_ring_pop(reply_ring_t *ring)
+{
+  size_t head = atomic_counter_get(&ring->head);
+  workqueue_entry_t *work;
+  if (head == atomic_counter_get(&ring->tail))
+    return NULL;
+  work = ring->slots[head % REPLY_RING_SIZE];
+  /* Only free the slot once we've read it. */
+  atomic_counter_add(&ring->head, 1);
+  return work;
+}
+
+/** Put a reply from <b>thread</b> on its reply queue.  The reply must not
+ * currently be on any thread's work queue. */
 static void
-queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
+queue_reply(workerthread_t *thread, workqueue_entry_t *work)
 {
-  int was_empty;
-  tor_mutex_acquire(&queue->lock);
-  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
-  tor_mutex_release(&queue->lock);
+  replyqueue_t *queue = thread->reply_queue;
+
+  if (reply_ring_push(thread->reply_ring, work) < 0) {
+    /* Our ring is full: the main thread is falling behind.  Use the shared
+     * list instead. */
+    monotime_get(&work->answered_at);
+    tor_mutex_acquire(&queue->lock);
+    TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
+    tor_mutex_release(&queue->lock);
+    atomic_counter_add(&queue->n_overflows, 1);
+  }
 
-  if (was_empty) {
+  /* Only the first answer since the main thread last looked needs to wake
+   * it up. */
+  if (atomic_counter_exchange(&queue->alert_pending, 1) == 0) {
+    atomic_counter_add(&queue->n_alerts, 1);
     if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
       /* XXXX complain! */
     }
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and send
+ * responses to <b>replyqueue</b>.  The thread isn't started until
+ * workerthread_start() is called. */
 static workerthread_t *
 workerthread_new(int32_t lower_priority_chance,
                  void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
+  unsigned i;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
+  tor_mutex_init_nonrecursive(&thr->lock);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
+    atomic_counter_init(&thr->n_queued[i]);
+  }
 
+  thr->reply_ring = tor_malloc_zero(sizeof(reply_ring_t));
+  atomic_counter_init(&thr->reply_ring->head);
+  atomic_counter_init(&thr->reply_ring->tail);
+  replyqueue->rings = tor_reallocarray(replyqueue->rings,
+                                       sizeof(reply_ring_t *),
+                                       replyqueue->n_rings + 1);
+  replyqueue->rings[replyqueue->n_rings++] = thr->reply_ring;
+
+  return thr;
+}
+
+/** Launch the thread for <b>thr</b>.  Return 0 on success, -1 on
+ * failure. */
+static int
+workerthread_start(workerthread_t *thr)
+{
   if (spawn_func(worker_thread_main, thr) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
     log_err(LD_GENERAL, "Can't launch worker thread.");
-    tor_free(thr);
-    return NULL;
+    return -1;
     //LCOV_EXCL_STOP
   }
 
-  return thr;
+  return 0;
 }
 
 /**
@@ -393,17 +647,23 @@ threadpool_queue_work_priority(threadpool_t *pool,
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
 
   workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  unsigned idx = crypto_fast_rng_get_uint(get_thread_fast_rng(),
+                                          pool->n_threads);
   ent->on_pool = pool;
-  ent->pending = 1;
+  ent->on_thread = pool->threads[idx];
   ent->priority = prio;
 
-  tor_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
+  tor_mutex_acquire(&ent->on_thread->lock);
+  workqueue_entry_enqueue(ent, 0);
+  tor_mutex_release(&ent->on_thread->lock);
 
-  tor_cond_signal_one(&pool->condition);
-
-  tor_mutex_release(&pool->lock);
+  /* Busy workers will find the new work on their own; we only need to wake
+   * somebody up if there's a worker waiting. */
+  if (atomic_counter_get(&pool->n_idle)) {
+    tor_mutex_acquire(&pool->lock);
+    tor_cond_signal_one(&pool->condition);
+    tor_mutex_release(&pool->lock);
+  }
 
   return ent;
 }
@@ -461,7 +721,7 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_args = new_args;
   pool->free_update_arg_fn = free_fn;
   pool->update_fn = fn;
-  ++pool->generation;
+  atomic_counter_add(&pool->generation, 1);
 
   tor_cond_signal_all(&pool->condition);
 
@@ -493,10 +753,14 @@ threadpool_queue_update(threadpool_t *pool,
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
+  int first_new;
   if (BUG(n < 0))
     return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
     n = MAX_THREADS;
+  /* All work lives on some thread's queues, so we need at least one. */
+  if (n < 1)
+    n = 1;
 
   tor_mutex_acquire(&pool->lock);
 
@@ -504,6 +768,9 @@ threadpool_start_threads(threadpool_t *pool, int n)
     pool->threads = tor_reallocarray(pool->threads,
                                      sizeof(workerthread_t*), n);
 
+  /* Set up every thread before we start any of them, so that the running
+   * threads always see a complete array of threads to steal from. */
+  first_new = pool->n_threads;
   while (pool->n_threads < n) {
     /* For half of our threads, we'll choose lower priorities permissively;
      * for the other half, we'll stick more strictly to higher priorities.
@@ -513,17 +780,18 @@ threadpool_start_threads(threadpool_t *pool, int n)
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(chance,
                                            state, pool, pool->reply_queue);
+    thr->index = pool->n_threads;
+    pool->threads[pool->n_threads++] = thr;
+  }
 
-    if (!thr) {
+  while (first_new < n) {
+    if (workerthread_start(pool->threads[first_new++]) < 0) {
       //LCOV_EXCL_START
       tor_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
       tor_mutex_release(&pool->lock);
       return -1;
       //LCOV_EXCL_STOP
     }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
   }
   tor_mutex_release(&pool->lock);
 
@@ -548,9 +816,12 @@ threadpool_new(int n_threads,
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
   tor_cond_init(&pool->condition);
+  atomic_counter_init(&pool->n_idle);
+  atomic_counter_init(&pool->generation);
+  atomic_counter_init(&pool->n_stolen);
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
+    atomic_counter_init(&pool->n_pending[i]);
   }
 
   pool->new_thread_state_fn = new_thread_state_fn;
@@ -597,10 +868,66 @@ replyqueue_new(uint32_t alertsocks_flags)
 
   tor_mutex_init(&rq->lock);
   TOR_TAILQ_INIT(&rq->answers);
+  atomic_counter_init(&rq->alert_pending);
+  atomic_counter_init(&rq->n_alerts);
+  atomic_counter_init(&rq->n_overflows);
+  /* The workers timestamp their answers. */
+  monotime_init();
 
   return rq;
 }
 
+static int replyqueue_process_batch(replyqueue_t *queue, int hold_alerts);
+
+/** Internal: start a reply coalescing window for <b>tp</b>, or start a new
+ * one if the last one just ended. */
+static void
+threadpool_open_reply_window(threadpool_t *tp)
+{
+  struct timeval tv;
+  tv.tv_sec = tp->reply_coalesce_usec / 1000000;
+  tv.tv_usec = tp->reply_coalesce_usec % 1000000;
+  tp->reply_window_open = 1;
+  /* Ask the workers not to alert us: we'll be back when the timer fires. */
+  atomic_counter_exchange(&tp->reply_queue->alert_pending, 1);
+  event_add(tp->reply_timer, &tv);
+}
+
+/** Internal: handle replies for <b>tp</b>, and decide whether to hold off
+ * alerts from the workers for a while.  <b>from_timer</b> is true iff a
+ * coalescing window just ended. */
+static void
+threadpool_handle_replies(threadpool_t *tp, int from_timer)
+{
+  replyqueue_t *queue = tp->reply_queue;
+  int n = replyqueue_process_batch(queue, tp->reply_window_open);
+
+  if (from_timer) {
+    if (n > 0) {
+      /* Still busy: keep coalescing. */
+      threadpool_open_reply_window(tp);
+    } else {
+      /* A whole window went by without any answers, so the workers are
+       * idle. Let the next answer wake us up right away.  Look once more
+       * for any answer that arrived while we weren't listening. */
+      tp->reply_window_open = 0;
+      n = replyqueue_process_batch(queue, 0);
+    }
+  }
+
+  if (tp->reply_cb)
+    tp->reply_cb(tp);
+
+  if (n > 0 && !tp->reply_window_open && tp->reply_coalesce_usec &&
+      tp->reply_timer) {
+    /* We found answers, so the workers are busy, and more answers are
+     * probably on their way.  Rather than letting the next one wake us up
+     * right away, come back for everything that arrived at the end of the
+     * window. */
+    threadpool_open_reply_window(tp);
+  }
+}
+
 /** Internal: Run from the libevent mainloop when there is work to handle in
  * the reply queue handler. */
 static void
@@ -609,9 +936,18 @@ reply_event_cb(evutil_socket_t sock, short events, void *arg)
   threadpool_t *tp = arg;
   (void) sock;
   (void) events;
-  replyqueue_process(tp->reply_queue);
-  if (tp->reply_cb)
-    tp->reply_cb(tp);
+  threadpool_handle_replies(tp, 0);
+}
+
+/** Internal: Run from the libevent mainloop at the end of a reply coalescing
+ * window. */
+static void
+reply_timer_cb(evutil_socket_t sock, short events, void *arg)
+{
+  threadpool_t *tp = arg;
+  (void) sock;
+  (void) events;
+  threadpool_handle_replies(tp, 1);
 }
 
 /** Register the threadpool <b>tp</b>'s reply queue with Tor's global
@@ -628,24 +964,89 @@ threadpool_register_reply_event(threadpool_t *tp,
   if (tp->reply_event) {
     tor_event_free(tp->reply_event);
   }
+  if (tp->reply_timer) {
+    tor_event_free(tp->reply_timer);
+  }
   tp->reply_event = tor_event_new(base,
                                   tp->reply_queue->alert.read_fd,
                                   EV_READ|EV_PERSIST,
                                   reply_event_cb,
                                   tp);
   tor_assert(tp->reply_event);
+  tp->reply_timer = tor_evtimer_new(base, reply_timer_cb, tp);
+  tor_assert(tp->reply_timer);
   tp->reply_cb = cb;
   return event_add(tp->reply_event, NULL);
 }
 
-/**
- * Process all pending replies on a reply queue. The main thread should call
- * this function every time the socket returned by replyqueue_get_socket() is
- * readable.
- */
+/** Once the threadpool <b>tp</b> has handled some replies from its reply
+ * event, have it wait up to <b>usec</b> microseconds for more replies
+ * before the workers can wake it up again.  This trades a little reply
+ * latency for fewer wakeups when the workers are busy.  If <b>usec</b> is
+ * 0, every first reply wakes the main thread right away. */
 void
-replyqueue_process(replyqueue_t *queue)
+threadpool_set_reply_coalesce_usec(threadpool_t *tp, uint32_t usec)
+{
+  tp->reply_coalesce_usec = usec;
+}
+
+/** Return the number of work items that <b>tp</b>'s workers have stolen
+ * from one another's queues so far. */
+uint64_t
+threadpool_get_n_stolen(threadpool_t *tp)
+{
+  return atomic_counter_get(&tp->n_stolen);
+}
+
+/** Make replyqueue_process() handle no more than <b>max_batch</b> replies
+ * from <b>queue</b> at a time, or any number of them if <b>max_batch</b> is
+ * 0. */
+void
+replyqueue_set_max_batch(replyqueue_t *queue, int max_batch)
+{
+  queue->max_batch = MAX(max_batch, 0);
+}
+
+/** Record that we are handling the reply <b>work</b> from <b>queue</b>. */
+static void
+replyqueue_note_reply(replyqueue_t *queue, const workqueue_entry_t *work)
+{
+  monotime_t now;
+  int64_t usec;
+  int bucket;
+
+  monotime_get(&now);
+  usec = monotime_diff_usec(&work->answered_at, &now);
+  if (usec <= 0)
+    bucket = 0;
+  else
+    bucket = tor_log2((uint64_t) usec) + 1;
+  bucket = MIN(bucket, REPLYQUEUE_LATENCY_BUCKETS - 1);
+  ++queue->stats.latency_hist[bucket];
+  ++queue->stats.n_replies;
+}
+
+/** Run the reply function for <b>work</b> and free it. */
+static void
+replyqueue_handle_reply(replyqueue_t *queue, workqueue_entry_t *work)
+{
+  replyqueue_note_reply(queue, work);
+  work->on_pool = NULL;
+
+  work->reply_fn(work->arg);
+  workqueue_entry_free(work);
+}
+
+/** Handle up to queue->max_batch pending replies on <b>queue</b>, and
+ * return the number that we handled.  If we had to leave some for later,
+ * make sure that the queue's socket stays readable.  If <b>hold_alerts</b>
+ * is true, keep asking the workers not to alert us. */
+static int
+replyqueue_process_batch(replyqueue_t *queue, int hold_alerts)
 {
+  workqueue_entry_t *work;
+  int i, n_rings, n_handled = 0, n_idle_rings = 0;
+  const int max = queue->max_batch ? queue->max_batch : INT_MAX;
   int r = queue->alert.drain_fn(queue->alert.read_fd);
   if (r < 0) {
     //LCOV_EXCL_START
@@ -655,20 +1056,101 @@ replyqueue_process(replyqueue_t *queue)
                    tor_socket_strerror(-r));
     //LCOV_EXCL_STOP
   }
+  /* We clear this after draining the alert and before looking for answers:
+   * any answer that we miss below will send a fresh alert. */
+  if (!hold_alerts)
+    atomic_counter_exchange(&queue->alert_pending, 0);
+  ++queue->stats.n_wakeups;
+
+  /* Take one answer from each ring in turn, so that every worker's answers
+   * get a fair share of the batch. */
+  n_rings = queue->n_rings;
+  i = queue->next_ring;
+  while (n_handled < max && n_rings && n_idle_rings < n_rings) {
+    if (i >= n_rings)
+      i = 0;
+    work = reply_ring_pop(queue->rings[i++]);
+    if (work) {
+      n_idle_rings = 0;
+      replyqueue_handle_reply(queue, work);
+      ++n_handled;
+    } else {
+      ++n_idle_rings;
+    }
+  }
+  queue->next_ring = i;
 
   tor_mutex_acquire(&queue->lock);
-  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
+  while (n_handled < max && !TOR_TAILQ_EMPTY(&queue->answers)) {
     /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
+    work = TOR_TAILQ_FIRST(&queue->answers);
     TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
     tor_mutex_release(&queue->lock);
-    work->on_pool = NULL;
 
-    work->reply_fn(work->arg);
-    workqueue_entry_free(work);
+    replyqueue_handle_reply(queue, work);
+    ++n_handled;
 
     tor_mutex_acquire(&queue->lock);
   }
-
   tor_mutex_release(&queue->lock);
+
+  if (n_handled >= max) {
+    /* There may be more: alert ourselves, so that we come back for them
+     * after the main loop has had a chance to do other things. */
+    ++queue->stats.n_full_batches;
+    if (atomic_counter_exchange(&queue->alert_pending, 1) == 0 ||
+        hold_alerts) {
+      if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
+        /* XXXX complain! */
+      }
+    }
+  }
+
+  return n_handled;
+}
+
+/**
+ * Process pending replies on a reply queue: all of them, or as many as
+ * replyqueue_set_max_batch() allows. The main thread should call this
+ * function every time the socket returned by replyqueue_get_socket() is
+ * readable.
+ */
+void
+replyqueue_process(replyqueue_t *queue)
+{
+  (void) replyqueue_process_batch(queue, 0);
+}
+
+/** Set *<b>out</b> to the statistics that <b>queue</b> has collected so
+ * far. */
+void
+replyqueue_get_stats(replyqueue_t *queue, replyqueue_stats_t *out)
+{
+  memcpy(out, &queue->stats, sizeof(*out));
+  out->n_alerts = atomic_counter_get(&queue->n_alerts);
+  out->n_overflows = atomic_counter_get(&queue->n_overflows);
+}
+
+/** Return an upper bound, in microseconds, on the reply latency of the
+ * fastest <b>frac</b> (between 0 and 1) of the replies counted in
+ * <b>stats</b>.  Return 0 if there are no replies.  Latencies in the
+ * slowest bucket are reported as that bucket's lower bound. */
+uint64_t
+replyqueue_stats_latency_usec(const replyqueue_stats_t *stats, double frac)
+{
+  uint64_t total = 0, target, seen = 0;
+  int i;
+  for (i = 0; i < REPLYQUEUE_LATENCY_BUCKETS; ++i)
+    total += stats->latency_hist[i];
+  if (total == 0)
+    return 0;
+  target = (uint64_t) (frac * (double) total);
+  if (target >= total)
+    target = total - 1;
+  for (i = 0; i < REPLYQUEUE_LATENCY_BUCKETS - 1; ++i) {
+    seen += stats->latency_hist[i];
+    if (seen > target)
+      return UINT64_C(1) << i;
+  }
+  return UINT64_C(1) << (REPLYQUEUE_LATENCY_BUCKETS - 2);
 }
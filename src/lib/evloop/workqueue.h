@@ -62,6 +62,39 @@ replyqueue_t *threadpool_get_replyqueue(threadpool_t *tp);
 
 replyqueue_t *replyqueue_new(uint32_t alertsocks_flags);
 void replyqueue_process(replyqueue_t *queue);
+void replyqueue_set_max_batch(replyqueue_t *queue, int max_batch);
+void threadpool_set_reply_coalesce_usec(threadpool_t *tp, uint32_t usec);
+uint64_t threadpool_get_n_stolen(threadpool_t *tp);
+
+/** Number of buckets in a reply latency histogram.  Bucket 0 counts replies
+ * that the main thread handled less than 1 usec after a worker queued them;
+ * bucket <b>i</b> counts those handled between 2^(i-1) and 2^i usec after;
+ * and the last bucket counts all the slower ones. */
+#define REPLYQUEUE_LATENCY_BUCKETS 24
+
+/** Statistics about how a reply queue has woken up the main thread, and how
+ * long replies have waited on it. */
+typedef struct replyqueue_stats_t {
+  /** Number of times a worker has alerted the main thread. */
+  uint64_t n_alerts;
+  /** Number of times the main thread has looked for replies. */
+  uint64_t n_wakeups;
+  /** Number of times the main thread stopped at its batch limit, and left
+   * replies for later. */
+  uint64_t n_full_batches;
+  /** Number of replies that the main thread has handled. */
+  uint64_t n_replies;
+  /** Number of replies that didn't fit on their worker's reply ring, and
+   * went on the shared list instead. */
+  uint64_t n_overflows;
+  /** Histogram of how long replies waited for the main thread; see
+   * REPLYQUEUE_LATENCY_BUCKETS. */
+  uint64_t latency_hist[REPLYQUEUE_LATENCY_BUCKETS];
+} replyqueue_stats_t;
+
+void replyqueue_get_stats(replyqueue_t *queue, replyqueue_stats_t *out);
+uint64_t replyqueue_stats_latency_usec(const replyqueue_stats_t *stats,
+                                       double frac);
 
 int threadpool_register_reply_event(threadpool_t *tp,
                                     void (*cb)(threadpool_t *tp));
@@ -0,0 +1,370 @@
+/* Copyright (c) 2007-2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file mempool.c
+ * \brief A pooling allocator for large numbers of same-sized objects.
+ *
+ * Some objects (like cells) are allocated and freed millions of times a
+ * minute on a busy relay.  Handing each one to malloc() and back costs
+ * allocator time and tends to fragment the heap.  Instead, an mp_pool_t
+ * carves same-sized items out of large chunks that it maps directly from
+ * the OS, and keeps released items on a per-chunk freelist so that they can
+ * be handed out again right away.
+ *
+ * Every item starts on a cache-line boundary, and is preceded by a small
+ * header that remembers which chunk it came from, so mp_pool_release() only
+ * needs the item itself.  The header lives in the last bytes of the
+ * previous item's slot (or of the chunk header, for the first item), so
+ * that it doesn't push the item off the boundary.
+ *
+ * A pool keeps its chunks on three lists: chunks with no items in use,
+ * chunks with some items in use, and chunks that are full.  We always
+ * allocate from a partly-used chunk if we can, so that the empty chunks stay
+ * empty: mp_pool_clean() then unmaps them, which actually gives the memory
+ * back to the OS.
+ *
+ * Pools are not thread-safe: only use a given pool from one thread at a
+ * time.
+ **/
+
+#include "orconfig.h"
+#include "lib/malloc/mempool.h"
+#include "lib/malloc/map_anon.h"
+#include "lib/cc/ctassert.h"
+#include "lib/err/torerr.h"
+
+#include <string.h>
+
+/** Every item in a pool is aligned to this many bytes: the size of a cache
+ * line on all the platforms we care about. */
+#define MP_ITEM_ALIGNMENT 64
+/** Number of bytes of header before each item that we hand out.  Items
+ * that come from the heap are only aligned to this. */
+#define MP_ITEM_HEADER_SIZE 16
+
+/** Round <b>n</b> up to the next multiple of <b>align</b>, which must be a
+ * power of two. */
+#define MP_ROUND_UP(n, align) (((n) + (align) - 1) & ~((size_t)(align) - 1))
+
+typedef struct mp_chunk_t mp_chunk_t;
+
+/** The header that precedes each item in a pool. */
+typedef union mp_item_header_t {
+  struct {
+    /** The chunk that holds this item, or NULL if this item was allocated
+     * from the heap by mp_pool_get_sized(). */
+    mp_chunk_t *chunk;
+    /** If this item is on its chunk's freelist, the next item on the
+     * freelist. */
+    union mp_item_header_t *next_free;
+  } h;
+  char pad_[MP_ITEM_HEADER_SIZE];
+} mp_item_header_t;
+
+CTASSERT(sizeof(mp_item_header_t) == MP_ITEM_HEADER_SIZE);
+
+/** A single mapped chunk of memory, holding many items. */
+struct mp_chunk_t {
+  /** Next and previous chunks in whichever of the pool's lists holds this
+   * chunk. */
+  mp_chunk_t *next, *prev;
+  /** The pool that owns this chunk. */
+  mp_pool_t *pool;
+  /** Released items in this chunk, most recently released first. */
+  mp_item_header_t *first_free;
+  /** Number of items in this chunk that are in use. */
+  int n_allocated;
+  /** Index of the first item in this chunk that we have never handed out.
+   * Everything from here on is untouched, and not on the freelist. */
+  int next_unused;
+  /** Address of the first item in this chunk.  Its header is just
+   * before it. */
+  char *mem;
+};
+
+/** A pool of same-sized items. */
+struct mp_pool_t {
+  /** Chunks with no items in use. */
+  mp_chunk_t *empty_chunks;
+  /** Chunks with some items in use, and some free. */
+  mp_chunk_t *used_chunks;
+  /** Chunks with every item in use. */
+  mp_chunk_t *full_chunks;
+  /** Number of chunks in <b>empty_chunks</b>. */
+  int n_empty_chunks;
+  /** The smallest that <b>n_empty_chunks</b> has been since the last
+   * mp_pool_clean(): that many empty chunks weren't needed at all. */
+  int min_empty_chunks;
+  /** Total number of chunks in this pool. */
+  int n_chunks;
+  /** Number of items per chunk. */
+  int items_per_chunk;
+  /** Number of items that are in use. */
+  size_t n_items_used;
+  /** Size of the items we hand out, as requested by our creator. */
+  size_t item_size;
+  /** Distance between consecutive items in a chunk, including headers and
+   * padding: see mp_pool_item_cost(). */
+  size_t item_stride;
+  /** Number of bytes that we map for each chunk. */
+  size_t chunk_size;
+};
+
+/** Number of bytes at the start of each chunk before its first item: enough
+ * for the mp_chunk_t and the first item's header. */
+#define MP_CHUNK_HEADER_LEN \
+  MP_ROUND_UP(sizeof(mp_chunk_t) + MP_ITEM_HEADER_SIZE, MP_ITEM_ALIGNMENT)
+
+/** Add <b>chunk</b> to the front of the list at *<b>list</b>. */
+static void
+mp_chunk_list_add(mp_chunk_t **list, mp_chunk_t *chunk)
+{
+  chunk->prev = NULL;
+  chunk->next = *list;
+  if (*list)
+    (*list)->prev = chunk;
+  *list = chunk;
+}
+
+/** Remove <b>chunk</b> from the list at *<b>list</b>. */
+static void
+mp_chunk_list_remove(mp_chunk_t **list, mp_chunk_t *chunk)
+{
+  if (chunk->prev)
+    chunk->prev->next = chunk->next;
+  else
+    *list = chunk->next;
+  if (chunk->next)
+    chunk->next->prev = chunk->prev;
+  chunk->next = chunk->prev = NULL;
+}
+
+/** Map and return a new empty chunk for <b>pool</b>. */
+static mp_chunk_t *
+mp_chunk_new(mp_pool_t *pool)
+{
+  mp_chunk_t *chunk = tor_mmap_anonymous(pool->chunk_size, 0, NULL);
+  memset(chunk, 0, sizeof(*chunk));
+  chunk->pool = pool;
+  chunk->mem = ((char *) chunk) + MP_CHUNK_HEADER_LEN;
+  ++pool->n_chunks;
+  return chunk;
+}
+
+/** Give the memory for <b>chunk</b> back to the OS. */
+static void
+mp_chunk_free(mp_chunk_t *chunk)
+{
+  mp_pool_t *pool = chunk->pool;
+  --pool->n_chunks;
+  tor_munmap_anonymous(chunk, pool->chunk_size);
+}
+
+/** Return the number of bytes that a pool uses for each item of
+ * <b>item_size</b> bytes, including our header and padding.  This is what
+ * callers should count against their memory limits. */
+size_t
+mp_pool_item_cost(size_t item_size)
+{
+  /* Each item's header goes at the end of the previous slot, so a slot
+   * needs room for both. */
+  return MP_ROUND_UP(item_size + MP_ITEM_HEADER_SIZE, MP_ITEM_ALIGNMENT);
+}
+
+/** Create and return a new pool for items of <b>item_size</b> bytes each,
+ * mapping memory from the OS <b>chunk_size</b> bytes at a time.
+ * <b>chunk_size</b> is rounded up if it is too small to hold a reasonable
+ * number of items. */
+mp_pool_t *
+mp_pool_new(size_t item_size, size_t chunk_size)
+{
+  mp_pool_t *pool = tor_malloc_zero(sizeof(mp_pool_t));
+  size_t header_len = MP_CHUNK_HEADER_LEN;
+
+  raw_assert(item_size > 0);
+  raw_assert(item_size < (1u<<24));
+
+  pool->item_size = item_size;
+  pool->item_stride = mp_pool_item_cost(item_size);
+  /* Hold at least 8 items per chunk; fewer makes the chunk bookkeeping
+   * pointless. */
+  if (chunk_size < header_len + 8 * pool->item_stride)
+    chunk_size = header_len + 8 * pool->item_stride;
+  pool->chunk_size = MP_ROUND_UP(chunk_size, 4096);
+  pool->items_per_chunk =
+    (int) ((pool->chunk_size - header_len) / pool->item_stride);
+
+  return pool;
+}
+
+/** Return a new item from <b>pool</b>.  The item is not zeroed.  Release it
+ * with mp_pool_release(). */
+void *
+mp_pool_get(mp_pool_t *pool)
+{
+  mp_chunk_t *chunk;
+  mp_item_header_t *item;
+
+  raw_assert(pool);
+
+  if (pool->used_chunks) {
+    chunk = pool->used_chunks;
+  } else {
+    if (pool->empty_chunks) {
+      chunk = pool->empty_chunks;
+      mp_chunk_list_remove(&pool->empty_chunks, chunk);
+      if (--pool->n_empty_chunks < pool->min_empty_chunks)
+        pool->min_empty_chunks = pool->n_empty_chunks;
+    } else {
+      chunk = mp_chunk_new(pool);
+    }
+    mp_chunk_list_add(&pool->used_chunks, chunk);
+  }
+
+  if (chunk->first_free) {
+    item = chunk->first_free;
+    chunk->first_free = item->h.next_free;
+  } else {
+    raw_assert(chunk->next_unused < pool->items_per_chunk);
+    item = (mp_item_header_t *)
+      (chunk->mem + pool->item_stride * chunk->next_unused++ -
+       MP_ITEM_HEADER_SIZE);
+    item->h.chunk = chunk;
+  }
+  item->h.next_free = NULL;
+
+  ++pool->n_items_used;
+  if (++chunk->n_allocated == pool->items_per_chunk) {
+    mp_chunk_list_remove(&pool->used_chunks, chunk);
+    mp_chunk_list_add(&pool->full_chunks, chunk);
+  }
+
+  return ((char *) item) + MP_ITEM_HEADER_SIZE;
+}
+
+/** Return a new item of at least <b>sz</b> bytes.  If it fits, take it from
+ * <b>pool</b>; otherwise, take it from the heap.  Either way, the item is
+ * not zeroed, and must be released with mp_pool_release(). */
+void *
+mp_pool_get_sized(mp_pool_t *pool, size_t sz)
+{
+  mp_item_header_t *item;
+
+  if (sz <= pool->item_size)
+    return mp_pool_get(pool);
+
+  item = tor_malloc(MP_ITEM_HEADER_SIZE + sz);
+  item->h.chunk = NULL;
+  item->h.next_free = NULL;
+  return ((char *) item) + MP_ITEM_HEADER_SIZE;
+}
+
+/** Release <b>ptr</b>, which must have come from mp_pool_get() or
+ * mp_pool_get_sized(), so that its pool can hand it out again. */
+void
+mp_pool_release(void *ptr)
+{
+  mp_item_header_t *item;
+  mp_chunk_t *chunk;
+  mp_pool_t *pool;
+
+  if (!ptr)
+    return;
+
+  item = (mp_item_header_t *) (((char *) ptr) - MP_ITEM_HEADER_SIZE);
+  chunk = item->h.chunk;
+  if (!chunk) {
+    tor_free_(item);
+    return;
+  }
+  pool = chunk->pool;
+  raw_assert(chunk->n_allocated > 0);
+
+  if (chunk->n_allocated == pool->items_per_chunk) {
+    mp_chunk_list_remove(&pool->full_chunks, chunk);
+    mp_chunk_list_add(&pool->used_chunks, chunk);
+  }
+
+  item->h.next_free = chunk->first_free;
+  chunk->first_free = item;
+  --pool->n_items_used;
+
+  if (--chunk->n_allocated == 0) {
+    /* Forget the freelist: the next user will start from the beginning of
+     * the chunk again, and we don't touch pages we don't need. */
+    chunk->first_free = NULL;
+    chunk->next_unused = 0;
+    mp_chunk_list_remove(&pool->used_chunks, chunk);
+    mp_chunk_list_add(&pool->empty_chunks, chunk);
+    ++pool->n_empty_chunks;
+  }
+}
+
+/** Give the memory for empty chunks in <b>pool</b> back to the OS, keeping
+ * at most <b>n_to_keep</b> empty chunks around for future allocations.  If
+ * <b>keep_recently_used</b> is true, also keep every chunk that has been
+ * used since the last time we cleaned this pool: we only release chunks
+ * that have sat empty for the whole interval. */
+void
+mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used)
+{
+  raw_assert(pool);
+  raw_assert(n_to_keep >= 0);
+
+  if (keep_recently_used) {
+    int n_recently_used = pool->n_empty_chunks - pool->min_empty_chunks;
+    if (n_to_keep < n_recently_used)
+      n_to_keep = n_recently_used;
+  }
+
+  while (pool->n_empty_chunks > n_to_keep) {
+    mp_chunk_t *chunk = pool->empty_chunks;
+    mp_chunk_list_remove(&pool->empty_chunks, chunk);
+    --pool->n_empty_chunks;
+    mp_chunk_free(chunk);
+  }
+
+  pool->min_empty_chunks = pool->n_empty_chunks;
+}
+
+/** Set *<b>stats_out</b> to the current occupancy of <b>pool</b>. */
+void
+mp_pool_get_stats(const mp_pool_t *pool, mp_pool_stats_t *stats_out)
+{
+  raw_assert(pool);
+  raw_assert(stats_out);
+
+  memset(stats_out, 0, sizeof(*stats_out));
+  stats_out->item_cost = pool->item_stride;
+  stats_out->n_items_used = pool->n_items_used;
+  stats_out->n_items_free =
+    ((size_t) pool->n_chunks) * pool->items_per_chunk - pool->n_items_used;
+  stats_out->n_chunks = pool->n_chunks;
+  stats_out->n_empty_chunks = pool->n_empty_chunks;
+  stats_out->n_bytes_mapped = ((size_t) pool->n_chunks) * pool->chunk_size;
+}
+
+/** Free every chunk in the list at <b>chunk</b>. */
+static void
+mp_chunk_list_free_all(mp_chunk_t *chunk)
+{
+  while (chunk) {
+    mp_chunk_t *next = chunk->next;
+    mp_chunk_free(chunk);
+    chunk = next;
+  }
+}
+
+/** Release all storage held by <b>pool</b>, including any items that are
+ * still in use. */
+void
+mp_pool_destroy_(mp_pool_t *pool)
+{
+  if (!pool)
+    return;
+  mp_chunk_list_free_all(pool->empty_chunks);
+  mp_chunk_list_free_all(pool->used_chunks);
+  mp_chunk_list_free_all(pool->full_chunks);
+  tor_free(pool);
+}
@@ -0,0 +1,46 @@
+/* Copyright (c) 2007-2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file mempool.h
+ * \brief Headers for mempool.c
+ **/
+
+#ifndef TOR_MEMPOOL_H
+#define TOR_MEMPOOL_H
+
+#include "lib/malloc/malloc.h"
+#include <stddef.h>
+
+/** A pool of fixed-size items, carved out of larger chunks. */
+typedef struct mp_pool_t mp_pool_t;
+
+/** Occupancy statistics for an mp_pool_t. */
+typedef struct mp_pool_stats_t {
+  /** Number of bytes that each item takes up in the pool, including our
+   * header and padding. */
+  size_t item_cost;
+  /** Number of items that have been handed out and not yet released. */
+  size_t n_items_used;
+  /** Number of items that we could hand out without mapping a new chunk. */
+  size_t n_items_free;
+  /** Total number of chunks that we have mapped. */
+  size_t n_chunks;
+  /** Number of chunks that have no items in use. */
+  size_t n_empty_chunks;
+  /** Total number of bytes that we have mapped for this pool. */
+  size_t n_bytes_mapped;
+} mp_pool_stats_t;
+
+size_t mp_pool_item_cost(size_t item_size);
+mp_pool_t *mp_pool_new(size_t item_size, size_t chunk_size);
+void *mp_pool_get(mp_pool_t *pool);
+void *mp_pool_get_sized(mp_pool_t *pool, size_t sz);
+void mp_pool_release(void *item);
+void mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used);
+void mp_pool_get_stats(const mp_pool_t *pool, mp_pool_stats_t *stats_out);
+void mp_pool_destroy_(mp_pool_t *pool);
+#define mp_pool_destroy(pool) \
+  FREE_AND_NULL(mp_pool_t, mp_pool_destroy_, (pool))
+
+#endif /* !defined(TOR_MEMPOOL_H) */
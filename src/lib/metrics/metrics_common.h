@@ -28,6 +28,8 @@ typedef enum {
   METRICS_TYPE_COUNTER,
   /* Can go up or down. */
   METRICS_TYPE_GAUGE,
+  /* Count of observed values, in buckets. */
+  METRICS_TYPE_HISTOGRAM,
 } metrics_type_t;
 
 /** Metric counter object (METRICS_TYPE_COUNTER). */
@@ -40,6 +42,19 @@ typedef struct metrics_gauge_t {
   int64_t value;
 } metrics_gauge_t;
 
+/** Histogram. */
+typedef struct metrics_histogram_t {
+  /** Number of buckets, not counting the implicit +Inf bucket. */
+  size_t n_bounds;
+  /** Upper bound of each bucket, in increasing order. */
+  int64_t *bounds;
+  /** Number of observed values in each bucket, followed by the number of
+   * values above the last bound. These are not cumulative. */
+  uint64_t *counts;
+  /** Sum of all observed values. */
+  int64_t sum;
+} metrics_histogram_t;
+
 const char *metrics_type_to_str(const metrics_type_t type);
 
 #endif /* !defined(TOR_LIB_METRICS_METRICS_COMMON_H) */
@@ -0,0 +1,284 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file metrics_shard.c
+ * @brief Counters and histograms that any thread can update cheaply.
+ *
+ * A metrics_shard_set_t is an array of 64-bit counters ("slots"), split into
+ * one shard per thread. A thread only ever writes to its own shard, so
+ * updating a counter is a plain addition: no lock, no atomic
+ * read-modify-write, and no cache line bouncing between threads. The cost
+ * moves to the reader, who has to add up every shard; that only happens when
+ * someone asks for the metrics, which is rare.
+ *
+ * Readers do not synchronize with writers, so a value read while other
+ * threads are updating it may be slightly out of date. That is fine for
+ * metrics. Where we have lock-free 64-bit C11 atomics, each counter is read
+ * and written with relaxed atomic loads and stores, so that a reader never
+ * sees half of an update, even on 32-bit platforms. Without them, a reader on
+ * a 32-bit platform can see a torn value, which looks like a counter reset to
+ * whoever is scraping us; we accept that on such platforms.
+ **/
+
+#include "orconfig.h"
+
+#include "lib/lock/compat_mutex.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+#include "lib/thread/threads.h"
+
+#include "lib/metrics/metrics_shard.h"
+
+/** Size of a cache line, or an upper bound on it. We align each shard to
+ * this, and round its size up to a multiple of it, so that two threads
+ * never write to the same cache line. */
+#define METRICS_SHARD_CACHE_LINE 64
+
+/* We only use atomics where 64-bit ones don't need a lock, or a library we
+ * don't link against. */
+#if defined(HAVE_WORKING_STDATOMIC) && ATOMIC_LLONG_LOCK_FREE == 2
+#define METRICS_SHARD_ATOMIC
+#endif
+
+#ifdef METRICS_SHARD_ATOMIC
+/** A counter in a shard. */
+typedef atomic_ullong metrics_shard_slot_t;
+/** Return the value of the counter at <b>p</b>. */
+#define SLOT_LOAD(p) atomic_load_explicit((p), memory_order_relaxed)
+/** Set the counter at <b>p</b> to <b>v</b>. */
+#define SLOT_STORE(p, v) atomic_store_explicit((p), (v), memory_order_relaxed)
+#else
+typedef uint64_t metrics_shard_slot_t;
+#define SLOT_LOAD(p) (*(p))
+#define SLOT_STORE(p, v) (*(p) = (v))
+#endif /* defined(METRICS_SHARD_ATOMIC) */
+
+/** Index of the shard that the threads which don't get their own share. */
+#define METRICS_SHARD_SHARED (METRICS_SHARD_MAX - 1)
+
+struct metrics_shard_set_t {
+  /** Number of counters in each shard. */
+  unsigned n_slots;
+  /** Size of each shard, in bytes. */
+  size_t shard_size;
+  /** The shards, indexed by thread. A shard is only allocated once a thread
+   * that uses it writes to this set. Each one points into the matching
+   * element of <b>allocs</b>, aligned to a cache line. */
+  metrics_shard_slot_t *shards[METRICS_SHARD_MAX];
+  /** The memory we allocated for each shard, to free. */
+  void *allocs[METRICS_SHARD_MAX];
+};
+
+/** True iff we have set up metrics_shard_thread and metrics_shard_lock. */
+static int metrics_shard_initialized = 0;
+/** For each thread, one plus the index of its shard, or 0 if we haven't
+ * given it one yet. */
+static tor_threadlocal_t metrics_shard_thread;
+/** Lock held to hand out shard indices, to allocate shards, to read shards,
+ * and to write to the shared shard. */
+static tor_mutex_t metrics_shard_lock;
+/** Number of threads that have asked for a shard index so far. */
+static unsigned metrics_shard_n_threads = 0;
+
+/** Set up the state we need to give each thread its own shard. */
+static void
+metrics_shard_init(void)
+{
+  if (metrics_shard_initialized)
+    return;
+  tor_threadlocal_init(&metrics_shard_thread);
+  tor_mutex_init_nonrecursive(&metrics_shard_lock);
+  metrics_shard_initialized = 1;
+}
+
+/** Return the index of the shard that the current thread writes to. */
+static unsigned
+metrics_shard_thread_idx(void)
+{
+  void *p = tor_threadlocal_get(&metrics_shard_thread);
+  uintptr_t v = (uintptr_t) p;
+
+  if (PREDICT_UNLIKELY(v == 0)) {
+    tor_mutex_acquire(&metrics_shard_lock);
+    v = ++metrics_shard_n_threads;
+    tor_mutex_release(&metrics_shard_lock);
+    if (v > METRICS_SHARD_MAX)
+      v = METRICS_SHARD_MAX;
+    tor_threadlocal_set(&metrics_shard_thread, (void *) v);
+  }
+  return (unsigned) (v - 1);
+}
+
+/** Return the shard at index <b>idx</b> in <b>set</b>, allocating it if
+ * needed. The caller must hold metrics_shard_lock. */
+static metrics_shard_slot_t *
+metrics_shard_get_locked(metrics_shard_set_t *set, unsigned idx)
+{
+  if (set->shards[idx] == NULL) {
+    /* tor_malloc() doesn't promise more than the alignment of the largest
+     * basic type, so allocate an extra cache line and round up. */
+    uintptr_t p;
+    set->allocs[idx] = tor_malloc_zero(set->shard_size +
+                                       METRICS_SHARD_CACHE_LINE - 1);
+    p = (uintptr_t) set->allocs[idx];
+    p = (p + METRICS_SHARD_CACHE_LINE - 1) &
+      ~(uintptr_t) (METRICS_SHARD_CACHE_LINE - 1);
+    set->shards[idx] = (metrics_shard_slot_t *) p;
+  }
+  return set->shards[idx];
+}
+
+/** Return the shard at index <b>idx</b> in <b>set</b>, allocating it if
+ * needed. Only the thread that owns this shard may call this. */
+static metrics_shard_slot_t *
+metrics_shard_get(metrics_shard_set_t *set, unsigned idx)
+{
+  metrics_shard_slot_t *shard = set->shards[idx];
+
+  if (PREDICT_UNLIKELY(shard == NULL)) {
+    tor_mutex_acquire(&metrics_shard_lock);
+    shard = metrics_shard_get_locked(set, idx);
+    tor_mutex_release(&metrics_shard_lock);
+  }
+  return shard;
+}
+
+/** Add <b>n</b> to the counter at <b>p</b>, which only we write to. */
+static inline void
+metrics_shard_slot_add(metrics_shard_slot_t *p, uint64_t n)
+{
+  SLOT_STORE(p, SLOT_LOAD(p) + n);
+}
+
+/** Return a newly allocated shard set with <b>n_slots</b> counters, all
+ * set to 0.
+ *
+ * This must first be called from the main thread, before any other thread
+ * uses a shard set. */
+metrics_shard_set_t *
+metrics_shard_set_new(unsigned n_slots)
+{
+  metrics_shard_set_t *set = tor_malloc_zero(sizeof(*set));
+  size_t size = n_slots * sizeof(metrics_shard_slot_t);
+
+  metrics_shard_init();
+
+  set->n_slots = n_slots;
+  set->shard_size = METRICS_SHARD_CACHE_LINE *
+    ((size + METRICS_SHARD_CACHE_LINE - 1) / METRICS_SHARD_CACHE_LINE);
+  if (set->shard_size == 0)
+    set->shard_size = METRICS_SHARD_CACHE_LINE;
+  return set;
+}
+
+/** Free a shard set. No other thread may be using it. */
+void
+metrics_shard_set_free_(metrics_shard_set_t *set)
+{
+  if (!set)
+    return;
+  for (unsigned i = 0; i < METRICS_SHARD_MAX; ++i)
+    tor_free(set->allocs[i]);
+  tor_free(set);
+}
+
+/** Add <b>n</b> to the counter at index <b>slot</b> in <b>set</b>. */
+void
+metrics_shard_set_add(metrics_shard_set_t *set, unsigned slot, uint64_t n)
+{
+  unsigned idx;
+
+  if (BUG(slot >= set->n_slots))
+    return;
+
+  idx = metrics_shard_thread_idx();
+  if (PREDICT_LIKELY(idx != METRICS_SHARD_SHARED)) {
+    metrics_shard_slot_add(&metrics_shard_get(set, idx)[slot], n);
+  } else {
+    /* Several threads write to this one, so they take turns. */
+    tor_mutex_acquire(&metrics_shard_lock);
+    metrics_shard_slot_add(&metrics_shard_get_locked(set, idx)[slot], n);
+    tor_mutex_release(&metrics_shard_lock);
+  }
+}
+
+/** Return the value of the counter at index <b>slot</b> in <b>set</b>,
+ * summed over all threads. */
+uint64_t
+metrics_shard_set_get(const metrics_shard_set_t *set, unsigned slot)
+{
+  uint64_t total = 0;
+
+  if (BUG(slot >= set->n_slots))
+    return 0;
+
+  tor_mutex_acquire(&metrics_shard_lock);
+  for (unsigned i = 0; i < METRICS_SHARD_MAX; ++i) {
+    if (set->shards[i])
+      total += SLOT_LOAD(&set->shards[i][slot]);
+  }
+  tor_mutex_release(&metrics_shard_lock);
+  return total;
+}
+
+/** Set every counter in <b>set</b> back to 0. Other threads must not be
+ * updating it. */
+void
+metrics_shard_set_reset(metrics_shard_set_t *set)
+{
+  tor_mutex_acquire(&metrics_shard_lock);
+  for (unsigned i = 0; i < METRICS_SHARD_MAX; ++i) {
+    if (!set->shards[i])
+      continue;
+    for (unsigned slot = 0; slot < set->n_slots; ++slot)
+      SLOT_STORE(&set->shards[i][slot], 0);
+  }
+  tor_mutex_release(&metrics_shard_lock);
+}
+
+/** Record <b>value</b> in the histogram <b>hist</b> of <b>set</b>. */
+void
+metrics_shard_histogram_observe(metrics_shard_set_t *set,
+                                const metrics_shard_histogram_t *hist,
+                                int64_t value)
+{
+  size_t bucket = 0;
+
+  while (bucket < hist->n_bounds && value > hist->bounds[bucket])
+    ++bucket;
+
+  metrics_shard_set_add(set, hist->first_slot + (unsigned) bucket, 1);
+  metrics_shard_set_add(set, hist->first_slot + (unsigned) hist->n_bounds + 1,
+                        (uint64_t) value);
+}
+
+/** Set <b>counts_out</b>, which must have room for
+ * <b>hist</b>-&gt;n_bounds + 1 values, to the number of values in each
+ * bucket of the histogram <b>hist</b> of <b>set</b>, and
+ * *<b>sum_out</b> to their sum. The counts are not cumulative. */
+void
+metrics_shard_histogram_get(const metrics_shard_set_t *set,
+                            const metrics_shard_histogram_t *hist,
+                            uint64_t *counts_out, int64_t *sum_out)
+{
+  for (size_t i = 0; i <= hist->n_bounds; ++i)
+    counts_out[i] = metrics_shard_set_get(set,
+                                          hist->first_slot + (unsigned) i);
+  *sum_out = (int64_t)
+    metrics_shard_set_get(set, hist->first_slot + (unsigned) hist->n_bounds
+                          + 1);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the shard at index <b>idx</b> in <b>set</b>, or NULL if no thread
+ * has written to it yet. */
+const void *
+metrics_shard_set_get_shard_for_testing(const metrics_shard_set_t *set,
+                                        unsigned idx)
+{
+  if (BUG(idx >= METRICS_SHARD_MAX))
+    return NULL;
+  return set->shards[idx];
+}
+#endif /* defined(TOR_UNIT_TESTS) */
@@ -0,0 +1,64 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * @file metrics_shard.h
+ * @brief Header for lib/metrics/metrics_shard.c
+ **/
+
+#ifndef TOR_LIB_METRICS_METRICS_SHARD_H
+#define TOR_LIB_METRICS_METRICS_SHARD_H
+
+#include <stddef.h>
+
+#include "lib/cc/torint.h"
+#include "lib/malloc/malloc.h"
+
+/** Number of shards in a metrics_shard_set_t. Each of the first
+ * METRICS_SHARD_MAX - 1 threads to touch a shard set gets a shard of its
+ * own; any threads after that share the last one. */
+#define METRICS_SHARD_MAX 64
+
+typedef struct metrics_shard_set_t metrics_shard_set_t;
+
+/** A histogram kept in a metrics_shard_set_t. It uses
+ * METRICS_SHARD_HISTOGRAM_N_SLOTS(n_bounds) consecutive slots starting at
+ * <b>first_slot</b>: one per bucket, one for the values above the last
+ * bound, and one for the sum of all values. */
+typedef struct metrics_shard_histogram_t {
+  /** Index of the first slot used by this histogram. */
+  unsigned first_slot;
+  /** Number of buckets, not counting the implicit +Inf bucket. */
+  size_t n_bounds;
+  /** Upper bound of each bucket, in increasing order. */
+  const int64_t *bounds;
+} metrics_shard_histogram_t;
+
+/** Number of slots used by a histogram with <b>n_bounds</b> buckets. */
+#define METRICS_SHARD_HISTOGRAM_N_SLOTS(n_bounds) ((n_bounds) + 2)
+
+metrics_shard_set_t *metrics_shard_set_new(unsigned n_slots);
+void metrics_shard_set_free_(metrics_shard_set_t *set);
+#define metrics_shard_set_free(set) \
+  FREE_AND_NULL(metrics_shard_set_t, metrics_shard_set_free_, (set))
+
+void metrics_shard_set_add(metrics_shard_set_t *set, unsigned slot,
+                           uint64_t n);
+uint64_t metrics_shard_set_get(const metrics_shard_set_t *set,
+                               unsigned slot);
+void metrics_shard_set_reset(metrics_shard_set_t *set);
+
+void metrics_shard_histogram_observe(metrics_shard_set_t *set,
+                                     const metrics_shard_histogram_t *hist,
+                                     int64_t value);
+void metrics_shard_histogram_get(const metrics_shard_set_t *set,
+                                 const metrics_shard_histogram_t *hist,
+                                 uint64_t *counts_out, int64_t *sum_out);
+
+#ifdef TOR_UNIT_TESTS
+const void *metrics_shard_set_get_shard_for_testing(
+                                          const metrics_shard_set_t *set,
+                                          unsigned idx);
+#endif
+
+#endif /* !defined(TOR_LIB_METRICS_METRICS_SHARD_H) */
@@ -50,6 +50,10 @@ metrics_store_entry_free_(metrics_store_entry_t *entry)
   }
   SMARTLIST_FOREACH(entry->labels, char *, l, tor_free(l));
   smartlist_free(entry->labels);
+  if (entry->type == METRICS_TYPE_HISTOGRAM) {
+    tor_free(entry->u.histogram.bounds);
+    tor_free(entry->u.histogram.counts);
+  }
   tor_free(entry->name);
   tor_free(entry->help);
   tor_free(entry);
@@ -73,15 +77,51 @@ metrics_store_entry_update(metrics_store_entry_t *entry, const int64_t value)
     /* Gauge can increment or decrement. And can be positive or negative. */
     entry->u.gauge.value += value;
     break;
+  case METRICS_TYPE_HISTOGRAM:
+    /* Use metrics_store_entry_set_histogram() instead. */
+    tor_assert_nonfatal_unreached();
+    break;
   }
 }
 
+/** Set the content of a histogram store entry: <b>n_bounds</b> bucket upper
+ * bounds from <b>bounds</b>, <b>n_bounds</b> + 1 bucket counts from
+ * <b>counts</b> (the last one being the +Inf bucket) and the <b>sum</b> of
+ * all observed values. The arrays are copied. */
+void
+metrics_store_entry_set_histogram(metrics_store_entry_t *entry,
+                                  size_t n_bounds, const int64_t *bounds,
+                                  const uint64_t *counts, int64_t sum)
+{
+  metrics_histogram_t *hist;
+
+  tor_assert(entry);
+  tor_assert(entry->type == METRICS_TYPE_HISTOGRAM);
+  tor_assert(bounds);
+  tor_assert(counts);
+
+  hist = &entry->u.histogram;
+  tor_free(hist->bounds);
+  tor_free(hist->counts);
+  hist->n_bounds = n_bounds;
+  hist->bounds = tor_memdup(bounds, n_bounds * sizeof(*bounds));
+  hist->counts = tor_memdup(counts, (n_bounds + 1) * sizeof(*counts));
+  hist->sum = sum;
+}
+
 /** Reset a store entry that is set its metric data to 0. */
 void
 metrics_store_entry_reset(metrics_store_entry_t *entry)
 {
   tor_assert(entry);
   /* Everything back to 0. */
+  if (entry->type == METRICS_TYPE_HISTOGRAM) {
+    metrics_histogram_t *hist = &entry->u.histogram;
+    if (hist->counts)
+      memset(hist->counts, 0, (hist->n_bounds + 1) * sizeof(*hist->counts));
+    hist->sum = 0;
+    return;
+  }
   memset(&entry->u, 0, sizeof(entry->u));
 }
 
@@ -99,6 +139,14 @@ metrics_store_entry_get_value(const metrics_store_entry_t *entry)
     return entry->u.counter.value;
   case METRICS_TYPE_GAUGE:
     return entry->u.gauge.value;
+  case METRICS_TYPE_HISTOGRAM: {
+    /* The value of a histogram is the number of observed values. */
+    const metrics_histogram_t *hist = &entry->u.histogram;
+    uint64_t total = 0;
+    for (size_t i = 0; hist->counts && i <= hist->n_bounds; ++i)
+      total += hist->counts[i];
+    return (total > INT64_MAX) ? INT64_MAX : (int64_t) total;
+  }
   }
 
   // LCOV_EXCL_START
@@ -37,6 +37,7 @@ struct metrics_store_entry_t {
   union {
     metrics_counter_t counter;
     metrics_gauge_t gauge;
+    metrics_histogram_t histogram;
   } u;
 };
 
@@ -64,5 +65,10 @@ void metrics_store_entry_add_label(metrics_store_entry_t *entry,
 void metrics_store_entry_reset(metrics_store_entry_t *entry);
 void metrics_store_entry_update(metrics_store_entry_t *entry,
                                 const int64_t value);
+void metrics_store_entry_set_histogram(metrics_store_entry_t *entry,
+                                       size_t n_bounds,
+                                       const int64_t *bounds,
+                                       const uint64_t *counts,
+                                       int64_t sum);
 
 #endif /* !defined(TOR_LIB_METRICS_METRICS_STORE_ENTRY_H) */
@@ -40,6 +40,39 @@ format_labels(smartlist_t *labels)
   return buf;
 }
 
+/** Format the buckets, sum and count of the histogram entry in to the
+ * buffer data. Prometheus wants cumulative bucket counts, each labeled with
+ * its upper bound. */
+static void
+format_histogram(const metrics_store_entry_t *entry, buf_t *data)
+{
+  const metrics_histogram_t *hist = &entry->u.histogram;
+  smartlist_t *labels = smartlist_new();
+  uint64_t cumulative = 0;
+  char le[32];
+
+  smartlist_add_all(labels, entry->labels);
+  smartlist_add(labels, le);
+  for (size_t i = 0; i <= hist->n_bounds; ++i) {
+    if (i < hist->n_bounds) {
+      tor_snprintf(le, sizeof(le), "le=%" PRIi64, hist->bounds[i]);
+    } else {
+      tor_snprintf(le, sizeof(le), "le=+Inf");
+    }
+    if (hist->counts) {
+      cumulative += hist->counts[i];
+    }
+    buf_add_printf(data, "%s_bucket%s %" PRIu64 "\n", entry->name,
+                   format_labels(labels), cumulative);
+  }
+  smartlist_free(labels);
+
+  buf_add_printf(data, "%s_sum%s %" PRIi64 "\n", entry->name,
+                 format_labels(entry->labels), hist->sum);
+  buf_add_printf(data, "%s_count%s %" PRIu64 "\n", entry->name,
+                 format_labels(entry->labels), cumulative);
+}
+
 /** Format the given entry in to the buffer data. */
 void
 prometheus_format_store_entry(const metrics_store_entry_t *entry, buf_t *data)
@@ -50,6 +83,10 @@ prometheus_format_store_entry(const metrics_store_entry_t *entry, buf_t *data)
   buf_add_printf(data, "# HELP %s %s\n", entry->name, entry->help);
   buf_add_printf(data, "# TYPE %s %s\n", entry->name,
                  metrics_type_to_str(entry->type));
+  if (entry->type == METRICS_TYPE_HISTOGRAM) {
+    format_histogram(entry, data);
+    return;
+  }
   buf_add_printf(data, "%s%s %" PRIi64 "\n", entry->name,
                  format_labels(entry->labels),
                  metrics_store_entry_get_value(entry));
@@ -22,10 +22,23 @@
 
 #include <stdlib.h>
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && defined(HAVE_WRITEV) \
+  && !defined(_WIN32)
+/** Defined if we can fill and drain several chunks of a buffer at once with
+ * readv() and writev(). */
+#define USE_IOVEC_IO
+/** Largest number of chunks that we fill or drain with a single readv() or
+ * writev() call. */
+#define BUF_MAX_IOV 16
+#endif /* defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && ... */
+
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
  * <b>buf</b> is well-formed. */
@@ -81,6 +94,42 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   }
 }
 
+#ifdef USE_IOVEC_IO
+/** Read from the file descriptor <b>fd</b> into the <b>n_iov</b> regions of
+ * free space in <b>buf</b> described by <b>iov</b>, with a single readv()
+ * call, and add what we read to <b>buf</b>.  If we get an EOF, set
+ * *<b>reached_eof</b> to 1.  Return -1 on error (and set *<b>error</b> to
+ * errno), 0 on eof or blocking, and the number of bytes read otherwise. */
+static inline int
+read_to_iov(buf_t *buf, const struct iovec *iov, int n_iov, tor_socket_t fd,
+            int *reached_eof, int *error)
+{
+  ssize_t read_result = readv(fd, iov, n_iov);
+
+  if (read_result < 0) {
+    int e = errno;
+    buf_commit_space_iov(buf, iov, n_iov, 0);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      if (error)
+        *error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    buf_commit_space_iov(buf, iov, n_iov, 0);
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    buf_commit_space_iov(buf, iov, n_iov, read_result);
+    log_debug(LD_NET,"Read %ld bytes into %d chunks. %d on inbuf.",
+              (long)read_result, n_iov, (int)buf->datalen);
+    tor_assert(read_result <= BUF_MAX_LEN);
+    return (int)read_result;
+  }
+}
+#endif /* defined(USE_IOVEC_IO) */
+
 /** Read from file descriptor <b>fd</b>, writing onto end of <b>buf</b>.  Read
  * at most <b>at_most</b> bytes, growing the buffer as necessary.  If recv()
  * returns 0 (because of EOF), set *<b>reached_eof</b> to 1 and return 0.
@@ -108,6 +157,27 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
   if (BUG(buf->datalen > BUF_MAX_LEN - at_most))
     return -1;
 
+#ifdef USE_IOVEC_IO
+  (void) is_socket;
+  while (at_most > total_read) {
+    struct iovec iov[BUF_MAX_IOV];
+    size_t readlen = 0;
+    int i, n_iov;
+    n_iov = buf_get_space_iov(buf, iov, BUF_MAX_IOV, at_most - total_read);
+    for (i = 0; i < n_iov; ++i)
+      readlen += iov[i].iov_len;
+
+    r = read_to_iov(buf, iov, n_iov, fd, reached_eof, socket_error);
+    check();
+    if (r < 0)
+      return r; /* Error */
+    tor_assert(total_read+r <= BUF_MAX_LEN);
+    total_read += r;
+    if ((size_t)r < readlen) { /* eof, block, or no more to read. */
+      break;
+    }
+  }
+#else /* !defined(USE_IOVEC_IO) */
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
@@ -133,6 +203,7 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
       break;
     }
   }
+#endif /* defined(USE_IOVEC_IO) */
   return (int)total_read;
 }
 
@@ -173,6 +244,31 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+#ifdef USE_IOVEC_IO
+/** Helper for buf_flush_to_fd(): try to write the <b>n_iov</b> regions of
+ * <b>buf</b>'s data described by <b>iov</b> onto file descriptor
+ * <b>fd</b> with a single writev() call.  Return the number of bytes written
+ * on success, 0 on blocking, -1 on failure.
+ */
+static inline int
+flush_iov(tor_socket_t fd, buf_t *buf, const struct iovec *iov, int n_iov)
+{
+  ssize_t write_result = writev(fd, iov, n_iov);
+
+  if (write_result < 0) {
+    if (!ERRNO_IS_EAGAIN(errno)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    buf_drain(buf, write_result);
+    tor_assert(write_result <= BUF_MAX_LEN);
+    return (int)write_result;
+  }
+}
+#endif /* defined(USE_IOVEC_IO) */
+
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, and remove the written bytes
  * from the buffer.  Return the number of bytes written on success,
@@ -193,6 +289,27 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   }
 
   check();
+#ifdef USE_IOVEC_IO
+  (void) is_socket;
+  while (sz) {
+    struct iovec iov[BUF_MAX_IOV];
+    size_t flushlen0 = 0;
+    int i, n_iov;
+    n_iov = buf_get_data_iov(buf, iov, BUF_MAX_IOV, sz);
+    tor_assert(n_iov > 0);
+    for (i = 0; i < n_iov; ++i)
+      flushlen0 += iov[i].iov_len;
+
+    r = flush_iov(fd, buf, iov, n_iov);
+    check();
+    if (r < 0)
+      return r;
+    flushed += r;
+    sz -= r;
+    if (r == 0 || (size_t)r < flushlen0) /* can't flush any more now. */
+      break;
+  }
+#else /* !defined(USE_IOVEC_IO) */
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
@@ -210,6 +327,7 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
     if (r == 0 || (size_t)r < flushlen0) /* can't flush any more now. */
       break;
   }
+#endif /* defined(USE_IOVEC_IO) */
   tor_assert(flushed <= BUF_MAX_LEN);
   return (int)flushed;
 }
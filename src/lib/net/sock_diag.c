@@ -0,0 +1,303 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file sock_diag.c
+ * \brief Ask the Linux kernel about many TCP sockets at once.
+ *
+ * The usual way to learn the congestion state of a TCP socket is to call
+ * getsockopt(TCP_INFO) on it, and then an ioctl to find out how much of its
+ * send queue is still unsent.  That's two system calls per socket.  With a
+ * netlink "sock_diag" dump, the kernel instead writes the same information
+ * for every TCP socket on the host into a buffer of ours, a few hundred
+ * sockets per system call.
+ *
+ * The dump identifies each socket by its inode number, which is also what
+ * fstat() reports for the socket's file descriptor: callers use that to
+ * match dump entries to their own sockets.
+ *
+ * The dump covers every socket on the host, not just ours, so it is only a
+ * win when we own most of them, as a busy relay does.
+ **/
+
+#define SOCK_DIAG_PRIVATE
+#include "orconfig.h"
+#include "lib/net/sock_diag.h"
+#include "lib/log/log.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#ifdef USE_SOCK_DIAG
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/tcp.h>
+
+/** Size of the buffer that we receive dump messages into.  The kernel fills
+ * as much of it as it can with each receive. */
+#define SOCK_DIAG_BUF_SIZE 65536
+
+/** TCP states that we ask about.  These are the kernel's TCP_ESTABLISHED
+ * and TCP_CLOSE_WAIT; we can't include the header that defines them
+ * alongside linux/tcp.h. */
+#define SOCK_DIAG_STATES ((1u << 1) | (1u << 8))
+
+struct tor_sock_diag_t {
+  /** The netlink socket. */
+  int fd;
+  /** Sequence number of our last request. */
+  uint32_t seq;
+  /** Buffer for the kernel's replies. */
+  uint8_t *buf;
+};
+
+/** Return true iff this build can use sock_diag at all. */
+int
+tor_sock_diag_is_supported(void)
+{
+  return 1;
+}
+
+/** Open and return a new sock_diag socket, or return NULL if the kernel
+ * won't give us one. */
+tor_sock_diag_t *
+tor_sock_diag_new(void)
+{
+  int fd = socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+  if (fd < 0) {
+    log_info(LD_NET, "Unable to open a sock_diag socket: %s",
+             strerror(errno));
+    return NULL;
+  }
+  tor_sock_diag_t *diag = tor_malloc_zero(sizeof(*diag));
+  diag->fd = fd;
+  diag->buf = tor_malloc(SOCK_DIAG_BUF_SIZE);
+  return diag;
+}
+
+/** Close and free <b>diag</b>. */
+void
+tor_sock_diag_free_(tor_sock_diag_t *diag)
+{
+  if (!diag)
+    return;
+  close(diag->fd);
+  tor_free(diag->buf);
+  tor_free(diag);
+}
+
+/** Look for the TCP information in <b>len</b> bytes of attributes at
+ * <b>p</b>, which belong to the dump entry for <b>msg</b>.  If it is there,
+ * and the kernel is new enough to tell us about unsent bytes, fill in
+ * <b>out</b> and return 0.  Otherwise return -1. */
+static int
+sock_diag_parse_info(const struct inet_diag_msg *msg, const uint8_t *p,
+                     size_t len, tor_tcp_diag_t *out)
+{
+  while (len >= NLA_HDRLEN) {
+    struct nlattr attr;
+    memcpy(&attr, p, sizeof(attr));
+    if (attr.nla_len < NLA_HDRLEN || attr.nla_len > len)
+      return -1;
+    if ((attr.nla_type & NLA_TYPE_MASK) == INET_DIAG_INFO) {
+      struct tcp_info tcp;
+      const size_t info_len = attr.nla_len - NLA_HDRLEN;
+      if (info_len < offsetof(struct tcp_info, tcpi_notsent_bytes) +
+                     sizeof(tcp.tcpi_notsent_bytes))
+        return -1;
+      memset(&tcp, 0, sizeof(tcp));
+      memcpy(&tcp, p + NLA_HDRLEN,
+             info_len < sizeof(tcp) ? info_len : sizeof(tcp));
+      out->inode = msg->idiag_inode;
+      out->cwnd = tcp.tcpi_snd_cwnd;
+      out->unacked = tcp.tcpi_unacked;
+      out->mss = tcp.tcpi_snd_mss;
+      out->notsent = tcp.tcpi_notsent_bytes;
+      return 0;
+    }
+    const size_t step = NLA_ALIGN((size_t)attr.nla_len);
+    if (step >= len)
+      break;
+    p += step;
+    len -= step;
+  }
+  return -1;
+}
+
+/** Parse <b>len</b> bytes of replies in <b>buf</b> to the request with
+ * sequence number <b>seq</b>, and call <b>cb</b> with <b>arg</b> on every
+ * socket that we can learn about.  Return 1 if the dump is over, 0 if there
+ * is more to read, and -1 if the kernel reported an error. */
+STATIC int
+sock_diag_parse(const uint8_t *buf, size_t len, uint32_t seq,
+                tor_sock_diag_cb_fn_t cb, void *arg)
+{
+  while (len >= NLMSG_HDRLEN) {
+    struct nlmsghdr hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.nlmsg_len < NLMSG_HDRLEN || hdr.nlmsg_len > len)
+      return -1;
+
+    if (hdr.nlmsg_seq == seq) {
+      if (hdr.nlmsg_type == NLMSG_DONE)
+        return 1;
+      if (hdr.nlmsg_type == NLMSG_ERROR)
+        return -1;
+      if (hdr.nlmsg_type == SOCK_DIAG_BY_FAMILY &&
+          hdr.nlmsg_len >= NLMSG_LENGTH(sizeof(struct inet_diag_msg))) {
+        struct inet_diag_msg msg;
+        tor_tcp_diag_t info;
+        memcpy(&msg, buf + NLMSG_HDRLEN, sizeof(msg));
+        if (sock_diag_parse_info(&msg, buf + NLMSG_LENGTH(sizeof(msg)),
+                                 hdr.nlmsg_len - NLMSG_LENGTH(sizeof(msg)),
+                                 &info) == 0) {
+          cb(&info, arg);
+        }
+      }
+    }
+
+    if (NLMSG_ALIGN(hdr.nlmsg_len) >= len)
+      break;
+    buf += NLMSG_ALIGN(hdr.nlmsg_len);
+    len -= NLMSG_ALIGN(hdr.nlmsg_len);
+  }
+  return 0;
+}
+
+/** Dump the TCP sockets of address family <b>family</b>.  Return 0 on
+ * success and -1 on failure. */
+static int
+sock_diag_dump_family(tor_sock_diag_t *diag, int family,
+                      tor_sock_diag_cb_fn_t cb, void *arg,
+                      unsigned *n_syscalls)
+{
+  struct {
+    struct nlmsghdr hdr;
+    struct inet_diag_req_v2 req;
+  } request;
+  struct sockaddr_nl addr;
+  int r = 0;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  memset(&request, 0, sizeof(request));
+  request.hdr.nlmsg_len = sizeof(request);
+  request.hdr.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+  request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.hdr.nlmsg_seq = ++diag->seq;
+  request.req.sdiag_family = family;
+  request.req.sdiag_protocol = IPPROTO_TCP;
+  request.req.idiag_states = SOCK_DIAG_STATES;
+  request.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+
+  ++*n_syscalls;
+  if (sendto(diag->fd, &request, sizeof(request), 0,
+             (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    log_info(LD_NET, "Unable to send sock_diag request: %s",
+             strerror(errno));
+    return -1;
+  }
+
+  do {
+    ssize_t n;
+    ++*n_syscalls;
+    n = recv(diag->fd, diag->buf, SOCK_DIAG_BUF_SIZE, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      log_info(LD_NET, "Unable to receive sock_diag reply: %s",
+               strerror(errno));
+      return -1;
+    }
+    if (n == 0)
+      return -1;
+    r = sock_diag_parse(diag->buf, (size_t)n, diag->seq, cb, arg);
+  } while (r == 0);
+
+  return r < 0 ? -1 : 0;
+}
+
+/** Ask the kernel about all established TCP sockets on this host, and call
+ * <b>cb</b> with <b>arg</b> on each one.  Add the number of system calls
+ * that we made to *<b>n_syscalls_out</b>.  Return 0 on success and -1 on
+ * failure; on failure, we may have called <b>cb</b> on some sockets. */
+MOCK_IMPL(int,
+tor_sock_diag_dump_tcp,(tor_sock_diag_t *diag, tor_sock_diag_cb_fn_t cb,
+                        void *arg, unsigned *n_syscalls_out))
+{
+  tor_assert(diag);
+  tor_assert(cb);
+  tor_assert(n_syscalls_out);
+
+  if (sock_diag_dump_family(diag, AF_INET, cb, arg, n_syscalls_out) < 0)
+    return -1;
+  if (sock_diag_dump_family(diag, AF_INET6, cb, arg, n_syscalls_out) < 0)
+    return -1;
+  return 0;
+}
+
+#else /* !defined(USE_SOCK_DIAG) */
+
+int
+tor_sock_diag_is_supported(void)
+{
+  return 0;
+}
+
+tor_sock_diag_t *
+tor_sock_diag_new(void)
+{
+  return NULL;
+}
+
+void
+tor_sock_diag_free_(tor_sock_diag_t *diag)
+{
+  (void)diag;
+}
+
+MOCK_IMPL(int,
+tor_sock_diag_dump_tcp,(tor_sock_diag_t *diag, tor_sock_diag_cb_fn_t cb,
+                        void *arg, unsigned *n_syscalls_out))
+{
+  (void)diag;
+  (void)cb;
+  (void)arg;
+  (void)n_syscalls_out;
+  return -1;
+}
+
+#endif /* defined(USE_SOCK_DIAG) */
+
+/** Set *<b>inode_out</b> to the inode number of <b>sock</b>, as the
+ * kernel reports it in sock_diag dumps.  Return 0 on success and -1 on
+ * failure. */
+int
+tor_sock_diag_get_inode(tor_socket_t sock, uint64_t *inode_out)
+{
+#if defined(HAVE_SYS_STAT_H) && !defined(_WIN32)
+  struct stat st;
+  if (fstat(sock, &st) < 0)
+    return -1;
+  *inode_out = (uint64_t)st.st_ino;
+  return 0;
+#else
+  (void)sock;
+  (void)inode_out;
+  return -1;
+#endif /* defined(HAVE_SYS_STAT_H) && !defined(_WIN32) */
+}
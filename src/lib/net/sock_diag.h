@@ -0,0 +1,60 @@
+/* Copyright (c) 2020, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file sock_diag.h
+ * \brief Header for sock_diag.c
+ **/
+
+#ifndef TOR_SOCK_DIAG_H
+#define TOR_SOCK_DIAG_H
+
+#include "orconfig.h"
+#include "lib/cc/torint.h"
+#include "lib/malloc/malloc.h"
+#include "lib/net/nettypes.h"
+#include "lib/testsupport/testsupport.h"
+
+#if defined(HAVE_LINUX_NETLINK_H) && defined(HAVE_LINUX_SOCK_DIAG_H) && \
+  defined(HAVE_LINUX_INET_DIAG_H) &&                                      \
+  defined(HAVE_STRUCT_TCP_INFO_TCPI_NOTSENT_BYTES)
+#define USE_SOCK_DIAG
+#endif
+
+/** A netlink socket that we use to ask the kernel about our TCP sockets. */
+typedef struct tor_sock_diag_t tor_sock_diag_t;
+
+/** What the kernel told us about one TCP socket. */
+typedef struct tor_tcp_diag_t {
+  /** Inode number of the socket; see tor_sock_diag_get_inode(). */
+  uint64_t inode;
+  /** Congestion window, in packets. */
+  uint32_t cwnd;
+  /** Number of packets that are sent and not yet acknowledged. */
+  uint32_t unacked;
+  /** Maximum segment size for sending. */
+  uint32_t mss;
+  /** Number of bytes in the send queue that are not sent yet. */
+  uint32_t notsent;
+} tor_tcp_diag_t;
+
+/** Function to call for each socket in a dump. */
+typedef void (*tor_sock_diag_cb_fn_t)(const tor_tcp_diag_t *info, void *arg);
+
+int tor_sock_diag_is_supported(void);
+tor_sock_diag_t *tor_sock_diag_new(void);
+void tor_sock_diag_free_(tor_sock_diag_t *diag);
+#define tor_sock_diag_free(diag) \
+  FREE_AND_NULL(tor_sock_diag_t, tor_sock_diag_free_, (diag))
+
+int tor_sock_diag_get_inode(tor_socket_t sock, uint64_t *inode_out);
+MOCK_DECL(int, tor_sock_diag_dump_tcp,
+          (tor_sock_diag_t *diag, tor_sock_diag_cb_fn_t cb, void *arg,
+           unsigned *n_syscalls_out));
+
+#if defined(SOCK_DIAG_PRIVATE) && defined(USE_SOCK_DIAG)
+STATIC int sock_diag_parse(const uint8_t *buf, size_t len, uint32_t seq,
+                           tor_sock_diag_cb_fn_t cb, void *arg);
+#endif /* defined(SOCK_DIAG_PRIVATE) && defined(USE_SOCK_DIAG) */
+
+#endif /* !defined(TOR_SOCK_DIAG_H) */
@@ -28,6 +28,10 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include <errno.h>
 #include <stddef.h>
 #include <string.h>
 #ifdef __FreeBSD__
@@ -623,6 +627,49 @@ write_all_to_socket(tor_socket_t fd, const char *buf, size_t count)
   return (ssize_t)count;
 }
 
+/** Return true iff tor_socket_sendfile() can work on this platform. */
+bool
+tor_socket_sendfile_supported(void)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+  return true;
+#else
+  return false;
+#endif
+}
+
+/** Send up to <b>count</b> bytes from the file <b>fd</b>, starting at
+ * *<b>offset</b>, to the socket <b>sock</b>, without copying them through
+ * userspace.  Advance *<b>offset</b> past the bytes that we sent, and return
+ * their number.  On error, return -1 and set the socket errno; if the
+ * platform can't do this at all, that errno is ENOSYS.
+ *
+ * Only the Linux-style sendfile() (which Solaris shares) is supported: the
+ * BSD variants have different signatures, and aren't worth it here. */
+ssize_t
+tor_socket_sendfile(tor_socket_t sock, int fd, uint64_t *offset,
+                    size_t count)
+{
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+  off_t off = (off_t) *offset;
+  if (BUG((uint64_t)off != *offset)) {
+    errno = EINVAL;
+    return -1;
+  }
+  ssize_t r = sendfile(sock, fd, &off, count);
+  if (r > 0)
+    *offset = (uint64_t) off;
+  return r;
+#else
+  (void) sock;
+  (void) fd;
+  (void) offset;
+  (void) count;
+  errno = ENOSYS;
+  return -1;
+#endif /* defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H) */
+}
+
 /**
  * On Windows, WSAEWOULDBLOCK is not always correct: when you see it,
  * you need to ask the socket for its actual errno.  Also, you need to
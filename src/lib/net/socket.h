@@ -61,6 +61,9 @@ void set_max_sockets(int);
 
 ssize_t write_all_to_socket(tor_socket_t fd, const char *buf, size_t count);
 ssize_t read_all_from_socket(tor_socket_t fd, char *buf, size_t count);
+bool tor_socket_sendfile_supported(void);
+ssize_t tor_socket_sendfile(tor_socket_t sock, int fd, uint64_t *offset,
+                            size_t count);
 
 /* For stupid historical reasons, windows sockets have an independent
  * set of errnos, and an independent way to get them.  Also, you can't
@@ -56,6 +56,7 @@
 #include <sys/epoll.h>
 #include <sys/prctl.h>
 #include <linux/futex.h>
+#include <linux/netlink.h>
 #include <sys/file.h>
 
 #include <stdarg.h>
@@ -223,10 +224,17 @@ static int filter_nopar_gen[] = {
     SCMP_SYS(prlimit64),
 #endif
     SCMP_SYS(read),
+    SCMP_SYS(readv),
     SCMP_SYS(rt_sigreturn),
     SCMP_SYS(sched_getaffinity),
 #ifdef __NR_sched_yield
     SCMP_SYS(sched_yield),
+#endif
+#ifdef __NR_sendfile
+    SCMP_SYS(sendfile),
+#endif
+#ifdef __NR_sendfile64
+    SCMP_SYS(sendfile64),
 #endif
     SCMP_SYS(sendmsg),
     SCMP_SYS(set_robust_list),
@@ -755,6 +763,16 @@ sb_socket(scmp_filter_ctx ctx, sandbox_cfg_t *filter)
   if (rc)
     return rc;
 
+#ifdef HAVE_KIST_SUPPORT
+  /* For the KIST scheduler's sock_diag dumps; see sock_diag.c. */
+  rc = seccomp_rule_add_3(ctx, SCMP_ACT_ALLOW, SCMP_SYS(socket),
+      SCMP_CMP(0, SCMP_CMP_EQ, PF_NETLINK),
+      SCMP_CMP_MASKED(1, SOCK_CLOEXEC, SOCK_RAW),
+      SCMP_CMP(2, SCMP_CMP_EQ, NETLINK_SOCK_DIAG));
+  if (rc)
+    return rc;
+#endif /* defined(HAVE_KIST_SUPPORT) */
+
   return 0;
 }
 
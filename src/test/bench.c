@@ -13,6 +13,8 @@
 #include "core/or/or.h"
 #include "core/crypto/onion_tap.h"
 #include "core/crypto/relay_crypto.h"
+#define RELAY_CRYPTO_PIPELINE_PRIVATE
+#include "core/crypto/relay_crypto_pipeline.h"
 
 #include "lib/intmath/weakrng.h"
 
@@ -24,25 +26,65 @@
 #include <openssl/obj_mac.h>
 #endif /* defined(ENABLE_OPENSSL) */
 
+#include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/mainloop/mainloop.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/policies.h"
+#include "core/or/policy_trie.h"
 #include "app/config/config.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/dircommon/consdiff.h"
+#include "feature/dircommon/directory.h"
 #include "lib/compress/compress.h"
+#include "lib/encoding/confline.h"
 
 #include "core/or/cell_st.h"
 #include "core/or/or_circuit_st.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/uring.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/buf/buffers.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/socket.h"
+#include "lib/time/compat_time.h"
 
 #include "feature/dirparse/microdesc_parse.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/dirauth/dirvote.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
+#include "feature/relay/router.h"
+
+#include "feature/dircommon/dir_connection_st.h"
+#include "feature/nodelist/microdesc_st.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -254,6 +296,148 @@ bench_onion_ntor_impl(void)
   dimap_free(keymap, NULL);
 }
 
+/** One work item for bench_onion_ntor_pool(): a batch of server-side
+ * handshakes, as a cpuworker would get them. */
+typedef struct bench_ntor_batch_t {
+  /** How many handshakes are in this batch? */
+  int n;
+  /** When did we queue this batch? */
+  monotime_t queued_at;
+} bench_ntor_batch_t;
+
+/** The threadpool used by bench_onion_ntor_pool(). */
+static threadpool_t *bench_ntor_pool = NULL;
+/** Server keys, node ID, and onionskin used by bench_onion_ntor_pool(). */
+static di_digest256_map_t *bench_ntor_keymap = NULL;
+static uint8_t bench_ntor_nodeid[DIGEST_LEN];
+static uint8_t bench_ntor_onionskin[NTOR_ONIONSKIN_LEN];
+/** Number of handshakes that bench_onion_ntor_pool() hasn't queued yet. */
+static int bench_ntor_left = 0;
+/** Number of handshakes that bench_onion_ntor_pool() has queued, and that
+ * haven't come back yet. */
+static int bench_ntor_outstanding = 0;
+/** Size of the batches that bench_onion_ntor_pool() is sending. */
+static int bench_ntor_batch_size = 1;
+/** Total nanoseconds that answered handshakes spent between being queued
+ * and being answered. */
+static uint64_t bench_ntor_delay_nsec = 0;
+
+static void
+bench_ntor_pool_fill(void);
+
+static void *
+bench_ntor_state_new(void *arg)
+{
+  (void) arg;
+  return tor_malloc_zero(1);
+}
+
+static void
+bench_ntor_state_free(void *state)
+{
+  tor_free(state);
+}
+
+static workqueue_reply_t
+bench_ntor_pool_threadfn(void *state, void *arg)
+{
+  bench_ntor_batch_t *batch = arg;
+  int i;
+  (void) state;
+  for (i = 0; i < batch->n; ++i) {
+    uint8_t reply[NTOR_REPLY_LEN];
+    uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
+    onion_skin_ntor_server_handshake(bench_ntor_onionskin, bench_ntor_keymap,
+                                     NULL, bench_ntor_nodeid, reply,
+                                     key_out, sizeof(key_out));
+  }
+  return WQ_RPL_REPLY;
+}
+
+static void
+bench_ntor_pool_replyfn(void *arg)
+{
+  bench_ntor_batch_t *batch = arg;
+  monotime_t now;
+  monotime_get(&now);
+  bench_ntor_delay_nsec +=
+    monotime_diff_nsec(&batch->queued_at, &now) * batch->n;
+  bench_ntor_outstanding -= batch->n;
+  tor_free(batch);
+  bench_ntor_pool_fill();
+}
+
+/** Queue more handshakes for bench_onion_ntor_pool(), keeping a bounded
+ * number outstanding, the way cpuworker.c does. */
+static void
+bench_ntor_pool_fill(void)
+{
+  const int max_pending = 64;
+  while (bench_ntor_left && bench_ntor_outstanding < max_pending) {
+    bench_ntor_batch_t *batch = tor_malloc_zero(sizeof(*batch));
+    batch->n = MIN(bench_ntor_batch_size, bench_ntor_left);
+    batch->n = MIN(batch->n, max_pending - bench_ntor_outstanding);
+    monotime_get(&batch->queued_at);
+    bench_ntor_left -= batch->n;
+    bench_ntor_outstanding += batch->n;
+    threadpool_queue_work(bench_ntor_pool, bench_ntor_pool_threadfn,
+                          bench_ntor_pool_replyfn, batch);
+  }
+}
+
+/** Measure how many server-side ntor handshakes per second a threadpool
+ * gets through, and how long each one waits for its answer, when we send
+ * them to the workers one at a time or in batches. */
+static void
+bench_onion_ntor_pool(void)
+{
+  const int n_handshakes = 1<<12;
+  const int thread_counts[] = { 2, 4, -1 };
+  const int batch_sizes[] = { 1, MAX_ONIONSKIN_BATCH, -1 };
+  curve25519_keypair_t keypair;
+  ntor_handshake_state_t *state = NULL;
+  int t, b;
+
+  monotime_init();
+  curve25519_secret_key_generate(&keypair.seckey, 0);
+  curve25519_public_key_generate(&keypair.pubkey, &keypair.seckey);
+  dimap_add_entry(&bench_ntor_keymap, keypair.pubkey.public_key, &keypair);
+  crypto_rand((char *)bench_ntor_nodeid, sizeof(bench_ntor_nodeid));
+  onion_skin_ntor_create(bench_ntor_nodeid, &keypair.pubkey, &state,
+                         bench_ntor_onionskin);
+
+  for (t = 0; thread_counts[t] > 0; ++t) {
+    replyqueue_t *rq = replyqueue_new(0);
+    bench_ntor_pool = threadpool_new(thread_counts[t], rq,
+                                     bench_ntor_state_new,
+                                     bench_ntor_state_free, NULL);
+    for (b = 0; batch_sizes[b] > 0; ++b) {
+      monotime_t start, end;
+      bench_ntor_batch_size = batch_sizes[b];
+      bench_ntor_left = n_handshakes;
+      bench_ntor_delay_nsec = 0;
+
+      monotime_get(&start);
+      bench_ntor_pool_fill();
+      while (bench_ntor_outstanding)
+        replyqueue_process(rq);
+      monotime_get(&end);
+
+      printf("%d worker thread(s), %d onionskin(s) per work item: "
+             "%.2f onionskins/sec, %.2f usec mean queueing delay\n",
+             thread_counts[t], batch_sizes[b],
+             ((double)n_handshakes) * 1e9 /
+             monotime_diff_nsec(&start, &end),
+             ((double)bench_ntor_delay_nsec) / n_handshakes / 1e3);
+    }
+    /* There's no way to shut down a threadpool, so we leak it. */
+    bench_ntor_pool = NULL;
+  }
+
+  ntor_handshake_state_free(state);
+  dimap_free(bench_ntor_keymap, NULL);
+}
+
 static void
 bench_onion_ntor(void)
 {
@@ -265,6 +449,9 @@ bench_onion_ntor(void)
     curve25519_set_impl_params(ed);
     bench_onion_ntor_impl();
   }
+
+  printf("Through a threadpool:\n");
+  bench_onion_ntor_pool();
 }
 
 static void
@@ -425,6 +612,43 @@ bench_cell_aes(void)
   tor_free(b);
 }
 
+/** Run AES performance benchmarks for batches of relay cell payloads, as
+ * handled by relay_crypt_payloads(). */
+static void
+bench_cell_aes_batch(void)
+{
+  uint64_t start, end;
+  const int iters = (1<<16);
+  const int batch_sizes[] = { 1, 2, 4, 8, 16, 64 };
+  uint8_t *payloads[64];
+  crypto_cipher_t *c;
+  unsigned b;
+  int i;
+  char key[CIPHER_KEY_LEN];
+  crypto_rand(key, sizeof(key));
+  c = crypto_cipher_new(key);
+
+  for (i = 0; i < 64; ++i)
+    payloads[i] = tor_malloc(CELL_PAYLOAD_SIZE);
+
+  reset_perftime();
+  for (b = 0; b < ARRAY_LENGTH(batch_sizes); ++b) {
+    const int n = batch_sizes[b];
+    const int n_batches = iters / n;
+    start = perftime();
+    for (i = 0; i < n_batches; ++i) {
+      relay_crypt_payloads(c, payloads, n);
+    }
+    end = perftime();
+    printf("%d payloads per batch: %.2f nsec per byte\n", n,
+           NANOCOUNT(start, end, n_batches*n*CELL_PAYLOAD_SIZE));
+  }
+
+  for (i = 0; i < 64; ++i)
+    tor_free(payloads[i]);
+  crypto_cipher_free(c);
+}
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -616,6 +840,485 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** As bench_cell_ops(), but handle the cells in batches with
+ * relay_crypto_crypt_or_cells(). */
+static void
+bench_cell_ops_batch(void)
+{
+  const int iters = 1<<16;
+  const int batch_sizes[] = { 1, 2, 4, 8, 16, 64 };
+  cell_t *cells[64];
+  char recognized[64];
+  relay_crypto_t crypto;
+  int i, outbound;
+  unsigned b;
+  uint64_t start, end;
+
+  memset(&crypto, 0, sizeof(crypto));
+  for (i = 0; i < 64; ++i) {
+    cells[i] = tor_malloc(sizeof(cell_t));
+    crypto_rand((char*)cells[i]->payload, sizeof(cells[i]->payload));
+  }
+
+  /* Initialize crypto */
+  char key1[CIPHER_KEY_LEN], key2[CIPHER_KEY_LEN];
+  crypto_rand(key1, sizeof(key1));
+  crypto_rand(key2, sizeof(key2));
+  crypto.f_crypto = crypto_cipher_new(key1);
+  crypto.b_crypto = crypto_cipher_new(key2);
+  crypto.f_digest = crypto_digest_new();
+  crypto.b_digest = crypto_digest_new();
+
+  reset_perftime();
+
+  for (outbound = 0; outbound <= 1; ++outbound) {
+    cell_direction_t d = outbound ? CELL_DIRECTION_OUT : CELL_DIRECTION_IN;
+    for (b = 0; b < ARRAY_LENGTH(batch_sizes); ++b) {
+      const int n = batch_sizes[b];
+      const int n_batches = iters / n;
+      start = perftime();
+      for (i = 0; i < n_batches; ++i) {
+        relay_crypto_crypt_or_cells(&crypto, cells, n, d, recognized, NULL);
+      }
+      end = perftime();
+      printf("%sbound cells, %2d per batch: %.2f ns per cell. "
+             "(%.2f ns per byte of payload)\n",
+             outbound?"Out":" In", n,
+             NANOCOUNT(start,end,n_batches*n),
+             NANOCOUNT(start,end,n_batches*n*CELL_PAYLOAD_SIZE));
+    }
+  }
+
+  relay_crypto_clear(&crypto);
+  for (i = 0; i < 64; ++i)
+    tor_free(cells[i]);
+}
+
+/** State for one fake circuit in bench_cell_pipeline(). */
+typedef struct bench_pipeline_circ_t {
+  relay_crypto_t crypto;
+  /** How many cells do we still need to send through the pipeline? */
+  int cells_left;
+} bench_pipeline_circ_t;
+
+/** Number of jobs that bench_cell_pipeline() is still waiting for. */
+static int bench_pipeline_jobs_outstanding = 0;
+/** The threadpool used by bench_cell_pipeline(). */
+static threadpool_t *bench_pipeline_pool = NULL;
+
+static void bench_pipeline_launch(bench_pipeline_circ_t *bc);
+
+static void *
+bench_pipeline_state_new(void *arg)
+{
+  (void) arg;
+  return tor_malloc_zero(1);
+}
+
+static void
+bench_pipeline_state_free(void *state)
+{
+  tor_free(state);
+}
+
+static workqueue_reply_t
+bench_pipeline_threadfn(void *state, void *arg)
+{
+  (void) state;
+  relay_crypto_job_t *job = arg;
+  relay_crypto_job_run(job);
+  return WQ_RPL_REPLY;
+}
+
+static void
+bench_pipeline_replyfn(void *arg)
+{
+  relay_crypto_job_t *job = arg;
+  bench_pipeline_circ_t *bc = (bench_pipeline_circ_t *) job->circ;
+  job->circ = NULL;
+  relay_crypto_job_free(job);
+  --bench_pipeline_jobs_outstanding;
+  bench_pipeline_launch(bc);
+}
+
+/** Send the next batch of cells for <b>bc</b> to the workers, if it has any
+ * left. As in relay_crypto_pipeline.c, there is at most one job per circuit
+ * at a time. */
+static void
+bench_pipeline_launch(bench_pipeline_circ_t *bc)
+{
+  relay_crypto_job_t *job;
+  if (bc->cells_left == 0)
+    return;
+  job = relay_crypto_job_new(&bc->crypto);
+  /* We don't have a real circuit: abuse this field to find our way back. */
+  job->circ = (or_circuit_t *) bc;
+  while (bc->cells_left && job->n_cells < RELAY_CRYPTO_PIPELINE_MAX_BATCH) {
+    relay_crypto_cell_t *rcell = tor_malloc_zero(sizeof(*rcell));
+    rcell->op = RELAY_CRYPTO_OP_DECRYPT_OUTBOUND;
+    crypto_fast_rng_getbytes(get_thread_fast_rng(), rcell->cell.payload,
+                             sizeof(rcell->cell.payload));
+    relay_crypto_job_add_cell(job, rcell);
+    --bc->cells_left;
+  }
+  ++bench_pipeline_jobs_outstanding;
+  threadpool_queue_work(bench_pipeline_pool, bench_pipeline_threadfn,
+                        bench_pipeline_replyfn, job);
+}
+
+/** Compare relay cell crypto throughput inline and through the relay crypto
+ * pipeline, for a bunch of circuits at once. This measures wall-clock time,
+ * not CPU time: the point of the pipeline is to use more cores. */
+static void
+bench_cell_pipeline(void)
+{
+  const int n_circs = 256;
+  const int cells_per_circ = 2048;
+  const int thread_counts[] = { 1, 2, 4, 8, -1 };
+  bench_pipeline_circ_t *circs = tor_calloc(n_circs, sizeof(*circs));
+  monotime_t start, end;
+  int i, j, t;
+
+  monotime_init();
+  for (i = 0; i < n_circs; ++i) {
+    char keys[CPATH_KEY_MATERIAL_LEN];
+    crypto_rand(keys, sizeof(keys));
+    relay_crypto_init(&circs[i].crypto, keys, sizeof(keys), 0, 0);
+  }
+
+  /* Inline: what the main thread does today. We generate the payloads here
+   * too, so that both modes do the same amount of work. */
+  monotime_get(&start);
+  for (j = 0; j < cells_per_circ; j += RELAY_CRYPTO_PIPELINE_MAX_BATCH) {
+    for (i = 0; i < n_circs; ++i) {
+      relay_crypto_job_t *job = relay_crypto_job_new(&circs[i].crypto);
+      int k;
+      for (k = 0; k < RELAY_CRYPTO_PIPELINE_MAX_BATCH; ++k) {
+        relay_crypto_cell_t *rc = tor_malloc_zero(sizeof(*rc));
+        rc->op = RELAY_CRYPTO_OP_DECRYPT_OUTBOUND;
+        crypto_fast_rng_getbytes(get_thread_fast_rng(), rc->cell.payload,
+                                 sizeof(rc->cell.payload));
+        relay_crypto_job_add_cell(job, rc);
+      }
+      relay_crypto_job_run(job);
+      relay_crypto_job_free(job);
+    }
+  }
+  monotime_get(&end);
+  printf("Inline: %.2f cells/sec\n",
+         ((double)n_circs * cells_per_circ) * 1e9 /
+         monotime_diff_nsec(&start, &end));
+
+  /* Pipelined, with a varying number of worker threads. */
+  for (t = 0; thread_counts[t] > 0; ++t) {
+    replyqueue_t *rq = replyqueue_new(0);
+    bench_pipeline_pool = threadpool_new(thread_counts[t], rq,
+                                         bench_pipeline_state_new,
+                                         bench_pipeline_state_free, NULL);
+    for (i = 0; i < n_circs; ++i)
+      circs[i].cells_left = cells_per_circ;
+
+    monotime_get(&start);
+    for (i = 0; i < n_circs; ++i)
+      bench_pipeline_launch(&circs[i]);
+    while (bench_pipeline_jobs_outstanding)
+      replyqueue_process(rq);
+    monotime_get(&end);
+
+    printf("Pipelined, %d worker thread(s): %.2f cells/sec\n",
+           thread_counts[t],
+           ((double)n_circs * cells_per_circ) * 1e9 /
+           monotime_diff_nsec(&start, &end));
+    /* There's no way to shut down a threadpool, so we leak it. */
+    bench_pipeline_pool = NULL;
+  }
+
+  for (i = 0; i < n_circs; ++i)
+    relay_crypto_clear(&circs[i].crypto);
+  tor_free(circs);
+}
+
+/** Number of work items that bench_workqueue() hasn't queued yet. */
+static int bench_wq_left = 0;
+/** Number of work items that bench_workqueue() is still waiting for. */
+static int bench_wq_outstanding = 0;
+/** The threadpool used by bench_workqueue(). */
+static threadpool_t *bench_wq_pool = NULL;
+/** Total nanoseconds that answered work items spent between being queued
+ * and being answered. */
+static uint64_t bench_wq_delay_nsec = 0;
+/** Largest number of work items that bench_wq_fill() keeps in flight. */
+static int bench_wq_max_inflight = 1024;
+
+/** A small work item for bench_workqueue(). */
+typedef struct bench_wq_item_t {
+  /** When did we queue this item? */
+  monotime_t queued_at;
+  /** Scratch output, so that the compiler can't skip the work. */
+  uint64_t result;
+} bench_wq_item_t;
+
+static void bench_wq_fill(void);
+
+static void *
+bench_wq_state_new(void *arg)
+{
+  (void) arg;
+  return tor_malloc_zero(1);
+}
+
+static void
+bench_wq_state_free(void *state)
+{
+  tor_free(state);
+}
+
+static workqueue_reply_t
+bench_wq_threadfn(void *state, void *arg)
+{
+  bench_wq_item_t *item = arg;
+  uint64_t x = (uint64_t)(uintptr_t) item;
+  int i;
+  (void) state;
+  /* About a microsecond of busywork: small enough that the cost of the
+   * queue itself dominates. */
+  for (i = 0; i < 256; ++i)
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+  item->result = x;
+  return WQ_RPL_REPLY;
+}
+
+static void
+bench_wq_replyfn(void *arg)
+{
+  bench_wq_item_t *item = arg;
+  monotime_t now;
+  monotime_get(&now);
+  bench_wq_delay_nsec += monotime_diff_nsec(&item->queued_at, &now);
+  --bench_wq_outstanding;
+  tor_free(item);
+  bench_wq_fill();
+}
+
+/** Queue more work items for bench_workqueue(), keeping a bounded number in
+ * flight, the way test_workqueue.c does. */
+static void
+bench_wq_fill(void)
+{
+  while (bench_wq_left && bench_wq_outstanding < bench_wq_max_inflight) {
+    bench_wq_item_t *item = tor_malloc_zero(sizeof(*item));
+    monotime_get(&item->queued_at);
+    --bench_wq_left;
+    ++bench_wq_outstanding;
+    threadpool_queue_work_priority(bench_wq_pool,
+                                   (bench_wq_left & 7) ?
+                                     WQ_PRI_LOW : WQ_PRI_HIGH,
+                                   bench_wq_threadfn, bench_wq_replyfn,
+                                   item);
+  }
+}
+
+/** Measure how many tiny work items per second go through a threadpool, and
+ * how long each one waits for its answer, at a range of thread counts. */
+static void
+bench_workqueue(void)
+{
+  const int n_items = 1<<18;
+  const int thread_counts[] = { 1, 2, 4, 8, 16, 32, 64, -1 };
+  int t;
+
+  monotime_init();
+  for (t = 0; thread_counts[t] > 0; ++t) {
+    replyqueue_t *rq = replyqueue_new(0);
+    monotime_t start, end;
+    bench_wq_pool = threadpool_new(thread_counts[t], rq,
+                                   bench_wq_state_new,
+                                   bench_wq_state_free, NULL);
+    bench_wq_left = n_items;
+    bench_wq_delay_nsec = 0;
+
+    monotime_get(&start);
+    bench_wq_fill();
+    while (bench_wq_outstanding)
+      replyqueue_process(rq);
+    monotime_get(&end);
+
+    printf("%d worker thread(s): %.2f items/sec, "
+           "%.2f usec mean reply delay\n",
+           thread_counts[t],
+           ((double)n_items) * 1e9 / monotime_diff_nsec(&start, &end),
+           ((double)bench_wq_delay_nsec) / n_items / 1e3);
+    /* There's no way to shut down a threadpool, so we leak it. */
+    bench_wq_pool = NULL;
+  }
+}
+
+/** Called by the threadpool after bench_workqueue_wakeups() has handled
+ * some replies from its main loop. */
+static void
+bench_wq_reply_cb(threadpool_t *tp)
+{
+  (void) tp;
+  if (bench_wq_left == 0 && bench_wq_outstanding == 0)
+    tor_libevent_exit_loop_after_delay(tor_libevent_get_base(), NULL);
+}
+
+/** Run <b>n_items</b> work items through a threadpool with <b>n_threads</b>
+ * threads from the main loop, keeping <b>inflight</b> of them in flight,
+ * with the given reply batch limit and coalescing window.  Report how often
+ * the main loop woke up, and how long replies waited for it. */
+static void
+bench_workqueue_wakeups_run(int n_items, int n_threads, int inflight,
+                            int max_batch, int window)
+{
+  replyqueue_t *rq = replyqueue_new(0);
+  replyqueue_stats_t stats;
+  monotime_t start, end;
+  double secs;
+
+  replyqueue_set_max_batch(rq, max_batch);
+  bench_wq_pool = threadpool_new(n_threads, rq,
+                                 bench_wq_state_new,
+                                 bench_wq_state_free, NULL);
+  threadpool_set_reply_coalesce_usec(bench_wq_pool, window);
+  threadpool_register_reply_event(bench_wq_pool, bench_wq_reply_cb);
+  bench_wq_max_inflight = inflight;
+  bench_wq_left = n_items;
+  bench_wq_delay_nsec = 0;
+
+  monotime_get(&start);
+  bench_wq_fill();
+  tor_libevent_run_event_loop(tor_libevent_get_base(), 0);
+  monotime_get(&end);
+
+  replyqueue_get_stats(rq, &stats);
+  secs = monotime_diff_nsec(&start, &end) / 1e9;
+  printf("%d in flight, batch %d, window %d usec: %.2f items/sec, "
+         "%.2f wakeups/sec, %.2f alerts/sec, %.2f replies/wakeup; "
+         "reply latency median %"PRIu64" usec, 99%% %"PRIu64" usec\n",
+         inflight, max_batch, window, n_items / secs,
+         stats.n_wakeups / secs, stats.n_alerts / secs,
+         ((double)stats.n_replies) / stats.n_wakeups,
+         replyqueue_stats_latency_usec(&stats, 0.5),
+         replyqueue_stats_latency_usec(&stats, 0.99));
+  /* There's no way to shut down a threadpool, so we leak it. */
+  bench_wq_pool = NULL;
+}
+
+/** Measure how often a threadpool wakes up the main loop, and how long its
+ * replies wait there, with different reply batch limits and coalescing
+ * windows, when the pool is lightly and heavily loaded. */
+static void
+bench_workqueue_wakeups(void)
+{
+  const int inflight[] = { 16, 1024, -1 };
+  const int max_batches[] = { 0, 64, -1 };
+  const int windows[] = { 0, 100, 1000, -1 };
+  int i, b, w;
+
+  monotime_init();
+  if (!tor_libevent_is_initialized()) {
+    tor_libevent_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    tor_libevent_initialize(&cfg);
+  }
+
+  for (i = 0; inflight[i] > 0; ++i) {
+    for (b = 0; max_batches[b] >= 0; ++b) {
+      for (w = 0; windows[w] >= 0; ++w) {
+        bench_workqueue_wakeups_run(1<<16, 4, inflight[i],
+                                    max_batches[b], windows[w]);
+      }
+    }
+  }
+  bench_wq_max_inflight = 1024;
+}
+
+/** Schedule cells with the circuitmux <b>policy</b> among <b>n_circs</b>
+ * active circuits, moving to the next EWMA tick every <b>cells_per_tick</b>
+ * cells (or never, if it is 0), and return the time per cell in
+ * nanoseconds. */
+static double
+bench_cmux_ewma_impl(circuitmux_policy_t *policy, int n_circs,
+                     int cells_per_tick)
+{
+  const int N = 1000000;
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuitmux_policy_data_t *pol_data;
+  circuit_t *circs = tor_calloc(n_circs, sizeof(circuit_t));
+  circuitmux_policy_circ_data_t **cdata =
+    tor_calloc(n_circs, sizeof(circuitmux_policy_circ_data_t *));
+  uint64_t start, end;
+  int i;
+
+#ifndef TOR_UNIT_TESTS
+  /* We have no way to make a tick go by. */
+  tor_assert(cells_per_tick == 0);
+#endif
+
+  pol_data = policy->alloc_cmux_data(cmux);
+  for (i = 0; i < n_circs; ++i) {
+    cdata[i] = policy->alloc_circ_data(cmux, pol_data, &circs[i],
+                                       CELL_DIRECTION_OUT, 1);
+    policy->notify_circ_active(cmux, pol_data, &circs[i], cdata[i]);
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < N; ++i) {
+    circuit_t *circ;
+    /* Let an EWMA tick go by every so often, so that we pay for whatever
+     * the policy does when the tick changes. */
+#ifdef TOR_UNIT_TESTS
+    if (cells_per_tick && i % cells_per_tick == 0)
+      cell_ewma_advance_ticks_for_testing(1);
+#endif
+    circ = policy->pick_active_circuit(cmux, pol_data);
+    policy->notify_xmit_cells(cmux, pol_data, circ, cdata[circ - circs], 1);
+  }
+  end = perftime();
+
+  for (i = 0; i < n_circs; ++i)
+    policy->free_circ_data(cmux, pol_data, &circs[i], cdata[i]);
+  policy->free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  tor_free(cdata);
+  tor_free(circs);
+  return NANOCOUNT(start, end, N);
+}
+
+static void
+bench_cmux_ewma(void)
+{
+  /* 0 means "never"; with 10-second ticks, the others are a channel sending
+   * 10000, 1000, and 100 cells per second.  We can only move the EWMA clock
+   * ourselves in a unit-test build of libtor. */
+  static const int cells_per_tick[] = {
+    0,
+#ifdef TOR_UNIT_TESTS
+    100000, 10000, 1000
+#endif
+  };
+  int n_circs;
+
+  cmux_ewma_set_options(NULL, NULL);
+  for (unsigned t = 0; t < ARRAY_LENGTH(cells_per_tick); ++t) {
+    if (cells_per_tick[t])
+      printf("One EWMA tick every %d cells:\n", cells_per_tick[t]);
+    else
+      printf("No EWMA ticks:\n");
+    for (n_circs = 1; n_circs <= 10000; n_circs *= 10) {
+      double plain = bench_cmux_ewma_impl(&ewma_policy, n_circs,
+                                          cells_per_tick[t]);
+      double lazy = bench_cmux_ewma_impl(&ewma_lazy_policy, n_circs,
+                                         cells_per_tick[t]);
+      printf("  %5d active circuits: ewma %.2f nsec/cell, "
+             "lazy ewma %.2f nsec/cell\n",
+             n_circs, plain, lazy);
+    }
+  }
+}
+
 static void
 bench_dh(void)
 {
@@ -738,6 +1441,1101 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+#ifndef _WIN32
+/** Return the resident set size of this process in KB, or -1 if we can't
+ * tell. */
+static long
+bench_rss_kb(void)
+{
+#ifdef __linux__
+  long pages = -1;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return -1;
+  if (fscanf(f, "%*s %ld", &pages) != 1)
+    pages = -1;
+  fclose(f);
+  return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+  return -1;
+#endif /* defined(__linux__) */
+}
+
+/** In a child process, load the microdesc cache from disk; if
+ * <b>digests</b> is set, look up every microdesc in it too.  Report how long
+ * that took and how much it grew the RSS. */
+static void
+bench_md_cache_load(const char *label, const smartlist_t *digests)
+{
+  pid_t pid;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    monotime_t start, end;
+    long rss0 = bench_rss_kb(), rss1;
+    microdesc_cache_t *mc;
+
+    monotime_get(&start);
+    mc = get_microdesc_cache();
+    if (digests) {
+      SMARTLIST_FOREACH(digests, const char *, d,
+        tor_assert(microdesc_cache_lookup_by_digest256(mc, d)));
+    }
+    monotime_get(&end);
+    rss1 = bench_rss_kb();
+    if (rss0 < 0 || rss1 < 0) {
+      printf("%-32s %8.2f msec\n", label,
+             monotime_diff_usec(&start, &end) / 1000.0);
+    } else {
+      printf("%-32s %8.2f msec  %6ld KB more RSS\n", label,
+             monotime_diff_usec(&start, &end) / 1000.0, rss1 - rss0);
+    }
+    fflush(stdout);
+    _exit(0);
+  } else if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+}
+
+/** Return a string holding <b>n_mds</b> made-up microdescriptors that look
+ * like the ones on the real network, and add their digests to
+ * <b>digests</b>. */
+static char *
+bench_make_mds(int n_mds, smartlist_t *digests)
+{
+  smartlist_t *chunks = smartlist_new();
+  crypto_pk_t *pk = crypto_pk_new();
+  char *pem = NULL, *mds;
+  size_t pem_len;
+  int i;
+
+  /* Every microdesc can share an onion key: the other keys make them
+   * distinct. */
+  tor_assert(crypto_pk_generate_key(pk) == 0);
+  tor_assert(crypto_pk_write_public_key_to_string(pk, &pem, &pem_len) == 0);
+  for (i = 0; i < n_mds; ++i) {
+    char rand_bytes[DIGEST256_LEN], ntor[BASE64_DIGEST256_LEN+1];
+    char ed[BASE64_DIGEST256_LEN+1];
+    char fam[2][HEX_DIGEST_LEN+1];
+    char *md;
+    crypto_rand(rand_bytes, sizeof(rand_bytes));
+    digest256_to_base64(ntor, rand_bytes);
+    crypto_rand(rand_bytes, sizeof(rand_bytes));
+    digest256_to_base64(ed, rand_bytes);
+    crypto_rand(rand_bytes, sizeof(rand_bytes));
+    base16_encode(fam[0], sizeof(fam[0]), rand_bytes, DIGEST_LEN);
+    base16_encode(fam[1], sizeof(fam[1]), rand_bytes + 10, DIGEST_LEN);
+    tor_asprintf(&md,
+                 "onion-key\n%s"
+                 "ntor-onion-key %s\n"
+                 "family $%s $%s\n"
+                 "p accept 53,80,443,5222-5223,25565\n"
+                 "id ed25519 %s\n",
+                 pem, ntor, fam[0], fam[1], ed);
+    crypto_digest256(rand_bytes, md, strlen(md), DIGEST_SHA256);
+    smartlist_add(digests, tor_memdup(rand_bytes, DIGEST256_LEN));
+    smartlist_add(chunks, md);
+  }
+  mds = smartlist_join_strings(chunks, "", 0, NULL);
+
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  crypto_pk_free(pk);
+  tor_free(pem);
+  return mds;
+}
+
+/** Compare loading a microdesc cache about the size of the one for the real
+ * network, with and without its index. */
+static void
+bench_md_cache(void)
+{
+  const int N_MDS = 8000;
+  or_options_t *options = get_options_mutable();
+  char *old_cachedir = options->CacheDirectory;
+  const char *tmpdir = getenv("TMPDIR");
+  char *dir = NULL, *fn;
+  smartlist_t *digests = smartlist_new();
+  char *mds = NULL;
+  pid_t pid;
+
+  tor_asprintf(&dir, "%s"PATH_SEPARATOR"tor-bench-md-cache-%d",
+               tmpdir ? tmpdir : "/tmp", (int)getpid());
+  if (check_private_dir(dir, CPD_CREATE, NULL) < 0) {
+    printf("Couldn't create %s\n", dir);
+    goto done;
+  }
+  options->CacheDirectory = dir;
+
+  mds = bench_make_mds(N_MDS, digests);
+
+  /* Write the cache in another process, so that the loads below don't start
+   * with a heap full of freed microdescs. */
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    smartlist_t *added =
+      microdescs_add_to_cache(get_microdesc_cache(), mds, NULL,
+                              SAVED_NOWHERE, 0, time(NULL), NULL);
+    tor_assert(smartlist_len(added) == N_MDS);
+    tor_assert(microdesc_cache_rebuild(NULL, 1) == 0);
+    _exit(0);
+  } else if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+
+  printf("Loading %d microdescriptors:\n", N_MDS);
+  bench_md_cache_load("from the index", NULL);
+  bench_md_cache_load("from the index, then using all", digests);
+  fn = get_cachedir_fname("cached-microdescs.idx");
+  write_str_to_file(fn, "", 1);
+  tor_free(fn);
+  bench_md_cache_load("parsing the whole file", NULL);
+
+  fn = get_cachedir_fname("cached-microdescs");
+  unlink(fn);
+  tor_free(fn);
+  fn = get_cachedir_fname("cached-microdescs.new");
+  unlink(fn);
+  tor_free(fn);
+  fn = get_cachedir_fname("cached-microdescs.idx");
+  unlink(fn);
+  tor_free(fn);
+  rmdir(dir);
+
+ done:
+  options->CacheDirectory = old_cachedir;
+  SMARTLIST_FOREACH(digests, char *, cp, tor_free(cp));
+  smartlist_free(digests);
+  tor_free(mds);
+  tor_free(dir);
+}
+
+/** Send <b>n_rounds</b> copies of the <b>len</b>-byte file <b>fname</b> to a
+ * child process that discards them, over a socketpair.  If
+ * <b>use_sendfile</b>, hand the file to the kernel as the DirPort spooling
+ * code does; otherwise copy it through a buf_t in 8 KB chunks, as we do for
+ * encrypted connections.  Print the throughput, and how many bytes we sent
+ * per second of the sender's CPU time. */
+static void
+bench_dir_spool_send(const char *label, const char *fname, size_t len,
+                     int n_rounds, int use_sendfile)
+{
+  const size_t CHUNK = 8192, BUF_MIN = 16384, MAX_WRITE = 65536;
+  tor_socket_t fds[2];
+  monotime_t start, end;
+  uint64_t cpu_start, cpu_end;
+  uint64_t total = 0;
+  pid_t pid;
+  int r;
+
+  tor_assert(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    char sink[65536];
+    tor_close_socket(fds[0]);
+    while (recv(fds[1], sink, sizeof(sink), 0) > 0)
+      ;
+    _exit(0);
+  }
+  tor_close_socket(fds[1]);
+
+  reset_perftime();
+  monotime_get(&start);
+  cpu_start = perftime();
+  for (r = 0; r < n_rounds; ++r) {
+    if (use_sendfile) {
+      int fd = tor_open_cloexec(fname, O_RDONLY, 0);
+      uint64_t off = 0;
+      tor_assert(fd >= 0);
+      while (off < len) {
+        ssize_t n = tor_socket_sendfile(fds[0], fd, &off,
+                                        MIN(MAX_WRITE, len - off));
+        tor_assert(n > 0);
+        total += n;
+      }
+      close(fd);
+    } else {
+      tor_mmap_t *map = tor_mmap_file(fname);
+      buf_t *buf = buf_new();
+      size_t off = 0;
+      tor_assert(map);
+      while (off < len || buf_datalen(buf)) {
+        while (off < len && buf_datalen(buf) < BUF_MIN) {
+          size_t n = MIN(CHUNK, len - off);
+          buf_add(buf, map->data + off, n);
+          off += n;
+        }
+        int n = buf_flush_to_socket(buf, fds[0],
+                                    MIN(MAX_WRITE, buf_datalen(buf)));
+        tor_assert(n > 0);
+        total += n;
+      }
+      buf_free(buf);
+      tor_munmap_file(map);
+    }
+  }
+  cpu_end = perftime();
+  monotime_get(&end);
+
+  tor_close_socket(fds[0]);
+  waitpid(pid, NULL, 0);
+
+  double secs = monotime_diff_usec(&start, &end) / 1e6;
+  double cpu_secs = (cpu_end - cpu_start) / 1e9;
+  printf("%-10s %8.1f MB/sec, %8.1f MB per sender CPU-second\n", label,
+         total / secs / 1e6, cpu_secs > 0 ? total / cpu_secs / 1e6 : 0.0);
+}
+
+/** Compare spooling a large consensus cache file to a DirPort connection by
+ * copying it, and by handing it to the kernel with sendfile(). */
+static void
+bench_dir_spool(void)
+{
+  const size_t LEN = 4 << 20;
+  const int N_ROUNDS = 64;
+  const char *tmpdir = getenv("TMPDIR");
+  char *fname = NULL;
+  char *data = tor_malloc(LEN);
+
+  if (!tor_socket_sendfile_supported()) {
+    puts("sendfile() is not supported here.");
+    goto done;
+  }
+  tor_asprintf(&fname, "%s"PATH_SEPARATOR"tor-bench-dir-spool-%d",
+               tmpdir ? tmpdir : "/tmp", (int)getpid());
+  crypto_rand(data, LEN);
+  if (write_bytes_to_file(fname, data, LEN, 1) < 0) {
+    printf("Couldn't write %s\n", fname);
+    goto done;
+  }
+
+  printf("Sending %d copies of a %d MB file:\n", N_ROUNDS, (int)(LEN>>20));
+  bench_dir_spool_send("copying", fname, LEN, N_ROUNDS, 0);
+  bench_dir_spool_send("sendfile", fname, LEN, N_ROUNDS, 1);
+  unlink(fname);
+
+ done:
+  tor_free(fname);
+  tor_free(data);
+}
+
+/** Reset this process's peak RSS, if we can, and return its current RSS in
+ * KB, or -1 if we can't tell. */
+static long
+bench_reset_peak_rss_kb(void)
+{
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if (f) {
+    fputs("5", f);
+    fclose(f);
+  }
+#endif /* defined(__linux__) */
+  return bench_rss_kb();
+}
+
+/** Return the peak RSS of this process in KB, or -1 if we can't tell. */
+static long
+bench_peak_rss_kb(void)
+{
+#ifdef __linux__
+  char line[128];
+  long kb = -1;
+  FILE *f = fopen("/proc/self/status", "r");
+  if (!f)
+    return -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+      break;
+  }
+  fclose(f);
+  return kb;
+#else
+  return -1;
+#endif /* defined(__linux__) */
+}
+
+/** In a child process, feed <b>headers</b> and then the <b>compressed_len</b>
+ * bytes of <b>compressed</b> to a directory download connection with
+ * <b>purpose</b> for <b>resource</b>, <b>step</b> bytes at a time, as if
+ * they were arriving from the network; then close it.  If <b>streaming</b>
+ * is false, make the connection wait for EOF as it used to.  Report how much
+ * work was left at EOF, how much the RSS grew at its peak, and, if
+ * <b>digests</b> is set, when the first and last of those microdescriptors
+ * became usable. */
+static void
+bench_dir_stream_fetch(const char *label, int streaming, uint8_t purpose,
+                       const char *headers, const char *resource,
+                       const char *compressed, size_t compressed_len,
+                       size_t step, const smartlist_t *digests)
+{
+  pid_t pid;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    const char *first = digests ? smartlist_get(digests, 0) : NULL;
+    dir_connection_t *conn = dir_connection_new(AF_INET);
+    monotime_t start, first_usable, eof, end;
+    bool have_first = false;
+    long rss0, peak;
+    size_t off;
+
+    TO_CONN(conn)->purpose = purpose;
+    TO_CONN(conn)->state = DIR_CONN_STATE_CLIENT_READING;
+    conn->requested_resource = tor_strdup(resource);
+    memset(conn->identity_digest, 'D', DIGEST_LEN);
+    conn->client_stream_declined = !streaming;
+    tor_init_connection_lists();
+    get_microdesc_cache();
+
+    rss0 = bench_reset_peak_rss_kb();
+    monotime_get(&start);
+    buf_add(TO_CONN(conn)->inbuf, headers, strlen(headers));
+    for (off = 0; off < compressed_len; off += step) {
+      buf_add(TO_CONN(conn)->inbuf, compressed + off,
+              MIN(step, compressed_len - off));
+      tor_assert(connection_dir_process_inbuf(conn) == 0);
+      if (first && !have_first &&
+          microdesc_cache_lookup_by_digest256(NULL, first)) {
+        monotime_get(&first_usable);
+        have_first = true;
+      }
+    }
+    monotime_get(&eof);
+    TO_CONN(conn)->inbuf_reached_eof = 1;
+    /* (Our made-up consensus won't load, but we've done the work by the
+     * time we find that out.) */
+    connection_dir_reached_eof(conn);
+    monotime_get(&end);
+    peak = bench_peak_rss_kb();
+
+    printf("%-10s %7.2f msec after EOF", label,
+           monotime_diff_usec(&eof, &end) / 1000.0);
+    if (digests) {
+      tor_assert(microdesc_cache_lookup_by_digest256(NULL,
+                          smartlist_get(digests, smartlist_len(digests)-1)));
+      if (!have_first)
+        first_usable = end;
+      printf("; first usable after %7.2f msec, all after %7.2f msec",
+             monotime_diff_usec(&start, &first_usable) / 1000.0,
+             monotime_diff_usec(&start, &end) / 1000.0);
+    }
+    if (rss0 >= 0 && peak >= 0)
+      printf("; peak RSS %6ld KB over start", peak - rss0);
+    puts("");
+    fflush(stdout);
+    _exit(0);
+  } else if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+
+  /* Start the next run with an empty cache. */
+  char *fn = get_cachedir_fname("cached-microdescs.new");
+  unlink(fn);
+  tor_free(fn);
+}
+
+/** Compare handling large compressed directory downloads all at once at
+ * EOF, and decompressing (and for microdescriptors, parsing) them as they
+ * arrive. */
+static void
+bench_dir_stream(void)
+{
+  /* The most microdescriptors we'll ask for at once over a tunneled
+   * connection, and about the number of relays in a consensus. */
+  const int N_MDS = 500, N_RELAYS = 7000;
+  or_options_t *options = get_options_mutable();
+  char *old_cachedir = options->CacheDirectory;
+  const char *tmpdir = getenv("TMPDIR");
+  smartlist_t *digests = smartlist_new(), *chunks = smartlist_new();
+  char *dir = NULL, *mds = NULL, *consensus = NULL, *headers = NULL;
+  char *joined = NULL, *resource = NULL, *compressed = NULL;
+  size_t compressed_len = 0;
+  int i;
+
+  tor_asprintf(&dir, "%s"PATH_SEPARATOR"tor-bench-dir-stream-%d",
+               tmpdir ? tmpdir : "/tmp", (int)getpid());
+  if (check_private_dir(dir, CPD_CREATE, NULL) < 0) {
+    printf("Couldn't create %s\n", dir);
+    goto done;
+  }
+  options->CacheDirectory = dir;
+  tor_asprintf(&headers, "HTTP/1.0 200 OK\r\nContent-Encoding: %s\r\n\r\n",
+               compression_method_get_name(ZLIB_METHOD));
+
+  mds = bench_make_mds(N_MDS, digests);
+  SMARTLIST_FOREACH_BEGIN(digests, const char *, d) {
+    char b64[BASE64_DIGEST256_LEN+1];
+    digest256_to_base64(b64, d);
+    smartlist_add_strdup(chunks, b64);
+  } SMARTLIST_FOREACH_END(d);
+  joined = smartlist_join_strings(chunks, "-", 0, NULL);
+  tor_asprintf(&resource, "d/%s", joined);
+  tor_assert(tor_compress(&compressed, &compressed_len, mds, strlen(mds),
+                          ZLIB_METHOD) == 0);
+  printf("Fetching %d microdescriptors (%d KB, %d KB compressed):\n",
+         N_MDS, (int)(strlen(mds) >> 10), (int)(compressed_len >> 10));
+  bench_dir_stream_fetch("at EOF", 0, DIR_PURPOSE_FETCH_MICRODESC,
+                         headers, resource, compressed, compressed_len,
+                         4096, digests);
+  bench_dir_stream_fetch("streaming", 1, DIR_PURPOSE_FETCH_MICRODESC,
+                         headers, resource, compressed, compressed_len,
+                         4096, digests);
+  tor_free(compressed);
+
+  /* Something shaped like a microdesc consensus, though nothing checks
+   * that it is one until we've decompressed all of it. */
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_clear(chunks);
+  smartlist_add_strdup(chunks, "network-status-version 3 microdesc\n");
+  for (i = 0; i < N_RELAYS; ++i) {
+    char id[DIGEST_LEN], md[DIGEST256_LEN];
+    char id_b64[BASE64_DIGEST_LEN+1], md_b64[BASE64_DIGEST256_LEN+1];
+    crypto_rand(id, sizeof(id));
+    crypto_rand(md, sizeof(md));
+    digest_to_base64(id_b64, id);
+    digest256_to_base64(md_b64, md);
+    smartlist_add_asprintf(chunks,
+                   "r Relay%d %s 2020-10-18 04:53:21 10.%d.%d.%d 9001 0\n"
+                   "m %s\n"
+                   "s Fast Guard Running Stable V2Dir Valid\n"
+                   "v Tor 0.4.4.5\n"
+                   "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-5 "
+                   "HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 "
+                   "Padding=1-2 Relay=1-3\n"
+                   "w Bandwidth=%d\n",
+                   i, id_b64, (i >> 16) & 255, (i >> 8) & 255, i & 255,
+                   md_b64, i * 7 % 50000);
+  }
+  consensus = smartlist_join_strings(chunks, "", 0, NULL);
+  tor_assert(tor_compress(&compressed, &compressed_len,
+                          consensus, strlen(consensus), ZLIB_METHOD) == 0);
+  printf("Fetching a consensus of %d relays (%d KB, %d KB compressed):\n",
+         N_RELAYS, (int)(strlen(consensus) >> 10),
+         (int)(compressed_len >> 10));
+  bench_dir_stream_fetch("at EOF", 0, DIR_PURPOSE_FETCH_CONSENSUS,
+                         headers, "microdesc", compressed, compressed_len,
+                         4096, NULL);
+  bench_dir_stream_fetch("streaming", 1, DIR_PURPOSE_FETCH_CONSENSUS,
+                         headers, "microdesc", compressed, compressed_len,
+                         4096, NULL);
+
+  rmdir(dir);
+
+ done:
+  options->CacheDirectory = old_cachedir;
+  SMARTLIST_FOREACH(digests, char *, cp, tor_free(cp));
+  smartlist_free(digests);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(mds);
+  tor_free(consensus);
+  tor_free(compressed);
+  tor_free(headers);
+  tor_free(joined);
+  tor_free(resource);
+  tor_free(dir);
+}
+#endif /* !defined(_WIN32) */
+
+/** Time <b>n</b> parses of the consensus <b>cons</b>, and return the mean
+ * time in msec. */
+static double
+bench_ns_parse_consensus(const char *cons, int n)
+{
+  monotime_t start, end;
+  int i;
+
+  monotime_get(&start);
+  for (i = 0; i < n; ++i) {
+    networkstatus_t *ns =
+      networkstatus_parse_vote_from_string(cons, strlen(cons), NULL,
+                                           NS_TYPE_CONSENSUS);
+    tor_assert(ns);
+    networkstatus_vote_free(ns);
+  }
+  monotime_get(&end);
+  return monotime_diff_usec(&start, &end) / 1000.0 / n;
+}
+
+/** Compare parsing a microdesc consensus about the size of the real one
+ * with and without the cpuworkers. */
+static void
+bench_ns_parse(void)
+{
+  const int N_ENTRIES = 7000, N = 20;
+  smartlist_t *chunks = smartlist_new();
+  char voter_id[HEX_DIGEST_LEN+1], sig[256], *sig64;
+  char *cons;
+  int i;
+
+  crypto_rand(sig, sizeof(sig));
+  base16_encode(voter_id, sizeof(voter_id), sig, DIGEST_LEN);
+  sig64 = tor_malloc(base64_encode_size(sizeof(sig), BASE64_ENCODE_MULTILINE)
+                     + 1);
+  base64_encode(sig64, base64_encode_size(sizeof(sig),
+                                          BASE64_ENCODE_MULTILINE) + 1,
+                sig, sizeof(sig), BASE64_ENCODE_MULTILINE);
+
+  smartlist_add_asprintf(chunks,
+      "network-status-version 3 microdesc\n"
+      "vote-status consensus\n"
+      "consensus-method %d\n"
+      "valid-after 2026-10-18 00:00:00\n"
+      "fresh-until 2026-10-18 01:00:00\n"
+      "valid-until 2026-10-18 03:00:00\n"
+      "voting-delay 300 300\n"
+      "known-flags Exit Fast Guard HSDir Running Stable V2Dir Valid\n"
+      "dir-source bench %s 10.0.0.1 10.0.0.1 80 443\n"
+      "contact nobody\n"
+      "vote-digest %s\n", MAX_SUPPORTED_CONSENSUS_METHOD,
+      voter_id, voter_id);
+  for (i = 0; i < N_ENTRIES; ++i) {
+    char id[DIGEST_LEN], id64[BASE64_DIGEST_LEN+1];
+    char md[DIGEST256_LEN], md64[BASE64_DIGEST256_LEN+1];
+    crypto_rand(md, sizeof(md));
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i));
+    digest_to_base64(id64, id);
+    digest256_to_base64(md64, md);
+    smartlist_add_asprintf(chunks,
+        "r relay%d %s 2026-10-18 00:00:00 10.0.%d.%d 9001 0\n"
+        "a [2001:db8::%x]:9001\n"
+        "m %s\n"
+        "s Fast Guard HSDir Running Stable V2Dir Valid\n"
+        "v Tor 0.4.5.0\n"
+        "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-5 "
+        "HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-3\n"
+        "w Bandwidth=%d\n",
+        i, id64, i / 256, i % 256, i, md64, crypto_rand_int(100000));
+  }
+  smartlist_add_asprintf(chunks,
+      "directory-footer\n"
+      "directory-signature sha256 %s %s\n"
+      "-----BEGIN SIGNATURE-----\n%s"
+      "-----END SIGNATURE-----\n", voter_id, voter_id, sig64);
+  cons = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(sig64);
+
+  printf("%d entries, on the main thread: %.2f msec\n", N_ENTRIES,
+         bench_ns_parse_consensus(cons, N));
+  if (!tor_libevent_is_initialized()) {
+    tor_libevent_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    tor_libevent_initialize(&cfg);
+  }
+  init_keys_client();
+  cpu_init();
+  /* We only shard the consensus when there's more than one CPU. */
+  printf("%d entries, with the cpuworkers on %d CPU(s): %.2f msec\n",
+         N_ENTRIES, get_num_cpus(get_options()),
+         bench_ns_parse_consensus(cons, N));
+
+  tor_free(cons);
+}
+
+/** Time a diff from <b>base</b> to <b>target</b> with <b>engine</b>,
+ * repeated <b>n</b> times.  Return the mean time in usec, and set
+ * *<b>diff_out</b> to the last diff we made. */
+static double
+bench_consdiff_engine(consdiff_engine_t engine, int n,
+                      const char *base, const char *target,
+                      char **diff_out)
+{
+  monotime_t start, end;
+  char *diff = NULL;
+  int i;
+
+  consdiff_set_engine(engine);
+  monotime_get(&start);
+  for (i = 0; i < n; ++i) {
+    tor_free(diff);
+    diff = consensus_diff_generate(base, strlen(base),
+                                   target, strlen(target));
+  }
+  monotime_get(&end);
+  *diff_out = diff;
+  return monotime_diff_usec(&start, &end) / (double)n;
+}
+
+/** Diff <b>base</b> against <b>target</b> <b>n</b> times with each engine,
+ * and print one line comparing their speed and output, headed with
+ * <b>label</b>. */
+static void
+bench_consdiff_compare(const char *label, int n,
+                       const char *base, const char *target)
+{
+  char *lcs_diff = NULL, *myers_diff = NULL;
+  double lcs_usec, myers_usec;
+
+  lcs_usec = bench_consdiff_engine(CONSDIFF_ENGINE_LCS, n,
+                                   base, target, &lcs_diff);
+  myers_usec = bench_consdiff_engine(CONSDIFF_ENGINE_MYERS, n,
+                                     base, target, &myers_diff);
+  if (!lcs_diff || !myers_diff) {
+    printf("%-24s (no diff)\n", label);
+  } else {
+    printf("%-24s %10.2f %10.2f %10lu %10lu  %s\n", label,
+           lcs_usec / 1000.0, myers_usec / 1000.0,
+           (unsigned long)strlen(lcs_diff),
+           (unsigned long)strlen(myers_diff),
+           strcmp(lcs_diff, myers_diff) ? "no" : "yes");
+  }
+  tor_free(lcs_diff);
+  tor_free(myers_diff);
+  consdiff_set_engine(CONSDIFF_ENGINE_MYERS);
+}
+
+/** Print the column headings for bench_consdiff_compare(). */
+static void
+bench_consdiff_print_header(void)
+{
+  printf("%-24s %10s %10s %10s %10s  %s\n", "", "lcs_msec", "myers_msec",
+         "lcs_size", "myers_size", "identical");
+}
+
+/** Fake router entry for bench_consdiff(). */
+typedef struct bench_consdiff_router_t {
+  uint8_t id[DIGEST_LEN];
+  uint8_t desc_serial;
+  uint32_t bw;
+  int flags;
+} bench_consdiff_router_t;
+
+static int
+bench_consdiff_router_cmp(const void **a, const void **b)
+{
+  const bench_consdiff_router_t *r1 = *a, *r2 = *b;
+  return fast_memcmp(r1->id, r2->id, DIGEST_LEN);
+}
+
+/** Return a new fake relay for bench_consdiff(). */
+static bench_consdiff_router_t *
+bench_consdiff_router_new(void)
+{
+  bench_consdiff_router_t *r = tor_malloc_zero(sizeof(*r));
+  crypto_rand((char *)r->id, DIGEST_LEN);
+  r->bw = crypto_rand_int(100000);
+  r->flags = crypto_rand_int(4);
+  return r;
+}
+
+/** Return a newly allocated fake consensus, with one entry for each
+ * bench_consdiff_router_t in <b>routers</b>, which must be sorted by
+ * identity.  The consensus is only good enough for the diff code. */
+static char *
+bench_consdiff_make_consensus(const smartlist_t *routers, int serial)
+{
+  static const char *flags[] = {
+    "Fast Running Valid", "Fast Guard Running Stable Valid",
+    "Exit Fast Running V2Dir Valid",
+    "Exit Fast Guard HSDir Running Stable V2Dir Valid",
+  };
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+
+  smartlist_add_asprintf(chunks, "network-status-version 3\n"
+                         "vote-status consensus\n"
+                         "consensus-method 30\n"
+                         "valid-after 2026-10-18 %02d:00:00\n"
+                         "fresh-until 2026-10-18 %02d:00:00\n"
+                         "known-flags Exit Fast Guard HSDir Running Stable "
+                         "V2Dir Valid\n", serial % 24, (serial + 1) % 24);
+  SMARTLIST_FOREACH_BEGIN(routers, const bench_consdiff_router_t *, r) {
+    char id[BASE64_DIGEST_LEN+1], d[BASE64_DIGEST_LEN+1];
+    uint8_t desc[DIGEST_LEN];
+    digest_to_base64(id, (const char *)r->id);
+    memcpy(desc, r->id, DIGEST_LEN);
+    desc[0] ^= r->desc_serial;
+    digest_to_base64(d, (const char *)desc);
+    smartlist_add_asprintf(chunks,
+                           "r relay%02x%02x %s %s 2026-10-18 00:00:00 "
+                           "10.%d.%d.%d 9001 0\n"
+                           "s %s\n"
+                           "v Tor 0.4.5.0\n"
+                           "pr Cons=1-2 Desc=1-2 DirCache=2 HSDir=2 "
+                           "Link=1-5 Relay=1-3\n"
+                           "w Bandwidth=%u\n"
+                           "p reject 1-65535\n",
+                           r->id[0], r->id[1], id, d,
+                           r->id[0], r->id[1], r->id[2],
+                           flags[r->flags], r->bw);
+  } SMARTLIST_FOREACH_END(r);
+  smartlist_add_asprintf(chunks, "directory-footer\n"
+                         "bandwidth-weights Wbd=0 Wbe=0 Wbg=4000\n"
+                         "directory-signature %d\n"
+                         "-----BEGIN SIGNATURE-----\n"
+                         "-----END SIGNATURE-----\n", serial);
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Return a newly allocated document of <b>n_lines</b> lines with no router
+ * entries, in which each line differs from <b>base</b> (if provided) with
+ * probability 1/<b>one_in</b>. */
+static char *
+bench_consdiff_make_flat(int n_lines, const char *base, int one_in)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+  int i;
+
+  if (base)
+    smartlist_split_string(lines, base, "\n", 0, 0);
+  for (i = 0; i < n_lines; ++i) {
+    if (!base) {
+      smartlist_add_asprintf(lines, "line %d", i);
+    } else if (crypto_rand_int(one_in) == 0) {
+      tor_free(lines->list[i]);
+      lines->list[i] = tor_strdup("changed");
+    }
+  }
+  result = smartlist_join_strings(lines, "\n", 1, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Compare the consensus diff engines on a series of fake consensuses, in
+ * which a few relays come and go and many change their bandwidth, flags, or
+ * descriptor every hour, roughly like the real network; and on one large
+ * section with no router entries, which is the worst case for the LCS
+ * engine.  "bench consdiff FILE..." does the same for real consensuses. */
+static void
+bench_consdiff(void)
+{
+  const int N_ROUTERS = 7000, N_HOURS = 6;
+  smartlist_t *routers = smartlist_new();
+  char *first, *cons = NULL;
+  int i, hour;
+
+  for (i = 0; i < N_ROUTERS; ++i)
+    smartlist_add(routers, bench_consdiff_router_new());
+  smartlist_sort(routers, bench_consdiff_router_cmp);
+  first = bench_consdiff_make_consensus(routers, 0);
+
+  bench_consdiff_print_header();
+  for (hour = 1; hour <= N_HOURS; ++hour) {
+    char label[32];
+
+    SMARTLIST_FOREACH_BEGIN(routers, bench_consdiff_router_t *, r) {
+      const int roll = crypto_rand_int(100);
+      if (roll < 2) {
+        SMARTLIST_DEL_CURRENT_KEEPORDER(routers, r);
+        tor_free(r);
+      } else if (roll < 7) {
+        ++r->desc_serial;
+      } else if (roll < 30) {
+        r->bw = crypto_rand_int(100000);
+      } else if (roll < 33) {
+        r->flags = crypto_rand_int(4);
+      }
+    } SMARTLIST_FOREACH_END(r);
+    for (i = 0; i < N_ROUTERS / 50; ++i)
+      smartlist_add(routers, bench_consdiff_router_new());
+    smartlist_sort(routers, bench_consdiff_router_cmp);
+    tor_free(cons);
+    cons = bench_consdiff_make_consensus(routers, hour);
+
+    tor_snprintf(label, sizeof(label), "%d hour(s) old", hour);
+    bench_consdiff_compare(label, 3, first, cons);
+  }
+  tor_free(first);
+  tor_free(cons);
+
+  /* Just under the largest section that gen_ed_diff() will accept. */
+  first = bench_consdiff_make_flat(9000, NULL, 0);
+  cons = bench_consdiff_make_flat(9000, first, 100);
+  bench_consdiff_compare("9000 lines, 1% changed", 1, first, cons);
+
+  SMARTLIST_FOREACH(routers, bench_consdiff_router_t *, r, tor_free(r));
+  smartlist_free(routers);
+  tor_free(first);
+  tor_free(cons);
+}
+
+/** Choose <b>n</b> nodes with <b>flags</b>, never choosing any node in
+ * <b>excluded</b>, the way router_choose_random_node() did before it had
+ * precomputed tables: by building the list of candidates every time. */
+static void
+bench_node_select_linear(int n, const smartlist_t *excluded,
+                         router_crn_flags_t flags)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    smartlist_t *sl = smartlist_new();
+    router_add_running_nodes_to_smartlist(sl, flags);
+    smartlist_subtract(sl, excluded);
+    tor_assert(node_sl_choose_by_bandwidth(sl, WEIGHT_FOR_MID));
+    smartlist_free(sl);
+  }
+}
+
+/** Compare choosing weighted random nodes from a consensus-sized nodelist
+ * by building the list of candidates each time, and by drawing from a
+ * precomputed alias table. */
+static void
+bench_node_select(void)
+{
+  const int N_RELAYS = 7000, N_LINEAR = 1000, N_TABLE = 200000;
+  const router_crn_flags_t flags = CRN_NEED_UPTIME|CRN_NEED_CAPACITY;
+  smartlist_t *excluded = smartlist_new();
+  uint64_t start, end;
+  int i;
+
+  /* Without a consensus, we believe what the descriptors say. */
+  for (i = 0; i < N_RELAYS; ++i) {
+    routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+    const char *msg = NULL;
+    node_t *node;
+    ri->cache_info.routerlist_index = -1;
+    crypto_rand(ri->cache_info.identity_digest, DIGEST_LEN);
+    crypto_rand(ri->cache_info.signed_descriptor_digest, DIGEST_LEN);
+    ri->cache_info.published_on = approx_time();
+    ri->cert_expiration_time = approx_time() + 86400;
+    ri->purpose = ROUTER_PURPOSE_GENERAL;
+    tor_asprintf(&ri->nickname, "Relay%d", i);
+    tor_addr_from_ipv4h(&ri->ipv4_addr, 0x0a000000 + i);
+    ri->ipv4_orport = 9001;
+    ri->onion_curve25519_pkey =
+      tor_malloc_zero(sizeof(curve25519_public_key_t));
+    crypto_rand((char *)ri->onion_curve25519_pkey->public_key,
+                CURVE25519_PUBKEY_LEN);
+    ri->bandwidthrate = ri->bandwidthcapacity = 1000 + (i * 7919) % 200000;
+    tor_assert(router_add_to_routerlist(ri, &msg, 1, 0) ==
+               ROUTER_ADDED_SUCCESSFULLY);
+    node = node_get_mutable_by_id(ri->cache_info.identity_digest);
+    node->is_running = node->is_valid = 1;
+    node->is_fast = node->is_stable = (i % 5) != 0;
+    /* Roughly what a circuit excludes: the other hops. */
+    if (i % 2000 == 1)
+      smartlist_add(excluded, node);
+  }
+  router_dir_info_changed();
+
+  reset_perftime();
+  start = perftime();
+  bench_node_select_linear(N_LINEAR, excluded, flags);
+  end = perftime();
+  printf("Choosing from %d nodes, building the list each time: "
+         "%.2f usec/node\n",
+         N_RELAYS, NANOCOUNT(start, end, N_LINEAR)/1e3);
+
+  node_select_tables_clear();
+  start = perftime();
+  tor_assert(router_choose_random_node(excluded, NULL, flags));
+  end = perftime();
+  printf("Building a table for %d nodes: %.2f usec\n",
+         N_RELAYS, NANOCOUNT(start, end, 1)/1e3);
+
+  start = perftime();
+  for (i = 0; i < N_TABLE; ++i)
+    tor_assert(router_choose_random_node(excluded, NULL, flags));
+  end = perftime();
+  printf("Choosing from %d nodes with a table: %.2f usec/node\n",
+         N_RELAYS, NANOCOUNT(start, end, N_TABLE)/1e3);
+
+  routerlist_free_all();
+  nodelist_free_all();
+  smartlist_free(excluded);
+}
+
+/** Check <b>n</b> addresses and ports against <b>policy</b> and against
+ * its compiled form, and print how long each took. */
+static void
+bench_exit_policy_one(const char *name, const smartlist_t *policy,
+                      const tor_addr_t *addrs, const uint16_t *ports, int n)
+{
+  const int N_ROUNDS = 50;
+  compiled_policy_t *cp;
+  uint64_t start, end;
+  int i, j, n_accepted = 0, n_accepted_compiled = 0;
+
+  start = perftime();
+  cp = addr_policy_compile(policy);
+  end = perftime();
+  printf("%s (%d entries): compiled in %.2f usec\n", name,
+         smartlist_len(policy), NANOCOUNT(start, end, 1)/1e3);
+
+  start = perftime();
+  for (j = 0; j < N_ROUNDS; ++j) {
+    for (i = 0; i < n; ++i)
+      n_accepted += compare_tor_addr_to_addr_policy(&addrs[i], ports[i],
+                                   policy) == ADDR_POLICY_ACCEPTED;
+  }
+  end = perftime();
+  printf("  list:     %.2f nsec/lookup\n", NANOCOUNT(start, end, n*N_ROUNDS));
+
+  start = perftime();
+  for (j = 0; j < N_ROUNDS; ++j) {
+    for (i = 0; i < n; ++i)
+      n_accepted_compiled += compare_tor_addr_to_compiled_policy(&addrs[i],
+                                   ports[i], cp) == ADDR_POLICY_ACCEPTED;
+  }
+  end = perftime();
+  printf("  compiled: %.2f nsec/lookup\n", NANOCOUNT(start, end, n*N_ROUNDS));
+
+  tor_assert(n_accepted == n_accepted_compiled);
+  compiled_policy_free(cp);
+}
+
+/** Compare checking exit streams against the default and reduced exit
+ * policies, and against a long reject-list, with and without compiling
+ * them. */
+static void
+bench_exit_policy(void)
+{
+  const int N_QUERIES = 4096, N_REJECTS = 5000;
+  static const uint16_t common_ports[] = { 80, 443, 22, 25, 6667, 8080 };
+  tor_addr_t *addrs = tor_calloc(N_QUERIES, sizeof(tor_addr_t));
+  uint16_t *ports = tor_calloc(N_QUERIES, sizeof(uint16_t));
+  smartlist_t *policy = NULL, *rejects = smartlist_new();
+  config_line_t line;
+  int i;
+
+  for (i = 0; i < N_QUERIES; ++i) {
+    tor_addr_from_ipv4h(&addrs[i], crypto_rand_int(2) ?
+                        0x50000000u + crypto_rand_int(1<<20) :
+                        (uint32_t)crypto_rand_uint64(UINT32_MAX));
+    ports[i] = crypto_rand_int(4) ?
+      common_ports[crypto_rand_int(ARRAY_LENGTH(common_ports))] :
+      1 + crypto_rand_int(65535);
+  }
+
+  reset_perftime();
+  tor_assert(!policies_parse_exit_policy(NULL, &policy,
+                                         EXIT_POLICY_IPV6_ENABLED |
+                                         EXIT_POLICY_REJECT_PRIVATE |
+                                         EXIT_POLICY_ADD_DEFAULT, NULL));
+  bench_exit_policy_one("Default exit policy", policy, addrs, ports,
+                        N_QUERIES);
+  addr_policy_list_free(policy);
+  policy = NULL;
+
+  tor_assert(!policies_parse_exit_policy(NULL, &policy,
+                                         EXIT_POLICY_IPV6_ENABLED |
+                                         EXIT_POLICY_REJECT_PRIVATE |
+                                         EXIT_POLICY_ADD_REDUCED, NULL));
+  bench_exit_policy_one("Reduced exit policy", policy, addrs, ports,
+                        N_QUERIES);
+  addr_policy_list_free(policy);
+  policy = NULL;
+
+  /* A reject-list of single addresses and /24s, some of them near the
+   * addresses that we check, before the reduced exit policy. */
+  for (i = 0; i < N_REJECTS; ++i) {
+    uint32_t a = (i % 2) ? 0x50000000u + crypto_rand_int(1<<20) :
+      (uint32_t)crypto_rand_uint64(UINT32_MAX);
+    smartlist_add_asprintf(rejects, "reject %d.%d.%d.%d%s:*",
+                           (int)(a >> 24), (int)((a >> 16) & 0xff),
+                           (int)((a >> 8) & 0xff),
+                           (i % 3) ? (int)(a & 0xff) : 0,
+                           (i % 3) ? "" : "/24");
+  }
+  memset(&line, 0, sizeof(line));
+  line.key = (char *)"ExitPolicy";
+  line.value = smartlist_join_strings(rejects, ",", 0, NULL);
+  tor_assert(!policies_parse_exit_policy(&line, &policy,
+                                         EXIT_POLICY_IPV6_ENABLED |
+                                         EXIT_POLICY_REJECT_PRIVATE |
+                                         EXIT_POLICY_ADD_REDUCED, NULL));
+  bench_exit_policy_one("Reject-list exit policy", policy, addrs, ports,
+                        N_QUERIES);
+  addr_policy_list_free(policy);
+
+  tor_free(line.value);
+  SMARTLIST_FOREACH(rejects, char *, cp, tor_free(cp));
+  smartlist_free(rejects);
+  tor_free(addrs);
+  tor_free(ports);
+}
+
+#ifdef HAVE_IO_URING
+static int bench_uring_n_done = 0;
+
+static void
+bench_uring_cb(tor_uring_req_t *req, int result, const uint8_t *data)
+{
+  (void)req;
+  (void)data;
+  if (result > 0)
+    ++bench_uring_n_done;
+}
+
+/** Compare reading from many ready sockets one recv() at a time with
+ * reading from them through a single io_uring submission. */
+static void
+bench_uring_io(void)
+{
+  const int N_SOCKS = 128, N_ROUNDS = 200, MSG_LEN = 512;
+  tor_socket_t fds[128][2];
+  tor_uring_req_t reqs[128];
+  char buf[16384];
+  uint64_t start, end;
+  tor_uring_t *ring;
+  int i, r;
+
+  if (!tor_uring_is_supported()) {
+    puts("io_uring is not supported here.");
+    return;
+  }
+  ring = tor_uring_new(256, 256, sizeof(buf));
+  tor_assert(ring);
+  memset(buf, 'x', sizeof(buf));
+  for (i = 0; i < N_SOCKS; ++i) {
+    tor_assert(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) == 0);
+    set_socket_nonblocking(fds[i][0]);
+    reqs[i].cb = bench_uring_cb;
+    reqs[i].arg = NULL;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (r = 0; r < N_ROUNDS; ++r) {
+    for (i = 0; i < N_SOCKS; ++i)
+      tor_assert(write(fds[i][1], buf, MSG_LEN) == MSG_LEN);
+    for (i = 0; i < N_SOCKS; ++i)
+      tor_assert(recv(fds[i][0], buf, sizeof(buf), 0) == MSG_LEN);
+  }
+  end = perftime();
+  printf("recv() per socket: %.2f nsec per read\n",
+         NANOCOUNT(start, end, N_ROUNDS * N_SOCKS));
+
+  reset_perftime();
+  start = perftime();
+  for (r = 0; r < N_ROUNDS; ++r) {
+    for (i = 0; i < N_SOCKS; ++i)
+      tor_assert(write(fds[i][1], buf, MSG_LEN) == MSG_LEN);
+    for (i = 0; i < N_SOCKS; ++i)
+      tor_assert(tor_uring_prep_recv(ring, &reqs[i], fds[i][0],
+                                     sizeof(buf)) == 0);
+    bench_uring_n_done = 0;
+    tor_uring_submit(ring, N_SOCKS);
+    while (bench_uring_n_done < N_SOCKS) {
+      if (tor_uring_process_completions(ring) == 0)
+        tor_uring_submit(ring, 1);
+    }
+  }
+  end = perftime();
+  printf("io_uring, one submission per round: %.2f nsec per read\n",
+         NANOCOUNT(start, end, N_ROUNDS * N_SOCKS));
+
+  for (i = 0; i < N_SOCKS; ++i) {
+    tor_close_socket(fds[i][0]);
+    tor_close_socket(fds[i][1]);
+  }
+  tor_uring_free(ring);
+}
+#endif /* defined(HAVE_IO_URING) */
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -759,7 +2557,13 @@ static struct benchmark_t benchmarks[] = {
   ENT(rand),
 
   ENT(cell_aes),
+  ENT(cell_aes_batch),
   ENT(cell_ops),
+  ENT(cell_ops_batch),
+  ENT(cell_pipeline),
+  ENT(workqueue),
+  ENT(workqueue_wakeups),
+  ENT(cmux_ewma),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -768,9 +2572,50 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+#ifndef _WIN32
+  ENT(md_cache),
+  ENT(dir_spool),
+  ENT(dir_stream),
+#endif
+  ENT(ns_parse),
+  ENT(consdiff),
+  ENT(node_select),
+  ENT(exit_policy),
+#ifdef HAVE_IO_URING
+  ENT(uring_io),
+#endif
   {NULL,NULL,0}
 };
 
+/** Compare our consensus diff engines on each pair of consecutive
+ * consensuses in <b>files</b>, which should be listed oldest first. */
+static int
+bench_consdiff_files(int n_files, const char **files)
+{
+  char *base = NULL, *target = NULL;
+  int i;
+
+  base = read_file_to_str(files[0], RFTS_BIN, NULL);
+  if (!base) {
+    perror(files[0]);
+    return 1;
+  }
+  bench_consdiff_print_header();
+  for (i = 1; i < n_files; ++i) {
+    target = read_file_to_str(files[i], RFTS_BIN, NULL);
+    if (!target) {
+      perror(files[i]);
+      tor_free(base);
+      return 1;
+    }
+    bench_consdiff_compare(files[i], 5, base, target);
+    tor_free(base);
+    base = target;
+  }
+  tor_free(base);
+  return 0;
+}
+
 static benchmark_t *
 find_benchmark(const char *name)
 {
@@ -820,6 +2665,10 @@ main(int argc, const char **argv)
     return 0;
   }
 
+  if (argc >= 4 && !strcmp(argv[1], "consdiff")) {
+    return bench_consdiff_files(argc - 2, argv + 2);
+  }
+
   for (i = 1; i < argc; ++i) {
     if (!strcmp(argv[i], "--list")) {
       list = 1;
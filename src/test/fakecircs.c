@@ -18,6 +18,7 @@
 #include "core/or/circuitlist.h"
 #include "core/or/circuitpadding.h"
 #include "core/or/crypt_path.h"
+#include "core/or/oom_age.h"
 #include "core/or/relay.h"
 #include "core/or/relay_crypto_st.h"
 
@@ -86,6 +87,7 @@ free_fake_orcirc(or_circuit_t *orcirc)
   if (circ->n_chan && circ->n_chan->cmux) {
     circuitmux_detach_circuit(circ->n_chan->cmux, circ);
   }
+  oom_age_index_remove(&circ->oom_age_entry);
 
   tor_free_(circ);
 }
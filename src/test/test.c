@@ -35,10 +35,12 @@
 #define CIRCUITLIST_PRIVATE
 #define MAINLOOP_PRIVATE
 #define STATEFILE_PRIVATE
+#define CPUWORKER_PRIVATE
 
 #include "core/or/or.h"
 #include "lib/err/backtrace.h"
 #include "lib/buf/buffers.h"
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitstats.h"
 #include "lib/compress/compress.h"
@@ -49,7 +51,12 @@
 #include "feature/rend/rendcache.h"
 #include "feature/rend/rendparse.h"
 #include "test/test.h"
+#include "test/fakechans.h"
+#include "test/log_test_helpers.h"
 #include "core/mainloop/mainloop.h"
+#include "core/mainloop/cpuworker.h"
+#include "feature/relay/router.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/memarea/memarea.h"
 #include "core/or/onion.h"
 #include "core/crypto/onion_ntor.h"
@@ -355,6 +362,180 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+/** Run unit tests for choosing how many onionskins go to a cpuworker at
+ * once. */
+static void
+test_onion_batch_size(void *arg)
+{
+  (void)arg;
+
+  /* With no more queued work than threads, we don't batch. */
+  tt_int_op(1, OP_EQ, cpuworker_onionskin_batch_size(0, 4, 100));
+  tt_int_op(1, OP_EQ, cpuworker_onionskin_batch_size(1, 4, 100));
+  tt_int_op(1, OP_EQ, cpuworker_onionskin_batch_size(4, 4, 100));
+  /* Past that, we share the queue out among the threads... */
+  tt_int_op(2, OP_EQ, cpuworker_onionskin_batch_size(5, 4, 100));
+  tt_int_op(3, OP_EQ, cpuworker_onionskin_batch_size(12, 4, 100));
+  /* ...up to a limit. */
+  tt_int_op(MAX_ONIONSKIN_BATCH, OP_EQ,
+            cpuworker_onionskin_batch_size(10000, 4, 100));
+  /* We never go past max_pending_tasks. */
+  tt_int_op(2, OP_EQ, cpuworker_onionskin_batch_size(10000, 4, 2));
+  tt_int_op(1, OP_EQ, cpuworker_onionskin_batch_size(10000, 4, 0));
+  /* Nonsense thread counts are treated as one thread. */
+  tt_int_op(3, OP_EQ, cpuworker_onionskin_batch_size(3, 0, 100));
+
+ done:
+  ;
+}
+
+/** Work items that mock_cpuworker_queue_work() has handed out. */
+static int fake_queue_entries[4];
+/** How many times has mock_cpuworker_queue_work() been called? */
+static int n_queue_work_calls = 0;
+/** The argument of the last successful call to mock_cpuworker_queue_work(),
+ * which mock_cpuworker_cancel_work() returns. */
+static void *queued_work_arg = NULL;
+/** If true, mock_cpuworker_queue_work() fails. */
+static int queue_work_should_fail = 0;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)priority;
+  (void)fn;
+  (void)reply_fn;
+  tor_assert(n_queue_work_calls < (int)ARRAY_LENGTH(fake_queue_entries));
+  ++n_queue_work_calls;
+  if (queue_work_should_fail)
+    return NULL;
+  queued_work_arg = arg;
+  return (workqueue_entry_t *) &fake_queue_entries[n_queue_work_calls-1];
+}
+
+static void *
+mock_cpuworker_cancel_work(workqueue_entry_t *ent)
+{
+  void *arg = queued_work_arg;
+  (void)ent;
+  queued_work_arg = NULL;
+  return arg;
+}
+
+/** Run unit tests for cancelling one onionskin out of a batch. */
+static void
+test_cpuworker_cancel_batch(void *arg)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  channel_t *chan = new_fake_channel();
+  or_circuit_t *circs[3] = { NULL, NULL, NULL };
+  uint64_t n_batched;
+  int i;
+  (void)arg;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(cpuworker_cancel_work, mock_cpuworker_cancel_work);
+
+  for (i = 0; i < 3; ++i) {
+    create_cell_t *cc = tor_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(cc, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN, buf);
+    circs[i] = or_circuit_new(0, NULL);
+    TO_CIRCUIT(circs[i])->purpose = CIRCUIT_PURPOSE_OR;
+    circs[i]->p_chan = chan;
+    tt_int_op(0, OP_EQ, onion_pending_add(circs[i], cc));
+  }
+
+  /* With a single thread, all three go to the cpuworkers in one batch. */
+  queue_pending_tasks();
+  tt_int_op(n_queue_work_calls, OP_EQ, 1);
+  for (i = 0; i < 3; ++i)
+    tt_ptr_op(circs[i]->workqueue_entry, OP_EQ, &fake_queue_entries[0]);
+  n_batched = cpuworker_get_n_onionskins_batched(ONION_HANDSHAKE_TYPE_NTOR);
+  tt_u64_op(n_batched, OP_EQ, 3);
+
+  /* Cancelling one of them sends the other two off again, without counting
+   * them twice. */
+  cpuworker_cancel_circ_handshake(circs[1]);
+  tt_int_op(n_queue_work_calls, OP_EQ, 2);
+  tt_ptr_op(circs[1]->workqueue_entry, OP_EQ, NULL);
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, &fake_queue_entries[1]);
+  tt_ptr_op(circs[2]->workqueue_entry, OP_EQ, &fake_queue_entries[1]);
+  tt_u64_op(cpuworker_get_n_onionskins_batched(ONION_HANDSHAKE_TYPE_NTOR),
+            OP_EQ, n_batched);
+  tt_assert(! TO_CIRCUIT(circs[0])->marked_for_close);
+  tt_assert(! TO_CIRCUIT(circs[2])->marked_for_close);
+
+  /* If we can't send the rest off again, nobody will answer them, so we
+   * close their circuits. */
+  queue_work_should_fail = 1;
+  setup_full_capture_of_logs(LOG_WARN);
+  cpuworker_cancel_circ_handshake(circs[0]);
+  expect_log_msg_containing("Couldn't queue work on threadpool");
+  tt_int_op(n_queue_work_calls, OP_EQ, 3);
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, NULL);
+  tt_ptr_op(circs[2]->workqueue_entry, OP_EQ, NULL);
+  tt_assert(! TO_CIRCUIT(circs[0])->marked_for_close);
+  tt_assert(TO_CIRCUIT(circs[2])->marked_for_close);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(cpuworker_cancel_work);
+  teardown_capture_of_logs();
+  for (i = 0; i < 3; ++i) {
+    if (circs[i])
+      circs[i]->p_chan = NULL;
+  }
+  circuit_free_all();
+  free_fake_channel(chan);
+}
+
+/** Helper for test_cpuworker_run_parallel: square the int at <b>arg</b>. */
+static void
+square_int(void *arg)
+{
+  int *ip = arg;
+  *ip = *ip * *ip;
+}
+
+/** Run unit tests for running independent calls across the cpuworkers. */
+static void
+test_cpuworker_run_parallel(void *arg)
+{
+  int vals[100];
+  void *args[100];
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 100; ++i) {
+    vals[i] = i;
+    args[i] = &vals[i];
+  }
+
+  /* Without cpuworkers, we make every call ourselves. */
+  cpuworker_run_parallel(square_int, args, 10);
+  for (i = 0; i < 10; ++i)
+    tt_int_op(vals[i], OP_EQ, i*i);
+
+  /* With them, every call still happens exactly once. */
+  tt_int_op(0, OP_EQ, init_keys_client());
+  cpu_init();
+  tt_assert(cpuworker_is_initialized());
+  cpuworker_run_parallel(square_int, args + 10, 90);
+  for (i = 10; i < 100; ++i)
+    tt_int_op(vals[i], OP_EQ, i*i);
+
+  /* Nothing to do. */
+  cpuworker_run_parallel(square_int, args, 0);
+  tt_int_op(vals[0], OP_EQ, 0);
+
+ done:
+  ;
+}
+
 static void
 test_circuit_timeout(void *arg)
 {
@@ -656,6 +837,9 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  ENT(onion_batch_size),
+  FORK(cpuworker_run_parallel),
+  FORK(cpuworker_cancel_batch),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
@@ -11,10 +11,16 @@
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/socket.h"
 #include "core/proto/proto_http.h"
 #include "core/proto/proto_socks.h"
 #include "test/test.h"
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
 /** Run unit tests for buffers.c */
 static void
 test_buffers_basic(void *arg)
@@ -858,6 +864,151 @@ test_buffer_peek_startswith(void *arg)
   buf_free(buf);
 }
 
+#ifdef HAVE_SYS_UIO_H
+static void
+test_buffers_iov(void *arg)
+{
+  (void)arg;
+  buf_t *buf = buf_new_with_capacity(256);
+  struct iovec iov[8];
+  char *mem = tor_malloc(8192);
+  char *out = tor_malloc(8192);
+  size_t total, have;
+  int i, n;
+
+  crypto_rand(mem, 8192);
+  buf_add(buf, mem, 100);
+
+  /* Ask for room for 2000 bytes: the first entry is the rest of the tail
+   * chunk, and the others are new chunks. */
+  n = buf_get_space_iov(buf, iov, 8, 2000);
+  tt_int_op(n, OP_GT, 1);
+  total = 0;
+  for (i = 0; i < n; ++i)
+    total += iov[i].iov_len;
+  tt_int_op(total, OP_EQ, 2000);
+  tt_int_op(buf_datalen(buf), OP_EQ, 100);
+
+  /* Only fill part of it: all of the first entry, and a little of the
+   * second. */
+  tt_int_op(iov[0].iov_len, OP_LT, 1900);
+  have = 100 + iov[0].iov_len + 100;
+  memcpy(iov[0].iov_base, mem+100, iov[0].iov_len);
+  memcpy(iov[1].iov_base, mem+100+iov[0].iov_len, 100);
+  buf_commit_space_iov(buf, iov, n, iov[0].iov_len + 100);
+  buf_assert_ok(buf);
+  tt_int_op(buf_datalen(buf), OP_EQ, have);
+  /* The chunks we didn't use are gone again. */
+  tt_ptr_op(buf->head->next, OP_EQ, buf->tail);
+  tt_ptr_op(buf->tail->next, OP_EQ, NULL);
+
+  /* Committing nothing leaves things as they were. */
+  n = buf_get_space_iov(buf, iov, 8, 5000);
+  tt_int_op(n, OP_GT, 0);
+  buf_commit_space_iov(buf, iov, n, 0);
+  buf_assert_ok(buf);
+  tt_int_op(buf_datalen(buf), OP_EQ, have);
+  tt_ptr_op(buf->head->next, OP_EQ, buf->tail);
+
+  /* Now export the data. */
+  n = buf_get_data_iov(buf, iov, 8, 8192);
+  tt_int_op(n, OP_EQ, 2);
+  tt_int_op(iov[0].iov_len + iov[1].iov_len, OP_EQ, have);
+  memcpy(out, iov[0].iov_base, iov[0].iov_len);
+  memcpy(out+iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+  tt_mem_op(out, OP_EQ, mem, have);
+
+  /* With limits on bytes and on entries. */
+  n = buf_get_data_iov(buf, iov, 8, 50);
+  tt_int_op(n, OP_EQ, 1);
+  tt_int_op(iov[0].iov_len, OP_EQ, 50);
+  n = buf_get_data_iov(buf, iov, 1, 8192);
+  tt_int_op(n, OP_EQ, 1);
+  tt_int_op(iov[0].iov_len, OP_LT, have);
+
+  /* And an empty buffer. */
+  buf_clear(buf);
+  tt_int_op(buf_get_data_iov(buf, iov, 8, 1000), OP_EQ, 0);
+  n = buf_get_space_iov(buf, iov, 8, 100);
+  tt_int_op(n, OP_EQ, 1);
+  buf_commit_space_iov(buf, iov, n, 0);
+  tt_ptr_op(buf->head, OP_EQ, NULL);
+  tt_ptr_op(buf->tail, OP_EQ, NULL);
+  buf_assert_ok(buf);
+
+ done:
+  buf_free(buf);
+  tor_free(mem);
+  tor_free(out);
+}
+#endif /* defined(HAVE_SYS_UIO_H) */
+
+/* Move a lot of data across a socketpair, so that each read and write
+ * spans several chunks. */
+static void
+test_buffers_socket_io(void *arg)
+{
+  (void)arg;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *in = buf_new_with_capacity(512);
+  buf_t *out = buf_new_with_capacity(512);
+  const size_t total = 300000;
+  char *mem = tor_malloc(total);
+  char *got = tor_malloc(total);
+  int eof = 0, err = 0, r;
+  int n_rounds = 0;
+
+  crypto_rand(mem, total);
+  /* Add the data in pieces, so it is spread over many chunks. */
+  for (size_t off = 0; off < total; off += 1000)
+    buf_add(out, mem + off, MIN(1000, total - off));
+
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+
+  while (buf_datalen(in) < total && n_rounds++ < 10000) {
+    if (buf_datalen(out)) {
+      r = buf_flush_to_socket(out, fds[0], buf_datalen(out));
+      tt_int_op(r, OP_GE, 0);
+    }
+    r = buf_read_from_socket(in, fds[1], 70000, &eof, &err);
+    tt_int_op(r, OP_GE, 0);
+    tt_int_op(eof, OP_EQ, 0);
+    buf_assert_ok(in);
+    buf_assert_ok(out);
+  }
+  tt_int_op(buf_datalen(out), OP_EQ, 0);
+  tt_int_op(buf_datalen(in), OP_EQ, total);
+  buf_get_bytes(in, got, total);
+  tt_mem_op(got, OP_EQ, mem, total);
+
+  /* Nothing left to read: we should block, not fail. */
+  r = buf_read_from_socket(in, fds[1], 1000, &eof, &err);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 0);
+  buf_assert_ok(in);
+
+  /* And now an EOF. */
+  tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  r = buf_read_from_socket(in, fds[1], 1000, &eof, &err);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 1);
+  tt_int_op(buf_datalen(in), OP_EQ, 0);
+  buf_assert_ok(in);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  buf_free(in);
+  buf_free(out);
+  tor_free(mem);
+  tor_free(got);
+}
+
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
@@ -871,6 +1022,10 @@ struct testcase_t buffer_tests[] = {
     NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
+#ifdef HAVE_SYS_UIO_H
+  { "iov", test_buffers_iov, 0, NULL, NULL },
+#endif
+  { "socket_io", test_buffers_socket_io, TT_FORK, NULL, NULL },
 
   { "compress/zlib", test_buffers_compress, TT_FORK,
     &passthrough_setup, (char*)"deflate" },
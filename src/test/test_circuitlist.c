@@ -18,6 +18,7 @@
 #include "core/or/origin_circuit_st.h"
 
 #include "lib/container/bitarray.h"
+#include "lib/crypt_ops/crypto_rand.h"
 
 static channel_t *
 new_fake_channel(void)
@@ -387,6 +388,63 @@ test_pick_circid(void *arg)
   UNMOCK(channel_dump_statistics);
 }
 
+/** Add and remove many circuit IDs on one channel, in random order, and
+ * make sure that the channel's circuit ID map always agrees with a simple
+ * bitmap, as it grows, shrinks, and shifts entries around. */
+static void
+test_clist_circid_map_churn(void *arg)
+{
+  channel_t *chan = NULL;
+  bitarray_t *ba = NULL;
+  const int N_IDS = 1<<12;
+  int i, n_set = 0;
+  (void)arg;
+
+  chan = new_fake_channel();
+  ba = bitarray_init_zero(N_IDS);
+
+  for (i = 0; i < 40000; ++i) {
+    circid_t id = crypto_rand_int(N_IDS);
+    if (bitarray_is_set(ba, id)) {
+      tt_int_op(circuit_id_in_use_on_channel(id, chan), OP_EQ, 2);
+      channel_mark_circid_usable(chan, id);
+      bitarray_clear(ba, id);
+      --n_set;
+    } else {
+      tt_int_op(circuit_id_in_use_on_channel(id, chan), OP_EQ, 0);
+      channel_mark_circid_unusable(chan, id);
+      bitarray_set(ba, id);
+      ++n_set;
+    }
+    tt_uint_op(chan->circid_map.n_used, OP_EQ, n_set);
+    /* Sweep everything from time to time, so that we notice an entry that
+     * got lost while we shifted or resized. */
+    if (i % 1000 == 0) {
+      circid_t j;
+      for (j = 0; j < (circid_t)N_IDS; ++j) {
+        tt_int_op(circuit_id_in_use_on_channel(j, chan), OP_EQ,
+                  bitarray_is_set(ba, j) ? 2 : 0);
+      }
+    }
+  }
+
+  /* Empty the map; it should give its memory back. */
+  for (i = 0; i < N_IDS; ++i) {
+    if (bitarray_is_set(ba, i))
+      channel_mark_circid_usable(chan, i);
+  }
+  tt_uint_op(chan->circid_map.n_used, OP_EQ, 0);
+  tt_ptr_op(chan->circid_map.ents, OP_EQ, NULL);
+
+ done:
+  if (chan) {
+    circuitmux_free(chan->cmux);
+    channel_clear_circid_map(chan);
+    tor_free(chan);
+  }
+  bitarray_free(ba);
+}
+
 /** Test that the circuit pools of our HS circuitmap are isolated based on
  *  their token type. */
 static void
@@ -468,6 +526,7 @@ struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
+  { "circid_map_churn", test_clist_circid_map_churn, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
     TT_FORK, NULL, NULL },
   END_OF_TESTCASES
@@ -4,9 +4,14 @@
 #define CIRCUITMUX_PRIVATE
 #define CIRCUITMUX_EWMA_PRIVATE
 
+#include <math.h>
+
 #include "core/or/or.h"
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
+#include "app/config/or_options_st.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/time/compat_time.h"
 
 #include "test/fakechans.h"
 #include "test/fakecircs.h"
@@ -185,6 +190,200 @@ test_cmux_ewma_policy_data(void *arg)
   ewma_policy.free_cmux_data(&cmux, pol_data);
 }
 
+static void
+test_cmux_ewma_lazy_policy_data(void *arg)
+{
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t circ; /* garbage */
+  circuitmux_policy_circ_data_t *circ_data = NULL;
+  const ewma_policy_circ_data_t *ewma_data;
+
+  (void) arg;
+
+  pol_data = ewma_lazy_policy.alloc_cmux_data(&cmux);
+  tt_assert(pol_data);
+  tt_uint_op(pol_data->magic, OP_EQ, EWMA_POL_DATA_MAGIC);
+  tt_uint_op(TO_EWMA_POL_DATA(pol_data)->lazy_scaling, OP_EQ, 1);
+
+  circ_data = ewma_lazy_policy.alloc_circ_data(&cmux, pol_data, &circ,
+                                               CELL_DIRECTION_IN, 42);
+  tt_assert(circ_data);
+  ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data);
+  /* No cells yet: the logarithm of zero. */
+  tt_assert(isinf(ewma_data->cell_ewma.cell_count));
+  tt_double_op(ewma_data->cell_ewma.cell_count, OP_LT, 0.0);
+  tt_uint_op(ewma_data->cell_ewma.is_for_p_chan, OP_EQ, 1);
+
+  /* Sending a cell gives it a finite count, which the plain policy would
+   * never need. */
+  ewma_lazy_policy.notify_circ_active(&cmux, pol_data, &circ, circ_data);
+  tt_ptr_op(ewma_lazy_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, &circ);
+  ewma_lazy_policy.notify_xmit_cells(&cmux, pol_data, &circ, circ_data, 1);
+  tt_assert(!isinf(ewma_data->cell_ewma.cell_count));
+  ewma_lazy_policy.notify_circ_inactive(&cmux, pol_data, &circ, circ_data);
+  tt_ptr_op(ewma_lazy_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, NULL);
+
+ done:
+  ewma_lazy_policy.free_circ_data(&cmux, pol_data, &circ, circ_data);
+  ewma_lazy_policy.free_cmux_data(&cmux, pol_data);
+}
+
+static void
+test_cmux_ewma_lazy_log_weight(void *arg)
+{
+  or_options_t options;
+  double w0, w1, fraction;
+  unsigned tick;
+
+  (void) arg;
+
+  memset(&options, 0, sizeof(options));
+  /* A halflife of one tick: each tick doubles a cell's weight. */
+  options.CircuitPriorityHalflife = 10.0;
+  cmux_ewma_set_options(&options, NULL);
+
+  tick = cell_ewma_get_current_tick_and_fraction(&fraction);
+  w0 = cell_ewma_get_log_weight(tick, 0.0);
+  w1 = cell_ewma_get_log_weight(tick + 1, 0.0);
+  tt_double_op(fabs(w1 - w0 - log(2.0)), OP_LT, 1e-9);
+  w1 = cell_ewma_get_log_weight(tick, 0.5);
+  tt_double_op(fabs(w1 - w0 - log(2.0) / 2), OP_LT, 1e-9);
+  /* Ticks before the base are fine too. */
+  w1 = cell_ewma_get_log_weight(tick - 3, 0.0);
+  tt_double_op(fabs(w0 - w1 - 3 * log(2.0)), OP_LT, 1e-9);
+
+  /* Changing the halflife keeps the weight of the current tick, and only
+   * changes how fast it grows from here on. */
+  options.CircuitPriorityHalflife = 20.0;
+  cmux_ewma_set_options(&options, NULL);
+  tt_double_op(fabs(cell_ewma_get_log_weight(tick, 0.0) - w0), OP_LT, 1e-9);
+  w1 = cell_ewma_get_log_weight(tick + 1, 0.0);
+  tt_double_op(fabs(w1 - w0 - log(2.0) / 2), OP_LT, 1e-9);
+
+ done:
+  ;
+}
+
+static void
+test_cmux_ewma_advance_ticks(void *arg)
+{
+  double fraction;
+  unsigned tick;
+
+  (void) arg;
+
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(1000000000);
+  circuitmux_ewma_free_all();
+  cell_ewma_initialize_ticks();
+
+  tick = cell_ewma_get_current_tick_and_fraction(&fraction);
+  cell_ewma_advance_ticks_for_testing(3);
+  tt_uint_op(cell_ewma_get_current_tick_and_fraction(&fraction), OP_EQ,
+             tick + 3);
+  tt_double_op(fraction, OP_LT, 1e-9);
+
+ done:
+  monotime_disable_test_mocking();
+}
+
+/** Feed the same cells, at the same times, to a circuitmux with each EWMA
+ * policy, and make sure that they always pick the same circuit. */
+static void
+test_cmux_ewma_lazy_same_order(void *arg)
+{
+#define N_CIRCS 16
+  circuitmux_t cmux_a, cmux_b; /* garbage */
+  circuitmux_policy_data_t *pol_a = NULL, *pol_b = NULL;
+  circuit_t circs_a[N_CIRCS], circs_b[N_CIRCS]; /* garbage */
+  circuitmux_policy_circ_data_t *cdata_a[N_CIRCS], *cdata_b[N_CIRCS];
+  int active[N_CIRCS];
+  int64_t now_nsec = 1000000000;
+  int i, step, n_active = N_CIRCS;
+
+  (void) arg;
+
+  memset(cdata_a, 0, sizeof(cdata_a));
+  memset(cdata_b, 0, sizeof(cdata_b));
+
+  /* Restart the tick logic at a time we control. */
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(now_nsec);
+  circuitmux_ewma_free_all();
+  cell_ewma_initialize_ticks();
+  cmux_ewma_set_options(NULL, NULL);
+
+  pol_a = ewma_policy.alloc_cmux_data(&cmux_a);
+  pol_b = ewma_lazy_policy.alloc_cmux_data(&cmux_b);
+  for (i = 0; i < N_CIRCS; ++i) {
+    cdata_a[i] = ewma_policy.alloc_circ_data(&cmux_a, pol_a, &circs_a[i],
+                                             CELL_DIRECTION_OUT, 0);
+    cdata_b[i] = ewma_lazy_policy.alloc_circ_data(&cmux_b, pol_b,
+                                                  &circs_b[i],
+                                                  CELL_DIRECTION_OUT, 0);
+    ewma_policy.notify_circ_active(&cmux_a, pol_a, &circs_a[i], cdata_a[i]);
+    ewma_lazy_policy.notify_circ_active(&cmux_b, pol_b, &circs_b[i],
+                                        cdata_b[i]);
+    active[i] = 1;
+  }
+
+  for (step = 0; step < 5000; ++step) {
+    circuit_t *pick_a, *pick_b;
+    unsigned n_cells = 1 + crypto_rand_int(4);
+
+    /* Let up to half a tick go by, so that the plain policy rescales
+     * often. */
+    now_nsec += (1 + crypto_rand_int(5000)) * (int64_t)1000000;
+    monotime_coarse_set_mock_time_nsec(now_nsec);
+
+    /* Sometimes a circuit runs out of cells, or gets more. */
+    i = crypto_rand_int(N_CIRCS);
+    if (crypto_rand_int(4) == 0 && (n_active > 1 || !active[i])) {
+      if (active[i]) {
+        ewma_policy.notify_circ_inactive(&cmux_a, pol_a, &circs_a[i],
+                                         cdata_a[i]);
+        ewma_lazy_policy.notify_circ_inactive(&cmux_b, pol_b, &circs_b[i],
+                                              cdata_b[i]);
+        --n_active;
+      } else {
+        ewma_policy.notify_circ_active(&cmux_a, pol_a, &circs_a[i],
+                                       cdata_a[i]);
+        ewma_lazy_policy.notify_circ_active(&cmux_b, pol_b, &circs_b[i],
+                                            cdata_b[i]);
+        ++n_active;
+      }
+      active[i] = !active[i];
+    }
+
+    pick_a = ewma_policy.pick_active_circuit(&cmux_a, pol_a);
+    pick_b = ewma_lazy_policy.pick_active_circuit(&cmux_b, pol_b);
+    tt_assert(pick_a);
+    tt_assert(pick_b);
+    tt_int_op(pick_a - circs_a, OP_EQ, pick_b - circs_b);
+    i = (int)(pick_a - circs_a);
+    ewma_policy.notify_xmit_cells(&cmux_a, pol_a, pick_a, cdata_a[i],
+                                  n_cells);
+    ewma_lazy_policy.notify_xmit_cells(&cmux_b, pol_b, pick_b, cdata_b[i],
+                                       n_cells);
+  }
+
+ done:
+  for (i = 0; i < N_CIRCS; ++i) {
+    if (cdata_a[i])
+      ewma_policy.free_circ_data(&cmux_a, pol_a, &circs_a[i], cdata_a[i]);
+    if (cdata_b[i])
+      ewma_lazy_policy.free_circ_data(&cmux_b, pol_b, &circs_b[i],
+                                      cdata_b[i]);
+  }
+  ewma_policy.free_cmux_data(&cmux_a, pol_a);
+  ewma_lazy_policy.free_cmux_data(&cmux_b, pol_b);
+  monotime_disable_test_mocking();
+#undef N_CIRCS
+}
+
 static void *
 cmux_ewma_setup_test(const struct testcase_t *tc)
 {
@@ -223,6 +422,10 @@ struct testcase_t circuitmux_ewma_tests[] = {
   TEST_CMUX_EWMA(policy_circ_data),
   TEST_CMUX_EWMA(notify_circ),
   TEST_CMUX_EWMA(xmit_cell),
+  TEST_CMUX_EWMA(lazy_policy_data),
+  TEST_CMUX_EWMA(lazy_log_weight),
+  TEST_CMUX_EWMA(advance_ticks),
+  TEST_CMUX_EWMA(lazy_same_order),
 
   END_OF_TESTCASES
 };
@@ -8,6 +8,8 @@
 #include "test/test.h"
 
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/uring.h"
+#include "lib/net/socket.h"
 
 #include <event2/event.h>
 
@@ -175,11 +177,148 @@ test_compat_libevent_postloop_events(void *arg)
   periodic_timer_free(timed);
 }
 
+#ifdef HAVE_IO_URING
+/** What a uring_test_cb() request saw when it finished. */
+typedef struct uring_test_req_t {
+  tor_uring_req_t req;
+  int n_done;
+  int result;
+  char data[64];
+} uring_test_req_t;
+
+static void
+uring_test_cb(tor_uring_req_t *req, int result, const uint8_t *data)
+{
+  uring_test_req_t *r = req->arg;
+  ++r->n_done;
+  r->result = result;
+  if (data && result > 0)
+    memcpy(r->data, data, MIN((size_t)result, sizeof(r->data)));
+}
+
+/** Submit everything on <b>ring</b> and process completions until
+ * <b>r</b> is done, or until we've waited too many times. */
+static void
+uring_test_wait_for(tor_uring_t *ring, uring_test_req_t *r)
+{
+  int tries = 0;
+  while (!r->n_done && tries++ < 10) {
+    tor_uring_submit(ring, 1);
+    tor_uring_process_completions(ring);
+  }
+}
+
+static void
+test_compat_libevent_uring(void *arg)
+{
+  (void)arg;
+  tor_uring_t *ring = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  uring_test_req_t r;
+  uint8_t *buf = NULL;
+  char got[16];
+  tor_uring_stats_t st;
+
+  if (!tor_uring_is_supported()) {
+    tt_skip();
+  }
+  ring = tor_uring_new(8, 4, 4096);
+  tt_assert(ring);
+  tt_int_op(tor_uring_get_buf_size(ring), OP_EQ, 4096);
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+
+  memset(&r, 0, sizeof(r));
+  r.req.cb = uring_test_cb;
+  r.req.arg = &r;
+
+  /* Receive: the request waits with the kernel until there is data. */
+  tt_int_op(tor_uring_prep_recv(ring, &r.req, fds[0], 4096), OP_EQ, 0);
+  tt_int_op(tor_uring_submit(ring, 0), OP_EQ, 1);
+  tt_int_op(tor_uring_process_completions(ring), OP_EQ, 0);
+  tt_int_op(r.n_done, OP_EQ, 0);
+  tt_int_op(write(fds[1], "hello", 5), OP_EQ, 5);
+  uring_test_wait_for(ring, &r);
+  tt_int_op(r.n_done, OP_EQ, 1);
+  tt_int_op(r.result, OP_EQ, 5);
+  tt_mem_op(r.data, OP_EQ, "hello", 5);
+
+  /* Send, from one of the ring's send buffers. */
+  memset(&r, 0, sizeof(r));
+  r.req.cb = uring_test_cb;
+  r.req.arg = &r;
+  int idx = tor_uring_send_buf_get(ring, &buf);
+  tt_int_op(idx, OP_GE, 0);
+  memcpy(buf, "world", 5);
+  tt_int_op(tor_uring_prep_send(ring, &r.req, fds[0], idx, 5), OP_EQ, 0);
+  uring_test_wait_for(ring, &r);
+  tt_int_op(r.result, OP_EQ, 5);
+  tor_uring_send_buf_release(ring, idx);
+  tt_int_op(read(fds[1], got, sizeof(got)), OP_EQ, 5);
+  tt_mem_op(got, OP_EQ, "world", 5);
+
+  /* Running out of send buffers. */
+  int idxs[4];
+  for (int i = 0; i < 4; ++i) {
+    idxs[i] = tor_uring_send_buf_get(ring, &buf);
+    tt_int_op(idxs[i], OP_GE, 0);
+  }
+  tt_int_op(tor_uring_send_buf_get(ring, &buf), OP_EQ, -1);
+  for (int i = 0; i < 4; ++i)
+    tor_uring_send_buf_release(ring, idxs[i]);
+
+  /* Poll. */
+  memset(&r, 0, sizeof(r));
+  r.req.cb = uring_test_cb;
+  r.req.arg = &r;
+  tt_int_op(tor_uring_prep_poll_writable(ring, &r.req, fds[0]), OP_EQ, 0);
+  uring_test_wait_for(ring, &r);
+  tt_int_op(r.n_done, OP_EQ, 1);
+  tt_int_op(r.result, OP_GT, 0);
+
+  /* Cancel a receive that would otherwise wait forever. */
+  memset(&r, 0, sizeof(r));
+  r.req.cb = uring_test_cb;
+  r.req.arg = &r;
+  tt_int_op(tor_uring_prep_recv(ring, &r.req, fds[0], 4096), OP_EQ, 0);
+  tt_int_op(tor_uring_submit(ring, 0), OP_EQ, 1);
+  tt_int_op(tor_uring_prep_cancel(ring, &r.req), OP_EQ, 0);
+  uring_test_wait_for(ring, &r);
+  tt_int_op(r.n_done, OP_EQ, 1);
+  tt_int_op(r.result, OP_EQ, -ECANCELED);
+
+  /* End of stream. */
+  memset(&r, 0, sizeof(r));
+  r.req.cb = uring_test_cb;
+  r.req.arg = &r;
+  tt_int_op(tor_uring_prep_recv(ring, &r.req, fds[0], 4096), OP_EQ, 0);
+  tor_close_socket(fds[1]);
+  fds[1] = TOR_INVALID_SOCKET;
+  uring_test_wait_for(ring, &r);
+  tt_int_op(r.n_done, OP_EQ, 1);
+  tt_int_op(r.result, OP_EQ, 0);
+
+  tor_uring_get_stats(ring, &st);
+  tt_u64_op(st.n_submitted, OP_EQ, 6);
+  tt_u64_op(st.n_completed, OP_EQ, 6);
+  tt_u64_op(st.n_no_buffers, OP_EQ, 0);
+
+ done:
+  tor_uring_free(ring);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+}
+#endif /* defined(HAVE_IO_URING) */
+
 struct testcase_t compat_libevent_tests[] = {
   { "logging_callback", test_compat_libevent_logging_callback,
     TT_FORK, NULL, NULL },
   { "header_version", test_compat_libevent_header_version, 0, NULL, NULL },
   { "postloop_events", test_compat_libevent_postloop_events,
     TT_FORK, NULL, NULL },
+#ifdef HAVE_IO_URING
+  { "uring", test_compat_libevent_uring, TT_FORK, NULL, NULL },
+#endif
   END_OF_TESTCASES
 };
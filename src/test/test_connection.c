@@ -6,6 +6,7 @@
 #define CONNECTION_PRIVATE
 #define MAINLOOP_PRIVATE
 #define CONNECTION_OR_PRIVATE
+#define CONNECTION_URING_PRIVATE
 
 #include "core/or/or.h"
 #include "test/test.h"
@@ -13,6 +14,7 @@
 #include "app/config/config.h"
 #include "app/config/or_options_st.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/or/connection_edge.h"
 #include "feature/hs/hs_common.h"
 #include "core/mainloop/mainloop.h"
@@ -21,6 +23,9 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/rend/rendcache.h"
 #include "feature/dircommon/directory.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/uring.h"
+#include "lib/net/socket.h"
 #include "core/or/connection_or.h"
 #include "lib/net/resolve.h"
 
@@ -34,6 +39,8 @@
 #include "feature/nodelist/routerinfo_st.h"
 #include "core/or/socks_request_st.h"
 
+#include <event2/event.h>
+
 static void * test_conn_get_basic_setup(const struct testcase_t *tc);
 static int test_conn_get_basic_teardown(const struct testcase_t *tc,
                                         void *arg);
@@ -1072,6 +1079,96 @@ test_conn_describe(void *arg)
   connection_free_minimal(conn);
 }
 
+#ifdef HAVE_IO_URING
+/** Run the main loop without blocking until <b>cond</b> holds, or until we
+ * give up. */
+#define RUN_LOOP_UNTIL(cond) STMT_BEGIN                                 \
+    int loops_;                                                         \
+    for (loops_ = 0; loops_ < 200; ++loops_) {                          \
+      if (cond)                                                         \
+        break;                                                          \
+      event_base_loop(tor_libevent_get_base(), EVLOOP_NONBLOCK);        \
+      tor_sleep_msec(5);                                                \
+    }                                                                   \
+  STMT_END
+
+static void
+test_conn_uring(void *arg)
+{
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  connection_t *conn = NULL;
+  char buf[64];
+  ssize_t n = 0;
+  (void)arg;
+
+  if (!tor_uring_is_supported()) {
+    tt_skip();
+  }
+
+  tor_init_connection_lists();
+  initialize_mainloop_events();
+  connection_bucket_init();
+  tt_int_op(connection_uring_init(), OP_EQ, 0);
+  tt_int_op(connection_uring_is_enabled(), OP_EQ, 1);
+
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+
+  /* OR connections do their own I/O through TLS: they stay on Libevent. */
+  conn = connection_new(CONN_TYPE_OR, AF_INET);
+  conn->s = fds[0];
+  tt_assert(!connection_uring_conn_is_eligible(conn));
+  conn->s = TOR_INVALID_SOCKET;
+  connection_free_minimal(conn);
+
+  conn = TO_CONN(dir_connection_new(AF_UNIX));
+  conn->s = fds[0];
+  fds[0] = TOR_INVALID_SOCKET;
+  conn->state = DIR_CONN_STATE_SERVER_COMMAND_WAIT;
+  conn->purpose = DIR_PURPOSE_SERVER;
+  tt_assert(connection_uring_conn_is_eligible(conn));
+  tt_int_op(connection_add(conn), OP_EQ, 0);
+  tt_assert(conn->uring);
+
+  /* An incomplete request: the directory code leaves it in the inbuf. */
+  connection_start_reading(conn);
+  tt_assert(connection_is_reading(conn));
+  tt_int_op(write(fds[1], "GET /tor/", 9), OP_EQ, 9);
+  RUN_LOOP_UNTIL(buf_datalen(conn->inbuf) == 9);
+  tt_int_op(buf_datalen(conn->inbuf), OP_EQ, 9);
+
+  /* Now answer, and close once we have flushed. */
+  connection_stop_reading(conn);
+  tt_assert(!connection_is_reading(conn));
+  conn->state = DIR_CONN_STATE_SERVER_WRITING;
+  connection_buf_add("HTTP/1.0 200 OK\r\n\r\n", 19, conn);
+  tt_assert(connection_is_writing(conn));
+  RUN_LOOP_UNTIL((n = read(fds[1], buf, sizeof(buf))) > 0);
+  tt_int_op(n, OP_EQ, 19);
+  tt_mem_op(buf, OP_EQ, "HTTP/1.0 200 OK\r\n\r\n", 19);
+
+  /* Flushing everything marks the connection; the loop then frees it and
+   * closes the socket. */
+  RUN_LOOP_UNTIL(smartlist_len(get_connection_array()) == 0);
+  tt_int_op(smartlist_len(get_connection_array()), OP_EQ, 0);
+  conn = NULL;
+  RUN_LOOP_UNTIL(read(fds[1], buf, sizeof(buf)) == 0);
+  tt_int_op(read(fds[1], buf, sizeof(buf)), OP_EQ, 0);
+
+ done:
+  if (conn) {
+    if (connection_in_array(conn))
+      connection_remove(conn);
+    connection_free_minimal(conn);
+  }
+  tor_close_socket(fds[0]);
+  tor_close_socket(fds[1]);
+  connection_uring_free_all();
+}
+#undef RUN_LOOP_UNTIL
+#endif /* defined(HAVE_IO_URING) */
+
 #ifndef COCCI
 #define CONNECTION_TESTCASE(name, fork, setup)                           \
   { #name, test_conn_##name, fork, &setup, NULL }
@@ -1107,5 +1204,8 @@ struct testcase_t connection_tests[] = {
   //CONNECTION_TESTCASE(func_suffix, TT_FORK, setup_func_pair),
   { "failed_orconn_tracker", test_failed_orconn_tracker, TT_FORK, NULL, NULL },
   { "describe", test_conn_describe, TT_FORK, NULL, NULL },
+#ifdef HAVE_IO_URING
+  { "uring", test_conn_uring, TT_FORK, NULL, NULL },
+#endif
   END_OF_TESTCASES
 };
@@ -328,6 +328,94 @@ test_conscache_filter(void *arg)
   smartlist_free(lst);
 }
 
+static void
+test_conscache_label_index(void *arg)
+{
+  (void)arg;
+  const int N = 12;
+  smartlist_t *lst = smartlist_new();
+  consensus_cache_entry_t *ents[12];
+  memset(ents, 0, sizeof(ents));
+
+  char *ddir_fname = tor_strdup(get_fname_rnd("datadir_cache"));
+  tor_free(get_options_mutable()->CacheDirectory);
+  get_options_mutable()->CacheDirectory = tor_strdup(ddir_fname);
+  check_private_dir(ddir_fname, CPD_CREATE, NULL);
+  consensus_cache_t *cache = consensus_cache_open("cons", 128);
+  tt_assert(cache);
+
+  int i;
+  for (i = 0; i < N; ++i) {
+    config_line_t *labels = NULL;
+    char num[8];
+    tor_snprintf(num, sizeof(num), "%d", i);
+    config_line_append(&labels, "index", num);
+    tor_snprintf(num, sizeof(num), "%d", i % 4);
+    config_line_append(&labels, "mod4", num);
+    /* A second value for a key we already have: it should be ignored. */
+    config_line_append(&labels, "mod4", "dup");
+    uint8_t body = (uint8_t) i;
+    ents[i] = consensus_cache_add(cache, labels, &body, 1);
+    config_free_lines(labels);
+    tt_assert(ents[i]);
+  }
+
+  consensus_cache_find_all(lst, cache, "mod4", "1");
+  tt_int_op(smartlist_len(lst), OP_EQ, 3);
+  tt_assert(smartlist_contains(lst, ents[1]));
+  tt_assert(smartlist_contains(lst, ents[5]));
+  tt_assert(smartlist_contains(lst, ents[9]));
+  smartlist_clear(lst);
+  consensus_cache_find_all(lst, cache, "mod4", "dup");
+  tt_int_op(smartlist_len(lst), OP_EQ, 0);
+  consensus_cache_find_all(lst, cache, "no-such-key", "1");
+  tt_int_op(smartlist_len(lst), OP_EQ, 0);
+  /* Keys and values don't run together. */
+  consensus_cache_find_all(lst, cache, "mod4 1", "");
+  tt_int_op(smartlist_len(lst), OP_EQ, 0);
+  tt_ptr_op(consensus_cache_find_first(cache, "index", "7"), OP_EQ, ents[7]);
+
+  /* Entries marked for removal disappear from lookups at once, and from the
+   * index when they're deleted. */
+  consensus_cache_entry_mark_for_removal(ents[5]);
+  consensus_cache_find_all(lst, cache, "mod4", "1");
+  tt_int_op(smartlist_len(lst), OP_EQ, 2);
+  tt_assert(! smartlist_contains(lst, ents[5]));
+  smartlist_clear(lst);
+  consensus_cache_entry_mark_for_removal(ents[2]);
+  for (i = 0; i < N; ++i) {
+    consensus_cache_entry_decref(ents[i]);
+    ents[i] = NULL;
+  }
+  consensus_cache_delete_pending(cache, 0);
+  tt_ptr_op(consensus_cache_find_first(cache, "index", "5"), OP_EQ, NULL);
+  tt_ptr_op(consensus_cache_find_first(cache, "index", "2"), OP_EQ, NULL);
+  consensus_cache_find_all(lst, cache, "mod4", "2");
+  tt_int_op(smartlist_len(lst), OP_EQ, 2);
+  smartlist_clear(lst);
+
+  /* The index gets rebuilt when we reopen the cache. */
+  consensus_cache_free(cache);
+  cache = consensus_cache_open("cons", 128);
+  tt_assert(cache);
+  consensus_cache_find_all(lst, cache, "mod4", "1");
+  tt_int_op(smartlist_len(lst), OP_EQ, 2);
+  smartlist_clear(lst);
+  consensus_cache_find_all(lst, cache, NULL, NULL);
+  tt_int_op(smartlist_len(lst), OP_EQ, N - 2);
+  consensus_cache_entry_t *ent = consensus_cache_find_first(cache,
+                                                            "index", "9");
+  tt_assert(ent);
+  tt_str_op(consensus_cache_entry_get_value(ent, "mod4"), OP_EQ, "1");
+
+ done:
+  for (i = 0; i < N; ++i)
+    consensus_cache_entry_decref(ents[i]);
+  tor_free(ddir_fname);
+  consensus_cache_free(cache);
+  smartlist_free(lst);
+}
+
 #define ENT(name)                                               \
   { #name, test_conscache_ ## name, TT_FORK, NULL, NULL }
 
@@ -336,5 +424,6 @@ struct testcase_t conscache_tests[] = {
   ENT(simple_usage),
   ENT(cleanup),
   ENT(filter),
+  ENT(label_index),
   END_OF_TESTCASES
 };
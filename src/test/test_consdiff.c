@@ -8,6 +8,7 @@
 #include "test/test.h"
 
 #include "feature/dircommon/consdiff.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/memarea/memarea.h"
 #include "test/log_test_helpers.h"
 
@@ -343,6 +344,201 @@ test_consdiff_calc_changes(void *arg)
   memarea_drop_all(area);
 }
 
+/** Return the number of bits set among the first <b>n</b> of <b>ba</b>. */
+static int
+bitarray_count_set(bitarray_t *ba, int n)
+{
+  int i, count = 0;
+  for (i = 0; i < n; ++i) {
+    if (bitarray_is_set(ba, i))
+      ++count;
+  }
+  return count;
+}
+
+static void
+test_consdiff_calc_changes_myers(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = bitarray_init_zero(6);
+  bitarray_t *changed2 = bitarray_init_zero(6);
+  memarea_t *area = memarea_new();
+  int i;
+
+  (void)arg;
+  consensus_split_lines_(sl1, "a\na\na\na\n", area);
+  consensus_split_lines_(sl2, "a\na\na\na\n", area);
+
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  calc_changes_myers(sls1, sls2, changed1, changed2);
+
+  /* Nothing should be set to changed. */
+  for (i = 0; i < 4; ++i) {
+    tt_assert(!bitarray_is_set(changed1, i));
+    tt_assert(!bitarray_is_set(changed2, i));
+  }
+
+  /* Two elements are changed, and we pick the same ones as calc_changes. */
+  smartlist_clear(sl2);
+  consensus_split_lines_(sl2, "a\nb\na\nb\n", area);
+  tor_free(sls1);
+  tor_free(sls2);
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  calc_changes_myers(sls1, sls2, changed1, changed2);
+
+  tt_assert(!bitarray_is_set(changed1, 0));
+  tt_assert(bitarray_is_set(changed1, 1));
+  tt_assert(bitarray_is_set(changed1, 2));
+  tt_assert(!bitarray_is_set(changed1, 3));
+  tt_assert(!bitarray_is_set(changed2, 0));
+  tt_assert(bitarray_is_set(changed2, 1));
+  tt_assert(!bitarray_is_set(changed2, 2));
+  tt_assert(bitarray_is_set(changed2, 3));
+  for (i = 0; i < 4; ++i) {
+    bitarray_clear(changed1, i);
+    bitarray_clear(changed2, i);
+  }
+
+  /* All elements are changed: the slices have no lines in common. */
+  smartlist_clear(sl2);
+  consensus_split_lines_(sl2, "b\nb\nb\nb\n", area);
+  tor_free(sls1);
+  tor_free(sls2);
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  calc_changes_myers(sls1, sls2, changed1, changed2);
+
+  for (i = 0; i < 4; ++i) {
+    tt_assert(bitarray_is_set(changed1, i));
+    tt_assert(bitarray_is_set(changed2, i));
+    bitarray_clear(changed1, i);
+    bitarray_clear(changed2, i);
+  }
+
+  /* Slices of different lengths with no lines in common, where neither is
+   * short enough for us to skip the search. */
+  smartlist_clear(sl1);
+  smartlist_clear(sl2);
+  consensus_split_lines_(sl1, "a\nb\na\n", area);
+  consensus_split_lines_(sl2, "c\nd\nc\nd\nc\n", area);
+  tor_free(sls1);
+  tor_free(sls2);
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  calc_changes_myers(sls1, sls2, changed1, changed2);
+
+  tt_int_op(bitarray_count_set(changed1, 6), OP_EQ, 3);
+  tt_int_op(bitarray_count_set(changed2, 6), OP_EQ, 5);
+  for (i = 0; i < 6; ++i) {
+    bitarray_clear(changed1, i);
+    bitarray_clear(changed2, i);
+  }
+
+  /* Slices of different lengths, with a common run in the middle. */
+  smartlist_clear(sl1);
+  smartlist_clear(sl2);
+  consensus_split_lines_(sl1, "x\nb\nc\nd\ny\n", area);
+  consensus_split_lines_(sl2, "p\nq\nb\nc\nd\nr\n", area);
+  tor_free(sls1);
+  tor_free(sls2);
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  calc_changes_myers(sls1, sls2, changed1, changed2);
+
+  tt_assert(bitarray_is_set(changed1, 0));
+  tt_assert(!bitarray_is_set(changed1, 1));
+  tt_assert(!bitarray_is_set(changed1, 2));
+  tt_assert(!bitarray_is_set(changed1, 3));
+  tt_assert(bitarray_is_set(changed1, 4));
+  tt_assert(bitarray_is_set(changed2, 0));
+  tt_assert(bitarray_is_set(changed2, 1));
+  tt_assert(!bitarray_is_set(changed2, 2));
+  tt_assert(!bitarray_is_set(changed2, 3));
+  tt_assert(!bitarray_is_set(changed2, 4));
+  tt_assert(bitarray_is_set(changed2, 5));
+
+ done:
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  tor_free(sls1);
+  tor_free(sls2);
+  memarea_drop_all(area);
+}
+
+static void
+test_consdiff_calc_changes_engines_agree(void *arg)
+{
+  static const char *alphabet[] = { "a", "b", "c", "d" };
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *lcs1 = NULL, *lcs2 = NULL, *myers1 = NULL, *myers2 = NULL;
+  memarea_t *area = memarea_new();
+  int iter, i;
+
+  (void)arg;
+  /* Both engines find a shortest diff, so on random inputs they must always
+   * agree on how many lines changed, even when they pick different ones. */
+  for (iter = 0; iter < 200; ++iter) {
+    const int n1 = crypto_rand_int(40), n2 = crypto_rand_int(40);
+    /* A small alphabet makes for many equal lines, and many possible
+     * diffs. */
+    smartlist_clear(sl1);
+    smartlist_clear(sl2);
+    for (i = 0; i < n1; ++i)
+      smartlist_add_linecpy(sl1, area, alphabet[crypto_rand_int(4)]);
+    for (i = 0; i < n2; ++i)
+      smartlist_add_linecpy(sl2, area, alphabet[crypto_rand_int(4)]);
+
+    lcs1 = bitarray_init_zero(n1 + 1);
+    lcs2 = bitarray_init_zero(n2 + 1);
+    myers1 = bitarray_init_zero(n1 + 1);
+    myers2 = bitarray_init_zero(n2 + 1);
+
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    calc_changes(sls1, sls2, lcs1, lcs2);
+    tor_free(sls1);
+    tor_free(sls2);
+
+    sls1 = smartlist_slice(sl1, 0, -1);
+    sls2 = smartlist_slice(sl2, 0, -1);
+    calc_changes_myers(sls1, sls2, myers1, myers2);
+    tor_free(sls1);
+    tor_free(sls2);
+
+    tt_int_op(bitarray_count_set(lcs1, n1), OP_EQ,
+              bitarray_count_set(myers1, n1));
+    tt_int_op(bitarray_count_set(lcs2, n2), OP_EQ,
+              bitarray_count_set(myers2, n2));
+    /* The lines we kept must be the same on both sides. */
+    tt_int_op(n1 - bitarray_count_set(myers1, n1), OP_EQ,
+              n2 - bitarray_count_set(myers2, n2));
+
+    bitarray_free(lcs1);
+    bitarray_free(lcs2);
+    bitarray_free(myers1);
+    bitarray_free(myers2);
+  }
+
+ done:
+  bitarray_free(lcs1);
+  bitarray_free(lcs2);
+  bitarray_free(myers1);
+  bitarray_free(myers2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  tor_free(sls1);
+  tor_free(sls2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_get_id_hash(void *arg)
 {
@@ -474,7 +670,8 @@ test_consdiff_gen_ed_diff(void *arg)
   memarea_t *area = memarea_new();
   setup_capture_of_logs(LOG_WARN);
 
-  (void)arg;
+  if (arg && !strcmp(arg, "lcs"))
+    consdiff_set_engine(CONSDIFF_ENGINE_LCS);
   cons1 = smartlist_new();
   cons2 = smartlist_new();
 
@@ -672,6 +869,7 @@ test_consdiff_gen_ed_diff(void *arg)
   /* TODO: small real use-cases, i.e. consensuses. */
 
  done:
+  consdiff_set_engine(CONSDIFF_ENGINE_MYERS);
   teardown_capture_of_logs();
   smartlist_free(cons1);
   smartlist_free(cons2);
@@ -1205,11 +1403,15 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
+  CONSDIFF_LEGACY(calc_changes_myers),
+  CONSDIFF_LEGACY(calc_changes_engines_agree),
   CONSDIFF_LEGACY(get_id_hash),
   CONSDIFF_LEGACY(is_valid_router_entry),
   CONSDIFF_LEGACY(next_router),
   CONSDIFF_LEGACY(base64cmp),
   CONSDIFF_LEGACY(gen_ed_diff),
+  { "gen_ed_diff_lcs", test_consdiff_gen_ed_diff, 0, &passthrough_setup,
+    (void*)"lcs" },
   CONSDIFF_LEGACY(apply_ed_diff),
   CONSDIFF_LEGACY(gen_diff),
   CONSDIFF_LEGACY(apply_diff),
@@ -2198,6 +2198,48 @@ test_stats(void *arg)
   return;
 }
 
+static void
+test_getinfo_memory(void *arg)
+{
+  control_connection_t dummy;
+  char *answer = NULL;
+  const char *errmsg = NULL;
+
+  (void) arg;
+
+  /* The OR subsystem always counts its cell queues. */
+  getinfo_helper_memory(&dummy, "memory/usage", &answer, &errmsg);
+  tt_ptr_op(errmsg, OP_EQ, NULL);
+  tt_assert(answer);
+  tt_assert(strstr(answer, "cell-queues="));
+  tor_free(answer);
+
+  getinfo_helper_memory(&dummy, "memory/usage/cell-queues", &answer,
+                        &errmsg);
+  tt_ptr_op(errmsg, OP_EQ, NULL);
+  tt_assert(answer);
+  tor_free(answer);
+
+  getinfo_helper_memory(&dummy, "memory/total", &answer, &errmsg);
+  tt_ptr_op(errmsg, OP_EQ, NULL);
+  tt_assert(answer);
+  tor_free(answer);
+
+  getinfo_helper_memory(&dummy, "memory/reclaimed", &answer, &errmsg);
+  tt_ptr_op(errmsg, OP_EQ, NULL);
+  tt_assert(answer);
+  tt_assert(strstr(answer, "cell-queues="));
+  tor_free(answer);
+
+  getinfo_helper_memory(&dummy, "memory/usage/no-such-thing", &answer,
+                        &errmsg);
+  tt_ptr_op(answer, OP_EQ, NULL);
+  tt_str_op(errmsg, OP_EQ, "Unrecognized subsystem");
+
+ done:
+  tor_free(answer);
+}
+
 #ifndef COCCI
 #define PARSER_TEST(type)                                             \
   { "parse/" #type, test_controller_parse_cmd, 0, &passthrough_setup, \
@@ -2233,5 +2275,6 @@ struct testcase_t controller_tests[] = {
   { "control_reply", test_control_reply, 0, NULL, NULL },
   { "control_getconf", test_control_getconf, 0, NULL, NULL },
   { "stats", test_stats, 0, NULL, NULL },
+  { "getinfo_memory", test_getinfo_memory, 0, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -8,6 +8,7 @@
 
 #define BWAUTH_PRIVATE
 #define CONFIG_PRIVATE
+#define CONNECTION_PRIVATE
 #define CONTROL_GETINFO_PRIVATE
 #define DIRAUTH_SYS_PRIVATE
 #define DIRCACHE_PRIVATE
@@ -28,6 +29,7 @@
 #include "app/config/config.h"
 #include "lib/confmgt/confmgt.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/relay.h"
 #include "core/or/protover.h"
 #include "core/or/versions.h"
@@ -56,6 +58,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
 #include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/dirparse/authcert_parse.h"
 #include "feature/dirparse/ns_parse.h"
@@ -66,6 +69,7 @@
 #include "feature/relay/router.h"
 #include "feature/relay/routerkeys.h"
 #include "feature/relay/routermode.h"
+#include "lib/buf/buffers.h"
 #include "lib/compress/compress.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_format.h"
@@ -77,15 +81,18 @@
 #include "test/opts_test_helpers.h"
 #include "test/test.h"
 #include "test/test_dir_common.h"
+#include "test/test_helpers.h"
 
 #include "core/or/addr_policy_st.h"
 #include "feature/dirauth/dirauth_options_st.h"
+#include "feature/dircommon/dir_connection_st.h"
 #include "feature/nodelist/authority_cert_st.h"
 #include "feature/nodelist/document_signature_st.h"
 #include "feature/nodelist/extrainfo_st.h"
 #include "feature/nodelist/microdesc_st.h"
 #include "feature/nodelist/networkstatus_st.h"
 #include "feature/nodelist/networkstatus_voter_info_st.h"
+#include "feature/nodelist/node_st.h"
 #include "feature/dirauth/ns_detached_signatures_st.h"
 #include "core/or/port_cfg_st.h"
 #include "feature/nodelist/routerinfo_st.h"
@@ -1303,6 +1310,132 @@ test_dir_parse_router_list(void *arg)
 #undef ADD
 }
 
+/** Return true iff <b>digests</b>, a list of DIGEST_LEN-byte digests,
+ * contains the digest of the router descriptor <b>desc</b>. */
+static int
+digest_list_has_router_hash(const smartlist_t *digests, const char *desc)
+{
+  char d[DIGEST_LEN];
+  if (router_get_router_hash(desc, strlen(desc), d) < 0)
+    return 0;
+  SMARTLIST_FOREACH(digests, const char *, dig,
+                    if (tor_memeq(dig, d, DIGEST_LEN)) return 1);
+  return 0;
+}
+
+static void
+test_dir_parse_router_list_ed_sigs(void *arg)
+{
+  (void) arg;
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *dest = smartlist_new();
+  smartlist_t *chunks = smartlist_new();
+  char *list = NULL;
+  const char *cp;
+  int i;
+
+  /* The ed25519 signatures of these get checked together, after they've
+   * all been parsed. */
+  smartlist_add_strdup(chunks, EX_RI_MINIMAL);
+  smartlist_add_strdup(chunks, EX_RI_ED_BAD_SIG1);
+  smartlist_add_strdup(chunks, EX_RI_MAXIMAL);
+  smartlist_add_strdup(chunks, EX_RI_ED_BAD_SIG2);
+  smartlist_add_strdup(chunks, EX_RI_ED_BAD_SIG3);
+  list = smartlist_join_strings(chunks, "", 0, NULL);
+
+  cp = list;
+  tt_int_op(0,OP_EQ,
+            router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                          0, 0, NULL, invalid));
+  tt_ptr_op(cp, OP_EQ, list + strlen(list));
+  tt_int_op(2, OP_EQ, smartlist_len(dest));
+  routerinfo_t *r = smartlist_get(dest, 0);
+  tt_mem_op(r->cache_info.signed_descriptor_body, OP_EQ,
+            EX_RI_MINIMAL, strlen(EX_RI_MINIMAL));
+  r = smartlist_get(dest, 1);
+  tt_mem_op(r->cache_info.signed_descriptor_body, OP_EQ,
+            EX_RI_MAXIMAL, strlen(EX_RI_MAXIMAL));
+
+  /* None of the bad ones can ever be downloaded again. */
+  tt_int_op(3, OP_EQ, smartlist_len(invalid));
+  tt_assert(digest_list_has_router_hash(invalid, EX_RI_ED_BAD_SIG1));
+  tt_assert(digest_list_has_router_hash(invalid, EX_RI_ED_BAD_SIG2));
+  tt_assert(digest_list_has_router_hash(invalid, EX_RI_ED_BAD_SIG3));
+
+  SMARTLIST_FOREACH(dest, routerinfo_t *, rinfo, routerinfo_free(rinfo));
+  SMARTLIST_FOREACH(invalid, uint8_t *, dig, tor_free(dig));
+  SMARTLIST_FOREACH(chunks, char *, chunk, tor_free(chunk));
+  smartlist_clear(dest);
+  smartlist_clear(invalid);
+  smartlist_clear(chunks);
+  tor_free(list);
+
+  /* Enough descriptors to need more than one batch, with a bad one in the
+   * last batch. */
+  for (i = 0; i < 40; ++i)
+    smartlist_add_strdup(chunks, EX_RI_MINIMAL);
+  smartlist_add_strdup(chunks, EX_RI_ED_BAD_SIG2);
+  list = smartlist_join_strings(chunks, "", 0, NULL);
+
+  cp = list;
+  tt_int_op(0,OP_EQ,
+            router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                          0, 0, NULL, invalid));
+  tt_int_op(40, OP_EQ, smartlist_len(dest));
+  tt_int_op(1, OP_EQ, smartlist_len(invalid));
+  tt_assert(digest_list_has_router_hash(invalid, EX_RI_ED_BAD_SIG2));
+
+ done:
+  tor_free(list);
+  SMARTLIST_FOREACH(dest, routerinfo_t *, rt, routerinfo_free(rt));
+  smartlist_free(dest);
+  SMARTLIST_FOREACH(invalid, uint8_t *, dig, tor_free(dig));
+  smartlist_free(invalid);
+  SMARTLIST_FOREACH(chunks, char *, chunk, tor_free(chunk));
+  smartlist_free(chunks);
+}
+
+/** Descriptors that mock_dump_desc() has been asked to dump. */
+static smartlist_t *dumped_descs = NULL;
+
+static void
+mock_dump_desc(const char *desc, const char *type)
+{
+  (void) type;
+  smartlist_add_strdup(dumped_descs, desc);
+}
+
+/** A descriptor whose ed25519 signatures we only check after parsing the
+ * whole list gets dumped on its own, not with the rest of the list. */
+static void
+test_dir_parse_router_list_ed_sigs_dump(void *arg)
+{
+  (void) arg;
+  smartlist_t *dest = smartlist_new();
+  char *list = NULL;
+  const char *cp;
+
+  dumped_descs = smartlist_new();
+  MOCK(dump_desc, mock_dump_desc);
+
+  tor_asprintf(&list, "%s%s", EX_RI_ED_BAD_SIG2, EX_RI_MINIMAL);
+  cp = list;
+  tt_int_op(0,OP_EQ,
+            router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                          0, 0, NULL, NULL));
+  tt_int_op(1, OP_EQ, smartlist_len(dest));
+  tt_int_op(1, OP_EQ, smartlist_len(dumped_descs));
+  tt_str_op(smartlist_get(dumped_descs, 0), OP_EQ, EX_RI_ED_BAD_SIG2);
+
+ done:
+  UNMOCK(dump_desc);
+  tor_free(list);
+  SMARTLIST_FOREACH(dest, routerinfo_t *, rt, routerinfo_free(rt));
+  smartlist_free(dest);
+  SMARTLIST_FOREACH(dumped_descs, char *, d, tor_free(d));
+  smartlist_free(dumped_descs);
+}
+
 static download_status_t dls_minimal;
 static download_status_t dls_maximal;
 static download_status_t dls_bad_fingerprint;
@@ -3412,8 +3545,13 @@ test_a_networkstatus(
   char *consensus_text_md2=NULL, *consensus_text_md3=NULL;
   char *consensus_text_md=NULL;
   networkstatus_t *con2=NULL, *con_md2=NULL, *con3=NULL, *con_md3=NULL;
+  char *flavor_bodies[N_CONSENSUS_FLAVORS];
+  networkstatus_t *flavor_cons[N_CONSENSUS_FLAVORS];
   ns_detached_signatures_t *dsig1=NULL, *dsig2=NULL;
 
+  memset(flavor_bodies, 0, sizeof(flavor_bodies));
+  memset(flavor_cons, 0, sizeof(flavor_cons));
+
   tt_assert(vrs_gen);
   tt_assert(rs_test);
   tt_assert(vrs_test);
@@ -3550,6 +3688,25 @@ test_a_networkstatus(
   tt_assert(con_md);
   tt_int_op(con_md->flavor,OP_EQ, FLAV_MICRODESC);
 
+  /* Building every flavor at once (in parallel, if the cpuworkers are
+   * running) must give the same consensuses as building them one by one.
+   * The builds must not write to anything that they share: the votes, or
+   * global state such as the protover summary cache, which we empty here so
+   * that parsing the flavors has to fill it again.  Otherwise
+   * test_dir_v3_networkstatus_parallel fails under TSan. */
+  protover_summary_cache_free_all();
+  tt_int_op(dirvote_compute_consensus_flavors(votes, 3,
+                                              cert3->identity_key,
+                                              sign_skey_3,
+                                              "AAAAAAAAAAAAAAAAAAAA",
+                                              sign_skey_leg1,
+                                              flavor_bodies, flavor_cons),
+            OP_EQ, N_CONSENSUS_FLAVORS);
+  tt_str_op(flavor_bodies[FLAV_NS], OP_EQ, consensus_text);
+  tt_str_op(flavor_bodies[FLAV_MICRODESC], OP_EQ, consensus_text_md);
+  tt_int_op(flavor_cons[FLAV_NS]->flavor, OP_EQ, FLAV_NS);
+  tt_int_op(flavor_cons[FLAV_MICRODESC]->flavor, OP_EQ, FLAV_MICRODESC);
+
   /* Check consensus contents. */
   tt_assert(con->type == NS_TYPE_CONSENSUS);
   tt_int_op(con->published,OP_EQ, 0); /* this field only appears in votes. */
@@ -3756,6 +3913,10 @@ test_a_networkstatus(
   smartlist_free(votes);
   tor_free(consensus_text);
   tor_free(consensus_text_md);
+  for (idx = 0; idx < N_CONSENSUS_FLAVORS; ++idx) {
+    tor_free(flavor_bodies[idx]);
+    networkstatus_vote_free(flavor_cons[idx]);
+  }
 
   networkstatus_vote_free(vote);
   networkstatus_vote_free(v1);
@@ -3799,6 +3960,17 @@ test_dir_v3_networkstatus(void *arg)
                        test_routerstatus_for_v3ns);
 }
 
+/** As test_dir_v3_networkstatus, but with the cpuworkers running, so that
+ * the consensus flavors get built in parallel. */
+static void
+test_dir_v3_networkstatus_parallel(void *arg)
+{
+  (void)arg;
+  init_keys_client();
+  cpu_init();
+  test_dir_v3_networkstatus(NULL);
+}
+
 static void
 test_dir_scale_bw(void *testdata)
 {
@@ -3945,6 +4117,153 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+static void
+test_dir_random_weighted_alias(void *testdata)
+{
+  int histogram[10];
+  uint64_t vals[10] = {3,1,2,4,6,0,7,5,8,9}, total=0;
+  uint64_t prob[10], mass[10];
+  int alias[10];
+  int i, choice;
+  const int n = 50000;
+  double max_sq_error;
+  (void) testdata;
+
+  for (i=0; i<10; ++i)
+    total += vals[i];
+  node_select_alias_build(vals, 10, prob, alias);
+
+  /* Every element should own exactly its share of the table. */
+  memset(mass, 0, sizeof(mass));
+  for (i=0; i<10; ++i) {
+    tt_u64_op(prob[i], OP_LE, total);
+    tt_int_op(alias[i], OP_GE, 0);
+    tt_int_op(alias[i], OP_LT, 10);
+    mass[i] += prob[i];
+    mass[alias[i]] += total - prob[i];
+  }
+  for (i=0; i<10; ++i)
+    tt_u64_op(mass[i], OP_EQ, vals[i] * 10);
+
+  memset(histogram,0,sizeof(histogram));
+  for (i=0; i<n; ++i) {
+    choice = node_select_alias_pick(prob, alias, 10, total);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    histogram[choice]++;
+  }
+
+  max_sq_error = 0;
+  for (i=0; i<10; ++i) {
+    int expected = (int)(n*vals[i]/total);
+    double frac_diff = 0, sq;
+    TT_BLATHER(("  %d : %5d vs %5d\n", (int)vals[i], histogram[i], expected));
+    if (expected)
+      frac_diff = (histogram[i] - expected) / ((double)expected);
+    else
+      tt_int_op(histogram[i], OP_EQ, 0);
+
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+
+  /* Weights as large as the ones we build tables from must not overflow. */
+  for (i=0; i<10; ++i)
+    vals[i] = (UINT64_C(1) << 58) / (i+1);
+  total = 0;
+  for (i=0; i<10; ++i)
+    total += vals[i];
+  node_select_alias_build(vals, 10, prob, alias);
+  memset(mass, 0, sizeof(mass));
+  for (i=0; i<10; ++i) {
+    mass[i] += prob[i];
+    mass[alias[i]] += total - prob[i];
+  }
+  for (i=0; i<10; ++i)
+    tt_u64_op(mass[i], OP_EQ, vals[i] * 10);
+
+  /* A singleton is always chosen. */
+  node_select_alias_build(vals, 1, prob, alias);
+  for (i = 0; i < 100; ++i)
+    tt_int_op(node_select_alias_pick(prob, alias, 1, vals[0]), OP_EQ, 0);
+
+  /* With all-zero weights, we choose uniformly. */
+  memset(vals, 0, sizeof(vals));
+  node_select_alias_build(vals, 5, prob, alias);
+  memset(histogram,0,sizeof(histogram));
+  for (i = 0; i < n; ++i) {
+    choice = node_select_alias_pick(prob, alias, 5, 0);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 5);
+    histogram[choice]++;
+  }
+  for (i = 0; i < 5; ++i)
+    tt_int_op(histogram[i], OP_GT, n/10);
+
+ done:
+  ;
+}
+
+static void
+test_dir_random_node_tables(void *testdata)
+{
+  smartlist_t *excluded = smartlist_new();
+  routerset_t *excludedset = NULL;
+  const smartlist_t *nodes;
+  const node_t *keep, *node;
+  char keep_hex[HEX_DIGEST_LEN+2];
+  int i;
+  (void) testdata;
+
+  helper_setup_fake_routerlist();
+  nodes = nodelist_get_list();
+  tt_int_op(smartlist_len(nodes), OP_EQ, HELPER_NUMBER_OF_DESCRIPTORS);
+  node_select_tables_clear();
+
+  node = router_choose_random_node(NULL, NULL, 0);
+  tt_assert(node);
+  tt_int_op(node_select_tables_count(), OP_EQ, 1);
+  node = router_choose_random_node(NULL, NULL, 0);
+  tt_assert(node);
+  tt_int_op(node_select_tables_count(), OP_EQ, 1);
+
+  /* Exclude all but one node: we must always get that one. */
+  keep = smartlist_get(nodes, 3);
+  SMARTLIST_FOREACH(nodes, const node_t *, n,
+                    if (n != keep) smartlist_add(excluded, (void *)n));
+  for (i = 0; i < 50; ++i)
+    tt_ptr_op(router_choose_random_node(excluded, NULL, 0), OP_EQ, keep);
+
+  /* Excluding it by routerset too leaves nothing. */
+  keep_hex[0] = '$';
+  base16_encode(keep_hex+1, HEX_DIGEST_LEN+1, keep->identity, DIGEST_LEN);
+  excludedset = routerset_new();
+  tt_int_op(routerset_parse(excludedset, keep_hex, "test"), OP_EQ, 0);
+  tt_ptr_op(router_choose_random_node(excluded, excludedset, 0), OP_EQ, NULL);
+  routerset_free(excludedset);
+  smartlist_clear(excluded);
+
+  /* The same goes for a node that went down without anybody telling the
+   * tables. */
+  excludedset = routerset_new();
+  SMARTLIST_FOREACH(nodes, const node_t *, n,
+                    if (n != keep) smartlist_add(excluded, (void *)n));
+  ((node_t *)keep)->is_running = 0;
+  tt_ptr_op(router_choose_random_node(excluded, excludedset, 0), OP_EQ, NULL);
+  ((node_t *)keep)->is_running = 1;
+
+  /* Changes to our directory information throw the tables away. */
+  tt_int_op(node_select_tables_count(), OP_GT, 0);
+  router_dir_info_changed();
+  tt_int_op(node_select_tables_count(), OP_EQ, 0);
+
+ done:
+  routerset_free(excludedset);
+  smartlist_free(excluded);
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -5330,6 +5649,207 @@ dir_tests_public_server_mode(const or_options_t *options)
   return 0;
 }
 
+/* The start of a microdescriptor: stream_mds_new() adds a random ntor key
+ * to each copy, so that they're distinct and don't compress too well. */
+static const char stream_md_template[] =
+  "onion-key\n"
+  "-----BEGIN RSA PUBLIC KEY-----\n"
+  "MIGJAoGBAMjlHH/daN43cSVRaHBwgUfnszzAhg98EvivJ9Qxfv51mvQUxPjQ07es\n"
+  "gV/3n8fyh3Kqr/ehi9jxkdgSRfSnmF7giaHL1SLZ29kA7KtST+pBvmTpDtHa3ykX\n"
+  "Xorc7hJvIyTZoc1HU+5XSynj3gsBE5IGK1ZRzrNS688LnuZMVp1tAgMBAAE=\n"
+  "-----END RSA PUBLIC KEY-----\n";
+
+/** Make <b>n</b> distinct microdescriptors.  Set *<b>body_out</b> to all of
+ * them, *<b>resource_out</b> to the resource for requesting them, and add
+ * their digests to <b>digests</b>. */
+static void
+stream_mds_new(int n, char **body_out, char **resource_out,
+               smartlist_t *digests)
+{
+  smartlist_t *mds = smartlist_new(), *encoded = smartlist_new();
+  for (int i = 0; i < n; ++i) {
+    char *md = NULL;
+    char d[DIGEST256_LEN], b64[BASE64_DIGEST256_LEN+1];
+    char key[CURVE25519_PUBKEY_LEN], key_b64[CURVE25519_BASE64_PADDED_LEN+1];
+    crypto_rand(key, sizeof(key));
+    base64_encode(key_b64, sizeof(key_b64), key, sizeof(key), 0);
+    tor_asprintf(&md, "%sntor-onion-key %s\np accept %d\n",
+                 stream_md_template, key_b64, i+1);
+    crypto_digest256(d, md, strlen(md), DIGEST_SHA256);
+    digest256_to_base64(b64, d);
+    smartlist_add(digests, tor_memdup(d, DIGEST256_LEN));
+    smartlist_add_strdup(encoded, b64);
+    smartlist_add(mds, md);
+  }
+  *body_out = smartlist_join_strings(mds, "", 0, NULL);
+  char *joined = smartlist_join_strings(encoded, "-", 0, NULL);
+  tor_asprintf(resource_out, "d/%s", joined);
+  tor_free(joined);
+  SMARTLIST_FOREACH(mds, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(encoded, char *, cp, tor_free(cp));
+  smartlist_free(mds);
+  smartlist_free(encoded);
+}
+
+/** Return a new client directory connection with <b>purpose</b>, waiting
+ * for the response to a request for <b>resource</b>. */
+static dir_connection_t *
+stream_conn_new(uint8_t purpose, const char *resource)
+{
+  dir_connection_t *conn = dir_connection_new(AF_INET);
+  TO_CONN(conn)->purpose = purpose;
+  TO_CONN(conn)->state = DIR_CONN_STATE_CLIENT_READING;
+  conn->requested_resource = tor_strdup(resource);
+  memset(conn->identity_digest, 'D', DIGEST_LEN);
+  return conn;
+}
+
+/** Put <b>len</b> bytes from <b>data</b> on the inbuf of <b>conn</b>,
+ * <b>step</b> bytes at a time, processing each piece as it arrives.  Return
+ * 0 if they were all processed happily, and -1 otherwise. */
+static int
+stream_conn_feed(dir_connection_t *conn, const char *data, size_t len,
+                 size_t step)
+{
+  while (len) {
+    size_t n = MIN(len, step);
+    buf_add(TO_CONN(conn)->inbuf, data, n);
+    if (connection_dir_process_inbuf(conn) < 0)
+      return -1;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/** Return the number of microdescriptors with digests in <b>digests</b> in
+ * the cache. */
+static int
+stream_n_cached_mds(const smartlist_t *digests)
+{
+  int n = 0;
+  SMARTLIST_FOREACH(digests, const char *, d,
+    n += microdesc_cache_lookup_by_digest256(NULL, d) != NULL);
+  return n;
+}
+
+static void
+test_dir_client_stream_microdescs(void *arg)
+{
+  const char *label = arg;
+  const int n_mds = 200;
+  compress_method_t method = ZLIB_METHOD;
+  dir_connection_t *conn = NULL;
+  smartlist_t *digests = smartlist_new();
+  char *body = NULL, *resource = NULL, *compressed = NULL, *headers = NULL;
+  size_t compressed_len = 0;
+  or_options_t *options = get_options_mutable();
+
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("stream_md_cache"));
+  tt_int_op(0, OP_EQ, check_private_dir(options->CacheDirectory,
+                                         CPD_CREATE, NULL));
+
+  stream_mds_new(n_mds, &body, &resource, digests);
+  tt_int_op(strlen(body), OP_GT, 4*16*1024);
+  if (!strcmp(label, "mislabeled"))
+    method = GZIP_METHOD;
+  tt_int_op(0, OP_EQ, tor_compress(&compressed, &compressed_len,
+                                   body, strlen(body), method));
+  tor_asprintf(&headers, "HTTP/1.0 200 OK\r\nContent-Encoding: %s\r\n\r\n",
+               compression_method_get_name(ZLIB_METHOD));
+
+  conn = stream_conn_new(DIR_PURPOSE_FETCH_MICRODESC, resource);
+  tt_int_op(0, OP_EQ, stream_conn_feed(conn, headers, strlen(headers), 7));
+  tt_int_op(0, OP_EQ, stream_conn_feed(conn, compressed, compressed_len, 64));
+
+  if (method == ZLIB_METHOD) {
+    /* We've decompressed everything, and added most of the microdescriptors
+     * to the cache before the connection has even closed. */
+    tt_assert(conn->client_stream);
+    tt_int_op(buf_datalen(TO_CONN(conn)->inbuf), OP_EQ, 0);
+    tt_int_op(connection_dir_client_bytes_streamed(conn), OP_EQ,
+              strlen(headers) + compressed_len);
+    tt_int_op(stream_n_cached_mds(digests), OP_GT, n_mds / 2);
+    tt_int_op(stream_n_cached_mds(digests), OP_LT, n_mds);
+  } else {
+    /* The body wasn't what the headers said it was: we wait until EOF, and
+     * then try everything we know. */
+    tt_assert(! conn->client_stream);
+    tt_assert(conn->client_stream_declined);
+    tt_int_op(buf_datalen(TO_CONN(conn)->inbuf), OP_EQ,
+              strlen(headers) + compressed_len);
+    tt_int_op(stream_n_cached_mds(digests), OP_EQ, 0);
+  }
+
+  tt_int_op(0, OP_EQ, connection_dir_client_reached_eof(conn));
+  tt_assert(! conn->client_stream);
+  tt_int_op(stream_n_cached_mds(digests), OP_EQ, n_mds);
+
+ done:
+  if (conn)
+    connection_free_minimal(TO_CONN(conn));
+  SMARTLIST_FOREACH(digests, char *, cp, tor_free(cp));
+  smartlist_free(digests);
+  tor_free(body);
+  tor_free(resource);
+  tor_free(compressed);
+  tor_free(headers);
+}
+
+static void
+test_dir_client_stream_consensus(void *arg)
+{
+  const char *label = arg;
+  const int truncated = !strcmp(label, "truncated");
+  dir_connection_t *conn = NULL;
+  smartlist_t *lines = smartlist_new();
+  char *body = NULL, *compressed = NULL, *expected = NULL;
+  size_t compressed_len = 0;
+  const char headers[] =
+    "HTTP/1.0 200 OK\r\nContent-Encoding: deflate\r\n\r\n";
+
+  /* Not a real consensus; we just want to see that all of it reaches the
+   * consensus handler, and that we don't let a partial one through. */
+  smartlist_add_strdup(lines, "network-status-version 3 microdesc\n");
+  for (int i = 0; i < 4096; ++i)
+    smartlist_add_asprintf(lines, "r Relay%d AAAA %d\n", i, i);
+  body = smartlist_join_strings(lines, "", 0, NULL);
+  tt_int_op(0, OP_EQ, tor_compress(&compressed, &compressed_len,
+                                   body, strlen(body), ZLIB_METHOD));
+  if (truncated)
+    compressed_len -= 8;
+
+  conn = stream_conn_new(DIR_PURPOSE_FETCH_CONSENSUS, "microdesc");
+  tt_int_op(0, OP_EQ, stream_conn_feed(conn, headers, strlen(headers), 512));
+  tt_int_op(0, OP_EQ, stream_conn_feed(conn, compressed, compressed_len,
+                                       512));
+  tt_assert(conn->client_stream);
+  tt_int_op(buf_datalen(TO_CONN(conn)->inbuf), OP_EQ, 0);
+
+  setup_capture_of_logs(LOG_INFO);
+  tt_int_op(-1, OP_EQ, connection_dir_client_reached_eof(conn));
+  tt_assert(! conn->client_stream);
+  if (truncated) {
+    expect_log_msg_containing("Unable to decompress HTTP body");
+    expect_no_log_msg_containing("Received consensus directory");
+  } else {
+    tor_asprintf(&expected, "Received consensus directory (body size %d)",
+                 (int)strlen(body));
+    expect_log_msg_containing(expected);
+  }
+
+ done:
+  teardown_capture_of_logs();
+  if (conn)
+    connection_free_minimal(TO_CONN(conn));
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(body);
+  tor_free(compressed);
+  tor_free(expected);
+}
+
 static void
 test_dir_should_use_directory_guards(void *data)
 {
@@ -6831,6 +7351,149 @@ test_dir_assumed_flags(void *arg)
   routerstatus_free(rs);
 }
 
+/** Return a newly allocated string holding <b>n</b> microdesc-flavored
+ * routerstatus entries, sorted by identity.  If <b>bad_idx</b> is
+ * nonnegative, replace the <b>w</b> line of that entry with
+ * <b>bad_line</b>. */
+static char *
+make_md_routerstatus_section(int n, int bad_idx, const char *bad_line)
+{
+  smartlist_t *chunks = smartlist_new();
+  char *result;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    char id[DIGEST_LEN], id64[BASE64_DIGEST_LEN+1];
+    char md[DIGEST256_LEN], md64[BASE64_DIGEST256_LEN+1];
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i));
+    memset(md, 'a' + (i % 26), sizeof(md));
+    digest_to_base64(id64, id);
+    digest256_to_base64(md64, md);
+    smartlist_add_asprintf(chunks,
+        "r router%d %s 2020-10-18 00:00:00 10.0.%d.%d 9001 0\n"
+        "m %s\n"
+        "s Fast Running Valid%s\n"
+        "v Tor 0.4.5.0\n"
+        "pr Cons=1-2 Desc=1-2 Link=1-5 Relay=1-3\n"
+        "%s\n",
+        i, id64, i / 256, i % 256, md64, (i % 3) ? "" : " Guard Stable",
+        (i == bad_idx) ? bad_line : "w Bandwidth=1000");
+  }
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Parse <b>section</b>, as made by make_md_routerstatus_section(), into
+ * <b>ns</b> one entry at a time.  Return 0 on success, -1 on failure. */
+static int
+parse_md_routerstatus_section_serially(networkstatus_t *ns,
+                                       const char *section)
+{
+  smartlist_t *tokens = smartlist_new();
+  memarea_t *area = memarea_new();
+  const char *cp = section, *eos = section + strlen(section);
+  int r = 0;
+
+  while (cp < eos) {
+    routerstatus_t *rs = routerstatus_parse_entry_from_string(
+                               area, &cp, eos, tokens, NULL, NULL,
+                               ns->consensus_method, FLAV_MICRODESC);
+    if (!rs) {
+      r = -1;
+      break;
+    }
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  return r;
+}
+
+static void
+test_dir_parse_routerstatus_sharded(void *arg)
+{
+  networkstatus_t *ns1 = NULL, *ns2 = NULL;
+  char *section = NULL;
+  int i, pass;
+
+  (void)arg;
+
+  ns1 = tor_malloc_zero(sizeof(networkstatus_t));
+  ns2 = tor_malloc_zero(sizeof(networkstatus_t));
+  ns1->type = ns2->type = NS_TYPE_CONSENSUS;
+  ns1->flavor = ns2->flavor = FLAV_MICRODESC;
+  ns1->consensus_method = ns2->consensus_method =
+    MAX_SUPPORTED_CONSENSUS_METHOD;
+  ns1->routerstatus_list = smartlist_new();
+  ns2->routerstatus_list = smartlist_new();
+
+  section = make_md_routerstatus_section(100, -1, NULL);
+  tt_int_op(parse_md_routerstatus_section_serially(ns1, section), OP_EQ, 0);
+  tt_int_op(smartlist_len(ns1->routerstatus_list), OP_EQ, 100);
+
+  /* First with every shard tokenized on the main thread, then with the
+   * cpuworkers running. */
+  for (pass = 0; pass < 2; ++pass) {
+    if (pass == 1) {
+      init_keys_client();
+      cpu_init();
+    }
+    SMARTLIST_FOREACH(ns2->routerstatus_list, routerstatus_t *, rs,
+                      routerstatus_free(rs));
+    smartlist_clear(ns2->routerstatus_list);
+    /* Shards of a few entries each, split in the middle of entries. */
+    tt_int_op(routerstatus_parse_section_sharded(ns2, section,
+                                                 section + strlen(section),
+                                                 FLAV_MICRODESC, 500),
+              OP_EQ, 0);
+    tt_int_op(smartlist_len(ns2->routerstatus_list), OP_EQ, 100);
+    for (i = 0; i < 100; ++i) {
+      const routerstatus_t *rs1 = smartlist_get(ns1->routerstatus_list, i);
+      const routerstatus_t *rs2 = smartlist_get(ns2->routerstatus_list, i);
+      tt_str_op(rs1->nickname, OP_EQ, rs2->nickname);
+      tt_mem_op(rs1->identity_digest, OP_EQ, rs2->identity_digest,
+                DIGEST_LEN);
+      tt_mem_op(rs1->descriptor_digest, OP_EQ, rs2->descriptor_digest,
+                DIGEST256_LEN);
+      tt_assert(tor_addr_eq(&rs1->ipv4_addr, &rs2->ipv4_addr));
+      tt_int_op(rs1->is_possible_guard, OP_EQ, rs2->is_possible_guard);
+      tt_int_op(rs1->is_stable, OP_EQ, rs2->is_stable);
+      tt_int_op(rs1->bandwidth_kb, OP_EQ, rs2->bandwidth_kb);
+      tt_int_op(rs1->pv.supports_extend2_cells, OP_EQ,
+                rs2->pv.supports_extend2_cells);
+    }
+  }
+  tor_free(section);
+
+  /* An entry that tokenizes but doesn't parse. */
+  setup_full_capture_of_logs(LOG_WARN);
+  section = make_md_routerstatus_section(100, 61, "w Bandwidth=lots");
+  tt_int_op(routerstatus_parse_section_sharded(ns2, section,
+                                               section + strlen(section),
+                                               FLAV_MICRODESC, 500),
+            OP_EQ, -1);
+  expect_log_msg_containing("Invalid Bandwidth");
+  mock_clean_saved_logs();
+  tor_free(section);
+
+  /* An entry that doesn't tokenize. */
+  section = make_md_routerstatus_section(100, 37, "a");
+  tt_int_op(routerstatus_parse_section_sharded(ns2, section,
+                                               section + strlen(section),
+                                               FLAV_MICRODESC, 500),
+            OP_EQ, -1);
+  expect_log_msg_containing("Error tokenizing router status");
+
+ done:
+  teardown_capture_of_logs();
+  tor_free(section);
+  networkstatus_vote_free(ns1);
+  networkstatus_vote_free(ns2);
+}
+
 static void
 test_dir_post_parsing(void *arg)
 {
@@ -7287,6 +7950,8 @@ struct testcase_t dir_tests[] = {
   DIR(routerinfo_parsing, 0),
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
+  DIR(parse_router_list_ed_sigs, TT_FORK),
+  DIR(parse_router_list_ed_sigs_dump, TT_FORK),
   DIR(load_routers, TT_FORK),
   DIR(load_extrainfo, TT_FORK),
   DIR(getinfo_extra, 0),
@@ -7301,7 +7966,10 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(param_voting),
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
+  DIR(v3_networkstatus_parallel, TT_FORK),
   DIR(random_weighted, 0),
+  DIR(random_weighted_alias, 0),
+  DIR(random_node_tables, TT_FORK),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -7321,6 +7989,10 @@ struct testcase_t dir_tests[] = {
   DIR(download_status_increment, TT_FORK),
   DIR(authdir_type_to_string, 0),
   DIR(conn_purpose_to_string, 0),
+  DIR_ARG(client_stream_microdescs, TT_FORK, "streamed"),
+  DIR_ARG(client_stream_microdescs, TT_FORK, "mislabeled"),
+  DIR_ARG(client_stream_consensus, TT_FORK, "complete"),
+  DIR_ARG(client_stream_consensus, TT_FORK, "truncated"),
   DIR(should_use_directory_guards, 0),
   DIR(should_not_init_request_to_ourselves, TT_FORK),
   DIR(should_not_init_request_to_dir_auths_without_v3_info, 0),
@@ -7339,6 +8011,7 @@ struct testcase_t dir_tests[] = {
   DIR_ARG(find_dl_min_delay, TT_FORK, "car"),
   DIR(assumed_flags, 0),
   DIR(matching_flags, 0),
+  DIR(parse_routerstatus_sharded, TT_FORK),
   DIR(networkstatus_compute_bw_weights_v10, 0),
   DIR(platform_str, 0),
   DIR(format_versions_list, TT_FORK),
@@ -13,11 +13,15 @@
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "feature/dircache/conscache.h"
 #include "feature/dircache/consdiffmgr.h"
 #include "feature/dircommon/directory.h"
 #include "feature/dircache/dircache.h"
 #include "test/test.h"
 #include "lib/compress/compress.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/encoding/confline.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/rend/rendcache.h"
 #include "feature/relay/relay_config.h"
@@ -2915,6 +2919,121 @@ test_dir_handle_get_parse_accept_encoding(void *arg)
   ;
 }
 
+static void
+mock_connection_start_writing(connection_t *conn)
+{
+  (void) conn;
+}
+
+/** Read everything that's waiting on <b>s</b> onto <b>out</b>. */
+static void
+drain_socket_to_buf(tor_socket_t s, buf_t *out)
+{
+  char tmp[16384];
+  ssize_t n;
+  while ((n = tor_socket_recv(s, tmp, sizeof(tmp), 0)) > 0)
+    buf_add(out, tmp, n);
+}
+
+static void
+test_dir_handle_get_spool_file_region(void *arg)
+{
+  const int fail_midway = !strcmp((const char *)arg, "fallback");
+  consensus_cache_t *cache = NULL;
+  consensus_cache_entry_t *ent = NULL;
+  dir_connection_t *conn = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *received = buf_new();
+  uint8_t *body = NULL;
+  char *got = NULL;
+  const size_t bodylen = 300000;
+  const char header[] = "HTTP/1.0 200 OK\r\n\r\n";
+
+  MOCK(connection_start_writing, mock_connection_start_writing);
+
+  char *ddir_fname = tor_strdup(get_fname_rnd("datadir_spool"));
+  tor_free(get_options_mutable()->CacheDirectory);
+  get_options_mutable()->CacheDirectory = tor_strdup(ddir_fname);
+  check_private_dir(ddir_fname, CPD_CREATE, NULL);
+  cache = consensus_cache_open("cons", 128);
+  tt_assert(cache);
+
+  body = tor_malloc(bodylen);
+  crypto_rand((char *)body, bodylen);
+  config_line_t *labels = NULL;
+  config_line_append(&labels, "flavor", "ns");
+  ent = consensus_cache_add(cache, labels, body, bodylen);
+  config_free_lines(labels);
+  tt_assert(ent);
+
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[1]));
+
+  conn = new_dir_conn();
+  TO_CONN(conn)->s = fds[0];
+  fds[0] = TOR_INVALID_SOCKET;
+  TO_CONN(conn)->state = DIR_CONN_STATE_SERVER_WRITING;
+  conn->spool = smartlist_new();
+  smartlist_add(conn->spool, spooled_resource_new_from_cache_entry(ent));
+  consensus_cache_entry_decref(ent);
+  ent = NULL;
+
+  connection_buf_add(header, strlen(header), TO_CONN(conn));
+  tt_int_op(0, OP_EQ, connection_dirserv_flushed_some(conn));
+  if (tor_socket_sendfile_supported()) {
+    /* The whole body is handed to the kernel. */
+    tt_assert(connection_dir_has_file_region(conn));
+    tt_u64_op(conn->file_region_len, OP_EQ, bodylen);
+    tt_int_op(connection_get_outbuf_len(TO_CONN(conn)), OP_EQ,
+              strlen(header));
+  } else {
+    tt_assert(! connection_dir_has_file_region(conn));
+  }
+
+  if (fail_midway && connection_dir_has_file_region(conn)) {
+    /* Send a little from the file, then pretend the kernel gave up. */
+    tt_int_op(connection_flush_to_socket(TO_CONN(conn), 5000), OP_EQ, 5000);
+    drain_socket_to_buf(fds[1], received);
+    tt_u64_op(conn->file_region_len, OP_EQ,
+              bodylen - (5000 - strlen(header)));
+    conn->file_region_failed = 1;
+    tt_int_op(0, OP_EQ, connection_dirserv_flushed_some(conn));
+    tt_assert(! connection_dir_has_file_region(conn));
+    tt_int_op(connection_get_outbuf_len(TO_CONN(conn)), OP_GT, 0);
+  }
+
+  int iters = 0;
+  while (connection_wants_to_flush(TO_CONN(conn)) || conn->spool) {
+    tt_int_op(connection_flush_to_socket(TO_CONN(conn), 1<<20), OP_GE, 0);
+    drain_socket_to_buf(fds[1], received);
+    tt_int_op(0, OP_EQ, connection_dirserv_flushed_some(conn));
+    tt_int_op(++iters, OP_LT, 10000);
+  }
+
+  tt_int_op(buf_datalen(received), OP_EQ, strlen(header) + bodylen);
+  got = tor_malloc(buf_datalen(received));
+  buf_get_bytes(received, got, buf_datalen(received));
+  tt_mem_op(got, OP_EQ, header, strlen(header));
+  tt_mem_op(got + strlen(header), OP_EQ, body, bodylen);
+  tt_assert(! connection_dir_has_file_region(conn));
+
+ done:
+  UNMOCK(connection_start_writing);
+  if (conn)
+    connection_free_minimal(TO_CONN(conn));
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  consensus_cache_entry_decref(ent);
+  consensus_cache_free(cache);
+  buf_free(received);
+  tor_free(body);
+  tor_free(got);
+  tor_free(ddir_fname);
+}
+
 #define DIR_HANDLE_CMD(name,flags) \
   { #name, test_dir_handle_get_##name, (flags), NULL, NULL }
 
@@ -2990,5 +3109,7 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(status_vote_next_consensus_signatures_busy, 0),
   DIR_HANDLE_CMD(status_vote_next_consensus_signatures, 0),
   DIR_HANDLE_CMD(parse_accept_encoding, 0),
+  DIR_HANDLE_CMD_ARG(spool_file_region, TT_FORK, "sendfile"),
+  DIR_HANDLE_CMD_ARG(spool_file_region, TT_FORK, "fallback"),
   END_OF_TESTCASES
 };
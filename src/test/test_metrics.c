@@ -18,12 +18,14 @@
 
 #include "core/mainloop/connection.h"
 #include "core/or/connection_st.h"
+#include "core/or/or_metrics.h"
 #include "core/or/policies.h"
 #include "core/or/port_cfg_st.h"
 
 #include "feature/metrics/metrics.h"
 
 #include "lib/encoding/confline.h"
+#include "lib/metrics/metrics_shard.h"
 #include "lib/metrics/metrics_store.h"
 
 #define TEST_METRICS_ENTRY_NAME    "entryA"
@@ -243,12 +245,210 @@ test_store(void *arg)
   metrics_store_free(store);
 }
 
+static void
+test_histogram(void *arg)
+{
+  metrics_store_t *store = NULL;
+  metrics_store_entry_t *entry = NULL;
+  buf_t *buf = buf_new();
+  char *output = NULL;
+  static const int64_t bounds[] = { 10, 100 };
+  static const uint64_t counts[] = { 1, 2, 3 };
+
+  (void) arg;
+
+  store = metrics_store_new();
+  entry = metrics_store_add(store, METRICS_TYPE_HISTOGRAM,
+                            TEST_METRICS_ENTRY_NAME,
+                            TEST_METRICS_ENTRY_HELP);
+  tt_assert(entry);
+  metrics_store_entry_add_label(entry, TEST_METRICS_ENTRY_LABEL_1);
+  metrics_store_entry_set_histogram(entry, ARRAY_LENGTH(bounds), bounds,
+                                    counts, 1234);
+  tt_int_op(metrics_store_entry_get_value(entry), OP_EQ, 6);
+
+  /* Buckets are cumulative. */
+  static const char *expected =
+    "# HELP " TEST_METRICS_ENTRY_NAME " " TEST_METRICS_ENTRY_HELP "\n"
+    "# TYPE " TEST_METRICS_ENTRY_NAME " histogram\n"
+    TEST_METRICS_ENTRY_NAME "_bucket{" TEST_METRICS_ENTRY_LABEL_1
+    ",le=10} 1\n"
+    TEST_METRICS_ENTRY_NAME "_bucket{" TEST_METRICS_ENTRY_LABEL_1
+    ",le=100} 3\n"
+    TEST_METRICS_ENTRY_NAME "_bucket{" TEST_METRICS_ENTRY_LABEL_1
+    ",le=+Inf} 6\n"
+    TEST_METRICS_ENTRY_NAME "_sum{" TEST_METRICS_ENTRY_LABEL_1 "} 1234\n"
+    TEST_METRICS_ENTRY_NAME "_count{" TEST_METRICS_ENTRY_LABEL_1 "} 6\n";
+
+  metrics_store_get_output(METRICS_FORMAT_PROMETHEUS, store, buf);
+  output = buf_extract(buf, NULL);
+  tt_str_op(expected, OP_EQ, output);
+
+  metrics_store_entry_reset(entry);
+  tt_int_op(metrics_store_entry_get_value(entry), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+  tor_free(output);
+  metrics_store_free(store);
+}
+
+#define SHARD_N_THREADS 4
+#define SHARD_N_ADDS 1000
+
+static metrics_shard_set_t *shard_test_set = NULL;
+static tor_mutex_t shard_test_mutex;
+static int shard_test_n_done = 0;
+
+static void
+shard_test_thread_fn(void *arg)
+{
+  (void) arg;
+  for (int i = 0; i < SHARD_N_ADDS; ++i) {
+    metrics_shard_set_add(shard_test_set, 0, 1);
+    metrics_shard_set_add(shard_test_set, 1, 2);
+  }
+  tor_mutex_acquire(&shard_test_mutex);
+  ++shard_test_n_done;
+  tor_mutex_release(&shard_test_mutex);
+}
+
+static void
+test_shard(void *arg)
+{
+  static const int64_t bounds[] = { 10, 100 };
+  const metrics_shard_histogram_t hist = {
+    .first_slot = 2,
+    .n_bounds = ARRAY_LENGTH(bounds),
+    .bounds = bounds,
+  };
+  uint64_t counts[ARRAY_LENGTH(bounds) + 1];
+  int64_t sum;
+  int n_done, n_shards = 0;
+
+  (void) arg;
+
+  tor_mutex_init(&shard_test_mutex);
+  shard_test_set =
+    metrics_shard_set_new(2 + METRICS_SHARD_HISTOGRAM_N_SLOTS(2));
+  tt_u64_op(metrics_shard_set_get(shard_test_set, 0), OP_EQ, 0);
+
+  /* Out of range slots are a bug, and ignored. */
+  tor_capture_bugs_(1);
+  metrics_shard_set_add(shard_test_set, 100, 1);
+  tt_int_op(smartlist_len(tor_get_captured_bug_log_()), OP_EQ, 1);
+  tor_end_capture_bugs_();
+
+  /* Every thread's additions show up in the total. */
+  metrics_shard_set_add(shard_test_set, 0, 5);
+  for (int i = 0; i < SHARD_N_THREADS; ++i)
+    spawn_func(shard_test_thread_fn, NULL);
+  for (int i = 0; i < 1000; ++i) {
+    tor_mutex_acquire(&shard_test_mutex);
+    n_done = shard_test_n_done;
+    tor_mutex_release(&shard_test_mutex);
+    if (n_done == SHARD_N_THREADS)
+      break;
+    tor_sleep_msec(10);
+  }
+  tt_int_op(n_done, OP_EQ, SHARD_N_THREADS);
+  tt_u64_op(metrics_shard_set_get(shard_test_set, 0), OP_EQ,
+            5 + SHARD_N_THREADS * SHARD_N_ADDS);
+  tt_u64_op(metrics_shard_set_get(shard_test_set, 1), OP_EQ,
+            2 * SHARD_N_THREADS * SHARD_N_ADDS);
+
+  /* Every shard that got written to starts on its own cache line. */
+  for (unsigned i = 0; i < METRICS_SHARD_MAX; ++i) {
+    const void *shard =
+      metrics_shard_set_get_shard_for_testing(shard_test_set, i);
+    if (shard) {
+      ++n_shards;
+      tt_u64_op(((uintptr_t) shard) % 64, OP_EQ, 0);
+    }
+  }
+  tt_int_op(n_shards, OP_GE, 2);
+
+  /* Histograms put each value in the first bucket it fits in. */
+  metrics_shard_histogram_observe(shard_test_set, &hist, 3);
+  metrics_shard_histogram_observe(shard_test_set, &hist, 10);
+  metrics_shard_histogram_observe(shard_test_set, &hist, 11);
+  metrics_shard_histogram_observe(shard_test_set, &hist, 1000);
+  metrics_shard_histogram_get(shard_test_set, &hist, counts, &sum);
+  tt_u64_op(counts[0], OP_EQ, 2);
+  tt_u64_op(counts[1], OP_EQ, 1);
+  tt_u64_op(counts[2], OP_EQ, 1);
+  tt_i64_op(sum, OP_EQ, 1024);
+
+  metrics_shard_set_reset(shard_test_set);
+  tt_u64_op(metrics_shard_set_get(shard_test_set, 0), OP_EQ, 0);
+  tt_u64_op(metrics_shard_set_get(shard_test_set, 1), OP_EQ, 0);
+
+ done:
+  metrics_shard_set_free(shard_test_set);
+  tor_mutex_uninit(&shard_test_mutex);
+}
+
+static void
+test_or_metrics(void *arg)
+{
+  buf_t *buf = buf_new();
+  char *output = NULL;
+  const smartlist_t *stores;
+
+  (void) arg;
+
+  /* Nothing is counted until we're enabled. */
+  or_metrics_note_cell(CELL_CREATE2);
+  or_metrics_set_enabled(true);
+  or_metrics_note_cell(CELL_CREATE2);
+  or_metrics_note_cell(CELL_CREATE2);
+  or_metrics_note_cell(200);
+  or_metrics_note_conn_bytes(CONN_TYPE_OR, 100, 50);
+  or_metrics_note_conn_bytes(CONN_TYPE_OR_LISTENER, 100, 50);
+  or_metrics_note_dos(OR_METRICS_DOS_CONCURRENT_CONN);
+  or_metrics_note_scheduler_run(3);
+  or_metrics_note_onionskin_handshake(false, 10);
+
+  stores = or_metrics_get_stores();
+  tt_int_op(smartlist_len(stores), OP_EQ, 1);
+  metrics_store_get_output(METRICS_FORMAT_PROMETHEUS,
+                           smartlist_get(stores, 0), buf);
+  output = buf_extract(buf, NULL);
+
+  tt_assert(strstr(output, "tor_cells_received_total{command=create2} 2\n"));
+  tt_assert(strstr(output,
+                   "tor_cells_received_total{command=unrecognized} 1\n"));
+  tt_assert(strstr(output, "tor_cells_received_total{command=relay} 0\n"));
+  tt_assert(strstr(output,
+                   "tor_connection_bytes_total{type=or,direction=read} "
+                   "100\n"));
+  tt_assert(strstr(output,
+                   "tor_connection_bytes_total{type=or,direction=written} "
+                   "50\n"));
+  tt_assert(strstr(output, "tor_dos_rejected_total"
+                   "{defense=concurrent_connections} 1\n"));
+  tt_assert(strstr(output, "tor_scheduler_runs_total 1\n"));
+  tt_assert(strstr(output,
+                   "tor_onionskin_handshakes_total{result=failure} 1\n"));
+  tt_assert(strstr(output, "tor_scheduler_pending_channels_bucket{le=2} 0\n"));
+  tt_assert(strstr(output, "tor_scheduler_pending_channels_bucket{le=4} 1\n"));
+  tt_assert(strstr(output, "tor_scheduler_pending_channels_sum 3\n"));
+
+ done:
+  or_metrics_set_enabled(false);
+  buf_free(buf);
+  tor_free(output);
+}
+
 struct testcase_t metrics_tests[] = {
 
   { "config", test_config, TT_FORK, NULL, NULL },
   { "connection", test_connection, TT_FORK, NULL, NULL },
   { "prometheus", test_prometheus, TT_FORK, NULL, NULL },
   { "store", test_store, TT_FORK, NULL, NULL },
+  { "histogram", test_histogram, TT_FORK, NULL, NULL },
+  { "shard", test_shard, TT_FORK, NULL, NULL },
+  { "or_metrics", test_or_metrics, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -5,6 +5,7 @@
 #include "core/or/or.h"
 
 #define DIRVOTE_PRIVATE
+#define MICRODESC_PRIVATE
 #include "app/config/config.h"
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirparse/microdesc_parse.h"
@@ -309,6 +310,175 @@ test_md_cache_broken(void *data)
   microdesc_free_all();
 }
 
+static void
+test_md_cache_index(void *data)
+{
+  or_options_t *options;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  microdesc_t *md1, *md2, *md3;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN], d3[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  char *cache_fn = NULL, *journal_fn = NULL, *index_fn = NULL;
+  char *s = NULL, *idx = NULL, *encoded_family = NULL;
+  size_t cache_len;
+  struct stat st;
+  const time_t now = time(NULL);
+  (void)data;
+
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_datadir_test_idx"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+  tor_asprintf(&cache_fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->CacheDirectory);
+  tor_asprintf(&journal_fn, "%s"PATH_SEPARATOR"cached-microdescs.new",
+               options->CacheDirectory);
+  tor_asprintf(&index_fn, "%s"PATH_SEPARATOR"cached-microdescs.idx",
+               options->CacheDirectory);
+
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+
+  /* Put md1 and md2 in the cache file. */
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = NULL;
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+
+  idx = read_file_to_str(index_fn, RFTS_BIN, &st);
+  tt_assert(idx);
+  tt_int_op(st.st_size, OP_EQ, 32 + 2*56);
+  tor_free(idx);
+
+  /* Reloading from the index doesn't parse anything until we look. */
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  md1 = microdesc_cache_lookup_noparse(mc, d1);
+  md2 = microdesc_cache_lookup_noparse(mc, d2);
+  tt_assert(md1);
+  tt_assert(md2);
+  tt_assert(md1->is_unparsed);
+  tt_assert(md2->is_unparsed);
+  tt_ptr_op(md1->onion_pkey, OP_EQ, NULL);
+  tt_int_op(md1->last_listed, OP_EQ, now);
+  tt_int_op(md1->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_ptr_op(md1, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_assert(! md1->is_unparsed);
+  tt_assert(md1->onion_pkey);
+  tt_assert(md1->onion_curve25519_pkey);
+  tt_assert(md2->is_unparsed);
+  tt_mem_op(md1->body, OP_EQ, test_md1, strlen(test_md1));
+
+  /* Now add md3 to the journal, and move it to the end of the cache file
+   * without rewriting the rest. */
+  s = read_file_to_str(cache_fn, RFTS_BIN, &st);
+  tt_assert(s);
+  cache_len = (size_t)st.st_size;
+  added = microdescs_add_to_cache(mc, test_md3_noannotation, NULL,
+                                  SAVED_NOWHERE, 0, now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  md3 = smartlist_get(added, 0);
+  smartlist_free(added);
+  added = NULL;
+  tt_int_op(md3->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  tt_int_op(microdesc_cache_append_journal(mc), OP_EQ, 0);
+  tt_int_op(md3->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md3->off, OP_GT, cache_len);
+  tor_free(s);
+  s = read_file_to_str(journal_fn, RFTS_BIN, NULL);
+  tt_str_op(s, OP_EQ, "");
+  tor_free(s);
+  s = read_file_to_str(cache_fn, RFTS_BIN, &st);
+  tt_assert(s);
+  tt_mem_op(md1->body, OP_EQ, s + md1->off, md1->bodylen);
+  tt_mem_op(md2->body, OP_EQ, s + md2->off, md2->bodylen);
+  tt_mem_op(md3->body, OP_EQ, s + md3->off, md3->bodylen);
+  tt_mem_op(md3->body, OP_EQ, test_md3_noannotation, md3->bodylen);
+  tor_free(s);
+  idx = read_file_to_str(index_fn, RFTS_BIN, &st);
+  tt_int_op(st.st_size, OP_EQ, 32 + 3*56);
+
+  /* All three come back from the index. */
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  md3 = microdesc_cache_lookup_noparse(mc, d3);
+  tt_assert(md3);
+  tt_assert(md3->is_unparsed);
+  tt_ptr_op(md3, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d3));
+  encoded_family = nodefamily_format(md3->family);
+  tt_str_op(encoded_family, OP_EQ, "nodex nodey nodez");
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d2));
+
+  /* If an index entry doesn't match its body, we drop that entry when we
+   * look it up. */
+  microdesc_free_all();
+  idx[32 + DIGEST256_LEN - 1] ^= 1;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(index_fn, idx, 32 + 3*56, 1));
+  setup_capture_of_logs(LOG_WARN);
+  mc = get_microdesc_cache();
+  {
+    char dbad[DIGEST256_LEN];
+    memcpy(dbad, idx + 32, DIGEST256_LEN);
+    tt_assert(microdesc_cache_lookup_noparse(mc, dbad));
+    tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_by_digest256(mc, dbad));
+    tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_noparse(mc, dbad));
+  }
+  expect_log_msg_containing("didn't match the cache file");
+  teardown_capture_of_logs();
+
+  /* If the cache file changes behind our back, we parse all of it, and
+   * write a new index. */
+  microdesc_free_all();
+  {
+    const char junk[] = "@last-listed 2020-01-01 00:00:00\n";
+    tt_int_op(0, OP_EQ, append_bytes_to_file(cache_fn, junk, strlen(junk),
+                                             1));
+  }
+  mc = get_microdesc_cache();
+  md1 = microdesc_cache_lookup_noparse(mc, d1);
+  md2 = microdesc_cache_lookup_noparse(mc, d2);
+  md3 = microdesc_cache_lookup_noparse(mc, d3);
+  tt_assert(md1 && md2 && md3);
+  tt_assert(! md1->is_unparsed);
+  tt_assert(! md2->is_unparsed);
+  tt_assert(! md3->is_unparsed);
+  tor_free(idx);
+  idx = read_file_to_str(index_fn, RFTS_BIN, &st);
+  tt_int_op(st.st_size, OP_EQ, 32 + 3*56);
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  tt_assert(microdesc_cache_lookup_noparse(mc, d1)->is_unparsed);
+
+ done:
+  teardown_capture_of_logs();
+  if (options)
+    tor_free(options->CacheDirectory);
+  microdesc_free_all();
+  smartlist_free(added);
+  tor_free(cache_fn);
+  tor_free(journal_fn);
+  tor_free(index_fn);
+  tor_free(s);
+  tor_free(idx);
+  tor_free(encoded_family);
+}
+
 /* Generated by chutney. */
 static const char test_ri[] =
   "router test005r 127.0.0.1 5005 0 7005\n"
@@ -923,6 +1093,7 @@ test_md_corrupt_desc(void *arg)
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "cache_index", test_md_cache_index, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
   { "parse_id_ed25519", test_md_parse_id_ed25519, 0, NULL, NULL },
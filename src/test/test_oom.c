@@ -7,6 +7,7 @@
 #define BUFFERS_PRIVATE
 #define CIRCUITLIST_PRIVATE
 #define CONNECTION_PRIVATE
+#define OOM_AGE_PRIVATE
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
 #include "core/or/circuitlist.h"
@@ -14,6 +15,9 @@
 #include "core/mainloop/connection.h"
 #include "app/config/config.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/malloc/mempool.h"
+#include "core/or/memacct.h"
+#include "core/or/oom_age.h"
 #include "core/or/relay.h"
 #include "test/test.h"
 #include "test/test_helpers.h"
@@ -97,6 +101,7 @@ dummy_edge_conn_new(circuit_t *circ,
    * edge connection read/write machinery. */
   add_bytes_to_buf(inbuf, in_bytes);
   add_bytes_to_buf(outbuf, out_bytes);
+  connection_update_oom_age(TO_CONN(conn));
 
   conn->on_circuit = circ;
   if (type == CONN_TYPE_EXIT) {
@@ -144,7 +149,7 @@ test_oom_circbuf(void *arg)
   c2 = dummy_or_circuit_new(20, 20);
 
   tt_int_op(packed_cell_mem_cost(), OP_EQ,
-            sizeof(packed_cell_t));
+            mp_pool_item_cost(sizeof(packed_cell_t)));
   tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
             packed_cell_mem_cost() * 70);
   tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We are still not OOM */
@@ -354,7 +359,250 @@ test_oom_streambuf(void *arg)
   monotime_disable_test_mocking();
 }
 
+/** State for oom_age_visit_record_. */
+typedef struct age_walk_t {
+  /** Every entry we have visited, in order. */
+  smartlist_t *visited;
+  /** Stop after visiting this many entries. */
+  int stop_after;
+  /** If set, remove this entry when we visit the first one. */
+  oom_age_entry_t *to_remove;
+  /** If set, move this entry to <b>new_stamp</b> when we first visit it. */
+  oom_age_entry_t *to_move;
+  uint32_t new_stamp;
+} age_walk_t;
+
+static int
+oom_age_visit_record_(oom_age_entry_t *ent, void *arg)
+{
+  age_walk_t *w = arg;
+  if (ent == w->to_move) {
+    w->to_move = NULL;
+    oom_age_index_update(ent, w->new_stamp);
+    return OOM_AGE_WALK_CONTINUE;
+  }
+  smartlist_add(w->visited, ent);
+  if (w->to_remove) {
+    oom_age_index_remove(w->to_remove);
+    w->to_remove = NULL;
+  }
+  if (smartlist_len(w->visited) == w->stop_after)
+    return OOM_AGE_WALK_STOP;
+  return OOM_AGE_WALK_CONTINUE;
+}
+
+/** Check that the OOM age index hands back entries oldest-first, and puts
+ * back the ones the walk doesn't consume. */
+static void
+test_oom_age_index(void *arg)
+{
+  oom_age_entry_t ents[6];
+  age_walk_t w;
+  const uint32_t now = 0x40000000;
+  const uint32_t bucket_len = 1u << OOM_AGE_BUCKET_SHIFT;
+  int i;
+
+  (void) arg;
+  memset(&w, 0, sizeof(w));
+  w.visited = smartlist_new();
+
+  for (i = 0; i < 6; ++i)
+    oom_age_entry_init(&ents[i], OOM_AGE_KIND_CIRCUIT);
+
+  /* Nothing to walk yet. */
+  tt_int_op(oom_age_index_walk(now, oom_age_visit_record_, &w), OP_EQ, 0);
+  tt_int_op(smartlist_len(w.visited), OP_EQ, 0);
+
+  /* Newest first, to anchor the ring; then some older entries in other
+   * buckets, one in the same bucket as another, and one far too old for
+   * the ring. */
+  oom_age_index_update(&ents[0], now);
+  oom_age_index_update(&ents[1], now - 3 * bucket_len);
+  oom_age_index_update(&ents[2], now - 3 * bucket_len - 1);
+  oom_age_index_update(&ents[3], now - 100 * bucket_len);
+  oom_age_index_update(&ents[4], now - (OOM_AGE_N_BUCKETS + 5) * bucket_len);
+  oom_age_index_update(&ents[5], now - 2 * bucket_len);
+  tt_int_op(oom_age_index_get_n_entries(), OP_EQ, 6);
+  for (i = 0; i < 6; ++i)
+    tt_assert(oom_age_entry_is_indexed(&ents[i]));
+
+  /* Updating an entry to its current stamp changes nothing. */
+  oom_age_index_update(&ents[5], now - 2 * bucket_len);
+  tt_int_op(oom_age_index_get_n_entries(), OP_EQ, 6);
+
+  /* A full walk sees everything, oldest first. */
+  tt_int_op(oom_age_index_walk(now, oom_age_visit_record_, &w), OP_EQ, 0);
+  tt_int_op(smartlist_len(w.visited), OP_EQ, 6);
+  tt_ptr_op(smartlist_get(w.visited, 0), OP_EQ, &ents[4]);
+  tt_ptr_op(smartlist_get(w.visited, 1), OP_EQ, &ents[3]);
+  tt_ptr_op(smartlist_get(w.visited, 2), OP_EQ, &ents[2]);
+  tt_ptr_op(smartlist_get(w.visited, 3), OP_EQ, &ents[1]);
+  tt_ptr_op(smartlist_get(w.visited, 4), OP_EQ, &ents[5]);
+  tt_ptr_op(smartlist_get(w.visited, 5), OP_EQ, &ents[0]);
+  /* ... and puts it all back. */
+  tt_int_op(oom_age_index_get_n_entries(), OP_EQ, 6);
+  for (i = 0; i < 6; ++i)
+    tt_assert(oom_age_entry_is_indexed(&ents[i]));
+
+  /* Stop part way through; remove an entry we have not reached yet, and
+   * move another one so that we come back to it later. */
+  smartlist_clear(w.visited);
+  w.stop_after = 3;
+  w.to_remove = &ents[2];
+  w.to_move = &ents[3];
+  w.new_stamp = now - 2 * bucket_len + 1;
+  tt_int_op(oom_age_index_walk(now, oom_age_visit_record_, &w), OP_EQ, 1);
+  tt_int_op(smartlist_len(w.visited), OP_EQ, 3);
+  tt_ptr_op(smartlist_get(w.visited, 0), OP_EQ, &ents[4]);
+  tt_ptr_op(smartlist_get(w.visited, 1), OP_EQ, &ents[1]);
+  tt_ptr_op(smartlist_get(w.visited, 2), OP_EQ, &ents[5]);
+  tt_assert(! oom_age_entry_is_indexed(&ents[2]));
+  tt_int_op(oom_age_index_get_n_entries(), OP_EQ, 5);
+  tt_int_op(ents[3].stamp, OP_EQ, now - 2 * bucket_len + 1);
+
+  /* Removing everything empties the index. */
+  for (i = 0; i < 6; ++i)
+    oom_age_index_remove(&ents[i]);
+  tt_int_op(oom_age_index_get_n_entries(), OP_EQ, 0);
+  smartlist_clear(w.visited);
+  w.stop_after = 0;
+  tt_int_op(oom_age_index_walk(now, oom_age_visit_record_, &w), OP_EQ, 0);
+  tt_int_op(smartlist_len(w.visited), OP_EQ, 0);
+
+ done:
+  smartlist_free(w.visited);
+}
+
+/** Fake subsystem allocations for test_oom_memacct. */
+static size_t fake_cache_alloc = 0;
+static size_t fake_queue_alloc = 0;
+static size_t fake_other_alloc = 0;
+/** Which fake subsystems have been asked to reclaim memory, in order. */
+static smartlist_t *fake_reclaim_log = NULL;
+
+static size_t
+fake_cache_get_allocation(void)
+{
+  return fake_cache_alloc;
+}
+
+static size_t
+fake_queue_get_allocation(void)
+{
+  return fake_queue_alloc;
+}
+
+static size_t
+fake_other_get_allocation(void)
+{
+  return fake_other_alloc;
+}
+
+static size_t
+fake_cache_handle_oom(time_t now, size_t min_remove_bytes)
+{
+  (void) now;
+  smartlist_add_asprintf(fake_reclaim_log, "cache:%"TOR_PRIuSZ,
+                         min_remove_bytes);
+  fake_cache_alloc -= min_remove_bytes;
+  return min_remove_bytes;
+}
+
+static size_t
+fake_queue_handle_oom(time_t now, size_t min_remove_bytes)
+{
+  (void) now;
+  smartlist_add_asprintf(fake_reclaim_log, "queue:%"TOR_PRIuSZ,
+                         min_remove_bytes);
+  fake_queue_alloc -= min_remove_bytes;
+  return min_remove_bytes;
+}
+
+static const memacct_t fake_queue_acct = {
+  .name = "queue",
+  .get_allocation = fake_queue_get_allocation,
+  .handle_oom = fake_queue_handle_oom,
+  .priority = MEMACCT_PRIO_CIRCUITS,
+};
+static const memacct_t fake_cache_acct = {
+  .name = "cache",
+  .get_allocation = fake_cache_get_allocation,
+  .handle_oom = fake_cache_handle_oom,
+  .priority = MEMACCT_PRIO_HS_CACHE,
+  .budget_percent = 20,
+};
+static const memacct_t fake_other_acct = {
+  .name = "other",
+  .get_allocation = fake_other_get_allocation,
+};
+
+/** Check that memacct adds up what its subsystems have allocated, and asks
+ * them to give memory back in order of priority, within their budgets. */
+static void
+test_oom_memacct(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  char *cp = NULL;
+  size_t alloc;
+
+  (void) arg;
+  fake_reclaim_log = smartlist_new();
+
+  /* Replace the real subsystems with our fakes; register the low-priority
+   * one first to make sure the order doesn't matter. */
+  memacct_free_all();
+  memacct_register(&fake_queue_acct);
+  memacct_register(&fake_cache_acct);
+  memacct_register(&fake_other_acct);
+  memacct_register(&fake_cache_acct);
+
+  options->MaxMemInQueues = 1000;
+  options->MaxMemInQueues_low_threshold = 750;
+  fake_cache_alloc = 100;
+  fake_queue_alloc = 500;
+  fake_other_alloc = 100;
+  tt_u64_op(memacct_get_total_allocation(), OP_EQ, 700);
+  tt_int_op(cell_queues_check_size(), OP_EQ, 0);
+
+  tt_int_op(memacct_get_allocation_by_name("cache", &alloc), OP_EQ, 0);
+  tt_u64_op(alloc, OP_EQ, 100);
+  tt_int_op(memacct_get_allocation_by_name("nonesuch", &alloc), OP_EQ, -1);
+  cp = memacct_get_usage_for_control();
+  tt_str_op(cp, OP_EQ, "other=100\ncache=100\nqueue=500");
+  tor_free(cp);
+
+  /* Over the limit: the cache is over its budget of 200 bytes, so it
+   * shrinks to 100; then the queues shrink until we are down to 900. */
+  fake_cache_alloc = 300;
+  fake_queue_alloc = 750;
+  tt_int_op(cell_queues_check_size(), OP_EQ, 1);
+  tt_int_op(smartlist_len(fake_reclaim_log), OP_EQ, 2);
+  tt_str_op(smartlist_get(fake_reclaim_log, 0), OP_EQ, "cache:200");
+  tt_str_op(smartlist_get(fake_reclaim_log, 1), OP_EQ, "queue:50");
+  tt_u64_op(memacct_get_total_allocation(), OP_EQ, 900);
+
+  cp = memacct_get_reclaimed_for_control();
+  tt_str_op(cp, OP_EQ, "cache=200\nqueue=50");
+  tor_free(cp);
+
+  /* Within budget: only the queues give anything back. */
+  SMARTLIST_FOREACH(fake_reclaim_log, char *, c, tor_free(c));
+  smartlist_clear(fake_reclaim_log);
+  fake_queue_alloc = 850;
+  tt_int_op(cell_queues_check_size(), OP_EQ, 1);
+  tt_int_op(smartlist_len(fake_reclaim_log), OP_EQ, 1);
+  tt_str_op(smartlist_get(fake_reclaim_log, 0), OP_EQ, "queue:150");
+
+ done:
+  tor_free(cp);
+  memacct_free_all();
+  SMARTLIST_FOREACH(fake_reclaim_log, char *, c, tor_free(c));
+  smartlist_free(fake_reclaim_log);
+}
+
 struct testcase_t oom_tests[] = {
+  { "age_index", test_oom_age_index, TT_FORK, NULL, NULL },
+  { "memacct", test_oom_memacct, TT_FORK, NULL, NULL },
   { "circbuf", test_oom_circbuf, TT_FORK, NULL, NULL },
   { "streambuf", test_oom_streambuf, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
@@ -253,6 +253,51 @@ test_parsecommon_get_next_token_success(void *arg)
   return;
 }
 
+static void
+test_parsecommon_get_next_token_keyword_prefix(void *arg)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  token_rule_t table[] = {
+          T01("uptime", K_UPTIME, ARGS, NO_OBJ),
+          T01("u", K_HIBERNATING, ARGS, NO_OBJ),
+          END_OF_TABLE,
+  };
+  /* Keywords that share a prefix with a table entry must not match it; a
+   * begin line with no newline after it isn't an object. */
+  const char *str =
+    "uptim 1\nuptimes 2\nu 3\nuptime 4\n-----BEGIN FOO-----";
+  directory_token_t *tok;
+  (void)arg;
+
+  tt_uint_op(table[0].t_len, OP_EQ, strlen("uptime"));
+  tt_uint_op(table[1].t_len, OP_EQ, 1);
+
+  tt_int_op(tokenize_string(area, str, NULL, tokens, table, 0), OP_EQ, 0);
+  tt_int_op(smartlist_len(tokens), OP_EQ, 5);
+  tok = smartlist_get(tokens, 0);
+  tt_int_op(tok->tp, OP_EQ, K_OPT);
+  tt_str_op(tok->args[0], OP_EQ, "uptim 1");
+  tok = smartlist_get(tokens, 1);
+  tt_int_op(tok->tp, OP_EQ, K_OPT);
+  tt_str_op(tok->args[0], OP_EQ, "uptimes 2");
+  tok = smartlist_get(tokens, 2);
+  tt_int_op(tok->tp, OP_EQ, K_HIBERNATING);
+  tt_str_op(tok->args[0], OP_EQ, "3");
+  tok = smartlist_get(tokens, 3);
+  tt_int_op(tok->tp, OP_EQ, K_UPTIME);
+  tt_str_op(tok->args[0], OP_EQ, "4");
+  tt_assert(!tok->object_type);
+  tok = smartlist_get(tokens, 4);
+  tt_int_op(tok->tp, OP_EQ, K_OPT);
+  tt_assert(!tok->object_type);
+
+ done:
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+}
+
 static void
 test_parsecommon_get_next_token_concat_args(void *arg)
 {
@@ -581,6 +626,7 @@ struct testcase_t parsecommon_tests[] = {
   PARSECOMMON_TEST(tokenize_string_at_end),
   PARSECOMMON_TEST(tokenize_string_no_annotations),
   PARSECOMMON_TEST(get_next_token_success),
+  PARSECOMMON_TEST(get_next_token_keyword_prefix),
   PARSECOMMON_TEST(get_next_token_concat_args),
   PARSECOMMON_TEST(get_next_token_parse_keys),
   PARSECOMMON_TEST(get_next_token_object),
@@ -3,16 +3,19 @@
 
 #define CONFIG_PRIVATE
 #define POLICIES_PRIVATE
+#define POLICY_TRIE_PRIVATE
 
 #include "core/or/or.h"
 #include "app/config/config.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/policies.h"
+#include "core/or/policy_trie.h"
 #include "core/or/extendinfo.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_descriptor.h"
 #include "feature/relay/router.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
 #include "test/log_test_helpers.h"
@@ -2673,6 +2676,217 @@ test_policies_fascist_firewall_choose_address(void *arg)
 #undef CHECK_CHOSEN_ADDR_NODE
 #undef CHECK_CHOSEN_ADDR_RN
 
+/** Set <b>addr</b> to a random address that's likely to be interesting for
+ * <b>policy</b>: usually one near the address of one of its entries. */
+static void
+compiled_policy_pick_addr(const smartlist_t *policy, tor_addr_t *addr)
+{
+  const addr_policy_t *e;
+  uint8_t bytes[16];
+  int keep_bits, i;
+
+  crypto_rand((char *)bytes, sizeof(bytes));
+  if (!smartlist_len(policy) || crypto_rand_int(4) == 0) {
+    if (crypto_rand_int(2))
+      tor_addr_from_ipv6_bytes(addr, bytes);
+    else
+      tor_addr_from_ipv4h(addr, get_uint32(bytes));
+    return;
+  }
+
+  /* Keep some of the bits of an entry's address, give or take a couple. */
+  e = smartlist_get(policy, crypto_rand_int(smartlist_len(policy)));
+  if (tor_addr_family(&e->addr) == AF_INET) {
+    uint32_t a = tor_addr_to_ipv4h(&e->addr), mask;
+    keep_bits = MAX(0, MIN(32, e->maskbits - 2 + crypto_rand_int(5)));
+    mask = keep_bits ? (0xffffffffu << (32 - keep_bits)) : 0;
+    tor_addr_from_ipv4h(addr, (a & mask) | (get_uint32(bytes) & ~mask));
+  } else {
+    const uint8_t *a = tor_addr_to_in6_addr8(&e->addr);
+    keep_bits = MAX(0, MIN(128, e->maskbits - 2 + crypto_rand_int(5)));
+    for (i = 0; i < keep_bits; ++i) {
+      uint8_t bit = 0x80 >> (i & 7);
+      bytes[i >> 3] = (bytes[i >> 3] & ~bit) | (a[i >> 3] & bit);
+    }
+    tor_addr_from_ipv6_bytes(addr, bytes);
+  }
+}
+
+/** Return a random port that's likely to be interesting for
+ * <b>policy</b>, or 0. */
+static uint16_t
+compiled_policy_pick_port(const smartlist_t *policy)
+{
+  const addr_policy_t *e;
+  switch (crypto_rand_int(4)) {
+    case 0:
+      return 0;
+    case 1:
+      return 1 + crypto_rand_int(65535);
+    default:
+      if (!smartlist_len(policy))
+        return 80;
+      e = smartlist_get(policy, crypto_rand_int(smartlist_len(policy)));
+      switch (crypto_rand_int(4)) {
+        case 0: return e->prt_min;
+        case 1: return e->prt_max;
+        case 2: return e->prt_min > 1 ? e->prt_min - 1 : 1;
+        default: return e->prt_max < 65535 ? e->prt_max + 1 : 65535;
+      }
+  }
+}
+
+/** Check that compiling <b>policy</b> doesn't change the answer for lots of
+ * interesting addresses and ports. */
+static void
+check_compiled_policy_matches(const smartlist_t *policy)
+{
+  compiled_policy_t *cp = addr_policy_compile(policy);
+  tor_addr_t addr;
+  uint16_t port;
+  int i;
+
+  tt_assert(cp);
+  tt_assert(!compiled_policy_is_linear(cp));
+  for (i = 0; i < 5000; ++i) {
+    compiled_policy_pick_addr(policy, &addr);
+    port = compiled_policy_pick_port(policy);
+    if (i % 10 == 0) {
+      /* An unknown address. */
+      tor_addr_make_unspec(&addr);
+      if (!port)
+        port = 443;
+    }
+    tt_int_op(compare_tor_addr_to_compiled_policy(&addr, port, cp), OP_EQ,
+              compare_tor_addr_to_addr_policy(&addr, port, policy));
+  }
+  tt_int_op(compare_tor_addr_to_compiled_policy(NULL, 80, cp), OP_EQ,
+            compare_tor_addr_to_addr_policy(NULL, 80, policy));
+
+ done:
+  compiled_policy_free(cp);
+}
+
+static void
+test_policies_compiled(void *arg)
+{
+  smartlist_t *policy = NULL, *policy2 = NULL;
+  compiled_policy_t *cp = NULL, *cp2 = NULL;
+  addr_policy_t *p;
+  tor_addr_t addr;
+  int i, malformed_list;
+  (void)arg;
+
+  /* The default exit policy, and the reduced one. */
+  tt_int_op(0, OP_EQ, policies_parse_exit_policy(NULL, &policy,
+                                                 EXIT_POLICY_IPV6_ENABLED |
+                                                 EXIT_POLICY_REJECT_PRIVATE |
+                                                 EXIT_POLICY_ADD_DEFAULT,
+                                                 NULL));
+  check_compiled_policy_matches(policy);
+  addr_policy_list_free(policy);
+  policy = NULL;
+  tt_int_op(0, OP_EQ, policies_parse_exit_policy(NULL, &policy,
+                                                 EXIT_POLICY_IPV6_ENABLED |
+                                                 EXIT_POLICY_REJECT_PRIVATE |
+                                                 EXIT_POLICY_ADD_REDUCED,
+                                                 NULL));
+  check_compiled_policy_matches(policy);
+  addr_policy_list_free(policy);
+  policy = NULL;
+
+  /* Overlapping prefixes and ports, in both orders. */
+  append_exit_policy_string(&policy, "accept 10.1.2.0/24:80-90");
+  append_exit_policy_string(&policy, "reject 10.1.0.0/16:85-100");
+  append_exit_policy_string(&policy, "accept 10.0.0.0/8:*");
+  append_exit_policy_string(&policy, "reject 10.1.2.3:*");
+  append_exit_policy_string(&policy, "reject 0.0.0.0/1:22");
+  append_exit_policy_string(&policy, "accept [2001:db8::]/33:443");
+  append_exit_policy_string(&policy, "reject [2001:db8::]/32:*");
+  append_exit_policy_string(&policy, "accept *4:1-1024");
+  append_exit_policy_string(&policy, "reject *6:*");
+  append_exit_policy_string(&policy, "accept 192.0.2.0/27:*");
+  check_compiled_policy_matches(policy);
+  addr_policy_list_free(policy);
+  policy = NULL;
+
+  /* Random policies, with a few bases so that prefixes overlap. */
+  for (i = 0; i < 20; ++i) {
+    int j, n = 1 + crypto_rand_int(200);
+    for (j = 0; j < n; ++j) {
+      char *s;
+      int lo = 1 + crypto_rand_int(65535);
+      int hi = lo + crypto_rand_int(65536 - lo);
+      const char *action = crypto_rand_int(2) ? "accept" : "reject";
+      if (crypto_rand_int(2)) {
+        tor_asprintf(&s, "%s %d.%d.0.0/%d:%d-%d", action,
+                     10 + crypto_rand_int(3), crypto_rand_int(4),
+                     crypto_rand_int(33), lo, hi);
+      } else {
+        tor_asprintf(&s, "%s [2001:db8:%x::]/%d:%d-%d", action,
+                     crypto_rand_int(4), crypto_rand_int(129), lo, hi);
+      }
+      append_exit_policy_string(&policy, s);
+      tor_free(s);
+    }
+    check_compiled_policy_matches(policy);
+    addr_policy_list_free(policy);
+    policy = NULL;
+  }
+  tt_int_op(compiled_policies_count(), OP_EQ, 0);
+
+  /* Equal policies share a compiled policy. */
+  append_exit_policy_string(&policy, "reject 1.2.3.4:*");
+  append_exit_policy_string(&policy, "accept *4:80");
+  append_exit_policy_string(&policy2, "reject 1.2.3.4:*");
+  append_exit_policy_string(&policy2, "accept *4:80");
+  cp = addr_policy_compile(policy);
+  cp2 = addr_policy_compile(policy2);
+  tt_ptr_op(cp, OP_EQ, cp2);
+  tt_int_op(compiled_policies_count(), OP_EQ, 1);
+  compiled_policy_free(cp2);
+  tor_addr_from_ipv4h(&addr, 0x01020304);
+  tt_int_op(compare_tor_addr_to_compiled_policy(&addr, 80, cp), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  tor_addr_from_ipv4h(&addr, 0x01020305);
+  tt_int_op(compare_tor_addr_to_compiled_policy(&addr, 80, cp), OP_EQ,
+            ADDR_POLICY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_compiled_policy(&addr, 0, cp), OP_EQ,
+            ADDR_POLICY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_compiled_policy(NULL, 80, cp), OP_EQ,
+            ADDR_POLICY_PROBABLY_ACCEPTED);
+  tt_int_op(compare_tor_addr_to_compiled_policy(NULL, 0, cp), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  compiled_policy_free(cp);
+  tt_int_op(compiled_policies_count(), OP_EQ, 0);
+  addr_policy_list_free(policy2);
+  policy2 = NULL;
+
+  /* A policy with an AF_UNSPEC entry can't be compiled, but still works. */
+  p = router_parse_addr_policy_item_from_string("reject *:25", -1,
+                                                &malformed_list);
+  tt_ptr_op(p, OP_NE, NULL);
+  tt_int_op(tor_addr_family(&p->addr), OP_EQ, AF_UNSPEC);
+  smartlist_add(policy, p);
+  cp = addr_policy_compile(policy);
+  tt_assert(compiled_policy_is_linear(cp));
+  setup_full_capture_of_logs(LOG_WARN);
+  tt_int_op(compare_tor_addr_to_compiled_policy(NULL, 25, cp), OP_EQ,
+            ADDR_POLICY_REJECTED);
+  expect_single_log_msg_containing("AF_UNSPEC");
+  teardown_capture_of_logs();
+
+  tt_ptr_op(addr_policy_compile(NULL), OP_EQ, NULL);
+  tt_int_op(compare_tor_addr_to_compiled_policy(&addr, 80, NULL), OP_EQ,
+            ADDR_POLICY_ACCEPTED);
+
+ done:
+  teardown_capture_of_logs();
+  compiled_policy_free(cp);
+  addr_policy_list_free(policy);
+  addr_policy_list_free(policy2);
+}
+
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
@@ -2687,5 +2901,6 @@ struct testcase_t policy_tests[] = {
     test_policies_fascist_firewall_allows_address, 0, NULL, NULL },
   { "reachable_addr_choose",
     test_policies_fascist_firewall_choose_address, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
   END_OF_TESTCASES
 };
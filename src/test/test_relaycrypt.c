@@ -4,6 +4,7 @@
 /* See LICENSE for licensing information */
 
 #define CRYPT_PATH_PRIVATE
+#define RELAY_CRYPTO_PIPELINE_PRIVATE
 
 #include "core/or/or.h"
 #include "core/or/circuitbuild.h"
@@ -12,6 +13,9 @@
 #include "lib/crypt_ops/crypto_rand.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/crypto/relay_crypto_pipeline.h"
+#include "core/mainloop/cpuworker.h"
+#include "lib/evloop/workqueue.h"
 #include "core/or/crypt_path.h"
 #include "core/or/cell_st.h"
 #include "core/or/or_circuit_st.h"
@@ -181,12 +185,281 @@ test_relaycrypt_inbound(void *arg)
   ;
 }
 
+/* Make sure that handling cells in a batch at a relay gives the same
+ * results as handling them one at a time. */
+static void
+test_relaycrypt_batch(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  relay_crypto_t single;
+  relay_header_t rh;
+  cell_t encrypted[20], batched[20], *cellp[20];
+  char recognized[20];
+  uint8_t digests[20 * DIGEST_LEN];
+  int i, n_recognized = 0;
+
+  memset(&single, 0, sizeof(single));
+  tt_assert(cs);
+  tt_int_op(0, OP_EQ,
+            relay_crypto_init(&single, KEY_MATERIAL[0],
+                              sizeof(KEY_MATERIAL[0]), 0, 0));
+
+  /* Some of these are for the first hop, and some go further. */
+  for (i = 0; i < 20; ++i) {
+    crypto_rand((char *)&encrypted[i], sizeof(encrypted[i]));
+    relay_header_unpack(&rh, encrypted[i].payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(encrypted[i].payload, &rh);
+    relay_encrypt_cell_outbound(&encrypted[i], cs->origin_circ,
+                                (i % 3) ? cs->origin_circ->cpath->prev :
+                                          cs->origin_circ->cpath);
+    memcpy(&batched[i], &encrypted[i], sizeof(cell_t));
+    cellp[i] = &batched[i];
+  }
+
+  relay_crypto_crypt_or_cells(&cs->or_circ[0]->crypto, cellp, 20,
+                              CELL_DIRECTION_OUT, recognized, digests);
+
+  for (i = 0; i < 20; ++i) {
+    char r = 0;
+    relay_crypto_crypt_or_cell(&single, &encrypted[i], CELL_DIRECTION_OUT,
+                               &r);
+    tt_int_op(recognized[i], OP_EQ, r);
+    tt_int_op(recognized[i], OP_EQ, (i % 3) == 0);
+    tt_mem_op(encrypted[i].payload, OP_EQ, batched[i].payload,
+              CELL_PAYLOAD_SIZE);
+    if (r) {
+      relay_crypto_record_sendme_digest(&single, true);
+      tt_mem_op(relay_crypto_get_sendme_digest(&single), OP_EQ,
+                digests + i*DIGEST_LEN, DIGEST_LEN);
+      ++n_recognized;
+    }
+  }
+  tt_int_op(n_recognized, OP_EQ, 7);
+
+  /* And the other way. */
+  relay_crypto_crypt_or_cells(&cs->or_circ[0]->crypto, cellp, 20,
+                              CELL_DIRECTION_IN, recognized, NULL);
+  for (i = 0; i < 20; ++i) {
+    char r = 0;
+    relay_crypto_crypt_or_cell(&single, &encrypted[i], CELL_DIRECTION_IN, &r);
+    tt_int_op(recognized[i], OP_EQ, 0);
+    tt_mem_op(encrypted[i].payload, OP_EQ, batched[i].payload,
+              CELL_PAYLOAD_SIZE);
+  }
+
+ done:
+  relay_crypto_clear(&single);
+}
+
+/** Return a new pipeline cell for <b>op</b>, holding a copy of <b>cell</b>. */
+static relay_crypto_cell_t *
+pipeline_cell_new(const cell_t *cell, relay_crypto_op_t op)
+{
+  relay_crypto_cell_t *rcell = tor_malloc_zero(sizeof(*rcell));
+  memcpy(&rcell->cell, cell, sizeof(cell_t));
+  rcell->op = op;
+  return rcell;
+}
+
+/* As test_relaycrypt_outbound, but do the relay side in batches with the
+ * relay crypto pipeline's jobs. */
+static void
+test_relaycrypt_pipeline_outbound(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  relay_header_t rh;
+  cell_t orig[20];
+  relay_crypto_job_t *job = NULL;
+  relay_crypto_cell_t *rcell;
+  int i, j;
+  tt_assert(cs);
+
+  job = relay_crypto_job_new(&cs->or_circ[0]->crypto);
+  for (i = 0; i < 20; ++i) {
+    cell_t encrypted;
+    crypto_rand((char *)&orig[i], sizeof(orig[i]));
+    relay_header_unpack(&rh, orig[i].payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig[i].payload, &rh);
+    memcpy(&encrypted, &orig[i], sizeof(cell_t));
+    relay_encrypt_cell_outbound(&encrypted, cs->origin_circ,
+                                cs->origin_circ->cpath->prev);
+    relay_crypto_job_add_cell(job, pipeline_cell_new(&encrypted,
+                                      RELAY_CRYPTO_OP_DECRYPT_OUTBOUND));
+  }
+  tt_int_op(job->n_cells, OP_EQ, 20);
+
+  for (j = 0; j < 3; ++j) {
+    /* Each hop handles the whole batch at once, with its own keys. */
+    memcpy(&job->crypto, &cs->or_circ[j]->crypto, sizeof(relay_crypto_t));
+    relay_crypto_job_run(job);
+    i = 0;
+    TOR_SIMPLEQ_FOREACH(rcell, &job->cells, next) {
+      tt_int_op(rcell->recognized, OP_EQ, j == 2);
+      if (j == 2) {
+        uint8_t expected[DIGEST_LEN];
+        tt_mem_op(orig[i].payload, OP_EQ, rcell->cell.payload,
+                  CELL_PAYLOAD_SIZE);
+        /* Only the last cell's digest is still in the crypto state. */
+        if (i == 19) {
+          relay_crypto_record_sendme_digest(&cs->or_circ[j]->crypto, true);
+          memcpy(expected,
+                 relay_crypto_get_sendme_digest(&cs->or_circ[j]->crypto),
+                 DIGEST_LEN);
+          tt_mem_op(expected, OP_EQ, rcell->sendme_digest, DIGEST_LEN);
+        }
+      }
+      ++i;
+    }
+    tt_int_op(i, OP_EQ, 20);
+  }
+
+ done:
+  relay_crypto_job_free(job);
+}
+
+/* As test_relaycrypt_inbound, but originate and relay the cells with the
+ * relay crypto pipeline's jobs. */
+static void
+test_relaycrypt_pipeline_inbound(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  relay_header_t rh;
+  cell_t orig[20];
+  relay_crypto_job_t *job = NULL;
+  relay_crypto_cell_t *rcell;
+  int i, j;
+  tt_assert(cs);
+
+  job = relay_crypto_job_new(&cs->or_circ[2]->crypto);
+  for (i = 0; i < 20; ++i) {
+    crypto_rand((char *)&orig[i], sizeof(orig[i]));
+    relay_header_unpack(&rh, orig[i].payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig[i].payload, &rh);
+    rcell = pipeline_cell_new(&orig[i], RELAY_CRYPTO_OP_ORIGINATE);
+    rcell->want_sendme_digest = (i == 19);
+    relay_crypto_job_add_cell(job, rcell);
+  }
+  relay_crypto_job_run(job);
+
+  /* The last hop's digest should match what we recorded. */
+  relay_crypto_record_sendme_digest(&cs->or_circ[2]->crypto, false);
+  rcell = TOR_SIMPLEQ_FIRST(&job->cells);
+  for (i = 0; i < 19; ++i)
+    rcell = TOR_SIMPLEQ_NEXT(rcell, next);
+  tt_mem_op(relay_crypto_get_sendme_digest(&cs->or_circ[2]->crypto), OP_EQ,
+            rcell->sendme_digest, DIGEST_LEN);
+
+  for (j = 1; j >= 0; --j) {
+    memcpy(&job->crypto, &cs->or_circ[j]->crypto, sizeof(relay_crypto_t));
+    TOR_SIMPLEQ_FOREACH(rcell, &job->cells, next)
+      rcell->op = RELAY_CRYPTO_OP_ENCRYPT_INBOUND;
+    relay_crypto_job_run(job);
+  }
+
+  i = 0;
+  TOR_SIMPLEQ_FOREACH(rcell, &job->cells, next) {
+    crypt_path_t *layer_hint = NULL;
+    char recognized = 0;
+    int r = relay_decrypt_cell(TO_CIRCUIT(cs->origin_circ), &rcell->cell,
+                               CELL_DIRECTION_IN, &layer_hint, &recognized);
+    tt_int_op(r, OP_EQ, 0);
+    tt_int_op(recognized, OP_EQ, 1);
+    tt_ptr_op(layer_hint, OP_EQ, cs->origin_circ->cpath->prev);
+    relay_header_unpack(&rh, orig[i].payload);
+    tt_mem_op(orig[i].payload + RELAY_HEADER_SIZE, OP_EQ,
+              rcell->cell.payload + RELAY_HEADER_SIZE,
+              CELL_PAYLOAD_SIZE - RELAY_HEADER_SIZE);
+    ++i;
+  }
+
+ done:
+  relay_crypto_job_free(job);
+}
+
+static workqueue_reply_t (*pipeline_work_fn)(void *, void *) = NULL;
+static void (*pipeline_reply_fn)(void *) = NULL;
+static void *pipeline_work_arg = NULL;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void) priority;
+  pipeline_work_fn = fn;
+  pipeline_reply_fn = reply_fn;
+  pipeline_work_arg = arg;
+  /* Nobody looks at this but to see that it isn't NULL. */
+  return (workqueue_entry_t *) arg;
+}
+
+/* Make sure that freeing a circuit while a worker has its cells doesn't
+ * free the keys out from under the worker. */
+static void
+test_relaycrypt_pipeline_circuit_free(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  or_circuit_t *circ = NULL;
+  cell_t cell;
+  tt_assert(cs);
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+
+  circ = or_circuit_new(0, NULL);
+  tt_int_op(0, OP_EQ,
+            relay_crypto_init(&circ->crypto, KEY_MATERIAL[0],
+                              sizeof(KEY_MATERIAL[0]), 0, 0));
+  tt_assert(!relay_crypto_pipeline_circ_is_busy(circ));
+
+  crypto_rand((char *)&cell, sizeof(cell));
+  tt_int_op(0, OP_EQ,
+            relay_crypto_pipeline_queue_received(circ, &cell,
+                                                 CELL_DIRECTION_OUT));
+  tt_assert(relay_crypto_pipeline_circ_is_busy(circ));
+  tt_ptr_op(pipeline_work_arg, OP_NE, NULL);
+
+  /* These two wait behind the first one. */
+  tt_int_op(0, OP_EQ,
+            relay_crypto_pipeline_queue_received(circ, &cell,
+                                                 CELL_DIRECTION_IN));
+  tt_int_op(0, OP_EQ,
+            relay_crypto_pipeline_queue_originated(circ, &cell, 0));
+  tt_int_op(circ->crypto_pipeline->n_pending, OP_EQ, 2);
+  tt_int_op(circ->crypto_pipeline->job->n_cells, OP_EQ, 1);
+
+  circuit_free_(TO_CIRCUIT(circ));
+  circ = NULL;
+
+  /* The worker can still run, and the reply only frees the job. */
+  tt_int_op(pipeline_work_fn(NULL, pipeline_work_arg), OP_EQ, WQ_RPL_REPLY);
+  pipeline_reply_fn(pipeline_work_arg);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  if (circ)
+    circuit_free_(TO_CIRCUIT(circ));
+  pipeline_work_fn = NULL;
+  pipeline_reply_fn = NULL;
+  pipeline_work_arg = NULL;
+}
+
 #define TEST(name) \
   { # name, test_relaycrypt_ ## name, 0, &relaycrypt_setup, NULL }
 
 struct testcase_t relaycrypt_tests[] = {
   TEST(outbound),
   TEST(inbound),
+  TEST(batch),
+  TEST(pipeline_outbound),
+  TEST(pipeline_inbound),
+  TEST(pipeline_circuit_free),
   END_OF_TESTCASES
 };
 
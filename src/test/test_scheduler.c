@@ -6,6 +6,7 @@
 #include <math.h>
 
 #define SCHEDULER_KIST_PRIVATE
+#define CONNECTION_PRIVATE
 #define CHANNEL_OBJECT_PRIVATE
 #define CHANNEL_FILE_PRIVATE
 #include "core/or/or.h"
@@ -15,6 +16,8 @@
 #include "core/or/channeltls.h"
 #include "core/mainloop/connection.h"
 #include "feature/nodelist/networkstatus.h"
+#include "core/or/or_connection_st.h"
+#include "lib/net/sock_diag.h"
 #define SCHEDULER_PRIVATE
 #include "core/or/scheduler.h"
 
@@ -744,6 +747,7 @@ test_scheduler_loop_kist(void *arg)
 
   channel_t *ch1 = new_fake_channel(), *ch2 = new_fake_channel();
   channel_t *ch3 = new_fake_channel();
+  kist_stats_t stats;
 
   /* setup options so we're sure about what sched we are running */
   MOCK(get_options, mock_get_options);
@@ -791,6 +795,13 @@ test_scheduler_loop_kist(void *arg)
 
   the_scheduler->run();
 
+  /* Every run counted, and looked at the sockets of its pending channels
+   * one at a time. */
+  kist_get_stats(&stats);
+  tt_u64_op(stats.n_runs, OP_EQ, 3);
+  tt_u64_op(stats.n_sock_updates, OP_EQ, 5);
+  tt_u64_op(stats.n_sock_updates_batched, OP_EQ, 0);
+
   channel_flush_some_cells_mock_free_all();
 
   /* We'll try to run this closed channel threw the scheduler loop and make
@@ -1265,6 +1276,98 @@ test_scheduler_kist_pending_list(void *arg)
   UNMOCK(channel_should_write_to_kernel);
 }
 
+static void
+test_scheduler_kist_batched_sampling(void *arg)
+{
+  (void) arg;
+  tor_socket_t listener = TOR_INVALID_SOCKET, client = TOR_INVALID_SOCKET;
+  tor_socket_t server = TOR_INVALID_SOCKET;
+  or_connection_t *orconn = NULL;
+  channel_t *chan = NULL;
+  smartlist_t *pending = smartlist_new();
+  struct sockaddr_in sin;
+  socklen_t sin_len = sizeof(sin);
+  tor_sock_diag_t *diag = NULL;
+  kist_stats_t stats;
+
+#ifndef HAVE_KIST_SUPPORT
+  tt_skip();
+#endif
+  if (!tor_sock_diag_is_supported())
+    tt_skip();
+  /* Make sure that the kernel will answer us at all. */
+  diag = tor_sock_diag_new();
+  if (!diag)
+    tt_skip();
+
+  /* Make a TCP connection over loopback, and put a little data into it so
+   * that the kernel has something to tell us. */
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  tt_assert(SOCKET_OK(listener));
+  tt_int_op(bind(listener, (struct sockaddr *)&sin, sizeof(sin)), OP_EQ, 0);
+  tt_int_op(listen(listener, 1), OP_EQ, 0);
+  tt_int_op(getsockname(listener, (struct sockaddr *)&sin, &sin_len),
+            OP_EQ, 0);
+  client = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  tt_assert(SOCKET_OK(client));
+  tt_int_op(connect(client, (struct sockaddr *)&sin, sizeof(sin)), OP_EQ, 0);
+  server = tor_accept_socket(listener, NULL, NULL);
+  tt_assert(SOCKET_OK(server));
+  tt_int_op(send(client, "hello", 5, 0), OP_EQ, 5);
+
+  MOCK(get_options, mock_get_options);
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 11;
+  mocked_options.KISTBatchedSampling = 1;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+  scheduler_kist_set_full_mode();
+
+  orconn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  TO_CONN(orconn)->s = client;
+  tor_addr_from_ipv4h(&TO_CONN(orconn)->addr, 0x7f000001);
+  client = TOR_INVALID_SOCKET;
+  chan = channel_tls_handle_incoming(orconn);
+  tt_assert(chan);
+  smartlist_add(pending, chan);
+
+  /* With batched sampling, we learn about the socket from the dump. */
+  update_all_socket_info(pending);
+  kist_get_stats(&stats);
+  tt_u64_op(stats.n_sock_updates, OP_EQ, 1);
+  tt_u64_op(stats.n_sock_updates_batched, OP_EQ, 1);
+
+  /* Without it, we ask about the socket directly. */
+  mocked_options.KISTBatchedSampling = 0;
+  the_scheduler->on_new_options();
+  update_all_socket_info(pending);
+  kist_get_stats(&stats);
+  tt_u64_op(stats.n_sock_updates, OP_EQ, 2);
+  tt_u64_op(stats.n_sock_updates_batched, OP_EQ, 1);
+
+ done:
+  tor_sock_diag_free(diag);
+  smartlist_free(pending);
+  if (chan) {
+    channel_unregister(chan);
+    chan->state = CHANNEL_STATE_CLOSED;
+    channel_free(chan);
+  }
+  if (orconn)
+    connection_free_minimal(TO_CONN(orconn));
+  if (SOCKET_OK(client))
+    tor_close_socket(client);
+  if (SOCKET_OK(server))
+    tor_close_socket(server);
+  if (SOCKET_OK(listener))
+    tor_close_socket(listener);
+  scheduler_free_all();
+  UNMOCK(get_options);
+}
+
 struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
@@ -1276,6 +1379,8 @@ struct testcase_t scheduler_tests[] = {
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   { "kist_pending_list", test_scheduler_kist_pending_list, TT_FORK,
     NULL, NULL },
+  { "kist_batched_sampling", test_scheduler_kist_batched_sampling, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
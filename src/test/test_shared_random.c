@@ -1038,7 +1038,7 @@ test_sr_get_majority_srv_from_votes(void *arg)
 
   /* Since it's only one vote with an SRV, it should not achieve majority and
      hence no SRV will be returned. */
-  chosen_srv = get_majority_srv_from_votes(votes, 1);
+  chosen_srv = get_majority_srv_from_votes(votes, 1, 0);
   tt_ptr_op(chosen_srv, OP_EQ, NULL);
 
   { /* Now put in 8 more votes. Let SRV_1 have majority. */
@@ -1063,14 +1063,12 @@ test_sr_get_majority_srv_from_votes(void *arg)
 
   /* Now we achieve majority for SRV_1, but not the AuthDirNumSRVAgreements
      requirement. So still not picking an SRV. */
-  set_num_srv_agreements(8);
-  chosen_srv = get_majority_srv_from_votes(votes, 1);
+  chosen_srv = get_majority_srv_from_votes(votes, 1, 8);
   tt_ptr_op(chosen_srv, OP_EQ, NULL);
 
   /* We will now lower the AuthDirNumSRVAgreements requirement by tweaking the
    * consensus parameter and we will try again. This time it should work. */
-  set_num_srv_agreements(7);
-  chosen_srv = get_majority_srv_from_votes(votes, 1);
+  chosen_srv = get_majority_srv_from_votes(votes, 1, 7);
   tt_assert(chosen_srv);
   tt_u64_op(chosen_srv->num_reveals, OP_EQ, 42);
   tt_mem_op(chosen_srv->value, OP_EQ, SRV_1, sizeof(chosen_srv->value));
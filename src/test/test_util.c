@@ -40,6 +40,7 @@
 #include "lib/encoding/confline.h"
 #include "lib/net/socketpair.h"
 #include "lib/malloc/map_anon.h"
+#include "lib/malloc/mempool.h"
 
 #ifdef HAVE_PWD_H
 #include <pwd.h>
@@ -6865,6 +6866,100 @@ test_util_map_anon(void *arg)
   tor_munmap_anonymous(ptr, sz);
 }
 
+static void
+test_util_mempool(void *arg)
+{
+  (void)arg;
+  mp_pool_t *pool = NULL;
+  mp_pool_stats_t st;
+  smartlist_t *items = smartlist_new();
+  char *big = NULL;
+  int i, per_chunk;
+
+  pool = mp_pool_new(530, 16384);
+  mp_pool_get_stats(pool, &st);
+  tt_int_op(st.item_cost % 64, OP_EQ, 0);
+  tt_int_op(st.item_cost, OP_EQ, mp_pool_item_cost(530));
+  tt_int_op(st.item_cost, OP_GE, 530);
+  tt_int_op(st.n_chunks, OP_EQ, 0);
+
+  /* Fill a bit more than one chunk. */
+  char *first = mp_pool_get(pool);
+  mp_pool_get_stats(pool, &st);
+  per_chunk = (int) st.n_items_free + 1;
+  tt_int_op(per_chunk, OP_GE, 8);
+  tt_int_op(((uintptr_t)first) % 64, OP_EQ, 0);
+  smartlist_add(items, first);
+  for (i = 1; i < per_chunk + 3; ++i) {
+    char *item = mp_pool_get(pool);
+    tt_int_op(((uintptr_t)item) % 64, OP_EQ, 0);
+    memset(item, i, 530);
+    smartlist_add(items, item);
+  }
+  mp_pool_get_stats(pool, &st);
+  tt_int_op(st.n_chunks, OP_EQ, 2);
+  tt_int_op(st.n_items_used, OP_EQ, per_chunk + 3);
+  tt_int_op(st.n_items_free, OP_EQ, per_chunk - 3);
+
+  /* Items don't overlap. */
+  for (i = 1; i < per_chunk + 3; ++i) {
+    const char *item = smartlist_get(items, i);
+    tt_int_op(item[0], OP_EQ, (char)i);
+    tt_int_op(item[529], OP_EQ, (char)i);
+  }
+
+  /* A released item is the next one we hand out. */
+  char *again = smartlist_get(items, 5);
+  mp_pool_release(again);
+  tt_ptr_op(mp_pool_get(pool), OP_EQ, again);
+
+  /* Release everything: both chunks become empty, and cleaning with
+   * keep_recently_used keeps them, since we used them in this interval. */
+  SMARTLIST_FOREACH(items, char *, item, mp_pool_release(item));
+  smartlist_clear(items);
+  mp_pool_get_stats(pool, &st);
+  tt_int_op(st.n_items_used, OP_EQ, 0);
+  tt_int_op(st.n_empty_chunks, OP_EQ, 2);
+  mp_pool_clean(pool, 0, 1);
+  mp_pool_get_stats(pool, &st);
+  tt_int_op(st.n_chunks, OP_EQ, 2);
+
+  /* Now they've been idle for a whole interval, so they go. */
+  mp_pool_clean(pool, 0, 1);
+  mp_pool_get_stats(pool, &st);
+  tt_int_op(st.n_chunks, OP_EQ, 0);
+  tt_int_op(st.n_bytes_mapped, OP_EQ, 0);
+
+  /* Explicitly keeping some. */
+  smartlist_add(items, mp_pool_get(pool));
+  mp_pool_release(smartlist_pop_last(items));
+  mp_pool_clean(pool, 1, 0);
+  mp_pool_get_stats(pool, &st);
+  tt_int_op(st.n_chunks, OP_EQ, 1);
+  mp_pool_clean(pool, 0, 0);
+  mp_pool_get_stats(pool, &st);
+  tt_int_op(st.n_chunks, OP_EQ, 0);
+
+  /* Oversized items come from the heap, and release the same way. */
+  big = mp_pool_get_sized(pool, 4096);
+  memset(big, 'x', 4096);
+  mp_pool_get_stats(pool, &st);
+  tt_int_op(st.n_chunks, OP_EQ, 0);
+  tt_int_op(st.n_items_used, OP_EQ, 0);
+  mp_pool_release(big);
+  big = mp_pool_get_sized(pool, 100);
+  mp_pool_get_stats(pool, &st);
+  tt_int_op(st.n_items_used, OP_EQ, 1);
+  mp_pool_release(big);
+
+  /* Destroying a pool with items in use frees them too. */
+  smartlist_add(items, mp_pool_get(pool));
+
+ done:
+  mp_pool_destroy(pool);
+  smartlist_free(items);
+}
+
 static void
 test_util_map_anon_nofork(void *arg)
 {
@@ -7099,5 +7194,6 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(log_mallinfo, 0),
   UTIL_TEST(map_anon, 0),
   UTIL_TEST(map_anon_nofork, 0),
+  UTIL_TEST(mempool, 0),
   END_OF_TESTCASES
 };
@@ -13,6 +13,7 @@
 #include "lib/evloop/compat_libevent.h"
 #include "lib/intmath/weakrng.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/time/compat_time.h"
 
 #include <stdio.h>
 
@@ -25,6 +26,10 @@ static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
 static int opt_n_cancel = 0;
 static int opt_ratio_rsa = 5;
+static int opt_max_batch = 0;
+static int opt_coalesce_usec = 0;
+static int opt_pause_msec = 0;
+static int opt_update = 0;
 
 #ifdef TRACK_RESPONSES
 tor_mutex_t bitmap_mutex;
@@ -35,6 +40,7 @@ bitarray_t *handled;
 typedef struct state_t {
   int magic;
   int n_handled;
+  int n_updates;
   crypto_pk_t *rsa;
   curve25519_secret_key_t ecdh;
   int is_shutdown;
@@ -122,6 +128,16 @@ workqueue_do_ecdh(void *state, void *work)
   return WQ_RPL_REPLY;
 }
 
+static workqueue_reply_t
+workqueue_do_update(void *state, void *work)
+{
+  state_t *st = state;
+  (void)work;
+  tor_assert(st->magic == 13371337);
+  ++st->n_updates;
+  return WQ_RPL_REPLY;
+}
+
 static workqueue_reply_t
 workqueue_shutdown_error(void *state, void *work)
 {
@@ -169,6 +185,30 @@ static int no_shutdown = 0;
 bitarray_t *received;
 #endif
 
+/** What happened to each item of work, indexed by serial. */
+typedef enum {
+  OUTCOME_NONE = 0,
+  OUTCOME_REPLIED,
+  OUTCOME_CANCELLED,
+} outcome_t;
+static uint8_t *outcomes = NULL;
+/** Number of items that ended more than once, or never. */
+static int n_bad_outcomes = 0;
+
+/** Record that the item with <b>serial</b> ended with <b>outcome</b>. Each
+ * item must end exactly once. */
+static void
+note_outcome(int serial, outcome_t outcome)
+{
+  tor_assert(serial >= 0 && serial < opt_n_items);
+  if (outcomes[serial] != OUTCOME_NONE) {
+    printf("Item %d ended twice (%d, then %d)\n",
+           serial, outcomes[serial], (int) outcome);
+    ++n_bad_outcomes;
+  }
+  outcomes[serial] = outcome;
+}
+
 static void
 handle_reply(void *arg)
 {
@@ -178,6 +218,8 @@ handle_reply(void *arg)
   bitarray_set(received,rw->serial);
 #endif
 
+  /* Naughty cast, but only looking at serial. */
+  note_outcome(((rsa_work_t *) arg)->serial, OUTCOME_REPLIED);
   tor_free(arg);
   ++n_received;
 }
@@ -231,6 +273,11 @@ add_n_work_items(threadpool_t *tp, int n)
   to_cancel = tor_calloc(opt_n_cancel, sizeof(workqueue_entry_t*));
 
   while (n_queued++ < n) {
+    if (opt_update && n_queued == n / 2 + 1) {
+      /* Put an update in the middle of the batch, so that the workers have
+       * to run it between the items they steal from one another. */
+      threadpool_queue_update(tp, NULL, workqueue_do_update, NULL, NULL);
+    }
     ent = add_work(tp);
     if (! ent) {
       puts("Z");
@@ -254,6 +301,8 @@ add_n_work_items(threadpool_t *tp, int n)
       n_failed_cancel++;
     } else {
       n_successful_cancel++;
+      /* Naughty cast, but only looking at serial. */
+      note_outcome(((rsa_work_t *) work)->serial, OUTCOME_CANCELLED);
       tor_free(work);
     }
   }
@@ -329,6 +378,12 @@ help(void)
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
+     "  -B <batch>    Handle no more than this many replies at a time\n"
+     "  -W <usec>     Hold off reply alerts for this long when we're busy\n"
+     "  -P <msec>     Pause this long before handling any replies, and check\n"
+     "                that some of them overflowed their reply rings\n"
+     "  -U            Queue an update in the middle of every batch, and\n"
+     "                check that the workers stole work from one another\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
      "                Disable one of the alert_socket backends.");
 }
@@ -357,6 +412,14 @@ main(int argc, char **argv)
       opt_ratio_rsa = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-C") && i+1<argc) {
       opt_n_cancel = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-B") && i+1<argc) {
+      opt_max_batch = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-W") && i+1<argc) {
+      opt_coalesce_usec = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-P") && i+1<argc) {
+      opt_pause_msec = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-U")) {
+      opt_update = 1;
     } else if (!strcmp(argv[i], "--no-eventfd2")) {
       as_flags |= ASOCKS_NOEVENTFD2;
     } else if (!strcmp(argv[i], "--no-eventfd")) {
@@ -379,7 +442,8 @@ main(int argc, char **argv)
   if (opt_n_threads < 1 ||
       opt_n_items < 1 || opt_n_inflight < 1 || opt_n_lowwater < 0 ||
       opt_n_cancel > opt_n_inflight || opt_n_inflight > MAX_INFLIGHT ||
-      opt_ratio_rsa < 0) {
+      opt_ratio_rsa < 0 || opt_max_batch < 0 || opt_coalesce_usec < 0 ||
+      opt_pause_msec < 0) {
     help();
     return 1;
   }
@@ -404,9 +468,11 @@ main(int argc, char **argv)
     return 77; // 77 means "skipped".
 
   tor_assert(rq);
+  replyqueue_set_max_batch(rq, opt_max_batch);
   tp = threadpool_new(opt_n_threads,
                       rq, new_state, free_state, NULL);
   tor_assert(tp);
+  threadpool_set_reply_coalesce_usec(tp, (uint32_t) opt_coalesce_usec);
 
   crypto_seed_weak_rng(&weak_rng);
 
@@ -425,6 +491,7 @@ main(int argc, char **argv)
   tor_mutex_init(&bitmap_mutex);
   handled_len = opt_n_items;
 #endif /* defined(TRACK_RESPONSES) */
+  outcomes = tor_malloc_zero(opt_n_items);
 
   for (i = 0; i < opt_n_inflight; ++i) {
     if (! add_work(tp)) {
@@ -433,6 +500,10 @@ main(int argc, char **argv)
     }
   }
 
+  /* Let the replies pile up past what the workers' rings can hold. */
+  if (opt_pause_msec)
+    tor_sleep_msec(opt_pause_msec);
+
   {
     struct timeval limit = { 180, 0 };
     tor_libevent_exit_loop_after_delay(tor_libevent_get_base(), &limit);
@@ -440,11 +511,41 @@ main(int argc, char **argv)
 
   tor_libevent_run_event_loop(tor_libevent_get_base(), 0);
 
+  replyqueue_stats_t stats;
+  replyqueue_get_stats(rq, &stats);
+  if (opt_verbose) {
+    printf("%"PRIu64" alerts, %"PRIu64" wakeups, %"PRIu64" full batches, "
+           "%"PRIu64" replies, %"PRIu64" overflows, %"PRIu64" stolen\n",
+           stats.n_alerts, stats.n_wakeups, stats.n_full_batches,
+           stats.n_replies, stats.n_overflows, threadpool_get_n_stolen(tp));
+    printf("Reply latency: median %"PRIu64" usec, 99%% %"PRIu64" usec\n",
+           replyqueue_stats_latency_usec(&stats, 0.5),
+           replyqueue_stats_latency_usec(&stats, 0.99));
+  }
+
+  for (i = 0; i < n_sent; ++i) {
+    if (outcomes[i] == OUTCOME_NONE) {
+      printf("Item %d never ended\n", i);
+      ++n_bad_outcomes;
+    }
+  }
+
   if (n_sent != opt_n_items || n_received+n_successful_cancel != n_sent) {
     printf("%d vs %d\n", n_sent, opt_n_items);
     printf("%d+%d vs %d\n", n_received, n_successful_cancel, n_sent);
     puts("FAIL");
     return 1;
+  } else if (n_bad_outcomes) {
+    puts("FAIL");
+    return 1;
+  } else if (opt_pause_msec && stats.n_overflows == 0) {
+    puts("No reply overflowed its ring");
+    puts("FAIL");
+    return 1;
+  } else if (opt_update && threadpool_get_n_stolen(tp) == 0) {
+    puts("No work was stolen");
+    puts("FAIL");
+    return 1;
   } else if (no_shutdown) {
     puts("Accepted work after shutdown\n");
     puts("FAIL");
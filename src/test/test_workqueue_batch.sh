@@ -0,0 +1,3 @@
+#!/bin/sh
+
+"${builddir:-.}/src/test/test_workqueue" -B 3 -W 200
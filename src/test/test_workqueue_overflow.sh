@@ -0,0 +1,3 @@
+#!/bin/sh
+
+"${builddir:-.}/src/test/test_workqueue" -N 20000 -I 10000 -P 1000
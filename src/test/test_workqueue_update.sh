@@ -0,0 +1,3 @@
+#!/bin/sh
+
+"${builddir:-.}/src/test/test_workqueue" -C 10 -U